@@ -9,6 +9,70 @@
 
 namespace muscle {
  
+/** Describes one contiguous block of bytes to be written out by DataIO::WriteGather(). */
+class ConstIOVec
+{
+public:
+   /** Default constructor.  Describes an empty block. */
+   ConstIOVec() : _bytes(NULL), _numBytes(0) {/* empty */}
+
+   /** Constructor.
+     * @param bytes Pointer to the first byte of the block.
+     * @param numBytes Number of bytes in the block.
+     */
+   ConstIOVec(const void * bytes, uint32 numBytes) : _bytes(bytes), _numBytes(numBytes) {/* empty */}
+
+   /** Returns a pointer to the first byte of the block. */
+   const void * GetBytes() const {return _bytes;}
+
+   /** Returns the number of bytes in the block. */
+   uint32 GetNumBytes() const {return _numBytes;}
+
+private:
+   const void * _bytes;
+   uint32 _numBytes;
+};
+
+class IPAddressAndPort;  // defined in util/NetworkUtilityFunctions.h
+
+/** Describes one datagram to be received by DataIO::ReadPackets(), or sent by DataIO::WritePackets(). */
+class PacketIOVec
+{
+public:
+   /** Default constructor.  Describes an empty datagram with no address. */
+   PacketIOVec() : _bytes(NULL), _numBytes(0), _optAddress(NULL) {/* empty */}
+
+   /** Constructor.
+     * @param bytes Pointer to the datagram's bytes, or (for ReadPackets()) to the buffer to receive the datagram into.
+     * @param numBytes Number of bytes in the datagram, or (for ReadPackets()) the size of the buffer.
+     * @param optAddress For ReadPackets(), if non-NULL, the address the datagram came from will be written here.
+     *                   For WritePackets(), if non-NULL, this is the address to send the datagram to;
+     *                   if NULL, the datagram is sent wherever Write() would have sent it.
+     */
+   PacketIOVec(void * bytes, uint32 numBytes, IPAddressAndPort * optAddress = NULL) : _bytes(bytes), _numBytes(numBytes), _optAddress(optAddress) {/* empty */}
+
+   /** Returns a pointer to the datagram's bytes. */
+   void * GetBytes() const {return _bytes;}
+
+   /** Returns the number of bytes in the datagram.  After a successful ReadPackets() call,
+     * this is the size of the received datagram rather than the size of the buffer.
+     */
+   uint32 GetNumBytes() const {return _numBytes;}
+
+   /** Sets the number of bytes in the datagram.  Called by ReadPackets() implementations.
+     * @param numBytes The new byte-count.
+     */
+   void SetNumBytes(uint32 numBytes) {_numBytes = numBytes;}
+
+   /** Returns the address this datagram came from or is going to, or NULL if no address was specified. */
+   IPAddressAndPort * GetAddress() const {return _optAddress;}
+
+private:
+   void * _bytes;
+   uint32 _numBytes;
+   IPAddressAndPort * _optAddress;
+};
+
 /** Abstract base class for a byte-stream Data I/O interface, similar to Be's BDataIO.  */
 class DataIO : public RefCountable, private CountedObject<DataIO>
 {
@@ -46,6 +110,42 @@ public:
     */
    virtual int32 Write(const void * buffer, uint32 size) = 0;
 
+   /** Pushes the bytes of several separate blocks into the outgoing I/O stream, in order,
+    *  as if they had been concatenated into one buffer and passed to Write().  Subclasses
+    *  that can do this without copying the bytes (e.g. via writev()) should override this
+    *  method; the default implementation just calls Write() for each block in turn, and
+    *  stops at the first block that isn't written in full.
+    *  @param blocks Array of blocks to write out.
+    *  @param numBlocks Number of items in the (blocks) array.
+    *  @return Number of bytes written, or -1 on error.  Note that this may be less than the
+    *          total size of the blocks, in which case the caller should try again later to
+    *          write out the remaining bytes.
+    */
+   virtual int32 WriteGather(const ConstIOVec * blocks, uint32 numBlocks);
+
+   /** Receives as many as (numPackets) datagrams at once.  Subclasses that do packet-style I/O
+    *  and can receive several datagrams with a single system call (e.g. via recvmmsg()) should
+    *  override this method; the default implementation just calls Read() once per packet,
+    *  stopping when Read() returns zero, and sets each packet's address to IPAddressAndPort().
+    *  @param packets Array of packets to receive into.  Each packet's buffer size should be at
+    *                 least GetPacketMaximumSize() bytes; on return, each received packet's byte-count
+    *                 is set to the size of its datagram.
+    *  @param numPackets Number of items in the (packets) array.
+    *  @return Number of packets received (zero if none were available), or -1 on error.
+    */
+   virtual int32 ReadPackets(PacketIOVec * packets, uint32 numPackets);
+
+   /** Sends as many as (numPackets) datagrams at once, in order.  Subclasses that do packet-style
+    *  I/O and can send several datagrams with a single system call (e.g. via sendmmsg()) should
+    *  override this method; the default implementation just calls Write() once per packet,
+    *  and stops at the first packet that isn't written in full.
+    *  @param packets Array of packets to send.
+    *  @param numPackets Number of items in the (packets) array.
+    *  @return Number of packets sent, or -1 on error.  Note that this may be less than (numPackets),
+    *          in which case the caller should try again later to send the remaining packets.
+    */
+   virtual int32 WritePackets(const PacketIOVec * packets, uint32 numPackets);
+
    /**
     * Seek to a given position in the I/O stream.  
     * May not be supported by a DataIO subclass, in 
@@ -88,6 +88,10 @@ public:
 
    virtual int32 Read(void *buffer, uint32 size);
    virtual int32 Write(const void *buffer, uint32 size);
+
+   /** Overridden to call DataIO::WriteGather(), so that each block goes through Write() and gets encrypted. */
+   virtual int32 WriteGather(const ConstIOVec * blocks, uint32 numBlocks) {return DataIO::WriteGather(blocks, numBlocks);}
+
    virtual void Shutdown();
 
 private:
@@ -43,6 +43,12 @@ public:
    virtual int32 Read(void * buffer, uint32 size) {return ReceiveData(_sock, buffer, size, _blocking);}
    virtual int32 Write(const void * buffer, uint32 size) {return SendData(_sock, buffer, size, _blocking);}
 
+   /** Overridden to send all of the blocks with a single system call, via SendDataGather().
+     * Note that subclasses that override Write() to transform the outgoing bytes must
+     * override this method too (e.g. to call DataIO::WriteGather() instead).
+     */
+   virtual int32 WriteGather(const ConstIOVec * blocks, uint32 numBlocks) {return SendDataGather(_sock, blocks, numBlocks, _blocking);}
+
    /**
     *  This method implementation always returns B_ERROR, because you can't seek on a socket!
     */
@@ -23,7 +23,7 @@ public:
     *  If you will be using this object with a AbstractMessageIOGateway,
     *  and/or select(), then it's usually better to set blocking to false.
     */
-   UDPSocketDataIO(const ConstSocketRef & sock, bool blocking) : _sock(sock), _maxPacketSize(MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET)
+   UDPSocketDataIO(const ConstSocketRef & sock, bool blocking) : _sock(sock), _maxPacketSize(MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET), _numDestinationsDone(0)
    {
       (void) SetBlockingIOEnabled(blocking);
       _sendTo.AddTail();  // so that by default, Write() will just call send() on our socket
@@ -47,15 +47,79 @@ public:
       return ret;
    }
 
+   /** Sends the given data to each of our send-destinations.  If it couldn't be sent to all of them,
+     * then the next call is assumed to be a retry of the same data, and so it won't be sent again to
+     * the destinations that already got it.
+     */
    virtual int32 Write(const void * buffer, uint32 size) 
    {
       int32 ret = 0;
-      for (uint32 i=0; i<_sendTo.GetNumItems(); i++)
+      for (uint32 i=_numDestinationsDone; i<_sendTo.GetNumItems(); i++)
       {
          const IPAddressAndPort & iap = _sendTo[i];
          int32 r = SendDataUDP(_sock, buffer, size, _blocking, iap.GetIPAddress(), iap.GetPort());
          if (r < (int32)size) return r;
                          else ret = r;
+         _numDestinationsDone++;
+      }
+      _numDestinationsDone = 0;
+      return ret;
+   }
+
+   /** Overridden to receive several packets with a single system call, where possible.
+     * Each packet's address (if any) is set to the packet's source, and GetSourceOfLastReadPacket()
+     * will return the source of the last packet received.
+     */
+   virtual int32 ReadPackets(PacketIOVec * packets, uint32 numPackets)
+   {
+      int32 ret = ReceivePacketsUDP(_sock, packets, numPackets, _blocking);
+      if ((ret > 0)&&(packets[ret-1].GetAddress())) _recvFrom = *packets[ret-1].GetAddress();
+      return ret;
+   }
+
+   /** Overridden to send several packets with a single system call, where possible.
+     * Packets that have no address are sent to each of our send-destinations, just as Write() would do.
+     * As with Write(), if such a packet is sent to only some of our send-destinations, it isn't counted
+     * as sent, and the next call is assumed to start with the same packet, which will then be sent only
+     * to the destinations that didn't get it yet.
+     */
+   virtual int32 WritePackets(const PacketIOVec * packets, uint32 numPackets)
+   {
+      // If the first packet was already sent to some of our destinations by a previous call, skip those this time
+      const uint32 numToSkip = ((numPackets > 0)&&(packets[0].GetAddress() == NULL)) ? muscleMin(_numDestinationsDone, _sendTo.GetNumItems()) : 0;
+
+      _scratchPackets.Clear();
+      for (uint32 i=0; i<numPackets; i++)
+      {
+         const PacketIOVec & p = packets[i];
+         if (p.GetAddress()) {if (_scratchPackets.AddTail(p) != B_NO_ERROR) return -1;}
+         else for (uint32 j=(i==0)?numToSkip:0; j<_sendTo.GetNumItems(); j++) if (_scratchPackets.AddTail(PacketIOVec(p.GetBytes(), p.GetNumBytes(), &_sendTo[j])) != B_NO_ERROR) return -1;
+      }
+      _scratchPackets.Normalize();  // so that we can pass the packets as an array
+
+      uint32 numSent = 0;
+      while(numSent < _scratchPackets.GetNumItems())
+      {
+         int32 r = SendPacketsUDP(_sock, _scratchPackets.HeadPointer()+numSent, _scratchPackets.GetNumItems()-numSent, _blocking);
+         if (r < 0) {if (numSent == 0) return -1; else break;}  // report the error on the next call, if we already sent some packets
+         if (r == 0) break;  // no more buffer space, for now
+         numSent += r;
+      }
+
+      // Return the number of packets that went out to all of their destinations, and remember how far we got with the next one
+      int32 ret = 0;
+      _numDestinationsDone = 0;
+      for (uint32 i=0; i<numPackets; i++)
+      {
+         const uint32 numAlreadySent = (i==0) ? numToSkip : 0;
+         const uint32 numCopies      = packets[i].GetAddress() ? 1 : (_sendTo.GetNumItems()-numAlreadySent);
+         if (numCopies > numSent)
+         {
+            if (packets[i].GetAddress() == NULL) _numDestinationsDone = numAlreadySent+numSent;
+            break;
+         }
+         numSent -= numCopies;
+         ret++;
       }
       return ret;
    }
@@ -95,7 +159,7 @@ public:
      * destination address and port.  Calling this with (invalidIP, 0) will
      * revert us to our default behavior of just calling() send on our UDP socket.
      */
-   void SetSendDestination(const IPAddressAndPort & dest) {(void) _sendTo.EnsureSize(1, true); _sendTo.Head() = dest;}
+   void SetSendDestination(const IPAddressAndPort & dest) {(void) _sendTo.EnsureSize(1, true); _sendTo.Head() = dest; _numDestinationsDone = 0;}
 
    /** Returns the IP address and port that Write() will send to, as was
      * previously specified in SetSendDestination().
@@ -103,7 +167,7 @@ public:
    const IPAddressAndPort & GetSendDestination() const {return _sendTo.HasItems() ? _sendTo.Head() : _sendTo.GetDefaultItem();}
 
    /** Call this to make our Write() method use sendto() with the specified destination addresss and ports. */
-   void SetSendDestinations(const Queue<IPAddressAndPort> & dests) {_sendTo = dests;}
+   void SetSendDestinations(const Queue<IPAddressAndPort> & dests) {_sendTo = dests; _numDestinationsDone = 0;}
 
    /** Returns read/write access to our list of send-destinations. */
    Queue<IPAddressAndPort> & GetSendDestinations() {return _sendTo;}
@@ -142,6 +206,9 @@ private:
    IPAddressAndPort _recvFrom;
    Queue<IPAddressAndPort> _sendTo;
    uint32 _maxPacketSize;
+
+   Queue<PacketIOVec> _scratchPackets;  // used by WritePackets()
+   uint32 _numDestinationsDone;         // how many of our send-destinations the last partially-sent packet was sent to
 };
 
 }; // end namespace muscle
@@ -4,17 +4,41 @@
 #include "reflector/StorageReflectConstants.h"  // for PR_COMMAND_PING, PR_RESULT_PONG
 #include "dataio/TCPSocketDataIO.h"
 
+#include <typeinfo>  // for typeid() in IsFlattenedFormatCompatibleWith()
+
 namespace muscle {
 
+static const char * INTERLEAVING_PING_FIELD = "_mioilv";   // in the PR_COMMAND_PING that asks our peer whether it supports interleaving
+static const char * INTERLEAVING_PONG_FIELD = "_mioilva";  // in the PR_RESULT_PONG that says that it does
+static const int32 INTERLEAVING_PROTOCOL_VERSION = 1;
+
+// Each chunk's body starts with its transfer ID, the offset of the chunk within the flattened Message, and the Message's total size
+static const uint32 CHUNK_SUBHEADER_SIZE = 3*sizeof(uint32);
+
 MessageIOGateway :: MessageIOGateway(int32 encoding) :
+   _maxGatherWriteBuffers(MUSCLE_MAX_GATHER_WRITE_BUFFERS),
+   _maxPriority(0),
+   _interleavingEnabled(false),
+   _interleavingProbeEnabled(false),
+   _peerSupportsInterleaving(false),
+   _interleavingChunkSize(MUSCLE_DEFAULT_INTERLEAVING_CHUNK_SIZE),
+   _nextTransferID(0),
+   _incomingChunkedBytes(0),
+   _maxIncomingChunkedMessages(MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES),
+   _maxIncomingChunkedBytes(MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES),
    _maxIncomingMessageSize(MUSCLE_NO_LIMIT),
    _outgoingEncoding(encoding), 
+   _lazyUnflattenEnabled(false),
    _aboutToFlattenCallback(NULL), _aboutToFlattenCallbackData(NULL),
    _flattenedCallback(NULL), _flattenedCallbackData(NULL),
    _unflattenedCallback(NULL), _unflattenedCallbackData(NULL)
 #ifdef MUSCLE_ENABLE_ZLIB_ENCODING
-   , _sendCodec(NULL), _recvCodec(NULL)
+   , _sendCodec(NULL), _recvCodec(NULL), _chunkSendCodec(NULL), _chunkRecvCodec(NULL)
+#endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   , _zstdSendCodec(NULL), _zstdRecvCodec(NULL), _zstdChunkSendCodec(NULL), _zstdChunkRecvCodec(NULL)
 #endif
+   , _flatteningChunkedMessage(false)
    , _syncPingCounter(0), _pendingSyncPingCounter(-1)
 {
    _scratchRecvBuffer.AdoptBuffer(sizeof(_scratchRecvBufferBytes), _scratchRecvBufferBytes);
@@ -27,14 +51,91 @@ MessageIOGateway :: ~MessageIOGateway()
 #ifdef MUSCLE_ENABLE_ZLIB_ENCODING
    delete _sendCodec;
    delete _recvCodec;
+   delete _chunkSendCodec;
+   delete _chunkRecvCodec;
 #endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   delete _zstdSendCodec;
+   delete _zstdRecvCodec;
+   delete _zstdChunkSendCodec;
+   delete _zstdChunkRecvCodec;
+#endif
+}
+
+status_t
+MessageIOGateway ::
+SetPriorityForWhatCode(uint32 whatCode, int32 priority)
+{
+   if (priority == 0) (void) _whatCodePriorities.Remove(whatCode);
+   else if (_whatCodePriorities.Put(whatCode, priority) != B_NO_ERROR) return B_ERROR;
+
+   _maxPriority = 0;  // since Messages with unassigned what-codes have priority 0
+   for (HashtableIterator<uint32, int32> iter(_whatCodePriorities); iter.HasData(); iter++) _maxPriority = muscleMax(_maxPriority, iter.GetValue());
+   return B_NO_ERROR;
+}
+
+// Finds the oldest queued Message that has the highest priority.  Returns false if the queue is empty.
+bool
+MessageIOGateway ::
+FindHighestPriorityQueuedMessage(uint32 & retIndex, int32 & retPriority) const
+{
+   const Queue<MessageRef> & q = GetOutgoingMessageQueue();
+   if (q.IsEmpty()) return false;
+
+   retIndex    = 0;
+   retPriority = q.Head()() ? GetPriorityForWhatCode(q.Head()()->what) : 0;
+   if (_whatCodePriorities.HasItems())  // otherwise every Message has priority 0, so the head Message is the one
+   {
+      // No need to look any further once we've found a Message with the highest possible priority
+      for (uint32 i=1; ((i<q.GetNumItems())&&(retPriority < _maxPriority)); i++)
+      {
+         const Message * msg = q[i]();
+         const int32 priority = msg ? GetPriorityForWhatCode(msg->what) : 0;
+         if (priority > retPriority) {retIndex = i; retPriority = priority;}
+      }
+   }
+   return true;
 }
 
 status_t
 MessageIOGateway ::
 PopNextOutgoingMessage(MessageRef & retMsg)
 {
-   return GetOutgoingMessageQueue().RemoveHead(retMsg);
+   uint32 index;
+   int32 priority;
+   return FindHighestPriorityQueuedMessage(index, priority) ? GetOutgoingMessageQueue().RemoveItemAt(index, retMsg) : B_ERROR;
+}
+
+void
+MessageIOGateway ::
+SetInterleavingEnabled(bool enabled, bool probePeer)
+{
+   _interleavingEnabled      = enabled;
+   _interleavingProbeEnabled = ((enabled)&&(probePeer));
+   _pendingNegotiationMessage.Reset();
+   ScheduleInterleavingProbe();
+}
+
+void
+MessageIOGateway ::
+ScheduleInterleavingProbe()
+{
+   if ((_interleavingProbeEnabled)&&(_peerSupportsInterleaving == false))
+   {
+      MessageRef pingMsg = GetMessageFromPool(PR_COMMAND_PING);
+      if ((pingMsg())&&(pingMsg()->AddInt32(INTERLEAVING_PING_FIELD, INTERLEAVING_PROTOCOL_VERSION) == B_NO_ERROR)) _pendingNegotiationMessage = pingMsg;
+                                                                                                                 else WARN_OUT_OF_MEMORY;
+   }
+}
+
+status_t
+MessageIOGateway ::
+PopNextOutgoingMessageWithBuffer(MessageRef & retMsg, ByteBufferRef & retFlatBuf)
+{
+   if (PopNextOutgoingMessage(retMsg) != B_NO_ERROR) return B_ERROR;
+   retFlatBuf.Reset();
+   if ((retMsg())&&(_preFlattenedBuffers.HasItems())) (void) _preFlattenedBuffers.Remove(retMsg, retFlatBuf);
+   return B_NO_ERROR;
 }
 
 // For this method, B_NO_ERROR means "keep sending", and B_ERROR means "stop sending for now", and isn't fatal to the stream
@@ -58,52 +159,217 @@ MessageIOGateway :: SendMoreData(int32 & sentBytes, uint32 & maxBytes)
    return (numSent < attemptSize) ? B_ERROR : B_NO_ERROR;
 }
 
-int32 
+// Places the bytes of the next frame we should send into (retBuf):  either our pending interleaving-negotiation
+// Message, the next queued Message, or the next chunk of a large Message that we are interleaving.
+// Returns B_ERROR if there is nothing more to send, or if there was an error (in which case we'll also be hosed)
+status_t
 MessageIOGateway ::
-DoOutputImplementation(uint32 maxBytes)
+PopAndFlattenNextOutgoingMessage(ByteBufferRef & retBuf)
 {
-   TCHECKPOINT;
+   bool chunkIt;
+   if (_pendingNegotiationMessage())
+   {
+      retBuf = FlattenHeaderAndMessage(_pendingNegotiationMessage);
+      _pendingNegotiationMessage.Reset();
+      if (retBuf() == NULL) {SetHosed(); return B_ERROR;}
+      return B_NO_ERROR;
+   }
 
-   int32 sentBytes = 0;
-   while((maxBytes > 0)&&(IsHosed() == false))
+   const bool allowChunking = IsInterleavingActive();
+   if ((allowChunking == false)&&(_outgoingChunkedMessages.IsEmpty())) return PopAndFlattenNextQueuedMessage(retBuf, false, chunkIt);
+
+   // A queued Message goes next only if its priority is higher than that of every Message we are part-way through sending
+   int32 maxChunkedPriority = 0;
+   for (uint32 i=0; i<_outgoingChunkedMessages.GetNumItems(); i++) if ((i == 0)||(_outgoingChunkedMessages[i]._priority > maxChunkedPriority)) maxChunkedPriority = _outgoingChunkedMessages[i]._priority;
+
+   uint32 queuedIndex;
+   int32 queuedPriority;
+   if ((FindHighestPriorityQueuedMessage(queuedIndex, queuedPriority))&&((_outgoingChunkedMessages.IsEmpty())||(queuedPriority > maxChunkedPriority)))
    {
-      // First, make sure our outgoing byte-buffer has data.  If it doesn't, fill it with the next outgoing message.
-      if (_sendBuffer._buffer() == NULL)
+      if (PopAndFlattenNextQueuedMessage(retBuf, allowChunking, chunkIt) == B_NO_ERROR)
       {
-         while(true)
-         {
-            MessageRef nextRef;
-            if (PopNextOutgoingMessage(nextRef) != B_NO_ERROR) 
-            {
-               if ((GetFlushOnEmpty())&&(sentBytes > 0)) GetDataIO()()->FlushOutput();
-               return sentBytes;  // nothing more to send, so we're done!
-            }
+         if (chunkIt == false) return B_NO_ERROR;
+         if (_outgoingChunkedMessages.AddTail(OutgoingChunkedMessage(retBuf, _nextTransferID++, queuedPriority)) != B_NO_ERROR) {SetHosed(); return B_ERROR;}
+      }
+      else if (IsHosed()) return B_ERROR;
+   }
 
-            const Message * nextSendMsg = nextRef();
-            if (nextSendMsg)
-            {
-               if (_aboutToFlattenCallback) _aboutToFlattenCallback(nextRef, _aboutToFlattenCallbackData);
+   if (_outgoingChunkedMessages.IsEmpty()) return B_ERROR;  // nothing more to send
+   retBuf = GetNextOutgoingChunk();
+   if (retBuf() == NULL) {SetHosed(); return B_ERROR;}
+   return B_NO_ERROR;
+}
+
+// Pops the next Message from our outgoing-Messages queue and places its flattened bytes into (retBuf).
+// If (allowChunking) is true and the Message is too large to send in one chunk, it will be flattened
+// for sending as chunks, and (retChunkIt) will be set to true.
+// Returns B_ERROR if there are no more Messages to send, or if there was an error (in which case we'll also be hosed)
+status_t
+MessageIOGateway ::
+PopAndFlattenNextQueuedMessage(ByteBufferRef & retBuf, bool allowChunking, bool & retChunkIt)
+{
+   while(true)
+   {
+      MessageRef nextRef;
+      ByteBufferRef preFlattenedBuf;
+      if (PopNextOutgoingMessageWithBuffer(nextRef, preFlattenedBuf) != B_NO_ERROR) return B_ERROR;  // nothing more to send
 
-               _sendBuffer._offset = 0;
-               _sendBuffer._buffer = FlattenHeaderAndMessage(nextRef);
-               if (_sendBuffer._buffer() == NULL) {SetHosed(); return -1;}
+      const Message * nextSendMsg = nextRef();
+      if (nextSendMsg)
+      {
+         if (_aboutToFlattenCallback) 
+         {
+            _aboutToFlattenCallback(nextRef, _aboutToFlattenCallbackData);
+            preFlattenedBuf.Reset();  // since the callback may have modified the Message
+         }
+
+         // If we're already sending too many chunked Messages, this one (which outranks them all) is simply sent whole
+         const uint32 flatSize = preFlattenedBuf() ? preFlattenedBuf()->GetNumBytes() : (GetHeaderSize()+nextSendMsg->FlattenedSize());
+         retChunkIt = ((allowChunking)&&(flatSize > _interleavingChunkSize)&&(CanStartOutgoingChunkedMessage(flatSize)));
+         // Our peer may finish receiving a chunked Message after Messages that we flatten later, so it gets
+         // compressed independently, and with its own codec, so that our main compression stream's state isn't disturbed
+         if (retChunkIt) {SwapChunkCodecs(true); _flatteningChunkedMessage = true;}
+         retBuf = preFlattenedBuf() ? preFlattenedBuf : FlattenHeaderAndMessage(nextRef);
+         if (retChunkIt) {SwapChunkCodecs(true); _flatteningChunkedMessage = false;}
+         if (retBuf() == NULL) {SetHosed(); return B_ERROR;}
 
-               if (_flattenedCallback) _flattenedCallback(nextRef, _flattenedCallbackData);
+         if (_flattenedCallback) _flattenedCallback(nextRef, _flattenedCallbackData);
 
 #ifdef DELIBERATELY_INJECT_ERRORS_INTO_OUTGOING_MESSAGE_FOR_TESTING_ONLY_DONT_ENABLE_THIS_UNLESS_YOU_LIKE_CHAOS
  uint32 hs    = GetHeaderSize();
- uint32 bs    = _sendBuffer._buffer()->GetNumBytes() - hs;
+ uint32 bs    = retBuf()->GetNumBytes() - hs;
  uint32 start = rand()%bs;
  uint32 end   = (start+5)%bs;
  if (start > end) muscleSwap(start, end);
  printf("Bork! %u->%u\n", start, end);
- for (uint32 i=start; i<=end; i++) _sendBuffer._buffer()->GetBuffer()[i+hs] = (uint8) (rand()%256);
+ for (uint32 i=start; i<=end; i++) retBuf()->GetBuffer()[i+hs] = (uint8) (rand()%256);
 #endif
 
-               break;  // now go on to the sending phase
-            }
+         return IsHosed() ? B_ERROR : B_NO_ERROR;  // in case our callbacks called SetHosed()
+      }
+   }
+}
+
+// Returns true iff we can start sending a (flatSize)-byte Message as chunks without going past the limits our peer
+// holds us to (by default) in HandleIncomingChunk()
+bool
+MessageIOGateway ::
+CanStartOutgoingChunkedMessage(uint32 flatSize) const
+{
+   if (_outgoingChunkedMessages.IsEmpty()) return true;
+   if (_outgoingChunkedMessages.GetNumItems() >= MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES) return false;
+
+   uint64 totalBytes = flatSize;
+   for (uint32 i=0; i<_outgoingChunkedMessages.GetNumItems(); i++) totalBytes += _outgoingChunkedMessages[i]._buffer()->GetNumBytes();
+   return (totalBytes <= (uint64)MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES);
+}
+
+// Returns a buffer containing the next chunk of the highest-priority Message that we are part-way through
+// sending (or of the oldest such Message, in case of a tie), or a NULL reference on failure (out of memory)
+ByteBufferRef
+MessageIOGateway ::
+GetNextOutgoingChunk()
+{
+   uint32 idx = 0;
+   for (uint32 i=1; i<_outgoingChunkedMessages.GetNumItems(); i++) if (_outgoingChunkedMessages[i]._priority > _outgoingChunkedMessages[idx]._priority) idx = i;
+
+   OutgoingChunkedMessage & ocm = _outgoingChunkedMessages[idx];
+   const uint32 hs         = GetHeaderSize();
+   const uint32 totalSize  = ocm._buffer()->GetNumBytes();
+   const uint32 chunkBytes = muscleMin(_interleavingChunkSize, totalSize-ocm._offset);
+
+   ByteBufferRef ret = GetByteBufferFromPool(hs+CHUNK_SUBHEADER_SIZE+chunkBytes);
+   if (ret())
+   {
+      uint32 * lhb = (uint32 *) ret()->GetBuffer();
+      lhb[0] = B_HOST_TO_LENDIAN_INT32(CHUNK_SUBHEADER_SIZE+chunkBytes);
+      lhb[1] = B_HOST_TO_LENDIAN_INT32(MUSCLE_MESSAGE_ENCODING_CHUNK);
+
+      uint32 * sh = (uint32 *) (ret()->GetBuffer()+hs);
+      sh[0] = B_HOST_TO_LENDIAN_INT32(ocm._transferID);
+      sh[1] = B_HOST_TO_LENDIAN_INT32(ocm._offset);
+      sh[2] = B_HOST_TO_LENDIAN_INT32(totalSize);
+      memcpy(ret()->GetBuffer()+hs+CHUNK_SUBHEADER_SIZE, ocm._buffer()->GetBuffer()+ocm._offset, chunkBytes);
+
+      ocm._offset += chunkBytes;
+      if (ocm._offset == totalSize) (void) _outgoingChunkedMessages.RemoveItemAt(idx);
+   }
+   return ret;
+}
+
+// Like SendMoreData(), except that it also flattens up to (_maxGatherWriteBuffers-1) more of our queued
+// Messages, and then sends as many of their bytes as possible via a single call to WriteGather().
+status_t 
+MessageIOGateway :: 
+SendMoreGatheredData(int32 & sentBytes, uint32 & maxBytes)
+{
+   TCHECKPOINT;
+
+   while(_gatherBuffers.GetNumItems()+1 < _maxGatherWriteBuffers)
+   {
+      ByteBufferRef buf;
+      if (PopAndFlattenNextOutgoingMessage(buf) != B_NO_ERROR) break;
+      if (_gatherBuffers.AddTail(buf) != B_NO_ERROR) {SetHosed(); break;}
+      if (_outgoingChunkedMessages.HasItems()) break;  // don't commit to more chunks than necessary, so that high-priority Messages can still preempt them
+   }
+   if (IsHosed()) return B_ERROR;
+
+   ConstIOVec blocks[MUSCLE_MAX_GATHER_WRITE_BUFFERS];
+   uint32 numBlocks   = 0;
+   uint32 attemptSize = 0;
+   for (uint32 i=0; ((i<=_gatherBuffers.GetNumItems())&&(attemptSize < maxBytes)); i++)
+   {
+      const ByteBuffer * bb   = (i==0) ? _sendBuffer._buffer() : _gatherBuffers[i-1]();
+      const uint32 offset     = (i==0) ? _sendBuffer._offset : 0;
+      const uint32 blockBytes = muscleMin(maxBytes-attemptSize, bb->GetNumBytes()-offset);
+      blocks[numBlocks++] = ConstIOVec(bb->GetBuffer()+offset, blockBytes);
+      attemptSize += blockBytes;
+   }
+
+   int32 numSent = GetDataIO()()->WriteGather(blocks, numBlocks);
+   if (numSent < 0) {SetHosed(); return B_ERROR;}
+
+   maxBytes  -= numSent;
+   sentBytes += numSent;
+
+   // Advance past the bytes that were sent, moving on to the next gathered buffer each time one is completed
+   uint32 numLeft = numSent;
+   while(_sendBuffer._buffer())
+   {
+      const uint32 headBytesLeft = _sendBuffer._buffer()->GetNumBytes()-_sendBuffer._offset;
+      if (numLeft < headBytesLeft) 
+      {
+         _sendBuffer._offset += numLeft;
+         break;
+      }
+
+      numLeft -= headBytesLeft;
+      _sendBuffer.Reset();
+      (void) _gatherBuffers.RemoveHead(_sendBuffer._buffer);
+   }
+
+   return (((uint32)numSent) < attemptSize) ? B_ERROR : B_NO_ERROR;
+}
+
+int32 
+MessageIOGateway ::
+DoOutputImplementation(uint32 maxBytes)
+{
+   TCHECKPOINT;
+
+   int32 sentBytes = 0;
+   while((maxBytes > 0)&&(IsHosed() == false))
+   {
+      // First, make sure our outgoing byte-buffer has data.  If it doesn't, fill it with the next outgoing message.
+      if (_sendBuffer._buffer() == NULL)
+      {
+         _sendBuffer._offset = 0;
+         if (PopAndFlattenNextOutgoingMessage(_sendBuffer._buffer) != B_NO_ERROR)
+         {
+            if (IsHosed()) break;
+            if ((GetFlushOnEmpty())&&(sentBytes > 0)) GetDataIO()()->FlushOutput();
+            return sentBytes;  // nothing more to send, so we're done!
          }
-         if (IsHosed()) break;  // in case our callbacks called SetHosed()
       }
 
       // At this point, _sendBuffer._buffer() is guaranteed not to be NULL!
@@ -121,6 +387,10 @@ DoOutputImplementation(uint32 maxBytes)
          else if (numSent < 0) SetHosed();
          else break;
       }
+      else if (_maxGatherWriteBuffers > 1)
+      {
+         if (SendMoreGatheredData(sentBytes, maxBytes) != B_NO_ERROR) break;  // output buffer is temporarily full
+      }
       else
       {
          if (SendMoreData(sentBytes, maxBytes) != B_NO_ERROR) break;  // output buffer is temporarily full
@@ -166,11 +436,7 @@ DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes
             // Finished receiving message bytes... now reconstruct that bad boy!
             MessageRef msg = UnflattenHeaderAndMessage(_recvBuffer._buffer);
             _recvBuffer.Reset();  // reset our state for the next one!
-            if (msg())  // for UDP, unexpected data shouldn't be fatal
-            {
-               if (_unflattenedCallback) _unflattenedCallback(msg, _unflattenedCallbackData);
-               receiver.CallMessageReceivedFromGateway(msg);
-            }
+            if (msg()) DeliverIncomingMessage(receiver, msg);  // for UDP, unexpected data shouldn't be fatal
          }
          else break;
       }
@@ -193,8 +459,10 @@ DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes
             if (_recvBuffer._offset >= hs)  // how about now?
             {
                // Now that we have the full header, parse it and allocate space for the message-body-bytes per its instructions
-               int32 bodySize = GetBodySize(bb->GetBuffer());
-               if ((bodySize >= 0)&&(((uint32)bodySize) <= _maxIncomingMessageSize))
+               const bool isChunk = IsChunkHeader(bb->GetBuffer());
+               int32 bodySize = isChunk ? (int32)(B_LENDIAN_TO_HOST_INT32(((const uint32 *)bb->GetBuffer())[0])) : GetBodySize(bb->GetBuffer());
+               if ((isChunk) ? ((bodySize > (int32)CHUNK_SUBHEADER_SIZE)&&(((uint64)(bodySize-CHUNK_SUBHEADER_SIZE)) <= ((uint64)_maxIncomingMessageSize)+hs))
+                             : ((bodySize >= 0)&&(((uint32)bodySize) <= _maxIncomingMessageSize)))
                {
                   int32 availableBodyBytes = bb->GetNumBytes()-hs;
                   if (bodySize <= availableBodyBytes) (void) bb->SetNumBytes(hs+bodySize, true);  // trim off any extra space we don't need
@@ -222,12 +490,18 @@ DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes
             if ((_recvBuffer._offset < bb->GetNumBytes())&&(ReceiveMoreData(readBytes, maxBytes, bb->GetNumBytes()) != B_NO_ERROR)) break;
             if (_recvBuffer._offset == bb->GetNumBytes())
             {
+               if (IsChunkHeader(bb->GetBuffer()))
+               {
+                  HandleIncomingChunk(receiver, *bb);
+                  _recvBuffer.Reset();  // reset our state for the next one!
+                  continue;
+               }
+
                // Finished receiving message bytes... now reconstruct that bad boy!
                MessageRef msg = UnflattenHeaderAndMessage(_recvBuffer._buffer);
                _recvBuffer.Reset();  // reset our state for the next one!
                if (msg() == NULL) {SetHosed(); break;}
-               if (_unflattenedCallback) _unflattenedCallback(msg, _unflattenedCallbackData);
-               receiver.CallMessageReceivedFromGateway(msg);
+               DeliverIncomingMessage(receiver, msg);
             }
          }
       }
@@ -235,6 +509,91 @@ DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes
    return IsHosed() ? -1 : readBytes;
 }
 
+// Adds the received chunk in (chunkBuf) to the Message it is part of, and passes that Message on once it is complete
+void
+MessageIOGateway ::
+HandleIncomingChunk(AbstractGatewayMessageReceiver & receiver, const ByteBuffer & chunkBuf)
+{
+   const uint32 hs           = GetHeaderSize();
+   const uint32 * sh         = (const uint32 *) (chunkBuf.GetBuffer()+hs);
+   const uint32 transferID   = B_LENDIAN_TO_HOST_INT32(sh[0]);
+   const uint32 offset       = B_LENDIAN_TO_HOST_INT32(sh[1]);
+   const uint32 totalSize    = B_LENDIAN_TO_HOST_INT32(sh[2]);
+   const uint8 * chunkBytes  = chunkBuf.GetBuffer()+hs+CHUNK_SUBHEADER_SIZE;
+   const uint32 numBytes     = chunkBuf.GetNumBytes()-(hs+CHUNK_SUBHEADER_SIZE);
+
+   TransferBuffer * tb = _incomingChunkedMessages.Get(transferID);
+   if (tb == NULL)
+   {
+      // This is the first chunk of a new Message, so it starts with the Message's header
+      if ((offset != 0)||(numBytes < hs)||(totalSize < hs)||(GetBodySize(chunkBytes) != (int32)(totalSize-hs))||((totalSize-hs) > _maxIncomingMessageSize))
+      {
+         LogTime(MUSCLE_LOG_DEBUG, "MessageIOGateway %p:  Invalid first chunk for transfer " UINT32_FORMAT_SPEC " (total size " UINT32_FORMAT_SPEC ")\n", this, transferID, totalSize);
+         SetHosed();
+         return;
+      }
+
+      // We allocate the entire Message's space up front, so limit how much of that our peer can have us holding at once
+      if ((_incomingChunkedMessages.HasItems())&&((_incomingChunkedMessages.GetNumItems() >= _maxIncomingChunkedMessages)||(_incomingChunkedBytes+totalSize > (uint64)_maxIncomingChunkedBytes)))
+      {
+         LogTime(MUSCLE_LOG_DEBUG, "MessageIOGateway %p:  Too many concurrent chunked Messages (" UINT32_FORMAT_SPEC " in progress, totalling " UINT64_FORMAT_SPEC " bytes), refusing transfer " UINT32_FORMAT_SPEC "\n", this, _incomingChunkedMessages.GetNumItems(), _incomingChunkedBytes, transferID);
+         SetHosed();
+         return;
+      }
+
+      tb = _incomingChunkedMessages.PutAndGet(transferID);
+      if (tb) tb->_buffer = GetByteBufferFromPool(totalSize);
+      if ((tb == NULL)||(tb->_buffer() == NULL)) {WARN_OUT_OF_MEMORY; SetHosed(); return;}
+      _incomingChunkedBytes += totalSize;
+   }
+
+   if ((offset != tb->_offset)||(totalSize != tb->_buffer()->GetNumBytes())||(numBytes > totalSize-offset))
+   {
+      LogTime(MUSCLE_LOG_DEBUG, "MessageIOGateway %p:  Unexpected chunk for transfer " UINT32_FORMAT_SPEC " (offset " UINT32_FORMAT_SPEC ", expected " UINT32_FORMAT_SPEC ")\n", this, transferID, offset, tb->_offset);
+      SetHosed();
+      return;
+   }
+
+   memcpy(tb->_buffer()->GetBuffer()+offset, chunkBytes, numBytes);
+   tb->_offset += numBytes;
+   if (tb->_offset == totalSize)
+   {
+      ByteBufferRef buf = tb->_buffer;
+      (void) _incomingChunkedMessages.Remove(transferID);
+      _incomingChunkedBytes -= totalSize;
+
+      SwapChunkCodecs(false);  // chunked Messages are compressed with their own codec; see PopAndFlattenNextQueuedMessage()
+      MessageRef msg = UnflattenHeaderAndMessage(buf);
+      SwapChunkCodecs(false);
+      if (msg()) DeliverIncomingMessage(receiver, msg);
+            else SetHosed();
+   }
+}
+
+// Passes (msg) on to (receiver), unless it is part of the interleaving negotiation, in which case we handle it ourself
+void
+MessageIOGateway ::
+DeliverIncomingMessage(AbstractGatewayMessageReceiver & receiver, const MessageRef & msg)
+{
+   if (_unflattenedCallback) _unflattenedCallback(msg, _unflattenedCallbackData);
+
+   if ((msg()->what == PR_COMMAND_PING)&&(_interleavingEnabled)&&(msg()->HasName(INTERLEAVING_PING_FIELD)))
+   {
+      // Our peer supports interleaving, and wants to know if we do too
+      _peerSupportsInterleaving = true;
+      MessageRef pongMsg = GetMessageFromPool(PR_RESULT_PONG);
+      if ((pongMsg())&&(pongMsg()->AddInt32(INTERLEAVING_PONG_FIELD, INTERLEAVING_PROTOCOL_VERSION) == B_NO_ERROR)) _pendingNegotiationMessage = pongMsg;
+                                                                                                                 else WARN_OUT_OF_MEMORY;
+   }
+   else if ((msg()->what == PR_RESULT_PONG)&&((msg()->HasName(INTERLEAVING_PONG_FIELD))||(msg()->HasName(INTERLEAVING_PING_FIELD))))
+   {
+      // A pong that contains only our ping's field is our own ping, echoed back by a peer that doesn't know about interleaving.
+      // If we haven't enabled interleaving ourself, we ignore the pong, so that a peer can't make us accept chunks we never asked for.
+      if ((_interleavingEnabled)&&(msg()->HasName(INTERLEAVING_PONG_FIELD))) _peerSupportsInterleaving = true;
+   }
+   else receiver.CallMessageReceivedFromGateway(msg);
+}
+
 // For this method, B_NO_ERROR means "We got all the data we had room for", and B_ERROR
 // means "short read".  A real network error will also cause SetHosed() to be called.
 status_t 
@@ -277,6 +636,43 @@ GetCodec(int32 newEncoding, ZLibCodec * & setCodec) const
 }
 #endif
 
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+ZStdCodec * 
+MessageIOGateway ::
+GetZStdCodec(int32 newEncoding, ZStdCodec * & setCodec) const
+{
+   TCHECKPOINT;
+
+   int newLevel;
+        if (muscleInRange(newEncoding, (int32)MUSCLE_MESSAGE_ENCODING_ZSTD_1,      (int32)MUSCLE_MESSAGE_ENCODING_ZSTD_19))     newLevel =   (newEncoding-MUSCLE_MESSAGE_ENCODING_ZSTD_1)+1;
+   else if (muscleInRange(newEncoding, (int32)MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1, (int32)MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_9)) newLevel = -((newEncoding-MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1)+1);
+   else return NULL;
+
+   if ((setCodec == NULL)||(newLevel != setCodec->GetCompressionLevel()))
+   {
+      delete setCodec;  // oops, encoding change!  Throw out the old codec, if any
+      setCodec = newnothrow ZStdCodec(newLevel);
+      if (setCodec == NULL) WARN_OUT_OF_MEMORY;
+   }
+   return setCodec;
+}
+#endif
+
+void
+MessageIOGateway ::
+SwapChunkCodecs(bool outgoing)
+{
+#ifdef MUSCLE_ENABLE_ZLIB_ENCODING
+   if (outgoing) muscleSwap(_sendCodec, _chunkSendCodec);
+            else muscleSwap(_recvCodec, _chunkRecvCodec);
+#endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   if (outgoing) muscleSwap(_zstdSendCodec, _zstdChunkSendCodec);
+            else muscleSwap(_zstdRecvCodec, _zstdChunkRecvCodec);
+#endif
+   (void) outgoing;  // avoid a compiler warning when no compression is compiled in
+}
+
 ByteBufferRef 
 MessageIOGateway ::
 FlattenHeaderAndMessage(const MessageRef & msgRef) const
@@ -300,7 +696,7 @@ FlattenHeaderAndMessage(const MessageRef & msgRef) const
             ZLibCodec * enc = GetCodec(_outgoingEncoding, _sendCodec);
             if (enc)
             {
-               ByteBufferRef compressedRef = enc->Deflate(ret()->GetBuffer()+hs, ret()->GetNumBytes()-hs, AreOutgoingMessagesIndependent(), hs);
+               ByteBufferRef compressedRef = enc->Deflate(ret()->GetBuffer()+hs, ret()->GetNumBytes()-hs, ((_flatteningChunkedMessage)||(AreOutgoingMessagesIndependent())), hs);
                if (compressedRef())
                {
                   encoding = MUSCLE_MESSAGE_ENCODING_ZLIB_1+enc->GetCompressionLevel()-1;
@@ -311,6 +707,24 @@ FlattenHeaderAndMessage(const MessageRef & msgRef) const
          }
 #endif
 
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+         if ((ret())&&(ret()->GetNumBytes() >= 32))
+         {
+            ZStdCodec * enc = GetZStdCodec(_outgoingEncoding, _zstdSendCodec);
+            if (enc)
+            {
+               ByteBufferRef compressedRef = enc->Compress(ret()->GetBuffer()+hs, ret()->GetNumBytes()-hs, ((_flatteningChunkedMessage)||(AreOutgoingMessagesIndependent())), hs);
+               if (compressedRef())
+               {
+                  const int level = enc->GetCompressionLevel();
+                  encoding = (level > 0) ? (MUSCLE_MESSAGE_ENCODING_ZSTD_1+level-1) : (MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1-level-1);
+                  ret = compressedRef;
+               }
+               else ret.Reset();  // uh oh, the compressor failed
+            }
+         }
+#endif
+
          if (ret())
          {
             uint32 * lhb = (uint32 *) ret()->GetBuffer();
@@ -346,17 +760,26 @@ UnflattenHeaderAndMessage(const ByteBufferRef & bufRef) const
          int32 encoding = B_LENDIAN_TO_HOST_INT32(lhb[1]);
 
          const ByteBuffer * bb = bufRef();  // default; may be changed below
+         ConstByteBufferRef lazyRef;        // if set, the Message will be unflattened lazily out of this buffer
 
-#ifdef MUSCLE_ENABLE_ZLIB_ENCODING
+#if defined(MUSCLE_ENABLE_ZLIB_ENCODING) || defined(MUSCLE_ENABLE_ZSTD_ENCODING)
          ByteBufferRef expRef;  // must be declared outside the brackets below!
+         bool isCompressed = false;
+# ifdef MUSCLE_ENABLE_ZLIB_ENCODING
          ZLibCodec * enc = GetCodec(encoding, _recvCodec);
-         if (enc) 
+         if (enc) {isCompressed = true; expRef = enc->Inflate(bb->GetBuffer()+offset, bb->GetNumBytes()-offset);}
+# endif
+# ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+         ZStdCodec * zenc = GetZStdCodec(encoding, _zstdRecvCodec);
+         if (zenc) {isCompressed = true; expRef = zenc->Decompress(bb->GetBuffer()+offset, bb->GetNumBytes()-offset);}
+# endif
+         if (isCompressed)
          {
-            expRef = enc->Inflate(bb->GetBuffer()+offset, bb->GetNumBytes()-offset);
             if (expRef()) 
             {
                bb = expRef();
                offset = 0;
+               if (_lazyUnflattenEnabled) lazyRef = expRef;
             }
             else
             {
@@ -368,7 +791,23 @@ UnflattenHeaderAndMessage(const ByteBufferRef & bufRef) const
          if (encoding != MUSCLE_MESSAGE_ENCODING_DEFAULT) bb = NULL;
 #endif
 
-         if ((bb == NULL)||(ret()->Unflatten(bb->GetBuffer()+offset, bb->GetNumBytes()-offset) != B_NO_ERROR)) ret.Reset();
+         if ((bb)&&(_lazyUnflattenEnabled)&&(lazyRef() == NULL))
+         {
+            // A lazily-unflattened Message keeps a reference to its bytes, so they must be held in a ref-counted buffer
+            if (bufRef.IsRefCounting()) lazyRef = bufRef;
+            else
+            {
+               lazyRef = GetByteBufferFromPool(bb->GetNumBytes()-offset, bb->GetBuffer()+offset);  // since our scratch buffer will be reused
+               offset = 0;
+               if (lazyRef() == NULL) bb = NULL;  // out of memory?
+            }
+         }
+
+         if (lazyRef())
+         {
+            if (ret()->UnflattenLazily(lazyRef, offset) != B_NO_ERROR) ret.Reset();
+         }
+         else if ((bb == NULL)||(ret()->Unflatten(bb->GetBuffer()+offset, bb->GetNumBytes()-offset) != B_NO_ERROR)) ret.Reset();
       }
    }
    return ret;
@@ -388,14 +827,20 @@ MessageIOGateway ::
 GetBodySize(const uint8 * headerBuf) const 
 {
    const uint32 * h = (const uint32 *) headerBuf;
-   return (muscleInRange((uint32)B_LENDIAN_TO_HOST_INT32(h[1]), (uint32)MUSCLE_MESSAGE_ENCODING_DEFAULT, (uint32)MUSCLE_MESSAGE_ENCODING_END_MARKER-1)) ? (int32)(B_LENDIAN_TO_HOST_INT32(h[0])) : -1;
+   const uint32 encoding = B_LENDIAN_TO_HOST_INT32(h[1]);
+   bool isKnownEncoding = muscleInRange(encoding, (uint32)MUSCLE_MESSAGE_ENCODING_DEFAULT, (uint32)MUSCLE_MESSAGE_ENCODING_END_MARKER-1);
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   isKnownEncoding = ((isKnownEncoding)||(muscleInRange(encoding, (uint32)MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1, (uint32)MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_9))
+                                       ||(muscleInRange(encoding, (uint32)MUSCLE_MESSAGE_ENCODING_ZSTD_1,      (uint32)MUSCLE_MESSAGE_ENCODING_ZSTD_19)));
+#endif
+   return isKnownEncoding ? (int32)(B_LENDIAN_TO_HOST_INT32(h[0])) : -1;
 }
 
 bool 
 MessageIOGateway ::
 HasBytesToOutput() const
 {
-   return ((IsHosed() == false)&&((_sendBuffer._buffer())||(GetOutgoingMessageQueue().HasItems())));
+   return ((IsHosed() == false)&&((_sendBuffer._buffer())||(GetOutgoingMessageQueue().HasItems())||(_pendingNegotiationMessage())||(_outgoingChunkedMessages.HasItems())));
 }
 
 void
@@ -409,10 +854,65 @@ Reset()
 #ifdef MUSCLE_ENABLE_ZLIB_ENCODING
    delete _sendCodec; _sendCodec = NULL;
    delete _recvCodec; _recvCodec = NULL;
+   delete _chunkSendCodec; _chunkSendCodec = NULL;
+   delete _chunkRecvCodec; _chunkRecvCodec = NULL;
+#endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   delete _zstdSendCodec; _zstdSendCodec = NULL;
+   delete _zstdRecvCodec; _zstdRecvCodec = NULL;
+   delete _zstdChunkSendCodec; _zstdChunkSendCodec = NULL;
+   delete _zstdChunkRecvCodec; _zstdChunkRecvCodec = NULL;
 #endif
 
    _sendBuffer.Reset();
    _recvBuffer.Reset();
+   _gatherBuffers.Clear();
+   _preFlattenedBuffers.Clear();
+
+   // Our next peer will need to negotiate interleaving all over again
+   _outgoingChunkedMessages.Clear();
+   _incomingChunkedMessages.Clear();
+   _incomingChunkedBytes = 0;
+   _peerSupportsInterleaving = false;
+   _pendingNegotiationMessage.Reset();
+   ScheduleInterleavingProbe();
+}
+
+bool
+MessageIOGateway ::
+IsFlattenedFormatCompatibleWith(const MessageIOGateway & rhs) const
+{
+   return ((_outgoingEncoding     == MUSCLE_MESSAGE_ENCODING_DEFAULT)&&(_aboutToFlattenCallback     == NULL)&&
+           (rhs._outgoingEncoding == MUSCLE_MESSAGE_ENCODING_DEFAULT)&&(rhs._aboutToFlattenCallback == NULL)&&
+           (typeid(*this) == typeid(rhs)));
+}
+
+ByteBufferRef
+MessageIOGateway ::
+FlattenSharedMessage(const MessageRef & msgRef) const
+{
+   return IsFlattenedFormatCompatibleWith(*this) ? FlattenHeaderAndMessage(msgRef) : ByteBufferRef();
+}
+
+status_t
+MessageIOGateway ::
+AddOutgoingPreFlattenedMessage(const MessageRef & msgRef, const ByteBufferRef & flatBuf)
+{
+   TCHECKPOINT;
+
+   if (AddOutgoingMessage(msgRef) != B_NO_ERROR) return B_ERROR;
+   if (flatBuf())
+   {
+      // Forget about any Messages that left our queue without going through DoOutput() (e.g. removed by
+      // the owner via GetOutgoingMessageQueue()).  Once only we hold a Message, it can't be in the queue anymore.
+      if (_preFlattenedBuffers.GetNumItems() > (2*GetOutgoingMessageQueue().GetNumItems())+32)
+      {
+         for (HashtableIterator<MessageRef, ByteBufferRef> iter(_preFlattenedBuffers); iter.HasData(); iter++) 
+            if (iter.GetKey().IsRefPrivate()) (void) _preFlattenedBuffers.Remove(iter.GetKey());
+      }
+      (void) _preFlattenedBuffers.Put(msgRef, flatBuf);  // on failure we'll just flatten (msgRef) the usual way later on
+   }
+   return B_NO_ERROR;
 }
 
 MessageRef MessageIOGateway :: CreateSynchronousPingMessage(uint32 syncPingCounter) const
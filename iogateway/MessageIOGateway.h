@@ -11,10 +11,15 @@
 # include "zlib/ZLibCodec.h"
 #endif
 
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+# include "zstd/ZStdCodec.h"
+#endif
+
 namespace muscle {
 
 /**
  * Encoding IDs.  As of MUSCLE 2.40, we support vanilla MUSCLE_MESSAGE_ENCODING_DEFAULT and 9 levels of zlib compression!
+ * As of MUSCLE 6.07, we also support 9 "fast" levels and 19 regular levels of Zstandard compression.
  */
 enum {
    MUSCLE_MESSAGE_ENCODING_DEFAULT = 1164862256, // 'Enc0',  /**< just plain ol' flattened Message objects, with no special encoding */
@@ -29,9 +34,64 @@ enum {
    MUSCLE_MESSAGE_ENCODING_ZLIB_8,
    MUSCLE_MESSAGE_ENCODING_ZLIB_9,                           /**< highest level of zlib compression (most space-efficient) */
 #endif
-   MUSCLE_MESSAGE_ENCODING_END_MARKER = MUSCLE_MESSAGE_ENCODING_DEFAULT+10  /**< Not a valid -- just here to mark the end of the range */
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1 = 1165649457, // 'Ezf1'  /**< least-fast of Zstandard's "fast" levels (better compression than ZSTD_FAST_9) */
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_2,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_3,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_4,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_5,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_6,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_7,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_8,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_9,                      /**< fastest Zstandard level (LZ4-class speed, least compression) */
+   MUSCLE_MESSAGE_ENCODING_ZSTD_1 = 1165652785,      // 'Ezs1'  /**< lowest regular level of Zstandard compression */
+   MUSCLE_MESSAGE_ENCODING_ZSTD_2,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_3,                           /**< This is the recommended CPU vs space-savings setting for Zstandard */
+   MUSCLE_MESSAGE_ENCODING_ZSTD_4,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_5,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_6,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_7,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_8,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_9,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_10,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_11,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_12,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_13,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_14,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_15,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_16,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_17,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_18,
+   MUSCLE_MESSAGE_ENCODING_ZSTD_19,                          /**< highest level of Zstandard compression (most space-efficient, but slow to compress) */
+#endif
+   MUSCLE_MESSAGE_ENCODING_END_MARKER = MUSCLE_MESSAGE_ENCODING_DEFAULT+10,  /**< Not a valid -- just here to mark the end of the range */
+   MUSCLE_MESSAGE_ENCODING_CHUNK = 1130917483  /**< 'Chnk':  one chunk of an interleaved Message; only sent to peers that have negotiated interleaving */
 };
 
+/** The maximum (and default) number of flattened Messages a MessageIOGateway will write out per system call. */
+#ifndef MUSCLE_MAX_GATHER_WRITE_BUFFERS
+# define MUSCLE_MAX_GATHER_WRITE_BUFFERS 64
+#endif
+
+/** The default size (in bytes) of the chunks that a MessageIOGateway splits large outgoing Messages into, when interleaving is in use. */
+#ifndef MUSCLE_DEFAULT_INTERLEAVING_CHUNK_SIZE
+# define MUSCLE_DEFAULT_INTERLEAVING_CHUNK_SIZE (32*1024)
+#endif
+
+/** The maximum number of chunked Messages that a MessageIOGateway will be part-way through sending at once, and the
+  * default maximum number that it will let its peer be part-way through sending to it.  See SetMaxIncomingChunkedMessages().
+  */
+#ifndef MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES
+# define MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES 16
+#endif
+
+/** The maximum total size (in bytes) of the chunked Messages that a MessageIOGateway will be part-way through sending at
+  * once, and the default maximum that it will let its peer be part-way through sending to it.  See SetMaxIncomingChunkedMessages().
+  */
+#ifndef MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES
+# define MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES (64*1024*1024)
+#endif
+
 /** Callback function type for flatten/unflatten notification callbacks */
 typedef void (*MessageFlattenedCallback)(const MessageRef & msgRef, void * userData);
 
@@ -39,6 +99,7 @@ typedef void (*MessageFlattenedCallback)(const MessageRef & msgRef, void * userD
  * A "gateway" object that knows how to send/receive Messages over a wire, via a provided DataIO object. 
  * May be subclassed to change the byte-level protocol, or used as-is if the default protocol is desired.
  * If ZLib compression is desired, be sure to compile with -DMUSCLE_ENABLE_ZLIB_ENCODING
+ * If Zstandard compression is desired, be sure to compile with -DMUSCLE_ENABLE_ZSTD_ENCODING
  *
  * The default protocol format used by this class is:
  *   -# 4 bytes (uint32) indicating the flattened size of the message
@@ -46,6 +107,11 @@ typedef void (*MessageFlattenedCallback)(const MessageRef & msgRef, void * userD
  *   -# n bytes of flattened Message (where n is the value specified in 1)
  *   -# goto 1 ...
  *
+ * If interleaving has been negotiated (see SetInterleavingEnabled()), a large Message may instead be sent as a
+ * series of chunks, each of which has the same 8-byte header (with MUSCLE_MESSAGE_ENCODING_CHUNK as its encoding
+ * type), followed by three uint32s (a transfer ID, the chunk's offset, and the total size of the Message's
+ * header and body bytes), followed by the next part of the Message's header and body bytes.
+ *
  * An example flattened Message byte structure is provided at the bottom of the
  * MessageIOGateway.h header file.
  */
@@ -59,7 +125,9 @@ public:
     *                          Default is MUSCLE_MESSAGE_ENCODING_DEFAULT, meaning that no
     *                          compression will be done.  Note that to use any of the
     *                          MUSCLE_MESSAGE_ENCODING_ZLIB_* encodings, you MUST have
-    *                          defined the compiler symbol -DMUSCLE_ENABLE_ZLIB_ENCODING.
+    *                          defined the compiler symbol -DMUSCLE_ENABLE_ZLIB_ENCODING,
+    *                          and to use any of the MUSCLE_MESSAGE_ENCODING_ZSTD_* encodings,
+    *                          you MUST have defined -DMUSCLE_ENABLE_ZSTD_ENCODING.
     */
    MessageIOGateway(int32 outgoingEncoding = MUSCLE_MESSAGE_ENCODING_DEFAULT);
 
@@ -117,11 +185,142 @@ public:
      * that is actually sent, so if any Messages are currently Queued up to be sent,
      * they will be sent using the new encoding.
      * Note that to use any of the MUSCLE_MESSAGE_ENCODING_ZLIB_* encodings, 
-     * you MUST have defined the compiler symbol -DMUSCLE_ENABLE_ZLIB_ENCODING.
+     * you MUST have defined the compiler symbol -DMUSCLE_ENABLE_ZLIB_ENCODING, and to
+     * use any of the MUSCLE_MESSAGE_ENCODING_ZSTD_* encodings, you MUST have defined
+     * the compiler symbol -DMUSCLE_ENABLE_ZSTD_ENCODING.
      * @param ec Encoding type to use.  Should be one of the MUSCLE_MESSAGE_ENCODING_* constants.
      */
    void SetOutgoingEncoding(int32 ec) {_outgoingEncoding = ec;}
 
+   /** Sets the maximum number of flattened Messages that DoOutput() will hand to our DataIO's
+     * WriteGather() method at once.  When several Messages are queued up, they will all be flattened
+     * and then written out with a single (writev()-style) system call, without being copied into a
+     * combined buffer first.  Set this to 1 to have each flattened Message passed to Write() separately.
+     * Defaults to MUSCLE_MAX_GATHER_WRITE_BUFFERS (64); values larger than that will be clamped.
+     * Note that gather-writes are never used with packet-based DataIOs (e.g. UDP).
+     * @param maxBuffers The maximum number of flattened Messages to write out per system call.
+     */
+   void SetMaxGatherWriteBuffers(uint32 maxBuffers) {_maxGatherWriteBuffers = muscleClamp(maxBuffers, (uint32)1, (uint32)MUSCLE_MAX_GATHER_WRITE_BUFFERS);}
+
+   /** Returns the maximum number of flattened Messages that DoOutput() will write out per system call, as set above. */
+   uint32 GetMaxGatherWriteBuffers() const {return _maxGatherWriteBuffers;}
+
+   /** Sets whether received Messages should be unflattened via Message::UnflattenLazily() rather than Message::Unflatten().
+     * When enabled, the string and raw-data fields of each received Message are left in the received byte buffer until
+     * they are first accessed, so a Message that is merely passed along to other gateways never has them copied, and
+     * re-flattening it is mostly memcpy().  Defaults to false, since a lazily-unflattened Message must not be read by
+     * several threads at once (see Message::UnflattenLazily() for details).
+     * @param enabled True to unflatten received Messages lazily, or false to unflatten them in full as they arrive.
+     */
+   void SetLazyUnflattenEnabled(bool enabled) {_lazyUnflattenEnabled = enabled;}
+
+   /** Returns true iff received Messages are being unflattened lazily, as set above. */
+   bool IsLazyUnflattenEnabled() const {return _lazyUnflattenEnabled;}
+
+   /** Sets the priority that outgoing Messages with the given what-code will be sent with.  Whenever this gateway is
+     * ready to send another Message, it sends the oldest of its queued Messages that has the highest priority, so that
+     * (for example) small control Messages can be sent ahead of a backlog of bulk-data Messages.  Messages of equal priority
+     * are always sent in the order they were queued, and Messages whose what-codes haven't been assigned a priority
+     * have priority 0.  Since this only changes the order in which whole Messages are sent, it works with any peer.
+     * Note that once any priorities are set, choosing the next Message to send requires a scan of the outgoing-Message queue.
+     * @param whatCode The what-code to assign a priority to.
+     * @param priority The priority to send those Messages with.  Higher values are sent first; negative values are
+     *                 sent after Messages with the default priority.  Passing 0 removes the assignment.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory).
+     */
+   status_t SetPriorityForWhatCode(uint32 whatCode, int32 priority);
+
+   /** Returns the priority assigned to outgoing Messages with the given what-code, as set above.  Defaults to 0. */
+   int32 GetPriorityForWhatCode(uint32 whatCode) const {return _whatCodePriorities.GetWithDefault(whatCode, 0);}
+
+   /** Enables or disables interleaved output.  When interleaving has been negotiated with our peer, each outgoing
+     * Message that is larger than our chunk size (see SetInterleavingChunkSize()) is sent as a series of chunks, and
+     * a higher-priority Message (see SetPriorityForWhatCode()) that is queued while it is being sent will go out
+     * between two of its chunks, rather than waiting for the entire large Message to be sent.  So a multi-megabyte
+     * reply doesn't add seconds of latency to the control Messages queued after it.
+     *
+     * Chunks are sent only to a peer that has negotiated interleaving, so this is compatible with older peers.  To
+     * negotiate, one side sends a PR_COMMAND_PING Message containing an "_mioilv" field.  A MessageIOGateway with
+     * interleaving enabled consumes that Message itself and replies with a PR_RESULT_PONG containing an "_mioilva" field;
+     * after that, both gateways may send chunks.  Any other peer won't recognize the ping, and (if it is a MUSCLE server)
+     * will echo it back as a plain PR_RESULT_PONG, which we consume without enabling interleaving.  Interleaving is
+     * never used with packet-based DataIOs (e.g. UDP), and it assumes the default 8-byte header format, so subclasses
+     * that override GetHeaderSize() or GetBodySize() shouldn't enable it.  Defaults to disabled.
+     * @param enabled True to enable interleaving, or false to disable it.
+     * @param probePeer If true, we will send the negotiation ping to our peer.  If false, we'll only respond to our
+     *                  peer's ping, if it sends one.  (e.g. a server might pass false here, so that clients that don't
+     *                  know about interleaving will never receive a ping they didn't ask for).  Defaults to true.
+     */
+   void SetInterleavingEnabled(bool enabled, bool probePeer = true);
+
+   /** Returns true iff interleaving has been enabled, as set above. */
+   bool IsInterleavingEnabled() const {return _interleavingEnabled;}
+
+   /** Returns true iff interleaving is enabled and our peer has told us that it supports it too. */
+   bool IsInterleavingNegotiated() const {return ((_interleavingEnabled)&&(_peerSupportsInterleaving));}
+
+   /** Sets the size of the chunks that large outgoing Messages are split into when interleaving is in use.
+     * Smaller chunks let high-priority Messages preempt more quickly, at the cost of some extra overhead.
+     * Defaults to MUSCLE_DEFAULT_INTERLEAVING_CHUNK_SIZE (32KB).  Values smaller than 64 will be interpreted as 64.
+     * @param chunkSize The maximum number of Message bytes to send per chunk.
+     */
+   void SetInterleavingChunkSize(uint32 chunkSize) {_interleavingChunkSize = muscleMax(chunkSize, (uint32)64);}
+
+   /** Returns the interleaving chunk size, as set above. */
+   uint32 GetInterleavingChunkSize() const {return _interleavingChunkSize;}
+
+   /** Sets limits on the chunked Messages that our peer may be part-way through sending to us at once.  Space for a
+     * chunked Message is allocated as soon as its first chunk arrives, so without these limits a peer could make us
+     * allocate any amount of memory by starting lots of chunked Messages and never finishing them.  If a new chunked
+     * Message would take us past either limit, our peer is considered to be misbehaving, and SetHosed() is called.
+     * (A chunked Message that arrives while no others are in progress is always allowed, subject only to our maximum
+     * incoming Message size, as a non-chunked Message would be)  Note that chunks are only accepted at all after
+     * interleaving has been negotiated.
+     * @param maxMessages The maximum number of chunked Messages that may be in progress at once.
+     *                    Defaults to MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES.
+     * @param maxTotalBytes The maximum total size (in bytes) of the chunked Messages that may be in progress at once.
+     *                      Defaults to MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES.
+     * @note A MessageIOGateway never goes past the default limits when it sends, so setting lower limits than those
+     *       may cause a well-behaved peer to be disconnected.
+     */
+   void SetMaxIncomingChunkedMessages(uint32 maxMessages, uint32 maxTotalBytes) {_maxIncomingChunkedMessages = maxMessages; _maxIncomingChunkedBytes = maxTotalBytes;}
+
+   /** Returns the maximum number of incoming chunked Messages that may be in progress at once, as set above. */
+   uint32 GetMaxIncomingChunkedMessages() const {return _maxIncomingChunkedMessages;}
+
+   /** Returns the maximum total size of the incoming chunked Messages that may be in progress at once, as set above. */
+   uint32 GetMaxIncomingChunkedBytes() const {return _maxIncomingChunkedBytes;}
+
+   /** Returns true iff (rhs) is guaranteed to flatten any outgoing Message into exactly the same bytes that
+     * this gateway would, so that a buffer returned by one gateway's FlattenSharedMessage() may be passed to
+     * the other gateway's AddOutgoingPreFlattenedMessage().  The default implementation returns true only if
+     * both gateways are of the same class, both are using MUSCLE_MESSAGE_ENCODING_DEFAULT (a zlib stream
+     * carries per-connection state), and neither has an about-to-flatten callback installed.
+     * Subclasses whose FlattenHeaderAndMessage() depends on per-connection state should override this to return false.
+     * @param rhs The gateway to compare our outgoing-Message format against.
+     */
+   virtual bool IsFlattenedFormatCompatibleWith(const MessageIOGateway & rhs) const;
+
+   /** Returns a buffer containing (msgRef) flattened exactly as this gateway's DoOutput() would send it,
+     * suitable for passing to AddOutgoingPreFlattenedMessage() on this gateway or on any compatible gateway.
+     * @param msgRef The Message to flatten.
+     * @returns the flattened header and Message bytes, or a NULL ByteBufferRef if our output can't be shared
+     *          (i.e. if IsFlattenedFormatCompatibleWith(*this) returns false) or if we ran out of memory.
+     */
+   ByteBufferRef FlattenSharedMessage(const MessageRef & msgRef) const;
+
+   /** Adds (msgRef) to our outgoing-Message queue (via AddOutgoingMessage()), and remembers that (flatBuf)
+     * already holds its flattened bytes.  When (msgRef) reaches the head of the queue, (flatBuf)'s bytes will be
+     * sent as-is rather than flattening the Message again.  This lets a Message that is being sent to many
+     * clients be flattened just once, with all of the clients' gateways sharing a single read-only buffer.
+     * @param msgRef The Message to send.  The Message must not be modified after this call.
+     * @param flatBuf A buffer returned by FlattenSharedMessage(), called on this gateway or on a gateway
+     *                for which IsFlattenedFormatCompatibleWith(*this) returns true.  The buffer must not
+     *                be modified after this call.  If NULL, (msgRef) will be flattened as usual.
+     * @returns B_NO_ERROR on success, or B_ERROR if (msgRef) couldn't be queued.
+     */
+   status_t AddOutgoingPreFlattenedMessage(const MessageRef & msgRef, const ByteBufferRef & flatBuf);
+
    /** Overwritten to augment AbstractMessageIOGateway::ExecuteSynchronousMessaging()
      * with some additional logic that prepends a PR_COMMAND_PING to the outgoing Message queue
      * and then makes sure that ExecuteSynchronousMessaging() doesn't return until the
@@ -169,7 +368,7 @@ protected:
     * @param msgRef Reference to a Message to flatten into a byte array.
     * @return A reference to a ByteBuffer object (containing the appropriate header
     *         bytes, followed flattened Message data) on success, or a NULL reference on failure.
-    * The default implementation uses msg.Flatten() and then (optionally) ZLib compression to produce 
+    * The default implementation uses msg.Flatten() and then (optionally) ZLib or Zstandard compression to produce 
     * the flattened bytes.
     */
    virtual ByteBufferRef FlattenHeaderAndMessage(const MessageRef & msgRef) const;
@@ -180,7 +379,7 @@ protected:
     *               bytes, followed by some flattened Message bytes.
     * @returns a Reference to a Message object containing the Message that was encoded in
     *          the ByteBuffer on success, or a NULL reference on failure.
-    * The default implementation uses (optional) ZLib decompression (depending on the header bytes)
+    * The default implementation uses (optional) ZLib or Zstandard decompression (depending on the header bytes)
     * and then msg.Unflatten() to produce the Message.
     */
    virtual MessageRef UnflattenHeaderAndMessage(const ByteBufferRef & bufRef) const;
@@ -223,11 +422,22 @@ protected:
 
    /** 
      * Removes the next MessageRef from our outgoing Message queue and returns it in (retMsg).
+     * The default implementation removes the oldest Message with the highest priority (see SetPriorityForWhatCode()).
      * @param retMsg on success, the next MessageRef to send will be written into this MessageRef.
      * @returns B_NO_ERROR on success, or B_ERROR on failure (queue was empty)
      */
    virtual status_t PopNextOutgoingMessage(MessageRef & retMsg);
 
+   /** 
+     * Removes the next MessageRef from our outgoing Message queue (via PopNextOutgoingMessage()), along
+     * with the flattened-bytes buffer that was supplied for it via AddOutgoingPreFlattenedMessage(), if any.
+     * @param retMsg on success, the next MessageRef to send will be written into this MessageRef.
+     * @param retFlatBuf on success, this will be set to (retMsg)'s pre-flattened bytes, or to a NULL
+     *                   reference if (retMsg) was not added via AddOutgoingPreFlattenedMessage().
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (queue was empty)
+     */
+   status_t PopNextOutgoingMessageWithBuffer(MessageRef & retMsg, ByteBufferRef & retFlatBuf);
+
    /** 
      * Should return true iff we need to make sure that any outgoing Messages that we've deflated
      * are inflatable independently of each other.  The default method always returns false, since it
@@ -243,6 +453,10 @@ private:
 #ifdef MUSCLE_ENABLE_ZLIB_ENCODING
    ZLibCodec * GetCodec(int32 newEncoding, ZLibCodec * & setCodec) const;
 #endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   ZStdCodec * GetZStdCodec(int32 newEncoding, ZStdCodec * & setCodec) const;
+#endif
+   void SwapChunkCodecs(bool outgoing);
 
    class TransferBuffer
    {
@@ -259,17 +473,61 @@ private:
       uint32 _offset;
    };
 
+   class OutgoingChunkedMessage
+   {
+   public:
+      OutgoingChunkedMessage() : _offset(0), _transferID(0), _priority(0) {/* empty */}
+      OutgoingChunkedMessage(const ByteBufferRef & buf, uint32 transferID, int32 priority) : _buffer(buf), _offset(0), _transferID(transferID), _priority(priority) {/* empty */}
+
+      ByteBufferRef _buffer;  // the entire flattened Message (header included)
+      uint32 _offset;         // how much of (_buffer) we have sent as chunks so far
+      uint32 _transferID;     // identifies this Message's chunks to the receiver
+      int32 _priority;
+   };
+
+   status_t PopAndFlattenNextOutgoingMessage(ByteBufferRef & retBuf);
+   status_t PopAndFlattenNextQueuedMessage(ByteBufferRef & retBuf, bool allowChunking, bool & retChunkIt);
+   ByteBufferRef GetNextOutgoingChunk();
+   bool CanStartOutgoingChunkedMessage(uint32 flatSize) const;
+   bool FindHighestPriorityQueuedMessage(uint32 & retIndex, int32 & retPriority) const;
+   bool IsInterleavingActive() const {return ((IsInterleavingNegotiated())&&(GetDataIO()())&&(GetDataIO()()->GetPacketMaximumSize() == 0));}
+   bool IsChunkHeader(const uint8 * header) const {return ((_peerSupportsInterleaving)&&(B_LENDIAN_TO_HOST_INT32(((const uint32 *)header)[1]) == MUSCLE_MESSAGE_ENCODING_CHUNK));}
+   void HandleIncomingChunk(AbstractGatewayMessageReceiver & receiver, const ByteBuffer & chunkBuf);
+   void DeliverIncomingMessage(AbstractGatewayMessageReceiver & receiver, const MessageRef & msg);
+   void ScheduleInterleavingProbe();
    status_t SendMoreData(int32 & sentBytes, uint32 & maxBytes);
+   status_t SendMoreGatheredData(int32 & sentBytes, uint32 & maxBytes);
    status_t ReceiveMoreData(int32 & readBytes, uint32 & maxBytes, uint32 maxArraySize);
 
    TransferBuffer _sendBuffer;
    TransferBuffer _recvBuffer;
 
+   uint32 _maxGatherWriteBuffers;
+   Queue<ByteBufferRef> _gatherBuffers;  // flattened Messages waiting to be sent after _sendBuffer, during gather-writes
+
+   Hashtable<MessageRef, ByteBufferRef> _preFlattenedBuffers;  // queued Messages whose flattened bytes were supplied to AddOutgoingPreFlattenedMessage()
+
+   Hashtable<uint32, int32> _whatCodePriorities;  // what-code -> priority
+   int32 _maxPriority;                            // the largest priority any queued Message can have
+
+   bool _interleavingEnabled;
+   bool _interleavingProbeEnabled;
+   bool _peerSupportsInterleaving;  // only ever set while interleaving is enabled, so that we never accept chunks we didn't ask for
+   uint32 _interleavingChunkSize;
+   MessageRef _pendingNegotiationMessage;                 // our interleaving ping or pong, to be sent before any queued Messages
+   Queue<OutgoingChunkedMessage> _outgoingChunkedMessages; // large Messages we are part-way through sending, in the order we started them
+   uint32 _nextTransferID;
+   Hashtable<uint32, TransferBuffer> _incomingChunkedMessages; // transfer ID -> partially reassembled Message
+   uint64 _incomingChunkedBytes;                          // the total size of the Messages in _incomingChunkedMessages
+   uint32 _maxIncomingChunkedMessages;
+   uint32 _maxIncomingChunkedBytes;
+
    uint8 _scratchRecvBufferBytes[2048];  // so we can receive smaller Messages without constantly allocating and freeing data
    ByteBuffer _scratchRecvBuffer;
 
    uint32 _maxIncomingMessageSize;
    int32 _outgoingEncoding;
+   bool _lazyUnflattenEnabled;
   
    MessageFlattenedCallback _aboutToFlattenCallback;
    void * _aboutToFlattenCallbackData;
@@ -283,7 +541,16 @@ private:
 #ifdef MUSCLE_ENABLE_ZLIB_ENCODING
    mutable ZLibCodec * _sendCodec;
    mutable ZLibCodec * _recvCodec;
+   mutable ZLibCodec * _chunkSendCodec;  // for chunked Messages, which may be received in a different order than they were deflated
+   mutable ZLibCodec * _chunkRecvCodec;
+#endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+   mutable ZStdCodec * _zstdSendCodec;
+   mutable ZStdCodec * _zstdRecvCodec;
+   mutable ZStdCodec * _zstdChunkSendCodec;  // for chunked Messages, as above
+   mutable ZStdCodec * _zstdChunkRecvCodec;
 #endif
+   bool _flatteningChunkedMessage;
 
    NestCount _noRPCReply;
    int32 _syncPingCounter;
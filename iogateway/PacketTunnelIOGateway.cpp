@@ -1,6 +1,5 @@
 /* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */  
 
-#include "dataio/UDPSocketDataIO.h"  // for retrieving the source IP address and port, where possible
 #include "iogateway/PacketTunnelIOGateway.h"
 
 namespace muscle {
@@ -17,15 +16,74 @@ static const uint32 FRAGMENT_HEADER_SIZE = 6*(sizeof(uint32));
 // The maximum number of bytes of memory to keep in a ByteBuffer to avoid reallocations
 static const uint32 MAX_CACHE_SIZE = 20*1024;
 
-PacketTunnelIOGateway :: PacketTunnelIOGateway(const AbstractMessageIOGatewayRef & slaveGateway, uint32 maxTransferUnit, uint32 magic) : _magic(magic), _maxTransferUnit(muscleMax(maxTransferUnit, FRAGMENT_HEADER_SIZE+1)), _allowMiscData(false), _sexID(0), _slaveGateway(slaveGateway), _outputPacketSize(0), _sendMessageIDCounter(0), _maxIncomingMessageSize(MUSCLE_NO_LIMIT)
+// The maximum number of packets to receive, or to send, via a single ReadPackets() or WritePackets() call
+static const uint32 MAX_PACKETS_PER_BATCH = 32;
+
+// When forward error correction is enabled, each packet starts with an FEC header with the following fields in it:
+//    uint32 fec_magic_number (the bitwise complement of our magic number)
+//    uint32 group_id
+//    uint32 (packet_index<<16)|(num_data_packets<<8)|(num_parity_packets)
+//    uint32 payload_size (or for a parity packet, the XOR of the payload sizes of its data packets)
+// A data packet's payload is the usual sequence of chunks; a parity packet's payload is the XOR of its data packets' payloads.
+// Data packets are numbered from zero; parity packets are numbered starting after the last data packet in the group.
+// Note that in a parity packet, num_data_packets is the number of data packets actually sent in its group, which may
+// be less than the number given in that group's data packets (if the group was ended early).
+static const uint32 FEC_HEADER_SIZE = 4*(sizeof(uint32));
+
+static const uint32 MAX_FEC_DATA_PACKETS   = 255;
+static const uint32 MAX_FEC_PARITY_PACKETS = 16;
+
+// Packets from FEC groups up to this many groups older than the current one are assumed to be late arrivals, and ignored
+static const int32 FEC_STRAGGLER_WINDOW = 16;
+
+// Data packets that are being held until a missing data packet before them arrives will be passed on without it after this long
+static const uint64 FEC_MAX_HOLD_TIME = MillisToMicros(100);
+
+static void XorBytes(uint8 * dest, const uint8 * src, uint32 numBytes)
+{
+   for (uint32 i=0; i<numBytes; i++) dest[i] ^= src[i];
+}
+
+PacketTunnelIOGateway :: PacketTunnelIOGateway(const AbstractMessageIOGatewayRef & slaveGateway, uint32 maxTransferUnit, uint32 magic) : _magic(magic), _maxTransferUnit(muscleMax(maxTransferUnit, FRAGMENT_HEADER_SIZE+1)), _allowMiscData(false), _sexID(0), _slaveGateway(slaveGateway), _sendMessageIDCounter(0), _maxIncomingMessageSize(MUSCLE_NO_LIMIT), _fecDataPackets(0), _fecParityPackets(0), _fecGroupID((uint32)GetRunTime64()), _fecNumDataPacketsSent(0), _fecReceiver(NULL)
 {
    _fakeSendIO.SetBuffer(ByteBufferRef(&_fakeSendBuffer, false));
    // _fakeReceiveIO's buffer will be set just before it is used
 }
 
+status_t PacketTunnelIOGateway :: SetForwardErrorCorrection(uint32 numDataPackets, uint32 numParityPackets)
+{
+   if (numParityPackets > 0)
+   {
+      if ((numDataPackets == 0)||(numDataPackets > MAX_FEC_DATA_PACKETS)||(numParityPackets > MAX_FEC_PARITY_PACKETS)||(numParityPackets > numDataPackets)||(_maxTransferUnit <= FEC_HEADER_SIZE+FRAGMENT_HEADER_SIZE)) return B_ERROR;
+      if ((_fecParityBuffer.SetNumBytes(numParityPackets*_maxTransferUnit, false) != B_NO_ERROR)||(_fecParitySizes.EnsureSize(numParityPackets, true) != B_NO_ERROR)||(_fecLengthXors.EnsureSize(numParityPackets, true) != B_NO_ERROR)) return B_ERROR;
+      memset(_fecParityBuffer.GetBuffer(), 0, _fecParityBuffer.GetNumBytes());
+      for (uint32 i=0; i<numParityPackets; i++) _fecParitySizes[i] = _fecLengthXors[i] = 0;
+   }
+   else 
+   {
+      numDataPackets = 0;
+      _fecParityBuffer.Clear(true);
+      _fecParitySizes.Clear(true);
+      _fecLengthXors.Clear(true);
+   }
+
+   _fecDataPackets   = numDataPackets;
+   _fecParityPackets = numParityPackets;
+
+   // Any group that was in progress is abandoned; its packets will just go without parity
+   _fecGroupID++;
+   _fecNumDataPacketsSent = 0;
+   return B_NO_ERROR;
+}
+
 int32 PacketTunnelIOGateway :: DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes)
 {
-   if (_inputPacketBuffer.SetNumBytes(_maxTransferUnit, false) != B_NO_ERROR) return -1;
+   if (_inputPacketBuffer.SetNumBytes(_maxTransferUnit*MAX_PACKETS_PER_BATCH, false) != B_NO_ERROR) return -1;
+   _fecReceiver = &receiver;
+   if (_fecReceiveStates.HasItems()) FlushExpiredFECGroups(receiver);
+
+   IPAddressAndPort fromIAPs[MAX_PACKETS_PER_BATCH];
+   PacketIOVec packets[MAX_PACKETS_PER_BATCH];
 
    bool firstTime = true;
    uint32 totalBytesRead = 0;
@@ -33,96 +91,280 @@ int32 PacketTunnelIOGateway :: DoInputImplementation(AbstractGatewayMessageRecei
    {
       firstTime = false;
 
-      int32 bytesRead = GetDataIO()()->Read(_inputPacketBuffer.GetBuffer(), _inputPacketBuffer.GetNumBytes());
-//printf("   READ " INT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " bytes\n", bytesRead, _inputPacketBuffer.GetNumBytes());
-      if (bytesRead > 0)
-      {
-         totalBytesRead += bytesRead;
-
-         IPAddressAndPort fromIAP;
-         UDPSocketDataIO * udpIO = dynamic_cast<UDPSocketDataIO *>(GetDataIO()());
-         if (udpIO) fromIAP = udpIO->GetSourceOfLastReadPacket();
+      // Receive as many packets as we can (without going too far past maxBytes) with a single call
+      const uint32 numPackets = muscleMax((uint32)1, muscleMin(MAX_PACKETS_PER_BATCH, (maxBytes-totalBytesRead)/_maxTransferUnit));
+      for (uint32 i=0; i<numPackets; i++) packets[i] = PacketIOVec(_inputPacketBuffer.GetBuffer()+(i*_maxTransferUnit), _maxTransferUnit, &fromIAPs[i]);
 
-         const uint8 * p = (const uint8 *) _inputPacketBuffer.GetBuffer();
-         if ((_allowMiscData)&&((bytesRead < (int32)FRAGMENT_HEADER_SIZE)||((uint32)B_LENDIAN_TO_HOST_INT32(*((const uint32 *)p)) != _magic)))
-         {
-            // If we're allowed to handle miscellaneous data, we'll just pass it on through verbatim
-            ByteBuffer temp;
-            temp.AdoptBuffer(bytesRead, const_cast<uint8 *>(p));
-            HandleIncomingMessage(receiver, ByteBufferRef(&temp, false), fromIAP);
-            (void) temp.ReleaseBuffer();
-         }
-         else
+      int32 numPacketsRead = GetDataIO()()->ReadPackets(packets, numPackets);
+      if (numPacketsRead > 0)
+      {
+         for (int32 i=0; i<numPacketsRead; i++)
          {
-            const uint8 * invalidByte = p+bytesRead;
-            while(invalidByte-p >= (int32)FRAGMENT_HEADER_SIZE)
+            const uint32 bytesRead = packets[i].GetNumBytes();
+            if (bytesRead > 0)
             {
-               const uint32 * h32 = (const uint32 *) p;
-               uint32 magic       = B_LENDIAN_TO_HOST_INT32(h32[0]);
-               uint32 sexID       = B_LENDIAN_TO_HOST_INT32(h32[1]);
-               uint32 messageID   = B_LENDIAN_TO_HOST_INT32(h32[2]);
-               uint32 offset      = B_LENDIAN_TO_HOST_INT32(h32[3]);
-               uint32 chunkSize   = B_LENDIAN_TO_HOST_INT32(h32[4]);
-               uint32 totalSize   = B_LENDIAN_TO_HOST_INT32(h32[5]);
+               totalBytesRead += bytesRead;
+
+               const uint8 * bytes = (const uint8 *) packets[i].GetBytes();
+               if ((bytesRead >= FEC_HEADER_SIZE)&&((uint32)B_LENDIAN_TO_HOST_INT32(*((const uint32 *)bytes)) == ~_magic)) HandleIncomingFECPacket(receiver, bytes, bytesRead, fromIAPs[i]);
+                                                                                                                     else HandleIncomingPacket(receiver, bytes, bytesRead, fromIAPs[i]);
+            }
+         }
+      }
+      else if (numPacketsRead < 0) return -1;
+      else break;
+   }
+   return totalBytesRead;
+}
+
+void PacketTunnelIOGateway :: HandleIncomingPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes, const IPAddressAndPort & fromIAP)
+{
+   const uint8 * p = packetBytes;
+   if ((_allowMiscData)&&((numBytes < FRAGMENT_HEADER_SIZE)||((uint32)B_LENDIAN_TO_HOST_INT32(*((const uint32 *)p)) != _magic)))
+   {
+      // If we're allowed to handle miscellaneous data, we'll just pass it on through verbatim
+      ByteBuffer temp;
+      temp.AdoptBuffer(numBytes, const_cast<uint8 *>(p));
+      HandleIncomingMessage(receiver, ByteBufferRef(&temp, false), fromIAP);
+      (void) temp.ReleaseBuffer();
+   }
+   else
+   {
+      const uint8 * invalidByte = p+numBytes;
+      while(invalidByte-p >= (int32)FRAGMENT_HEADER_SIZE)
+      {
+         const uint32 * h32 = (const uint32 *) p;
+         uint32 magic       = B_LENDIAN_TO_HOST_INT32(h32[0]);
+         uint32 sexID       = B_LENDIAN_TO_HOST_INT32(h32[1]);
+         uint32 messageID   = B_LENDIAN_TO_HOST_INT32(h32[2]);
+         uint32 offset      = B_LENDIAN_TO_HOST_INT32(h32[3]);
+         uint32 chunkSize   = B_LENDIAN_TO_HOST_INT32(h32[4]);
+         uint32 totalSize   = B_LENDIAN_TO_HOST_INT32(h32[5]);
 //printf("   PARSE magic=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " sex=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " messageID=" UINT32_FORMAT_SPEC " offset=" UINT32_FORMAT_SPEC " chunkSize=" UINT32_FORMAT_SPEC " totalSize=" UINT32_FORMAT_SPEC "\n", magic, _magic, sexID, _sexID, messageID, offset, chunkSize, totalSize);
 
-               p += FRAGMENT_HEADER_SIZE;
-               if ((magic == _magic)&&((_sexID == 0)||(_sexID != sexID))&&((invalidByte-p >= (int32)chunkSize)&&(totalSize <= _maxIncomingMessageSize)))
+         p += FRAGMENT_HEADER_SIZE;
+         if ((magic == _magic)&&((_sexID == 0)||(_sexID != sexID))&&((invalidByte-p >= (int32)chunkSize)&&(totalSize <= _maxIncomingMessageSize)))
+         {
+            ReceiveState * rs = _receiveStates.Get(fromIAP);
+            if (rs == NULL)
+            {
+               if (offset == 0) rs = _receiveStates.PutAndGet(fromIAP, ReceiveState(messageID));
+               if (rs)
                {
-                  ReceiveState * rs = _receiveStates.Get(fromIAP);
-                  if (rs == NULL)
+                  rs->_buf = GetByteBufferFromPool(totalSize);
+                  if (rs->_buf() == NULL)
                   {
-                     if (offset == 0) rs = _receiveStates.PutAndGet(fromIAP, ReceiveState(messageID));
-                     if (rs)
-                     {
-                        rs->_buf = GetByteBufferFromPool(totalSize);
-                        if (rs->_buf() == NULL)
-                        {
-                           _receiveStates.Remove(fromIAP);
-                           rs = NULL;
-                        }
-                     }
+                     _receiveStates.Remove(fromIAP);
+                     rs = NULL;
                   }
-                  if (rs)
-                  {
-                     if ((offset == 0)||(messageID != rs->_messageID))
-                     {
-                        // A new message... start receiving it (but only if we are starting at the beginning)
-                        rs->_messageID = messageID;
-                        rs->_offset    = 0;
-                        rs->_buf()->SetNumBytes(totalSize, false);
-                     }
-
-                     uint32 rsSize = rs->_buf()->GetNumBytes();
+               }
+            }
+            if (rs)
+            {
+               if ((offset == 0)||(messageID != rs->_messageID))
+               {
+                  // A new message... start receiving it (but only if we are starting at the beginning)
+                  rs->_messageID = messageID;
+                  rs->_offset    = 0;
+                  rs->_buf()->SetNumBytes(totalSize, false);
+               }
+
+               uint32 rsSize = rs->_buf()->GetNumBytes();
 //printf("  CHECK:  offset=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " %s\n", offset, rs->_offset, (offset==rs->_offset)?"":"DISCONTINUITY!!!");
-                     if ((messageID == rs->_messageID)&&(totalSize == rsSize)&&(offset == rs->_offset)&&(offset+chunkSize <= rsSize))
-                     {
-                        memcpy(rs->_buf()->GetBuffer()+offset, p, chunkSize);
-                        rs->_offset += chunkSize;
-                        if (rs->_offset == rsSize) 
-                        {
-                           HandleIncomingMessage(receiver, rs->_buf, fromIAP);
-                           rs->_offset = 0;
-                           rs->_buf()->Clear(rsSize > MAX_CACHE_SIZE);
-                        }
-                     }
-                     else 
-                     {
-                        LogTime(MUSCLE_LOG_DEBUG, "Unknown fragment (" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC ") received from %s, ignoring it.\n", messageID, offset, chunkSize, totalSize, fromIAP.ToString()());
-                        rs->_offset = 0;
-                        rs->_buf()->Clear(rsSize > MAX_CACHE_SIZE);
-                     }
+               if ((messageID == rs->_messageID)&&(totalSize == rsSize)&&(offset == rs->_offset)&&(offset+chunkSize <= rsSize))
+               {
+                  memcpy(rs->_buf()->GetBuffer()+offset, p, chunkSize);
+                  rs->_offset += chunkSize;
+                  if (rs->_offset == rsSize) 
+                  {
+                     HandleIncomingMessage(receiver, rs->_buf, fromIAP);
+                     rs->_offset = 0;
+                     rs->_buf()->Clear(rsSize > MAX_CACHE_SIZE);
                   }
-                  p += chunkSize;
                }
-               else break;
+               else 
+               {
+                  LogTime(MUSCLE_LOG_DEBUG, "Unknown fragment (" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC ") received from %s, ignoring it.\n", messageID, offset, chunkSize, totalSize, fromIAP.ToString()());
+                  rs->_offset = 0;
+                  rs->_buf()->Clear(rsSize > MAX_CACHE_SIZE);
+               }
             }
+            p += chunkSize;
          }
+         else break;
       }
-      else if (bytesRead < 0) return -1;
-      else break;
    }
-   return totalBytesRead;
+}
+
+void PacketTunnelIOGateway :: HandleIncomingFECPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes, const IPAddressAndPort & fromIAP)
+{
+   const uint32 * h32       = (const uint32 *) packetBytes;
+   const uint32 groupID     = B_LENDIAN_TO_HOST_INT32(h32[1]);
+   const uint32 layout      = B_LENDIAN_TO_HOST_INT32(h32[2]);
+   const uint32 sizeField   = B_LENDIAN_TO_HOST_INT32(h32[3]);
+   const uint32 index       = (layout>>16);
+   const uint32 numData     = (layout>>8)&0xFF;
+   const uint32 numParity   = (layout&0xFF);
+   const uint8 * payload    = packetBytes+FEC_HEADER_SIZE;
+   const uint32 payloadSize = numBytes-FEC_HEADER_SIZE;
+   const bool isParity      = (index >= numData);
+   if ((numData == 0)||(numParity == 0)||(numParity > MAX_FEC_PARITY_PACKETS)||(index >= numData+numParity)||(payloadSize > _maxTransferUnit)||((isParity == false)&&(sizeField != payloadSize)))
+   {
+      LogTime(MUSCLE_LOG_DEBUG, "Malformed FEC packet (" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC ") received from %s, ignoring it.\n", groupID, layout, sizeField, fromIAP.ToString()());
+      return;
+   }
+
+   FECReceiveState * fs = _fecReceiveStates.Get(fromIAP);
+   if (fs == NULL)
+   {
+      fs = _fecReceiveStates.PutAndGet(fromIAP);
+      if (fs == NULL) {WARN_OUT_OF_MEMORY; return;}
+   }
+
+   if ((fs->_numParity == 0)||(groupID != fs->_groupID))
+   {
+      const int32 groupsAhead = (int32)(groupID-fs->_groupID);
+      if ((fs->_numParity > 0)&&(groupsAhead < 0)&&(groupsAhead > -FEC_STRAGGLER_WINDOW)) return;  // a late packet from a group we've already finished with
+
+      // A new group has started, so whatever we were holding from the old group won't be reconstructed now; pass it on as-is
+      FlushFECGroup(receiver, *fs, fromIAP);
+      if ((fs->_xors.SetNumBytes(numParity*_maxTransferUnit, false) != B_NO_ERROR)||(fs->_haveParity.EnsureSize(numParity, true) != B_NO_ERROR)||(fs->_lengthXors.EnsureSize(numParity, true) != B_NO_ERROR))
+      {
+         WARN_OUT_OF_MEMORY;
+         (void) _fecReceiveStates.Remove(fromIAP);
+         return;
+      }
+      memset(fs->_xors.GetBuffer(), 0, fs->_xors.GetNumBytes());
+      for (uint32 j=0; j<numParity; j++) {fs->_haveParity[j] = false; fs->_lengthXors[j] = 0;}
+      fs->_haveData.Clear();
+      fs->_groupID   = groupID;
+      fs->_numParity = numParity;
+      fs->_numData   = MUSCLE_NO_LIMIT;
+      fs->_nextIndex = 0;
+   }
+   if (numParity != fs->_numParity) return;  // inconsistent with the rest of its group?
+
+   if (isParity)
+   {
+      const uint32 j = index-numData;
+      if (fs->_haveParity[j]) return;  // duplicate packet
+
+      fs->_haveParity[j] = true;
+      fs->_numData       = numData;
+      XorBytes(fs->_xors.GetBuffer()+(j*_maxTransferUnit), payload, payloadSize);
+      fs->_lengthXors[j] ^= sizeField;
+   }
+   else HandleIncomingFECDataPacket(receiver, *fs, index, payload, payloadSize, fromIAP);
+
+   // If we know the group's size, see if any of its missing data packets can now be reconstructed.
+   // That's possible whenever we have a parity packet and all but one of its data packets.
+   if (fs->_numData != MUSCLE_NO_LIMIT)
+   {
+      for (uint32 j=0; j<fs->_numParity; j++)
+      {
+         if (fs->_haveParity[j] == false) continue;
+
+         uint32 numMissing = 0, missingIndex = 0;
+         for (uint32 i=j; i<fs->_numData; i+=fs->_numParity)
+         {
+            if ((i >= fs->_haveData.GetNumItems())||(fs->_haveData[i] == false))
+            {
+               numMissing++;
+               missingIndex = i;
+            }
+         }
+
+         const uint32 missingSize = fs->_lengthXors[j];
+         if ((numMissing == 1)&&(missingSize <= _maxTransferUnit)&&(_fecScratchBuffer.SetNumBytes(missingSize, false) == B_NO_ERROR))
+         {
+            memcpy(_fecScratchBuffer.GetBuffer(), fs->_xors.GetBuffer()+(j*_maxTransferUnit), missingSize);
+            HandleIncomingFECDataPacket(receiver, *fs, missingIndex, _fecScratchBuffer.GetBuffer(), missingSize, fromIAP);
+         }
+      }
+   }
+}
+
+void PacketTunnelIOGateway :: HandleIncomingFECDataPacket(AbstractGatewayMessageReceiver & receiver, FECReceiveState & fs, uint32 index, const uint8 * payload, uint32 payloadSize, const IPAddressAndPort & fromIAP)
+{
+   while(fs._haveData.GetNumItems() <= index) if (fs._haveData.AddTail(false) != B_NO_ERROR) return;
+   if (fs._haveData[index]) return;  // duplicate packet
+
+   fs._haveData[index] = true;
+   const uint32 j = index%fs._numParity;
+   XorBytes(fs._xors.GetBuffer()+(j*_maxTransferUnit), payload, payloadSize);
+   fs._lengthXors[j] ^= payloadSize;
+
+   if (index == fs._nextIndex)
+   {
+      HandleIncomingPacket(receiver, payload, payloadSize, fromIAP);
+      fs._nextIndex++;
+
+      // Now pass on any held packets that were waiting for this one
+      while((fs._nextIndex < fs._heldPackets.GetNumItems())&&(fs._heldPackets[fs._nextIndex]()))
+      {
+         ByteBufferRef buf = fs._heldPackets[fs._nextIndex];
+         fs._heldPackets[fs._nextIndex].Reset();
+         HandleIncomingPacket(receiver, buf()->GetBuffer(), buf()->GetNumBytes(), fromIAP);
+         fs._nextIndex++;
+      }
+      if (fs._nextIndex >= fs._heldPackets.GetNumItems())
+      {
+         fs._heldPackets.Clear();
+         fs._holdStartTime = MUSCLE_TIME_NEVER;
+      }
+   }
+   else if (index > fs._nextIndex)
+   {
+      // Hold on to this packet until the packets before it have been received or reconstructed, so that the chunks are parsed in order
+      while(fs._heldPackets.GetNumItems() <= index) if (fs._heldPackets.AddTail() != B_NO_ERROR) return;
+      fs._heldPackets[index] = GetByteBufferFromPool(payloadSize, payload);
+      if (fs._holdStartTime == MUSCLE_TIME_NEVER)
+      {
+         fs._holdStartTime = GetRunTime64();
+         InvalidatePulseTime();  // so that Pulse() will pass the held packets on, even if no more packets arrive
+      }
+   }
+}
+
+void PacketTunnelIOGateway :: FlushFECGroup(AbstractGatewayMessageReceiver & receiver, FECReceiveState & fs, const IPAddressAndPort & fromIAP)
+{
+   for (uint32 i=fs._nextIndex; i<fs._heldPackets.GetNumItems(); i++)
+   {
+      ByteBufferRef buf = fs._heldPackets[i];
+      if (buf()) HandleIncomingPacket(receiver, buf()->GetBuffer(), buf()->GetNumBytes(), fromIAP);
+   }
+   // We've given up on the missing packets before the held ones, so any that show up after this are too late to be used.
+   // Any later packets in this group will still be passed on as usual, though.
+   fs._nextIndex = muscleMax(fs._nextIndex, fs._heldPackets.GetNumItems());
+   fs._heldPackets.Clear();
+   fs._holdStartTime = MUSCLE_TIME_NEVER;
+}
+
+void PacketTunnelIOGateway :: FlushExpiredFECGroups(AbstractGatewayMessageReceiver & receiver)
+{
+   const uint64 now = GetRunTime64();
+   for (HashtableIterator<IPAddressAndPort, FECReceiveState> iter(_fecReceiveStates); iter.HasData(); iter++)
+   {
+      FECReceiveState & fs = iter.GetValue();
+      if ((fs._holdStartTime != MUSCLE_TIME_NEVER)&&(now >= fs._holdStartTime+FEC_MAX_HOLD_TIME)) FlushFECGroup(receiver, fs, iter.GetKey());
+   }
+}
+
+uint64 PacketTunnelIOGateway :: GetPulseTime(const PulseArgs & args)
+{
+   uint64 ret = AbstractMessageIOGateway::GetPulseTime(args);
+   for (HashtableIterator<IPAddressAndPort, FECReceiveState> iter(_fecReceiveStates); iter.HasData(); iter++)
+   {
+      const FECReceiveState & fs = iter.GetValue();
+      if (fs._holdStartTime != MUSCLE_TIME_NEVER) ret = muscleMin(ret, fs._holdStartTime+FEC_MAX_HOLD_TIME);
+   }
+   return ret;
+}
+
+void PacketTunnelIOGateway :: Pulse(const PulseArgs & args)
+{
+   AbstractMessageIOGateway::Pulse(args);
+   if ((_fecReceiver)&&(_fecReceiveStates.HasItems())) FlushExpiredFECGroups(*_fecReceiver);
 }
 
 void PacketTunnelIOGateway :: HandleIncomingMessage(AbstractGatewayMessageReceiver & receiver, const ByteBufferRef & buf, const IPAddressAndPort & fromIAP)
@@ -156,7 +398,10 @@ void PacketTunnelIOGateway :: HandleIncomingMessage(AbstractGatewayMessageReceiv
 
 int32 PacketTunnelIOGateway :: DoOutputImplementation(uint32 maxBytes)
 {
-   if (_outputPacketBuffer.SetNumBytes(_maxTransferUnit, false) != B_NO_ERROR) return -1;
+   // Note that we leave room for a group's parity packets after a full batch of data packets.
+   // (This buffer's size must never change while _outputPackets is pointing into it!)
+   if (_outputPacketBuffer.SetNumBytes(_maxTransferUnit*(MAX_PACKETS_PER_BATCH+MAX_FEC_PARITY_PACKETS), false) != B_NO_ERROR) return -1;
+   const uint32 fecHeaderSize = (_fecParityPackets > 0) ? FEC_HEADER_SIZE : 0;
 
    uint32 totalBytesWritten = 0;
    bool firstTime = true;
@@ -164,80 +409,110 @@ int32 PacketTunnelIOGateway :: DoOutputImplementation(uint32 maxBytes)
    {
       firstTime = false;
 
-      // Step 1:  Add as much data to our output packet buffer as we can fit into it
-      while((_outputPacketSize+FRAGMENT_HEADER_SIZE < _maxTransferUnit)&&(HasBytesToOutput()))
+      // Step 1:  Fill up as many output packets as we can, each as full as we can get it
+      while((_outputPackets.GetNumItems() < MAX_PACKETS_PER_BATCH)&&((_currentOutputBuffer())||(GetOutgoingMessageQueue().HasItems())))
       {
-         // Demand-create the next send-buffer
-         if (_currentOutputBuffer() == NULL)
+         uint8 * packetStart = _outputPacketBuffer.GetBuffer()+(_outputPackets.GetNumItems()*_maxTransferUnit);
+         uint32 packetSize = fecHeaderSize;  // if FEC is enabled, we'll fill in the FEC header once we know the payload's size
+         while((packetSize+FRAGMENT_HEADER_SIZE < _maxTransferUnit)&&((_currentOutputBuffer())||(GetOutgoingMessageQueue().HasItems())))
          {
-            MessageRef msg;
-            if (GetOutgoingMessageQueue().RemoveHead(msg) == B_NO_ERROR)
+            // Demand-create the next send-buffer
+            if (_currentOutputBuffer() == NULL)
             {
-               _currentOutputBufferOffset = 0; 
-               _currentOutputBuffer.Reset();
-
-               if (_slaveGateway())
+               MessageRef msg;
+               if (GetOutgoingMessageQueue().RemoveHead(msg) == B_NO_ERROR)
                {
-                  DataIORef oldIO = _slaveGateway()->GetDataIO(); // save slave gateway's old state
+                  _currentOutputBufferOffset = 0; 
+                  _currentOutputBuffer.Reset();
 
-                  // Get the slave gateway to generate its output into our ByteBuffer
-                  _fakeSendBuffer.SetNumBytes(0, false);
-                  _fakeSendIO.Seek(0, DataIO::IO_SEEK_SET);
-                  _slaveGateway()->SetDataIO(DataIORef(&_fakeSendIO, false));
-                  _slaveGateway()->AddOutgoingMessage(msg);
-                  while(_slaveGateway()->DoOutput() > 0) {/* empty */}
+                  if (_slaveGateway())
+                  {
+                     DataIORef oldIO = _slaveGateway()->GetDataIO(); // save slave gateway's old state
 
-                  _slaveGateway()->SetDataIO(oldIO);  // restore slave gateway's old state
-                  _currentOutputBuffer.SetRef(&_fakeSendBuffer, false);
-               }
-               else if (_fakeSendBuffer.SetNumBytes(msg()->FlattenedSize(), false) == B_NO_ERROR)
-               {
-                  // Default algorithm:  Just flatten the Message into the buffer
-                  msg()->Flatten(_fakeSendBuffer.GetBuffer());
-                  _currentOutputBuffer.SetRef(&_fakeSendBuffer, false);
+                     // Get the slave gateway to generate its output into our ByteBuffer
+                     _fakeSendBuffer.SetNumBytes(0, false);
+                     _fakeSendIO.Seek(0, DataIO::IO_SEEK_SET);
+                     _slaveGateway()->SetDataIO(DataIORef(&_fakeSendIO, false));
+                     _slaveGateway()->AddOutgoingMessage(msg);
+                     while(_slaveGateway()->DoOutput() > 0) {/* empty */}
+
+                     _slaveGateway()->SetDataIO(oldIO);  // restore slave gateway's old state
+                     _currentOutputBuffer.SetRef(&_fakeSendBuffer, false);
+                  }
+                  else if (_fakeSendBuffer.SetNumBytes(msg()->FlattenedSize(), false) == B_NO_ERROR)
+                  {
+                     // Default algorithm:  Just flatten the Message into the buffer
+                     msg()->Flatten(_fakeSendBuffer.GetBuffer());
+                     _currentOutputBuffer.SetRef(&_fakeSendBuffer, false);
+                  }
                }
             }
-         }
-         if (_currentOutputBuffer() == NULL) break;   // oops, out of mem?
-
-         uint32 sbSize          = _currentOutputBuffer()->GetNumBytes();
-         uint32 dataBytesToSend = muscleMin(_maxTransferUnit-(_outputPacketSize+FRAGMENT_HEADER_SIZE), sbSize-_currentOutputBufferOffset);
-
-         uint8  * p   = ((uint8 *)_outputPacketBuffer.GetBuffer()) + _outputPacketSize;
-         uint32 * h32 = (uint32 *) p;
-         h32[0] = B_HOST_TO_LENDIAN_INT32(_magic);                      // a well-known magic number, for sanity checking
-         h32[1] = B_HOST_TO_LENDIAN_INT32(_sexID);                      // source exclusion ID
-         h32[2] = B_HOST_TO_LENDIAN_INT32(_sendMessageIDCounter);       // message ID tag so the receiver can track what belongs where
-         h32[3] = B_HOST_TO_LENDIAN_INT32(_currentOutputBufferOffset);  // start offset (within its message) for this sub-chunk
-         h32[4] = B_HOST_TO_LENDIAN_INT32(dataBytesToSend); // size of this sub-chunk
-         h32[5] = B_HOST_TO_LENDIAN_INT32(sbSize);          // total size of this message
+            if (_currentOutputBuffer() == NULL) break;   // oops, out of mem?
+
+            uint32 sbSize          = _currentOutputBuffer()->GetNumBytes();
+            uint32 dataBytesToSend = muscleMin(_maxTransferUnit-(packetSize+FRAGMENT_HEADER_SIZE), sbSize-_currentOutputBufferOffset);
+
+            uint8  * p   = packetStart + packetSize;
+            uint32 * h32 = (uint32 *) p;
+            h32[0] = B_HOST_TO_LENDIAN_INT32(_magic);                      // a well-known magic number, for sanity checking
+            h32[1] = B_HOST_TO_LENDIAN_INT32(_sexID);                      // source exclusion ID
+            h32[2] = B_HOST_TO_LENDIAN_INT32(_sendMessageIDCounter);       // message ID tag so the receiver can track what belongs where
+            h32[3] = B_HOST_TO_LENDIAN_INT32(_currentOutputBufferOffset);  // start offset (within its message) for this sub-chunk
+            h32[4] = B_HOST_TO_LENDIAN_INT32(dataBytesToSend); // size of this sub-chunk
+            h32[5] = B_HOST_TO_LENDIAN_INT32(sbSize);          // total size of this message
 //printf("CREATING PACKET magic=" UINT32_FORMAT_SPEC " msgID=" UINT32_FORMAT_SPEC " offset=" UINT32_FORMAT_SPEC " chunkSize=" UINT32_FORMAT_SPEC " totalSize=" UINT32_FORMAT_SPEC "\n", _magic, _sendMessageIDCounter, _currentOutputBufferOffset, dataBytesToSend, sbSize);
-         memcpy(p+FRAGMENT_HEADER_SIZE, _currentOutputBuffer()->GetBuffer()+_currentOutputBufferOffset, dataBytesToSend);
+            memcpy(p+FRAGMENT_HEADER_SIZE, _currentOutputBuffer()->GetBuffer()+_currentOutputBufferOffset, dataBytesToSend);
 
-         _outputPacketSize += (FRAGMENT_HEADER_SIZE+dataBytesToSend);
-         _currentOutputBufferOffset += dataBytesToSend;
-         if (_currentOutputBufferOffset == sbSize)
+            packetSize += (FRAGMENT_HEADER_SIZE+dataBytesToSend);
+            _currentOutputBufferOffset += dataBytesToSend;
+            if (_currentOutputBufferOffset == sbSize)
+            {
+               _currentOutputBuffer.Reset();
+               _fakeSendBuffer.Clear(_fakeSendBuffer.GetNumBytes() > MAX_CACHE_SIZE);  // don't keep too much memory around!
+               _sendMessageIDCounter++;
+            }
+         }
+
+         if (packetSize == fecHeaderSize) break;  // out of memory?
+         if (fecHeaderSize > 0)
          {
-            _currentOutputBuffer.Reset();
-            _fakeSendBuffer.Clear(_fakeSendBuffer.GetNumBytes() > MAX_CACHE_SIZE);  // don't keep too much memory around!
-            _sendMessageIDCounter++;
+            uint32 * h32 = (uint32 *) packetStart;
+            h32[0] = B_HOST_TO_LENDIAN_INT32(~_magic);
+            h32[1] = B_HOST_TO_LENDIAN_INT32(_fecGroupID);
+            h32[2] = B_HOST_TO_LENDIAN_INT32((_fecNumDataPacketsSent<<16)|(_fecDataPackets<<8)|_fecParityPackets);
+            h32[3] = B_HOST_TO_LENDIAN_INT32(packetSize-fecHeaderSize);
+            AddToFECParity(_fecNumDataPacketsSent, packetStart+fecHeaderSize, packetSize-fecHeaderSize);
+            _fecNumDataPacketsSent++;
          }
+         if (_outputPackets.AddTail(PacketIOVec(packetStart, packetSize)) != B_NO_ERROR) return -1;
+         if ((fecHeaderSize > 0)&&(_fecNumDataPacketsSent == _fecDataPackets)&&(AddFECParityPackets() != B_NO_ERROR)) return -1;
       }
 
-      // Step 2:  If we have a non-empty packet to send, send it!
-      if (_outputPacketSize > 0)
+      // If we've run out of data to send, end the current FEC group now, so that the receivers don't have to wait for its parity packets
+      if ((_fecNumDataPacketsSent > 0)&&(_currentOutputBuffer() == NULL)&&(GetOutgoingMessageQueue().IsEmpty())&&(AddFECParityPackets() != B_NO_ERROR)) return -1;
+
+      // Step 2:  If we have any packets to send, send as many of them as we can, all at once
+      if (_outputPackets.HasItems())
       {
-         // If bytesWritten is set to zero, we just hold this buffer until our next call.
-         int32 bytesWritten = GetDataIO()()->Write(_outputPacketBuffer.GetBuffer(), _outputPacketSize);
-//printf("WROTE " INT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " bytes %s\n", bytesWritten, _outputPacketSize, (bytesWritten==(int32)_outputPacketSize)?"":"******** SHORT ***********");
-         if (bytesWritten > 0)
+         // If no packets are sent, we just hold them until our next call.
+         _outputPackets.Normalize();  // so that we can pass the packets to WritePackets() as an array
+         int32 numPacketsWritten = GetDataIO()()->WritePackets(_outputPackets.HeadPointer(), _outputPackets.GetNumItems());
+//printf("WROTE " INT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " packets\n", numPacketsWritten, _outputPackets.GetNumItems());
+         if (numPacketsWritten > 0)
          {
-            if (bytesWritten != (int32)_outputPacketSize) LogTime(MUSCLE_LOG_ERROR, "PacketTunnelIOGateway::DoOutput():  Short write!  (" INT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " bytes)\n", bytesWritten, _outputPacketSize);
-            _outputPacketBuffer.Clear();
-            _outputPacketSize = 0;
-            totalBytesWritten += bytesWritten;
+            for (int32 i=0; i<numPacketsWritten; i++) totalBytesWritten += _outputPackets[i].GetNumBytes();
+            // Move any unsent packets to the front of our buffer, so that Step 1 can append more packets after them
+            const uint32 numUnsent = _outputPackets.GetNumItems()-numPacketsWritten;
+            for (uint32 i=0; i<numUnsent; i++)
+            {
+               const PacketIOVec & pv = _outputPackets[numPacketsWritten+i];
+               uint8 * dest = _outputPacketBuffer.GetBuffer()+(i*_maxTransferUnit);
+               memmove(dest, pv.GetBytes(), pv.GetNumBytes());
+               _outputPackets[i] = PacketIOVec(dest, pv.GetNumBytes());
+            }
+            while(_outputPackets.GetNumItems() > numUnsent) (void) _outputPackets.RemoveTail();
          }
-         else if (bytesWritten == 0) break;  // no more space to write, for now
+         else if (numPacketsWritten == 0) break;  // no more space to write, for now
          else return -1;
       }
       else break;  // nothing more to do! 
@@ -245,4 +520,38 @@ int32 PacketTunnelIOGateway :: DoOutputImplementation(uint32 maxBytes)
    return totalBytesWritten;
 }
 
+void PacketTunnelIOGateway :: AddToFECParity(uint32 index, const uint8 * payload, uint32 payloadSize)
+{
+   const uint32 j = index%_fecParityPackets;
+   XorBytes(_fecParityBuffer.GetBuffer()+(j*_maxTransferUnit), payload, payloadSize);
+   _fecParitySizes[j] = muscleMax(_fecParitySizes[j], payloadSize);
+   _fecLengthXors[j] ^= payloadSize;
+}
+
+status_t PacketTunnelIOGateway :: AddFECParityPackets()
+{
+   // If the group was ended early, some of its parity packets may not have any data packets to protect
+   const uint32 numParityToSend = muscleMin(_fecParityPackets, _fecNumDataPacketsSent);
+   for (uint32 j=0; j<numParityToSend; j++)
+   {
+      uint8 * packetStart = _outputPacketBuffer.GetBuffer()+(_outputPackets.GetNumItems()*_maxTransferUnit);
+      uint32 * h32 = (uint32 *) packetStart;
+      h32[0] = B_HOST_TO_LENDIAN_INT32(~_magic);
+      h32[1] = B_HOST_TO_LENDIAN_INT32(_fecGroupID);
+      h32[2] = B_HOST_TO_LENDIAN_INT32(((_fecNumDataPacketsSent+j)<<16)|(_fecNumDataPacketsSent<<8)|_fecParityPackets);
+      h32[3] = B_HOST_TO_LENDIAN_INT32(_fecLengthXors[j]);
+
+      uint8 * parity = _fecParityBuffer.GetBuffer()+(j*_maxTransferUnit);
+      memcpy(packetStart+FEC_HEADER_SIZE, parity, _fecParitySizes[j]);
+      if (_outputPackets.AddTail(PacketIOVec(packetStart, FEC_HEADER_SIZE+_fecParitySizes[j])) != B_NO_ERROR) return B_ERROR;
+
+      memset(parity, 0, _fecParitySizes[j]);
+      _fecParitySizes[j] = _fecLengthXors[j] = 0;
+   }
+
+   _fecGroupID++;
+   _fecNumDataPacketsSent = 0;
+   return B_NO_ERROR;
+}
+
 }; // end namespace muscle
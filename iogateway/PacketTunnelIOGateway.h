@@ -19,7 +19,8 @@ namespace muscle {
   * class does not do any automated retransmission of lost data, so if you do use it over UDP
   * (or some other lossy I/O channel), you will need to handle lost Messages at a higher level.
   * If a message fragment is lost over the I/O channel, this class will simply drop the entire message
-  * and continue.
+  * and continue... unless forward error correction is enabled (see SetForwardErrorCorrection()), in
+  * which case the receiver can usually reconstruct the lost packet without any retransmission.
   */
 class PacketTunnelIOGateway : public AbstractMessageIOGateway, private CountedObject<PacketTunnelIOGateway>
 {
@@ -39,7 +40,7 @@ public:
      */
    PacketTunnelIOGateway(const AbstractMessageIOGatewayRef & slaveGateway = AbstractMessageIOGatewayRef(), uint32 maxTransferUnit = MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET, uint32 magic = DEFAULT_TUNNEL_IOGATEWAY_MAGIC);
 
-   virtual bool HasBytesToOutput() const {return ((_currentOutputBuffer())||(GetOutgoingMessageQueue().HasItems()));}
+   virtual bool HasBytesToOutput() const {return ((_outputPackets.HasItems())||(_currentOutputBuffer())||(GetOutgoingMessageQueue().HasItems()));}
 
    /** Sets our slave gateway.  Only necessary if you didn't specify a slave gateway in the constructor. */
    void SetSlaveGateway(const AbstractMessageIOGatewayRef & slaveGateway) {_slaveGateway = slaveGateway;}
@@ -75,9 +76,50 @@ public:
    /** Returns the current source-exclusion ID.  See above for details. */
    uint32 GetSourceExclusionID() const {return _sexID;}
 
+   /** Enables or disables forward error correction (FEC) on our outgoing packets.  When enabled,
+     * our outgoing packets are sent in groups of (numDataPackets), and each group is followed by
+     * (numParityPackets) parity packets.  Parity packet #j holds the XOR of every (numParityPackets)th
+     * data packet in the group, starting with data packet #j, so a receiver can reconstruct any lost
+     * data packet as long as no other data packet (or parity packet) that shares its parity packet
+     * was lost too.  In particular, a burst of up to (numParityPackets) consecutive lost data packets
+     * can always be recovered.  The bandwidth overhead is (numParityPackets/numDataPackets).
+     * <p>
+     * Receivers decode FEC packets automatically, whether or not they have FEC enabled themselves,
+     * but note that older versions of this class don't understand FEC packets and will ignore them.
+     * Whenever we run out of data to send, the current group is ended early (i.e. its parity packets
+     * are sent immediately), so that receivers never have to wait for a lost packet to be reconstructed;
+     * that means the overhead is higher when Messages are sent one at a time.
+     * <p>
+     * A receiver passes on data packets in order, so a data packet that arrives after a missing one
+     * is held until the missing one arrives or is reconstructed.  If that hasn't happened within
+     * 100 milliseconds, the held packets are passed on without it, by our Pulse() callback (or by
+     * DoInput(), if it is called first).  Pulse() passes them to the receiver that was given to our most
+     * recent DoInput() call, so that receiver must still be valid then (as it is when this gateway
+     * belongs to a session in a ReflectServer, which also takes care of calling Pulse()).
+     * @param numDataPackets Number of data packets per group (1-255).
+     * @param numParityPackets Number of parity packets per group (0-16, and no more than (numDataPackets)).
+     *                         Pass 0 to disable FEC (which is the default state).
+     * @returns B_NO_ERROR on success, or B_ERROR if the arguments are out of range or our maximum
+     *          transfer unit is too small to leave room for the FEC header.
+     */
+   status_t SetForwardErrorCorrection(uint32 numDataPackets, uint32 numParityPackets);
+
+   /** Returns the number of data packets per FEC group, as set by SetForwardErrorCorrection(). */
+   uint32 GetFECDataPacketsPerGroup() const {return _fecDataPackets;}
+
+   /** Returns the number of parity packets per FEC group, as set by SetForwardErrorCorrection().  Zero means FEC is disabled. */
+   uint32 GetFECParityPacketsPerGroup() const {return _fecParityPackets;}
+
+   /** Overridden to schedule a callback for when our oldest held FEC data packets should be given up on. */
+   virtual uint64 GetPulseTime(const PulseArgs & args);
+
+   /** Overridden to pass on any held FEC data packets that have been waiting too long for a missing packet. */
+   virtual void Pulse(const PulseArgs & args);
+
 protected:
    /** Implemented to receive packets from various sources and re-assemble them together into
-     * the appropriate Message objects.  Note that when MessageReceived() is called on the
+     * the appropriate Message objects.  Several packets are received at once (via DataIO::ReadPackets())
+     * when possible.  Note that when MessageReceived() is called on the
      * AbstractGatewayMessageReceiver object, the void-pointer argument will point to an
      * IPAddressAndPort object that the callee can use to find out where the incoming Message
      * came from.
@@ -85,11 +127,21 @@ protected:
    virtual int32 DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes);
 
    /** Implemented to send outgoing Messages in a packet-friendly way... i.e. by chopping up
-     * too-large Messages, and batching together too-small Messages.
+     * too-large Messages, and batching together too-small Messages.  Several packets are sent
+     * at once (via DataIO::WritePackets()) when possible.
      */
    virtual int32 DoOutputImplementation(uint32 maxBytes = MUSCLE_NO_LIMIT);
 
 private:
+   class FECReceiveState;
+
+   void HandleIncomingPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes, const IPAddressAndPort & fromIAP);
+   void HandleIncomingFECPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes, const IPAddressAndPort & fromIAP);
+   void HandleIncomingFECDataPacket(AbstractGatewayMessageReceiver & receiver, FECReceiveState & fs, uint32 index, const uint8 * payload, uint32 payloadSize, const IPAddressAndPort & fromIAP);
+   void FlushFECGroup(AbstractGatewayMessageReceiver & receiver, FECReceiveState & fs, const IPAddressAndPort & fromIAP);
+   void FlushExpiredFECGroups(AbstractGatewayMessageReceiver & receiver);
+   void AddToFECParity(uint32 index, const uint8 * payload, uint32 payloadSize);
+   status_t AddFECParityPackets();
    void HandleIncomingMessage(AbstractGatewayMessageReceiver & receiver, const ByteBufferRef & buf, const IPAddressAndPort & fromIAP);
 
    const uint32 _magic;                 // our magic number, used to sanity check packets
@@ -100,9 +152,9 @@ private:
 
    AbstractMessageIOGatewayRef _slaveGateway;
 
-   ByteBuffer _inputPacketBuffer;
-   ByteBuffer _outputPacketBuffer;
-   uint32 _outputPacketSize;
+   ByteBuffer _inputPacketBuffer;    // room for a batch of incoming packets
+   ByteBuffer _outputPacketBuffer;   // room for a batch of outgoing packets
+   Queue<PacketIOVec> _outputPackets;  // filled-in outgoing packets (in _outputPacketBuffer) that haven't been sent yet
 
    uint32 _sendMessageIDCounter;
    ByteBufferRef _currentOutputBuffer;
@@ -114,6 +166,36 @@ private:
    ByteBufferDataIO _fakeReceiveIO;
    uint32 _maxIncomingMessageSize;
 
+   // Forward error correction, sending side
+   uint32 _fecDataPackets;          // data packets per group
+   uint32 _fecParityPackets;        // parity packets per group (zero means FEC is disabled)
+   uint32 _fecGroupID;              // ID of the group we are currently sending
+   uint32 _fecNumDataPacketsSent;   // number of data packets we've sent so far in the current group
+   ByteBuffer _fecParityBuffer;     // the parity payloads-in-progress for the current group, one per _maxTransferUnit bytes
+   Queue<uint32> _fecParitySizes;   // the size of each parity payload-in-progress
+   Queue<uint32> _fecLengthXors;    // the XOR of the payload sizes of each parity packet's data packets
+
+   // Forward error correction, receiving side
+   class FECReceiveState
+   {
+   public:
+      FECReceiveState() : _groupID(0), _numParity(0), _numData(0), _nextIndex(0), _holdStartTime(MUSCLE_TIME_NEVER) {/* empty */}
+
+      uint32 _groupID;
+      uint32 _numParity;
+      uint32 _numData;      // MUSCLE_NO_LIMIT until a parity packet tells us how many data packets the group has
+      uint32 _nextIndex;    // index of the next data packet to pass on to HandleIncomingPacket()
+      uint64 _holdStartTime;  // when we started holding the packets in _heldPackets, or MUSCLE_TIME_NEVER if we aren't holding any
+      Queue<bool> _haveData;      // which data packets we have (received or reconstructed)
+      Queue<bool> _haveParity;    // which parity packets we have received
+      Queue<ByteBufferRef> _heldPackets;  // data packets that arrived after a missing one, waiting for it
+      ByteBuffer _xors;             // for each parity packet, the XOR of it and its data packets that we have
+      Queue<uint32> _lengthXors;    // likewise for the packets' payload sizes
+   };
+   Hashtable<IPAddressAndPort, FECReceiveState> _fecReceiveStates;
+   ByteBuffer _fecScratchBuffer;
+   AbstractGatewayMessageReceiver * _fecReceiver;  // the receiver passed to our most recent DoInput() call, for Pulse() to use
+
    class ReceiveState 
    {
    public:
@@ -0,0 +1,694 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include "iogateway/ReliableUDPIOGateway.h"
+
+namespace muscle {
+
+// Every packet starts with the following fields:
+//    uint32 magic_number
+//    uint32 sender_epoch        (chosen at random when the sending gateway is created or Reset(); in data
+//                                packets, a new one is also chosen whenever the receiver restarts)
+//    uint32 (value<<8)|packet_type
+// A data packet (packet_type RUDP_PACKET_TYPE_DATA, value=stream_id) continues with:
+//    uint32 packet_seq          (one higher for each data packet sent, including retransmissions)
+//    uint32 lowest_unacked_seq  (the sender is no longer waiting for any packet_seq before this one, so the receiver can stop waiting for them too)
+//    uint32 stream_seq          (one higher for each fragment sent on the stream; a retransmitted fragment keeps its stream_seq)
+//    uint32 message_size        (total size of the flattened Message that this fragment is part of)
+//    uint32 fragment_offset     (offset of this fragment within its flattened Message)
+//    ... followed by the fragment's bytes
+// An ack packet (packet_type RUDP_PACKET_TYPE_ACK, value=num_ranges) continues with:
+//    uint32 acked_epoch         (the sender_epoch of the data packets being acknowledged)
+//    uint32 cumulative_ack      (every packet_seq before this one has been received)
+//    (num_ranges) pairs of uint32s, each the [start, end) of a run of packet_seqs received after cumulative_ack
+enum {
+   RUDP_PACKET_TYPE_DATA = 0,
+   RUDP_PACKET_TYPE_ACK
+};
+static const uint32 COMMON_HEADER_SIZE = 3*(sizeof(uint32));
+static const uint32 DATA_HEADER_SIZE   = 8*(sizeof(uint32));
+static const uint32 ACK_HEADER_SIZE    = 5*(sizeof(uint32));
+static const uint32 ACK_RANGE_SIZE     = 2*(sizeof(uint32));
+
+static const uint32 MIN_TRANSFER_UNIT = 64;
+static const uint32 MAX_ACK_RANGES    = 32;  // max number of runs reported in a single ack packet
+static const uint32 MAX_RECEIVED_RANGES = 128; // max number of runs the receiver will keep track of (packets that would start another run are dropped)
+
+// The maximum number of packets to receive, or to send, via a single ReadPackets() or WritePackets() call
+static const uint32 MAX_PACKETS_PER_BATCH = 32;
+
+// Congestion control parameters (window sizes are in packets)
+static const uint32 INITIAL_CONGESTION_WINDOW = 10;
+static const uint32 MIN_CONGESTION_WINDOW     = 2;
+static const uint32 MAX_CONGESTION_WINDOW     = 1024;  // also bounds how far ahead of its cumulative ack (and its next in-order fragment) the receiver will accept packets, and how many fragments it will hold
+static const uint32 PACKET_REORDER_THRESHOLD  = 3;     // a packet is lost once this many later packets have been acknowledged
+
+// Retransmission timeout parameters (in microseconds)
+static const uint64 INITIAL_RETRANSMIT_TIMEOUT = 250*1000;
+static const uint64 MIN_RETRANSMIT_TIMEOUT     = 100*1000;
+static const uint64 MAX_RETRANSMIT_TIMEOUT     = 5*1000*1000;
+
+// Each congestion window's worth of packets is paced out over (4/5) of a round trip, but we'll
+// allow up to this many microseconds' worth of unused pacing credit to be sent in a burst, since
+// the clock (and the event loop) won't always wake us up exactly when the next packet is due.
+static const uint64 MAX_PACING_BURST_MICROS = 10*1000;
+
+// Returns true iff sequence number (a) comes before sequence number (b), taking wraparound into account
+static inline bool IsSeqBefore(uint32 a, uint32 b) {return ((int32)(a-b) < 0);}
+
+// Returns a new randomly-chosen epoch value that is different from (oldEpoch)
+static uint32 ChooseNewEpoch(const void * gateway, uint32 oldEpoch)
+{
+   const uint32 ret = ((uint32)GetRunTime64())^((uint32)((uintptr)gateway))^((uint32)rand());
+   return (ret == oldEpoch) ? (ret+1) : ret;
+}
+
+ReliableUDPIOGateway :: ReliableUDPIOGateway(uint32 maxTransferUnit, uint32 magic) : _magic(magic), _maxTransferUnit(muscleMax(maxTransferUnit, MIN_TRANSFER_UNIT)), _maxIncomingMessageSize(MUSCLE_NO_LIMIT), _epoch(0), _sendEpoch(0)
+{
+   ResetConnectionState();
+}
+
+void ReliableUDPIOGateway :: Reset()
+{
+   AbstractMessageIOGateway::Reset();
+   ResetConnectionState();
+}
+
+void ReliableUDPIOGateway :: ResetConnectionState()
+{
+   _epoch     = ChooseNewEpoch(this, _epoch);
+   _sendEpoch = _epoch;
+
+   _outgoingStreams.Clear();
+   _readyStreams.Clear();
+   ResetSendState();
+   _havePeerAckEpoch = false;
+   _peerAckEpoch     = 0;
+
+   _havePeerEpoch         = false;
+   _peerEpoch             = 0;
+   _previousPeerEpoch     = 0;
+   _receivedCumulativeSeq = 0;
+   _receivedRanges.Clear();
+   _ackPending            = false;
+   _incomingStreams.Clear();
+   _numHeldFragments      = 0;
+}
+
+void ReliableUDPIOGateway :: ResetSendState()
+{
+   _pendingPackets.Clear();
+   _inFlight.Clear();
+   _nextPacketSeq           = 0;
+   _largestAckedSeq         = _nextPacketSeq-1;
+   _recoveryStartSeq        = _nextPacketSeq;
+   _congestionWindow        = INITIAL_CONGESTION_WINDOW;
+   _slowStartThreshold      = MAX_CONGESTION_WINDOW;
+   _windowIncreaseCount     = 0;
+   _haveRTTSample           = false;
+   _smoothedRTT             = 0;
+   _rttVariance             = 0;
+   _retransmitTimeout       = INITIAL_RETRANSMIT_TIMEOUT;
+   _nextPacedSendTime       = 0;
+   _numPacketsSent          = 0;
+   _numPacketsRetransmitted = 0;
+
+   // Our peer's receive state starts over along with ours, so each stream's current Message (if any) has to be sent again from its beginning
+   for (HashtableIterator<uint16, OutgoingStream> iter(_outgoingStreams); iter.HasData(); iter++)
+   {
+      OutgoingStream & stream = iter.GetValue();
+      stream._flatOffset    = 0;
+      stream._nextStreamSeq = 0;
+   }
+}
+
+status_t ReliableUDPIOGateway :: SetStreamForWhatCode(uint32 whatCode, uint16 streamID)
+{
+   if (streamID == 0)
+   {
+      (void) _whatCodeStreams.Remove(whatCode);
+      return B_NO_ERROR;
+   }
+   return _whatCodeStreams.Put(whatCode, streamID);
+}
+
+uint16 ReliableUDPIOGateway :: GetStreamIDForOutgoingMessage(const MessageRef & msg) const
+{
+   const uint16 * streamID = _whatCodeStreams.Get(msg()->what);
+   return streamID ? *streamID : 0;
+}
+
+bool ReliableUDPIOGateway :: IsSendAllowed(uint64 now, uint32 numExtraPackets) const
+{
+   return ((_inFlight.GetNumItems()+numExtraPackets < _congestionWindow)&&(_nextPacedSendTime <= now));
+}
+
+bool ReliableUDPIOGateway :: HasBytesToOutput() const
+{
+   return ((_ackPending)||((HasDataToSend())&&(IsSendAllowed(GetRunTime64(), 0))));
+}
+
+uint64 ReliableUDPIOGateway :: GetPulseTime(const PulseArgs & args)
+{
+   uint64 ret = AbstractMessageIOGateway::GetPulseTime(args);
+   if (_inFlight.HasItems()) ret = muscleMin(ret, _inFlight.GetFirstValue()->_sendTime+_retransmitTimeout);
+   if ((HasDataToSend())&&(_inFlight.GetNumItems() < _congestionWindow)&&(_nextPacedSendTime > args.GetCallbackTime())) ret = muscleMin(ret, _nextPacedSendTime);
+   return ret;
+}
+
+void ReliableUDPIOGateway :: Pulse(const PulseArgs & args)
+{
+   AbstractMessageIOGateway::Pulse(args);
+   CheckForRetransmitTimeout(args.GetCallbackTime());
+}
+
+int32 ReliableUDPIOGateway :: DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes)
+{
+   if (_inputPacketBuffer.SetNumBytes(_maxTransferUnit*MAX_PACKETS_PER_BATCH, false) != B_NO_ERROR) return -1;
+
+   PacketIOVec packets[MAX_PACKETS_PER_BATCH];
+
+   bool firstTime = true;
+   uint32 totalBytesRead = 0;
+   while((totalBytesRead < maxBytes)&&((firstTime)||(IsSuggestedTimeSliceExpired() == false)))
+   {
+      firstTime = false;
+
+      const uint32 numPackets = muscleMax((uint32)1, muscleMin(MAX_PACKETS_PER_BATCH, (maxBytes-totalBytesRead)/_maxTransferUnit));
+      for (uint32 i=0; i<numPackets; i++) packets[i] = PacketIOVec(_inputPacketBuffer.GetBuffer()+(i*_maxTransferUnit), _maxTransferUnit);
+
+      int32 numPacketsRead = GetDataIO()()->ReadPackets(packets, numPackets);
+      if (numPacketsRead > 0)
+      {
+         for (int32 i=0; i<numPacketsRead; i++)
+         {
+            const uint32 bytesRead = packets[i].GetNumBytes();
+            totalBytesRead += bytesRead;
+            HandleIncomingPacket(receiver, (const uint8 *) packets[i].GetBytes(), bytesRead);
+         }
+      }
+      else if (numPacketsRead < 0) return -1;
+      else break;
+   }
+
+   if (totalBytesRead > 0) InvalidatePulseTime();  // since acks may have changed our timeouts
+   return totalBytesRead;
+}
+
+void ReliableUDPIOGateway :: HandleIncomingPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes)
+{
+   if (numBytes < COMMON_HEADER_SIZE) return;
+
+   const uint32 * h32 = (const uint32 *) packetBytes;
+   if ((uint32)B_LENDIAN_TO_HOST_INT32(h32[0]) != _magic) return;  // not one of ours
+
+   const uint32 epoch    = B_LENDIAN_TO_HOST_INT32(h32[1]);
+   const uint32 typeWord = B_LENDIAN_TO_HOST_INT32(h32[2]);
+   const uint32 value    = (typeWord>>8);
+   switch(typeWord&0xFF)
+   {
+      case RUDP_PACKET_TYPE_DATA:
+         if ((numBytes >= DATA_HEADER_SIZE)&&(value <= 0xFFFF)) HandleIncomingDataPacket(receiver, epoch, (uint16)value, packetBytes, numBytes);
+      break;
+
+      case RUDP_PACKET_TYPE_ACK:
+         if ((numBytes >= ACK_HEADER_SIZE)&&(value <= (numBytes-ACK_HEADER_SIZE)/ACK_RANGE_SIZE)) HandleIncomingAck(epoch, B_LENDIAN_TO_HOST_INT32(h32[3]), B_LENDIAN_TO_HOST_INT32(h32[4]), h32+5, value);
+      break;
+
+      default:
+         LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Ignoring packet of unknown type " UINT32_FORMAT_SPEC "\n", typeWord&0xFF);
+      break;
+   }
+}
+
+void ReliableUDPIOGateway :: HandleIncomingDataPacket(AbstractGatewayMessageReceiver & receiver, uint32 epoch, uint16 streamID, const uint8 * packetBytes, uint32 numBytes)
+{
+   if ((_havePeerEpoch == false)||(epoch != _peerEpoch))
+   {
+      if ((_havePeerEpoch)&&(epoch == _previousPeerEpoch)) return;  // a straggler from before our peer's epoch changed
+
+      // Our peer is new, or has restarted, so whatever we knew about its previous packets no longer applies
+      if (_havePeerEpoch) LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Peer's epoch changed from " UINT32_FORMAT_SPEC " to " UINT32_FORMAT_SPEC ", resetting receive state.\n", _peerEpoch, epoch);
+      _previousPeerEpoch     = _peerEpoch;
+      _havePeerEpoch         = true;
+      _peerEpoch             = epoch;
+      _receivedCumulativeSeq = 0;
+      _receivedRanges.Clear();
+      _incomingStreams.Clear();
+      _numHeldFragments      = 0;
+   }
+
+   // We ack even duplicate and dropped packets, since a duplicate probably means our previous ack got lost,
+   // and our ack's epoch is how a peer that didn't know we restarted finds out about it
+   _ackPending = true;
+
+   const uint32 * h32 = (const uint32 *) packetBytes;
+   const uint32 packetSeq = B_LENDIAN_TO_HOST_INT32(h32[3]);
+   const uint32 floorSeq  = B_LENDIAN_TO_HOST_INT32(h32[4]);
+   if (IsSeqBefore(packetSeq, floorSeq) == false) AdvanceReceivedCumulativeSeq(floorSeq);
+   if (IsSeqBefore(packetSeq, _receivedCumulativeSeq+MAX_CONGESTION_WINDOW) == false) return;  // too far ahead; it will be resent later
+
+   IncomingStream * stream = _incomingStreams.GetOrPut(streamID);
+   if (stream == NULL) {WARN_OUT_OF_MEMORY; return;}
+
+   // If we'd have to hold on to this fragment but are already holding too many, we drop it (unacknowledged, so it will be resent)
+   const uint32 streamSeq = B_LENDIAN_TO_HOST_INT32(h32[5]);
+   const bool mustHold = ((IsSeqBefore(stream->_nextStreamSeq, streamSeq))&&(stream->_heldFragments.ContainsKey(streamSeq) == false));
+   if ((mustHold)&&((_numHeldFragments >= MAX_CONGESTION_WINDOW)||(IsSeqBefore(streamSeq, stream->_nextStreamSeq+MAX_CONGESTION_WINDOW) == false))) return;
+
+   if (RecordReceivedPacketSeq(packetSeq) == false) return;  // duplicate packet (or one we have no room to keep track of)
+
+   if (streamSeq == stream->_nextStreamSeq)
+   {
+      HandleIncomingFragment(receiver, *stream, packetBytes, numBytes);
+      stream->_nextStreamSeq++;
+
+      // Now process any fragments that arrived early and were waiting for this one
+      ByteBufferRef held;
+      while(stream->_heldFragments.Remove(stream->_nextStreamSeq, held) == B_NO_ERROR)
+      {
+         _numHeldFragments--;
+         HandleIncomingFragment(receiver, *stream, held()->GetBuffer(), held()->GetNumBytes());
+         stream->_nextStreamSeq++;
+      }
+   }
+   else if (mustHold)
+   {
+      ByteBufferRef buf = GetByteBufferFromPool(numBytes, packetBytes);
+      if ((buf())&&(stream->_heldFragments.Put(streamSeq, buf) == B_NO_ERROR)) _numHeldFragments++;
+                                                                        else WARN_OUT_OF_MEMORY;
+   }
+   // else it's a fragment we already have (i.e. it was retransmitted unnecessarily), so we can ignore it
+}
+
+void ReliableUDPIOGateway :: HandleIncomingFragment(AbstractGatewayMessageReceiver & receiver, IncomingStream & stream, const uint8 * packetBytes, uint32 numBytes)
+{
+   const uint32 * h32        = (const uint32 *) packetBytes;
+   const uint32 messageSize  = B_LENDIAN_TO_HOST_INT32(h32[6]);
+   const uint32 offset       = B_LENDIAN_TO_HOST_INT32(h32[7]);
+   const uint8 * fragment    = packetBytes+DATA_HEADER_SIZE;
+   const uint32 fragmentSize = numBytes-DATA_HEADER_SIZE;
+
+   if (offset == 0)
+   {
+      // A new Message is starting
+      stream._messageBuf.Reset();
+      stream._messageOffset = 0;
+      if (messageSize > _maxIncomingMessageSize)
+      {
+         LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Ignoring incoming Message of size " UINT32_FORMAT_SPEC " (max is " UINT32_FORMAT_SPEC ")\n", messageSize, _maxIncomingMessageSize);
+         return;
+      }
+
+      stream._messageBuf = GetByteBufferFromPool(messageSize);
+      if (stream._messageBuf() == NULL) {WARN_OUT_OF_MEMORY; return;}
+   }
+
+   ByteBuffer * buf = stream._messageBuf();
+   if (buf == NULL) return;  // we're skipping the rest of a Message that we couldn't accept
+
+   if ((offset != stream._messageOffset)||(messageSize != buf->GetNumBytes())||(fragmentSize > messageSize-offset))
+   {
+      LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Inconsistent fragment (" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC "), dropping its Message.\n", offset, fragmentSize, messageSize);
+      stream._messageBuf.Reset();
+      return;
+   }
+
+   memcpy(buf->GetBuffer()+offset, fragment, fragmentSize);
+   stream._messageOffset += fragmentSize;
+   if (stream._messageOffset == messageSize)
+   {
+      MessageRef msg = GetMessageFromPool();
+      if ((msg())&&(msg()->Unflatten(buf->GetBuffer(), buf->GetNumBytes()) == B_NO_ERROR)) receiver.CallMessageReceivedFromGateway(msg);
+                                                                                      else LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Couldn't unflatten incoming Message of size " UINT32_FORMAT_SPEC "\n", messageSize);
+      stream._messageBuf.Reset();
+      stream._messageOffset = 0;
+   }
+}
+
+bool ReliableUDPIOGateway :: RecordReceivedPacketSeq(uint32 packetSeq)
+{
+   if (IsSeqBefore(packetSeq, _receivedCumulativeSeq)) return false;  // we already got that one
+
+   if (packetSeq == _receivedCumulativeSeq)
+   {
+      _receivedCumulativeSeq++;
+      if ((_receivedRanges.HasItems())&&(_receivedRanges.Head()._start == _receivedCumulativeSeq))
+      {
+         // This packet filled the gap before our first run, so the cumulative ack now covers that run also
+         _receivedCumulativeSeq = _receivedRanges.Head()._end;
+         (void) _receivedRanges.RemoveHead();
+      }
+      return true;
+   }
+
+   // Find the first run that doesn't end before (packetSeq).  We search from the back, since new packets usually arrive after all of our runs.
+   const uint32 numRanges = _receivedRanges.GetNumItems();
+   uint32 i = numRanges;
+   while((i > 0)&&(IsSeqBefore(_receivedRanges[i-1]._end, packetSeq) == false)) i--;
+
+   if (i == numRanges) return ((numRanges < MAX_RECEIVED_RANGES)&&(_receivedRanges.AddTail(SeqRange(packetSeq, packetSeq+1)) == B_NO_ERROR));
+
+   SeqRange & r = _receivedRanges[i];
+   if (r._end == packetSeq)
+   {
+      // Extend the run by one, and merge it with the next run if they now touch
+      r._end++;
+      if ((i+1 < numRanges)&&(_receivedRanges[i+1]._start == r._end))
+      {
+         r._end = _receivedRanges[i+1]._end;
+         (void) _receivedRanges.RemoveItemAt(i+1);
+      }
+      return true;
+   }
+   if (IsSeqBefore(packetSeq, r._start) == false) return false;  // it's inside the run, so we already got it
+   if (r._start == packetSeq+1)
+   {
+      r._start = packetSeq;
+      return true;
+   }
+   return ((numRanges < MAX_RECEIVED_RANGES)&&(_receivedRanges.InsertItemAt(i, SeqRange(packetSeq, packetSeq+1)) == B_NO_ERROR));
+}
+
+void ReliableUDPIOGateway :: AdvanceReceivedCumulativeSeq(uint32 packetSeq)
+{
+   if (IsSeqBefore(_receivedCumulativeSeq, packetSeq) == false) return;
+
+   // The sender has given up on every packet before (packetSeq) (it resent their contents in later packets), so we can stop waiting for them
+   _receivedCumulativeSeq = packetSeq;
+   while((_receivedRanges.HasItems())&&(IsSeqBefore(_receivedCumulativeSeq, _receivedRanges.Head()._start) == false))
+   {
+      if (IsSeqBefore(_receivedCumulativeSeq, _receivedRanges.Head()._end)) _receivedCumulativeSeq = _receivedRanges.Head()._end;
+      (void) _receivedRanges.RemoveHead();
+   }
+}
+
+void ReliableUDPIOGateway :: HandleIncomingAck(uint32 ackerEpoch, uint32 ackedEpoch, uint32 cumulativeAck, const uint32 * ranges, uint32 numRanges)
+{
+   if (ackedEpoch != _sendEpoch) return;  // it's acknowledging packets we sent before we (or our peer) were Reset()
+
+   if ((_havePeerAckEpoch)&&(ackerEpoch != _peerAckEpoch))
+   {
+      // Our peer has restarted, so it will never finish reassembling anything we sent before; start over with a new epoch
+      LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Peer restarted (epoch " UINT32_FORMAT_SPEC " -> " UINT32_FORMAT_SPEC "), resetting send state.\n", _peerAckEpoch, ackerEpoch);
+      _peerAckEpoch = ackerEpoch;
+      _sendEpoch    = ChooseNewEpoch(this, _sendEpoch);
+      ResetSendState();
+      return;
+   }
+   _havePeerAckEpoch = true;
+   _peerAckEpoch     = ackerEpoch;
+
+   const uint64 now = GetRunTime64();
+   uint32 numAcked = 0;
+   uint32 largestAckedSeq = 0;
+   uint64 largestAckedSendTime = 0;
+
+   // Since our in-flight packets are in the order they were sent, the cumulative part of the ack just removes them from the front
+   while(_inFlight.HasItems())
+   {
+      const uint32 seq = *_inFlight.GetFirstKey();
+      if (IsSeqBefore(seq, cumulativeAck) == false) break;
+      PacketAcknowledged(seq, *_inFlight.GetFirstValue(), numAcked, largestAckedSeq, largestAckedSendTime);
+      (void) _inFlight.RemoveFirst();
+   }
+
+   // Then each run removes the in-flight packets it covers
+   for (uint32 i=0; ((i<numRanges)&&(_inFlight.HasItems())); i++)
+   {
+      uint32 start     = B_LENDIAN_TO_HOST_INT32(ranges[2*i]);
+      const uint32 end = B_LENDIAN_TO_HOST_INT32(ranges[(2*i)+1]);
+      const uint32 firstSeq = *_inFlight.GetFirstKey();
+      if (IsSeqBefore(start, firstSeq)) start = firstSeq;  // no sense checking for packets that aren't in flight
+      for (uint32 seq=start; ((IsSeqBefore(seq, end))&&(IsSeqBefore(seq, _nextPacketSeq))); seq++)
+      {
+         SentPacket sp;
+         if (_inFlight.Remove(seq, sp) == B_NO_ERROR) PacketAcknowledged(seq, sp, numAcked, largestAckedSeq, largestAckedSendTime);
+      }
+   }
+   if (numAcked == 0) return;
+
+   UpdateRoundTripTime(now-largestAckedSendTime);
+   if (IsSeqBefore(_largestAckedSeq, largestAckedSeq)) _largestAckedSeq = largestAckedSeq;
+
+   // Any packet sent sufficiently long before the largest acknowledged packet is presumed lost
+   while(_inFlight.HasItems())
+   {
+      const uint32 seq = *_inFlight.GetFirstKey();
+      if ((int32)(_largestAckedSeq-seq) < (int32)PACKET_REORDER_THRESHOLD) break;
+      PacketLost(seq, *_inFlight.GetFirstValue());
+      (void) _inFlight.RemoveFirst();
+   }
+}
+
+void ReliableUDPIOGateway :: PacketAcknowledged(uint32 packetSeq, const SentPacket & sp, uint32 & numAcked, uint32 & largestAckedSeq, uint64 & largestAckedSendTime)
+{
+   if ((numAcked == 0)||(IsSeqBefore(largestAckedSeq, packetSeq)))
+   {
+      largestAckedSeq      = packetSeq;
+      largestAckedSendTime = sp._sendTime;
+   }
+   numAcked++;
+
+   // Packets that were sent before our last window reduction don't grow the window
+   if (IsSeqBefore(packetSeq, _recoveryStartSeq)) return;
+
+   if (_congestionWindow < _slowStartThreshold) _congestionWindow++;  // slow start:  the window doubles every round trip
+   else if (++_windowIncreaseCount >= _congestionWindow)
+   {
+      // congestion avoidance:  the window grows by one packet every round trip
+      _windowIncreaseCount = 0;
+      _congestionWindow++;
+   }
+   _congestionWindow = muscleMin(_congestionWindow, MAX_CONGESTION_WINDOW);
+}
+
+void ReliableUDPIOGateway :: PacketLost(uint32 packetSeq, const SentPacket & sp)
+{
+   if (_pendingPackets.AddTail(sp._packet) != B_NO_ERROR) WARN_OUT_OF_MEMORY;
+   _numPacketsRetransmitted++;
+
+   // Only the first loss in each round trip shrinks the window, since the other losses are probably from the same congestion event
+   if (IsSeqBefore(packetSeq, _recoveryStartSeq) == false)
+   {
+      _slowStartThreshold  = muscleMax(_congestionWindow/2, MIN_CONGESTION_WINDOW);
+      _congestionWindow    = _slowStartThreshold;
+      _windowIncreaseCount = 0;
+      _recoveryStartSeq    = _nextPacketSeq;
+   }
+}
+
+void ReliableUDPIOGateway :: UpdateRoundTripTime(uint64 sample)
+{
+   // As per RFC 6298
+   if (_haveRTTSample)
+   {
+      const uint64 delta = (sample > _smoothedRTT) ? (sample-_smoothedRTT) : (_smoothedRTT-sample);
+      _rttVariance = ((3*_rttVariance)+delta)/4;
+      _smoothedRTT = ((7*_smoothedRTT)+sample)/8;
+   }
+   else
+   {
+      _haveRTTSample = true;
+      _smoothedRTT   = sample;
+      _rttVariance   = sample/2;
+   }
+   _retransmitTimeout = muscleClamp(_smoothedRTT+(4*_rttVariance), MIN_RETRANSMIT_TIMEOUT, MAX_RETRANSMIT_TIMEOUT);
+}
+
+void ReliableUDPIOGateway :: CheckForRetransmitTimeout(uint64 now)
+{
+   if ((_inFlight.HasItems())&&(now >= _inFlight.GetFirstValue()->_sendTime+_retransmitTimeout))
+   {
+      // Nothing has been acknowledged for a whole timeout period, so we'll assume everything in flight
+      // was lost, and start over with a minimal window and a longer timeout, as TCP does.
+      LogTime(MUSCLE_LOG_DEBUG, "ReliableUDPIOGateway:  Retransmit timeout (" UINT64_FORMAT_SPEC " microseconds), resending " UINT32_FORMAT_SPEC " packets.\n", _retransmitTimeout, _inFlight.GetNumItems());
+      _slowStartThreshold  = muscleMax(_congestionWindow/2, MIN_CONGESTION_WINDOW);
+      _congestionWindow    = MIN_CONGESTION_WINDOW;
+      _windowIncreaseCount = 0;
+      _recoveryStartSeq    = _nextPacketSeq;
+      _retransmitTimeout   = muscleMin(_retransmitTimeout*2, MAX_RETRANSMIT_TIMEOUT);
+      while(_inFlight.HasItems())
+      {
+         if (_pendingPackets.AddTail(_inFlight.GetFirstValue()->_packet) != B_NO_ERROR) WARN_OUT_OF_MEMORY;
+         _numPacketsRetransmitted++;
+         (void) _inFlight.RemoveFirst();
+      }
+      InvalidatePulseTime();
+   }
+}
+
+void ReliableUDPIOGateway :: AdvancePacingClock(uint64 now)
+{
+   if (_haveRTTSample == false) return;  // until we know the round-trip time, the initial window is our only limit
+
+   const uint64 interval     = (_smoothedRTT*4)/(((uint64)_congestionWindow)*5);
+   const uint64 earliestTime = (now > MAX_PACING_BURST_MICROS) ? (now-MAX_PACING_BURST_MICROS) : 0;
+   _nextPacedSendTime = muscleMax(_nextPacedSendTime, earliestTime)+interval;
+}
+
+status_t ReliableUDPIOGateway :: EnqueueOutgoingMessage(const MessageRef & msg)
+{
+   const uint16 streamID = GetStreamIDForOutgoingMessage(msg);
+   OutgoingStream * stream = _outgoingStreams.GetOrPut(streamID);
+   if (stream == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   const bool wasIdle = ((stream->_messages.IsEmpty())&&(stream->_flatMessage() == NULL));
+   if ((stream->_messages.AddTail(msg) != B_NO_ERROR)||((wasIdle)&&(_readyStreams.AddTail(streamID) != B_NO_ERROR))) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   return B_NO_ERROR;
+}
+
+ByteBufferRef ReliableUDPIOGateway :: GetNextFragmentPacket()
+{
+   uint16 streamID;
+   while(_readyStreams.RemoveHead(streamID) == B_NO_ERROR)
+   {
+      OutgoingStream * stream = _outgoingStreams.Get(streamID);
+      if (stream == NULL) continue;
+
+      if (stream->_flatMessage() == NULL)
+      {
+         MessageRef msg;
+         if (stream->_messages.RemoveHead(msg) != B_NO_ERROR) continue;
+
+         stream->_flatMessage = GetByteBufferFromPool(msg()->FlattenedSize());
+         if (stream->_flatMessage() == NULL)
+         {
+            WARN_OUT_OF_MEMORY;
+            (void) stream->_messages.AddHead(msg);
+            (void) _readyStreams.AddHead(streamID);
+            return ByteBufferRef();
+         }
+         msg()->Flatten(stream->_flatMessage()->GetBuffer());
+         stream->_flatOffset = 0;
+      }
+
+      const uint32 messageSize  = stream->_flatMessage()->GetNumBytes();
+      const uint32 fragmentSize = muscleMin(_maxTransferUnit-DATA_HEADER_SIZE, messageSize-stream->_flatOffset);
+      ByteBufferRef packet = GetByteBufferFromPool(DATA_HEADER_SIZE+fragmentSize);
+      if (packet() == NULL)
+      {
+         WARN_OUT_OF_MEMORY;
+         (void) _readyStreams.AddHead(streamID);
+         return ByteBufferRef();
+      }
+
+      uint8 * p = packet()->GetBuffer();
+      uint32 * h32 = (uint32 *) p;
+      h32[0] = B_HOST_TO_LENDIAN_INT32(_magic);
+      h32[1] = 0;  // epoch will be filled in when the packet is sent
+      h32[2] = B_HOST_TO_LENDIAN_INT32((((uint32)streamID)<<8)|RUDP_PACKET_TYPE_DATA);
+      h32[3] = 0;  // packet sequence number will be filled in when the packet is sent
+      h32[4] = 0;  // ditto for the lowest unacknowledged sequence number
+      h32[5] = B_HOST_TO_LENDIAN_INT32(stream->_nextStreamSeq++);
+      h32[6] = B_HOST_TO_LENDIAN_INT32(messageSize);
+      h32[7] = B_HOST_TO_LENDIAN_INT32(stream->_flatOffset);
+      memcpy(p+DATA_HEADER_SIZE, stream->_flatMessage()->GetBuffer()+stream->_flatOffset, fragmentSize);
+
+      stream->_flatOffset += fragmentSize;
+      if (stream->_flatOffset == messageSize) stream->_flatMessage.Reset();
+
+      // Go to the back of the line, so that the other streams get their turns
+      if (((stream->_flatMessage())||(stream->_messages.HasItems()))&&(_readyStreams.AddTail(streamID) != B_NO_ERROR)) WARN_OUT_OF_MEMORY;
+      return packet;
+   }
+   return ByteBufferRef();
+}
+
+int32 ReliableUDPIOGateway :: SendAck()
+{
+   // If there are too many runs to fit, we report the most recent ones, since they're the most useful to the sender
+   const uint32 numRanges  = muscleMin(_receivedRanges.GetNumItems(), MAX_ACK_RANGES, (_maxTransferUnit-ACK_HEADER_SIZE)/ACK_RANGE_SIZE);
+   const uint32 firstRange = _receivedRanges.GetNumItems()-numRanges;
+   const uint32 ackSize    = ACK_HEADER_SIZE+(numRanges*ACK_RANGE_SIZE);
+   if (_ackBuffer.SetNumBytes(ackSize, false) != B_NO_ERROR) return -1;
+
+   uint32 * h32 = (uint32 *) _ackBuffer.GetBuffer();
+   h32[0] = B_HOST_TO_LENDIAN_INT32(_magic);
+   h32[1] = B_HOST_TO_LENDIAN_INT32(_epoch);
+   h32[2] = B_HOST_TO_LENDIAN_INT32((numRanges<<8)|RUDP_PACKET_TYPE_ACK);
+   h32[3] = B_HOST_TO_LENDIAN_INT32(_peerEpoch);
+   h32[4] = B_HOST_TO_LENDIAN_INT32(_receivedCumulativeSeq);
+   for (uint32 i=0; i<numRanges; i++)
+   {
+      const SeqRange & r = _receivedRanges[firstRange+i];
+      h32[5+(2*i)]   = B_HOST_TO_LENDIAN_INT32(r._start);
+      h32[5+(2*i)+1] = B_HOST_TO_LENDIAN_INT32(r._end);
+   }
+
+   const int32 bytesWritten = GetDataIO()()->Write(_ackBuffer.GetBuffer(), ackSize);
+   if (bytesWritten == (int32)ackSize) _ackPending = false;
+   return bytesWritten;
+}
+
+int32 ReliableUDPIOGateway :: DoOutputImplementation(uint32 maxBytes)
+{
+   const uint64 now = GetRunTime64();
+   CheckForRetransmitTimeout(now);
+
+   // Sort any newly queued Messages into their streams
+   MessageRef msg;
+   while(GetOutgoingMessageQueue().RemoveHead(msg) == B_NO_ERROR) if (EnqueueOutgoingMessage(msg) != B_NO_ERROR) return -1;
+
+   uint32 totalBytesWritten = 0;
+   if (_ackPending)
+   {
+      const int32 ackBytesWritten = SendAck();
+      if (ackBytesWritten < 0) return -1;
+      totalBytesWritten += ackBytesWritten;
+   }
+
+   ByteBufferRef batch[MAX_PACKETS_PER_BATCH];
+   PacketIOVec packets[MAX_PACKETS_PER_BATCH];
+   uint64 pacedSendTimes[MAX_PACKETS_PER_BATCH];
+   bool firstTime = true;
+   while((totalBytesWritten < maxBytes)&&((firstTime)||(IsSuggestedTimeSliceExpired() == false)))
+   {
+      firstTime = false;
+
+      // Gather up as many packets as our congestion window and our pacing will let us send right now
+      uint32 numPackets = 0;
+      while((numPackets < MAX_PACKETS_PER_BATCH)&&(IsSendAllowed(now, numPackets)))
+      {
+         ByteBufferRef packet;
+         if (_pendingPackets.RemoveHead(packet) != B_NO_ERROR) packet = GetNextFragmentPacket();
+         if (packet() == NULL) break;  // nothing more to send (or out of memory)
+
+         uint32 * h32 = (uint32 *) packet()->GetBuffer();
+         h32[1] = B_HOST_TO_LENDIAN_INT32(_sendEpoch);
+         h32[3] = B_HOST_TO_LENDIAN_INT32(_nextPacketSeq+numPackets);
+         h32[4] = B_HOST_TO_LENDIAN_INT32(_inFlight.HasItems() ? *_inFlight.GetFirstKey() : _nextPacketSeq);
+
+         pacedSendTimes[numPackets] = _nextPacedSendTime;
+         AdvancePacingClock(now);
+
+         batch[numPackets]   = packet;
+         packets[numPackets] = PacketIOVec(packet()->GetBuffer(), packet()->GetNumBytes());
+         numPackets++;
+      }
+      if (numPackets == 0) break;
+
+      const int32 numWritten = GetDataIO()()->WritePackets(packets, numPackets);
+      if (numWritten < 0) return -1;
+
+      for (int32 i=0; i<numWritten; i++)
+      {
+         if (_inFlight.Put(_nextPacketSeq++, SentPacket(batch[i], now)) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return -1;}
+         totalBytesWritten += batch[i]()->GetNumBytes();
+         _numPacketsSent++;
+      }
+
+      if ((uint32)numWritten < numPackets)
+      {
+         // The DataIO's output buffer is full, so we'll hold on to the unsent packets (in order) until next time
+         _nextPacedSendTime = pacedSendTimes[numWritten];
+         for (int32 i=((int32)numPackets)-1; i>=numWritten; i--) if (_pendingPackets.AddHead(batch[i]) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return -1;}
+         break;
+      }
+      for (uint32 i=0; i<numPackets; i++) batch[i].Reset();
+   }
+
+   InvalidatePulseTime();
+   return totalBytesWritten;
+}
+
+}; // end namespace muscle
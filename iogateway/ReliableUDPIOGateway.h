@@ -0,0 +1,230 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#ifndef MuscleReliableUDPIOGateway_h
+#define MuscleReliableUDPIOGateway_h
+
+#include "iogateway/AbstractMessageIOGateway.h"
+#include "util/ByteBuffer.h"
+
+namespace muscle {
+
+#define DEFAULT_RELIABLE_UDP_IOGATEWAY_MAGIC 1381319792 // 'Rudp'
+
+/** This I/O gateway sends Messages reliably, and in order, over a lossy datagram channel such as
+  * a UDPSocketDataIO.  Each Message is flattened and split into fragments that fit into a single
+  * packet, and every packet is acknowledged by the receiver with a selective acknowledgement (i.e.
+  * a cumulative ack plus a list of the runs of packets received after it).  Packets that aren't
+  * acknowledged are retransmitted, either when three later packets have been acknowledged, or when
+  * the retransmission timeout (derived from the measured round-trip time) expires.
+  *
+  * Outgoing traffic is limited by a TCP-Reno-style congestion window (slow start, then additive
+  * increase and multiplicative decrease whenever packet loss is detected), and is paced out over each
+  * round trip rather than being sent in bursts.  If the congestion window or the pacing rate doesn't allow
+  * a packet to be sent right now, HasBytesToOutput() returns false, and the gateway's Pulse() callback
+  * is scheduled for when it does.  (So this gateway should be Pulse()'d, as it is automatically when it
+  * is used in a ReflectServer)
+  *
+  * Each Message is sent on one of up to 65536 independent streams (see SetStreamForWhatCode()).
+  * Messages are delivered in order within each stream, but a lost packet on one stream doesn't delay
+  * the delivery of Messages on any other stream, and the streams' outgoing fragments are interleaved
+  * round-robin, so that (for example) a large file transfer on one stream doesn't hold up small
+  * control Messages on another.
+  *
+  * This gateway talks to a single peer, so its DataIO should send its packets to (and receive packets
+  * from) only that peer; e.g. a UDPSocketDataIO with a single send-destination.  Each gateway chooses a
+  * random "epoch" value when it is created or Reset(), so that if the peer restarts, its new packets
+  * aren't confused with its old ones.  When the acknowledgements we receive show that our peer has
+  * restarted, we start a new epoch for the data we send, and resend the Message we were in the middle
+  * of sending (if any) from its beginning.  (Messages whose packets were all sent to the peer's previous
+  * incarnation are not resent)
+  *
+  * The receiving side's memory use is bounded:  packets more than MAX_CONGESTION_WINDOW sequence numbers
+  * ahead of the receiver's cumulative acknowledgement, or that would have to be held for reassembly when
+  * too many packets are already being held, are dropped without being acknowledged (so the sender will
+  * retransmit them later).
+  */
+class ReliableUDPIOGateway : public AbstractMessageIOGateway, private CountedObject<ReliableUDPIOGateway>
+{
+public:
+   /** @param maxTransferUnit The largest packet size this I/O gateway will be allowed to send.
+     *                        Default value is MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET (aka
+     *                        1404 if MUSCLE_AVOID_IPV6 is defined, 1388 otherwise).  Values smaller
+     *                        than 64 will be interpreted as 64.
+     * @param magic The "magic number" that is expected to be at the beginning of each packet
+     *              sent and received.  You can usually leave this as the default.
+     */
+   ReliableUDPIOGateway(uint32 maxTransferUnit = MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET, uint32 magic = DEFAULT_RELIABLE_UDP_IOGATEWAY_MAGIC);
+
+   /** Returns true iff we have an acknowledgement to send, or if we have data to send and our
+     * congestion window and pacing rate allow us to send some of it right now.
+     */
+   virtual bool HasBytesToOutput() const;
+
+   /** Overridden to schedule our retransmission timeouts, and to wake up when our pacing allows more data to be sent. */
+   virtual uint64 GetPulseTime(const PulseArgs & args);
+
+   /** Overridden to handle retransmission timeouts. */
+   virtual void Pulse(const PulseArgs & args);
+
+   /** Overridden to discard all of our connection state (including any unacknowledged data) and choose a new epoch. */
+   virtual void Reset();
+
+   /** Specifies which stream outgoing Messages with the given what-code should be sent on.
+     * Messages whose what-codes haven't been assigned a stream are sent on stream 0.
+     * @param whatCode The what-code to assign a stream to.
+     * @param streamID The stream to send those Messages on.  Passing 0 removes the assignment.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory).
+     */
+   status_t SetStreamForWhatCode(uint32 whatCode, uint16 streamID);
+
+   /** Sets the maximum size Message we will allow ourself to receive.  Defaults to MUSCLE_NO_LIMIT. */
+   void SetMaxIncomingMessageSize(uint32 messageSize) {_maxIncomingMessageSize = messageSize;}
+
+   /** Returns the current setting of the maximum-message-size value.  Default to MUSCLE_NO_LIMIT. */
+   uint32 GetMaxIncomingMessageSize() const {return _maxIncomingMessageSize;}
+
+   /** Returns the current size of our congestion window, in packets. */
+   uint32 GetCongestionWindow() const {return _congestionWindow;}
+
+   /** Returns our current estimate of the round-trip time to our peer, in microseconds. */
+   uint64 GetSmoothedRoundTripTime() const {return _smoothedRTT;}
+
+   /** Returns the number of packets that we have sent but that haven't been acknowledged yet. */
+   uint32 GetNumPacketsInFlight() const {return _inFlight.GetNumItems();}
+
+   /** Returns the total number of data packets we have sent, including retransmissions. */
+   uint64 GetNumPacketsSent() const {return _numPacketsSent;}
+
+   /** Returns the number of data packets we have had to retransmit. */
+   uint64 GetNumPacketsRetransmitted() const {return _numPacketsRetransmitted;}
+
+protected:
+   /** Receives a batch of packets (via DataIO::ReadPackets()), processes any acknowledgements
+     * in them, and passes on any Messages that they complete.
+     */
+   virtual int32 DoInputImplementation(AbstractGatewayMessageReceiver & receiver, uint32 maxBytes = MUSCLE_NO_LIMIT);
+
+   /** Sends any pending acknowledgement, and then as many data packets (retransmissions first)
+     * as our congestion window and pacing rate allow, via DataIO::WritePackets().
+     */
+   virtual int32 DoOutputImplementation(uint32 maxBytes = MUSCLE_NO_LIMIT);
+
+   /** Returns the ID of the stream that (msg) should be sent on.  The default implementation
+     * returns the stream assigned to (msg)'s what-code via SetStreamForWhatCode(), or 0.
+     * Subclasses can override this to choose streams based on other criteria.
+     * @param msg The outgoing Message to choose a stream for.
+     */
+   virtual uint16 GetStreamIDForOutgoingMessage(const MessageRef & msg) const;
+
+private:
+   class OutgoingStream;
+   class IncomingStream;
+   class SentPacket;
+
+   void ResetConnectionState();
+   void ResetSendState();
+   void HandleIncomingPacket(AbstractGatewayMessageReceiver & receiver, const uint8 * packetBytes, uint32 numBytes);
+   void HandleIncomingDataPacket(AbstractGatewayMessageReceiver & receiver, uint32 epoch, uint16 streamID, const uint8 * packetBytes, uint32 numBytes);
+   void HandleIncomingFragment(AbstractGatewayMessageReceiver & receiver, IncomingStream & stream, const uint8 * packetBytes, uint32 numBytes);
+   void HandleIncomingAck(uint32 ackerEpoch, uint32 ackedEpoch, uint32 cumulativeAck, const uint32 * ranges, uint32 numRanges);
+   bool RecordReceivedPacketSeq(uint32 packetSeq);
+   void AdvanceReceivedCumulativeSeq(uint32 packetSeq);
+   void PacketAcknowledged(uint32 packetSeq, const SentPacket & sp, uint32 & numAcked, uint32 & largestAckedSeq, uint64 & largestAckedSendTime);
+   void PacketLost(uint32 packetSeq, const SentPacket & sp);
+   void UpdateRoundTripTime(uint64 sample);
+   void CheckForRetransmitTimeout(uint64 now);
+   void AdvancePacingClock(uint64 now);
+   bool IsSendAllowed(uint64 now, uint32 numExtraPackets) const;
+   bool HasDataToSend() const {return ((_pendingPackets.HasItems())||(_readyStreams.HasItems())||(GetOutgoingMessageQueue().HasItems()));}
+   status_t EnqueueOutgoingMessage(const MessageRef & msg);
+   ByteBufferRef GetNextFragmentPacket();
+   int32 SendAck();
+
+   const uint32 _magic;
+   const uint32 _maxTransferUnit;
+   uint32 _maxIncomingMessageSize;
+   Hashtable<uint32, uint16> _whatCodeStreams;  // what-code -> stream ID
+
+   uint32 _epoch;      // our current epoch, chosen at random (sent in our acks)
+   uint32 _sendEpoch;  // the epoch of the data packets we send; changes whenever our peer restarts
+
+   // Sending side
+   class OutgoingStream
+   {
+   public:
+      OutgoingStream() : _flatOffset(0), _nextStreamSeq(0) {/* empty */}
+
+      Queue<MessageRef> _messages;  // Messages waiting to be fragmented
+      ByteBufferRef _flatMessage;   // the flattened Message we are currently fragmenting
+      uint32 _flatOffset;           // how much of (_flatMessage) we have fragmented so far
+      uint32 _nextStreamSeq;        // stream sequence number for the next fragment on this stream
+   };
+   Hashtable<uint16, OutgoingStream> _outgoingStreams;
+   Queue<uint16> _readyStreams;            // streams with fragments to send, in round-robin order
+   Queue<ByteBufferRef> _pendingPackets;   // packets (mostly retransmissions) to send before any new fragments
+
+   class SentPacket
+   {
+   public:
+      SentPacket() : _sendTime(0) {/* empty */}
+      SentPacket(const ByteBufferRef & packet, uint64 sendTime) : _packet(packet), _sendTime(sendTime) {/* empty */}
+
+      ByteBufferRef _packet;
+      uint64 _sendTime;
+   };
+   Hashtable<uint32, SentPacket> _inFlight;  // packet sequence number -> unacknowledged packet, in the order they were sent
+
+   uint32 _nextPacketSeq;         // sequence number of the next data packet we send
+   uint32 _largestAckedSeq;       // the largest sequence number that has been acknowledged
+   uint32 _recoveryStartSeq;      // losses of packets sent before this one don't shrink the congestion window again
+   uint32 _congestionWindow;      // max number of packets in flight
+   uint32 _slowStartThreshold;    // window size at which slow start ends
+   uint32 _windowIncreaseCount;   // acks counted towards the next congestion-avoidance window increase
+   bool _haveRTTSample;
+   uint64 _smoothedRTT;
+   uint64 _rttVariance;
+   uint64 _retransmitTimeout;
+   uint64 _nextPacedSendTime;
+   uint64 _numPacketsSent;
+   uint64 _numPacketsRetransmitted;
+   bool _havePeerAckEpoch;
+   uint32 _peerAckEpoch;  // our peer's epoch, as reported in its acks; if it changes, our peer has restarted
+
+   // Receiving side
+   class SeqRange
+   {
+   public:
+      SeqRange() : _start(0), _end(0) {/* empty */}
+      SeqRange(uint32 start, uint32 end) : _start(start), _end(end) {/* empty */}
+
+      uint32 _start;  // first sequence number in the run
+      uint32 _end;    // one past the last sequence number in the run
+   };
+
+   bool _havePeerEpoch;
+   uint32 _peerEpoch;
+   uint32 _previousPeerEpoch;      // stray packets from our peer's previous epoch are ignored
+   uint32 _receivedCumulativeSeq;  // we have received every packet before this sequence number
+   Queue<SeqRange> _receivedRanges; // runs of packets received after (_receivedCumulativeSeq), in ascending order
+   bool _ackPending;
+
+   class IncomingStream
+   {
+   public:
+      IncomingStream() : _nextStreamSeq(0), _messageOffset(0) {/* empty */}
+
+      uint32 _nextStreamSeq;                           // stream sequence number of the next fragment to process
+      Hashtable<uint32, ByteBufferRef> _heldFragments;  // fragments that arrived early, by stream sequence number
+      ByteBufferRef _messageBuf;                       // the flattened Message we are currently reassembling
+      uint32 _messageOffset;                           // how much of (_messageBuf) we have received so far
+   };
+   Hashtable<uint16, IncomingStream> _incomingStreams;
+   uint32 _numHeldFragments;  // total number of fragments held in all of our IncomingStreams
+
+   ByteBuffer _inputPacketBuffer;  // room for a batch of incoming packets
+   ByteBuffer _ackBuffer;          // our outgoing ack packet
+};
+
+}; // end namespace muscle
+
+#endif
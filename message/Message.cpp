@@ -144,6 +144,9 @@ public:
    // For debugging:  returns a description of our contents as a String
    virtual void AddToString(String & s, uint32 maxRecurseLevel, int indent) const = 0;
 
+   // Returns true iff this array is a LazyDataArray placeholder that must be replaced by a real array before use
+   virtual bool IsLazy() const {return false;}
+
    // Returns true iff this array is identical to (rhs).  If (compareContents) is false,
    // only the array lengths and type codes are checked, not the data itself.
    bool IsEqualTo(const AbstractDataArray * rhs, bool compareContents) const
@@ -981,41 +984,11 @@ public:
    /** For backwards compatibility with older muscle streams */
    virtual bool ShouldWriteNumItems() const {return false;}
 
-   virtual status_t Unflatten(const uint8 * buffer, uint32 numBytes)
-   {
-      Clear(false);
+   virtual status_t Unflatten(const uint8 * buffer, uint32 numBytes) {return UnflattenAux(buffer, numBytes, NULL);}
 
-      uint32 readOffset = 0;
-      while(readOffset < numBytes)
-      {
-         uint32 readFs;
-         if (ReadData(buffer, numBytes, &readOffset, &readFs, sizeof(readFs)) != B_NO_ERROR) 
-         {
-            LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Read of sub-message size failed (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes);
-            return B_ERROR;
-         }
-
-         readFs = B_LENDIAN_TO_HOST_INT32(readFs);
-         if (readOffset + readFs > numBytes) 
-         {
-            LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Sub-message size too large (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ", readFs=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes, readFs);
-            return B_ERROR;  // message size too large for our buffer... corruption?
-         }
-         MessageRef nextMsg = GetMessageFromPool();
-         if (nextMsg())
-         {
-            if (nextMsg()->Unflatten(&buffer[readOffset], readFs) != B_NO_ERROR) 
-            {
-               LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Sub-message unflatten failed (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ", readFs=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes, readFs);
-               return B_ERROR;
-            }
-            if (AddDataItem(&nextMsg, sizeof(nextMsg)) != B_NO_ERROR) return B_ERROR;
-            readOffset += readFs;
-         }
-         else return B_ERROR;
-      }
-      return B_NO_ERROR;
-   }
+   // Like Unflatten(), except that the sub-Messages are unflattened via Message::UnflattenLazily().
+   // (buffer) must point into (bufRef)'s byte array.
+   status_t UnflattenLazily(const ConstByteBufferRef & bufRef, const uint8 * buffer, uint32 numBytes) {return UnflattenAux(buffer, numBytes, &bufRef);}
 
    virtual void AddToString(String & s, uint32 maxRecurseLevel, int indent) const
    {
@@ -1076,6 +1049,44 @@ protected:
       }
       return true;
    }
+
+private:
+   status_t UnflattenAux(const uint8 * buffer, uint32 numBytes, const ConstByteBufferRef * optLazyBufRef)
+   {
+      Clear(false);
+
+      uint32 readOffset = 0;
+      while(readOffset < numBytes)
+      {
+         uint32 readFs;
+         if (ReadData(buffer, numBytes, &readOffset, &readFs, sizeof(readFs)) != B_NO_ERROR) 
+         {
+            LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Read of sub-message size failed (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes);
+            return B_ERROR;
+         }
+
+         readFs = B_LENDIAN_TO_HOST_INT32(readFs);
+         if (readOffset + readFs > numBytes) 
+         {
+            LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Sub-message size too large (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ", readFs=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes, readFs);
+            return B_ERROR;  // message size too large for our buffer... corruption?
+         }
+         MessageRef nextMsg = GetMessageFromPool();
+         if (nextMsg())
+         {
+            const uint8 * nextBuf = &buffer[readOffset];
+            if ((optLazyBufRef ? nextMsg()->UnflattenLazily(*optLazyBufRef, (uint32)(nextBuf-(*optLazyBufRef)()->GetBuffer()), readFs) : nextMsg()->Unflatten(nextBuf, readFs)) != B_NO_ERROR) 
+            {
+               LogTime(MUSCLE_LOG_DEBUG, "MessageDataArray %p:  Sub-message unflatten failed (readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ", readFs=" UINT32_FORMAT_SPEC ")\n", this, readOffset, numBytes, readFs);
+               return B_ERROR;
+            }
+            if (AddDataItem(&nextMsg, sizeof(nextMsg)) != B_NO_ERROR) return B_ERROR;
+            readOffset += readFs;
+         }
+         else return B_ERROR;
+      }
+      return B_NO_ERROR;
+   }
 };
 DECLAREFIELDTYPE(MessageDataArray);
 
@@ -1137,7 +1148,7 @@ public:
       }
 
       uint32 numElements = B_LENDIAN_TO_HOST_INT32(networkByteOrder);
-      if (this->_data.EnsureSize(numElements) != B_NO_ERROR) return B_ERROR;
+      if (this->_data.EnsureSize(muscleMin(numElements, (inputBufferBytes-readOffset)/((uint32)sizeof(uint32)+1))) != B_NO_ERROR) return B_ERROR;  // don't let a bogus count make us allocate more than the buffer could possibly hold
       for (uint32 i=0; i<numElements; i++)
       {
          if (this->ReadData(buffer, inputBufferBytes, &readOffset, &networkByteOrder, sizeof(networkByteOrder)) != B_NO_ERROR) 
@@ -1197,6 +1208,170 @@ public:
 };
 DECLAREFIELDTYPE(StringDataArray);
 
+// Returns a new, empty data array of the appropriate class for the given type code
+static RefCountableRef CreateDataArray(uint32 tc)
+{
+   RefCountableRef newEntry;
+   switch(tc)
+   {
+      case B_BOOL_TYPE:    newEntry.SetRef(NEWFIELD(BoolDataArray));    break;
+      case B_DOUBLE_TYPE:  newEntry.SetRef(NEWFIELD(DoubleDataArray));  break;
+      case B_POINTER_TYPE: newEntry.SetRef(NEWFIELD(PointerDataArray)); break;
+      case B_POINT_TYPE:   newEntry.SetRef(NEWFIELD(PointDataArray));   break;
+      case B_RECT_TYPE:    newEntry.SetRef(NEWFIELD(RectDataArray));    break;
+      case B_FLOAT_TYPE:   newEntry.SetRef(NEWFIELD(FloatDataArray));   break;
+      case B_INT64_TYPE:   newEntry.SetRef(NEWFIELD(Int64DataArray));   break;
+      case B_INT32_TYPE:   newEntry.SetRef(NEWFIELD(Int32DataArray));   break;
+      case B_INT16_TYPE:   newEntry.SetRef(NEWFIELD(Int16DataArray));   break;
+      case B_INT8_TYPE:    newEntry.SetRef(NEWFIELD(Int8DataArray));    break;
+      case B_MESSAGE_TYPE: newEntry.SetRef(NEWFIELD(MessageDataArray)); break;
+      case B_STRING_TYPE:  newEntry.SetRef(NEWFIELD(StringDataArray));  break;
+      case B_TAG_TYPE:     newEntry.SetRef(NEWFIELD(TagDataArray));     break;
+      default:
+         newEntry.SetRef(NEWFIELD(ByteBufferDataArray));
+         if (newEntry()) (static_cast<ByteBufferDataArray*>(newEntry()))->SetTypeCode(tc);
+         break;
+   }
+   return newEntry;
+}
+
+/* A placeholder for a string or raw-data field that was unflattened by Message::UnflattenLazily().
+ * It holds a reference to the received bytes, and gets replaced by a real data array (via
+ * MaterializeArray()) the first time the Message's field is accessed.  Until then, flattening
+ * the field is a simple memcpy() of the original bytes.  A LazyDataArray is never modified
+ * after SetData() is called, so it is safe for several Messages to share one.
+ */
+class LazyDataArray : public AbstractDataArray
+{
+public:
+   LazyDataArray() : _data(NULL), _numBytes(0), _numItems(0), _typeCode(B_RAW_TYPE) {/* empty */}
+   virtual ~LazyDataArray() {/* empty */}
+
+   // Returns true iff fields of the given type code can be represented by a LazyDataArray.
+   // Fixed-size types are cheap to unflatten right away, and Message fields get unflattened lazily on a per-Message basis instead.
+   static bool IsLazyTypeCode(uint32 tc)
+   {
+      switch(tc)
+      {
+         case B_BOOL_TYPE:  case B_DOUBLE_TYPE: case B_POINTER_TYPE: case B_POINT_TYPE: case B_RECT_TYPE:   case B_FLOAT_TYPE:
+         case B_INT64_TYPE: case B_INT32_TYPE:  case B_INT16_TYPE:   case B_INT8_TYPE:  case B_MESSAGE_TYPE: case B_TAG_TYPE:
+            return false;
+
+         default:
+            return true;  // B_STRING_TYPE, and all of the types that get stored in a ByteBufferDataArray
+      }
+   }
+
+   // Validates the flattened field data at (buffer), and makes us represent it.  (buffer) must point into (bufRef)'s byte array.
+   status_t SetData(const ConstByteBufferRef & bufRef, const uint8 * buffer, uint32 numBytes, uint32 tc)
+   {
+      // Same format as written by VariableSizeFlatObjectArray and ByteBufferDataArray:  item count, then (item size, item data) for each item
+      uint32 readOffset = 0;
+      uint32 numItems;
+      if (ReadData(buffer, numBytes, &readOffset, &numItems, sizeof(numItems)) != B_NO_ERROR) return B_ERROR;
+      numItems = B_LENDIAN_TO_HOST_INT32(numItems);
+      for (uint32 i=0; i<numItems; i++)
+      {
+         uint32 itemSize;
+         if (ReadData(buffer, numBytes, &readOffset, &itemSize, sizeof(itemSize)) != B_NO_ERROR) return B_ERROR;
+         itemSize = B_LENDIAN_TO_HOST_INT32(itemSize);
+         if ((itemSize > numBytes-readOffset)||((itemSize == 0)&&(tc == B_STRING_TYPE)))  // a flattened String always has at least its NUL byte
+         {
+            LogTime(MUSCLE_LOG_DEBUG, "LazyDataArray %p:  Bad item size (i=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC ", readOffset=" UINT32_FORMAT_SPEC ", numBytes=" UINT32_FORMAT_SPEC ", itemSize=" UINT32_FORMAT_SPEC ")\n", this, i, numItems, readOffset, numBytes, itemSize);
+            return B_ERROR;
+         }
+         readOffset += itemSize;
+      }
+
+      _bufRef   = bufRef;
+      _data     = buffer;
+      _numBytes = readOffset;  // any trailing bytes would be ignored by Unflatten() anyway
+      _numItems = numItems;
+      _typeCode = tc;
+      return B_NO_ERROR;
+   }
+
+   // Returns a real data array holding the unflattened contents of this field, or a NULL reference on failure (out of memory)
+   RefCountableRef Materialize() const
+   {
+      RefCountableRef ret = CreateDataArray(_typeCode);
+      if ((ret())&&(static_cast<AbstractDataArray *>(ret())->Unflatten(_data, _numBytes) != B_NO_ERROR)) ret.Reset();
+      return ret;
+   }
+
+   virtual bool IsLazy() const {return true;}
+
+   virtual uint32 TypeCode() const {return _typeCode;}
+   virtual uint32 GetNumItems() const {return _numItems;}
+   virtual bool ElementsAreFixedSize() const {return false;}
+   virtual bool IsFlattenable() const {return true;}
+
+   // Flattenable interface
+   virtual uint32 FlattenedSize() const {return _numBytes;}
+   virtual void Flatten(uint8 * buffer) const {memcpy(buffer, _data, _numBytes);}
+   virtual status_t Unflatten(const uint8 *, uint32) {return B_ERROR;}  // use SetData() instead
+
+   virtual RefCountableRef Clone() const;
+
+   // The Message class always replaces us with a real array before reading or modifying our items, so these should never be called
+   virtual status_t AddDataItem(const void *, uint32) {return B_ERROR;}
+   virtual status_t RemoveDataItem(uint32) {return B_ERROR;}
+   virtual status_t PrependDataItem(const void *, uint32) {return B_ERROR;}
+   virtual void Clear(bool) {/* empty */}
+   virtual void Normalize() {/* empty */}
+   virtual status_t FindDataItem(uint32, const void **) const {return B_ERROR;}
+   virtual status_t ReplaceDataItem(uint32, const void *, uint32) {return B_ERROR;}
+
+   // These are implemented in terms of a temporary real array, just in case
+   virtual uint32 GetItemSize(uint32 index) const
+   {
+      RefCountableRef r = Materialize();
+      return r() ? static_cast<const AbstractDataArray *>(r())->GetItemSize(index) : 0;
+   }
+
+   virtual uint32 CalculateChecksum(bool countNonFlattenableFields) const
+   {
+      RefCountableRef r = Materialize();
+      return r() ? static_cast<const AbstractDataArray *>(r())->CalculateChecksum(countNonFlattenableFields) : 0;
+   }
+
+   virtual void AddToString(String & s, uint32 maxRecurseLevel, int indent) const
+   {
+      RefCountableRef r = Materialize();
+      if (r()) static_cast<const AbstractDataArray *>(r())->AddToString(s, maxRecurseLevel, indent);
+   }
+
+protected:
+   virtual bool AreContentsEqual(const AbstractDataArray * rhs) const
+   {
+      RefCountableRef r = Materialize();
+      return ((r())&&(static_cast<const AbstractDataArray *>(r())->IsEqualTo(rhs, true)));
+   }
+
+private:
+   ConstByteBufferRef _bufRef;  // keeps the bytes that (_data) points to valid
+   const uint8 * _data;
+   uint32 _numBytes;
+   uint32 _numItems;
+   uint32 _typeCode;
+};
+DECLAREFIELDTYPE(LazyDataArray);
+
+// Returns the data array held by (entry), first replacing it with a real data array if it is a LazyDataArray.
+// Returns NULL if the placeholder couldn't be replaced (out of memory).
+static AbstractDataArray * MaterializeArray(const RefCountableRef & entry)
+{
+   AbstractDataArray * ada = static_cast<AbstractDataArray *>(entry.GetItemPointer());
+   if (ada->IsLazy())
+   {
+      RefCountableRef realArray = static_cast<const LazyDataArray *>(ada)->Materialize();
+      if (realArray() == NULL) {WARN_OUT_OF_MEMORY; return NULL;}
+      const_cast<RefCountableRef &>(entry) = realArray;  // (entry) belongs to a Message's field table; the placeholder is no longer needed
+      ada = static_cast<AbstractDataArray *>(realArray());
+   }
+   return ada;
+}
+
 void MessageFieldNameIterator :: SkipNonMatchingFieldNames()
 {
    // Gotta move ahead until we find the first matching value!
@@ -1269,7 +1444,9 @@ void Message :: AddToString(String & s, uint32 maxRecurseLevel, int indent) cons
 
    for (HashtableIterator<String, RefCountableRef> iter(_entries, HTIT_FLAG_NOREGISTER); iter.HasData(); iter++)
    {
-      const AbstractDataArray * nextValue = static_cast<const AbstractDataArray *>(iter.GetValue()());
+      const AbstractDataArray * nextValue = MaterializeArray(iter.GetValue());
+      if (nextValue == NULL) continue;
+
       uint32 tc = nextValue->TypeCode();
       MakePrettyTypeCodeString(tc, prettyTypeCodeBuf);
       DoIndents(indent,s); 
@@ -1285,14 +1462,14 @@ void Message :: AddToString(String & s, uint32 maxRecurseLevel, int indent) cons
 AbstractDataArray * Message :: GetArray(const String & arrayName, uint32 tc)
 {
    RefCountableRef * array;
-   return (((array = _entries.Get(arrayName)) != NULL)&&((tc == B_ANY_TYPE)||(tc == (static_cast<const AbstractDataArray *>(array->GetItemPointer()))->TypeCode()))) ? (static_cast<AbstractDataArray *>(array->GetItemPointer())) : NULL;
+   return (((array = _entries.Get(arrayName)) != NULL)&&((tc == B_ANY_TYPE)||(tc == (static_cast<const AbstractDataArray *>(array->GetItemPointer()))->TypeCode()))) ? MaterializeArray(*array) : NULL;
 }
 
 // Returns a read-only pointer to a held array of the given type, if it exists.  If (tc) is B_ANY_TYPE, then any type array is acceptable.
 const AbstractDataArray * Message :: GetArray(const String & arrayName, uint32 tc) const
 {
    const RefCountableRef * array;
-   return (((array = _entries.Get(arrayName)) != NULL)&&((tc == B_ANY_TYPE)||(tc == (static_cast<const AbstractDataArray *>(array->GetItemPointer()))->TypeCode()))) ? (static_cast<const AbstractDataArray *>(array->GetItemPointer())) : NULL;
+   return (((array = _entries.Get(arrayName)) != NULL)&&((tc == B_ANY_TYPE)||(tc == (static_cast<const AbstractDataArray *>(array->GetItemPointer()))->TypeCode()))) ? MaterializeArray(*array) : NULL;
 }
 
 
@@ -1302,8 +1479,8 @@ const AbstractDataArray * Message :: GetArrayAndTypeCode(const String & arrayNam
    const RefCountableRef * aRef = _entries.Get(arrayName);
    if (aRef)
    {
-      const AbstractDataArray * ada = static_cast<const AbstractDataArray *>(aRef->GetItemPointer());
-      if (index < ada->GetNumItems())
+      const AbstractDataArray * ada = MaterializeArray(*aRef);
+      if ((ada)&&(index < ada->GetNumItems()))
       {
          *retTC = ada->TypeCode();
          return ada;
@@ -1315,9 +1492,8 @@ const AbstractDataArray * Message :: GetArrayAndTypeCode(const String & arrayNam
 // Returns an pointer to a held array of the given type, if it exists.  If (tc) is B_ANY_TYPE, then any type array is acceptable.
 RefCountableRef Message :: GetArrayRef(const String & arrayName, uint32 tc) const
 {
-   RefCountableRef array;
-   if ((_entries.Get(arrayName, array) == B_NO_ERROR)&&(tc != B_ANY_TYPE)&&(tc != ((const AbstractDataArray *)array())->TypeCode())) array.Reset();
-   return array;
+   const AbstractDataArray * array = GetArray(arrayName, tc);  // makes sure we don't hand out a LazyDataArray
+   return array ? *_entries.Get(arrayName) : RefCountableRef();
 }
 
 AbstractDataArray * Message :: GetOrCreateArray(const String & arrayName, uint32 tc)
@@ -1334,27 +1510,7 @@ AbstractDataArray * Message :: GetOrCreateArray(const String & arrayName, uint32
    if (_entries.ContainsKey(arrayName)) return NULL;
 
    // Oops!  This array doesn't exist; better create it!
-   RefCountableRef newEntry;
-   switch(tc)
-   {
-      case B_BOOL_TYPE:    newEntry.SetRef(NEWFIELD(BoolDataArray));    break;
-      case B_DOUBLE_TYPE:  newEntry.SetRef(NEWFIELD(DoubleDataArray));  break;
-      case B_POINTER_TYPE: newEntry.SetRef(NEWFIELD(PointerDataArray)); break;
-      case B_POINT_TYPE:   newEntry.SetRef(NEWFIELD(PointDataArray));   break;
-      case B_RECT_TYPE:    newEntry.SetRef(NEWFIELD(RectDataArray));    break;
-      case B_FLOAT_TYPE:   newEntry.SetRef(NEWFIELD(FloatDataArray));   break;
-      case B_INT64_TYPE:   newEntry.SetRef(NEWFIELD(Int64DataArray));   break;
-      case B_INT32_TYPE:   newEntry.SetRef(NEWFIELD(Int32DataArray));   break;
-      case B_INT16_TYPE:   newEntry.SetRef(NEWFIELD(Int16DataArray));   break;
-      case B_INT8_TYPE:    newEntry.SetRef(NEWFIELD(Int8DataArray));    break;
-      case B_MESSAGE_TYPE: newEntry.SetRef(NEWFIELD(MessageDataArray)); break;
-      case B_STRING_TYPE:  newEntry.SetRef(NEWFIELD(StringDataArray));  break;
-      case B_TAG_TYPE:     newEntry.SetRef(NEWFIELD(TagDataArray));     break;
-      default:
-         newEntry.SetRef(NEWFIELD(ByteBufferDataArray));
-         if (newEntry()) (static_cast<ByteBufferDataArray*>(newEntry()))->SetTypeCode(tc);
-         break;
-   }
+   RefCountableRef newEntry = CreateDataArray(tc);
    return ((newEntry())&&(_entries.Put(arrayName, newEntry) == B_NO_ERROR)) ? (AbstractDataArray*)newEntry() : NULL;
 }
 
@@ -1391,8 +1547,8 @@ uint32 Message :: CalculateChecksum(bool countNonFlattenableFields) const
    for (HashtableIterator<String, RefCountableRef> it(_entries, HTIT_FLAG_NOREGISTER); it.HasData(); it++)
    {
       // Note that I'm deliberately NOT considering the ordering of the fields when computing the checksum!
-      const AbstractDataArray * a = static_cast<const AbstractDataArray *>(it.GetValue()());
-      if ((countNonFlattenableFields)||(a->IsFlattenable())) 
+      const AbstractDataArray * a = MaterializeArray(it.GetValue());
+      if ((a)&&((countNonFlattenableFields)||(a->IsFlattenable()))) 
       {
          uint32 fnChk = it.GetKey().CalculateChecksum();
          ret += fnChk;
@@ -1469,6 +1625,22 @@ void Message :: Flatten(uint8 * buffer) const
 }
 
 status_t Message :: Unflatten(const uint8 * buffer, uint32 inputBufferBytes) 
+{
+   return UnflattenAux(buffer, inputBufferBytes, NULL);
+}
+
+status_t Message :: UnflattenLazily(const ConstByteBufferRef & bufRef, uint32 offset, uint32 inputBufferBytes)
+{
+   const ByteBuffer * bb = bufRef();
+   if ((bb == NULL)||(offset > bb->GetNumBytes()))
+   {
+      Clear();
+      return B_ERROR;
+   }
+   return UnflattenAux(bb->GetBuffer()+offset, muscleMin(inputBufferBytes, bb->GetNumBytes()-offset), &bufRef);
+}
+
+status_t Message :: UnflattenAux(const uint8 * buffer, uint32 inputBufferBytes, const ConstByteBufferRef * optLazyBufRef)
 {
    TCHECKPOINT;
 
@@ -1553,6 +1725,21 @@ status_t Message :: Unflatten(const uint8 * buffer, uint32 inputBufferBytes)
          return B_ERROR;
       }
    
+      if ((optLazyBufRef)&&(LazyDataArray::IsLazyTypeCode(tc)))
+      {
+         // Just validate the field's data and remember where it is; it will be unflattened when (if) it is accessed
+         const RefCountableRef * oldEntry = _entries.Get(entryName);
+         RefCountableRef lazyRef(NEWFIELD(LazyDataArray));
+         if (((oldEntry)&&(static_cast<const AbstractDataArray *>(oldEntry->GetItemPointer())->TypeCode() != tc))||(lazyRef() == NULL)||(static_cast<LazyDataArray *>(lazyRef())->SetData(*optLazyBufRef, &buffer[readOffset], eLength, tc) != B_NO_ERROR)||(_entries.Put(entryName, lazyRef) != B_NO_ERROR))
+         {
+            LogTime(MUSCLE_LOG_DEBUG, "Message %p:  Unable to set up lazy data array object!  (inputBufferBytes=" UINT32_FORMAT_SPEC ", what=" UINT32_FORMAT_SPEC " i=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " tc=" UINT32_FORMAT_SPEC " entryName=[%s])\n", this, inputBufferBytes, what, i, numEntries, tc, entryName());
+            Clear();
+            return B_ERROR;
+         }
+         readOffset += eLength;
+         continue;
+      }
+
       AbstractDataArray * nextEntry = GetOrCreateArray(entryName, tc);
       if (nextEntry == NULL) 
       {
@@ -1560,7 +1747,7 @@ status_t Message :: Unflatten(const uint8 * buffer, uint32 inputBufferBytes)
          return B_ERROR;
       }
 
-      if (nextEntry->Unflatten(&buffer[readOffset], eLength) != B_NO_ERROR) 
+      if ((((optLazyBufRef)&&(tc == B_MESSAGE_TYPE)) ? static_cast<MessageDataArray *>(nextEntry)->UnflattenLazily(*optLazyBufRef, &buffer[readOffset], eLength) : nextEntry->Unflatten(&buffer[readOffset], eLength)) != B_NO_ERROR) 
       {
          LogTime(MUSCLE_LOG_DEBUG, "Message %p:  Unable to unflatten data array object!  (inputBufferBytes=" UINT32_FORMAT_SPEC ", what=" UINT32_FORMAT_SPEC " i=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " tc=" UINT32_FORMAT_SPEC " entryName=[%s])\n", this, inputBufferBytes, what, i, numEntries, tc, entryName());
          Clear();  // fix for occasional crash bug; we were deleting nextEntry here, *and* in the destructor!
@@ -1746,8 +1933,8 @@ void * Message :: GetPointerToNormalizedFieldData(const String & fieldName, uint
    RefCountableRef * e = _entries.Get(fieldName);
    if (e)
    {
-      AbstractDataArray * a = static_cast<AbstractDataArray *>(e->GetItemPointer());
-      if ((typeCode == B_ANY_TYPE)||(typeCode == a->TypeCode()))
+      AbstractDataArray * a = MaterializeArray(*e);
+      if ((a)&&((typeCode == B_ANY_TYPE)||(typeCode == a->TypeCode())))
       {
          a->Normalize();
 
@@ -2320,7 +2507,18 @@ bool Message :: FieldsAreSubsetOf(const Message & rhs, bool compareContents) con
    for (HashtableIterator<String, RefCountableRef> iter(_entries, HTIT_FLAG_NOREGISTER); iter.HasData(); iter++)
    {
       const RefCountableRef * hisNextValue = rhs._entries.Get(iter.GetKey());
-      if ((hisNextValue == NULL)||((static_cast<const AbstractDataArray*>(iter.GetValue()()))->IsEqualTo((const AbstractDataArray*)(hisNextValue->GetItemPointer()), compareContents) == false)) return false;
+      if (hisNextValue == NULL) return false;
+
+      const AbstractDataArray * myArray  = static_cast<const AbstractDataArray *>(iter.GetValue()());
+      const AbstractDataArray * hisArray = static_cast<const AbstractDataArray *>(hisNextValue->GetItemPointer());
+      if (compareContents)
+      {
+         // LazyDataArrays can't compare their contents directly, so make sure both sides are real arrays first
+         myArray  = MaterializeArray(iter.GetValue());
+         hisArray = MaterializeArray(*hisNextValue);
+         if ((myArray == NULL)||(hisArray == NULL)) return false;
+      }
+      if (myArray->IsEqualTo(hisArray, compareContents) == false) return false;
    }
    return true;
 }
@@ -334,6 +334,26 @@ public:
     */
    virtual status_t Unflatten(const uint8 *buf, uint32 size);
 
+   /**
+    *  Like Unflatten(), except that string and raw-data fields are not copied out of (bufRef) right away.
+    *  Instead, this Message keeps a reference to (bufRef), and each such field is unflattened only when it
+    *  is first accessed.  Fields that are never accessed are never copied, and when this Message is flattened
+    *  again, any fields that have not been accessed are written out via a simple memcpy() of their original bytes.
+    *  The structure of every field is still validated up front, so a corrupt buffer is rejected here, just as
+    *  it would be by Unflatten().  This is useful for e.g. servers that mostly just pass received Messages along.
+    *  @param bufRef Reference to the ByteBuffer holding the flattened Message.  The contents of this buffer must
+    *                not be modified for as long as this Message (or any copies of it) may still refer to them.
+    *  @param offset Byte offset into (bufRef) at which the flattened Message starts.  Defaults to zero.
+    *  @param size The number of bytes in the flattened Message.  Defaults to MUSCLE_NO_LIMIT, meaning
+    *              all of the bytes in (bufRef) after (offset).
+    *  @return B_NO_ERROR if the buffer was successfully Unflattened, or B_ERROR if there
+    *          was an error (usually meaning the buffer was corrupt, or out-of-memory)
+    *  @note Since the first access to a lazily-unflattened field updates this Message's internal state,
+    *        a Message that was unflattened this way should not be read by more than one thread at a time,
+    *        except via FlattenedSize() and Flatten(), which never unflatten any fields.
+    */
+   status_t UnflattenLazily(const ConstByteBufferRef & bufRef, uint32 offset = 0, uint32 size = MUSCLE_NO_LIMIT);
+
    /** Adds a new string to the Message.
     *  @param fieldName Name of the field to add (or add to)
     *  @param val The string to add
@@ -1510,6 +1530,7 @@ private:
    const AbstractDataArray * GetArray(const String & arrayName, uint32 etc) const;
    AbstractDataArray * GetOrCreateArray(const String & arrayName, uint32 tc);
    const AbstractDataArray * GetArrayAndTypeCode(const String & arrayName, uint32 index, uint32 * retTypeCode) const;
+   status_t UnflattenAux(const uint8 * buffer, uint32 inputBufferBytes, const ConstByteBufferRef * optLazyBufRef);
 
    status_t AddFlatAux(const String & fieldName, const FlatCountableRef & flat, uint32 etc, bool prepend);
    status_t AddFlatAux(const String & fieldName, const ByteBufferRef & bufRef, uint32 etc, bool prepend)
@@ -134,8 +134,8 @@ PR_RESULT_ERRORACCESSDENIED  = 558920246
 # Reply to a PR_COMMAND_GETDATATREES message
 PR_RESULT_DATATREES          = 558920247 
 
-# Reserved for future expansion
-PR_RESULT_RESERVED5          = 558920248 
+# Sent after the last PR_RESULT_DATAITEMS of a paged or streamed PR_COMMAND_GETDATA reply
+PR_RESULT_ENDOFDATAITEMS     = 558920248 
 
 # Reserved for future expansion
 PR_RESULT_RESERVED6          = 558920249 
@@ -309,6 +309,15 @@ PR_NAME_REPLY_ENCODING            = "!Enc"
 # If present as an int32 in PR_COMMAND_GETDATATREES, returned trees will be clipped to this maximum depth. (0==roots only)
 PR_NAME_MAXDEPTH                  = "!MDep"
 
+# If present as an int32 in PR_COMMAND_GETDATA, no more than this many nodes will be returned per page of results
+PR_NAME_MAX_RESULTS               = "!MxRs"
+
+# Any type:  if present in a PR_COMMAND_GETDATA message, the results are generated a little at a time, as the client reads them
+PR_NAME_STREAM_RESULTS            = "!Strm"
+
+# String:  in PR_RESULT_ENDOFDATAITEMS, identifies the rest of the results; send it back in a PR_COMMAND_GETDATA to get the next page
+PR_NAME_RESULTS_CURSOR            = "!Crsr"
+
 # this field name's submessage is the payload of the current node
 # in the message created by StorageReflectSession::SaveNodeTreeToMessage() 
 PR_NAME_NODEDATA                  = "data"  
@@ -61,6 +61,8 @@ win32:MUSCLE_SOURCES += $$MUSCLE_DIR/regex/regex/regcomp.c            \
                         $$MUSCLE_DIR/regex/regex/regexec.c            \
                         $$MUSCLE_DIR/regex/regex/regfree.c
 
+!win32:MUSCLE_SOURCES += $$MUSCLE_DIR/dataio/FileDescriptorDataIO.cpp
+
 MUSCLE_INCLUDES = $$MUSCLE_DIR/qtsupport/QMessageTransceiverThread.h
 
 SOURCES = qt_example.cpp $$MUSCLE_SOURCES
@@ -42,6 +42,7 @@ SOURCES	+= $$MUSCLE_DIR/message/Message.cpp \
         $$MUSCLE_DIR/reflector/ReflectServer.cpp \
         $$MUSCLE_DIR/reflector/FilterSessionFactory.cpp \
         $$MUSCLE_DIR/reflector/RateLimitSessionIOPolicy.cpp \
+        $$MUSCLE_DIR/reflector/HierarchicalRateLimitSessionIOPolicy.cpp \
         $$MUSCLE_DIR/reflector/ServerComponent.cpp \
         $$MUSCLE_DIR/util/MemoryAllocator.cpp \
         $$MUSCLE_DIR/util/Directory.cpp \
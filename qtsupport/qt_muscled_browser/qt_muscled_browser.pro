@@ -44,6 +44,7 @@ SOURCES	+= $$MUSCLE_DIR/message/Message.cpp \
         $$MUSCLE_DIR/reflector/ReflectServer.cpp \
         $$MUSCLE_DIR/reflector/FilterSessionFactory.cpp \
         $$MUSCLE_DIR/reflector/RateLimitSessionIOPolicy.cpp \
+        $$MUSCLE_DIR/reflector/HierarchicalRateLimitSessionIOPolicy.cpp \
         $$MUSCLE_DIR/reflector/ServerComponent.cpp \
         $$MUSCLE_DIR/util/MemoryAllocator.cpp \
         $$MUSCLE_DIR/util/Directory.cpp \
@@ -62,4 +63,6 @@ win32:SOURCES	+= $$MUSCLE_DIR/regex/regex/regcomp.c \
         $$MUSCLE_DIR/regex/regex/regexec.c \
         $$MUSCLE_DIR/regex/regex/regfree.c
 
+!win32:SOURCES	+= $$MUSCLE_DIR/dataio/FileDescriptorDataIO.cpp
+
 HEADERS	+= $$MUSCLE_DIR/qtsupport/QMessageTransceiverThread.h Browser.h
@@ -71,7 +71,7 @@ void ProxySessionFactory :: AboutToDetachFromServer()
 }
 
 AbstractReflectSession ::
-AbstractReflectSession() : _sessionID(GetNextGlobalID(_sessionIDCounter)), _connectingAsync(false), _isConnected(false), _maxAsyncConnectPeriod(MUSCLE_MAX_ASYNC_CONNECT_DELAY_MICROSECONDS), _asyncConnectTimeoutTime(MUSCLE_TIME_NEVER), _reconnectViaTCP(true), _lastByteOutputAt(0), _maxInputChunk(MUSCLE_NO_LIMIT), _maxOutputChunk(MUSCLE_NO_LIMIT), _outputStallLimit(MUSCLE_TIME_NEVER), _autoReconnectDelay(MUSCLE_TIME_NEVER), _reconnectTime(MUSCLE_TIME_NEVER), _wasConnected(false), _isExpendable(false)
+AbstractReflectSession() : _sessionID(GetNextGlobalID(_sessionIDCounter)), _connectingAsync(false), _isConnected(false), _maxAsyncConnectPeriod(MUSCLE_MAX_ASYNC_CONNECT_DELAY_MICROSECONDS), _asyncConnectTimeoutTime(MUSCLE_TIME_NEVER), _reconnectViaTCP(true), _lastByteOutputAt(0), _maxInputChunk(MUSCLE_NO_LIMIT), _maxOutputChunk(MUSCLE_NO_LIMIT), _outputStallLimit(MUSCLE_TIME_NEVER), _scratchReconnected(false), _ioStatusCheckPending(false), _registeredReadFD(-1), _registeredWriteFD(-1), _autoReconnectDelay(MUSCLE_TIME_NEVER), _reconnectTime(MUSCLE_TIME_NEVER), _wasConnected(false), _isExpendable(false)
 {
    char buf[64]; sprintf(buf, UINT32_FORMAT_SPEC, _sessionID);
    _idString = buf;
@@ -114,7 +114,27 @@ AbstractReflectSession ::
 AddOutgoingMessage(const MessageRef & ref) 
 {
    MASSERT(IsAttachedToServer(), "Can not call AddOutgoingMessage() while not attached to the server");
-   return (_gateway()) ? _gateway()->AddOutgoingMessage(ref) : B_ERROR;
+   if ((_gateway() == NULL)||(_gateway()->AddOutgoingMessage(ref) != B_NO_ERROR)) return B_ERROR;
+   InvalidateIOStatus();
+   return B_NO_ERROR;
+}
+
+void
+AbstractReflectSession ::
+SetGateway(const AbstractMessageIOGatewayRef & ref)
+{
+   if (_gateway()) (void) RemovePulseChild(_gateway());
+   _gateway = ref;
+   if (_gateway()) (void) PutPulseChild(_gateway());  // so our gateway gets Pulse()'d whenever we do
+   _outputStallLimit = _gateway()?_gateway()->GetOutputStallLimit():MUSCLE_TIME_NEVER;
+   InvalidateIOStatus();
+}
+
+void
+AbstractReflectSession ::
+InvalidateIOStatus()
+{
+   if ((_ioStatusCheckPending == false)&&(IsFullyAttachedToServer())) GetOwner()->InvalidateSessionIOStatus(this);
 }
 
 status_t
@@ -161,7 +181,7 @@ Reconnect()
       {
          if (_gateway() == NULL)
          {
-            _gateway = CreateGateway();
+            SetGateway(CreateGateway());
             if (_gateway() == NULL) return B_ERROR;
          }
 
@@ -176,7 +196,7 @@ Reconnect()
 
             if (dynamic_cast<SSLSocketAdapterGateway *>(_gateway()) == NULL) 
             {
-               _gateway.SetRef(newnothrow SSLSocketAdapterGateway(_gateway));
+               SetGateway(AbstractMessageIOGatewayRef(newnothrow SSLSocketAdapterGateway(_gateway)));
                if (_gateway() == NULL) return B_ERROR;
             }
          }
@@ -194,6 +214,7 @@ Reconnect()
             SetConnectingAsync(doTCPConnect);
          }
          _scratchReconnected = true;   // tells ReflectServer not to shut down our new IO!
+         InvalidateIOStatus();         // so that ReflectServer will watch our new socket
          return B_NO_ERROR;
       }
    }
@@ -274,7 +295,7 @@ void AbstractReflectSession :: AsyncConnectCompleted()
 }
 
 void AbstractReflectSession :: SetInputPolicy(const AbstractSessionIOPolicyRef & newRef) {SetPolicyAux(_inputPolicyRef, _maxInputChunk, newRef, true);}
-void AbstractReflectSession :: SetOutputPolicy(const AbstractSessionIOPolicyRef & newRef) {SetPolicyAux(_outputPolicyRef, _maxOutputChunk, newRef, true);}
+void AbstractReflectSession :: SetOutputPolicy(const AbstractSessionIOPolicyRef & newRef) {SetPolicyAux(_outputPolicyRef, _maxOutputChunk, newRef, false);}
 void AbstractReflectSession :: SetPolicyAux(AbstractSessionIOPolicyRef & myRef, uint32 & chunk, const AbstractSessionIOPolicyRef & newRef, bool isInput)
 {
    TCHECKPOINT;
@@ -286,6 +307,7 @@ void AbstractReflectSession :: SetPolicyAux(AbstractSessionIOPolicyRef & myRef,
       myRef = newRef;
       chunk = myRef() ? 0 : MUSCLE_NO_LIMIT;  // sensible default to use until my policy gets its say about what we should do
       if (myRef()) myRef()->PolicyHolderAdded(ph);
+      InvalidateIOStatus();
    }
 }
 
@@ -434,6 +456,7 @@ void AbstractReflectSession :: SetConnectingAsync(bool isConnectingAsync)
    _connectingAsync = isConnectingAsync;
    _asyncConnectTimeoutTime = ((_connectingAsync)&&(_maxAsyncConnectPeriod != MUSCLE_TIME_NEVER)) ? (GetRunTime64()+_maxAsyncConnectPeriod) : MUSCLE_TIME_NEVER;
    InvalidatePulseTime();
+   InvalidateIOStatus();
 }
 
 const DataIORef &
@@ -222,7 +222,7 @@ public:
      * to set our gateway for us when we are attached.
      * @param ref Reference to the I/O gateway to use, or a NULL reference to remove any gateway we have.
      */
-   void SetGateway(const AbstractMessageIOGatewayRef & ref) {_gateway = ref; _outputStallLimit = _gateway()?_gateway()->GetOutputStallLimit():MUSCLE_TIME_NEVER;}
+   void SetGateway(const AbstractMessageIOGatewayRef & ref);
 
    /**
     * Returns a reference to our internally held message IO gateway object,
@@ -465,6 +465,15 @@ public:
     */
    status_t Reconnect();
 
+   /** Tells the ReflectServer that the values returned by our IsReadyForInput(), HasBytesToOutput(),
+     * GetSessionReadSelectSocket() or GetSessionWriteSelectSocket() methods may have changed, so that
+     * it will re-check them before its next WaitForEvents() call.  The ReflectServer only checks sessions
+     * that have done I/O, been Pulse()'d, or had Messages added to their outgoing queue, so you only need
+     * to call this if your subclass changes its I/O status in some other way (e.g. by installing a new
+     * DataIO object directly into its gateway).  It's a no-op if we aren't fully attached to a server.
+     */
+   void InvalidateIOStatus();
+
    /** Convenience method:  Returns the "read" file descriptor associated with this session's
      * DataIO class, or a NULL reference if there is none.
      */
@@ -505,6 +514,9 @@ private:
    uint32 _maxOutputChunk;  // and stored here for convenience
    uint64 _outputStallLimit;
    bool _scratchReconnected; // scratch, watched by ReflectServer during ClientConnectionClosed() calls.
+   bool _ioStatusCheckPending; // true iff we are in the ReflectServer's set of sessions to check before its next WaitForEvents()
+   int _registeredReadFD;      // the socket the ReflectServer has registered for our read events, or -1
+   int _registeredWriteFD;     // the socket the ReflectServer has registered for our write events, or -1
    String _sessionRootPath;
 
    // auto-reconnect support
@@ -34,7 +34,7 @@ public:
    uint32 HashCode() const {return ((uint32)((uintptr)_session))+(_asInput?1:0);}  // double-cast for AMD64
 
    /** Equality operator;  returns true iff (rhs) has the same two settings as we do */
-   bool operator == (const PolicyHolder & rhs) {return ((rhs._session == _session)&&(rhs._asInput == _asInput));}
+   bool operator == (const PolicyHolder & rhs) const {return ((rhs._session == _session)&&(rhs._asInput == _asInput));}
 
 private:
    AbstractReflectSession * _session;
@@ -140,6 +140,13 @@ public:
      */
    virtual void EndIO(uint64 now) = 0;
 
+   /** Should return true iff the server needs to wake up at the exact microsecond returned by
+     * this policy's GetPulseTime(), rather than up to a millisecond later.  Under some
+     * SocketMultiplexer implementations (e.g. epoll on older Linux kernels) that costs an
+     * extra system call per event-loop cycle, so the default implementation returns false.
+     */
+   virtual bool IsPrecisePulseTimeRequired() const {return false;}
+
 private:
    friend class ReflectServer;
    bool _hasBegun;  // used by the ReflectServer
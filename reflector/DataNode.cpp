@@ -5,7 +5,7 @@
 
 namespace muscle {
 
-DataNode :: DataNode() : _children(NULL), _orderedIndex(NULL), _orderedCounter(0L), _subscribers(NULL)  // _parent and _cachedDataChecksum will be set in Init()/Reset(), not here
+DataNode :: DataNode() : _children(NULL), _orderedIndex(NULL), _indexEntry(NULL), _orderedCounter(0L), _subscribers(NULL), _subscriberIndices(NULL)  // _parent and _cachedDataChecksum will be set in Init()/Reset(), not here
 {
    // empty
 }
@@ -15,12 +15,14 @@ DataNode :: ~DataNode()
    delete _children;
    delete _orderedIndex;
    delete _subscribers;
+   delete _subscriberIndices;
 }
 
 void DataNode :: Init(const String & name, const MessageRef & initData)
 {
    _nodeName           = name;
    _parent             = NULL;
+   _cachedNodePath.Clear();
    _depth              = 0;
    _maxChildIDHint     = 0;
    _data               = initData;
@@ -37,41 +39,109 @@ void DataNode :: Reset()
    // (See FogBugz #9845 for details)
    delete _children;     _children     = NULL;
    delete _orderedIndex; _orderedIndex = NULL;
-   delete _subscribers;  _subscribers  = NULL;
+   ClearSubscribers();
 
    _parent             = NULL;
+   _cachedNodePath.Clear();
    _depth              = 0;
    _maxChildIDHint     = 0;
+   _orderedCounter     = 0;
    _data.Reset();
    _cachedDataChecksum = 0;
 }
 
-void DataNode :: IncrementSubscriptionRefCount(const String & sessionID, long delta)
+// Below this many subscribers, a linear search of (_subscribers) is cheaper than maintaining (_subscriberIndices)
+#define SUBSCRIBER_INDICES_THRESHOLD 16
+
+int32 DataNode :: IndexOfSubscriber(const StorageReflectSession * session)
 {
-   TCHECKPOINT;
+   if (_subscribers == NULL) return -1;
 
-   if (delta > 0)
+   if ((_subscriberIndices == NULL)&&(_subscribers->GetNumItems() >= SUBSCRIBER_INDICES_THRESHOLD))
    {
-      uint32 res = 0;
-      if (_subscribers == NULL)
+      _subscriberIndices = newnothrow Hashtable<const StorageReflectSession *, uint32>;
+      if (_subscriberIndices)
       {
-         _subscribers = newnothrow Hashtable<const String *, uint32>;
-         if (_subscribers == NULL) WARN_OUT_OF_MEMORY;
+         for (uint32 i=0; i<_subscribers->GetNumItems(); i++) 
+         {
+            if (_subscriberIndices->Put((*_subscribers)[i]._session, i) != B_NO_ERROR)
+            {
+               delete _subscriberIndices;
+               _subscriberIndices = NULL;  // we'll just fall back to a linear search, then
+               break;
+            }
+         }
       }
-      if (_subscribers)
+      else WARN_OUT_OF_MEMORY;
+   }
+
+   if (_subscriberIndices)
+   {
+      const uint32 * idx = _subscriberIndices->Get(session);
+      return idx ? (int32)*idx : -1;
+   }
+   else
+   {
+      for (int32 i=_subscribers->GetNumItems()-1; i>=0; i--) if ((*_subscribers)[i]._session == session) return i;
+      return -1;
+   }
+}
+
+void DataNode :: RemoveSubscriberAt(uint32 idx)
+{
+   // Move our last subscriber into the vacated slot, so that the list stays contiguous without any shifting
+   const uint32 lastIdx = _subscribers->GetNumItems()-1;
+   if (_subscriberIndices) (void) _subscriberIndices->Remove((*_subscribers)[idx]._session);
+   if (idx < lastIdx)
+   {
+      (*_subscribers)[idx] = (*_subscribers)[lastIdx];
+      if (_subscriberIndices) (void) _subscriberIndices->Put((*_subscribers)[idx]._session, idx);  // can't fail, since the key was already present
+   }
+   (void) _subscribers->RemoveTail();
+}
+
+void DataNode :: ClearSubscribers()
+{
+   delete _subscribers;       _subscribers       = NULL;
+   delete _subscriberIndices; _subscriberIndices = NULL;
+}
+
+void DataNode :: IncrementSubscriptionRefCount(StorageReflectSession * session, long delta)
+{
+   TCHECKPOINT;
+
+   if (delta > 0)
+   {
+      const int32 idx = IndexOfSubscriber(session);
+      if (idx >= 0) (*_subscribers)[idx]._refCount += delta;
+      else
       {
-         (void) _subscribers->Get(&sessionID, res);
-         (void) _subscribers->Put(&sessionID, res+delta);  // I'm not sure how to cleanly handle out-of-mem here??  --jaf
+         if (_subscribers == NULL)
+         {
+            _subscribers = newnothrow Queue<Subscriber>;
+            if (_subscribers == NULL) {WARN_OUT_OF_MEMORY; return;}
+         }
+         if (_subscribers->AddTail(Subscriber(session, delta)) == B_NO_ERROR)
+         {
+            if ((_subscriberIndices)&&(_subscriberIndices->Put(session, _subscribers->GetNumItems()-1) != B_NO_ERROR))
+            {
+               // Out of memory; drop the index, IndexOfSubscriber() will try to regenerate it later
+               delete _subscriberIndices;
+               _subscriberIndices = NULL;
+            }
+         }
+         else WARN_OUT_OF_MEMORY;  // I'm not sure how to cleanly handle out-of-mem here??  --jaf
       }
    }
    else if (delta < 0)
    {
-      uint32 res = 0;
-      if ((_subscribers)&&(_subscribers->Get(&sessionID, res) == B_NO_ERROR))
+      const int32 idx = IndexOfSubscriber(session);
+      if (idx >= 0)
       {
+         uint32 & refCount = (*_subscribers)[idx]._refCount;
          uint32 decBy = (uint32) -delta;
-         if (decBy >= res) (void) _subscribers->Remove(&sessionID);
-                      else (void) _subscribers->Put(&sessionID, res-decBy);  // out-of-mem shouldn't be possible
+         if (decBy >= refCount) RemoveSubscriberAt(idx);
+                           else refCount -= decBy;
       }
    }
 }
@@ -80,15 +150,7 @@ status_t DataNode :: InsertOrderedChild(const MessageRef & data, const String *
 {
    TCHECKPOINT;
 
-   if (_orderedIndex == NULL)
-   {
-      _orderedIndex = newnothrow Queue<DataNodeRef>;
-      if (_orderedIndex == NULL)
-      {
-         WARN_OUT_OF_MEMORY; 
-         return B_ERROR;
-      }
-   }
+   if (EnsureIndexAllocated() != B_NO_ERROR) return B_ERROR;
 
    // Find a unique ID string for our new kid
    String temp;  // must be declared out here!
@@ -111,16 +173,10 @@ status_t DataNode :: InsertOrderedChild(const MessageRef & data, const String *
    }
 
    uint32 insertIndex = _orderedIndex->GetNumItems();  // default to end of index
-   if ((optInsertBefore)&&(optInsertBefore->Cstr()[0] == 'I'))  // only 'I''s could be in our index!
+   if (optInsertBefore)
    {
-      for (int i=_orderedIndex->GetNumItems()-1; i>=0; i--) 
-      {
-         if ((*_orderedIndex)[i]()->GetNodeName() == *optInsertBefore)
-         {
-            insertIndex = i;
-            break;
-         }
-      }
+      const int32 beforeIndex = GetIndexPositionOf(*optInsertBefore);
+      if (beforeIndex >= 0) insertIndex = beforeIndex;
    }
  
    // Update the index
@@ -128,8 +184,11 @@ status_t DataNode :: InsertOrderedChild(const MessageRef & data, const String *
    {
       if (_orderedIndex->InsertItemAt(insertIndex, dref) == B_NO_ERROR)
       {
-         String np;
-         if ((optRetAdded)&&(dref()->GetNodePath(np) == B_NO_ERROR)) (void) optRetAdded->Put(np, dref);
+         if (optRetAdded)
+         {
+            const String & np = dref()->GetNodePath();
+            if (np.HasChars()) (void) optRetAdded->Put(np, dref);
+         }
 
          // Notify anyone monitoring this node that the ordered-index has been updated
          notifyWithOnSetParent->NotifySubscribersThatNodeIndexChanged(*this, INDEX_OP_ENTRYINSERTED, insertIndex, dref()->GetNodeName());
@@ -144,9 +203,9 @@ status_t DataNode :: RemoveIndexEntryAt(uint32 removeIndex, StorageReflectSessio
 {
    TCHECKPOINT;
 
-   if ((_orderedIndex)&&(removeIndex < _orderedIndex->GetNumItems()))
+   DataNodeRef holdKey;  // gotta keep a reference here, or it's dangling pointer time
+   if ((_orderedIndex)&&(_orderedIndex->RemoveItemAt(removeIndex, holdKey) == B_NO_ERROR))
    {
-      DataNodeRef holdKey = _orderedIndex->RemoveItemAtWithDefault(removeIndex);  // gotta make a temp copy here, or it's dangling pointer time
       if ((holdKey())&&(optNotifyWith)) optNotifyWith->NotifySubscribersThatNodeIndexChanged(*this, INDEX_OP_ENTRYREMOVED, removeIndex, holdKey()->GetNodeName());
       return B_NO_ERROR;
    }
@@ -162,12 +221,7 @@ status_t DataNode :: InsertIndexEntryAt(uint32 insertIndex, StorageReflectSessio
       DataNodeRef childNode;
       if (_children->Get(&key, childNode) == B_NO_ERROR)
       {
-         if (_orderedIndex == NULL)
-         {
-            _orderedIndex = newnothrow Queue<DataNodeRef>;
-            if (_orderedIndex == NULL) WARN_OUT_OF_MEMORY; 
-         }
-         if ((_orderedIndex)&&(_orderedIndex->InsertItemAt(insertIndex, childNode) == B_NO_ERROR))
+         if ((EnsureIndexAllocated() == B_NO_ERROR)&&(_orderedIndex->InsertItemAt(insertIndex, childNode) == B_NO_ERROR))
          {
             // Notify anyone monitoring this node that the ordered-index has been updated
             notifyWithOnSetParent->NotifySubscribersThatNodeIndexChanged(*this, INDEX_OP_ENTRYINSERTED, insertIndex, childNode()->GetNodeName());
@@ -187,16 +241,10 @@ status_t DataNode :: ReorderChild(const DataNodeRef & child, const String * move
    {
       // Then re-add him to the index at the appropriate point
       uint32 targetIndex = _orderedIndex->GetNumItems();  // default to end of index
-      if ((moveToBeforeThis)&&(HasChild(*moveToBeforeThis)))
+      if (moveToBeforeThis)
       {
-         for (int i=_orderedIndex->GetNumItems()-1; i>=0; i--) 
-         { 
-            if (*moveToBeforeThis == (*_orderedIndex)[i]()->GetNodeName())
-            {
-               targetIndex = i;
-               break; 
-            }
-         }
+         const int32 beforeIndex = GetIndexPositionOf(*moveToBeforeThis);
+         if (beforeIndex >= 0) targetIndex = beforeIndex;
       }
 
       // Now add the child back into the index at his new position
@@ -241,13 +289,14 @@ void DataNode :: SetParent(DataNode * parent, StorageReflectSession * optNotifyW
 
    if ((_parent)&&(parent)) LogTime(MUSCLE_LOG_WARNING, "Warning, overwriting previous parent of node [%s]\n", GetNodeName()());
    _parent = parent;
+   InvalidateCachedNodePaths();  // since our node path (and our descendants' paths) depend on our parent
    if (_parent) 
    {
       const char * nn = _nodeName();
       uint32 id = atol(&nn[(*nn=='I')?1:0]);
       _parent->_maxChildIDHint = muscleMax(_parent->_maxChildIDHint, id);
    }
-   else if (_subscribers) _subscribers->Clear();
+   else ClearSubscribers();
 
    // Calculate our node's depth into the tree
    _depth = 0;
@@ -275,10 +324,48 @@ const String * DataNode :: GetPathClause(uint32 depth) const
    return NULL;
 }
 
+void DataNode :: UpdateCachedNodePath() const
+{
+   if (_parent)
+   {
+      // Our parent's path is cached along the way, so that our siblings and descendants can reuse it
+      const String & parentPath = _parent->GetNodePath();
+      if (parentPath.HasChars())
+      {
+         const bool parentIsRoot = (_parent->_parent == NULL);
+         if (_cachedNodePath.Prealloc(parentPath.Length()+(parentIsRoot?0:1)+_nodeName.Length()) == B_NO_ERROR)
+         {
+            _cachedNodePath = parentPath;
+            if (parentIsRoot == false) _cachedNodePath += '/';
+            _cachedNodePath += _nodeName;
+         }
+      }
+   }
+   else _cachedNodePath = "/";
+}
+
+void DataNode :: InvalidateCachedNodePaths()
+{
+   // A node's path is only ever cached after its parent's path is, so we can stop recursing at any node that has no cached path
+   if (_cachedNodePath.HasChars())
+   {
+      _cachedNodePath.Clear();
+      if (_children) for (HashtableIterator<const String *, DataNodeRef> iter(*_children); iter.HasData(); iter++) iter.GetValue()()->InvalidateCachedNodePaths();
+   }
+}
+
 status_t DataNode :: GetNodePath(String & retPath, uint32 startDepth) const
 {
    TCHECKPOINT;
 
+   if (startDepth == 0)
+   {
+      const String & np = GetNodePath();
+      if (np.IsEmpty()) return B_ERROR;
+      retPath = np;
+      return B_NO_ERROR;
+   }
+
    // Calculate node path and node depth
    if (_parent)
    {
@@ -364,21 +451,32 @@ status_t DataNode :: RemoveIndexEntry(const String & key, StorageReflectSession
    TCHECKPOINT;
 
    // Update our ordered-node index & notify everyone about the change
-   if ((_orderedIndex)&&(key()[0] == 'I'))  // if it doesn't start with I, we know it's not part of our ordered-index!
+   const int32 idx = GetIndexPositionOf(key);
+   DataNodeRef holdKey;  // (key) may belong to the removed child, so we need to keep it alive until we're done
+   if ((idx >= 0)&&(_orderedIndex->RemoveItemAt(idx, holdKey) == B_NO_ERROR))
    {
-      for (int i=_orderedIndex->GetNumItems()-1; i>=0; i--)
-      {
-         if (key == (*_orderedIndex)[i]()->GetNodeName())
-         {
-            (void) _orderedIndex->RemoveItemAt(i);
-            if (optNotifyWith) optNotifyWith->NotifySubscribersThatNodeIndexChanged(*this, INDEX_OP_ENTRYREMOVED, i, key);
-            return B_NO_ERROR;
-         }
-      }
+      if (optNotifyWith) optNotifyWith->NotifySubscribersThatNodeIndexChanged(*this, INDEX_OP_ENTRYREMOVED, idx, key);
+      return B_NO_ERROR;
    }
    return B_ERROR;
 }
 
+int32 DataNode :: GetIndexPositionOf(const String & key) const
+{
+   const DataNodeRef * childRef = ((_orderedIndex)&&(_children)) ? _children->Get(&key) : NULL;
+   return childRef ? _orderedIndex->IndexOf(childRef->GetItemPointer()) : -1;
+}
+
+status_t DataNode :: EnsureIndexAllocated()
+{
+   if (_orderedIndex == NULL)
+   {
+      _orderedIndex = newnothrow DataNodeIndex;
+      if (_orderedIndex == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   }
+   return B_NO_ERROR;
+}
+
 void DataNode :: SetData(const MessageRef & data, StorageReflectSession * optNotifyWith, bool isBeingCreated)
 {
    MessageRef oldData;
@@ -396,7 +494,7 @@ uint32 DataNode :: CalculateChecksum(uint32 maxRecursionDepth) const
    else
    {
       uint32 ret = _cachedDataChecksum;
-      if (_orderedIndex) for (int32 i=_orderedIndex->GetNumItems()-1; i>=0; i--) ret += (*_orderedIndex)[i]()->GetNodeName().CalculateChecksum();
+      if (_orderedIndex) for (DataNodeIndexIterator iter(*_orderedIndex); iter.HasData(); iter++) ret += iter.GetValue()()->GetNodeName().CalculateChecksum();
       if (_children) for (HashtableIterator<const String *, DataNodeRef> iter(*_children); iter.HasData(); iter++) ret += iter.GetValue()()->CalculateChecksum(maxRecursionDepth-1);
       return ret;
    }
@@ -409,17 +507,18 @@ void DataNode :: PrintToStream(FILE * optFile, uint32 maxRecursionDepth, int ind
    if (optFile == NULL) optFile = stdout;
 
    PrintIndent(optFile, indentLevel);
-   String np; (void) GetNodePath(np);
+   const String & np = GetNodePath();
    fprintf(optFile, "DataNode [%s] numChildren=" UINT32_FORMAT_SPEC " orderedIndex=" INT32_FORMAT_SPEC " checksum=" UINT32_FORMAT_SPEC " msgChecksum=" UINT32_FORMAT_SPEC "\n", np(), _children?_children->GetNumItems():0, _orderedIndex?(int32)_orderedIndex->GetNumItems():(int32)-1, CalculateChecksum(maxRecursionDepth), _data()?_data()->CalculateChecksum():0);
    if (_data()) _data()->PrintToStream(optFile, true, indentLevel+1);
    if (maxRecursionDepth > 0)
    {
       if (_orderedIndex)
       {
-         for (uint32 i=0; i<_orderedIndex->GetNumItems(); i++)
+         uint32 i = 0;
+         for (DataNodeIndexIterator iter(*_orderedIndex); iter.HasData(); iter++)
          {
             PrintIndent(optFile, indentLevel);
-            fprintf(optFile, "   Index slot " UINT32_FORMAT_SPEC " = %s\n", i, (*_orderedIndex)[i]()->GetNodeName()());
+            fprintf(optFile, "   Index slot " UINT32_FORMAT_SPEC " = %s\n", i++, iter.GetValue()()->GetNodeName()());
          }
       }
       if (_children)
@@ -482,4 +581,278 @@ DataNodeRef DataNode :: GetDescendantAux(const char * subPath) const
    else return GetChild(subPath);
 }
 
+/** One entry in a DataNodeIndex's tree.  (_size) is the number of entries in the subtree rooted here, and
+  * (_priority) is a pseudo-random number; the tree is kept heap-ordered on it, which keeps it balanced.
+  */
+class DataNodeIndexEntry
+{
+public:
+   DataNodeIndexEntry(const DataNodeRef & node, uint32 priority) : _node(node), _left(NULL), _right(NULL), _parent(NULL), _size(1), _priority(priority) {/* empty */}
+
+   DataNodeRef _node;
+   DataNodeIndexEntry * _left;
+   DataNodeIndexEntry * _right;
+   DataNodeIndexEntry * _parent;
+   uint32 _size;
+   uint32 _priority;
+};
+
+static inline uint32 GetSubtreeSize(const DataNodeIndexEntry * e) {return e ? e->_size : 0;}
+
+// Recalculates (e)'s size from its children's, and makes sure the children point back to (e)
+static void UpdateEntry(DataNodeIndexEntry * e)
+{
+   e->_size = 1+GetSubtreeSize(e->_left)+GetSubtreeSize(e->_right);
+   if (e->_left)  e->_left->_parent  = e;
+   if (e->_right) e->_right->_parent = e;
+}
+
+// Recalculates the sizes of (e) and of each of its ancestors, from the bottom up
+static void UpdateEntryAndAncestors(DataNodeIndexEntry * e)
+{
+   for (; e; e=e->_parent) UpdateEntry(e);
+}
+
+// Splits the subtree rooted at (e) into a subtree of its first (numLeft) entries and a subtree of the rest.
+// This (like MergeEntries() and DeleteEntries()) is done iteratively rather than recursively, so that even
+// a badly unbalanced tree can't overflow the stack.
+static void SplitEntries(DataNodeIndexEntry * e, uint32 numLeft, DataNodeIndexEntry * & retLeft, DataNodeIndexEntry * & retRight)
+{
+   // Walk down from (e), appending each entry to the bottom of the right spine of the left subtree, or of the left spine of the right subtree
+   DataNodeIndexEntry * lastLeft  = NULL;
+   DataNodeIndexEntry * lastRight = NULL;
+   DataNodeIndexEntry ** leftSlot  = &retLeft;
+   DataNodeIndexEntry ** rightSlot = &retRight;
+   while(e)
+   {
+      const uint32 leftSize = GetSubtreeSize(e->_left);
+      if (leftSize < numLeft)
+      {
+         numLeft -= (leftSize+1);
+         *leftSlot  = e;
+         e->_parent = lastLeft;
+         lastLeft   = e;
+         leftSlot   = &e->_right;
+         e          = e->_right;
+      }
+      else
+      {
+         *rightSlot = e;
+         e->_parent = lastRight;
+         lastRight  = e;
+         rightSlot  = &e->_left;
+         e          = e->_left;
+      }
+   }
+   *leftSlot = *rightSlot = NULL;
+
+   // Then the entries we moved have to have their sizes recalculated
+   UpdateEntryAndAncestors(lastLeft);
+   UpdateEntryAndAncestors(lastRight);
+}
+
+// Joins two subtrees (all of whose entries in (left) come before all of the entries in (right)) into one
+static DataNodeIndexEntry * MergeEntries(DataNodeIndexEntry * left, DataNodeIndexEntry * right)
+{
+   // Walk down the right spine of (left) and the left spine of (right), always taking the higher-priority entry next
+   DataNodeIndexEntry * ret  = NULL;
+   DataNodeIndexEntry * last = NULL;
+   DataNodeIndexEntry ** slot = &ret;
+   while((left)&&(right))
+   {
+      if (left->_priority > right->_priority)
+      {
+         *slot = left;
+         left->_parent = last;
+         last = left;
+         slot = &left->_right;
+         left = left->_right;
+      }
+      else
+      {
+         *slot = right;
+         right->_parent = last;
+         last  = right;
+         slot  = &right->_left;
+         right = right->_left;
+      }
+   }
+   *slot = left ? left : right;
+
+   UpdateEntryAndAncestors(last);
+   return ret;
+}
+
+void DataNodeIndex :: DeleteEntries(DataNodeIndexEntry * e)
+{
+   while(e)
+   {
+      if (e->_left)
+      {
+         // Rotate our left child up into our place, so that eventually the entry at the top has no left child
+         DataNodeIndexEntry * left = e->_left;
+         e->_left     = left->_right;
+         left->_right = e;
+         e = left;
+      }
+      else
+      {
+         DataNodeIndexEntry * next = e->_right;
+         e->_node()->_indexEntry = NULL;
+         delete e;
+         e = next;
+      }
+   }
+}
+
+// Seeds each index's pseudo-random sequence differently, so that a client can't predict the shape of
+// the tree, and pick an order of insertions and removals that would leave it badly unbalanced
+static uint32 GetDataNodeIndexSeed(const DataNodeIndex * index)
+{
+   const uint64 now = GetRunTime64();
+   const uint32 vals[] = {(uint32)now, (uint32)(now>>32), (uint32)((uintptr)index), (uint32)(((uint64)(uintptr)index)>>32)};
+   const uint32 ret = CalculateHashCode(vals, sizeof(vals));
+   return ret ? ret : 2463534242UL;  // xorshift32 gets stuck at zero
+}
+
+DataNodeIndex :: DataNodeIndex() : _root(NULL), _numItems(0), _nextPriority(GetDataNodeIndexSeed(this))
+{
+   // empty
+}
+
+DataNodeIndex :: ~DataNodeIndex()
+{
+   Clear();
+}
+
+void DataNodeIndex :: Clear()
+{
+   DeleteEntries(_root);
+   _root     = NULL;
+   _numItems = 0;
+}
+
+const DataNodeRef & DataNodeIndex :: GetItemAt(uint32 idx) const
+{
+   const DataNodeIndexEntry * e = _root;
+   while(e)
+   {
+      const uint32 leftSize = GetSubtreeSize(e->_left);
+      if (idx < leftSize) e = e->_left;
+      else if (idx == leftSize) return e->_node;
+      else
+      {
+         idx -= (leftSize+1);
+         e = e->_right;
+      }
+   }
+   return GetDefaultObjectForType<DataNodeRef>();
+}
+
+int32 DataNodeIndex :: IndexOf(const DataNode * node) const
+{
+   const DataNodeIndexEntry * e = node ? node->_indexEntry : NULL;
+   if (e == NULL) return -1;
+
+   // Our position is the number of entries to our left:  the ones in our left subtree, plus
+   // those (and their left subtrees) of each ancestor that we're in the right subtree of
+   uint32 ret = GetSubtreeSize(e->_left);
+   while(e->_parent)
+   {
+      if (e == e->_parent->_right) ret += GetSubtreeSize(e->_parent->_left)+1;
+      e = e->_parent;
+   }
+   return (e == _root) ? (int32)ret : -1;  // (node) might be in some other DataNode's index
+}
+
+status_t DataNodeIndex :: InsertItemAt(uint32 idx, const DataNodeRef & node)
+{
+   if ((idx > _numItems)||(node() == NULL)||(node()->_indexEntry)) return B_ERROR;
+
+   // xorshift32, so that our tree's shape doesn't depend on the order the entries are inserted in
+   _nextPriority ^= (_nextPriority << 13);
+   _nextPriority ^= (_nextPriority >> 17);
+   _nextPriority ^= (_nextPriority << 5);
+
+   DataNodeIndexEntry * newEntry = newnothrow DataNodeIndexEntry(node, _nextPriority);
+   if (newEntry == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   DataNodeIndexEntry * left;
+   DataNodeIndexEntry * right;
+   SplitEntries(_root, idx, left, right);
+   _root = MergeEntries(MergeEntries(left, newEntry), right);
+   _root->_parent = NULL;
+   _numItems++;
+   node()->_indexEntry = newEntry;
+   return B_NO_ERROR;
+}
+
+status_t DataNodeIndex :: RemoveItemAt(uint32 idx, DataNodeRef & retNode)
+{
+   if (idx >= _numItems) return B_ERROR;
+
+   DataNodeIndexEntry * e = _root;
+   while(true)
+   {
+      const uint32 leftSize = GetSubtreeSize(e->_left);
+      if (idx < leftSize) e = e->_left;
+      else if (idx == leftSize) break;
+      else
+      {
+         idx -= (leftSize+1);
+         e = e->_right;
+      }
+   }
+
+   // Replace (e) with the merger of its two subtrees, then fix up the sizes of its ancestors
+   DataNodeIndexEntry * parent      = e->_parent;
+   DataNodeIndexEntry * replacement = MergeEntries(e->_left, e->_right);
+   if (replacement) replacement->_parent = parent;
+   if (parent == NULL) _root = replacement;
+   else
+   {
+      if (parent->_left == e) parent->_left  = replacement;
+                         else parent->_right = replacement;
+      for (DataNodeIndexEntry * p=parent; p; p=p->_parent) p->_size--;
+   }
+   _numItems--;
+
+   retNode = e->_node;
+   retNode()->_indexEntry = NULL;
+   delete e;
+   return B_NO_ERROR;
+}
+
+DataNodeIndexIterator :: DataNodeIndexIterator(const DataNodeIndex & index) : _entry(index._root)
+{
+   if (_entry) while(_entry->_left) _entry = _entry->_left;
+}
+
+void DataNodeIndexIterator :: operator++(int)
+{
+   if (_entry == NULL) return;
+
+   if (_entry->_right)
+   {
+      _entry = _entry->_right;
+      while(_entry->_left) _entry = _entry->_left;
+   }
+   else
+   {
+      // Go up until we come up from a left subtree; that parent is the next entry
+      const DataNodeIndexEntry * prev = _entry;
+      _entry = _entry->_parent;
+      while((_entry)&&(prev == _entry->_right))
+      {
+         prev   = _entry;
+         _entry = _entry->_parent;
+      }
+   }
+}
+
+const DataNodeRef & DataNodeIndexIterator :: GetValue() const
+{
+   return _entry->_node;
+}
+
 }; // end namespace muscle
@@ -11,6 +11,8 @@ namespace muscle {
 
 class StorageReflectSession;
 class DataNode;
+class DataNodeIndex;
+class DataNodeIndexEntry;  // defined in DataNode.cpp
 
 DECLARE_REFTYPES(DataNode);
 
@@ -118,13 +120,20 @@ public:
    status_t GetNodePath(String & retPath, uint32 startDepth = 0) const;
 
    /** A more convenient verseion of the above GetNodePath() implementation.
-     * @param startDepth The depth at which the path should start.  Defaults to zero, meaning the full path.
-     *                   Values greater than zero will return a partial path (e.g. a startDepth of 1 in the
-     *                   above example would return "12.18.240.15/1234/beshare/files/joe", and a startDepth
-     *                   of 2 would return "1234/beshare/files/joe")
+     * @param startDepth The depth at which the path should start.  Values greater than zero will return a partial 
+     *                   path (e.g. a startDepth of 1 in the above example would return "12.18.240.15/1234/beshare/files/joe",
+     *                   and a startDepth of 2 would return "1234/beshare/files/joe")
      * @returns this node's node path as a String.
      */
-   String GetNodePath(uint32 startDepth = 0) const {String ret; (void) GetNodePath(ret, startDepth); return ret;}
+   String GetNodePath(uint32 startDepth) const {String ret; (void) GetNodePath(ret, startDepth); return ret;}
+
+   /** Returns the full node path of this node (e.g. "/12.18.240.15/1234/beshare/files/joe").
+     * The path is generated the first time it is asked for, and cached until this node (or one of its
+     * ancestors) is given a new parent, so calling this method repeatedly is cheap.
+     * @note the returned reference remains valid only until this node is reparented, reset, or deleted.
+     * @returns this node's node path, or an empty String if it couldn't be generated (out of memory?)
+     */
+   const String & GetNodePath() const {if (_cachedNodePath.IsEmpty()) UpdateCachedNodePath(); return _cachedNodePath;}
 
    /** Returns the name of the node in our path at the (depth) level.
      * @param depth The node name we are interested in.  For example, 0 will return the name of the
@@ -154,18 +163,27 @@ public:
    void Reset();  
 
    /**
-    * Modifies the refcount for the given sessionID.
-    * Any sessionID's with (refCount > 0) will be in the GetSubscribers() list.
-    * @param sessionID the sessionID whose reference count is to be modified
+    * Modifies the subscription refcount for the given session.
+    * Any sessions with (refCount > 0) will be in our list of subscribers (see GetSubscriberAt()).
+    * @param session the session whose reference count is to be modified.  A session must remove all of its
+    *                references (e.g. when it is detached from the server) before it is deleted, since our 
+    *                subscribers list holds plain pointers rather than references to the sessions.
     * @param delta the amount to add to the reference count.
     */
-   void IncrementSubscriptionRefCount(const String & sessionID, long delta);
+   void IncrementSubscriptionRefCount(StorageReflectSession * session, long delta);
 
-   /** Returns an iterator that can be used to iterate over our list of active subscribers */
-   HashtableIterator<const String *, uint32> GetSubscribers() const {return _subscribers ? _subscribers->GetIterator() : HashtableIterator<const String *, uint32>();}
+   /** Returns the number of sessions currently subscribed to this node */
+   uint32 GetNumSubscribers() const {return _subscribers ? _subscribers->GetNumItems() : 0;}
 
-   /** Returns a pointer to our ordered-child index */
-   const Queue<DataNodeRef> * GetIndex() const {return _orderedIndex;}
+   /** Returns the (idx)th session currently subscribed to this node.  Subscribers are not kept in any particular order.
+     * Note that when a session unsubscribes, our last subscriber is moved into its slot, so a loop that might cause
+     * sessions to unsubscribe (e.g. by calling their callbacks) should iterate from the end of the list to the start.
+     * @param idx Index of the subscriber to return.  Must be less than GetNumSubscribers().
+     */
+   StorageReflectSession * GetSubscriberAt(uint32 idx) const {return (*_subscribers)[idx]._session;}
+
+   /** Returns a pointer to our ordered-child index, or NULL if we don't have one. */
+   const DataNodeIndex * GetIndex() const {return _orderedIndex;}
 
    /** Insert a new entry into our ordered-child list at the (nth) entry position.
     *  Don't call this function unless you really know what you are doing!
@@ -278,6 +296,7 @@ public:
 private:
    friend class StorageReflectSession;
    friend class ObjectPool<DataNode>;
+   friend class DataNodeIndex;
    DataNodeRef GetDescendantAux(const char * subPath) const;
 
    /** Assignment operator.  Note that this operator is only here to assist with ObjectPool recycling operations, and doesn't actually
@@ -287,19 +306,129 @@ private:
 
    void Init(const String & nodeName, const MessageRef & initialValue);
    void SetParent(DataNode * _parent, StorageReflectSession * optNotifyWith);
+   void UpdateCachedNodePath() const;
+   void InvalidateCachedNodePaths();
+   int32 IndexOfSubscriber(const StorageReflectSession * session);
+   void RemoveSubscriberAt(uint32 idx);
+   void ClearSubscribers();
    status_t RemoveIndexEntry(const String & key, StorageReflectSession * optNotifyWith);
+   int32 GetIndexPositionOf(const String & key) const;
+   status_t EnsureIndexAllocated();
 
    DataNode * _parent;
    MessageRef _data;
    mutable uint32 _cachedDataChecksum;
    Hashtable<const String *, DataNodeRef> * _children;  // lazy-allocated
-   Queue<DataNodeRef> * _orderedIndex;  // only used when tracking the ordering of our children (lazy-allocated)
+   DataNodeIndex * _orderedIndex;  // only used when tracking the ordering of our children (lazy-allocated)
+   DataNodeIndexEntry * _indexEntry;  // our entry in our parent's _orderedIndex, or NULL if we aren't in it
    uint32 _orderedCounter;
    String _nodeName;
+   mutable String _cachedNodePath;  // demand-generated by GetNodePath(); empty when not currently cached
    uint32 _depth;  // number of ancestors our node has (e.g. root's _depth is zero)
    uint32 _maxChildIDHint;  // keep track of the largest child ID, for easier allocation of non-conflicting future child IDs
 
-   Hashtable<const String *, uint32> * _subscribers;  // lazy-allocated
+   /** One entry in our list of subscribed sessions */
+   class Subscriber
+   {
+   public:
+      Subscriber() : _session(NULL), _refCount(0) {/* empty */}
+      Subscriber(StorageReflectSession * session, uint32 refCount) : _session(session), _refCount(refCount) {/* empty */}
+
+      StorageReflectSession * _session;
+      uint32 _refCount;
+   };
+
+   Queue<Subscriber> * _subscribers;  // lazy-allocated; kept contiguous so that notifying our subscribers is a simple array walk
+   Hashtable<const StorageReflectSession *, uint32> * _subscriberIndices;  // session -> index in (_subscribers); allocated only when we have many subscribers
+};
+
+/** This class is the ordered-child index of a DataNode:  an ordered list of references to some or all of
+  * the DataNode's children.  It is kept as a balanced binary tree (a treap) in which each entry knows
+  * how many entries are beneath it, so that inserting or removing an entry at a given position, looking
+  * up the entry at a given position, and finding the position of a given child all take O(log N) time,
+  * instead of O(N) time, which matters for indices with many thousands of entries.  Each indexed
+  * DataNode keeps a pointer to its own entry, so finding a child's position requires no searching.
+  */
+class DataNodeIndex
+{
+public:
+   /** Default constructor.  Creates an empty index. */
+   DataNodeIndex();
+
+   /** Destructor. */
+   ~DataNodeIndex();
+
+   /** Returns the number of entries in the index. */
+   uint32 GetNumItems() const {return _numItems;}
+
+   /** Returns true iff the index has at least one entry in it. */
+   bool HasItems() const {return (_numItems > 0);}
+
+   /** Returns the DataNodeRef at the given position in the index, or a NULL reference if (idx) is out of range.
+     * @param idx Position of the entry to return (zero is the first entry).
+     */
+   const DataNodeRef & GetItemAt(uint32 idx) const;
+
+   /** Convenience synonym for GetItemAt(). */
+   const DataNodeRef & operator [](uint32 idx) const {return GetItemAt(idx);}
+
+   /** Returns the position of (node) in this index, or -1 if (node) isn't in this index.
+     * @param node The DataNode to look for.
+     */
+   int32 IndexOf(const DataNode * node) const;
+
+   /** Inserts (node) into the index at the given position.
+     * @param idx The position to insert at.  Must not be greater than GetNumItems().
+     * @param node The DataNode to insert.  It must not already be in an index.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (bad position, already indexed, or out of memory)
+     */
+   status_t InsertItemAt(uint32 idx, const DataNodeRef & node);
+
+   /** Removes the entry at the given position from the index.
+     * @param idx The position of the entry to remove.
+     * @param retNode On success, the removed DataNodeRef is written here.
+     * @returns B_NO_ERROR on success, or B_ERROR if (idx) was out of range.
+     */
+   status_t RemoveItemAt(uint32 idx, DataNodeRef & retNode);
+
+   /** Removes all entries from the index. */
+   void Clear();
+
+private:
+   friend class DataNodeIndexIterator;
+
+   DataNodeIndex(const DataNodeIndex &);  // unimplemented, on purpose
+   DataNodeIndex & operator = (const DataNodeIndex &);  // unimplemented, on purpose
+
+   static void DeleteEntries(DataNodeIndexEntry * e);
+
+   DataNodeIndexEntry * _root;
+   uint32 _numItems;
+   uint32 _nextPriority;  // state of the pseudo-random sequence used to balance the tree
+};
+
+/** This class is used to iterate over the entries in a DataNodeIndex, in order.  Each step is O(1) on average.
+  * Modifying the index while iterating over it is not supported.
+  */
+class DataNodeIndexIterator
+{
+public:
+   /** Constructor.
+     * @param index The index to iterate over, starting with its first entry.
+     */
+   DataNodeIndexIterator(const DataNodeIndex & index);
+
+   /** Returns true iff the iterator is pointing at a valid entry. */
+   bool HasData() const {return (_entry != NULL);}
+
+   /** Advances the iterator to the next entry in the index. */
+   void operator++(int);
+
+   /** Returns the DataNodeRef the iterator is currently pointing at.  Only valid if HasData() returns true. */
+   const DataNodeRef & GetValue() const;
+
+private:
+   const DataNodeIndexEntry * _entry;
 };
 
 }; // end namespace muscle
@@ -0,0 +1,325 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include "reflector/HierarchicalRateLimitSessionIOPolicy.h"
+
+namespace muscle {
+
+void
+HierarchicalRateLimitSessionIOPolicy :: TokenBucket ::
+SetParameters(uint32 maxRate, uint32 burstBytes)
+{
+   _maxRate        = maxRate;
+   _burstBytes     = burstBytes;
+   _scaledTokens   = (_maxRate > 0) ? (((uint64)_burstBytes)*MICROS_PER_SECOND) : 0;  // start out full, unless we're never allowed to transfer anything
+   _lastUpdateTime = 0;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy :: TokenBucket ::
+Update(uint64 now)
+{
+   if ((_maxRate == MUSCLE_NO_LIMIT)||(_maxRate == 0)||(now <= _lastUpdateTime)) return;
+
+   if (_lastUpdateTime > 0)
+   {
+      const uint64 maxScaledTokens = ((uint64)_burstBytes)*MICROS_PER_SECOND;
+      const uint64 elapsed = now-_lastUpdateTime;
+      if (elapsed > (maxScaledTokens-muscleMin(_scaledTokens, maxScaledTokens))/_maxRate) _scaledTokens = maxScaledTokens;  // full (checked this way to avoid overflow)
+                                                                                      else _scaledTokens += elapsed*_maxRate;
+   }
+   _lastUpdateTime = now;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy :: TokenBucket ::
+Consume(uint32 numBytes)
+{
+   if (_maxRate == MUSCLE_NO_LIMIT) return;
+
+   const uint64 scaledBytes = ((uint64)numBytes)*MICROS_PER_SECOND;
+   _scaledTokens = (_scaledTokens > scaledBytes) ? (_scaledTokens-scaledBytes) : 0;
+}
+
+uint64
+HierarchicalRateLimitSessionIOPolicy :: TokenBucket ::
+GetTimeWhenAvailable(uint32 numBytes) const
+{
+   if (_maxRate == MUSCLE_NO_LIMIT) return 0;
+   if (_maxRate == 0) return MUSCLE_TIME_NEVER;
+
+   const uint64 scaledBytes = ((uint64)numBytes)*MICROS_PER_SECOND;
+   if (_scaledTokens >= scaledBytes) return _lastUpdateTime;
+   return _lastUpdateTime+(((scaledBytes-_scaledTokens)+_maxRate-1)/_maxRate);  // round up, so that we don't wake up a microsecond too early
+}
+
+HierarchicalRateLimitSessionIOPolicy ::
+HierarchicalRateLimitSessionIOPolicy(uint32 maxRate, uint32 burstBytes) : _cycleCount(0), _now(0), _allotmentsComputed(false), _activeGroupWeight(0), _nextWakeupTime(MUSCLE_TIME_NEVER)
+{
+   _rootBucket.SetParameters((maxRate == MUSCLE_NO_LIMIT) ? (MUSCLE_NO_LIMIT-1) : maxRate, burstBytes);  // MUSCLE_NO_LIMIT would mean "no bucket at all"
+}
+
+HierarchicalRateLimitSessionIOPolicy ::
+~HierarchicalRateLimitSessionIOPolicy()
+{
+   // empty
+}
+
+status_t
+HierarchicalRateLimitSessionIOPolicy ::
+PutGroupParameters(const String & groupPattern, const RateLimitParameters & params)
+{
+   StringMatcherRef smRef(newnothrow StringMatcher);
+   if (smRef() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   return (smRef()->SetPattern(groupPattern) == B_NO_ERROR) ? _groupPatterns.Put(groupPattern, GroupPattern(smRef, params)) : B_ERROR;
+}
+
+status_t
+HierarchicalRateLimitSessionIOPolicy ::
+SetSessionParameters(const AbstractReflectSession * session, const RateLimitParameters & params)
+{
+   if (_sessionParams.Put(session, params) != B_NO_ERROR) return B_ERROR;
+
+   for (uint32 i=0; i<2; i++)
+   {
+      SessionState * ss = _holders.Get(PolicyHolder(const_cast<AbstractReflectSession *>(session), (i==0)));
+      if (ss) SetSessionStateParameters(*ss, params);
+   }
+   return B_NO_ERROR;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+RemoveSessionParameters(const AbstractReflectSession * session)
+{
+   if (_sessionParams.Remove(session) != B_NO_ERROR) return;
+
+   for (uint32 i=0; i<2; i++)
+   {
+      SessionState * ss = _holders.Get(PolicyHolder(const_cast<AbstractReflectSession *>(session), (i==0)));
+      if (ss) SetSessionStateParameters(*ss, _defaultSessionParams);
+   }
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+SetSessionStateParameters(SessionState & ss, const RateLimitParameters & params)
+{
+   ss._params = params;
+   ss._bucket.SetParameters(params.GetMaxRate(), params.GetBurstBytes());
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+PolicyHolderAdded(const PolicyHolder & holder)
+{
+   SessionState * ss = _holders.PutAndGet(holder);
+   if (ss)
+   {
+      const RateLimitParameters * params = _sessionParams.Get(holder.GetSession());
+      SetSessionStateParameters(*ss, params ? *params : _defaultSessionParams);
+   }
+   else WARN_OUT_OF_MEMORY;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+PolicyHolderRemoved(const PolicyHolder & holder)
+{
+   SessionState * ss = _holders.Get(holder);
+   if (ss)
+   {
+      ReleaseGroup(*ss);
+      (void) _holders.Remove(holder);
+   }
+
+   // Forget any per-session parameters once the session has no more use for them
+   if ((_holders.ContainsKey(PolicyHolder(holder.GetSession(), !holder.IsAsInput())) == false)) (void) _sessionParams.Remove(holder.GetSession());
+}
+
+String
+HierarchicalRateLimitSessionIOPolicy ::
+GetGroupName(const PolicyHolder & holder) const
+{
+   return holder.GetSession()->GetHostName();
+}
+
+status_t
+HierarchicalRateLimitSessionIOPolicy ::
+AssignGroup(const PolicyHolder & holder, SessionState & ss)
+{
+   const String groupName = GetGroupName(holder);
+
+   GroupStateRef * gRef = _groups.Get(groupName);
+   if (gRef == NULL)
+   {
+      GroupStateRef newGroupRef(newnothrow GroupState);
+      if ((newGroupRef() == NULL)||((gRef = _groups.PutAndGet(groupName, newGroupRef)) == NULL)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+      GroupState * g = newGroupRef();
+      g->_name   = groupName;
+      g->_params = _defaultGroupParams;
+      for (HashtableIterator<String, GroupPattern> iter(_groupPatterns); iter.HasData(); iter++)
+      {
+         if (iter.GetValue()._matcher()->Match(groupName()))
+         {
+            g->_params = iter.GetValue()._params;
+            break;
+         }
+      }
+      g->_bucket.SetParameters(g->_params.GetMaxRate(), g->_params.GetBurstBytes());
+   }
+
+   ss._group = *gRef;
+   ss._group()->_numHolders++;
+   return B_NO_ERROR;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+ReleaseGroup(SessionState & ss)
+{
+   GroupState * g = ss._group();
+   if ((g)&&(--g->_numHolders == 0)) (void) _groups.Remove(g->_name);
+   ss._group.Reset();
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+BeginIO(uint64 now)
+{
+   _now = now;
+   _cycleCount++;
+   _rootBucket.Update(now);
+
+   _allotmentsComputed = false;
+   _activeGroups.Clear();
+   _activeSessions.Clear();
+   _activeGroupWeight = 0;
+   _nextWakeupTime = MUSCLE_TIME_NEVER;
+   InvalidatePulseTime();  // since the set of sessions waiting for us will be different this time
+}
+
+bool
+HierarchicalRateLimitSessionIOPolicy ::
+OkayToTransfer(const PolicyHolder & holder)
+{
+   SessionState * ss = _holders.Get(holder);
+   if ((ss == NULL)||((ss->_group() == NULL)&&(AssignGroup(holder, *ss) != B_NO_ERROR))) return false;
+
+   GroupState * g = ss->_group();
+   g->_bucket.Update(_now);
+   ss->_bucket.Update(_now);
+
+   if (ss->_lastWantedCycle+1 < _cycleCount) ss->_isFresh = true;  // it was idle during the previous cycle
+   ss->_lastWantedCycle = _cycleCount;
+
+   // The session may only transfer if there is enough bandwidth available at every level of the tree
+   const uint32 rootThreshold = GetRootThresholdBytes(*ss);
+   if ((_rootBucket.GetAvailableBytes() < rootThreshold)||(g->_bucket.GetAvailableBytes() < g->_bucket.GetThresholdBytes())||(ss->_bucket.GetAvailableBytes() < ss->_bucket.GetThresholdBytes()))
+   {
+      // Make sure the server wakes up when the session will be allowed to transfer again
+      const uint64 okayTime = muscleMax(_rootBucket.GetTimeWhenAvailable(rootThreshold), muscleMax(g->_bucket.GetTimeWhenAvailable(g->_bucket.GetThresholdBytes()), ss->_bucket.GetTimeWhenAvailable(ss->_bucket.GetThresholdBytes())));
+      _nextWakeupTime = muscleMin(_nextWakeupTime, okayTime);
+      return false;
+   }
+
+   if (g->_activeWeight == 0)
+   {
+      if (_activeGroups.AddTail(g) != B_NO_ERROR) return false;
+      _activeGroupWeight += g->_params.GetWeight();
+   }
+   if (_activeSessions.AddTail(ss) != B_NO_ERROR) return false;
+   g->_activeWeight += ss->_params.GetWeight();
+   ss->_isFresh = false;
+   return true;
+}
+
+uint32
+HierarchicalRateLimitSessionIOPolicy ::
+GetRootThresholdBytes(const SessionState & ss) const
+{
+   // A backlogged session has to wait for the full threshold like everyone else, so that the sessions that
+   // get to transfer at each wakeup (and hence their shares of the bandwidth) are determined only by weight.
+   // But a session that was idle can go sooner, the higher its weight, since its data is probably urgent.
+   if (ss._isFresh == false) return _rootBucket.GetThresholdBytes();
+
+   const uint64 weight = ((uint64)ss._params.GetWeight())*ss._group()->_params.GetWeight();
+   return (uint32) muscleMax(_rootBucket.GetThresholdBytes()/weight, (uint64)1);
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+ComputeAllotments()
+{
+   // Divide the available bandwidth amongst the active groups, in proportion to their weights...
+   const uint64 rootBytes = _rootBucket.GetAvailableBytes();
+   for (uint32 i=0; i<_activeGroups.GetNumItems(); i++)
+   {
+      GroupState * g = _activeGroups[i];
+      g->_allotment = (uint32) muscleMin((rootBytes*g->_params.GetWeight())/_activeGroupWeight, (uint64)g->_bucket.GetAvailableBytes());
+   }
+
+   // ... and then divide each group's share amongst its active sessions, in proportion to their weights
+   for (uint32 i=0; i<_activeSessions.GetNumItems(); i++)
+   {
+      SessionState * ss = _activeSessions[i];
+      GroupState * g = ss->_group();
+      ss->_allotment = (uint32) muscleMin((((uint64)g->_allotment)*ss->_params.GetWeight())/g->_activeWeight, (uint64)ss->_bucket.GetAvailableBytes());
+      if (ss->_allotment == 0) ss->_allotment = 1;  // a tiny overdraft is better than having the server spin on a writable socket we won't let it write to
+   }
+   _allotmentsComputed = true;
+}
+
+uint32
+HierarchicalRateLimitSessionIOPolicy ::
+GetMaxTransferChunkSize(const PolicyHolder & holder)
+{
+   if (_allotmentsComputed == false) ComputeAllotments();
+
+   SessionState * ss = _holders.Get(holder);
+   return ss ? ss->_allotment : 0;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+BytesTransferred(const PolicyHolder & holder, uint32 numBytes)
+{
+   _rootBucket.Consume(numBytes);
+
+   SessionState * ss = _holders.Get(holder);
+   if (ss)
+   {
+      ss->_bucket.Consume(numBytes);
+      if (ss->_group()) ss->_group()->_bucket.Consume(numBytes);
+   }
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+EndIO(uint64)
+{
+   // Reset the per-cycle state, so that the next cycle's active sets start out empty
+   for (uint32 i=0; i<_activeGroups.GetNumItems(); i++) _activeGroups[i]->_activeWeight = 0;
+   _activeGroups.Clear();
+   _activeSessions.Clear();
+   _activeGroupWeight = 0;
+}
+
+uint64
+HierarchicalRateLimitSessionIOPolicy ::
+GetPulseTime(const PulseArgs &)
+{
+   return _nextWakeupTime;
+}
+
+void
+HierarchicalRateLimitSessionIOPolicy ::
+Pulse(const PulseArgs &)
+{
+   TCHECKPOINT;
+
+   // Our only job here was to wake up the server, so that it will ask us about the waiting sessions again
+   _nextWakeupTime = MUSCLE_TIME_NEVER;
+}
+
+}; // end namespace muscle
@@ -0,0 +1,237 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#ifndef HierarchicalRateLimitSessionIOPolicy_h
+#define HierarchicalRateLimitSessionIOPolicy_h
+
+#include "reflector/AbstractSessionIOPolicy.h"
+#include "regex/StringMatcher.h"
+
+namespace muscle {
+
+/** This class holds the settings for one node in a HierarchicalRateLimitSessionIOPolicy's tree:
+  * its weight relative to its siblings, its own maximum transfer rate, and its burst size.
+  */
+class RateLimitParameters
+{
+public:
+   /** Constructor.
+     * @param weight How much bandwidth this node should get, relative to its siblings.  A node with weight 4 gets four
+     *               times the bandwidth of a sibling with weight 1, when both have data to transfer.  Defaults to 1.
+     * @param maxRate The maximum rate this node may transfer at, in bytes per second, even when no siblings are competing
+     *                with it.  Defaults to MUSCLE_NO_LIMIT (i.e. limited only by the policy's aggregate rate).
+     * @param burstBytes The maximum number of bytes this node may accumulate the right to transfer while idle, and then
+     *                   transfer all at once.  Only meaningful if (maxRate) isn't MUSCLE_NO_LIMIT.  Defaults to 2048.
+     */
+   RateLimitParameters(uint32 weight = 1, uint32 maxRate = MUSCLE_NO_LIMIT, uint32 burstBytes = 2048) : _weight(muscleMax(weight, (uint32)1)), _maxRate(maxRate), _burstBytes(burstBytes) {/* empty */}
+
+   /** Returns our weight, as specified in the constructor. */
+   uint32 GetWeight() const {return _weight;}
+
+   /** Returns our maximum transfer rate in bytes per second, as specified in the constructor. */
+   uint32 GetMaxRate() const {return _maxRate;}
+
+   /** Returns our burst size in bytes, as specified in the constructor. */
+   uint32 GetBurstBytes() const {return _burstBytes;}
+
+private:
+   uint32 _weight;
+   uint32 _maxRate;
+   uint32 _burstBytes;
+};
+
+/**
+ * This policy enforces an aggregate maximum bandwidth for the set of AbstractReflectSessions
+ * that use it (just like RateLimitSessionIOPolicy), but it also divides that bandwidth fairly
+ * amongst them.  Sessions are sorted into groups (by default, one group per host), and each
+ * group and each session has its own weight, maximum rate and burst size (see RateLimitParameters).
+ * <p>
+ * During each I/O cycle the bandwidth available to the policy is divided amongst the groups that
+ * have sessions wanting to transfer, in proportion to their weights, and each group's share is then
+ * divided amongst its sessions the same way.  That way a bulk-transfer client can't starve a
+ * control client of bandwidth just by always having more data queued up, and giving control clients
+ * (or their hosts) a higher weight lets them get their data through quickly even under heavy load.
+ * <p>
+ * The policy wakes up the server (via PulseNode) at the microsecond when a waiting session will be
+ * allowed to transfer again, rather than on a fixed schedule.  Each policy object may be referenced
+ * by zero or more PolicyHolders at once.
+ */
+class HierarchicalRateLimitSessionIOPolicy : public AbstractSessionIOPolicy, private CountedObject<HierarchicalRateLimitSessionIOPolicy>
+{
+public:
+   /** Constructor.
+     * @param maxRate The maximum aggregate transfer rate to be enforced for all sessions
+     *                that use this policy, in bytes per second.
+     * @param burstBytes When the bytes first start to flow, the policy allows the first (burstBytes)
+     *                   bytes to be sent out immediately, before clamping down on the flow rate.
+     *                   Sessions aren't allowed to transfer until at least half this many bytes' worth
+     *                   of bandwidth is available, so that the server doesn't wake up too often.  The
+     *                   exception is a session that has just become ready to transfer after being idle:
+     *                   if its weight (times its group's weight) is N, it only has to wait for 1/N as
+     *                   many bytes, which keeps the latency of high-weight control sessions low without
+     *                   letting high-weight bulk sessions crowd out the others.  Defaults to 2048 bytes.
+     */
+   HierarchicalRateLimitSessionIOPolicy(uint32 maxRate, uint32 burstBytes = 2048);
+
+   /** Destructor. */
+   virtual ~HierarchicalRateLimitSessionIOPolicy();
+
+   /** Sets the parameters to use for groups whose names don't match any of our group patterns.
+     * Only affects groups created after this call.  The default parameters are RateLimitParameters().
+     * @param params The new default group parameters.
+     */
+   void SetDefaultGroupParameters(const RateLimitParameters & params) {_defaultGroupParams = params;}
+
+   /** Returns the parameters we use for groups that don't match any of our group patterns. */
+   const RateLimitParameters & GetDefaultGroupParameters() const {return _defaultGroupParams;}
+
+   /** Sets the parameters to use for sessions that haven't had parameters set via SetSessionParameters().
+     * Only affects sessions added after this call.  The default parameters are RateLimitParameters().
+     * @param params The new default session parameters.
+     */
+   void SetDefaultSessionParameters(const RateLimitParameters & params) {_defaultSessionParams = params;}
+
+   /** Returns the parameters we use for sessions that haven't had parameters set via SetSessionParameters(). */
+   const RateLimitParameters & GetDefaultSessionParameters() const {return _defaultSessionParams;}
+
+   /** Specifies the parameters to use for any group whose name matches the given pattern.
+     * Patterns are checked in the order they were added, and the first match wins.
+     * Only affects groups created after this call.
+     * @param groupPattern Pattern to match group names against (e.g. "192.168.0.*")
+     * @param params The parameters to use for matching groups.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory?)
+     */
+   status_t PutGroupParameters(const String & groupPattern, const RateLimitParameters & params);
+
+   /** Removes a pattern previously added with PutGroupParameters().
+     * @param groupPattern The pattern to remove.
+     * @returns B_NO_ERROR on success, or B_ERROR if the pattern wasn't found.
+     */
+   status_t RemoveGroupParameters(const String & groupPattern) {return _groupPatterns.Remove(groupPattern);}
+
+   /** Sets the weight, maximum rate and burst size for one particular session.  Takes effect immediately
+     * if the session is already using this policy, or when it starts using this policy otherwise.
+     * @param session The session to set parameters for.
+     * @param params The parameters to use for (session).
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory?)
+     */
+   status_t SetSessionParameters(const AbstractReflectSession * session, const RateLimitParameters & params);
+
+   /** Reverts the given session to using our default session parameters.
+     * @param session The session to revert.
+     */
+   void RemoveSessionParameters(const AbstractReflectSession * session);
+
+   virtual void PolicyHolderAdded(const PolicyHolder & holder);
+   virtual void PolicyHolderRemoved(const PolicyHolder & holder);
+
+   virtual void BeginIO(uint64 now);
+   virtual bool OkayToTransfer(const PolicyHolder & holder);
+   virtual uint32 GetMaxTransferChunkSize(const PolicyHolder & holder);
+   virtual void BytesTransferred(const PolicyHolder & holder, uint32 numBytes);
+   virtual void EndIO(uint64 now);
+
+   virtual uint64 GetPulseTime(const PulseArgs & args);
+   virtual void Pulse(const PulseArgs & args);
+
+   /** Returns true, since our waiting sessions become eligible to transfer partway through a millisecond */
+   virtual bool IsPrecisePulseTimeRequired() const {return true;}
+
+protected:
+   /** Returns the name of the group the given PolicyHolder's session should be placed into.
+     * Called once per PolicyHolder, the first time its session wants to transfer data.
+     * Default implementation returns the session's host name (i.e. its IP address), so that each
+     * host gets its own group.  Subclasses may override this to group sessions differently.
+     * @param holder The PolicyHolder to return the group name of.
+     */
+   virtual String GetGroupName(const PolicyHolder & holder) const;
+
+private:
+   /** Standard token bucket, with byte counts kept in units of bytes*microseconds so that refills don't accumulate rounding error */
+   class TokenBucket
+   {
+   public:
+      TokenBucket() : _maxRate(MUSCLE_NO_LIMIT), _burstBytes(0), _scaledTokens(0), _lastUpdateTime(0) {/* empty */}
+
+      void SetParameters(uint32 maxRate, uint32 burstBytes);
+      void Update(uint64 now);
+      uint32 GetAvailableBytes() const {return (_maxRate == MUSCLE_NO_LIMIT) ? MUSCLE_NO_LIMIT : (uint32)(_scaledTokens/MICROS_PER_SECOND);}
+      uint32 GetThresholdBytes() const {return (_maxRate == MUSCLE_NO_LIMIT) ? 0 : muscleMax(_burstBytes/2, (uint32)1);}
+      void Consume(uint32 numBytes);
+      uint64 GetTimeWhenAvailable(uint32 numBytes) const;
+
+   private:
+      uint32 _maxRate;
+      uint32 _burstBytes;
+      uint64 _scaledTokens;
+      uint64 _lastUpdateTime;
+   };
+
+   class GroupState : public RefCountable
+   {
+   public:
+      GroupState() : _numHolders(0), _activeWeight(0), _allotment(0) {/* empty */}
+
+      String _name;
+      RateLimitParameters _params;
+      TokenBucket _bucket;
+      uint32 _numHolders;
+
+      // These are only valid during an I/O cycle
+      uint64 _activeWeight;  // sum of the weights of our sessions that want to transfer
+      uint32 _allotment;     // how many bytes our sessions may transfer, in total
+   };
+   DECLARE_REFTYPES(GroupState);
+
+   class SessionState
+   {
+   public:
+      SessionState() : _allotment(0), _lastWantedCycle(0), _isFresh(true) {/* empty */}
+
+      RateLimitParameters _params;
+      TokenBucket _bucket;
+      GroupStateRef _group;     // set the first time the session wants to transfer
+      uint32 _allotment;        // only valid during an I/O cycle
+      uint64 _lastWantedCycle;  // the most recent I/O cycle in which the session wanted to transfer
+      bool _isFresh;            // true iff the session hasn't transferred since it was last idle
+   };
+
+   class GroupPattern
+   {
+   public:
+      GroupPattern() {/* empty */}
+      GroupPattern(const StringMatcherRef & matcher, const RateLimitParameters & params) : _matcher(matcher), _params(params) {/* empty */}
+
+      StringMatcherRef _matcher;
+      RateLimitParameters _params;
+   };
+
+   void SetSessionStateParameters(SessionState & ss, const RateLimitParameters & params);
+   status_t AssignGroup(const PolicyHolder & holder, SessionState & ss);
+   uint32 GetRootThresholdBytes(const SessionState & ss) const;
+   void ReleaseGroup(SessionState & ss);
+   void ComputeAllotments();
+
+   TokenBucket _rootBucket;
+
+   RateLimitParameters _defaultGroupParams;
+   RateLimitParameters _defaultSessionParams;
+   Hashtable<String, GroupPattern> _groupPatterns;
+   Hashtable<const AbstractReflectSession *, RateLimitParameters> _sessionParams;
+
+   Hashtable<PolicyHolder, SessionState> _holders;
+   Hashtable<String, GroupStateRef> _groups;
+
+   uint64 _cycleCount;  // incremented in each BeginIO()
+
+   // These are only valid during an I/O cycle
+   uint64 _now;
+   bool _allotmentsComputed;
+   Queue<GroupState *> _activeGroups;
+   Queue<SessionState *> _activeSessions;
+   uint64 _activeGroupWeight;
+   uint64 _nextWakeupTime;  // when the earliest session that was refused will be allowed to transfer again
+};
+
+}; // end namespace muscle
+
+#endif
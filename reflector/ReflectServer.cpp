@@ -19,10 +19,121 @@
 # include "iogateway/SSLSocketAdapterGateway.h"
 #endif
 
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+# include "system/Thread.h"
+#endif
+
 namespace muscle {
 
 extern bool _mainReflectServerCatchSignals;  // from SetupSystem.cpp
 
+// The maximum number of connections we'll accept from one listening socket before going on to other things.
+// Also the maximum number of connections an AcceptThread will pass to us in a single batch.
+static const uint32 MAX_ACCEPTS_PER_BATCH = 64;
+
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+
+// what-code of the Messages that an AcceptThread passes to its ReflectServer.  The accepted connections
+// are tagged (as AcceptedSocket objects) under the name "s".
+enum {
+   ACCEPT_EVENT_SOCKETS = 1920426355 // 'rwas'
+};
+
+/** Holds a connection that an AcceptThread accepted, until the ReflectServer can create a session for it. */
+class AcceptedSocket : public RefCountable
+{
+public:
+   AcceptedSocket(const ConstSocketRef & socket, const ip_address & localIP) : _socket(socket), _localIP(localIP) {/* empty */}
+
+   const ConstSocketRef _socket;
+   const ip_address _localIP;  // the local interface the connection was accepted on
+};
+
+/** A thread that accepts incoming TCP connections on a listening socket as fast as they arrive,
+  * and passes them on to its ReflectServer in batches.
+  */
+class ReflectServer :: AcceptThread : public Thread
+{
+public:
+   AcceptThread(const IPAddressAndPort & iap, const ConstSocketRef & acceptSocket) : _iap(iap), _acceptSocket(acceptSocket) {(void) SetLockFreeMessagingEnabled(true);}
+
+   /** Returns the port (and interface) that we are accepting connections for. */
+   const IPAddressAndPort & GetIPAddressAndPort() const {return _iap;}
+
+   /** Called in the main thread when our owner-wakeup-socket selects ready-for-read:  Appends the newly accepted connections to (_pendingSockets). */
+   void GetAcceptedSockets();
+
+   Queue<RefCountableRef> _pendingSockets;  // main-thread only:  accepted connections that don't have sessions yet
+
+protected:
+   virtual void InternalThreadEntry();
+
+private:
+   const IPAddressAndPort _iap;
+   const ConstSocketRef _acceptSocket;
+};
+
+void ReflectServer :: AcceptThread :: GetAcceptedSockets()
+{
+   DrainOwnerWakeupSocket();
+
+   Queue<MessageRef> batches;
+   Queue<MessageRef> * q = LockAndReturnReplyQueue();
+   if (q)
+   {
+      batches.SwapContents(*q);
+      (void) UnlockReplyQueue();
+   }
+
+   for (uint32 i=0; i<batches.GetNumItems(); i++)
+   {
+      RefCountableRef asRef;
+      for (uint32 j=0; batches[i]()->FindTag("s", j, asRef) == B_NO_ERROR; j++) if (_pendingSockets.AddTail(asRef) != B_NO_ERROR) WARN_OUT_OF_MEMORY;
+   }
+}
+
+void ReflectServer :: AcceptThread :: InternalThreadEntry()
+{
+   SocketMultiplexer multiplexer;
+   const int wakeupFD = GetInternalThreadWakeupSocket().GetFileDescriptor();
+   const int acceptFD = _acceptSocket.GetFileDescriptor();
+   bool keepGoing = ((wakeupFD >= 0)&&(acceptFD >= 0)&&(multiplexer.RegisterPersistentSocketForEventsByTypeIndex(wakeupFD, SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR)&&(multiplexer.RegisterPersistentSocketForEventsByTypeIndex(acceptFD, SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR));
+   while((keepGoing)&&(multiplexer.WaitForEvents() >= 0))
+   {
+      if (multiplexer.IsSocketReadyForRead(acceptFD))
+      {
+         // Accept everything that is waiting (up to a point), and pass it all to the main thread at once
+         MessageRef batch = GetMessageFromPool(ACCEPT_EVENT_SOCKETS);
+         for (uint32 i=0; (batch())&&(i<MAX_ACCEPTS_PER_BATCH); i++)
+         {
+            ip_address localIP;
+            ConstSocketRef newSocket = Accept(_acceptSocket, &localIP);
+            if (newSocket() == NULL) break;  // nothing more to accept, for now
+
+            RefCountableRef asRef(newnothrow AcceptedSocket(newSocket, localIP));
+            if ((asRef() == NULL)||(batch()->AddTag("s", asRef) != B_NO_ERROR)) WARN_OUT_OF_MEMORY;  // (newSocket) will be closed
+         }
+         if (batch() == NULL) WARN_OUT_OF_MEMORY;
+         else if ((batch()->HasName("s"))&&(SendMessageToOwner(batch) != B_NO_ERROR)) WARN_OUT_OF_MEMORY;
+      }
+
+      if (multiplexer.IsSocketReadyForRead(wakeupFD))
+      {
+         // The only thing our owner ever tells us is to exit (via a NULL Message)
+         DrainInternalThreadWakeupSocket();
+         Queue<MessageRef> * q = LockAndReturnMessageQueue();
+         if (q)
+         {
+            for (uint32 i=0; i<q->GetNumItems(); i++) if ((*q)[i]() == NULL) keepGoing = false;
+            q->Clear();
+            (void) UnlockMessageQueue();
+         }
+      }
+   }
+}
+
+#endif
+
 status_t
 ReflectServer ::
 AddNewSession(const AbstractReflectSessionRef & ref, const ConstSocketRef & ss)
@@ -228,6 +339,8 @@ AttachNewSession(const AbstractReflectSessionRef & ref)
       if (newSession->AttachedToServer() == B_NO_ERROR)
       {
          newSession->SetFullyAttachedToServer(true);
+         (void) PutPulseChild(newSession);  // so that the session (and its gateway) will be Pulse()'d as part of our own PulseAux() calls
+         newSession->InvalidateIOStatus();  // so that its sockets will be registered before our next WaitForEvents() call
          if (_doLogging) LogTime(MUSCLE_LOG_DEBUG, "New %s (" UINT32_FORMAT_SPEC " total)\n", newSession->GetSessionDescriptionString()(), _sessions.GetNumItems());
          return B_NO_ERROR;
       }
@@ -244,7 +357,7 @@ AttachNewSession(const AbstractReflectSessionRef & ref)
 }
 
 
-ReflectServer :: ReflectServer() : _keepServerGoing(true), _serverStartedAt(0), _doLogging(true), _serverSessionID(GetCurrentTime64()+GetRunTime64()+rand())
+ReflectServer :: ReflectServer() : _numAcceptThreads(0), _keepServerGoing(true), _serverStartedAt(0), _doLogging(true), _serverSessionID(GetCurrentTime64()+GetRunTime64()+rand())
 {
    if (_serverSessionID == 0) _serverSessionID++;  // paranoia:  make sure 0 can be used as a guard value
 
@@ -254,7 +367,12 @@ ReflectServer :: ReflectServer() : _keepServerGoing(true), _serverStartedAt(0),
 
 ReflectServer :: ~ReflectServer()
 {
-   // empty
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+   while(_acceptThreads.HasItems()) ShutdownAcceptThreads(_acceptThreads.Head()->GetIPAddressAndPort());
+
+   AcceptThread * at;
+   while(_lameDuckAcceptThreads.RemoveTail(at) == B_NO_ERROR) delete at;
+#endif
 }
 
 void
@@ -271,6 +389,7 @@ ReflectServer :: Cleanup()
             ars.SetFullyAttachedToServer(false);
             ars.AboutToDetachFromServer();
             ars.DoOutput(MUSCLE_NO_LIMIT);  // one last chance for him to send any leftover data!
+            StopWatchingSession(&ars);
             ars.SetOwner(NULL);
             _lameDuckSessions.AddTail(nextValue);  // we'll delete it below
             _sessions.Remove(iter.GetKey());  // but prevent other sessions from accessing it now that it's detached
@@ -382,6 +501,23 @@ ServerProcessLoop()
       return B_ERROR;
    }
 
+#ifdef MUSCLE_SINGLE_THREAD_ONLY
+   if ((_numAcceptThreads > 0)&&(_doLogging)) LogTime(MUSCLE_LOG_WARNING, "Accept threads are not available when MUSCLE_SINGLE_THREAD_ONLY is defined; connections will be accepted in the main thread.\n");
+#else
+   {
+      Queue<IPAddressAndPort> ports;  // (a copy, since StartAcceptThreads() modifies _factorySockets)
+      for (HashtableIterator<IPAddressAndPort, ConstSocketRef> iter(_factorySockets); iter.HasData(); iter++) (void) ports.AddTail(iter.GetKey());
+      for (uint32 i=0; i<ports.GetNumItems(); i++)
+      {
+         if (StartAcceptThreads(ports[i], _factorySockets.GetWithDefault(ports[i])) != B_NO_ERROR)
+         {
+            if (_doLogging) LogTime(MUSCLE_LOG_CRITICALERROR, "Server:  Could not start accept threads, aborting.\n");
+            return B_ERROR;
+         }
+      }
+   }
+#endif
+
    TCHECKPOINT;
 
    // Print an informative startup message
@@ -422,6 +558,10 @@ ServerProcessLoop()
    // The primary event loop for any MUSCLE-based server!
    // These variables are used as scratch space, but are declared outside the loop to avoid having to reinitialize them all the time.
    Hashtable<AbstractSessionIOPolicyRef, Void> policies;
+   Hashtable<AbstractReflectSession *, Void> sessionsToCheck;
+   Hashtable<AbstractReflectSession *, Void> readySessions;
+   Queue<AbstractReflectSession *> policySessions;
+   Queue<AbstractReflectSession *> writingSessions;
 
    while(ClearLameDucks() == B_NO_ERROR)
    {
@@ -429,6 +569,7 @@ ServerProcessLoop()
       EventLoopCycleBegins();
 
       uint64 nextPulseAt = MUSCLE_TIME_NEVER; // running minimum of everything that wants to be Pulse()'d
+      uint64 precisePulseAt = MUSCLE_TIME_NEVER;  // running minimum of the policies that need to be Pulse()'d on the exact microsecond
 
       // Set up socket multiplexer registrations and Pulse() timing info for all our different components
       {
@@ -450,65 +591,73 @@ ServerProcessLoop()
 
          TCHECKPOINT;
 
-         // Set up the sessions, their associated IO-gateways, and their IOPolicies
-         if (_sessions.HasItems())
+         // Update the socket registrations of any sessions whose I/O status may have changed since the previous cycle.
+         // Session sockets stay registered with the multiplexer until they change, so idle sessions cost nothing here.
+         if (_sessionsToCheck.HasItems())
          {
-            for (HashtableIterator<const String *, AbstractReflectSessionRef> iter(GetSessions()); iter.HasData(); iter++)
+            sessionsToCheck.SwapContents(_sessionsToCheck);  // any session that needs to be checked again next cycle will be put back into _sessionsToCheck
+            for (HashtableIterator<AbstractReflectSession *, Void> iter(sessionsToCheck); iter.HasData(); iter++)
             {
-               AbstractReflectSession * session = iter.GetValue()();
-               if (session)
+               AbstractReflectSession * session = iter.GetKey();
+               session->_ioStatusCheckPending = false;
+               session->_maxInputChunk = session->_maxOutputChunk = 0;
+
+               bool checkAgain = false;  // set true if this session's I/O status could change without our being told about it
+               int readFD = -1, writeFD = -1;
+               AbstractMessageIOGateway * g = session->GetGateway()();
+               if (g)
                {
-                  session->_maxInputChunk = session->_maxOutputChunk = 0;
-                  AbstractMessageIOGateway * g = session->GetGateway()();
-                  if (g)
+                  int sessionReadFD = session->GetSessionReadSelectSocket().GetFileDescriptor();
+                  if ((sessionReadFD >= 0)&&(session->IsConnectingAsync() == false))
                   {
-                     int sessionReadFD = session->GetSessionReadSelectSocket().GetFileDescriptor();
-                     if ((sessionReadFD >= 0)&&(session->IsConnectingAsync() == false))
-                     {
-                        session->_maxInputChunk = CheckPolicy(policies, session->GetInputPolicy(), PolicyHolder(session->IsReadyForInput() ? session : NULL, true), now);
-                        if (session->_maxInputChunk > 0) (void) _multiplexer.RegisterSocketForReadReady(sessionReadFD);
-                     }
+                     session->_maxInputChunk = CheckPolicy(policies, session->GetInputPolicy(), PolicyHolder(session->IsReadyForInput() ? session : NULL, true), now);
+                     if (session->_maxInputChunk > 0) readFD = sessionReadFD;
+                                                 else checkAgain = true;  // so we'll notice when it becomes ready for input again
+                  }
 
-                     int sessionWriteFD = session->GetSessionWriteSelectSocket().GetFileDescriptor();
-                     if (sessionWriteFD >= 0)
+                  int sessionWriteFD = session->GetSessionWriteSelectSocket().GetFileDescriptor();
+                  if (sessionWriteFD >= 0)
+                  {
+                     bool out;
+                     if (session->IsConnectingAsync()) 
                      {
-                        bool out;
-                        if (session->IsConnectingAsync()) 
-                        {
-                           out = true;  // so we can watch for the async-connect event
+                        out = true;  // so we can watch for the async-connect event
 #if defined(WIN32)
-                           // Under Windows, failed asynchronous TCP connect()'s are communicated via the a raised exception-flag
-                           (void) _multiplexer.RegisterSocketForExceptionRaised(sessionWriteFD);
+                        // Under Windows, failed asynchronous TCP connect()'s are communicated via the a raised exception-flag
+                        (void) _multiplexer.RegisterSocketForExceptionRaised(sessionWriteFD);
 #endif
-                        }
-                        else
-                        {
-                           session->_maxOutputChunk = CheckPolicy(policies, session->GetOutputPolicy(), PolicyHolder(session->HasBytesToOutput() ? session : NULL, false), now);
-                           out = ((session->_maxOutputChunk > 0)||((g->GetDataIO()())&&(g->GetDataIO()()->HasBufferedOutput())));
-                        }
-
-                        if (out) 
-                        {
-                           (void) _multiplexer.RegisterSocketForWriteReady(sessionWriteFD);
-                           if (session->_lastByteOutputAt == 0) session->_lastByteOutputAt = now;  // the bogged-session-clock starts ticking when we first want to write...
-                           if (session->_outputStallLimit != MUSCLE_TIME_NEVER) nextPulseAt = muscleMin(nextPulseAt, session->_lastByteOutputAt+session->_outputStallLimit);
-                        }
-                        else session->_lastByteOutputAt = 0;  // If we no longer want to write, then the bogged-session-clock-timeout is cancelled
+                     }
+                     else
+                     {
+                        session->_maxOutputChunk = CheckPolicy(policies, session->GetOutputPolicy(), PolicyHolder(session->HasBytesToOutput() ? session : NULL, false), now);
+                        out = ((session->_maxOutputChunk > 0)||((g->GetDataIO()())&&(g->GetDataIO()()->HasBufferedOutput())));
                      }
 
-                     TCHECKPOINT;
-                     CallGetPulseTimeAux(*g, now, nextPulseAt);
-                     TCHECKPOINT;
+                     if (out) 
+                     {
+                        writeFD    = sessionWriteFD;
+                        checkAgain = true;  // so we can keep an eye on its output-stall timer
+                        (void) writingSessions.AddTail(session);
+                        if (session->_lastByteOutputAt == 0) session->_lastByteOutputAt = now;  // the bogged-session-clock starts ticking when we first want to write...
+                        if (session->_outputStallLimit != MUSCLE_TIME_NEVER) nextPulseAt = muscleMin(nextPulseAt, session->_lastByteOutputAt+session->_outputStallLimit);
+                     }
+                     else session->_lastByteOutputAt = 0;  // If we no longer want to write, then the bogged-session-clock-timeout is cancelled
                   }
-                  TCHECKPOINT;
-                  CallGetPulseTimeAux(*session, now, nextPulseAt);
-                  TCHECKPOINT;
                }
+               SetSessionSocketRegistrations(session, readFD, writeFD);
+
+               if ((session->GetInputPolicy()())||(session->GetOutputPolicy()()))
+               {
+                  checkAgain = true;  // since a policy may change its mind about the session at any time
+                  (void) policySessions.AddTail(session);
+               }
+               if (checkAgain) InvalidateSessionIOStatus(session);
             }
+            sessionsToCheck.Clear();
          }
 
          TCHECKPOINT;
-         CallGetPulseTimeAux(*this, now, nextPulseAt);
+         CallGetPulseTimeAux(*this, now, nextPulseAt);  // our sessions (and their gateways) are our pulse-children, so this handles them too
          TCHECKPOINT;
 
          // Set up the Session IO Policies
@@ -516,29 +665,31 @@ ServerProcessLoop()
          {
             // Now that the policies know *who* amongst their policyholders will be reading/writing,
             // let's ask each activated policy *how much* each policyholder should be allowed to read/write.
-            for (HashtableIterator<const String *, AbstractReflectSessionRef> iter(GetSessions()); iter.HasData(); iter++)
+            for (uint32 i=0; i<policySessions.GetNumItems(); i++)
             {
-               AbstractReflectSession * session = iter.GetValue()();
-               if (session)
-               {
-                  AbstractSessionIOPolicy * inPolicy  = session->GetInputPolicy()();
-                  AbstractSessionIOPolicy * outPolicy = session->GetOutputPolicy()();
-                  if ((inPolicy)&&( session->_maxInputChunk  > 0)) session->_maxInputChunk  = inPolicy->GetMaxTransferChunkSize(PolicyHolder(session, true));
-                  if ((outPolicy)&&(session->_maxOutputChunk > 0)) session->_maxOutputChunk = outPolicy->GetMaxTransferChunkSize(PolicyHolder(session, false));
-               }
+               AbstractReflectSession * session = policySessions[i];
+               AbstractSessionIOPolicy * inPolicy  = session->GetInputPolicy()();
+               AbstractSessionIOPolicy * outPolicy = session->GetOutputPolicy()();
+               if ((inPolicy)&&( session->_maxInputChunk  > 0)) session->_maxInputChunk  = inPolicy->GetMaxTransferChunkSize(PolicyHolder(session, true));
+               if ((outPolicy)&&(session->_maxOutputChunk > 0)) session->_maxOutputChunk = outPolicy->GetMaxTransferChunkSize(PolicyHolder(session, false));
             }
 
             // Now that all is prepared, calculate all the policies' wakeup times
             TCHECKPOINT;
-            for (HashtableIterator<AbstractSessionIOPolicyRef, Void> iter(policies); iter.HasData(); iter++) CallGetPulseTimeAux(*iter.GetKey()(), now, nextPulseAt);
+            for (HashtableIterator<AbstractSessionIOPolicyRef, Void> iter(policies); iter.HasData(); iter++)
+            {
+               AbstractSessionIOPolicy * p = iter.GetKey()();
+               CallGetPulseTimeAux(*p, now, p->IsPrecisePulseTimeRequired() ? precisePulseAt : nextPulseAt);
+            }
             TCHECKPOINT;
          }
+         policySessions.Clear();
       }
 
       TCHECKPOINT;
 
       // This block is the center of the MUSCLE server's universe -- where we sit and wait for the next event
-      if (_multiplexer.WaitForEvents(nextPulseAt) < 0)
+      if (_multiplexer.WaitForEvents(muscleMin(nextPulseAt, precisePulseAt), (precisePulseAt < nextPulseAt)) < 0)
       {
          if (_doLogging) LogTime(MUSCLE_LOG_CRITICALERROR, "WaitForEvents() failed, aborting!\n");
          ClearLameDucks();
@@ -555,114 +706,133 @@ ServerProcessLoop()
 
       TCHECKPOINT;
 
-      // Do I/O for each of our attached sessions
+      // Do I/O for each of our sessions that has a socket ready for I/O (sessions without any ready sockets needn't be visited at all)
       {
-         for (HashtableIterator<const String *, AbstractReflectSessionRef> iter(GetSessions()); iter.HasData(); iter++)
+         const Queue<int> & readySockets = _multiplexer.GetReadySockets();
+         for (uint32 i=0; i<readySockets.GetNumItems(); i++)
+         {
+            AbstractReflectSession * session;
+            if (_socketSessions.Get(readySockets[i], session) == B_NO_ERROR) (void) readySessions.PutWithDefault(session);  // (a session's read and write sockets may be listed separately)
+         }
+
+         for (HashtableIterator<AbstractReflectSession *, Void> iter(readySessions); iter.HasData(); iter++)
          {
             TCHECKPOINT;
 
-            AbstractReflectSessionRef & sessionRef = iter.GetValue();
-            AbstractReflectSession * session = sessionRef();
-            if (session)
-            {
+            AbstractReflectSession * session = iter.GetKey();
+            AbstractReflectSessionRef sessionRef(session);  // (session) is still in our _sessions table, so this just adds a reference to it
+            session->InvalidateIOStatus();  // since the I/O we are about to do is likely to change what it wants to do next
+
 #ifdef MUSCLE_ENABLE_MEMORY_TRACKING
-               MemoryAllocator * ma = GetCPlusPlusGlobalMemoryAllocator()();
-               if (ma) (void) ma->SetAllocationHasFailed(false);  // (session)'s responsibility for starts here!  If we run out of mem on his watch, he's history
+            MemoryAllocator * ma = GetCPlusPlusGlobalMemoryAllocator()();
+            if (ma) (void) ma->SetAllocationHasFailed(false);  // (session)'s responsibility for starts here!  If we run out of mem on his watch, he's history
 #endif
 
-               TCHECKPOINT;
+            TCHECKPOINT;
 
-               CallSetCycleStartTime(*session, GetRunTime64());
-               TCHECKPOINT;
-               CallPulseAux(*session, session->GetCycleStartTime());
+            CallSetCycleStartTime(*session, GetRunTime64());
+            {
+               AbstractMessageIOGateway * gateway = session->GetGateway()();
+               if (gateway) CallSetCycleStartTime(*gateway, GetRunTime64());
+            }
+
+            TCHECKPOINT;
+
+            int readSock = session->GetSessionReadSelectSocket().GetFileDescriptor();
+            if (readSock >= 0)
+            {
+               int32 readBytes = 0;
+               if (_multiplexer.IsSocketReadyForRead(readSock))
                {
-                  AbstractMessageIOGateway * gateway = session->GetGateway()();
-                  if (gateway) 
-                  {
-                     TCHECKPOINT;
+                  readBytes = session->DoInput(*session, session->_maxInputChunk);  // session->MessageReceivedFromGateway() gets called here
 
-                     CallSetCycleStartTime(*gateway, GetRunTime64());
-                     CallPulseAux(*gateway, gateway->GetCycleStartTime());
-                  }
+                  AbstractSessionIOPolicy * p = session->GetInputPolicy()();
+                  if ((p)&&(readBytes >= 0)) p->BytesTransferred(PolicyHolder(session, true), (uint32)readBytes);
                }
 
                TCHECKPOINT;
 
-               int readSock = session->GetSessionReadSelectSocket().GetFileDescriptor();
-               if (readSock >= 0)
+               if (readBytes < 0)
                {
-                  int32 readBytes = 0;
-                  if (_multiplexer.IsSocketReadyForRead(readSock))
-                  {
-                     readBytes = session->DoInput(*session, session->_maxInputChunk);  // session->MessageReceivedFromGateway() gets called here
-
-                     AbstractSessionIOPolicy * p = session->GetInputPolicy()();
-                     if ((p)&&(readBytes >= 0)) p->BytesTransferred(PolicyHolder(session, true), (uint32)readBytes);
-                  }
-
-                  TCHECKPOINT;
-
-                  if (readBytes < 0)
-                  {
-                     bool wasConnecting = session->IsConnectingAsync();
-                     if ((DisconnectSession(session) == false)&&(_doLogging)) LogTime(MUSCLE_LOG_DEBUG, "Connection for %s %s (read error).\n", session->GetSessionDescriptionString()(), wasConnecting?"failed":"was severed");
-                  }
+                  bool wasConnecting = session->IsConnectingAsync();
+                  if ((DisconnectSession(session) == false)&&(_doLogging)) LogTime(MUSCLE_LOG_DEBUG, "Connection for %s %s (read error).\n", session->GetSessionDescriptionString()(), wasConnecting?"failed":"was severed");
                }
+            }
 
-               int writeSock = session->GetSessionWriteSelectSocket().GetFileDescriptor();
-               if (writeSock >= 0)
-               {
-                  int32 wroteBytes = 0;
+            int writeSock = session->GetSessionWriteSelectSocket().GetFileDescriptor();
+            if (writeSock >= 0)
+            {
+               int32 wroteBytes = 0;
 
-                  TCHECKPOINT;
+               TCHECKPOINT;
 
-                  if (_multiplexer.IsSocketReadyForWrite(writeSock))
+               if (_multiplexer.IsSocketReadyForWrite(writeSock))
+               {
+                  if (session->IsConnectingAsync()) wroteBytes = (FinalizeAsyncConnect(sessionRef) == B_NO_ERROR) ? 0 : -1;
+                  else
                   {
-                     if (session->IsConnectingAsync()) wroteBytes = (FinalizeAsyncConnect(sessionRef) == B_NO_ERROR) ? 0 : -1;
-                     else
+                     // if the session's DataIO object is still has bytes buffered for output, try to send them now
+                     AbstractMessageIOGateway * g = session->GetGateway()();
+                     if (g)
                      {
-                        // if the session's DataIO object is still has bytes buffered for output, try to send them now
-                        AbstractMessageIOGateway * g = session->GetGateway()();
-                        if (g)
-                        {
-                           DataIO * io = g->GetDataIO()();
-                           if (io) io->WriteBufferedOutput();
-                        }
+                        DataIO * io = g->GetDataIO()();
+                        if (io) io->WriteBufferedOutput();
+                     }
 
-                        wroteBytes = session->DoOutput(session->_maxOutputChunk);
+                     wroteBytes = session->DoOutput(session->_maxOutputChunk);
 
-                        AbstractSessionIOPolicy * p = session->GetOutputPolicy()();
-                        if ((p)&&(wroteBytes >= 0)) p->BytesTransferred(PolicyHolder(session, false), (uint32)wroteBytes);
-                     }
+                     AbstractSessionIOPolicy * p = session->GetOutputPolicy()();
+                     if ((p)&&(wroteBytes >= 0)) p->BytesTransferred(PolicyHolder(session, false), (uint32)wroteBytes);
                   }
+               }
 #if defined(WIN32)
-                  if (_multiplexer.IsSocketExceptionRaised(writeSock)) wroteBytes = -1;  // async connect() failed!
+               if (_multiplexer.IsSocketExceptionRaised(writeSock)) wroteBytes = -1;  // async connect() failed!
 #endif
 
-                  TCHECKPOINT;
+               TCHECKPOINT;
 
-                  if (wroteBytes < 0)
-                  {
-                     bool wasConnecting = session->IsConnectingAsync();
-                     if ((DisconnectSession(session) == false)&&(_doLogging)) LogTime(MUSCLE_LOG_DEBUG, "Connection for %s %s (write error).\n", session->GetSessionDescriptionString()(), wasConnecting?"failed":"was severed");
-                  }
-                  else if (session->_lastByteOutputAt > 0)
-                  {
-                     // Check for output stalls
-                     const uint64 now = GetRunTime64();
-                          if ((wroteBytes > 0)||(session->_maxOutputChunk == 0)) session->_lastByteOutputAt = now;  // reset the moribundness-timer
-                     else if (now-session->_lastByteOutputAt > session->_outputStallLimit)
-                     {
-                        if (_doLogging) LogTime(MUSCLE_LOG_WARNING, "Connection for %s timed out (output stall, no data movement for " UINT64_FORMAT_SPEC " seconds).\n", session->GetSessionDescriptionString()(), MicrosToSeconds(session->_outputStallLimit));
-                        (void) DisconnectSession(session);
-                     }
-                  }
+               if (wroteBytes < 0)
+               {
+                  bool wasConnecting = session->IsConnectingAsync();
+                  if ((DisconnectSession(session) == false)&&(_doLogging)) LogTime(MUSCLE_LOG_DEBUG, "Connection for %s %s (write error).\n", session->GetSessionDescriptionString()(), wasConnecting?"failed":"was severed");
                }
+               else if ((wroteBytes > 0)&&(session->_lastByteOutputAt > 0)) session->_lastByteOutputAt = GetRunTime64();  // reset the moribundness-timer
             }
             TCHECKPOINT;
             CheckForOutOfMemory(sessionRef);  // if the session caused a memory error, give him the boot
          }
+         readySessions.Clear();
+
+         // Check for output stalls on any sessions that wanted to write during this cycle, whether their sockets were ready or not
+         if (writingSessions.HasItems())
+         {
+            const uint64 now = GetRunTime64();
+            for (uint32 i=0; i<writingSessions.GetNumItems(); i++)
+            {
+               AbstractReflectSession * session = writingSessions[i];
+               if ((session->_lastByteOutputAt > 0)&&(session->GetSessionWriteSelectSocket().GetFileDescriptor() >= 0))
+               {
+                       if (session->_maxOutputChunk == 0) session->_lastByteOutputAt = now;  // reset the moribundness-timer
+                  else if (now-session->_lastByteOutputAt > session->_outputStallLimit)
+                  {
+                     if (_doLogging) LogTime(MUSCLE_LOG_WARNING, "Connection for %s timed out (output stall, no data movement for " UINT64_FORMAT_SPEC " seconds).\n", session->GetSessionDescriptionString()(), MicrosToSeconds(session->_outputStallLimit));
+                     (void) DisconnectSession(session);
+                  }
+               }
+            }
+            writingSessions.Clear();
+         }
+      }
+
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+      // Create sessions for the connections that our accept threads have accepted
+      for (uint32 i=0; i<_acceptThreads.GetNumItems(); i++)
+      {
+         AcceptThread * at = _acceptThreads[i];
+         if (_multiplexer.IsSocketReadyForRead(at->GetOwnerWakeupSocket().GetFileDescriptor())) at->GetAcceptedSockets();
+         if (at->_pendingSockets.HasItems()) ProcessAcceptedSockets(at);
       }
+#endif
 
       TCHECKPOINT;
 
@@ -736,6 +906,12 @@ status_t ReflectServer :: ClearLameDucks()
    // Delete any factories that were previously marked for deletion
    _lameDuckFactories.Clear();
 
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+   // Likewise for the accept threads that were serving those factories (they've already exited)
+   AcceptThread * at;
+   while(_lameDuckAcceptThreads.RemoveTail(at) == B_NO_ERROR) delete at;
+#endif
+
    // Remove any sessions that were previously marked for removal
    AbstractReflectSessionRef duckRef;
    while(_lameDuckSessions.RemoveHead(duckRef) == B_NO_ERROR)
@@ -750,6 +926,7 @@ status_t ReflectServer :: ClearLameDucks()
             duck->AboutToDetachFromServer();
             duck->DoOutput(MUSCLE_NO_LIMIT);  // one last chance for him to send any leftover data!
             if (_doLogging) LogTime(MUSCLE_LOG_DEBUG, "Closed %s (" UINT32_FORMAT_SPEC " left)\n", duck->GetSessionDescriptionString()(), _sessions.GetNumItems()-1);
+            StopWatchingSession(duck);
             duck->SetOwner(NULL);
             (void) _sessions.Remove(&id);
          }
@@ -770,10 +947,27 @@ void ReflectServer :: LogAcceptFailed(int lvl, const char * desc, const char * i
 
 status_t ReflectServer :: DoAccept(const IPAddressAndPort & iap, const ConstSocketRef & acceptSocket, ReflectSessionFactory * optFactory)
 {
-   // Accept a new connection and try to start up a session for it
-   ip_address acceptedFromIP;
-   ConstSocketRef newSocket = Accept(acceptSocket, &acceptedFromIP);
-   if (newSocket())
+   // Accept the waiting connections (up to a point, so that a connection storm can't starve our existing sessions)
+   // and try to start up a session for each one
+   const ConstSocketRef as = acceptSocket;  // (a copy, in case a new session removes our factory)
+   status_t ret = B_ERROR;
+   for (uint32 i=0; i<MAX_ACCEPTS_PER_BATCH; i++)
+   {
+      ip_address acceptedFromIP;
+      ConstSocketRef newSocket = Accept(as, &acceptedFromIP);
+      if (newSocket() == NULL)
+      {
+         if (i == 0) LogAcceptFailed(MUSCLE_LOG_DEBUG, "Accept() failed", NULL, iap);
+         break;
+      }
+      if (AddAcceptedSession(iap, newSocket, acceptedFromIP, optFactory) == B_NO_ERROR) ret = B_NO_ERROR;
+      if ((optFactory)&&((optFactory->IsFullyAttachedToServer() == false)||(optFactory->IsReadyToAcceptSessions() == false))) break;
+   }
+   return ret;
+}
+
+status_t ReflectServer :: AddAcceptedSession(const IPAddressAndPort & iap, const ConstSocketRef & newSocket, const ip_address & acceptedFromIP, ReflectSessionFactory * optFactory)
+{
    {
       NestCountGuard ncg(_inDoAccept);
       IPAddressAndPort nip(acceptedFromIP, iap.GetPort());
@@ -805,8 +999,6 @@ status_t ReflectServer :: DoAccept(const IPAddressAndPort & iap, const ConstSock
          else if (optFactory) LogAcceptFailed(MUSCLE_LOG_DEBUG, "Session creation denied", ipbuf, nip);
       }
    }
-   else LogAcceptFailed(MUSCLE_LOG_DEBUG, "Accept() failed", NULL, iap);
-
    return B_ERROR;
 }
 
@@ -898,6 +1090,7 @@ ReplaceSession(const AbstractReflectSessionRef & newSessionRef, AbstractReflectS
    {
        // Oops, rollback changes and error out
        newSession->SetGateway(AbstractMessageIOGatewayRef());
+       if (oldSession->GetGateway()()) (void) oldSession->PutPulseChild(oldSession->GetGateway()());  // since newSession->SetGateway() took it away from oldSession
        newSession->_hostName.Clear();
        newSession->_ipAddressAndPort.Reset();
        return B_ERROR;
@@ -909,6 +1102,7 @@ bool ReflectServer :: DisconnectSession(AbstractReflectSession * session)
    session->SetConnectingAsync(false);
    session->_isConnected = false;
    session->_scratchReconnected = false;  // if the session calls Reconnect() this will be set to true below
+   session->_lastByteOutputAt = 0;        // a disconnected session can't be stalled
 
    AbstractMessageIOGateway * oldGW = session->GetGateway()();
    DataIO * oldIO = oldGW ? oldGW->GetDataIO()() : NULL;
@@ -925,9 +1119,84 @@ bool ReflectServer :: DisconnectSession(AbstractReflectSession * session)
    }
    else if ((session->_scratchReconnected == false)&&(newGW == oldGW)&&(newIO == oldIO)) ShutdownIOFor(session);
 
+   session->InvalidateIOStatus();  // so that its old sockets will be unregistered
    return ret;
 }
 
+void ReflectServer :: AboutToPulseChild(PulseNode & child)
+{
+   AbstractReflectSession * session = dynamic_cast<AbstractReflectSession *>(&child);
+   if (session) session->InvalidateIOStatus();  // since its Pulse() (or its gateway's) may well change what I/O it wants to do
+}
+
+void ReflectServer :: InvalidateSessionIOStatus(AbstractReflectSession * session)
+{
+   if (_sessionsToCheck.PutWithDefault(session) == B_NO_ERROR) session->_ioStatusCheckPending = true;
+                                                            else WARN_OUT_OF_MEMORY;
+}
+
+void ReflectServer :: SetSessionSocketRegistrations(AbstractReflectSession * session, int readFD, int writeFD)
+{
+   const uint32 sets[] = {SocketMultiplexer::FDSTATE_SET_READ, SocketMultiplexer::FDSTATE_SET_WRITE};
+   const int newFDs[]  = {readFD, writeFD};
+   int * curFDs[]      = {&session->_registeredReadFD, &session->_registeredWriteFD};
+
+   // First, unregister any sockets that the session no longer wants watched
+   for (uint32 i=0; i<ARRAYITEMS(sets); i++)
+   {
+      int oldFD = *curFDs[i];
+      if ((oldFD >= 0)&&(oldFD != newFDs[i]))
+      {
+         *curFDs[i] = -1;
+
+         // If some other session has since claimed this file descriptor, then the registration isn't ours to remove anymore
+         AbstractReflectSession * owner;
+         if ((_socketSessions.Get(oldFD, owner) == B_NO_ERROR)&&(owner == session))
+         {
+            (void) _multiplexer.UnregisterPersistentSocketForEventsByTypeIndex(oldFD, sets[i]);
+            if ((session->_registeredReadFD != oldFD)&&(session->_registeredWriteFD != oldFD)) (void) _socketSessions.Remove(oldFD);
+         }
+      }
+   }
+
+   // Then register any sockets that it wants watched but that aren't registered yet
+   for (uint32 i=0; i<ARRAYITEMS(sets); i++)
+   {
+      int newFD = newFDs[i];
+      if ((newFD >= 0)&&(newFD != *curFDs[i]))
+      {
+         AbstractReflectSession * owner = NULL;
+         if ((_socketSessions.Get(newFD, owner) != B_NO_ERROR)||(owner != session))
+         {
+            // This file descriptor may have been left registered on behalf of a session whose socket was
+            // closed (and whose file descriptor was then re-used), so we take it over starting from a clean slate
+            if (owner)
+            {
+               if (owner->_registeredReadFD  == newFD) owner->_registeredReadFD  = -1;
+               if (owner->_registeredWriteFD == newFD) owner->_registeredWriteFD = -1;
+            }
+            for (uint32 j=0; j<ARRAYITEMS(sets); j++) (void) _multiplexer.UnregisterPersistentSocketForEventsByTypeIndex(newFD, sets[j]);
+            if (_socketSessions.Put(newFD, session) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; continue;}
+         }
+
+         if (_multiplexer.RegisterPersistentSocketForEventsByTypeIndex(newFD, sets[i]) == B_NO_ERROR) *curFDs[i] = newFD;
+         else
+         {
+            WARN_OUT_OF_MEMORY;
+            if ((session->_registeredReadFD != newFD)&&(session->_registeredWriteFD != newFD)) (void) _socketSessions.Remove(newFD);
+         }
+      }
+   }
+}
+
+void ReflectServer :: StopWatchingSession(AbstractReflectSession * session)
+{
+   SetSessionSocketRegistrations(session, -1, -1);
+   (void) _sessionsToCheck.Remove(session);
+   session->_ioStatusCheckPending = false;
+   (void) RemovePulseChild(session);
+}
+
 void
 ReflectServer ::
 EndSession(AbstractReflectSession * who)
@@ -951,7 +1220,7 @@ PutAcceptFactory(uint16 port, const ReflectSessionFactoryRef & factoryRef, const
    ReflectSessionFactory * f = factoryRef();
    if (f)
    {
-      ConstSocketRef acceptSocket = CreateAcceptingSocket(port, 20, &port, optInterfaceIP);
+      ConstSocketRef acceptSocket = CreateAcceptingSocket(port, SOMAXCONN, &port, optInterfaceIP, (_numAcceptThreads > 0));
       if (acceptSocket())
       {
          IPAddressAndPort iap(optInterfaceIP, port);
@@ -964,6 +1233,13 @@ PutAcceptFactory(uint16 port, const ReflectSessionFactoryRef & factoryRef, const
                if (f->AttachedToServer() == B_NO_ERROR) 
                {
                   f->SetFullyAttachedToServer(true);
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+                  if ((_serverStartedAt > 0)&&(StartAcceptThreads(iap, acceptSocket) != B_NO_ERROR))  // if we aren't running yet, ServerProcessLoop() will start them
+                  {
+                     (void) RemoveAcceptFactory(port, optInterfaceIP);
+                     return B_ERROR;
+                  }
+#endif
                   return B_NO_ERROR;
                }
                else
@@ -997,6 +1273,9 @@ RemoveAcceptFactoryAux(const IPAddressAndPort & iap)
       if (_factories.IndexOfValue(ref) < 0) ref()->SetOwner(NULL);
 
       (void) _factorySockets.Remove(iap);
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+      ShutdownAcceptThreads(iap);
+#endif
 
       return B_NO_ERROR;
    }
@@ -1077,14 +1356,76 @@ AddLameDuckSession(AbstractReflectSession * who)
 {
    TCHECKPOINT;
 
-   for (HashtableIterator<const String *, AbstractReflectSessionRef> xiter(GetSessions()); xiter.HasData(); xiter++)
+   const AbstractReflectSessionRef * ref = _sessions.Get(&who->GetSessionIDString());
+   if ((ref)&&((*ref)() == who)) AddLameDuckSession(*ref);
+}
+
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+
+status_t
+ReflectServer ::
+StartAcceptThreads(const IPAddressAndPort & iap, const ConstSocketRef & acceptSocket)
+{
+   uint32 numStarted = 0;
+   for (uint32 i=0; i<_numAcceptThreads; i++)
    {
-      if (xiter.GetValue()() == who)
+      // The first thread watches the factory's own socket; the others get sockets of their own, on the same port
+      ConstSocketRef s = (i == 0) ? acceptSocket : CreateAcceptingSocket(iap.GetPort(), SOMAXCONN, NULL, iap.GetIPAddress(), true);
+      if ((s() == NULL)||(SetSocketBlockingEnabled(s, false) != B_NO_ERROR))
       {
-         AddLameDuckSession(xiter.GetValue());
+         if (_doLogging) LogTime(MUSCLE_LOG_WARNING, "Could not create listening socket #" UINT32_FORMAT_SPEC " for port %u, using only " UINT32_FORMAT_SPEC " accept thread%s.\n", i+1, iap.GetPort(), numStarted, (numStarted==1)?"":"s");
          break;
       }
+
+      AcceptThread * at = newnothrow AcceptThread(iap, s);
+      if (at == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      if (_acceptThreads.AddTail(at) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; delete at; return B_ERROR;}
+
+      // Our event loop watches each accept thread's wakeup socket, so that we'll know when it has connections for us
+      const int fd = at->GetOwnerWakeupSocket().GetFileDescriptor();
+      if ((fd < 0)||(_multiplexer.RegisterPersistentSocketForEventsByTypeIndex(fd, SocketMultiplexer::FDSTATE_SET_READ) != B_NO_ERROR)||(at->StartInternalThread() != B_NO_ERROR)) return B_ERROR;
+      numStarted++;
+   }
+
+   // From now on our accept threads do all the accepting on this port, so our event loop shouldn't watch the factory's socket
+   if (numStarted > 0) (void) _factorySockets.Remove(iap);
+   return B_NO_ERROR;
+}
+
+void
+ReflectServer ::
+ShutdownAcceptThreads(const IPAddressAndPort & iap)
+{
+   for (int32 i=_acceptThreads.GetNumItems()-1; i>=0; i--)
+   {
+      AcceptThread * at = _acceptThreads[i];
+      if (at->GetIPAddressAndPort() == iap)
+      {
+         at->ShutdownInternalThread();
+         const int fd = at->GetOwnerWakeupSocket().GetFileDescriptor();
+         if (fd >= 0) (void) _multiplexer.UnregisterPersistentSocketForEventsByTypeIndex(fd, SocketMultiplexer::FDSTATE_SET_READ);
+         (void) _acceptThreads.RemoveItemAt(i);
+         if (_lameDuckAcceptThreads.AddTail(at) != B_NO_ERROR) delete at;  // we may be in the middle of a ProcessAcceptedSockets(at) call, so deletion is done later on
+      }
    }
 }
 
+void
+ReflectServer ::
+ProcessAcceptedSockets(AcceptThread * at)
+{
+   ReflectSessionFactory * factory = GetFactory(at->GetIPAddressAndPort().GetPort(), at->GetIPAddressAndPort().GetIPAddress())();
+   if (factory == NULL) {at->_pendingSockets.Clear(); return;}  // paranoia
+
+   // If the factory isn't accepting sessions right now, the connections will wait in (_pendingSockets) until it is
+   RefCountableRef asRef;
+   while((factory->IsFullyAttachedToServer())&&(factory->IsReadyToAcceptSessions())&&(at->_pendingSockets.RemoveHead(asRef) == B_NO_ERROR))
+   {
+      const AcceptedSocket * as = static_cast<const AcceptedSocket *>(asRef());
+      (void) AddAcceptedSession(at->GetIPAddressAndPort(), as->_socket, as->_localIP, factory);
+   }
+}
+
+#endif
+
 }; // end namespace muscle
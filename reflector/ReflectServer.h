@@ -205,6 +205,23 @@ public:
    /** Read-only implementation of the above */
    const Hashtable<ip_address, String> & GetAddressRemappingTable() const {return _remapIPs;}
 
+   /** Sets the number of threads that should accept incoming TCP connections on each port passed to PutAcceptFactory().
+     * If zero (the default), connections are accepted by the thread that calls ServerProcessLoop().  Otherwise, each
+     * accepting port gets (numThreads) listening sockets (bound via SO_REUSEPORT, so that the OS divides incoming
+     * connections amongst them), each of which is watched by its own thread.  Those threads accept connections as fast
+     * as they arrive, and hand them to the ServerProcessLoop() thread in batches, which then creates sessions for them
+     * as usual (via the port's ReflectSessionFactory).  That keeps accept latency low during a connection storm
+     * (e.g. thousands of clients reconnecting at once after a network outage).
+     * @param numThreads How many accept threads to use for each accepting port.
+     * @note This must be called before PutAcceptFactory() and ServerProcessLoop() are called.  Accept threads are
+     *       not available if MUSCLE_SINGLE_THREAD_ONLY is defined, and only one listening socket per port is possible
+     *       on systems that don't support SO_REUSEPORT.
+     */
+   void SetNumAcceptThreads(uint32 numThreads) {_numAcceptThreads = numThreads;}
+
+   /** Returns the number of accept threads per port, as previously specified via SetNumAcceptThreads(). */
+   uint32 GetNumAcceptThreads() const {return _numAcceptThreads;}
+
    /** Returns a number that is (hopefully) unique to each ReflectSession instance. 
      * This number will be different each time the server is run, but will remain the same for the duration of the server's life.
      */
@@ -284,20 +301,38 @@ protected:
      */
    bool DisconnectSession(AbstractReflectSession * which);
 
+   /** Overridden to mark any session that is about to be Pulse()'d as needing its I/O status re-checked */
+   virtual void AboutToPulseChild(PulseNode & child);
+
 private:
    friend class AbstractReflectSession;
+   void InvalidateSessionIOStatus(AbstractReflectSession * session);
+   void SetSessionSocketRegistrations(AbstractReflectSession * session, int readFD, int writeFD);
+   void StopWatchingSession(AbstractReflectSession * session);
    void AddLameDuckSession(const AbstractReflectSessionRef & whoRef);
-   void AddLameDuckSession(AbstractReflectSession * who);  // convenience method ... less efficient
+   void AddLameDuckSession(AbstractReflectSession * who);  // convenience method
    void ShutdownIOFor(AbstractReflectSession * session);
    status_t ClearLameDucks();  // returns B_NO_ERROR if the server should keep going, or B_ERROR otherwise
    uint32 DumpBoggedSessions();
    status_t RemoveAcceptFactoryAux(const IPAddressAndPort & iap);
    status_t FinalizeAsyncConnect(const AbstractReflectSessionRef & ref);
    status_t DoAccept(const IPAddressAndPort & iap, const ConstSocketRef & acceptSocket, ReflectSessionFactory * optFactory);
+   status_t AddAcceptedSession(const IPAddressAndPort & iap, const ConstSocketRef & newSocket, const ip_address & acceptedFromIP, ReflectSessionFactory * optFactory);
    void LogAcceptFailed(int lvl, const char * desc, const char * ipbuf, const IPAddressAndPort & iap);
    uint32 CheckPolicy(Hashtable<AbstractSessionIOPolicyRef, Void> & policies, const AbstractSessionIOPolicyRef & policyRef, const PolicyHolder & ph, uint64 now) const;
    void CheckForOutOfMemory(const AbstractReflectSessionRef & optSessionRef);
 
+#ifndef MUSCLE_SINGLE_THREAD_ONLY
+   class AcceptThread;
+   status_t StartAcceptThreads(const IPAddressAndPort & iap, const ConstSocketRef & acceptSocket);
+   void ShutdownAcceptThreads(const IPAddressAndPort & iap);
+   void ProcessAcceptedSockets(AcceptThread * acceptThread);
+
+   Queue<AcceptThread *> _acceptThreads;
+   Queue<AcceptThread *> _lameDuckAcceptThreads;  // for delayed-deletion of accept threads whose factory has gone away
+#endif
+   uint32 _numAcceptThreads;
+
    Hashtable<IPAddressAndPort, ReflectSessionFactoryRef> _factories;
    Hashtable<IPAddressAndPort, ConstSocketRef> _factorySockets;
 
@@ -313,6 +348,8 @@ private:
 
    Hashtable<ip_address, String> _remapIPs;  // for v2.20; custom strings for "special" IP addresses
    SocketMultiplexer _multiplexer;
+   Hashtable<AbstractReflectSession *, Void> _sessionsToCheck;  // sessions whose socket registrations need to be updated before our next WaitForEvents() call
+   Hashtable<int, AbstractReflectSession *> _socketSessions;    // socket file descriptor -> the session we registered it for
 
 #ifdef MUSCLE_ENABLE_SSL
    ConstByteBufferRef _publicKey;  // used for making outgoing TCP connections
@@ -30,7 +30,7 @@ enum
    PR_COMMAND_REORDERDATA,        // Moves one or more entries in a node index to a different spot in the index
    PR_COMMAND_ADDREQUIRES,        // Add require patterns to the server's require list (Requires ban privilege)
    PR_COMMAND_REMOVEREQUIRES,     // Remove require patterns from the server's require list (Requires ban privilege)
-   PR_COMMAND_SETDATATREES,       // Sets an entire subtree of data from a single Message (Not implemented!)
+   PR_COMMAND_SETDATATREES,       // Sets one or more entire subtrees of data from a single Message
    PR_COMMAND_GETDATATREES,       // Returns an entire subtree of data as a single Message
    PR_COMMAND_JETTISONDATATREES,  // Removes matching RESULT_DATATREES Messages from the outgoing queue
    PR_COMMAND_RESERVED14,         // reserved for future expansion
@@ -59,7 +59,7 @@ enum
    PR_RESULT_PONG,         // Response from a PR_COMMAND_PING message
    PR_RESULT_ERRORACCESSDENIED, // Your client isn't allowed to do something it tried to do
    PR_RESULT_DATATREES,    // Reply to a PR_COMMAND_GETDATATREES message
-   PR_RESULT_RESERVED5,    // reserved for future expansion
+   PR_RESULT_ENDOFDATAITEMS, // Sent after the last PR_RESULT_DATAITEMS of a paged or streamed PR_COMMAND_GETDATA reply
    PR_RESULT_RESERVED6,    // reserved for future expansion
    PR_RESULT_RESERVED7,    // reserved for future expansion
    PR_RESULT_RESERVED8,    // reserved for future expansion
@@ -112,6 +112,7 @@ enum
 #define PR_NAME_ROUTE_NEIGHBORS_TO_GATEWAY "!N2G" // If set as parameter, session accepts unrecognized Messages from neighbors and sends them to gateway (set by default)
 #define PR_NAME_DISABLE_SUBSCRIPTIONS "!Dsub" // If set as a parameter, disable all subscription updates.
 #define PR_NAME_MAX_UPDATE_MESSAGE_ITEMS "!MxUp"  // Int32 parameter; sets max # of items per PR_RESULT_DATAITEMS message
+#define PR_NAME_LATEST_VALUES_ONLY   "!LVal"  // If set as a parameter, queued-but-unsent PR_RESULT_DATAITEMS values are replaced by newer ones
 #define PR_NAME_SESSION_ROOT         "!Root"  // String returned in parameter set; contains this sessions /host/sessionID
 #define PR_NAME_REJECTED_MESSAGE     "!Rjct"  // Message: In PR_RESULT_ERROR_* messages, returns the client's message that failed to execute.
 #define PR_NAME_PRIVILEGE_BITS       "!Priv"  // int32 bit-chord of PR_PRIVILEGE_* bits.
@@ -129,7 +130,10 @@ enum
 #define PR_NAME_SUBSCRIBE_PREFIX      "SUBSCRIBE:" // Prefix for parameters that indicate a subscription request 
 #define PR_NAME_TREE_REQUEST_ID       "!TRid"   // Identifier field for associating PR_RESULT_DATATREES replies with PR_COMMAND_GETDATATREE commands
 #define PR_NAME_REPLY_ENCODING        "!Enc"    // Parameter name holding int32 of MUSCLE_MESSAGE_ENCODING_* used to send to client
-#define PR_NAME_MAXDEPTH              "!MDep"   // If present as an int32 in PR_COMMAND_GETDATATREES, returned trees will be clipped to this maximum depth. (0==roots only)
+#define PR_NAME_MAXDEPTH              "!MDep"   // If present as an int32 in PR_COMMAND_GETDATATREES or PR_COMMAND_SETDATATREES, trees will be clipped to this maximum depth. (0==roots only)
+#define PR_NAME_MAX_RESULTS           "!MxRs"   // If present as an int32 in PR_COMMAND_GETDATA, no more than this many nodes will be returned per page of results
+#define PR_NAME_STREAM_RESULTS        "!Strm"   // Any type:  if present in a PR_COMMAND_GETDATA message, the results are generated a little at a time, as the client reads them
+#define PR_NAME_RESULTS_CURSOR        "!Crsr"   // String:  in PR_RESULT_ENDOFDATAITEMS, identifies the rest of the results; send it back in a PR_COMMAND_GETDATA to get the next page
 
 // Names in the output message generated by StorageReflectSession::SaveNodeTreeToMessage()
 #define PR_NAME_NODEDATA      "data"   // this submessage is the payload of the current node
@@ -204,6 +208,14 @@ enum
 //                               If unset, the default value (MUSCLE_MESSAGE_ENCODING_DEFAULT) is used.
 //                               Setting this parameter is useful if you want the server to compress
 //                               the data it sends back to your client.
+//
+//      PR_NAME_LATEST_VALUES_ONLY : If set, then whenever the session sends a PR_RESULT_DATAITEMS message
+//                                   while earlier ones are still waiting to be sent to the client (e.g.
+//                                   because the client can't keep up), any values in the waiting messages
+//                                   that the new message supersedes are dropped, so that a slow client only
+//                                   receives the latest value of each node.  This field may be of any type,
+//                                   only its existence/non-existence is relevant.  This parameter is NOT set
+//                                   by default.
 //      
 //
 // if 'what' is PR_COMMAND_GETPARAMETERS:
@@ -223,6 +235,20 @@ enum
 //    that key path.  (Note:  fields that start with a '/' are not allowed, and
 //    will be ignored!)
 //
+// if 'what' is PR_COMMAND_SETDATATREES:
+//    Like PR_COMMAND_SETDATA, except that each Message field's value is an entire subtree
+//    to store under that field's key path, rather than the data for a single node.  Each
+//    subtree Message has the same format as the subtree Messages in a PR_RESULT_DATATREES
+//    reply:  the node's data Message in PR_NAME_NODEDATA, and (optionally) a Message
+//    containing its child subtrees (keyed by child name) in PR_NAME_NODECHILDREN, and a
+//    Message listing the indexed children's names in its PR_NAME_KEYS field in PR_NAME_NODEINDEX.
+//    If a PR_NAME_MAXDEPTH int32 is present, the subtrees will be clipped to that depth.
+//    The whole Message is checked before anything is stored; if any subtree is malformed
+//    (or storing them would exceed the server's per-session node limit), nothing is stored
+//    and the Message is returned as a PR_RESULT_ERRORACCESSDENIED Message.  Subscribers
+//    are sent all of the resulting changes in a single PR_RESULT_DATAITEMS Message, rather
+//    than in several smaller ones.  PR_NAME_SET_QUIETLY is supported as in PR_COMMAND_SETDATA.
+//
 // if 'what' is PR_COMMAND_REMOVEDATA:
 //    Removes all data nodes that match the path(s) in the PR_NAME_KEYS string field.
 //    Paths should be specified relative to this session's root node (i.e. they should
@@ -246,6 +272,23 @@ enum
 //    Each matching message is added with its full path as a field name.  
 //    A PR_NAME_FILTERS field may be added to further limit the nodes matched
 //    by the PR_NAME_KEYS field.
+//    Large result sets can be returned in pages, and/or streamed:
+//      - If a PR_NAME_MAX_RESULTS int32 is present, no more than that many matching nodes
+//        will be returned.  After the page's PR_RESULT_DATAITEMS (and PR_RESULT_INDEXUPDATED)
+//        messages, a PR_RESULT_ENDOFDATAITEMS message is sent.  If more results remain, it will
+//        contain a PR_NAME_RESULTS_CURSOR string; to get the next page, send a PR_COMMAND_GETDATA
+//        message containing that string in its PR_NAME_RESULTS_CURSOR field (PR_NAME_KEYS and
+//        PR_NAME_FILTERS aren't needed; a new PR_NAME_MAX_RESULTS value may be given).  The
+//        server keeps its place in the database between pages, so nodes that are removed before
+//        they are returned won't be returned, and no node will be returned twice.  Unused cursors
+//        expire when the client has more than a few outstanding, or when it disconnects; an
+//        expired cursor is bounced back as a PR_RESULT_ERRORACCESSDENIED message.
+//      - If a PR_NAME_STREAM_RESULTS field (of any type) is present, the results are generated
+//        a little at a time during subsequent event-loop iterations, and only as fast as the
+//        client reads them, so that a huge result set doesn't stall the server or use lots of
+//        memory.  A PR_RESULT_ENDOFDATAITEMS message is sent when the results (or the page of
+//        results, if PR_NAME_MAX_RESULTS is also present) are done.  Note that replies to
+//        commands sent after a streamed PR_COMMAND_GETDATA may arrive before its results do.
 // 
 // if 'what' is PR_COMMAND_INSERTORDEREDDATA:
 //    The session looks for one or more messages in the PR_NAME_KEYS field.  Each
@@ -356,7 +399,7 @@ enum
 //
 // if 'what' is PR_RESULT_ERRORACCESSDENIED:
 //    You tried to do something that you don't have permission to do (such as kick, ban,
-//    or unban another user).
+//    or unban another user, or store more data nodes than the server allows).
 //
 // if 'what' is anything else:
 //    This message was reflected to your client by a neighboring client session.  The content
@@ -9,11 +9,16 @@ namespace muscle {
 
 #define DEFAULT_PATH_PREFIX "*/*"  // when we get a path name without a leading '/', prepend this
 #define DEFAULT_MAX_SUBSCRIPTION_MESSAGE_SIZE   50   // no more than 50 items/update message, please
+#define DEFAULT_GETDATA_TIME_SLICE   5000  // streamed GETDATA results are generated for no more than 5mS per Pulse(), unless told otherwise
+#define MAX_STREAMED_MESSAGES_QUEUED 16    // streamed GETDATA results are generated only while fewer than this many Messages are queued for our client
+#define STREAMED_OUTPUT_POLL_PERIOD  10000 // while our client isn't reading, we check back every 10mS in case our queue was drained without DoOutput()
+#define GETDATA_NODES_PER_TIME_CHECK 256   // how many nodes a GETDATA traversal looks at between checks of the clock
+#define MAX_PAGED_QUERIES            8     // maximum number of unfinished paged GETDATA queries per session
 
 // field under which we file our shared data in the central-state message
 static const String SRS_SHARED_DATA = "srs_shared";
 
-StorageReflectSessionFactory :: StorageReflectSessionFactory() : _maxIncomingMessageSize(MUSCLE_NO_LIMIT)
+StorageReflectSessionFactory :: StorageReflectSessionFactory() : _maxIncomingMessageSize(MUSCLE_NO_LIMIT), _lazyUnflattenEnabled(false), _latestValueOutputEnabled(false)
 {
    // empty
 }
@@ -22,10 +27,11 @@ AbstractReflectSessionRef StorageReflectSessionFactory :: CreateSession(const St
 {
    TCHECKPOINT;
 
-   AbstractReflectSession * srs = newnothrow StorageReflectSession;
+   StorageReflectSession * srs = newnothrow StorageReflectSession;
    AbstractReflectSessionRef ret(srs);
+   if (srs) srs->SetLatestValueOutputEnabled(_latestValueOutputEnabled);
  
-   if ((srs)&&(SetMaxIncomingMessageSizeFor(srs) == B_NO_ERROR)) return ret;
+   if ((srs)&&(SetMaxIncomingMessageSizeFor(srs) == B_NO_ERROR)&&(SetLazyUnflattenEnabledFor(srs) == B_NO_ERROR)) return ret;
    else
    {
       WARN_OUT_OF_MEMORY;
@@ -45,12 +51,26 @@ status_t StorageReflectSessionFactory :: SetMaxIncomingMessageSizeFor(AbstractRe
    return B_NO_ERROR;
 }
 
+status_t StorageReflectSessionFactory :: SetLazyUnflattenEnabledFor(AbstractReflectSession * session) const
+{
+   if (_lazyUnflattenEnabled) 
+   {
+      if (session->GetGateway()() == NULL) session->SetGateway(session->CreateGateway());
+      MessageIOGateway * gw = dynamic_cast<MessageIOGateway*>(session->GetGateway()());
+      if (gw) gw->SetLazyUnflattenEnabled(true);
+         else return B_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
 StorageReflectSession ::
 StorageReflectSession() : 
    _parameters(PR_RESULT_PARAMETERS), 
    _sharedData(NULL),
    _subscriptionsEnabled(true), 
    _maxSubscriptionMessageItems(DEFAULT_MAX_SUBSCRIPTION_MESSAGE_SIZE), 
+   _latestValueOutputEnabled(false),
+   _nextQueryCursorID(0),
    _indexingPresent(false),
    _currentNodeCount(0),
    _maxNodeCount(MUSCLE_NO_LIMIT)
@@ -196,6 +216,10 @@ Cleanup()
 {
    TCHECKPOINT;
 
+   // Let go of any nodes our unfinished GETDATA queries are holding on to
+   _streamedQueries.Clear();
+   _pagedQueries.Clear();
+
    if (_sharedData)
    {
       DataNodeRef hostNodeRef;
@@ -225,6 +249,7 @@ Cleanup()
       {
          // Remove all of our subscription-marks from neighbor's nodes
          (void) _subscriptions.DoTraversal((PathMatchCallback)DoSubscribeRefCallbackFunc, this, GetGlobalRoot(), false, (void *)(-LONG_MAX));
+         for (HashtableIterator<String, PathMatcherEntry> iter(_subscriptions.GetEntries()); iter.HasData(); iter++) _sharedData->_subscriptionIndex.RemovePath(this, *iter.GetValue().GetParser()());
       }
       _sharedData = NULL;
    }
@@ -240,10 +265,48 @@ NotifySubscribersThatNodeChanged(DataNode & modifiedNode, const MessageRef & old
 {
    TCHECKPOINT;
 
-   for (HashtableIterator<const String *, uint32> subIter = modifiedNode.GetSubscribers(); subIter.HasData(); subIter++)
+   // When several sessions are subscribed to this node, they can all share a single update Message (see NodeChangedShared())
+   StorageReflectSessionSharedData * sd = _sharedData;
+   const bool isFanOut = ((sd->_fanOutNode == NULL)&&(modifiedNode.GetNumSubscribers() > 1)&&(modifiedNode.GetNodePath().HasChars()));
+   if (isFanOut)
+   {
+      sd->_fanOutNode = &modifiedNode;
+
+      // During a bulk update, count the subscribers that will update each pending update Message, so that NodeChangedShared()
+      // can tell when a shared pending update Message may be added to in place.  That's only safe if every subscriber is
+      // certain to make the same change, and none of them will need to flush its updates while we are iterating; so we
+      // don't do it for removals, or when any subscriber has a QueryFilter that could turn our change into a removal.
+      if ((sd->_bulkUpdateInProgress)&&(isBeingRemoved == false))
+      {
+         for (uint32 i=0; i<modifiedNode.GetNumSubscribers(); i++)
+         {
+            StorageReflectSession * next = modifiedNode.GetSubscriberAt(i);
+            if (((next != this)||(GetReflectToSelf()))&&(next->GetSubscriptionsEnabled()))
+            {
+               if (next->_subscriptions.GetNumFilters() > 0) {sd->_fanOutHolders.Clear(); break;}
+               if (next->_nextSubscriptionMessage())
+               {
+                  uint32 * count = sd->_fanOutHolders.GetOrPut(next->_nextSubscriptionMessage(), 0);
+                  if (count) (*count)++;
+               }
+            }
+         }
+      }
+   }
+
+   // We iterate backwards, since a callback may unsubscribe a session, and the node fills the vacated slot with its last
+   // subscriber, which we will already have notified.  (If several are removed at once, we skip down to the new end of the list)
+   for (uint32 i=modifiedNode.GetNumSubscribers(); i>0; i=muscleMin(i-1, modifiedNode.GetNumSubscribers()))
+   {
+      StorageReflectSession * next = modifiedNode.GetSubscriberAt(i-1);
+      if ((next != this)||(GetReflectToSelf())) next->NodeChanged(modifiedNode, oldData, isBeingRemoved);
+   }
+
+   if (isFanOut)
    {
-      StorageReflectSession * next = dynamic_cast<StorageReflectSession *>(GetSession(*subIter.GetKey())());
-      if ((next)&&((next != this)||(GetReflectToSelf()))) next->NodeChanged(modifiedNode, oldData, isBeingRemoved);
+      sd->_fanOutNode = NULL;
+      sd->_fanOutTransitions.Clear();
+      sd->_fanOutHolders.Clear();
    }
 
    TCHECKPOINT;
@@ -255,12 +318,8 @@ NotifySubscribersThatNodeIndexChanged(DataNode & modifiedNode, char op, uint32 i
 {
    TCHECKPOINT;
 
-   for (HashtableIterator<const String *, uint32> subIter = modifiedNode.GetSubscribers(); subIter.HasData(); subIter++)
-   {
-      AbstractReflectSessionRef nRef = GetSession(*subIter.GetKey());
-      StorageReflectSession * s = dynamic_cast<StorageReflectSession *>(nRef());
-      if (s) s->NodeIndexChanged(modifiedNode, op, index, key);
-   }
+   // Backwards, for the same reason as in NotifySubscribersThatNodeChanged()
+   for (uint32 i=modifiedNode.GetNumSubscribers(); i>0; i=muscleMin(i-1, modifiedNode.GetNumSubscribers())) modifiedNode.GetSubscriberAt(i-1)->NodeIndexChanged(modifiedNode, op, index, key);
 
    TCHECKPOINT;
 }
@@ -271,11 +330,10 @@ NotifySubscribersOfNewNode(DataNode & newNode)
 {
    TCHECKPOINT;
 
-   for (HashtableIterator<const String *, AbstractReflectSessionRef> iter(GetSessions()); iter.HasData(); iter++)
-   {
-      StorageReflectSession * next = dynamic_cast<StorageReflectSession *>(iter.GetValue()());
-      if (next) next->NodeCreated(newNode);  // always notify; !Self filtering will be done elsewhere
-   }
+   // Only sessions with a subscription path that could match (newNode) need to be told about it
+   Hashtable<StorageReflectSession *, Void> candidates;
+   _sharedData->_subscriptionIndex.FindSessions(newNode, candidates);
+   for (HashtableIterator<StorageReflectSession *, Void> iter(candidates); iter.HasData(); iter++) iter.GetKey()->NodeCreated(newNode);  // always notify; !Self filtering will be done elsewhere
 
    TCHECKPOINT;
 }
@@ -284,7 +342,7 @@ void
 StorageReflectSession ::
 NodeCreated(DataNode & newNode)
 {
-   newNode.IncrementSubscriptionRefCount(GetSessionIDString(), _subscriptions.GetMatchCount(newNode, newNode.GetData()(), 0));  // FogBugz #5803
+   newNode.IncrementSubscriptionRefCount(this, _subscriptions.GetMatchCount(newNode, newNode.GetData()(), 0));  // FogBugz #5803
 }
 
 void
@@ -327,12 +385,13 @@ NodeChangedAux(DataNode & modifiedNode, const MessageRef & nodeData, bool isBein
 {
    TCHECKPOINT;
 
-   if (_nextSubscriptionMessage() == NULL) _nextSubscriptionMessage = GetMessageFromPool(PR_RESULT_DATAITEMS);
-   if (_nextSubscriptionMessage())
+   if ((_sharedData->_fanOutNode == &modifiedNode)&&(NodeChangedShared(nodeData, isBeingRemoved) == B_NO_ERROR)) return;
+
+   if (EnsureNextSubscriptionMessageIsPrivate() == B_NO_ERROR)
    {
       _sharedData->_subsDirty = true;
-      String np;
-      if (modifiedNode.GetNodePath(np) == B_NO_ERROR)
+      const String & np = modifiedNode.GetNodePath();
+      if (np.HasChars())
       {
          if (isBeingRemoved) 
          {
@@ -349,9 +408,97 @@ NodeChangedAux(DataNode & modifiedNode, const MessageRef & nodeData, bool isBein
          }
          else _nextSubscriptionMessage()->AddMessage(np, nodeData);
       }
-      if (_nextSubscriptionMessage()->GetNumNames() >= _maxSubscriptionMessageItems) PushSubscriptionMessages(); 
+      if ((_nextSubscriptionMessage()->GetNumNames() >= _maxSubscriptionMessageItems)&&(_sharedData->_bulkUpdateInProgress == false)) PushSubscriptionMessages(); 
+   }
+}
+
+status_t
+StorageReflectSession ::
+NodeChangedShared(const MessageRef & nodeData, bool isBeingRemoved)
+{
+   TCHECKPOINT;
+
+   // Every session whose pending update Message is (prevMsg) will end up with the same updated Message, so only the first one needs to build it
+   StorageReflectSessionSharedData * sd = _sharedData;
+   const String & fanOutNodePath = sd->_fanOutNode->GetNodePath();
+   const Message * prevMsg = _nextSubscriptionMessage();
+   StorageReflectSessionSharedData::FanOutTransition * ft = sd->_fanOutTransitions.Get(prevMsg);
+   if (ft == NULL)
+   {
+      bool addInPlace = false;
+      if (prevMsg)
+      {
+         // If our pending update Message isn't shared with anyone else, it's cheaper to just add to it in place
+         const bool isInSharedUpdates = sd->_sharedUpdates.ContainsKey(_nextSubscriptionMessage);
+         if (prevMsg->GetRefCount() <= (uint32)(isInSharedUpdates?2:1)) return B_ERROR;
+
+         // Likewise if everyone who shares it is about to make the same change to it (see NotifySubscribersThatNodeChanged()).
+         // This is only done during a bulk update, since otherwise a sharer might push the Message out before the others
+         // had been notified, and they would then send the change a second time.
+         const uint32 * numHolders = sd->_fanOutHolders.Get(prevMsg);
+         addInPlace = ((numHolders)&&(prevMsg->GetRefCount() == (*numHolders)+(isInSharedUpdates?1:0)));
+
+         // Removal notices don't count towards _maxSubscriptionMessageItems, so a long run of removals could make the
+         // Message grow without bound, and copying it for every notification would then be too expensive.
+         if ((addInPlace == false)&&(prevMsg->GetNumNames()+prevMsg->GetNumValuesInName(PR_NAME_REMOVED_DATAITEMS) >= _maxSubscriptionMessageItems)) return B_ERROR;
+      }
+
+      if ((isBeingRemoved)&&(prevMsg)&&(prevMsg->HasName(fanOutNodePath, B_MESSAGE_TYPE))) return B_ERROR;  // NodeChangedAux() will handle the necessary flush
+
+      if (addInPlace)
+      {
+         ft = sd->_fanOutTransitions.PutAndGet(prevMsg, StorageReflectSessionSharedData::FanOutTransition(nodeData(), isBeingRemoved, _nextSubscriptionMessage));
+         if (ft == NULL) return B_ERROR;
+
+         if ((isBeingRemoved ? _nextSubscriptionMessage()->AddString(PR_NAME_REMOVED_DATAITEMS, fanOutNodePath) : _nextSubscriptionMessage()->AddMessage(fanOutNodePath, nodeData)) != B_NO_ERROR)
+         {
+            (void) sd->_fanOutTransitions.Remove(prevMsg);
+            return B_ERROR;
+         }
+
+         StorageReflectSessionSharedData::SharedUpdate * su = sd->_sharedUpdates.Get(_nextSubscriptionMessage);
+         if (su) *su = StorageReflectSessionSharedData::SharedUpdate();  // any flattened bytes it had are out of date now
+         sd->_subsDirty = true;
+         return B_NO_ERROR;  // no need to check the Message's size, since it won't be pushed until the bulk update is done
+      }
+
+      MessageRef newMsg = prevMsg ? GetMessageFromPool(*prevMsg) : GetMessageFromPool(PR_RESULT_DATAITEMS);
+      if (newMsg() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      if ((isBeingRemoved ? newMsg()->AddString(PR_NAME_REMOVED_DATAITEMS, fanOutNodePath) : newMsg()->AddMessage(fanOutNodePath, nodeData)) != B_NO_ERROR) return B_ERROR;
+      if (sd->_sharedUpdates.Put(newMsg, StorageReflectSessionSharedData::SharedUpdate()) != B_NO_ERROR) return B_ERROR;
+
+      ft = sd->_fanOutTransitions.PutAndGet(prevMsg, StorageReflectSessionSharedData::FanOutTransition(nodeData(), isBeingRemoved, newMsg));
+      if (ft == NULL) 
+      {
+         (void) sd->_sharedUpdates.Remove(newMsg);
+         return B_ERROR;
+      }
+   }
+   else if ((ft->_nodeData != nodeData())||(ft->_isBeingRemoved != isBeingRemoved)) return B_ERROR;  // our QueryFilters gave us a different update than our neighbors got
+
+   _nextSubscriptionMessage = ft->_result;
+   sd->_subsDirty = true;
+   if ((_nextSubscriptionMessage()->GetNumNames() >= _maxSubscriptionMessageItems)&&(sd->_bulkUpdateInProgress == false)) PushSubscriptionMessages(); 
+   return B_NO_ERROR;
+}
+
+status_t
+StorageReflectSession ::
+EnsureNextSubscriptionMessageIsPrivate()
+{
+   if (_nextSubscriptionMessage() == NULL) _nextSubscriptionMessage = GetMessageFromPool(PR_RESULT_DATAITEMS);
+   else if (_nextSubscriptionMessage.IsRefPrivate() == false)
+   {
+      // If the only other reference to our Message is the shared-updates table's, then nobody else is using it,
+      // and we can take it back.  Otherwise we need to make our own copy of it before we can modify it.
+      StorageReflectSessionSharedData * sd = _sharedData;
+      if ((_nextSubscriptionMessage()->GetRefCount() == 2)&&(sd->_fanOutTransitions.ContainsKey(_nextSubscriptionMessage()) == false)) (void) sd->_sharedUpdates.Remove(_nextSubscriptionMessage);
+      if (_nextSubscriptionMessage.IsRefPrivate() == false) _nextSubscriptionMessage = GetMessageFromPool(*_nextSubscriptionMessage());
    }
-   else WARN_OUT_OF_MEMORY;
+   if (_nextSubscriptionMessage()) return B_NO_ERROR;
+
+   WARN_OUT_OF_MEMORY;
+   return B_ERROR;
 }
 
 void
@@ -364,8 +511,8 @@ NodeIndexChanged(DataNode & modifiedNode, char op, uint32 index, const String &
    {
       if (_nextIndexSubscriptionMessage() == NULL) _nextIndexSubscriptionMessage = GetMessageFromPool(PR_RESULT_INDEXUPDATED);
 
-      String np;
-      if ((_nextIndexSubscriptionMessage())&&(modifiedNode.GetNodePath(np) == B_NO_ERROR))
+      const String & np = modifiedNode.GetNodePath();
+      if ((_nextIndexSubscriptionMessage())&&(np.HasChars()))
       {
          _sharedData->_subsDirty = true;
          char temp[100];
@@ -474,7 +621,7 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
          break;
 
          case PR_COMMAND_SETDATATREES:
-            BounceMessage(PR_RESULT_ERRORUNIMPLEMENTED, msgRef);    // not implemented, for now
+            if (SetDataTrees(msg) != B_NO_ERROR) BounceMessage(PR_RESULT_ERRORACCESSDENIED, msgRef);
          break;
 
          case PR_COMMAND_GETDATATREES:
@@ -582,7 +729,12 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
                      // This marks any currently existing matching nodes so they know to notify us
                      // It must be done once per subscription path, as it uses per-sub ref-counting
                      NodePathMatcher temp;
-                     if ((temp.PutPathString(fixPath, ConstQueryFilterRef()) == B_NO_ERROR)&&(_subscriptions.PutPathString(fixPath, filter) == B_NO_ERROR)) (void) temp.DoTraversal((PathMatchCallback)DoSubscribeRefCallbackFunc, this, GetGlobalRoot(), false, (void *)1L);
+                     if ((temp.PutPathString(fixPath, ConstQueryFilterRef()) == B_NO_ERROR)&&(_subscriptions.PutPathString(fixPath, filter) == B_NO_ERROR))
+                     {
+                        // The subscription index is what tells us about nodes created in the future
+                        if (_sharedData->_subscriptionIndex.PutPath(this, *_subscriptions.GetEntries()[fixPath].GetParser()()) == B_NO_ERROR) (void) temp.DoTraversal((PathMatchCallback)DoSubscribeRefCallbackFunc, this, GetGlobalRoot(), false, (void *)1L);
+                                                                                                                                  else (void) _subscriptions.RemovePathString(fixPath);
+                     }
                   }
                   if ((subscribeQuietly == false)&&(getMsg.AddString(PR_NAME_KEYS, path) == B_NO_ERROR))
                   {
@@ -613,6 +765,7 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
                {
                   (void) msg.FindInt32(PR_NAME_MAX_UPDATE_MESSAGE_ITEMS, _maxSubscriptionMessageItems);
                }
+               else if (fn == PR_NAME_LATEST_VALUES_ONLY) SetLatestValueOutputEnabled(true);
                else if (fn == PR_NAME_PRIVILEGE_BITS)
                {
                   // don't add this to the parameter set; clients aren't allowed to change
@@ -638,9 +791,9 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
          {
             if (_sessionDir())
             {
-               String np;
+               const String & np = _sessionDir()->GetNodePath();
                MessageRef resultMessage = GetMessageFromPool(_parameters);
-               if ((resultMessage())&&(_sessionDir()->GetNodePath(np) == B_NO_ERROR))
+               if ((resultMessage())&&(np.HasChars()))
                {
                   // Add hard-coded params 
 
@@ -653,6 +806,9 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
                   resultMessage()->RemoveName(PR_NAME_ROUTE_NEIGHBORS_TO_GATEWAY);
                   if (IsRoutingFlagSet(MUSCLE_ROUTING_FLAG_NEIGHBORS_TO_GATEWAY)) resultMessage()->AddBool(PR_NAME_ROUTE_NEIGHBORS_TO_GATEWAY, true);
 
+                  resultMessage()->RemoveName(PR_NAME_LATEST_VALUES_ONLY);
+                  if (IsLatestValueOutputEnabled()) resultMessage()->AddBool(PR_NAME_LATEST_VALUES_ONLY, true);
+
                   resultMessage()->RemoveName(PR_NAME_SESSION_ROOT);
                   resultMessage()->AddString(PR_NAME_SESSION_ROOT, np);
 
@@ -757,7 +913,8 @@ MessageReceivedFromGateway(const MessageRef & msgRef, void * userData)
          break;
 
          case PR_COMMAND_GETDATA:
-            DoGetData(msg);
+            if ((msg.HasName(PR_NAME_MAX_RESULTS))||(msg.HasName(PR_NAME_STREAM_RESULTS))||(msg.HasName(PR_NAME_RESULTS_CURSOR))) DoPagedGetData(msgRef);
+            else DoGetData(msg);
          break;
 
          case PR_COMMAND_REMOVEDATA:
@@ -1027,6 +1184,143 @@ SendGetDataResults(MessageRef & replyMessage)
    }
 }
 
+void
+StorageReflectSession ::
+DoPagedGetData(const MessageRef & msgRef)
+{
+   TCHECKPOINT;
+
+   const Message & msg = *msgRef();
+   GetDataQueryRef queryRef;
+   const String * cursor;
+   if (msg.FindString(PR_NAME_RESULTS_CURSOR, &cursor) == B_NO_ERROR)
+   {
+      // Our client wants the next page of a query it started earlier
+      if (_pagedQueries.Remove(*cursor, queryRef) != B_NO_ERROR)
+      {
+         BounceMessage(PR_RESULT_ERRORACCESSDENIED, msgRef);  // unknown or expired cursor
+         return;
+      }
+   }
+   else
+   {
+      queryRef = GetDataQueryRef(newnothrow GetDataQuery);
+      if (queryRef() == NULL) {WARN_OUT_OF_MEMORY; return;}
+
+      (void) queryRef()->_matcher.PutPathsFromMessage(PR_NAME_KEYS, PR_NAME_FILTERS, msg, DEFAULT_PATH_PREFIX);
+      if (queryRef()->_matcher.BeginTraversal(queryRef()->_cursor, _sharedData->_root) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return;}
+   }
+
+   GetDataQuery & query = *queryRef();
+   int32 maxResults;
+   if (msg.FindInt32(PR_NAME_MAX_RESULTS, maxResults) == B_NO_ERROR) query._maxResults = (maxResults > 0) ? (uint32)maxResults : MUSCLE_NO_LIMIT;
+   query._stream = msg.HasName(PR_NAME_STREAM_RESULTS);
+   if (query._stream)
+   {
+      // Pulse() will generate the results, as our client reads them
+      if (_streamedQueries.AddTail(queryRef) == B_NO_ERROR) InvalidatePulseTime();
+                                                       else WARN_OUT_OF_MEMORY;
+   }
+   else (void) RunGetDataQuery(queryRef, MUSCLE_TIME_NEVER);
+}
+
+bool
+StorageReflectSession ::
+RunGetDataQuery(const GetDataQueryRef & queryRef, uint64 endTime)
+{
+   TCHECKPOINT;
+
+   GetDataQuery & query = *queryRef();
+   while((query._cursor.IsActive())&&(query._numResults < query._maxResults))
+   {
+      if ((query._stream)&&(IsStreamedOutputBlocked())) return false;  // we'll continue after our client has read some of what we've sent
+
+      query._numResults += query._matcher.ContinueTraversal((PathMatchCallback)GetDataCallbackFunc, this, query._cursor, true, query._results, query._maxResults-query._numResults, GETDATA_NODES_PER_TIME_CHECK);
+      if ((GetRunTime64() >= endTime)&&(query._cursor.IsActive())&&(query._numResults < query._maxResults))
+      {
+         // Out of time for now, but our client might as well have what we've got so far
+         SendGetDataResults(query._results[0]);
+         SendGetDataResults(query._results[1]);
+         return false;
+      }
+   }
+
+   FinishGetDataPage(queryRef);
+   return true;
+}
+
+void
+StorageReflectSession ::
+FinishGetDataPage(const GetDataQueryRef & queryRef)
+{
+   TCHECKPOINT;
+
+   GetDataQuery & query = *queryRef();
+   SendGetDataResults(query._results[0]);
+   SendGetDataResults(query._results[1]);
+   query._numResults = 0;
+
+   MessageRef doneMsg = GetMessageFromPool(PR_RESULT_ENDOFDATAITEMS);
+   if (doneMsg() == NULL) {WARN_OUT_OF_MEMORY; return;}
+
+   if (query._cursor.IsActive())
+   {
+      // There are more results to come, so we'll hold on to the query until our client asks for them
+      if (_pagedQueries.GetNumItems() >= MAX_PAGED_QUERIES) (void) _pagedQueries.RemoveFirst();  // the oldest unfinished query expires
+      const String cursor = String("%1").Arg(++_nextQueryCursorID);
+      if ((_pagedQueries.Put(cursor, queryRef) != B_NO_ERROR)||(doneMsg()->AddString(PR_NAME_RESULTS_CURSOR, cursor) != B_NO_ERROR))
+      {
+         WARN_OUT_OF_MEMORY;
+         (void) _pagedQueries.Remove(cursor);
+      }
+   }
+   MessageReceivedFromSession(*this, doneMsg, NULL);
+}
+
+bool
+StorageReflectSession ::
+IsStreamedOutputBlocked() const
+{
+   const AbstractMessageIOGateway * gw = GetGateway()();
+   return ((gw)&&(gw->GetOutgoingMessageQueue().GetNumItems() >= MAX_STREAMED_MESSAGES_QUEUED));
+}
+
+uint64
+StorageReflectSession ::
+GetPulseTime(const PulseArgs & args)
+{
+   uint64 ret = DumbReflectSession::GetPulseTime(args);
+   if (_streamedQueries.HasItems()) ret = muscleMin(ret, IsStreamedOutputBlocked() ? (args.GetCallbackTime()+STREAMED_OUTPUT_POLL_PERIOD) : 0);
+   return ret;
+}
+
+void
+StorageReflectSession ::
+Pulse(const PulseArgs & args)
+{
+   TCHECKPOINT;
+
+   DumbReflectSession::Pulse(args);
+
+   const uint64 timeSlice = GetSuggestedMaximumTimeSlice();
+   const uint64 endTime   = args.GetCallbackTime()+((timeSlice == MUSCLE_TIME_NEVER) ? DEFAULT_GETDATA_TIME_SLICE : timeSlice);
+   while(_streamedQueries.HasItems())
+   {
+      GetDataQueryRef queryRef = _streamedQueries.Head();  // (a copy, in case we get cleaned up while sending results)
+      if (RunGetDataQuery(queryRef, endTime) == false) break;
+      (void) _streamedQueries.RemoveFirstInstanceOf(queryRef);
+   }
+}
+
+int32
+StorageReflectSession ::
+DoOutput(uint32 maxBytes)
+{
+   const int32 ret = DumbReflectSession::DoOutput(maxBytes);
+   if ((_streamedQueries.HasItems())&&(IsStreamedOutputBlocked() == false)) InvalidatePulseTime();  // time to generate more results
+   return ret;
+}
+
 void StorageReflectSession :: DoRemoveData(NodePathMatcher & matcher, bool quiet)
 {
    TCHECKPOINT;
@@ -1074,10 +1368,47 @@ PushSubscriptionMessages()
             nextSession->PushSubscriptionMessage(nextSession->_nextIndexSubscriptionMessage);
          }
       }
+
+      // All the shared update Messages have been handed off now, so their bookkeeping is no longer needed
+      _sharedData->_fanOutTransitions.Clear();
+      _sharedData->_fanOutHolders.Clear();
+      _sharedData->_sharedUpdates.Clear();
+
       PushSubscriptionMessages();  // in case these generated even more messages...
    }
 }
 
+status_t
+StorageReflectSession ::
+AddOutgoingMessage(const MessageRef & msgRef)
+{
+   TCHECKPOINT;
+
+   if ((_latestValueOutputEnabled)&&(msgRef())&&(msgRef()->what == PR_RESULT_DATAITEMS)&&(CoalesceOutgoingResults(msgRef) == B_NO_ERROR)) return B_NO_ERROR;
+
+   StorageReflectSessionSharedData::SharedUpdate * su = _sharedData ? _sharedData->_sharedUpdates.Get(msgRef) : NULL;
+   MessageIOGateway * gw = su ? dynamic_cast<MessageIOGateway *>(GetGateway()()) : NULL;
+   if (gw)
+   {
+      // Flatten the shared Message only if no compatible gateway has already done so
+      const MessageIOGateway * flattenedBy = dynamic_cast<const MessageIOGateway *>(su->_flattenedBy());
+      if ((flattenedBy == NULL)||(gw->IsFlattenedFormatCompatibleWith(*flattenedBy) == false))
+      {
+         ByteBufferRef flatBuf = gw->FlattenSharedMessage(msgRef);
+         if (flatBuf())
+         {
+            su->_flattenedBy = GetGateway();
+            su->_flatBuf     = flatBuf;
+         }
+         else return DumbReflectSession::AddOutgoingMessage(msgRef);  // (gw) can't share buffers, so it will have to flatten (msgRef) itself
+      }
+      if (gw->AddOutgoingPreFlattenedMessage(msgRef, su->_flatBuf) != B_NO_ERROR) return B_ERROR;
+      InvalidateIOStatus();
+      return B_NO_ERROR;
+   }
+   return DumbReflectSession::AddOutgoingMessage(msgRef);
+}
+
 void
 StorageReflectSession ::
 PushSubscriptionMessage(MessageRef & ref)
@@ -1174,8 +1505,8 @@ GetSubtreesCallback(DataNode & node, void * ud)
    if ((inMyOwnSubtree == false)||(reflectToSelf))
    {
       MessageRef subMsg = GetMessageFromPool();
-      String nodePath;
-      if ((subMsg() == NULL)||(node.GetNodePath(nodePath) != B_NO_ERROR)||(reply->AddMessage(nodePath, subMsg) != B_NO_ERROR)||(SaveNodeTreeToMessage(*subMsg(), &node, "", true, (maxDepth>=0)?(uint32)maxDepth:MUSCLE_NO_LIMIT, NULL) != B_NO_ERROR)) return 0;
+      const String & nodePath = node.GetNodePath();
+      if ((subMsg() == NULL)||(nodePath.IsEmpty())||(reply->AddMessage(nodePath, subMsg) != B_NO_ERROR)||(SaveNodeTreeToMessage(*subMsg(), &node, "", true, (maxDepth>=0)?(uint32)maxDepth:MUSCLE_NO_LIMIT, NULL) != B_NO_ERROR)) return 0;
    }
    return node.GetDepth();  // continue traversal as usual
 }
@@ -1199,7 +1530,7 @@ int
 StorageReflectSession ::
 DoSubscribeRefCallback(DataNode & node, void * userData)
 {
-   node.IncrementSubscriptionRefCount(GetSessionIDString(), (long) userData);
+   node.IncrementSubscriptionRefCount(this, (long) userData);
    return node.GetDepth();  // continue traversal as usual
 }
 
@@ -1226,8 +1557,8 @@ GetDataCallback(DataNode & node, void * userData)
    {
       MessageRef & resultMsg = messageArray[0];
       if (resultMsg() == NULL) resultMsg = GetMessageFromPool(PR_RESULT_DATAITEMS);
-      String np;
-      if ((resultMsg())&&(node.GetNodePath(np) == B_NO_ERROR))
+      const String & np = node.GetNodePath();
+      if ((resultMsg())&&(np.HasChars()))
       {
          (void) resultMsg()->AddMessage(np, node.GetData());
          if (resultMsg()->GetNumNames() >= _maxSubscriptionMessageItems) SendGetDataResults(resultMsg);
@@ -1240,7 +1571,7 @@ GetDataCallback(DataNode & node, void * userData)
    }
 
    // But indices we need to send to ourself no matter what, as they are generated on the server side.
-   const Queue<DataNodeRef> * index = node.GetIndex();
+   const DataNodeIndex * index = node.GetIndex();
    if (index)
    {
       uint32 indexLen = index->GetNumItems();
@@ -1248,15 +1579,16 @@ GetDataCallback(DataNode & node, void * userData)
       {
          MessageRef & indexUpdateMsg = messageArray[1];
          if (indexUpdateMsg() == NULL) indexUpdateMsg = GetMessageFromPool(PR_RESULT_INDEXUPDATED);
-         String np;
-         if ((indexUpdateMsg())&&(node.GetNodePath(np) == B_NO_ERROR))
+         const String & np = node.GetNodePath();
+         if ((indexUpdateMsg())&&(np.HasChars()))
          {
             char clearStr[] = {INDEX_OP_CLEARED, '\0'};
             (void) indexUpdateMsg()->AddString(np, clearStr);
-            for (uint32 i=0; i<indexLen; i++) 
+            uint32 i = 0;
+            for (DataNodeIndexIterator iter(*index); iter.HasData(); iter++)
             {
-               char temp[100]; sprintf(temp, "%c" UINT32_FORMAT_SPEC ":", INDEX_OP_ENTRYINSERTED, i);
-               (void) indexUpdateMsg()->AddString(np, (*index)[i]()->GetNodeName().Prepend(temp));
+               char temp[100]; sprintf(temp, "%c" UINT32_FORMAT_SPEC ":", INDEX_OP_ENTRYINSERTED, i++);
+               (void) indexUpdateMsg()->AddString(np, iter.GetValue()()->GetNodeName().Prepend(temp));
             }
             if (indexUpdateMsg()->GetNumNames() >= _maxSubscriptionMessageItems) SendGetDataResults(messageArray[1]);
          }
@@ -1478,18 +1810,7 @@ CheckChildForTraversal(TraversalContext & data, DataNode * nextChild, int & dept
                         if (data.IsUseFiltersOkay()) constDataRef = nextChild->GetData();
                         if (((GetEntries().GetNumItems() == 1)&&((data.IsUseFiltersOkay() == false)||(iter.GetValue().GetFilter()() == NULL)))||(MatchesNode(*nextChild, constDataRef, data.GetRootDepth())))
                         {
-                           int nextDepth;
-                           if ((constDataRef() == NULL)||(constDataRef() == nextChild->GetData()())) nextDepth = data.CallCallbackMethod(*nextChild);  // the usual/simple case
-                           else
-                           {
-                              // Hey, the QueryFilter retargetted the ConstMessageRef!  So we need the callback to see the modified Message, not the original one.
-                              // We'll do that the sneaky way, by temporarily swapping out (nextChild)'s MessageRef, and then swapping it back in afterwards.
-                              MessageRef origNodeMsg = nextChild->GetData(); 
-                              nextChild->SetData(CastAwayConstFromRef(constDataRef), NULL, false);
-                              nextDepth = data.CallCallbackMethod(*nextChild);
-                              nextChild->SetData(origNodeMsg, NULL, false);
-                           }
-
+                           int nextDepth = CallCallbackWithData(data, *nextChild, constDataRef);
                            if (nextDepth < ((int)nextChild->GetDepth())-1) 
                            {
                               depth = nextDepth;
@@ -1523,6 +1844,149 @@ CheckChildForTraversal(TraversalContext & data, DataNode * nextChild, int & dept
    return false;
 }
 
+int
+StorageReflectSession :: NodePathMatcher ::
+CallCallbackWithData(TraversalContext & data, DataNode & node, const ConstMessageRef & constDataRef) const
+{
+   if ((constDataRef() == NULL)||(constDataRef() == node.GetData()())) return data.CallCallbackMethod(node);  // the usual/simple case
+
+   // Hey, the QueryFilter retargetted the ConstMessageRef!  So we need the callback to see the modified Message, not the original one.
+   // We'll do that the sneaky way, by temporarily swapping out (node)'s MessageRef, and then swapping it back in afterwards.
+   MessageRef origNodeMsg = node.GetData(); 
+   node.SetData(CastAwayConstFromRef(constDataRef), NULL, false);
+   const int nextDepth = data.CallCallbackMethod(node);
+   node.SetData(origNodeMsg, NULL, false);
+   return nextDepth;
+}
+
+status_t
+StorageReflectSession :: NodePathMatcher ::
+BeginTraversal(TraversalCursor & cursor, const DataNodeRef & root) const
+{
+   cursor.Reset();
+   if (root() == NULL) return B_ERROR;
+
+   cursor._rootDepth = root()->GetDepth();
+   return PushTraversalFrame(cursor, root);
+}
+
+status_t
+StorageReflectSession :: NodePathMatcher ::
+PushTraversalFrame(TraversalCursor & cursor, const DataNodeRef & nodeRef) const
+{
+   DataNode & node = *nodeRef();
+   const int level = node.GetDepth()-cursor._rootDepth;
+
+   TraversalCursor::Frame frame;
+   frame._node = nodeRef;
+
+   // As in DoTraversalAux(), if none of our parsers are using wildcarding at this level, we can look up the children we need directly
+   bool parsersHaveWildcards = false;
+   for (HashtableIterator<String, PathMatcherEntry> iter(GetEntries()); iter.HasData(); iter++)
+   {
+      const StringMatcherQueue * nextQueue = iter.GetValue().GetParser()();
+      if ((nextQueue)&&((int)nextQueue->GetNumItems() > level))
+      {
+         const StringMatcher * nextMatcher = nextQueue->GetItemAt(level)->GetItemPointer();
+         if ((nextMatcher == NULL)||(nextMatcher->IsPatternUnique() == false))
+         {
+            parsersHaveWildcards = true;
+            break;
+         }
+      }
+   }
+
+   if (parsersHaveWildcards) frame._iter = node.GetChildIterator();
+   else
+   {
+      for (HashtableIterator<String, PathMatcherEntry> iter(GetEntries()); iter.HasData(); iter++)
+      {
+         const StringMatcherQueue * nextQueue = iter.GetValue().GetParser()();
+         if ((nextQueue)&&((int)nextQueue->GetNumItems() > level))
+         {
+            DataNodeRef childRef;
+            if ((node.GetChild(RemoveEscapeChars(nextQueue->GetItemAt(level)->GetItemPointer()->GetPattern()), childRef) == B_NO_ERROR)&&(frame._candidates.IndexOf(childRef) < 0)&&(frame._candidates.AddTail(childRef) != B_NO_ERROR)) return B_ERROR;
+         }
+      }
+   }
+   return cursor._frames.AddTail(frame);
+}
+
+uint32
+StorageReflectSession :: NodePathMatcher ::
+ContinueTraversal(PathMatchCallback cb, StorageReflectSession * This, TraversalCursor & cursor, bool useFilters, void * userData, uint32 maxCallbacks, uint32 maxVisits)
+{
+   TCHECKPOINT;
+
+   TraversalContext data(cb, This, useFilters, userData, cursor._rootDepth);
+   uint32 numVisits = 0;
+   while((cursor._frames.HasItems())&&(data.GetVisitCount() < maxCallbacks)&&(numVisits < maxVisits))
+   {
+      // Find the next child of the current node to look at
+      TraversalCursor::Frame & frame = cursor._frames.Tail();
+      DataNodeRef childRef;
+      if (frame._nextCandidate < frame._candidates.GetNumItems()) childRef = frame._candidates[frame._nextCandidate++];
+      else if (frame._iter.HasData())
+      {
+         childRef = frame._iter.GetValue();  // note:  may be a NULL ref, if the child was removed while we were paused on it
+         frame._iter++;
+      }
+      else
+      {
+         (void) cursor._frames.RemoveTail();  // we're done with this node's children, so back up to its parent
+         continue;
+      }
+
+      DataNode * child = childRef();
+      const int depth = frame._node()->GetDepth();
+      if ((child == NULL)||(child->GetParent() != frame._node())) continue;  // (child) was removed from the tree since we started on its parent's children
+      numVisits++;
+
+      // See whether any of our parsers match (child), and/or might match its descendants
+      const int clauseIdx = depth-data.GetRootDepth();
+      const PathMatcherEntry * terminalEntry = NULL;
+      bool doDescend = false;
+      for (HashtableIterator<String, PathMatcherEntry> iter(GetEntries()); ((terminalEntry == NULL)||(doDescend == false))&&(iter.HasData()); iter++)
+      {
+         const StringMatcherQueue * nextQueue = iter.GetValue().GetParser()();
+         const int numClausesInParser = nextQueue ? (int)nextQueue->GetNumItems() : 0;
+         if (numClausesInParser > clauseIdx)
+         {
+            const StringMatcher * nextMatcher = nextQueue->GetItemAt(clauseIdx)->GetItemPointer();
+            if ((nextMatcher == NULL)||(nextMatcher->Match(child->GetNodeName()())))
+            {
+               if (numClausesInParser == clauseIdx+1) 
+               {
+                  if (terminalEntry == NULL) terminalEntry = &iter.GetValue();
+               }
+               else doDescend = true;
+            }
+         }
+      }
+
+      // Set up to visit (child)'s children first, so that if the callback asks us to skip them, it can
+      if ((doDescend)&&(PushTraversalFrame(cursor, childRef) != B_NO_ERROR))
+      {
+         WARN_OUT_OF_MEMORY;
+         cursor.Reset();
+         break;
+      }
+
+      if (terminalEntry)
+      {
+         // Same checks as in CheckChildForTraversal()
+         ConstMessageRef constDataRef; 
+         if (data.IsUseFiltersOkay()) constDataRef = child->GetData();
+         if (((GetEntries().GetNumItems() == 1)&&((data.IsUseFiltersOkay() == false)||(terminalEntry->GetFilter()() == NULL)))||(MatchesNode(*child, constDataRef, data.GetRootDepth())))
+         {
+            const int nextDepth = CallCallbackWithData(data, *child, constDataRef);
+            while((cursor._frames.HasItems())&&((int)cursor._frames.Tail()._node()->GetDepth() > nextDepth)) (void) cursor._frames.RemoveTail();
+         }
+      }
+   }
+   return data.GetVisitCount();
+}
+
 DataNodeRef
 StorageReflectSession ::
 GetNewDataNode(const String & name, const MessageRef & initialValue)
@@ -1582,6 +2046,15 @@ JettisonOutgoingResults(const NodePathMatcher * matcher)
          Message * msg = oq.GetItemAt(i)->GetItemPointer();
          if ((msg)&&(msg->what == PR_RESULT_DATAITEMS))
          {
+            if (oq[i].IsRefPrivate() == false)
+            {
+               // This Message may be shared with other sessions (or already flattened), so we must modify a copy of it instead
+               MessageRef copyRef = GetMessageFromPool(*msg);
+               if (copyRef() == NULL) {WARN_OUT_OF_MEMORY; continue;}
+               oq[i] = copyRef;
+               msg = copyRef();
+            }
+
             if (matcher)
             {
                // Remove any PR_NAME_REMOVED_DATAITEMS entries that match... 
@@ -1617,6 +2090,120 @@ JettisonOutgoingResults(const NodePathMatcher * matcher)
    }
 }
 
+// Returns true iff (msg) contains nothing but node values and PR_NAME_REMOVED_DATAITEMS notices, so that its items may be coalesced
+static bool IsCoalescableResultMessage(const Message & msg)
+{
+   for (MessageFieldNameIterator iter = msg.GetFieldNameIterator(); iter.HasData(); iter++)
+   {
+      uint32 tc;
+      const String & fn = iter.GetFieldName();
+      if ((msg.GetInfo(fn, &tc) != B_NO_ERROR)||((tc != B_MESSAGE_TYPE)&&((tc != B_STRING_TYPE)||(fn != PR_NAME_REMOVED_DATAITEMS)))) return false;
+   }
+   return true;
+}
+
+static bool HasRemovalNotice(const Message & msg, const String & nodePath)
+{
+   const String * rname;
+   for (uint32 i=0; msg.FindString(PR_NAME_REMOVED_DATAITEMS, i, &rname) == B_NO_ERROR; i++) if (*rname == nodePath) return true;
+   return false;
+}
+
+// Removes (nodePath)'s values from the queued PR_RESULT_DATAITEMS Messages at indices (runStart) and up in (oq)
+static status_t RemoveQueuedValues(Queue<MessageRef> & oq, uint32 runStart, const String & nodePath)
+{
+   for (uint32 i=runStart; i<oq.GetNumItems(); i++)
+   {
+      MessageRef & qRef = oq[i];
+      if ((qRef()->HasName(nodePath, B_MESSAGE_TYPE))&&(IsCoalescableResultMessage(*qRef())))
+      {
+         if (qRef.IsRefPrivate() == false)
+         {
+            // This Message may be shared with other sessions (or already flattened), so we must modify a copy of it instead
+            MessageRef copyRef = GetMessageFromPool(*qRef());
+            if (copyRef() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+            qRef = copyRef;
+         }
+         (void) qRef()->RemoveName(nodePath);
+      }
+   }
+   return B_NO_ERROR;
+}
+
+status_t
+StorageReflectSession ::
+CoalesceOutgoingResults(const MessageRef & msgRef)
+{
+   TCHECKPOINT;
+
+   AbstractMessageIOGateway * gw = GetGateway()();
+   if (gw == NULL) return B_ERROR;
+
+   const Message & newMsg = *msgRef();
+   if (IsCoalescableResultMessage(newMsg) == false) return B_ERROR;
+
+   // Only the run of PR_RESULT_DATAITEMS Messages at the end of the queue is considered, so that
+   // node updates are never reordered with respect to any other kind of Message we've queued.
+   Queue<MessageRef> & oq = gw->GetOutgoingMessageQueue();
+   uint32 runStart = oq.GetNumItems();
+   while((runStart > 0)&&(oq[runStart-1]())&&(oq[runStart-1]()->what == PR_RESULT_DATAITEMS)) runStart--;
+   if (runStart == oq.GetNumItems()) return B_ERROR;  // nothing queued that we could coalesce with
+
+   // See if all of (newMsg)'s items can go into the last queued Message.  A single Message can't
+   // express a remove-then-add of the same node, and we don't want to exceed the client's item limit.
+   MessageRef & tailRef = oq.Tail();
+   bool mergeIntoTail = IsCoalescableResultMessage(*tailRef());
+   if (mergeIntoTail)
+   {
+      uint32 numNames = tailRef()->GetNumNames();
+      for (MessageFieldNameIterator iter = newMsg.GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++)
+      {
+         const String & np = iter.GetFieldName();
+         if (HasRemovalNotice(*tailRef(), np)) {mergeIntoTail = false; break;}
+         if ((tailRef()->HasName(np) == false)&&(++numNames > _maxSubscriptionMessageItems)) {mergeIntoTail = false; break;}
+      }
+   }
+
+   // Remove any queued values that (newMsg) supersedes (both its new values and its removal notices supersede them)
+   const String * rname;
+   for (MessageFieldNameIterator iter = newMsg.GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++) if (RemoveQueuedValues(oq, runStart, iter.GetFieldName()) != B_NO_ERROR) return B_ERROR;
+   for (uint32 r=0; newMsg.FindString(PR_NAME_REMOVED_DATAITEMS, r, &rname) == B_NO_ERROR; r++) if (RemoveQueuedValues(oq, runStart, *rname) != B_NO_ERROR) return B_ERROR;
+
+   status_t ret = B_ERROR;
+   if (mergeIntoTail)
+   {
+      if (tailRef.IsRefPrivate() == false)
+      {
+         MessageRef copyRef = GetMessageFromPool(*tailRef());
+         if (copyRef() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+         tailRef = copyRef;
+      }
+
+      ret = B_NO_ERROR;
+      Message & tailMsg = *tailRef();
+      for (MessageFieldNameIterator iter = newMsg.GetFieldNameIterator(); iter.HasData(); iter++)
+      {
+         const String & fn = iter.GetFieldName();
+         if (fn == PR_NAME_REMOVED_DATAITEMS)
+         {
+            for (uint32 r=0; newMsg.FindString(fn, r, &rname) == B_NO_ERROR; r++)
+               if ((HasRemovalNotice(tailMsg, *rname) == false)&&(tailMsg.AddString(fn, *rname) != B_NO_ERROR)) ret = B_ERROR;
+         }
+         else
+         {
+            // Only the most recent value of the node is of any interest
+            MessageRef nodeData;
+            if ((newMsg.FindMessage(fn, newMsg.GetNumValuesInName(fn)-1, nodeData) != B_NO_ERROR)||(tailMsg.AddMessage(fn, nodeData) != B_NO_ERROR)) ret = B_ERROR;
+         }
+      }
+      if (ret != B_NO_ERROR) WARN_OUT_OF_MEMORY;  // we'll fall back to queueing (msgRef) too, so nothing gets lost
+   }
+
+   // Any Messages that were left with nothing in them needn't be sent at all
+   for (int i=oq.GetNumItems()-1; i>=(int)runStart; i--) if (oq[i]()->HasNames() == false) (void) oq.RemoveItemAt(i);
+   return ret;
+}
+
 status_t
 StorageReflectSession :: CloneDataNodeSubtree(const DataNode & node, const String & destPath, bool allowOverwriteData, bool allowCreateNode, bool quiet, bool addToTargetIndex, const String * optInsertBefore, const ITraversalPruner * optPruner)
 {
@@ -1636,14 +2223,14 @@ StorageReflectSession :: CloneDataNodeSubtree(const DataNode & node, const Strin
    }
 
    // Lastly, if he has an index, make sure the clone ends up with an equivalent index
-   const Queue<DataNodeRef> * index = node.GetIndex();
+   const DataNodeIndex * index = node.GetIndex();
    if (index)
    {
       DataNode * clone = GetDataNode(destPath);
       if (clone)
       {
-         uint32 idxLen = index->GetNumItems();
-         for (uint32 i=0; i<idxLen; i++) if (clone->InsertIndexEntryAt(i, this, (*index)[i]()->GetNodeName()) != B_NO_ERROR) return B_ERROR;
+         uint32 i = 0;
+         for (DataNodeIndexIterator iter(*index); iter.HasData(); iter++) if (clone->InsertIndexEntryAt(i++, this, iter.GetValue()()->GetNodeName()) != B_NO_ERROR) return B_ERROR;
       }
       else return B_ERROR;
    }
@@ -1666,16 +2253,15 @@ StorageReflectSession :: SaveNodeTreeToMessage(Message & msg, const DataNode * n
    if ((node->HasChildren())&&(maxDepth > 0))
    {
       // Save the node-index, if there is one
-      const Queue<DataNodeRef> * index = node->GetIndex();
+      const DataNodeIndex * index = node->GetIndex();
       if (index)
       {
-         uint32 indexSize = index->GetNumItems();
-         if (indexSize > 0)
+         if (index->HasItems())
          {
             MessageRef indexMsgRef(GetMessageFromPool());
             if ((indexMsgRef() == NULL)||(msg.AddMessage(PR_NAME_NODEINDEX, indexMsgRef) != B_NO_ERROR)) return B_ERROR;
             Message * indexMsg = indexMsgRef();
-            for (uint32 i=0; i<indexSize; i++) if (indexMsg->AddString(PR_NAME_KEYS, (*index)[i]()->GetNodeName()) != B_NO_ERROR) return B_ERROR;
+            for (DataNodeIndexIterator iter(*index); iter.HasData(); iter++) if (indexMsg->AddString(PR_NAME_KEYS, iter.GetValue()()->GetNodeName()) != B_NO_ERROR) return B_ERROR;
          }
       }
 
@@ -1766,6 +2352,80 @@ StorageReflectSession :: RestoreNodeTreeFromMessage(const Message & msg, const S
    return B_NO_ERROR;   
 }
 
+// Adds to (retCount) the number of nodes that RestoreNodeTreeFromMessage() would need to create to restore (msg) as (optNode),
+// and fails if (msg) is missing any of the payload Messages that RestoreNodeTreeFromMessage() would need.
+static status_t CountNewNodesInTree(const DataNode * optNode, const Message & msg, uint32 maxDepth, uint32 & retCount)
+{
+   if (msg.HasName(PR_NAME_NODEDATA, B_MESSAGE_TYPE) == false) return B_ERROR;
+
+   MessageRef childrenRef;
+   if ((maxDepth > 0)&&(msg.FindMessage(PR_NAME_NODECHILDREN, childrenRef) == B_NO_ERROR)&&(childrenRef()))
+   {
+      for (MessageFieldNameIterator iter = childrenRef()->GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++)
+      {
+         MessageRef nextChildRef;
+         if ((childrenRef()->FindMessage(iter.GetFieldName(), nextChildRef) == B_NO_ERROR)&&(nextChildRef()))
+         {
+            DataNodeRef childNodeRef;
+            if ((optNode == NULL)||(optNode->GetChild(iter.GetFieldName(), childNodeRef) != B_NO_ERROR)) retCount++;
+            if (CountNewNodesInTree(childNodeRef(), *nextChildRef(), maxDepth-1, retCount) != B_NO_ERROR) return B_ERROR;
+         }
+      }
+   }
+   return B_NO_ERROR;
+}
+
+status_t
+StorageReflectSession ::
+SetDataTrees(const Message & setMsg)
+{
+   TCHECKPOINT;
+
+   if (_sessionDir() == NULL) return B_ERROR;
+
+   int32 maxDepth = -1; (void) setMsg.FindInt32(PR_NAME_MAXDEPTH, maxDepth);
+   const uint32 restoreDepth = (maxDepth >= 0) ? (uint32)maxDepth : MUSCLE_NO_LIMIT;
+
+   // First make sure the whole Message can be applied, so that we never leave a partially-restored set of trees behind
+   uint32 newNodeCount = 0;
+   for (MessageFieldNameIterator it = setMsg.GetFieldNameIterator(B_MESSAGE_TYPE); it.HasData(); it++)
+   {
+      const String & path = it.GetFieldName();
+      if ((path.IsEmpty())||(path[0] == '/')||(path.EndsWith('/'))||(path.IndexOf("//") >= 0)) return B_ERROR;
+
+      // Count the not-yet-existing nodes along the path to the subtree's root (including the root itself)
+      const DataNode * node = _sessionDir();
+      int32 prevSlashPos = -1;
+      while(prevSlashPos < (int32)path.Length())
+      {
+         int32 slashPos = path.IndexOf('/', prevSlashPos+1);
+         if (slashPos < 0) slashPos = path.Length();
+         DataNodeRef childNodeRef;
+         if ((node == NULL)||(node->GetChild(path.Substring(prevSlashPos+1, slashPos), childNodeRef) != B_NO_ERROR)) newNodeCount++;
+         node = childNodeRef();
+         prevSlashPos = slashPos;
+      }
+
+      MessageRef treeRef;
+      for (int32 i=0; setMsg.FindMessage(path, i, treeRef) == B_NO_ERROR; i++) if ((treeRef() == NULL)||(CountNewNodesInTree(node, *treeRef(), restoreDepth, newNodeCount) != B_NO_ERROR)) return B_ERROR;
+   }
+   if (((uint64)_currentNodeCount)+newNodeCount > _maxNodeCount) return B_ERROR;
+
+   // Then restore the trees.  While we do that, the subscribers' pending update Messages are allowed to grow without limit,
+   // so that each subscriber will be sent one update Message describing all of the changes, instead of many partial ones.
+   const bool quiet = setMsg.HasName(PR_NAME_SET_QUIETLY);
+   const bool wasBulkUpdate = _sharedData->_bulkUpdateInProgress;
+   _sharedData->_bulkUpdateInProgress = true;
+   status_t ret = B_NO_ERROR;
+   for (MessageFieldNameIterator it = setMsg.GetFieldNameIterator(B_MESSAGE_TYPE); it.HasData(); it++)
+   {
+      MessageRef treeRef;
+      for (int32 i=0; setMsg.FindMessage(it.GetFieldName(), i, treeRef) == B_NO_ERROR; i++) if (RestoreNodeTreeFromMessage(*treeRef(), it.GetFieldName(), true, false, restoreDepth, NULL, quiet) != B_NO_ERROR) ret = B_ERROR;  // out of memory?
+   }
+   _sharedData->_bulkUpdateInProgress = wasBulkUpdate;
+   return ret;
+}
+
 status_t StorageReflectSession :: RemoveParameter(const String & paramName, bool & retUpdateDefaultMessageRoute)
 {
    if (_parameters.HasName(paramName) == false) return B_ERROR;  // FogBugz #6348:  DO NOT remove paramName until the end of this method!
@@ -1774,6 +2434,8 @@ status_t StorageReflectSession :: RemoveParameter(const String & paramName, bool
    {
       String str = paramName.Substring(10);
       _subscriptions.AdjustStringPrefix(str, DEFAULT_PATH_PREFIX);
+      const PathMatcherEntry * e = _subscriptions.GetEntries().Get(str);
+      if (e) _sharedData->_subscriptionIndex.RemovePath(this, *e->GetParser()());
       if (_subscriptions.RemovePathString(str) == B_NO_ERROR)
       {
          // Remove the references from this subscription from all nodes
@@ -1787,6 +2449,7 @@ status_t StorageReflectSession :: RemoveParameter(const String & paramName, bool
    else if (paramName == PR_NAME_ROUTE_NEIGHBORS_TO_GATEWAY) SetRoutingFlag(MUSCLE_ROUTING_FLAG_NEIGHBORS_TO_GATEWAY, false);
    else if (paramName == PR_NAME_DISABLE_SUBSCRIPTIONS)      SetSubscriptionsEnabled(true);
    else if (paramName == PR_NAME_MAX_UPDATE_MESSAGE_ITEMS)   _maxSubscriptionMessageItems = DEFAULT_MAX_SUBSCRIPTION_MESSAGE_SIZE;  // back to the default
+   else if (paramName == PR_NAME_LATEST_VALUES_ONLY)         SetLatestValueOutputEnabled(false);
    else if (paramName == PR_NAME_REPLY_ENCODING)
    {
       MessageIOGateway * gw = dynamic_cast<MessageIOGateway *>(GetGateway()());
@@ -1862,5 +2525,151 @@ void StorageReflectSession :: PrintSessionsInfo() const
    printf("Totals: " UINT32_FORMAT_SPEC " messages, " UINT32_FORMAT_SPEC " message-bytes, " UINT32_FORMAT_SPEC " nodes, " UINT32_FORMAT_SPEC " node-bytes.\n", totalNumOutMessages, totalNumOutBytes, totalNumNodes, totalNumNodeBytes);
 }
 
+StorageReflectSession :: SubscriptionIndex :: IndexNode ::
+~IndexNode()
+{
+   for (HashtableIterator<String, IndexNode *> iter(_literalChildren);  iter.HasData(); iter++) delete iter.GetValue();
+   for (HashtableIterator<String, IndexNode *> iter(_wildcardChildren); iter.HasData(); iter++) delete iter.GetValue();
+   delete _anyChild;
+}
+
+StorageReflectSession::SubscriptionIndex::IndexNode *
+StorageReflectSession :: SubscriptionIndex ::
+GetOrCreateChild(IndexNode & node, const StringMatcherRef & clause)
+{
+   const StringMatcher * sm = clause();
+   if (sm == NULL)
+   {
+      if (node._anyChild == NULL)
+      {
+         node._anyChild = newnothrow IndexNode;
+         if (node._anyChild == NULL) WARN_OUT_OF_MEMORY;
+      }
+      return node._anyChild;
+   }
+
+   const bool isLiteral = sm->IsPatternUnique();
+   Hashtable<String, IndexNode *> & children = isLiteral ? node._literalChildren : node._wildcardChildren;
+   const String key = isLiteral ? RemoveEscapeChars(sm->GetPattern()) : sm->GetPattern();
+
+   IndexNode * child = children.GetWithDefault(key);
+   if (child == NULL)
+   {
+      child = newnothrow IndexNode;
+      if (child == NULL) {WARN_OUT_OF_MEMORY; return NULL;}
+      if (isLiteral == false) child->_matcher = clause;
+      if (children.Put(key, child) != B_NO_ERROR) {delete child; return NULL;}
+   }
+   return child;
+}
+
+status_t
+StorageReflectSession :: SubscriptionIndex ::
+PutPath(StorageReflectSession * session, const StringMatcherQueue & clauses)
+{
+   TCHECKPOINT;
+
+   IndexNode * node = &_root;
+   for (uint32 i=0; i<clauses.GetNumItems(); i++)
+   {
+      node = GetOrCreateChild(*node, clauses[i]);
+      if (node == NULL) return B_ERROR;  // empty IndexNodes left behind here are harmless
+   }
+
+   uint32 * count = node->_sessions.GetOrPut(session, 0);
+   if (count == NULL) return B_ERROR;
+   (*count)++;
+   return B_NO_ERROR;
+}
+
+void
+StorageReflectSession :: SubscriptionIndex ::
+RemovePath(StorageReflectSession * session, const StringMatcherQueue & clauses)
+{
+   TCHECKPOINT;
+
+   (void) RemovePathAux(_root, session, clauses, 0);
+}
+
+// Returns true iff (node) is empty after the removal, and can therefore be deleted by its parent
+bool
+StorageReflectSession :: SubscriptionIndex ::
+RemovePathAux(IndexNode & node, StorageReflectSession * session, const StringMatcherQueue & clauses, uint32 clauseIdx)
+{
+   if (clauseIdx == clauses.GetNumItems())
+   {
+      uint32 * count = node._sessions.Get(session);
+      if ((count)&&(--(*count) == 0)) (void) node._sessions.Remove(session);
+   }
+   else
+   {
+      const StringMatcher * sm = clauses[clauseIdx]();
+      if (sm == NULL)
+      {
+         if ((node._anyChild)&&(RemovePathAux(*node._anyChild, session, clauses, clauseIdx+1)))
+         {
+            delete node._anyChild;
+            node._anyChild = NULL;
+         }
+      }
+      else
+      {
+         const bool isLiteral = sm->IsPatternUnique();
+         Hashtable<String, IndexNode *> & children = isLiteral ? node._literalChildren : node._wildcardChildren;
+         const String key = isLiteral ? RemoveEscapeChars(sm->GetPattern()) : sm->GetPattern();
+
+         IndexNode * child = children.GetWithDefault(key);
+         if ((child)&&(RemovePathAux(*child, session, clauses, clauseIdx+1)))
+         {
+            (void) children.Remove(key);
+            delete child;
+         }
+      }
+   }
+   return node.IsEmpty();
+}
+
+void
+StorageReflectSession :: SubscriptionIndex ::
+FindSessions(const DataNode & node, Hashtable<StorageReflectSession *, Void> & retSessions) const
+{
+   TCHECKPOINT;
+
+   // Gather up the node's path clauses (not including the root node's name), so we can match them from the top down
+   const uint32 numNames = node.GetDepth();
+   const String * smallNames[32];
+   const String ** names = (numNames <= ARRAYITEMS(smallNames)) ? smallNames : newnothrow_array(const String *, numNames);
+   if (names == NULL) {WARN_OUT_OF_MEMORY; return;}
+
+   const DataNode * n = &node;
+   for (int32 i=numNames-1; i>=0; i--,n=n->GetParent()) names[i] = &n->GetNodeName();
+   FindSessionsAux(_root, names, numNames, retSessions);
+
+   if (names != smallNames) delete [] names;
+}
+
+void
+StorageReflectSession :: SubscriptionIndex ::
+FindSessionsAux(const IndexNode & node, const String ** names, uint32 numNames, Hashtable<StorageReflectSession *, Void> & retSessions) const
+{
+   if (numNames == 0)
+   {
+      for (HashtableIterator<StorageReflectSession *, uint32> iter(node._sessions, HTIT_FLAG_NOREGISTER); iter.HasData(); iter++) (void) retSessions.PutWithDefault(iter.GetKey());
+   }
+   else
+   {
+      const String & name = *names[0];
+
+      IndexNode * child;
+      if (node._literalChildren.Get(name, child) == B_NO_ERROR) FindSessionsAux(*child, names+1, numNames-1, retSessions);
+      if (node._anyChild) FindSessionsAux(*node._anyChild, names+1, numNames-1, retSessions);
+      for (HashtableIterator<String, IndexNode *> iter(node._wildcardChildren, HTIT_FLAG_NOREGISTER); iter.HasData(); iter++)
+      {
+         const IndexNode * wc = iter.GetValue();
+         if (wc->_matcher()->Match(name())) FindSessionsAux(*wc, names+1, numNames-1, retSessions);
+      }
+   }
+}
+
 }; // end namespace muscle
 
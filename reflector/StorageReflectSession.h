@@ -16,7 +16,9 @@ namespace muscle {
 class StorageReflectSessionFactory : public ReflectSessionFactory, private CountedObject<StorageReflectSessionFactory>
 {
 public:
-   /** Default constructor.  The maximum incoming message size is set to "unlimited" by default.  */
+   /** Default constructor.  The maximum incoming message size is set to "unlimited" by default,
+     * and lazy unflattening is disabled by default.
+     */
    StorageReflectSessionFactory();
 
    /** Returns a new StorageReflectSession */
@@ -31,6 +33,24 @@ public:
    /** Returns our current setting for the maximum incoming message size for sessions we produce. */
    uint32 GetMaxIncomingMessageSize() const {return _maxIncomingMessageSize;}
 
+   /** Sets whether the StorageReflectSession objects we create should unflatten their incoming
+     * Messages lazily.  See MessageIOGateway::SetLazyUnflattenEnabled() for details.
+     * @param enabled True to enable lazy unflattening, or false to disable it.
+     */
+   void SetLazyUnflattenEnabled(bool enabled) {_lazyUnflattenEnabled = enabled;}
+
+   /** Returns our current setting for lazy unflattening in the sessions we produce. */
+   bool IsLazyUnflattenEnabled() const {return _lazyUnflattenEnabled;}
+
+   /** Sets whether the StorageReflectSession objects we create should start out with latest-value
+     * output enabled.  See StorageReflectSession::SetLatestValueOutputEnabled() for details.
+     * @param enabled True to enable latest-value output, or false to disable it.
+     */
+   void SetLatestValueOutputEnabled(bool enabled) {_latestValueOutputEnabled = enabled;}
+
+   /** Returns our current setting for latest-value output in the sessions we produce. */
+   bool IsLatestValueOutputEnabled() const {return _latestValueOutputEnabled;}
+
 protected:
    /** If we have a limited maximum size for incoming messages, then this method 
      * demand-allocate the session's gateway, and set its max incoming message size if possible.
@@ -39,8 +59,17 @@ protected:
      */
    status_t SetMaxIncomingMessageSizeFor(AbstractReflectSession * session) const;
 
+   /** If lazy unflattening is enabled, then this method demand-allocates the session's gateway,
+     * and enables lazy unflattening on it if possible.
+     * @return B_NO_ERROR on success, or B_ERROR on failure (out of memory or the created gateway
+     *         wasn't a MessageIOGateway)
+     */
+   status_t SetLazyUnflattenEnabledFor(AbstractReflectSession * session) const;
+
 private:
    uint32 _maxIncomingMessageSize;
+   bool _lazyUnflattenEnabled;
+   bool _latestValueOutputEnabled;
 };
 
 /** This class is an interface to an object that can prune the traversals used
@@ -119,6 +148,45 @@ public:
    /** Returns a read-only reference to our parameters message */
    const Message & GetParametersConst() const {return _parameters;}
 
+   /** Overridden so that when a subscription-update Message that is shared by several sessions is
+     * sent to a MessageIOGateway, the Message is flattened only once and the flattened bytes are
+     * shared by all of the compatible gateways it is sent to.
+     * @param msgRef Reference to a Message to send to our client.
+     * @return B_NO_ERROR on success, B_ERROR if out-of-memory.
+     */
+   virtual status_t AddOutgoingMessage(const MessageRef & msgRef);
+
+   /** Enables or disables latest-value output mode.  When enabled, and a PR_RESULT_DATAITEMS Message is
+     * sent to our client while older PR_RESULT_DATAITEMS Messages are still waiting in our gateway's
+     * outgoing queue, any queued-but-unsent values for the same nodes are removed from the queued Messages,
+     * and the new values are merged into the last queued Message where possible.  That way a slow client
+     * watching fast-changing nodes never has more than one pending value per node queued up (per run of
+     * update Messages; other kinds of Message are never reordered or coalesced), and it gets the current
+     * values as soon as its connection catches up.  Clients can also enable this mode by setting the
+     * PR_NAME_LATEST_VALUES_ONLY parameter.  Disabled by default.
+     * @param enabled True to enable latest-value output, or false to send every update.
+     * @note When the server is using worker threads, queued Messages are handed off to a worker thread
+     *       once per event-loop cycle, so only updates generated within the same cycle are coalesced.
+     */
+   void SetLatestValueOutputEnabled(bool enabled) {_latestValueOutputEnabled = enabled;}
+
+   /** Returns true iff latest-value output mode is enabled.  See SetLatestValueOutputEnabled() for details. */
+   bool IsLatestValueOutputEnabled() const {return _latestValueOutputEnabled;}
+
+   /** Overridden to schedule a Pulse() call while we have streamed PR_COMMAND_GETDATA results to generate. */
+   virtual uint64 GetPulseTime(const PulseArgs & args);
+
+   /** Overridden to generate the next batch of results for our streamed PR_COMMAND_GETDATA queries (see
+     * PR_NAME_STREAM_RESULTS).  Each call generates results until our client has enough of them queued up,
+     * or until our suggested maximum time slice (see SetSuggestedMaximumTimeSlice()) has been used up, so
+     * that a huge query won't hold up the server's other sessions.  If no time slice has been suggested,
+     * a time slice of 5 milliseconds is used.
+     */
+   virtual void Pulse(const PulseArgs & args);
+
+   /** Overridden to schedule the generation of more streamed PR_COMMAND_GETDATA results after our client has read some. */
+   virtual int32 DoOutput(uint32 maxBytes);
+
 protected:
    /**
     * Create or Set the value of a data node.
@@ -176,6 +244,19 @@ protected:
     */
    status_t RestoreNodeTreeFromMessage(const Message & msg, const String & path, bool loadData, bool appendToIndex = false, uint32 maxDepth = MUSCLE_NO_LIMIT, const ITraversalPruner * optPruner = NULL, bool quiet = false);
 
+   /**
+     * Creates or updates one or more subtrees of the node database in a single operation.
+     * This method is similar to calling MessageReceivedFromGateway() with a PR_COMMAND_SETDATATREES Message,
+     * except that it tells you whether the operation succeeded.  The whole Message is checked before any
+     * nodes are touched, so a malformed Message (or one that would take us past our node-count limit) leaves
+     * the database unchanged.  Subscribers are sent a single PR_RESULT_DATAITEMS Message each, rather than one
+     * Message for every (n) changed nodes.
+     * @param setMsg a PR_COMMAND_SETDATATREES Message.  Each Message field's name is a node path relative to our
+     *               session node, and each value is a subtree Message as created by SaveNodeTreeToMessage().
+     * @returns B_NO_ERROR on success, or B_ERROR on failure.
+     */
+   virtual status_t SetDataTrees(const Message & setMsg);
+
    /** 
      * Create and insert a new node into one or more ordered child indices in the node tree.
      * This method is similar to calling MessageReceivedFromGateway() with a PR_COMMAND_INSERTORDEREDDATA 
@@ -242,6 +323,66 @@ protected:
        * @returns The number of times (cb) was called by this traversal.
        */
       uint32 DoTraversal(PathMatchCallback cb, StorageReflectSession * This, DataNode & node, bool useFilters, void * userData);
+
+      /** Holds our place in a traversal that is done a little at a time; see BeginTraversal() and ContinueTraversal(). */
+      class TraversalCursor
+      {
+      public:
+         /** Default constructor.  Creates a cursor that isn't in a traversal. */
+         TraversalCursor() : _rootDepth(0) {/* empty */}
+
+         /** Returns true iff the traversal has been begun and hasn't been completed yet. */
+         bool IsActive() const {return _frames.HasItems();}
+
+         /** Abandons the traversal (if any) and releases the nodes we were holding on to. */
+         void Reset() {_frames.Clear();}
+
+      private:
+         friend class NodePathMatcher;
+
+         // One of these for each node on the path from the traversal's root to the current node
+         class Frame
+         {
+         public:
+            Frame() : _nextCandidate(0) {/* empty */}
+
+            DataNodeRef _node;
+            DataNodeRefIterator _iter;       // points to the next of (_node)'s children to look at
+            Queue<DataNodeRef> _candidates;  // used instead of (_iter) when only specifically-named children can match
+            uint32 _nextCandidate;
+         };
+
+         Queue<Frame> _frames;
+         int _rootDepth;
+      };
+
+      /**
+       * Sets up (cursor) to do a depth-first traversal of the node tree under (root), a little at a time.
+       * Call ContinueTraversal() to do the actual traversing.
+       * @param cursor The cursor to set up.  Any traversal it was already doing is abandoned.
+       * @param root The node to begin the traversal at.
+       * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory?)
+       */
+      status_t BeginTraversal(TraversalCursor & cursor, const DataNodeRef & root) const;
+
+      /**
+       * Continues the traversal that (cursor) was set up for by BeginTraversal(), from where the previous
+       * call left off.  Nodes are visited in the same order DoTraversal() would visit them, except that a matching
+       * node is passed to (cb) before its descendants rather than after them.  Since (cursor) holds on to the nodes
+       * it is positioned at, the node tree may be modified between calls:  nodes that are removed from the tree
+       * before the traversal gets to them won't be visited, and nodes that are added may or may not be visited,
+       * but no node will be visited twice.
+       * @param cb The callback function to call whenever a node that matches at least one of our path strings is encountered.
+       * @param This pointer to our owner StorageReflectSession object.
+       * @param cursor The cursor that was set up by BeginTraversal().  When the traversal is complete, it will no longer be active.
+       * @param useFilters If true, we will only call (cb) on nodes whose Messages match our filter; otherwise
+       *                   we'll call (cb) on any node whose path matches, regardless of filtering status.
+       * @param userData Any value you wish; it will be passed along to the callback method.
+       * @param maxCallbacks The maximum number of times to call (cb) before returning.
+       * @param maxVisits The maximum number of nodes to look at before returning, whether they match or not.
+       * @returns The number of times (cb) was called by this call.
+       */
+      uint32 ContinueTraversal(PathMatchCallback cb, StorageReflectSession * This, TraversalCursor & cursor, bool useFilters, void * userData, uint32 maxCallbacks, uint32 maxVisits);
  
       /**
        * Returns the number of path-strings that we contain that match (node).
@@ -276,6 +417,8 @@ protected:
       int DoTraversalAux(TraversalContext & data, DataNode & node);
       bool PathMatches(DataNode & node, ConstMessageRef & optData, const PathMatcherEntry & entry, int rootDepth) const;
       bool CheckChildForTraversal(TraversalContext & data, DataNode * nextChild, int & depth);
+      int CallCallbackWithData(TraversalContext & data, DataNode & node, const ConstMessageRef & constDataRef) const;
+      status_t PushTraversalFrame(TraversalCursor & cursor, const DataNodeRef & nodeRef) const;
    };
 
    friend class DataNode;
@@ -473,6 +616,16 @@ protected:
     */
    void JettisonOutgoingResults(const NodePathMatcher * matcher);
 
+   /**
+    * Called by AddOutgoingMessage() when latest-value output is enabled and (msgRef) is a PR_RESULT_DATAITEMS
+    * Message.  Removes any values in our outgoing queue that are superseded by the items in (msgRef), and
+    * then merges (msgRef)'s items into the last queued PR_RESULT_DATAITEMS Message, if possible.
+    * @param msgRef The PR_RESULT_DATAITEMS Message that is being sent to our client.  It won't be modified.
+    * @returns B_NO_ERROR if (msgRef)'s items were merged into a queued Message (in which case (msgRef)
+    *          should not be queued), or B_ERROR if (msgRef) should be queued as usual.
+    */
+   status_t CoalesceOutgoingResults(const MessageRef & msgRef);
+
    /**
     * This method goes through the outgoing-messages list looking for PR_RESULT_SUBTREE
     * messages.  For each such message that it finds, it will see if the message's PR_NAME_REQUEST_TREE_ID
@@ -498,11 +651,33 @@ protected:
 
 private:
    void NodeChangedAux(DataNode & modifiedNode, const MessageRef & nodeData, bool isBeingRemoved);
+   status_t NodeChangedShared(const MessageRef & nodeData, bool isBeingRemoved);
+   status_t EnsureNextSubscriptionMessageIsPrivate();
    void UpdateDefaultMessageRoute();
    status_t RemoveParameter(const String & paramName, bool & retUpdateDefaultMessageRoute);
    int PassMessageCallbackAux(DataNode & node, const MessageRef & msgRef, bool matchSelfOkay);
    void TallyNodeBytes(const DataNode & n, uint32 & retNumNodes, uint32 & retNodeBytes) const;
 
+   /** Holds the state of a paged or streamed PR_COMMAND_GETDATA query that hasn't returned all of its results yet */
+   class GetDataQuery : public RefCountable
+   {
+   public:
+      GetDataQuery() : _maxResults(MUSCLE_NO_LIMIT), _numResults(0), _stream(false) {/* empty */}
+
+      NodePathMatcher _matcher;
+      NodePathMatcher::TraversalCursor _cursor;
+      uint32 _maxResults;       // maximum number of results per page
+      uint32 _numResults;       // number of results generated so far for the current page
+      bool _stream;             // true iff the current page is being generated by Pulse()
+      MessageRef _results[2];   // the PR_RESULT_DATAITEMS and PR_RESULT_INDEXUPDATED Messages being filled (demand-allocated)
+   };
+   DECLARE_REFTYPES(GetDataQuery);
+
+   void DoPagedGetData(const MessageRef & msgRef);
+   bool RunGetDataQuery(const GetDataQueryRef & queryRef, uint64 endTime);
+   void FinishGetDataPage(const GetDataQueryRef & queryRef);
+   bool IsStreamedOutputBlocked() const;
+
    DECLARE_MUSCLE_TRAVERSAL_CALLBACK(StorageReflectSession, KickClientCallback);     /** Sessions of matching nodes are EndSession()'d  */
    DECLARE_MUSCLE_TRAVERSAL_CALLBACK(StorageReflectSession, InsertOrderedDataCallback); /** Matching nodes have ordered data inserted into them as child nodes */
    DECLARE_MUSCLE_TRAVERSAL_CALLBACK(StorageReflectSession, ReorderDataCallback);    /** Matching nodes area reordered in their parent's index */
@@ -529,6 +704,66 @@ private:
     */
    void NotifySubscribersOfNewNode(DataNode & newNode);
 
+   /** A server-wide index of the subscription paths of every attached StorageReflectSession.
+     * The paths are stored as a tree of path clauses, with literal clauses looked up by hash and
+     * wildcard clauses evaluated once per distinct pattern, so that when a node is created we only
+     * need to visit the sessions that have a subscription path that could match it, rather than
+     * every session on the server.
+     */
+   class SubscriptionIndex
+   {
+   public:
+      /** Default constructor.  Creates an empty index. */
+      SubscriptionIndex() {/* empty */}
+
+      /** Destructor. */
+      ~SubscriptionIndex() {/* empty */}
+
+      /** Adds a subscription path to the index.
+        * @param session The session that the path belongs to.
+        * @param clauses The path's parsed clauses, as held by a PathMatcherEntry.
+        * @returns B_NO_ERROR on success, or B_ERROR if out of memory.
+        */
+      status_t PutPath(StorageReflectSession * session, const StringMatcherQueue & clauses);
+
+      /** Removes a subscription path that was previously added with PutPath().
+        * @param session The session that the path belongs to.
+        * @param clauses The path's parsed clauses; must be equivalent to the ones that were passed to PutPath().
+        */
+      void RemovePath(StorageReflectSession * session, const StringMatcherQueue & clauses);
+
+      /** Adds to (retSessions) every session that has at least one subscription path that matches (node)'s path.
+        * QueryFilters are not taken into account here; that is up to the caller.
+        * @param node The node to find candidate subscribers for.
+        * @param retSessions On return, the matching sessions will have been added to this table.
+        */
+      void FindSessions(const DataNode & node, Hashtable<StorageReflectSession *, Void> & retSessions) const;
+
+   private:
+      class IndexNode
+      {
+      public:
+         IndexNode() : _anyChild(NULL) {/* empty */}
+         ~IndexNode();
+
+         bool IsEmpty() const {return ((_sessions.IsEmpty())&&(_literalChildren.IsEmpty())&&(_wildcardChildren.IsEmpty())&&(_anyChild == NULL));}
+
+         StringMatcherRef _matcher;  // the pattern that leads to us, if we are one of our parent's _wildcardChildren
+
+         Hashtable<String, IndexNode *> _literalChildren;   // children for clauses that can only match one node name
+         Hashtable<String, IndexNode *> _wildcardChildren;  // children for wildcarded clauses, keyed by pattern
+         IndexNode * _anyChild;                             // child for the "*" clause (which matches any node name)
+
+         Hashtable<StorageReflectSession *, uint32> _sessions;  // sessions with paths that end here -> number of such paths
+      };
+
+      IndexNode * GetOrCreateChild(IndexNode & node, const StringMatcherRef & clause);
+      bool RemovePathAux(IndexNode & node, StorageReflectSession * session, const StringMatcherQueue & clauses, uint32 clauseIdx);
+      void FindSessionsAux(const IndexNode & node, const String ** names, uint32 numNames, Hashtable<StorageReflectSession *, Void> & retSessions) const;
+
+      IndexNode _root;
+   };
+
    /** This class holds data that needs to be shared by all attached instances
      * of the StorageReflectSession class.  An instance of this class is stored
      * on demand in the central-state Message.
@@ -536,10 +771,40 @@ private:
    class StorageReflectSessionSharedData
    {
    public:
-      StorageReflectSessionSharedData(const DataNodeRef & root) : _root(root), _subsDirty(false) {/* empty */}
+      StorageReflectSessionSharedData(const DataNodeRef & root) : _root(root), _subsDirty(false), _fanOutNode(NULL), _bulkUpdateInProgress(false) {/* empty */}
+
+      /** Holds the flattened bytes of a subscription-update Message that is shared by several sessions */
+      class SharedUpdate
+      {
+      public:
+         SharedUpdate() {/* empty */}
+
+         AbstractMessageIOGatewayRef _flattenedBy;  // the gateway that created (_flatBuf), or NULL if it hasn't been created yet
+         ByteBufferRef _flatBuf;
+      };
+
+      /** Records that a session whose pending update Message was (key) now has (_result) as its pending update Message */
+      class FanOutTransition
+      {
+      public:
+         FanOutTransition() : _nodeData(NULL), _isBeingRemoved(false) {/* empty */}
+         FanOutTransition(const Message * nodeData, bool isBeingRemoved, const MessageRef & result) : _nodeData(nodeData), _isBeingRemoved(isBeingRemoved), _result(result) {/* empty */}
+
+         const Message * _nodeData;
+         bool _isBeingRemoved;
+         MessageRef _result;
+      };
 
       DataNodeRef _root;
       bool _subsDirty;
+
+      SubscriptionIndex _subscriptionIndex;  // every session's subscription paths, for NotifySubscribersOfNewNode()
+
+      Hashtable<MessageRef, SharedUpdate> _sharedUpdates;  // pending update Messages that may be held by more than one session
+      Hashtable<const Message *, FanOutTransition> _fanOutTransitions;  // valid only while NotifySubscribersThatNodeChanged() is iterating
+      Hashtable<const Message *, uint32> _fanOutHolders;  // valid only while NotifySubscribersThatNodeChanged() is iterating:  pending update Message -> number of subscribers sure to update it identically
+      const DataNode * _fanOutNode;  // the node whose subscribers are currently being notified, or NULL
+      bool _bulkUpdateInProgress;    // true while SetDataTrees() is running; pending update Messages aren't size-limited then
    };
 
    /** Sets up the global root and other shared data */
@@ -573,6 +838,18 @@ private:
    /** Maximum number of subscription update fields per PR_RESULT message */
    uint32 _maxSubscriptionMessageItems;    
 
+   /** If true, queued-but-unsent subscription updates are replaced by newer ones */
+   bool _latestValueOutputEnabled;
+
+   /** Streamed PR_COMMAND_GETDATA queries that are in progress; the one at the head is being generated */
+   Queue<GetDataQueryRef> _streamedQueries;
+
+   /** Paged PR_COMMAND_GETDATA queries that are waiting for our client to ask for their next page, keyed by cursor */
+   Hashtable<String, GetDataQueryRef> _pagedQueries;
+
+   /** Used to generate unique PR_NAME_RESULTS_CURSOR strings */
+   uint32 _nextQueryCursorID;
+
    /** Optimization flag:  set true the first time we index a node */
    bool _indexingPresent;                 
 
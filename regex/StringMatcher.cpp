@@ -1,6 +1,7 @@
 /* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */  
 
 #include <stdio.h>
+#include <ctype.h>
 #include "regex/StringMatcher.h"
 #include "util/String.h"
 #include "util/StringTokenizer.h"
@@ -19,17 +20,17 @@ StringMatcherRef GetStringMatcherFromPool(const String & matchString, bool isSim
    return ret;
 }
 
-StringMatcher::StringMatcher() : _bits(0)
+StringMatcher::StringMatcher() : _bits(0), _globType(GLOB_TYPE_NONE), _globMasks(NULL), _globStartStates(0), _globLoopStates(0), _globAcceptStates(0)
 {
    // empty
 } 
 
-StringMatcher :: StringMatcher(const String & str, bool simple) : _bits(0)
+StringMatcher :: StringMatcher(const String & str, bool simple) : _bits(0), _globType(GLOB_TYPE_NONE), _globMasks(NULL), _globStartStates(0), _globLoopStates(0), _globAcceptStates(0)
 {
    (void) SetPattern(str, simple);
 }
 
-StringMatcher :: StringMatcher(const StringMatcher & rhs) : RefCountable(rhs), _bits(0)
+StringMatcher :: StringMatcher(const StringMatcher & rhs) : RefCountable(rhs), _bits(0), _globType(GLOB_TYPE_NONE), _globMasks(NULL), _globStartStates(0), _globLoopStates(0), _globAcceptStates(0)
 {
    *this = rhs;
 }
@@ -45,6 +46,171 @@ void StringMatcher :: Reset()
    _bits = 0;
    _ranges.Clear();
    _pattern.Clear();
+   ClearGlob();
+}
+
+void StringMatcher :: ClearGlob()
+{
+   _globType = GLOB_TYPE_NONE;
+   _globPrefix.Clear();
+   _globSuffix.Clear();
+   delete [] _globMasks;
+   _globMasks = NULL;
+   _globStartStates = _globLoopStates = _globAcceptStates = 0;
+}
+
+// Token values used by CompileGlob(), in addition to the literal char values 0-255
+enum {
+   GLOB_TOKEN_ANYCHAR = 256,  // ?
+   GLOB_TOKEN_STAR,           // *
+   GLOB_TOKEN_SEPARATOR       // ,
+};
+
+bool StringMatcher :: CompileGlob(const char * str)
+{
+   // First, parse the pattern into tokens, giving up on anything that only the regex library knows how to handle
+   Queue<uint16> tokens;
+   bool escapeMode = false;
+   for (const char * ptr = str; *ptr != '\0'; ptr++)
+   {
+      const uint8 c = (uint8) *ptr;
+      uint16 token = c;
+      if (escapeMode)
+      {
+         // the regex library gives escaped letters and digits (and \<, \>, \` and \') special meanings of its own
+         if ((ispunct(c) == false)||(strchr("<>`'", c) != NULL)) return false;
+         escapeMode = false;
+      }
+      else
+      {
+         switch(c)
+         {
+            case '*':  token = GLOB_TOKEN_STAR;      break;
+            case '?':  token = GLOB_TOKEN_ANYCHAR;   break;
+            case ',':  token = GLOB_TOKEN_SEPARATOR; break;
+            case '\\': escapeMode = true;          continue;
+
+            case '[': case ']': case '(': case ')': case '|': case '^': case '$': case '+': case '{': case '}':
+               return false;  // regex syntax, not glob syntax
+         }
+      }
+      if ((token == GLOB_TOKEN_STAR)&&(tokens.HasItems())&&(tokens.Tail() == GLOB_TOKEN_STAR)) continue;  // "**" is the same as "*"
+      if (tokens.AddTail(token) != B_NO_ERROR) return false;
+   }
+   if ((escapeMode)&&(tokens.AddTail('\\') != B_NO_ERROR)) return false;  // a trailing backslash matches itself, as it does in SetPattern()
+
+   uint32 numAlternatives = 1, numStars = 0, numAnyChars = 0, numStates = 1;
+   for (uint32 i=0; i<tokens.GetNumItems(); i++)
+   {
+      switch(tokens[i])
+      {
+         case GLOB_TOKEN_STAR:      numStars++;                       break;
+         case GLOB_TOKEN_SEPARATOR: numAlternatives++; numStates++;   break;
+         case GLOB_TOKEN_ANYCHAR:   numAnyChars++;     numStates++;   break;
+         default:                                      numStates++;   break;
+      }
+   }
+
+   // Common cases that can be handled with simple string comparisons
+   if ((numAlternatives == 1)&&(numAnyChars == 0)&&(numStars <= 1))
+   {
+      bool sawStar = false;
+      for (uint32 i=0; i<tokens.GetNumItems(); i++)
+      {
+         const uint16 t = tokens[i];
+         if (t == GLOB_TOKEN_STAR) sawStar = true;
+         else if (sawStar) _globSuffix += (char) t;
+                      else _globPrefix += (char) t;
+      }
+
+           if (sawStar == false)     _globType = GLOB_TYPE_LITERAL;
+      else if (_globSuffix.IsEmpty()) _globType = _globPrefix.IsEmpty() ? GLOB_TYPE_ANYTHING : GLOB_TYPE_PREFIX;
+      else                            _globType = _globPrefix.IsEmpty() ? GLOB_TYPE_SUFFIX   : GLOB_TYPE_PREFIXSUFFIX;
+      return true;
+   }
+
+   // General case:  a non-deterministic automaton, simulated one bit per state.  Each alternative gets one
+   // state per non-star token, plus a final state.  Stars are represented as states that loop back to themselves.
+   if (numStates > 64) return false;  // too many states to fit into our bit-masks; let the regex library handle it
+
+   _globMasks = newnothrow_array(uint64, 256);
+   if (_globMasks == NULL) {WARN_OUT_OF_MEMORY; return false;}
+   memset(_globMasks, 0, 256*sizeof(uint64));
+
+   uint32 stateIdx = 0;
+   _globStartStates = ((uint64)1)<<stateIdx;
+   for (uint32 i=0; i<tokens.GetNumItems(); i++)
+   {
+      const uint64 curState  = ((uint64)1)<<stateIdx;
+      const uint64 nextState = curState<<1;
+      const uint16 t = tokens[i];
+      switch(t)
+      {
+         case GLOB_TOKEN_STAR:
+            _globLoopStates |= curState;
+         break;
+
+         case GLOB_TOKEN_SEPARATOR:
+            _globAcceptStates |= curState;
+            _globStartStates  |= nextState;
+            stateIdx++;
+         break;
+
+         case GLOB_TOKEN_ANYCHAR:
+            for (uint32 c=1; c<256; c++) _globMasks[c] |= nextState;
+            stateIdx++;
+         break;
+
+         default:
+            _globMasks[t] |= nextState;
+            stateIdx++;
+         break;
+      }
+   }
+   _globAcceptStates |= ((uint64)1)<<stateIdx;
+   _globType = GLOB_TYPE_AUTOMATON;
+   return true;
+}
+
+bool StringMatcher :: MatchGlob(const char * str) const
+{
+   switch(_globType)
+   {
+      case GLOB_TYPE_ANYTHING: 
+         return true;
+
+      case GLOB_TYPE_LITERAL:  
+         return (strcmp(str, _globPrefix()) == 0);
+
+      case GLOB_TYPE_PREFIX:   
+         return (strncmp(str, _globPrefix(), _globPrefix.Length()) == 0);
+
+      case GLOB_TYPE_SUFFIX:
+      {
+         const uint32 len = (uint32) strlen(str);
+         return ((len >= _globSuffix.Length())&&(memcmp(str+len-_globSuffix.Length(), _globSuffix(), _globSuffix.Length()) == 0));
+      }
+
+      case GLOB_TYPE_PREFIXSUFFIX:
+      {
+         const uint32 len = (uint32) strlen(str);
+         return ((len >= _globPrefix.Length()+_globSuffix.Length())&&(strncmp(str, _globPrefix(), _globPrefix.Length()) == 0)&&(memcmp(str+len-_globSuffix.Length(), _globSuffix(), _globSuffix.Length()) == 0));
+      }
+
+      case GLOB_TYPE_AUTOMATON:
+      {
+         uint64 states = _globStartStates;
+         for (const char * ptr = str; *ptr != '\0'; ptr++)
+         {
+            states = ((states<<1) & _globMasks[(uint8)*ptr]) | (states & _globLoopStates);
+            if (states == 0) return false;  // no way to match, no matter what comes next
+         }
+         return ((states & _globAcceptStates) != 0);
+      }
+
+      default:
+         return false;
+   }
 }
 
 StringMatcher & StringMatcher :: operator = (const StringMatcher & rhs)
@@ -65,6 +231,7 @@ status_t StringMatcher :: SetPattern(const String & s, bool isSimple)
    const char * str = _pattern();
    String regexPattern;
    _ranges.Clear();
+   ClearGlob();
    if (isSimple)
    {
       // Special case:  if the first char is a tilde, ignore it, but set the negate-bit.
@@ -111,29 +278,32 @@ status_t StringMatcher :: SetPattern(const String & s, bool isSimple)
       {
          if ((str[0] == '\\')&&(str[1] == '<')) str++;  // special case escape of initial < for "\<15-23>"
 
-         regexPattern = "^(";
-
-         bool escapeMode = false;
-         for (const char * ptr = str; *ptr != '\0'; ptr++)
+         if (CompileGlob(str) == false)  // native globs don't need the regex library at all
          {
-            char c = *ptr;
+            regexPattern = "^(";
 
-            if (escapeMode) escapeMode = false;
-            else
+            bool escapeMode = false;
+            for (const char * ptr = str; *ptr != '\0'; ptr++)
             {
-               switch(c)
+               char c = *ptr;
+
+               if (escapeMode) escapeMode = false;
+               else
                {
-                  case ',':  c = '|';              break;  // commas are treated as union-bars
-                  case '.':  regexPattern += '\\'; break;  // dots are considered literals, so escape those
-                  case '*':  regexPattern += '.';  break;  // hmmm.
-                  case '?':  c = '.';              break;  // question marks mean any-single-char
-                  case '\\': escapeMode = true;    break;  // don't transform the next character!
+                  switch(c)
+                  {
+                     case ',':  c = '|';              break;  // commas are treated as union-bars
+                     case '.':  regexPattern += '\\'; break;  // dots are considered literals, so escape those
+                     case '*':  regexPattern += '.';  break;  // hmmm.
+                     case '?':  c = '.';              break;  // question marks mean any-single-char
+                     case '\\': escapeMode = true;    break;  // don't transform the next character!
+                  }
                }
+               regexPattern += c;
             }
-            regexPattern += c;
+            if (escapeMode) regexPattern += '\\';  // just in case the user left a trailing backslash
+            regexPattern += ")$";
          }
-         if (escapeMode) regexPattern += '\\';  // just in case the user left a trailing backslash
-         regexPattern += ")$";
       }
    }
    else SetBit(STRINGMATCHER_BIT_NEGATE, false);
@@ -146,13 +316,13 @@ status_t StringMatcher :: SetPattern(const String & s, bool isSimple)
    }
 
    // And compile the new one
-   if (_ranges.IsEmpty())
+   if ((_ranges.IsEmpty())&&(_globType == GLOB_TYPE_NONE))
    {
       bool isValid = (regcomp(&_regExp, regexPattern.HasChars() ? regexPattern() : str, REG_EXTENDED) == 0);
       SetBit(STRINGMATCHER_BIT_REGEXVALID, isValid);
       return isValid ? B_NO_ERROR : B_ERROR;
    }
-   else return B_NO_ERROR;  // for range queries, we don't need a valid regex
+   else return B_NO_ERROR;  // for range queries and native globs, we don't need a valid regex
 }
 
 bool StringMatcher :: Match(const char * const str) const
@@ -161,7 +331,8 @@ bool StringMatcher :: Match(const char * const str) const
 
    bool ret = false;  // pessimistic default
 
-   if (_ranges.IsEmpty())
+   if (_globType != GLOB_TYPE_NONE) ret = MatchGlob(str);
+   else if (_ranges.IsEmpty())
    {
       if (IsBitSet(STRINGMATCHER_BIT_REGEXVALID)) ret = (regexec(&_regExp, str, 0, NULL, 0) != REG_NOMATCH);
    }
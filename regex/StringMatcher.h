@@ -24,7 +24,9 @@
 
 namespace muscle {
 
-/** This class uses the regex library to implement "simple" string matching (similar to filename globbing in bash) as well as full regular expression pattern-matching. */
+/** This class implements "simple" string matching (similar to filename globbing in bash) as well as full regular expression pattern-matching.
+  * Simple patterns that use only literal characters, wildcards (* and ?) and commas are matched natively; other patterns are handed to the regex library.
+  */
 class StringMatcher : public RefCountable
 {
 public:
@@ -118,9 +120,15 @@ public:
    /** Returns a hash code for this StringMatcher */
    inline uint32 HashCode() const {return _pattern.HashCode() + _bits;}
 
+   /** Returns true iff our current pattern will be matched by our own glob-matching code, or false if Match() will call regexec() instead. */
+   bool IsNativeGlob() const {return (_globType != GLOB_TYPE_NONE);}
+
 private:
    void SetBit(uint8 bit, bool set) {if (set) _bits |= bit; else _bits &= ~(bit);}
    bool IsBitSet(uint8 bit) const {return (_bits & bit) != 0;}
+   bool CompileGlob(const char * str);
+   bool MatchGlob(const char * str) const;
+   void ClearGlob();
 
    enum {
       STRINGMATCHER_BIT_REGEXVALID             = (1<<0),
@@ -143,10 +151,30 @@ private:
       uint32 _max; 
    };
 
+   enum {
+      GLOB_TYPE_NONE = 0,     // not a native glob; use _regExp or _ranges instead
+      GLOB_TYPE_ANYTHING,     // e.g. "*"
+      GLOB_TYPE_LITERAL,      // e.g. "foo"
+      GLOB_TYPE_PREFIX,       // e.g. "foo*"
+      GLOB_TYPE_SUFFIX,       // e.g. "*foo"
+      GLOB_TYPE_PREFIXSUFFIX, // e.g. "foo*bar"
+      GLOB_TYPE_AUTOMATON,    // anything else, e.g. "f?o*b*r,baz"
+      NUM_GLOB_TYPES
+   };
+
    uint8 _bits;
+   uint8 _globType;
    String _pattern;
    regex_t _regExp;
    Queue<IDRange> _ranges;
+
+   // Used by the native glob matcher
+   String _globPrefix;    // the literal string, for GLOB_TYPE_LITERAL
+   String _globSuffix;
+   uint64 * _globMasks;   // for GLOB_TYPE_AUTOMATON:  256 state-transition bit-masks, one per char value
+   uint64 _globStartStates;
+   uint64 _globLoopStates;
+   uint64 _globAcceptStates;
 }; 
 DECLARE_REFTYPES(StringMatcher);
 
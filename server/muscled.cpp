@@ -8,7 +8,7 @@
 #include "reflector/DumbReflectSession.h"
 #include "reflector/StorageReflectSession.h"
 #include "reflector/FilterSessionFactory.h"
-#include "reflector/RateLimitSessionIOPolicy.h"
+#include "reflector/HierarchicalRateLimitSessionIOPolicy.h"
 #include "reflector/SignalHandlerSession.h"
 #include "system/GlobalMemoryAllocator.h"
 #include "system/SetupSystem.h"
@@ -19,6 +19,22 @@ using namespace muscle;
 
 #define DEFAULT_MUSCLED_PORT 2960
 
+// Returns a policy that limits the aggregate rate to (maxRate), and shares it fairly amongst the hosts and sessions using it
+static AbstractSessionIOPolicyRef CreateRateLimitPolicy(uint32 maxRate, uint32 maxRatePerHost, uint32 maxRatePerSession, const Hashtable<String, uint32> & hostWeights)
+{
+   HierarchicalRateLimitSessionIOPolicy * policy = newnothrow HierarchicalRateLimitSessionIOPolicy(maxRate);
+   if (policy == NULL) return AbstractSessionIOPolicyRef();  // caller will warn
+
+   AbstractSessionIOPolicyRef ret(policy);
+   policy->SetDefaultGroupParameters(RateLimitParameters(1, maxRatePerHost));
+   policy->SetDefaultSessionParameters(RateLimitParameters(1, maxRatePerSession));
+   for (HashtableIterator<String, uint32> iter(hostWeights); iter.HasData(); iter++)
+   {
+      if (policy->PutGroupParameters(iter.GetKey(), RateLimitParameters(iter.GetValue(), maxRatePerHost)) != B_NO_ERROR) return AbstractSessionIOPolicyRef();
+   }
+   return ret;
+}
+
 // Aux method; main() without the global stuff.  This is a good method to
 // call if you already have the global stuff set up the way you like it.
 // The third argument can be passed in as NULL, or point to a UsageLimitProxyMemoryAllocator object 
@@ -33,15 +49,21 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
    uint32 maxReceiveRate     = MUSCLE_NO_LIMIT;
    uint32 maxSendRate        = MUSCLE_NO_LIMIT;
    uint32 maxCombinedRate    = MUSCLE_NO_LIMIT;
+   uint32 maxRatePerHost     = MUSCLE_NO_LIMIT;
+   uint32 maxRatePerSession  = MUSCLE_NO_LIMIT;
    uint32 maxMessageSize     = MUSCLE_NO_LIMIT;
    uint32 maxSessions        = MUSCLE_NO_LIMIT;
    uint32 maxSessionsPerHost = MUSCLE_NO_LIMIT;
+   uint32 numAcceptThreads   = 0;
+   bool lazyUnflatten        = false;
+   bool latestValuesOnly     = false;
 
    Hashtable<IPAddressAndPort, Void> listenPorts;
    Queue<String> bans;
    Queue<String> requires;
    Message tempPrivs;
    Hashtable<ip_address, String> tempRemaps;
+   Hashtable<String, uint32> hostWeights;
 
    Message args; (void) ParseArgs(argc, argv, args);
    HandleStandardDaemonArgs(args);
@@ -59,7 +81,11 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       Log(MUSCLE_LOG_INFO, "                [privkick=ippattern] [privall=ippattern]\n");
       Log(MUSCLE_LOG_INFO, "                [maxsendrate=kBps] [maxreceiverate=kBps]\n");
       Log(MUSCLE_LOG_INFO, "                [maxcombinedrate=kBps] [maxmessagesize=k]\n");
+      Log(MUSCLE_LOG_INFO, "                [maxrateperhost=kBps] [maxratepersession=kBps]\n");
+      Log(MUSCLE_LOG_INFO, "                [hostweight=ippattern,weight]\n");
       Log(MUSCLE_LOG_INFO, "                [maxsessions=num] [maxsessionsperhost=num]\n");
+      Log(MUSCLE_LOG_INFO, "                [acceptthreads=num]\n");
+      Log(MUSCLE_LOG_INFO, "                [lazyunflatten] [latestvalues]\n");
       Log(MUSCLE_LOG_INFO, "                [localhost=ipaddress] [daemon]\n");
       Log(MUSCLE_LOG_INFO, " - port may be any number between 1 and 65536\n");
       Log(MUSCLE_LOG_INFO, " - listen is like port, except it includes a local interface IP as well.\n");
@@ -79,6 +105,18 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       Log(MUSCLE_LOG_INFO, "   privall assigns all privileges to the matching IP addresses.\n");
       Log(MUSCLE_LOG_INFO, " - remap tells muscled to treat connections from a given IP address\n");
       Log(MUSCLE_LOG_INFO, "   as if they are coming from another (for stupid NAT tricks, etc)\n");
+      Log(MUSCLE_LOG_INFO, " - The rate limits are shared fairly amongst hosts, and amongst the sessions\n");
+      Log(MUSCLE_LOG_INFO, "   from each host.  maxrateperhost and maxratepersession further limit each\n");
+      Log(MUSCLE_LOG_INFO, "   host and session, and hostweight gives matching hosts a bigger share\n");
+      Log(MUSCLE_LOG_INFO, "   (e.g. hostweight=192.168.0.*,4 gives them four times the usual share).\n");
+      Log(MUSCLE_LOG_INFO, " - acceptthreads is the number of threads to accept new connections on for\n");
+      Log(MUSCLE_LOG_INFO, "   each port (default=0, meaning they are accepted in the main thread).\n");
+      Log(MUSCLE_LOG_INFO, "   Useful when many clients (re)connect at once.\n");
+      Log(MUSCLE_LOG_INFO, "   (requires a build with -DMUSCLE_USE_PTHREADS)\n");
+      Log(MUSCLE_LOG_INFO, " - If lazyunflatten is specified, string and raw-data fields of received\n");
+      Log(MUSCLE_LOG_INFO, "   Messages are only unflattened when needed.\n");
+      Log(MUSCLE_LOG_INFO, " - If latestvalues is specified, clients that can't keep up are sent only\n");
+      Log(MUSCLE_LOG_INFO, "   the latest value of each subscribed node, rather than every update.\n");
       Log(MUSCLE_LOG_INFO, " - If daemon is specified, muscled will run as a background process.\n");
       return(5);
    }
@@ -149,6 +187,33 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       maxCombinedRate = muscleMax((uint32)0, (uint32)(k*1024.0f));
    }
 
+   if (args.FindString("maxrateperhost", &value) == B_NO_ERROR)
+   {
+      float k = (float) atof(value);
+      maxRatePerHost = muscleMax((uint32)0, (uint32)(k*1024.0f));
+   }
+
+   if (args.FindString("maxratepersession", &value) == B_NO_ERROR)
+   {
+      float k = (float) atof(value);
+      maxRatePerSession = muscleMax((uint32)0, (uint32)(k*1024.0f));
+   }
+
+   {
+      for (int32 i=0; (args.FindString("hostweight", i, &value) == B_NO_ERROR); i++)
+      {
+         StringTokenizer tok(value, ",=");
+         const char * pattern = tok();
+         const char * weight  = tok();
+         if ((pattern)&&(weight)&&(atoi(weight) > 0))
+         {
+            LogTime(MUSCLE_LOG_INFO, "Clients whose IP addresses match [%s] get a bandwidth weight of %i.\n", pattern, atoi(weight));
+            hostWeights.Put(pattern, atoi(weight));
+         }
+         else LogTime(MUSCLE_LOG_ERROR, "Error parsing hostweight argument (it should look something like hostweight=192.168.0.*,4).\n");
+      }
+   }
+
    if (args.FindString("maxnodespersession", &value) == B_NO_ERROR)
    {
       maxNodesPerSession = atoi(value);
@@ -167,6 +232,24 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       LogTime(MUSCLE_LOG_INFO, "Limiting session count for any given host to " UINT32_FORMAT_SPEC".\n", maxSessionsPerHost);
    }
 
+   if (args.FindString("acceptthreads", &value) == B_NO_ERROR) 
+   {
+      numAcceptThreads = atoi(value);
+      LogTime(MUSCLE_LOG_INFO, "Using " UINT32_FORMAT_SPEC " accept thread%s per port.\n", numAcceptThreads, (numAcceptThreads==1)?"":"s");
+   }
+
+   if (args.HasName("lazyunflatten"))
+   {
+      LogTime(MUSCLE_LOG_INFO, "Unflattening received Messages lazily.\n");
+      lazyUnflatten = true;
+   }
+
+   if (args.HasName("latestvalues"))
+   {
+      LogTime(MUSCLE_LOG_INFO, "Coalescing queued subscription updates for slow clients.\n");
+      latestValuesOnly = true;
+   }
+
    {
       for (int32 i=0; (args.FindString("ban", i, &value) == B_NO_ERROR); i++)
       {
@@ -204,6 +287,7 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
 
    bool okay = true;
    server.GetAddressRemappingTable() = tempRemaps;
+   server.SetNumAcceptThreads(numAcceptThreads);
 
    if (maxNodesPerSession != MUSCLE_NO_LIMIT) server.GetCentralState().AddInt32(PR_NAME_MAX_NODES_PER_SESSION, maxNodesPerSession);
    for (MessageFieldNameIterator iter = tempPrivs.GetFieldNameIterator(); iter.HasData(); iter++) tempPrivs.CopyName(iter.GetFieldName(), server.GetCentralState());
@@ -212,7 +296,7 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
    AbstractSessionIOPolicyRef inputPolicyRef, outputPolicyRef;
    if (maxCombinedRate != MUSCLE_NO_LIMIT)
    {
-      inputPolicyRef.SetRef(newnothrow RateLimitSessionIOPolicy(maxCombinedRate));
+      inputPolicyRef = CreateRateLimitPolicy(maxCombinedRate, maxRatePerHost, maxRatePerSession, hostWeights);
       outputPolicyRef = inputPolicyRef;
       if (inputPolicyRef()) LogTime(MUSCLE_LOG_INFO, "Limiting aggregate I/O bandwidth to %.02f kilobytes/second.\n", ((float)maxCombinedRate/1024.0f));
       else
@@ -225,7 +309,7 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
    {
       if (maxReceiveRate != MUSCLE_NO_LIMIT)
       {
-         inputPolicyRef.SetRef(newnothrow RateLimitSessionIOPolicy(maxReceiveRate));
+         inputPolicyRef = CreateRateLimitPolicy(maxReceiveRate, maxRatePerHost, maxRatePerSession, hostWeights);
          if (inputPolicyRef()) LogTime(MUSCLE_LOG_INFO, "Limiting aggregate receive bandwidth to %.02f kilobytes/second.\n", ((float)maxReceiveRate/1024.0f));
          else
          {
@@ -235,7 +319,7 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       }
       if (maxSendRate != MUSCLE_NO_LIMIT)
       {
-         outputPolicyRef.SetRef(newnothrow RateLimitSessionIOPolicy(maxSendRate));
+         outputPolicyRef = CreateRateLimitPolicy(maxSendRate, maxRatePerHost, maxRatePerSession, hostWeights);
          if (outputPolicyRef()) LogTime(MUSCLE_LOG_INFO, "Limiting aggregate send bandwidth to %.02f kilobytes/second.\n", ((float)maxSendRate/1024.0f)); 
          else
          {
@@ -247,7 +331,7 @@ int muscledmainAux(int argc, char ** argv, void * cookie)
       
    // Set up the Session Factory.  This factory object creates the new StorageReflectSessions
    // as needed when people connect, and also has a filter to keep out the riff-raff.
-   StorageReflectSessionFactory factory; factory.SetMaxIncomingMessageSize(maxMessageSize);
+   StorageReflectSessionFactory factory; factory.SetMaxIncomingMessageSize(maxMessageSize); factory.SetLazyUnflattenEnabled(lazyUnflatten); factory.SetLatestValueOutputEnabled(latestValuesOnly);
    FilterSessionFactory filter(ReflectSessionFactoryRef(&factory, false), maxSessionsPerHost, maxSessions);
    filter.SetInputPolicy(inputPolicyRef);
    filter.SetOutputPolicy(outputPolicyRef);
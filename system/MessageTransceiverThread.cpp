@@ -5,6 +5,10 @@
 #include "iogateway/MessageIOGateway.h"
 #include "reflector/ReflectServer.h"
 
+#ifndef WIN32
+# include "dataio/FileDescriptorDataIO.h"
+#endif
+
 namespace muscle {
 
 static status_t FindIPAddressInMessage(const Message & msg, const String & fieldName, ip_address & ip)
@@ -610,6 +614,19 @@ AbstractMessageIOGatewayRef ThreadSupervisorSession :: CreateGateway()
    return AbstractMessageIOGatewayRef(gw);
 }
 
+DataIORef ThreadSupervisorSession :: CreateDataIO(const ConstSocketRef & socket)
+{
+#ifndef WIN32
+   if (_mtt->IsLockFreeMessagingEnabled())
+   {
+      DataIORef dio(newnothrow FileDescriptorDataIO(socket, false));
+      if (dio() == NULL) WARN_OUT_OF_MEMORY;
+      return dio;
+   }
+#endif
+   return StorageReflectSession::CreateDataIO(socket);
+}
+
 void ThreadSupervisorSession :: MessageReceivedFromGateway(const MessageRef &, void *)
 {
    // The message from the gateway is merely a signal that we should check
@@ -250,6 +250,11 @@ public:
    /** Overridden to create a custom gateway for interacting with the MessageTransceiverThread */
    virtual AbstractMessageIOGatewayRef CreateGateway();         
 
+   /** Overridden to read the MessageTransceiverThread's wakeup socket with a FileDescriptorDataIO when
+     * lock-free messaging is enabled, since in that case the wakeup socket may be an eventfd rather than a socket.
+     */
+   virtual DataIORef CreateDataIO(const ConstSocketRef & socket);
+
    /** Overridden to deal with the MessageTransceiverThread.  If you are subclassing
      * ThreadSupervisorSession, don't override this method; override MessageReceivedFromOwner() instead.
      */
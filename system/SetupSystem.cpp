@@ -5,6 +5,7 @@
 #include "dataio/DataIO.h"
 #include "util/ObjectPool.h"
 #include "util/MiscUtilityFunctions.h"  // for ExitWithoutCleanup()
+#include "util/NetworkUtilityFunctions.h"  // for IPAddressAndPort
 #include "util/DebugTimer.h"
 #include "util/CountedObject.h"
 #include "util/String.h"
@@ -79,6 +80,37 @@ bool _mainReflectServerCatchSignals = false;
 static Mutex * _muscleLock = NULL;
 Mutex * GetGlobalMuscleLock() {return _muscleLock;}
 
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+pthread_key_t _objectPoolMagazinesKey;
+bool _objectPoolMagazinesKeyValid = false;
+static uint32 _nextObjectPoolMagazineSlot = 0;
+
+// Returns all of the magazines in (t) to their pools, then deletes (t).  Must be called with the global muscle lock locked.
+static void DeleteObjectPoolMagazineTableAux(ObjectPoolMagazineTable * t)
+{
+   for (uint32 i=0; i<t->_numSlots; i++)
+   {
+      ObjectPoolMagazine * mag = t->_magazines[i];
+      if (mag)
+      {
+         AbstractObjectManager::MagazineThreadExiting(*mag);
+         delete mag;
+      }
+   }
+   delete [] t->_magazines;
+   delete t;
+}
+
+// Called by pthreads when a thread that has a ObjectPoolMagazineTable exits
+static void DeleteObjectPoolMagazineTable(void * p)
+{
+   Mutex * m = GetGlobalMuscleLock();
+   if ((m)&&(m->Lock() != B_NO_ERROR)) m = NULL;
+   DeleteObjectPoolMagazineTableAux((ObjectPoolMagazineTable *) p);
+   if (m) m->Unlock();
+}
+#endif
+
 #if defined(MUSCLE_USE_MUTEXES_FOR_ATOMIC_OPERATIONS)
 Mutex * _muscleAtomicMutexes = NULL;  // used by DoMutexAtomicIncrement()
 #endif
@@ -451,6 +483,11 @@ ThreadSetupSystem :: ThreadSetupSystem(bool muscleSingleThreadOnly)
 #endif
       _muscleLock = &_lock;
 
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+      // Per-thread ObjectPool magazines are only useful (and only safe) if we're actually using threads
+      if (_muscleSingleThreadOnly == false) _objectPoolMagazinesKeyValid = (pthread_key_create(&_objectPoolMagazinesKey, DeleteObjectPoolMagazineTable) == 0);
+#endif
+
 #if defined(MUSCLE_USE_MUTEXES_FOR_ATOMIC_OPERATIONS)
       _muscleAtomicMutexes = newnothrow_array(Mutex, MUSCLE_MUTEX_POOL_SIZE);
       MASSERT(_muscleAtomicMutexes, "Could not allocate atomic mutexes!");
@@ -462,6 +499,25 @@ ThreadSetupSystem :: ~ThreadSetupSystem()
 {
    if (--_threadSetupCount == 0)
    {
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+      if (_objectPoolMagazinesKeyValid)
+      {
+         // pthreads won't clean up the main thread's magazines for us, so we'll do it here
+         if (_lock.Lock() == B_NO_ERROR)
+         {
+            ObjectPoolMagazineTable * t = (ObjectPoolMagazineTable *) pthread_getspecific(_objectPoolMagazinesKey);
+            if (t)
+            {
+               (void) pthread_setspecific(_objectPoolMagazinesKey, NULL);
+               DeleteObjectPoolMagazineTableAux(t);
+            }
+            _objectPoolMagazinesKeyValid = false;
+            (void) pthread_key_delete(_objectPoolMagazinesKey);
+            _lock.Unlock();
+         }
+      }
+#endif
+
 #if defined(MUSCLE_USE_MUTEXES_FOR_ATOMIC_OPERATIONS)
       delete [] _muscleAtomicMutexes; _muscleAtomicMutexes = NULL;
 #endif
@@ -836,6 +892,101 @@ void AbstractObjectRecycler :: GlobalFlushAllCachedObjects()
    if (m) m->Unlock();
 }
 
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+ObjectPoolMagazine * AbstractObjectManager :: CreateThreadMagazine()
+{
+   Mutex * m = GetGlobalMuscleLock();
+   if ((m == NULL)||(m->Lock() != B_NO_ERROR)) return NULL;
+
+   ObjectPoolMagazine * ret = NULL;
+   if (_objectPoolMagazinesKeyValid)
+   {
+      if (_magazineSlot == MUSCLE_NO_LIMIT) _magazineSlot = _nextObjectPoolMagazineSlot++;
+
+      ObjectPoolMagazineTable * t = (ObjectPoolMagazineTable *) pthread_getspecific(_objectPoolMagazinesKey);
+      if (t == NULL)
+      {
+         t = newnothrow ObjectPoolMagazineTable;
+         if (t)
+         {
+            if (pthread_setspecific(_objectPoolMagazinesKey, t) != 0)
+            {
+               delete t;
+               t = NULL;
+            }
+         }
+         else WARN_OUT_OF_MEMORY;
+      }
+
+      if ((t)&&(_magazineSlot >= t->_numSlots))
+      {
+         uint32 newNumSlots = muscleMax(_nextObjectPoolMagazineSlot, (uint32)16);
+         ObjectPoolMagazine ** newMagazines = newnothrow_array(ObjectPoolMagazine *, newNumSlots);
+         if (newMagazines)
+         {
+            for (uint32 i=0; i<newNumSlots; i++) newMagazines[i] = (i<t->_numSlots) ? t->_magazines[i] : NULL;
+            delete [] t->_magazines;
+            t->_magazines = newMagazines;
+            t->_numSlots  = newNumSlots;
+         }
+         else WARN_OUT_OF_MEMORY;
+      }
+
+      if ((t)&&(_magazineSlot < t->_numSlots))
+      {
+         ret = t->_magazines[_magazineSlot];  // in case a memory-allocation callback created it while we weren't looking
+         if (ret == NULL)
+         {
+            ret = newnothrow ObjectPoolMagazine(this);
+            if (ret)
+            {
+               // Add the new magazine to our list, so that we can empty it out if we are destroyed first
+               ret->_next = _firstMagazine;
+               if (_firstMagazine) _firstMagazine->_prev = ret;
+               _firstMagazine = ret;
+               t->_magazines[_magazineSlot] = ret;
+            }
+            else WARN_OUT_OF_MEMORY;
+         }
+      }
+   }
+
+   m->Unlock();
+   return ret;
+}
+#endif
+
+void AbstractObjectManager :: MagazineThreadExiting(ObjectPoolMagazine & mag)
+{
+   AbstractObjectManager * pool = mag._pool;
+   if (pool)
+   {
+      pool->ReclaimMagazineObjects(mag);
+      if (mag._prev) mag._prev->_next = mag._next;
+      if (mag._next) mag._next->_prev = mag._prev;
+      if (pool->_firstMagazine == &mag) pool->_firstMagazine = mag._next;
+      mag._prev = mag._next = NULL;
+      mag._pool = NULL;
+   }
+}
+
+void AbstractObjectManager :: DetachAllMagazines()
+{
+   Mutex * m = GetGlobalMuscleLock();
+   if ((m)&&(m->Lock() != B_NO_ERROR)) m = NULL;
+
+   while(_firstMagazine)
+   {
+      ObjectPoolMagazine * mag = _firstMagazine;
+      ReclaimMagazineObjects(*mag);
+      _firstMagazine = mag->_next;
+      mag->_prev = mag->_next = NULL;
+      mag->_pool = NULL;  // the magazine itself is still owned by its thread, which will delete it later
+   }
+
+   if (m) m->Unlock();
+}
+
 static CompleteSetupSystem * _activeCSS = NULL;
 CompleteSetupSystem * CompleteSetupSystem :: GetCurrentCompleteSetupSystem() {return _activeCSS;}
 
@@ -879,6 +1030,54 @@ uint32 DataIO :: WriteFully(const void * buffer, uint32 size)
    return (uint32) (b-((const uint8 *)buffer));
 }
 
+int32 DataIO :: WriteGather(const ConstIOVec * blocks, uint32 numBlocks)
+{
+   int32 ret = 0;
+   for (uint32 i=0; i<numBlocks; i++)
+   {
+      const ConstIOVec & b = blocks[i];
+      if (b.GetNumBytes() == 0) continue;
+
+      int32 bytesWritten = Write(b.GetBytes(), b.GetNumBytes());
+      if (bytesWritten < 0) return (ret > 0) ? ret : -1;  // report the error on the next call, if we already wrote some bytes
+
+      ret += bytesWritten;
+      if (((uint32)bytesWritten) < b.GetNumBytes()) break;  // output buffer is full, so stop for now
+   }
+   return ret;
+}
+
+int32 DataIO :: ReadPackets(PacketIOVec * packets, uint32 numPackets)
+{
+   int32 ret = 0;
+   for (uint32 i=0; i<numPackets; i++)
+   {
+      PacketIOVec & p = packets[i];
+      int32 bytesRead = Read(p.GetBytes(), p.GetNumBytes());
+      if (bytesRead < 0) return (ret > 0) ? ret : -1;  // report the error on the next call, if we already read some packets
+      if (bytesRead == 0) break;  // nothing more to read, for now
+
+      p.SetNumBytes(bytesRead);
+      if (p.GetAddress()) *p.GetAddress() = IPAddressAndPort();  // we have no way of knowing where the packet came from
+      ret++;
+   }
+   return ret;
+}
+
+int32 DataIO :: WritePackets(const PacketIOVec * packets, uint32 numPackets)
+{
+   int32 ret = 0;
+   for (uint32 i=0; i<numPackets; i++)
+   {
+      const PacketIOVec & p = packets[i];
+      int32 bytesWritten = Write(p.GetBytes(), p.GetNumBytes());
+      if (bytesWritten < 0) return (ret > 0) ? ret : -1;  // report the error on the next call, if we already wrote some packets
+      if (((uint32)bytesWritten) < p.GetNumBytes()) break;  // output buffer is full, so stop for now
+      ret++;
+   }
+   return ret;
+}
+
 uint32 DataIO :: ReadFully(void * buffer, uint32 size)
 {
    uint8 * b = (uint8 *) buffer;
@@ -978,7 +1177,7 @@ status_t Flattenable :: CopyFromImplementation(const Flattenable & copyFrom)
    return ret;
 }
 
-#if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
+#if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL) || defined(MUSCLE_USE_IOURING)
 extern void NotifySocketMultiplexersThatSocketIsClosed(int fd);
 #endif
 
@@ -990,7 +1189,7 @@ static void CloseSocket(int fd)
 {
    if (fd >= 0)
    {
-#if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
+#if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL) || defined(MUSCLE_USE_IOURING)
       // We have to do this, otherwise a socket fd value can get re-used before the next call
       // to WaitForEvents(), causing the SocketMultiplexers to fail to update their in-kernel state.
       NotifySocketMultiplexersThatSocketIsClosed(fd);
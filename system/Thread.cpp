@@ -13,13 +13,45 @@
 # error "You're not allowed use the Thread class if you have the MUSCLE_SINGLE_THREAD_ONLY compiler constant defined!"
 #endif
 
+#if defined(MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES) && defined(__linux__) && !defined(MUSCLE_AVOID_EVENTFD)
+# define MUSCLE_USE_EVENTFD_FOR_THREAD_WAKEUPS
+# include <sys/eventfd.h>
+# include <unistd.h>
+// Added to the owner's eventfd counter when the internal thread exits, as the equivalent of an EOF on a socket
+static const eventfd_t EVENTFD_INTERNAL_THREAD_EXITED = ((eventfd_t)1)<<62;
+#endif
+
 namespace muscle {
 
+#ifdef MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES
+// Atomically sets (*p) to (newVal) if it is currently equal to (oldVal).  Returns the value (*p) had before the call.
+static inline void * AtomicCompareAndSwapPointer(void * volatile * p, void * oldVal, void * newVal)
+{
+# if defined(__GNUC__)
+   return __sync_val_compare_and_swap(p, oldVal, newVal);
+# else
+   return InterlockedCompareExchangePointer(p, newVal, oldVal);
+# endif
+}
+
+// Atomically sets (*p) to (newVal), and returns the value (*p) had before the call.
+static inline void * AtomicSwapPointer(void * volatile * p, void * newVal)
+{
+# if defined(__GNUC__)
+   return __sync_lock_test_and_set(p, newVal);
+# else
+   return InterlockedExchangePointer(p, newVal);
+# endif
+}
+#endif
+
+ObjectPool<Thread::LockFreeMessageNode> Thread::_lockFreeNodePool;
+
 #ifdef MUSCLE_ENABLE_DEADLOCK_FINDER
 extern void DeadlockFinder_PrintAndClearLogEventsForCurrentThread();
 #endif
 
-Thread :: Thread(bool useMessagingSockets) : _useMessagingSockets(useMessagingSockets), _messageSocketsAllocated(!useMessagingSockets), _threadRunning(false), _suggestedStackSize(0), _threadStackBase(NULL)
+Thread :: Thread(bool useMessagingSockets) : _useMessagingSockets(useMessagingSockets), _messageSocketsAllocated(!useMessagingSockets), _lockFreeMessaging(false), _threadRunning(false), _suggestedStackSize(0), _threadStackBase(NULL)
 {
 #if defined(MUSCLE_USE_QT_THREADS)
    _thread.SetOwner(this);
@@ -29,9 +61,23 @@ Thread :: Thread(bool useMessagingSockets) : _useMessagingSockets(useMessagingSo
 Thread :: ~Thread()
 {
    MASSERT(IsInternalThreadRunning() == false, "You must not delete a Thread object while its internal thread is still running! (i.e. You must call thread.ShutdownInternalThread() or thread.WaitForThreadToExit() before deleting the Thread object)");
+   for (uint32 i=0; i<NUM_MESSAGE_THREADS; i++) MoveLockFreeMessagesToQueue(_threadData[i]);  // so that our nodes go back to the pool
    CloseSockets();
 }
 
+status_t Thread :: SetLockFreeMessagingEnabled(bool enabled)
+{
+#ifdef MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES
+   if ((IsInternalThreadRunning())||((_useMessagingSockets)&&(_messageSocketsAllocated))) return B_ERROR;
+
+   if (enabled == false) for (uint32 i=0; i<NUM_MESSAGE_THREADS; i++) MoveLockFreeMessagesToQueue(_threadData[i]);
+   _lockFreeMessaging = enabled;
+   return B_NO_ERROR;
+#else
+   return enabled ? B_ERROR : B_NO_ERROR;
+#endif
+}
+
 const ConstSocketRef & Thread :: GetInternalThreadWakeupSocket()
 {
    return GetThreadWakeupSocketAux(_threadData[MESSAGE_THREAD_INTERNAL]);
@@ -44,12 +90,61 @@ const ConstSocketRef & Thread :: GetOwnerWakeupSocket()
 
 const ConstSocketRef & Thread :: GetThreadWakeupSocketAux(ThreadSpecificData & tsd)
 {
-   if ((_messageSocketsAllocated == false)&&(CreateConnectedSocketPair(_threadData[MESSAGE_THREAD_INTERNAL]._messageSocket, _threadData[MESSAGE_THREAD_OWNER]._messageSocket) != B_NO_ERROR)) return GetNullSocket();
+   if (_messageSocketsAllocated == false)
+   {
+#ifdef MUSCLE_USE_EVENTFD_FOR_THREAD_WAKEUPS
+      if (_lockFreeMessaging)
+      {
+         // Each thread gets its own eventfd to block on, and the other thread signals it by incrementing its counter
+         for (uint32 i=0; i<NUM_MESSAGE_THREADS; i++)
+         {
+            _threadData[i]._messageSocket = GetConstSocketRefFromPool(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC));
+            if (_threadData[i]._messageSocket() == NULL)
+            {
+               for (uint32 j=0; j<i; j++) _threadData[j]._messageSocket.Reset();
+               return GetNullSocket();
+            }
+         }
+      }
+      else
+#endif
+      if (CreateConnectedSocketPair(_threadData[MESSAGE_THREAD_INTERNAL]._messageSocket, _threadData[MESSAGE_THREAD_OWNER]._messageSocket) != B_NO_ERROR) return GetNullSocket();
+   }
 
    _messageSocketsAllocated = true;
    return tsd._messageSocket;
 }
 
+void Thread :: DrainInternalThreadWakeupSocket()
+{
+   (void) DrainWakeupSocketAux(_threadData[MESSAGE_THREAD_INTERNAL]._messageSocket.GetFileDescriptor());
+}
+
+void Thread :: DrainOwnerWakeupSocket()
+{
+   (void) DrainWakeupSocketAux(_threadData[MESSAGE_THREAD_OWNER]._messageSocket.GetFileDescriptor());
+}
+
+int32 Thread :: DrainWakeupSocketAux(int fd)
+{
+   if (fd < 0) return -1;
+
+#ifdef MUSCLE_USE_EVENTFD_FOR_THREAD_WAKEUPS
+   if (_lockFreeMessaging)
+   {
+      eventfd_t count;
+      if (eventfd_read(fd, &count) != 0) return (errno == EAGAIN) ? 0 : -1;
+      if (count < EVENTFD_INTERNAL_THREAD_EXITED) return sizeof(count);
+
+      (void) eventfd_write(fd, EVENTFD_INTERNAL_THREAD_EXITED);  // keep it readable, just like a socket at EOF stays readable
+      return -1;
+   }
+#endif
+
+   uint8 bytes[256];
+   return ConvertReturnValueToMuscleSemantics(recv_ignore_eintr(fd, (char *)bytes, sizeof(bytes), 0), sizeof(bytes), false);
+}
+
 void Thread :: CloseSockets()
 {
    if (_useMessagingSockets)
@@ -63,7 +158,7 @@ status_t Thread :: StartInternalThread()
 {
    if (IsInternalThreadRunning() == false)
    {
-      bool needsInitialSignal = (_threadData[MESSAGE_THREAD_INTERNAL]._messages.HasItems());
+      bool needsInitialSignal = ((_threadData[MESSAGE_THREAD_INTERNAL]._messages.HasItems())||(_threadData[MESSAGE_THREAD_INTERNAL]._lockFreeHead != NULL));
       status_t ret = StartInternalThreadAux();
       if (ret == B_NO_ERROR)
       {
@@ -139,39 +234,109 @@ status_t Thread :: SendMessageAux(int whichQueue, const MessageRef & replyRef)
 {
    status_t ret = B_ERROR;
    ThreadSpecificData & tsd = _threadData[whichQueue];
-   if (tsd._queueLock.Lock() == B_NO_ERROR)
+   bool sendNotification = false;
+   if (_lockFreeMessaging) ret = PushLockFreeMessage(tsd, replyRef, sendNotification);
+   else if (tsd._queueLock.Lock() == B_NO_ERROR)
    {
       if (tsd._messages.AddTail(replyRef) == B_NO_ERROR) ret = B_NO_ERROR;
-      bool sendNotification = (tsd._messages.GetNumItems() == 1);
+      sendNotification = (tsd._messages.GetNumItems() == 1);
       (void) tsd._queueLock.Unlock();
-      if ((sendNotification)&&(_signalLock.Lock() == B_NO_ERROR))
+   }
+
+   if ((sendNotification)&&(_signalLock.Lock() == B_NO_ERROR))
+   {
+      switch(whichQueue)
       {
-         switch(whichQueue)
-         {
-            case MESSAGE_THREAD_INTERNAL: SignalInternalThread(); break;
-            case MESSAGE_THREAD_OWNER:    SignalOwner();          break;
-         }
-         _signalLock.Unlock();
+         case MESSAGE_THREAD_INTERNAL: SignalInternalThread(); break;
+         case MESSAGE_THREAD_OWNER:    SignalOwner();          break;
       }
+      _signalLock.Unlock();
    }
    return ret;
 }
 
+status_t Thread :: PushLockFreeMessage(ThreadSpecificData & tsd, const MessageRef & ref, bool & retWasEmpty)
+{
+#ifdef MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES
+   LockFreeMessageNode * node = _lockFreeNodePool.ObtainObject();
+   if (node == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   node->_msg = ref;
+
+   // Push the node onto the head of the stack.  Only the receiving thread ever removes nodes, and it
+   // always takes the whole stack at once, so there is no ABA problem to worry about here.
+   void * oldHead = tsd._lockFreeHead;
+   while(true)
+   {
+      node->_next = (LockFreeMessageNode *) oldHead;
+      void * prevHead = AtomicCompareAndSwapPointer(&tsd._lockFreeHead, oldHead, node);
+      if (prevHead == oldHead) break;
+      oldHead = prevHead;
+   }
+   retWasEmpty = (oldHead == NULL);  // only the first Message onto an empty stack needs to wake up the receiver
+   return B_NO_ERROR;
+#else
+   (void) tsd; (void) ref; (void) retWasEmpty;
+   return B_ERROR;
+#endif
+}
+
+void Thread :: MoveLockFreeMessagesToQueue(ThreadSpecificData & tsd)
+{
+#ifdef MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES
+   if (tsd._lockFreeHead == NULL) return;  // cheap check, to avoid the atomic operation when there is nothing to do
+
+   // The stack holds the most recently sent Message first, so reverse it to get the Messages back in the order they were sent
+   LockFreeMessageNode * node = (LockFreeMessageNode *) AtomicSwapPointer(&tsd._lockFreeHead, NULL);
+   LockFreeMessageNode * fifo = NULL;
+   uint32 numNodes = 0;
+   while(node)
+   {
+      LockFreeMessageNode * next = node->_next;
+      node->_next = fifo;
+      fifo = node;
+      node = next;
+      numNodes++;
+   }
+
+   (void) tsd._messages.EnsureSize(tsd._messages.GetNumItems()+numNodes);
+   while(fifo)
+   {
+      LockFreeMessageNode * next = fifo->_next;
+      if (tsd._messages.AddTail() == B_NO_ERROR) tsd._messages.Tail().SwapContents(fifo->_msg);
+                                             else WARN_OUT_OF_MEMORY;
+      _lockFreeNodePool.ReleaseObject(fifo);
+      fifo = next;
+   }
+#else
+   (void) tsd;
+#endif
+}
+
 void Thread :: SignalInternalThread() 
 {
-   SignalAux(MESSAGE_THREAD_OWNER);  // we send a byte on the owner's socket and the byte comes out on the internal socket
+   SignalAux(MESSAGE_THREAD_INTERNAL);
 }
 
 void Thread :: SignalOwner() 
 {
-   SignalAux(MESSAGE_THREAD_INTERNAL);  // we send a byte on the internal socket and the byte comes out on the owner's socket
+   SignalAux(MESSAGE_THREAD_OWNER);
 }
 
-void Thread :: SignalAux(int whichSocket)
+void Thread :: SignalAux(int whichThread)
 {
    if (_messageSocketsAllocated)
    {
-      int fd = _threadData[whichSocket]._messageSocket.GetFileDescriptor();
+#ifdef MUSCLE_USE_EVENTFD_FOR_THREAD_WAKEUPS
+      if (_lockFreeMessaging)
+      {
+         int fd = _threadData[whichThread]._messageSocket.GetFileDescriptor();
+         if (fd >= 0) (void) eventfd_write(fd, 1);
+         return;
+      }
+#endif
+
+      // we send a byte on the other thread's socket and the byte comes out on (whichThread)'s socket
+      int fd = _threadData[(whichThread == MESSAGE_THREAD_INTERNAL) ? MESSAGE_THREAD_OWNER : MESSAGE_THREAD_INTERNAL]._messageSocket.GetFileDescriptor();
       if (fd >= 0) 
       {
          char junk = 'S';
@@ -195,7 +360,12 @@ int32 Thread :: WaitForNextMessageAux(ThreadSpecificData & tsd, MessageRef & ref
    int32 ret = -1;  // pessimistic default
    if (tsd._queueLock.Lock() == B_NO_ERROR)
    {
-      if (tsd._messages.RemoveHead(ref) == B_NO_ERROR) ret = tsd._messages.GetNumItems();
+      if ((_lockFreeMessaging)&&(tsd._messages.IsEmpty())) MoveLockFreeMessagesToQueue(tsd);
+      if (tsd._messages.RemoveHead(ref) == B_NO_ERROR) 
+      {
+         if ((_lockFreeMessaging)&&(tsd._messages.IsEmpty())) MoveLockFreeMessagesToQueue(tsd);  // so that our return value is meaningful
+         ret = tsd._messages.GetNumItems();
+      }
       (void) tsd._queueLock.Unlock();
 
       int msgfd;
@@ -227,11 +397,8 @@ int32 Thread :: WaitForNextMessageAux(ThreadSpecificData & tsd, MessageRef & ref
                if (t.HasItems()) for (HashtableIterator<ConstSocketRef, bool> iter(t, HTIT_FLAG_NOREGISTER); iter.HasData(); iter++) iter.GetValue() = tsd._multiplexer.IsSocketEventOfTypeFlagged(iter.GetKey().GetFileDescriptor(), j);
             }
 
-            if (tsd._multiplexer.IsSocketReadyForRead(msgfd))  // any signals from the other thread?
-            {
-               uint8 bytes[256];
-               if (ConvertReturnValueToMuscleSemantics(recv_ignore_eintr(msgfd, (char *)bytes, sizeof(bytes), 0), sizeof(bytes), false) > 0) ret = WaitForNextMessageAux(tsd, ref, wakeupTime);
-            }
+            // any signals from the other thread?
+            if ((tsd._multiplexer.IsSocketReadyForRead(msgfd))&&(DrainWakeupSocketAux(msgfd) > 0)) ret = WaitForNextMessageAux(tsd, ref, wakeupTime);
          }
       }
    }
@@ -280,7 +447,10 @@ status_t Thread :: WaitForInternalThreadToExit()
 Queue<MessageRef> * Thread :: LockAndReturnMessageQueue()
 {
    ThreadSpecificData & tsd = _threadData[MESSAGE_THREAD_INTERNAL];
-   return (tsd._queueLock.Lock() == B_NO_ERROR) ? &tsd._messages : NULL;
+   if (tsd._queueLock.Lock() != B_NO_ERROR) return NULL;
+
+   if (_lockFreeMessaging) MoveLockFreeMessagesToQueue(tsd);
+   return &tsd._messages;
 }
 
 status_t Thread :: UnlockMessageQueue()
@@ -291,7 +461,10 @@ status_t Thread :: UnlockMessageQueue()
 Queue<MessageRef> * Thread :: LockAndReturnReplyQueue()
 {
    ThreadSpecificData & tsd = _threadData[MESSAGE_THREAD_OWNER];
-   return (tsd._queueLock.Lock() == B_NO_ERROR) ? &tsd._messages : NULL;
+   if (tsd._queueLock.Lock() != B_NO_ERROR) return NULL;
+
+   if (_lockFreeMessaging) MoveLockFreeMessagesToQueue(tsd);
+   return &tsd._messages;
 }
 
 status_t Thread :: UnlockReplyQueue()
@@ -328,8 +501,16 @@ void Thread::InternalThreadEntryAux()
       _curThreadsMutex.Unlock();
    }
 
-   if (_threadData[MESSAGE_THREAD_OWNER]._messages.HasItems()) SignalOwner();
+   if ((_threadData[MESSAGE_THREAD_OWNER]._messages.HasItems())||(_threadData[MESSAGE_THREAD_OWNER]._lockFreeHead != NULL)) SignalOwner();
    InternalThreadEntry();
+#ifdef MUSCLE_USE_EVENTFD_FOR_THREAD_WAKEUPS
+   if ((_lockFreeMessaging)&&(_messageSocketsAllocated))
+   {
+      // closing an eventfd doesn't wake anyone up, so we'll mark the owner's eventfd as being at EOF explicitly
+      int ownerFD = _threadData[MESSAGE_THREAD_OWNER]._messageSocket.GetFileDescriptor();
+      if (ownerFD >= 0) (void) eventfd_write(ownerFD, EVENTFD_INTERNAL_THREAD_EXITED);
+   }
+#endif
    _threadData[MESSAGE_THREAD_INTERNAL]._messageSocket.Reset();  // this will wake up the owner thread with EOF on socket
 
    if (_curThreadsMutex.Lock() == B_NO_ERROR)
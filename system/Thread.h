@@ -35,6 +35,10 @@
 # error "Thread:  threading support not implemented for this platform.  You'll need to add support for your platform to the MUSCLE Lock and Thread classes for your OS before you can use the Thread class here (or define MUSCLE_USE_PTHREADS or QT_THREAD_SUPPORT to use those threading APIs, respectively)."
 #endif
 
+#if !defined(MUSCLE_AVOID_LOCKFREE_MESSAGE_QUEUES) && (defined(__GNUC__) || defined(WIN32))
+# define MUSCLE_ENABLE_LOCKFREE_MESSAGE_QUEUES
+#endif
+
 namespace muscle {
 
 /** This class is an platform-independent class that creates an internally held thread and executes it.
@@ -167,6 +171,27 @@ public:
      */
    const ConstSocketRef & GetOwnerWakeupSocket();
 
+   /** Reads and discards any pending wakeup-notifications from the socket returned by GetOwnerWakeupSocket().
+     * If you select() on GetOwnerWakeupSocket() yourself, call this (rather than recv()) before checking the reply queue,
+     * since with lock-free messaging enabled the wakeup "socket" may not be a socket at all.
+     */
+   void DrainOwnerWakeupSocket();
+
+   /** Enables or disables lock-free messaging for this Thread.  When enabled, SendMessageToInternalThread() and
+     * SendMessageToOwner() add the MessageRef to their queue without locking any Mutex, and the receiving thread
+     * is only signalled when its queue goes from empty to non-empty.  Under Linux, the wakeup sockets are also
+     * replaced by eventfd objects, which are cheaper to signal and to drain than a socket pair.  Since an eventfd
+     * can't be used with send() or recv(), code that watches a wakeup socket directly should drain it via
+     * DrainOwnerWakeupSocket() or DrainInternalThreadWakeupSocket() instead.  Lock-free messaging is disabled by default.
+     * @param enabled true to enable lock-free messaging, or false to use the traditional Mutex-protected queues.
+     * @returns B_NO_ERROR on success, or B_ERROR if the internal thread is running, the wakeup sockets have already
+     *          been allocated, or lock-free messaging isn't supported on this platform.
+     */
+   status_t SetLockFreeMessagingEnabled(bool enabled);
+
+   /** Returns true iff lock-free messaging has been enabled via SetLockFreeMessagingEnabled(). */
+   bool IsLockFreeMessagingEnabled() const {return _lockFreeMessaging;}
+
    /** Enumeration of the socket sets that are available for blocking on; used in GetOwnerSocketSet()
     *  and GetInternalSocketSet() calls.
     */
@@ -298,6 +323,11 @@ protected:
      */
    const ConstSocketRef & GetInternalThreadWakeupSocket();
 
+   /** Reads and discards any pending wakeup-notifications from the socket returned by GetInternalThreadWakeupSocket().
+     * Call this (rather than recv()) if your InternalThreadEntry() implementation select()s on that socket itself.
+     */
+   void DrainInternalThreadWakeupSocket();
+
    /** Locks the lock we use to serialize calls to SignalInternalThread() and
      * SignalOwner().  Be sure to call UnlockSignallingLock() when you are done with the lock.
      * @returns B_NO_ERROR on success, or B_ERROR on failure (couldn't lock)
@@ -354,11 +384,12 @@ private:
    class ThreadSpecificData 
    {
    public:
-      ThreadSpecificData() {/* empty */}
+      ThreadSpecificData() : _lockFreeHead(NULL) {/* empty */}
 
       Mutex _queueLock;
       ConstSocketRef _messageSocket;
       Queue<MessageRef> _messages;
+      void * volatile _lockFreeHead;  // when lock-free messaging is enabled, the most recently sent LockFreeMessageNode (or NULL)
       Hashtable<ConstSocketRef, bool> _socketSets[NUM_SOCKET_SETS];  // (socket -> isFlagged)
       SocketMultiplexer _multiplexer;
    };
@@ -367,9 +398,23 @@ private:
    const ConstSocketRef & GetThreadWakeupSocketAux(ThreadSpecificData & tsd);
    int32 WaitForNextMessageAux(ThreadSpecificData & tsd, MessageRef & ref, uint64 wakeupTime = MUSCLE_TIME_NEVER);
    status_t SendMessageAux(int whichQueue, const MessageRef & ref);
-   void SignalAux(int whichSocket);
+   status_t PushLockFreeMessage(ThreadSpecificData & tsd, const MessageRef & ref, bool & retWasEmpty);
+   void MoveLockFreeMessagesToQueue(ThreadSpecificData & tsd);
+   void SignalAux(int whichThread);
+   int32 DrainWakeupSocketAux(int fd);
    void InternalThreadEntryAux();
 
+   /** A singly-linked node in a ThreadSpecificData's lock-free message stack. */
+   class LockFreeMessageNode : public RefCountable
+   {
+   public:
+      LockFreeMessageNode() : _next(NULL) {/* empty */}
+
+      MessageRef _msg;
+      LockFreeMessageNode * _next;
+   };
+   static ObjectPool<LockFreeMessageNode> _lockFreeNodePool;
+
    enum {
       MESSAGE_THREAD_INTERNAL = 0,  // internal thread's (input queue, socket to block on)
       MESSAGE_THREAD_OWNER,         // main thread's (input queue, socket to block on)
@@ -378,6 +423,7 @@ private:
 
    const bool _useMessagingSockets;
    bool _messageSocketsAllocated;
+   bool _lockFreeMessaging;
 
    ThreadSpecificData _threadData[NUM_MESSAGE_THREADS];
 
@@ -225,4 +225,248 @@ status_t ThreadPool :: StartInternalThread(Thread & thread)
    return thread.StartInternalThread();
 }
 
+WorkStealingThreadPool :: WorkStealingThreadPool(uint32 threadCount) : ThreadPool(threadCount), _threadCount(muscleMax(threadCount, (uint32)1)), _nextHomeThreadIndex(0)
+{
+   // empty
+}
+
+WorkStealingThreadPool :: ~WorkStealingThreadPool()
+{
+   (void) Shutdown();  // must be done here, since ~ThreadPool() won't call our implementation
+}
+
+uint32 WorkStealingThreadPool :: Shutdown()
+{
+   {
+      MutexGuard mg(_clientsLock);  // so that RegisterClient() can't start our threads after this
+      (void) _isShuttingDown.AtomicIncrement();
+   }
+
+   // Each thread will exit the next time it looks for something to do.  (Now that we're shutting down, _threads won't change.
+   // We don't hold _clientsLock while we wait, since a client's MessageReceivedFromThreadPool() might be unregistering a client)
+   for (uint32 i=0; i<_threads.GetNumItems(); i++) _threads[i]()->ShutdownInternalThread(false);
+   for (uint32 i=0; i<_threads.GetNumItems(); i++) (void) _threads[i]()->WaitForInternalThreadToExit();
+
+   // Wake up anyone who is waiting in UnregisterClient() for Messages that will now never be handled
+   {
+      MutexGuard mg(_clientsLock);
+      for (HashtableIterator<IThreadPoolClient *, ClientStateRef> iter(_clients); iter.HasData(); iter++)
+      {
+         ClientState * cs = iter.GetValue()();
+         MutexGuard csg(cs->_lock);
+         cs->_isScheduled = false;
+         cs->_completionSocket.Reset();
+      }
+   }
+
+   // Calls that started before we set _isShuttingDown may still be using our ClientStates or threads, so wait for them to finish
+   while(_numCallsInProgress.GetCount() > 0) Snooze64(MillisToMicros(1));
+
+   MutexGuard mg(_clientsLock);
+   uint32 ret = _threads.GetNumItems()+_clients.GetNumItems();
+   for (HashtableIterator<IThreadPoolClient *, ClientStateRef> iter(_clients); iter.HasData(); iter++)
+   {
+      iter.GetKey()->_threadPool      = NULL;  // so they won't try to unregister from us
+      iter.GetKey()->_threadPoolState = NULL;
+   }
+   _clients.Clear();
+   _threads.Clear();
+   _idleThreads.Clear();
+   return ret;
+}
+
+status_t WorkStealingThreadPool :: StartWorkerThreadsUnsafe()
+{
+   if (_threads.HasItems()) return B_NO_ERROR;
+   if (_threads.EnsureSize(_threadCount) != B_NO_ERROR) return B_ERROR;
+
+   for (uint32 i=0; i<_threadCount; i++)
+   {
+      WorkerThreadRef wtRef(newnothrow WorkerThread(this, i));
+      if ((wtRef() == NULL)||(_threads.AddTail(wtRef) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; break;}
+   }
+
+   if (_threads.GetNumItems() == _threadCount)
+   {
+      uint32 numStarted = 0;
+      for (; numStarted<_threadCount; numStarted++) if (StartInternalThread(*_threads[numStarted]()) != B_NO_ERROR) break;
+      if (numStarted == _threadCount) return B_NO_ERROR;
+
+      LogTime(MUSCLE_LOG_ERROR, "WorkStealingThreadPool:  Error launching thread!\n");
+      for (uint32 i=0; i<numStarted; i++) _threads[i]()->ShutdownInternalThread();
+   }
+   _threads.Clear();
+   return B_ERROR;
+}
+
+void WorkStealingThreadPool :: RegisterClient(IThreadPoolClient * client)
+{
+   MutexGuard mg(_clientsLock);
+   if ((IsShuttingDown())||(StartWorkerThreadsUnsafe() != B_NO_ERROR)) return;
+
+   // New clients are spread across our threads round-robin; after that, a client's home is wherever it last ran
+   ClientStateRef csRef(newnothrow ClientState(client, (_nextHomeThreadIndex++)%_threads.GetNumItems()));
+   if (csRef() == NULL) {WARN_OUT_OF_MEMORY; return;}
+   if (_clients.Put(client, csRef) == B_NO_ERROR) client->_threadPoolState = csRef();
+}
+
+void WorkStealingThreadPool :: UnregisterClient(IThreadPoolClient * client)
+{
+   CallInProgress cip(this);
+
+   // We keep a reference to the client's state, since Shutdown() may remove it from _clients while we wait
+   ClientStateRef csRef;
+   {
+      MutexGuard mg(_clientsLock);
+      csRef = _clients.GetWithDefault(client);
+   }
+   ClientState * cs = csRef();
+   if (cs == NULL) return;
+
+   // If this client has any Messages pending, we need to block until they are gone
+   while(true)
+   {
+      ConstSocketRef waitSock;
+      {
+         MutexGuard mg(cs->_lock);
+         if (cs->_isScheduled == false) break;
+
+         ConstSocketRef signalSock;
+         if (CreateConnectedSocketPair(waitSock, signalSock, true) == B_NO_ERROR) cs->_completionSocket = signalSock;
+      }
+
+      char buf;
+      if (waitSock()) (void) ReadData(waitSock, &buf, sizeof(buf), true);   // block here until ReadData() returns, indicating that we can continue
+                 else Snooze64(MillisToMicros(1));  // couldn't get a socket pair?  Then we'll just have to poll
+   }
+
+   // final cleanup
+   MutexGuard mg(_clientsLock);
+   client->_threadPoolState = NULL;
+   (void) _clients.Remove(client);
+}
+
+status_t WorkStealingThreadPool :: SendMessageToThreadPool(IThreadPoolClient * client, const MessageRef & msg)
+{
+   CallInProgress cip(this);  // must be declared before we check IsShuttingDown(), so that Shutdown() will see it
+   ClientState * cs = (ClientState *) client->_threadPoolState;
+   if ((cs == NULL)||(IsShuttingDown())) return B_ERROR;
+
+   uint32 homeThreadIndex;
+   {
+      MutexGuard mg(cs->_lock);
+      if (cs->_messages.AddTail(msg) != B_NO_ERROR) return B_ERROR;
+      if (cs->_isScheduled) return B_NO_ERROR;  // the Message will be handed over along with the others already queued
+
+      cs->_isScheduled = true;
+      homeThreadIndex = cs->_homeThreadIndex;
+   }
+   ScheduleClient(cs, homeThreadIndex);
+   return B_NO_ERROR;
+}
+
+void WorkStealingThreadPool :: ScheduleClient(ClientState * cs, uint32 threadIndex)
+{
+   WorkerThread * wt = _threads[threadIndex]();
+   {
+      MutexGuard mg(wt->_readyLock);
+      if (wt->_readyClients.AddTail(cs) != B_NO_ERROR) 
+      {
+         // Without a ready-queue entry, this client would never be handled again, so keep trying
+         WARN_OUT_OF_MEMORY;
+         while(wt->_readyClients.AddTail(cs) != B_NO_ERROR) Snooze64(MillisToMicros(1));
+      }
+   }
+   WakeIdleThread(threadIndex);
+}
+
+void WorkStealingThreadPool :: WakeIdleThread(uint32 preferredThreadIndex)
+{
+   uint32 wakeIndex;
+   {
+      MutexGuard mg(_idleLock);
+      if (_idleThreads.IsEmpty()) return;  // everyone is busy, so whoever finishes first will find the work
+
+      // Prefer the given thread (since the client's data is likely still in its cache), otherwise someone else can steal it
+      int32 idx = _idleThreads.IndexOf(preferredThreadIndex);
+      if (idx >= 0) (void) _idleThreads.RemoveItemAt(idx, wakeIndex);
+               else (void) _idleThreads.RemoveTail(wakeIndex);  // the most-recently-idled thread is likely the hottest
+   }
+   (void) _threads[wakeIndex]()->SendMessageToInternalThread(MessageRef(&_dummyMsg, false));
+}
+
+WorkStealingThreadPool::ClientState * WorkStealingThreadPool :: GetNextReadyClient(WorkerThread & wt)
+{
+   ClientState * cs;
+   {
+      MutexGuard mg(wt._readyLock);
+      if (wt._readyClients.RemoveHead(cs) == B_NO_ERROR) return cs;
+   }
+
+   // Nothing for us to do, so try to steal the longest-waiting client from one of the other threads
+   const uint32 numThreads = _threads.GetNumItems();
+   for (uint32 i=1; i<numThreads; i++)
+   {
+      WorkerThread * victim = _threads[(wt._index+i)%numThreads]();
+      MutexGuard mg(victim->_readyLock);
+      if (victim->_readyClients.RemoveHead(cs) == B_NO_ERROR) return cs;
+   }
+   return NULL;
+}
+
+void WorkStealingThreadPool :: WorkerThreadEntry(WorkerThread & wt)
+{
+   while(IsShuttingDown() == false)
+   {
+      ClientState * cs = GetNextReadyClient(wt);
+      if (cs == NULL)
+      {
+         // Register as idle before checking one last time, so that anyone who schedules a client after our check will wake us up
+         {
+            MutexGuard mg(_idleLock);
+            if (_idleThreads.AddTail(wt._index) != B_NO_ERROR) WARN_OUT_OF_MEMORY;
+         }
+
+         cs = GetNextReadyClient(wt);
+         if (cs)
+         {
+            // No need to sleep after all.  (If someone already took us off the idle list, their wakeup will just cost us a loop iteration)
+            MutexGuard mg(_idleLock);
+            (void) _idleThreads.RemoveFirstInstanceOf(wt._index);
+         }
+         else if (wt.WaitForWakeup()) continue;  // go around again and see what there is to do
+         else break;  // Shutdown() wants us to go away
+      }
+      HandleClientMessages(wt, cs);
+   }
+}
+
+void WorkStealingThreadPool :: HandleClientMessages(WorkerThread & wt, ClientState * cs)
+{
+   {
+      MutexGuard mg(cs->_lock);
+      wt._batch.SwapContents(cs->_messages);
+      cs->_homeThreadIndex = wt._index;  // if we stole this client, it's ours now
+   }
+
+   while(wt._batch.HasItems())
+   {
+      MessageReceivedFromThreadPoolAux(cs->_client, wt._batch.Head(), wt._batch.GetNumItems()-1);
+      (void) wt._batch.RemoveHead();
+   }
+
+   {
+      MutexGuard mg(cs->_lock);
+      if (cs->_messages.IsEmpty())
+      {
+         cs->_isScheduled = false;
+         cs->_completionSocket.Reset();  // wake up UnregisterClient(), if it's waiting for us
+         return;  // note that (cs) may be deleted as soon as we unlock it
+      }
+   }
+
+   // More Messages arrived while we were busy, so go to the back of the line behind our other ready clients
+   ScheduleClient(cs, wt._index);
+}
+
 }; // end namespace muscle
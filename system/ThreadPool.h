@@ -22,7 +22,7 @@ public:
      * @param threadPool Pointer to the ThreadPool object this client should register with, or NULL if you wish this client
      *                   to start out unregistered.  (If the latter, be sure to call SetThreadPool() later on).
      */
-   IThreadPoolClient(ThreadPool * threadPool) : _threadPool(NULL) {SetThreadPool(threadPool);}
+   IThreadPoolClient(ThreadPool * threadPool) : _threadPool(NULL), _threadPoolState(NULL) {SetThreadPool(threadPool);}
 
    /** Destructor.  Note that if this object is still registered with a ThreadPool when this destructor is called,
      * an assertion failure will be triggered -- registered IThreadPoolClient objects MUST call SetThreadPool(NULL) 
@@ -72,8 +72,10 @@ protected:
 
 private:
    friend class ThreadPool;
+   friend class WorkStealingThreadPool;
 
    ThreadPool * _threadPool;
+   void * _threadPoolState;  // for the private use of our ThreadPool, if it needs any per-client state
 };
 
 /** This class allows you to multiplex the handling of a large number of parallel Message streams
@@ -107,10 +109,15 @@ protected:
      */
    virtual status_t StartInternalThread(Thread & thread);
 
+   /** Calls MessageReceivedFromThreadPool() on the specified client.  Available to subclasses, since they aren't friends of IThreadPoolClient. */
+   void MessageReceivedFromThreadPoolAux(IThreadPoolClient * client, const MessageRef & msg, uint32 numLeft) {client->MessageReceivedFromThreadPool(msg, numLeft);}
+
+   /** Stops all of our threads and forgets about all of our clients.  Returns the number of objects that were released. */
+   virtual uint32 Shutdown();
+
 private:
    virtual void RecycleObject(void * /*obj*/) {/* empty */}
    virtual uint32 FlushCachedObjects() {return Shutdown();}  // called by SetupSystem destructor, to avoid crashes on exit
-   uint32 Shutdown();
 
    class ThreadPoolThread : public Thread, public RefCountable
    {
@@ -134,13 +141,12 @@ private:
    friend class IThreadPoolClient;
    friend class ThreadPoolThread;
 
-   void RegisterClient(IThreadPoolClient * client);
-   void UnregisterClient(IThreadPoolClient * client);
-   status_t SendMessageToThreadPool(IThreadPoolClient * client, const MessageRef & msg);
+   virtual void RegisterClient(IThreadPoolClient * client);
+   virtual void UnregisterClient(IThreadPoolClient * client);
+   virtual status_t SendMessageToThreadPool(IThreadPoolClient * client, const MessageRef & msg);
    void DispatchPendingMessagesUnsafe();  // _poolLock must be locked when this is called!
    void ThreadFinishedProcessingClientMessages(uint32 threadID, IThreadPoolClient * client);
    bool DoesClientHaveMessagesOutstandingUnsafe(IThreadPoolClient * client) const;
-   void MessageReceivedFromThreadPoolAux(IThreadPoolClient * client, const MessageRef & msg, uint32 numLeft) {client->MessageReceivedFromThreadPool(msg, numLeft);}  // just to skirt protected-member issues 
 
    const uint32 _maxThreadCount;
 
@@ -156,6 +162,111 @@ private:
    Hashtable<IThreadPoolClient *, ConstSocketRef> _waitingForCompletion; // Clients who are blocked in UnregisterClient() waiting for Messages to complete processing
 };
 
+/** This is a ThreadPool that doesn't use a pool-wide Mutex to hand out Messages.  Instead, each
+  * client gets its own Message queue, and is assigned to a "home" thread.  When a client's queue
+  * goes from empty to non-empty, the client is appended to its home thread's ready-queue, and all
+  * of the Messages that arrive for it before that thread gets around to it are handed over as a
+  * single batch.  A thread that runs out of clients to serve steals clients (along with their
+  * pending Messages) from the other threads' ready-queues, and a stolen client's home thread then
+  * becomes the thread that stole it.  Idle threads are only woken up when there is work for them.
+  *
+  * As with ThreadPool, each client's Messages are handled one at a time, in the order they were
+  * sent.  Unlike ThreadPool, all of the threads are started up front (when the first client
+  * registers), rather than on demand.
+  */
+class WorkStealingThreadPool : public ThreadPool
+{
+public:
+   /** Constructor.
+     * @param threadCount The number of Threads this WorkStealingThreadPool will create.  Defaults to 16.
+     */
+   WorkStealingThreadPool(uint32 threadCount = 16);
+
+   /** Destructor.  */
+   virtual ~WorkStealingThreadPool();
+
+protected:
+   virtual uint32 Shutdown();
+
+private:
+   /** Per-client state:  the client's queued Messages, and where it is scheduled to run */
+   class ClientState : public RefCountable
+   {
+   public:
+      ClientState(IThreadPoolClient * client, uint32 homeThreadIndex) : _client(client), _homeThreadIndex(homeThreadIndex), _isScheduled(false) {/* empty */}
+
+      IThreadPoolClient * const _client;
+
+      Mutex _lock;                       // protects all of the members below
+      Queue<MessageRef> _messages;       // Messages not yet handed to a thread
+      uint32 _homeThreadIndex;           // the thread whose ready-queue we go into when we have Messages to handle
+      bool _isScheduled;                 // true iff we are in a ready-queue, or a thread is handling our Messages
+      ConstSocketRef _completionSocket;  // if non-NULL, closing this wakes up a call to UnregisterClient() that's waiting for us
+   };
+   DECLARE_REFTYPES(ClientState);
+
+   class WorkerThread : public Thread, public RefCountable
+   {
+   public:
+      WorkerThread(WorkStealingThreadPool * pool, uint32 index) : _pool(pool), _index(index) {(void) SetLockFreeMessagingEnabled(true);}
+
+      /** Blocks until someone wakes us up.  Returns false iff it's time for us to exit. */
+      bool WaitForWakeup() {MessageRef msg; return ((WaitForNextMessageFromOwner(msg) < 0)||(msg() != NULL));}
+
+      WorkStealingThreadPool * const _pool;
+      const uint32 _index;
+
+      Mutex _readyLock;                    // protects _readyClients
+      Queue<ClientState *> _readyClients;  // clients with Messages waiting to be handled, in the order they became ready
+      Queue<MessageRef> _batch;            // internal thread only:  the Messages we are currently handing to a client
+
+   protected:
+      virtual void InternalThreadEntry() {_pool->WorkerThreadEntry(*this);}
+   };
+   DECLARE_REFTYPES(WorkerThread);
+   friend class WorkerThread;
+
+   virtual void RegisterClient(IThreadPoolClient * client);
+   virtual void UnregisterClient(IThreadPoolClient * client);
+   virtual status_t SendMessageToThreadPool(IThreadPoolClient * client, const MessageRef & msg);
+
+   status_t StartWorkerThreadsUnsafe();  // _clientsLock must be locked when this is called!
+   void ScheduleClient(ClientState * cs, uint32 threadIndex);
+   void WakeIdleThread(uint32 preferredThreadIndex);
+   void WorkerThreadEntry(WorkerThread & wt);
+   ClientState * GetNextReadyClient(WorkerThread & wt);
+   void HandleClientMessages(WorkerThread & wt, ClientState * cs);
+
+   /** Counts a SendMessageToThreadPool() or UnregisterClient() call as in progress for as long as it exists,
+     * so that Shutdown() won't free the ClientStates and threads that the call may be using until it is done.
+     */
+   class CallInProgress
+   {
+   public:
+      CallInProgress(WorkStealingThreadPool * pool) : _pool(pool) {(void) _pool->_numCallsInProgress.AtomicIncrement();}
+      ~CallInProgress() {(void) _pool->_numCallsInProgress.AtomicDecrement();}
+
+   private:
+      WorkStealingThreadPool * _pool;
+   };
+   friend class CallInProgress;
+
+   bool IsShuttingDown() const {return (_isShuttingDown.GetCount() != 0);}
+
+   const uint32 _threadCount;
+   AtomicCounter _isShuttingDown;      // non-zero once Shutdown() has been called
+   AtomicCounter _numCallsInProgress;  // number of CallInProgress objects currently in existence
+
+   Queue<WorkerThreadRef> _threads;  // populated once, by StartWorkerThreadsUnsafe(), and not changed again until Shutdown()
+
+   Mutex _idleLock;
+   Queue<uint32> _idleThreads;       // indices of threads that are blocked waiting for something to do
+
+   Mutex _clientsLock;
+   Hashtable<IThreadPoolClient *, ClientStateRef> _clients;
+   uint32 _nextHomeThreadIndex;
+};
+
 }; // end namespace muscle
 
 #endif
@@ -0,0 +1,83 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#ifndef MuscleServerTestSupport_h
+#define MuscleServerTestSupport_h
+
+#include "dataio/NullDataIO.h"
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/DumbReflectSession.h"
+#include "reflector/ReflectServer.h"
+#include "system/Thread.h"
+
+namespace muscle {
+
+// Helper classes and functions shared by the test programs that run a ReflectServer.
+
+/** This session ends its server's event loop when the other end of its socket is closed.
+  * A test that runs its server in a ServerThread can add one of these (connected to one end
+  * of a socket pair) to the server, and then close the other end to stop the server.
+  */
+class ServerStopperSession : public DumbReflectSession
+{
+public:
+   /** Default constructor */
+   ServerStopperSession() {/* empty */}
+
+   virtual bool ClientConnectionClosed()
+   {
+      EndServer();
+      return DumbReflectSession::ClientConnectionClosed();
+   }
+};
+
+/** A Thread that runs a ReflectServer's event loop, and then cleans up the server when the loop returns. */
+class ServerThread : public Thread
+{
+public:
+   /** Default constructor */
+   ServerThread() {/* empty */}
+
+   /** Returns the server that our internal thread runs.  Set it up before calling StartInternalThread(). */
+   ReflectServer & GetServer() {return _server;}
+
+protected:
+   virtual void InternalThreadEntry()
+   {
+      if (_server.ServerProcessLoop() != B_NO_ERROR) LogTime(MUSCLE_LOG_CRITICALERROR, "ServerProcessLoop() returned an error!\n");
+      _server.Cleanup();
+   }
+
+private:
+   ReflectServer _server;
+};
+
+/** Adds the given session to (server), with a gateway whose DataIO discards everything written to it,
+  * so that the session can be driven directly via SendToSession() without any sockets.
+  * @param server The server to add the session to.
+  * @param sessionRef The session to add.
+  * @param optGateway The gateway to give the session (we take ownership of it), or NULL to give it a new MessageIOGateway.
+  * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory?)
+  */
+static inline status_t AddOfflineSession(ReflectServer & server, const AbstractReflectSessionRef & sessionRef, AbstractMessageIOGateway * optGateway = NULL)
+{
+   AbstractMessageIOGatewayRef gatewayRef(optGateway ? optGateway : newnothrow MessageIOGateway);
+   if ((sessionRef() == NULL)||(gatewayRef() == NULL)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   gatewayRef()->SetDataIO(DataIORef(newnothrow NullDataIO));
+   sessionRef()->SetGateway(gatewayRef);
+   return server.AddNewSession(sessionRef);
+}
+
+/** Hands (msg) to (session) as if its client had sent it.
+  * @returns B_NO_ERROR on success, or B_ERROR if (msg) is a NULL reference (e.g. because GetMessageFromPool() failed)
+  */
+static inline status_t SendToSession(AbstractReflectSession * session, const MessageRef & msg)
+{
+   if (msg() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   session->CallMessageReceivedFromGateway(msg);
+   return B_NO_ERROR;
+}
+
+}; // end namespace muscle
+
+#endif
@@ -0,0 +1,223 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks and benchmarks DataNode's ordered-child index.  First it performs a long random sequence of
+// PR_COMMAND_INSERTORDEREDDATA, PR_COMMAND_REORDERDATA and PR_COMMAND_REMOVEDATA operations on an indexed node,
+// checking the node's index (and the PR_RESULT_INDEXUPDATED notifications a subscriber receives) against a simple
+// model after every step.  Then it measures the cost of each kind of operation on indices of various sizes.
+
+// Exposes StorageReflectSession's node lookup, so we can look at the node's index directly
+class TestSession : public StorageReflectSession
+{
+public:
+   TestSession() {/* empty */}
+
+   const DataNode * GetNode(const String & path) const {return GetDataNode(path);}
+};
+
+static AbstractReflectSessionRef AddSession(ReflectServer & server)
+{
+   AbstractReflectSessionRef sessionRef(newnothrow TestSession);
+   return (AddOfflineSession(server, sessionRef) == B_NO_ERROR) ? sessionRef : AbstractReflectSessionRef();
+}
+
+// Inserts (count) new entries into the index, before the entry named (optBefore), or at the end if it's NULL
+static status_t InsertEntries(AbstractReflectSession * session, const MessageRef & payload, const String * optBefore, uint32 count)
+{
+   MessageRef msg = GetMessageFromPool(PR_COMMAND_INSERTORDEREDDATA);
+   if ((msg() == NULL)||(msg()->AddString(PR_NAME_KEYS, "list") != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   for (uint32 i=0; i<count; i++) if (msg()->AddMessage(optBefore ? *optBefore : String("end"), payload) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   return SendToSession(session, msg);
+}
+
+// Moves the entry named (name) to just before the entry named (optBefore), or to the end if it's NULL
+static status_t MoveEntry(AbstractReflectSession * session, const String & name, const String * optBefore)
+{
+   MessageRef msg = GetMessageFromPool(PR_COMMAND_REORDERDATA);
+   return ((msg())&&(msg()->AddString(String("list/")+name, optBefore ? *optBefore : String("end")) == B_NO_ERROR)) ? SendToSession(session, msg) : B_ERROR;
+}
+
+static status_t RemoveEntry(AbstractReflectSession * session, const String & name)
+{
+   MessageRef msg = GetMessageFromPool(PR_COMMAND_REMOVEDATA);
+   return ((msg())&&(msg()->AddString(PR_NAME_KEYS, String("list/")+name) == B_NO_ERROR)) ? SendToSession(session, msg) : B_ERROR;
+}
+
+static const DataNode * GetListNode(AbstractReflectSession * session)
+{
+   return static_cast<TestSession *>(session)->GetNode("list");
+}
+
+// Applies the PR_RESULT_INDEXUPDATED Messages in (session)'s outgoing queue to (model), and then clears the queue
+static status_t ApplyIndexUpdates(AbstractReflectSession * session, Queue<String> & model)
+{
+   Queue<MessageRef> & oq = session->GetGateway()()->GetOutgoingMessageQueue();
+   MessageRef msg;
+   while(oq.RemoveHead(msg) == B_NO_ERROR)
+   {
+      if (msg()->what != PR_RESULT_INDEXUPDATED) continue;
+      for (MessageFieldNameIterator iter = msg()->GetFieldNameIterator(B_STRING_TYPE); iter.HasData(); iter++)
+      {
+         const String * s;
+         for (uint32 i=0; msg()->FindString(iter.GetFieldName(), i, &s) == B_NO_ERROR; i++)
+         {
+            const char * colon = strchr(s->Cstr(), ':');
+            const uint32 idx   = atol(s->Cstr()+1);
+            switch(s->Cstr()[0])
+            {
+               case INDEX_OP_CLEARED:       model.Clear(); break;
+               case INDEX_OP_ENTRYINSERTED: if ((colon == NULL)||(model.InsertItemAt(idx, colon+1) != B_NO_ERROR)) return B_ERROR; break;
+               case INDEX_OP_ENTRYREMOVED:  if ((colon == NULL)||(idx >= model.GetNumItems())||(model[idx] != colon+1)) return B_ERROR; (void) model.RemoveItemAt(idx); break;
+               default:                     return B_ERROR;
+            }
+         }
+      }
+   }
+   return B_NO_ERROR;
+}
+
+static bool IndexMatchesModel(const DataNode * node, const Queue<String> & model)
+{
+   const uint32 numItems = ((node)&&(node->GetIndex())) ? node->GetIndex()->GetNumItems() : 0;
+   if (numItems != model.GetNumItems()) return false;
+   for (uint32 i=0; i<numItems; i++) if ((*node->GetIndex())[i]()->GetNodeName() != model[i]) return false;
+   return true;
+}
+
+static int CheckIndex(ReflectServer & server)
+{
+   AbstractReflectSessionRef owner      = AddSession(server);
+   AbstractReflectSessionRef subscriber = AddSession(server);
+   if ((owner() == NULL)||(subscriber() == NULL)) return 10;
+
+   MessageRef payload = GetMessageFromPool(1234);
+   MessageRef setMsg  = GetMessageFromPool(PR_COMMAND_SETDATA);
+   MessageRef subMsg  = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+   if ((payload() == NULL)||(setMsg() == NULL)||(subMsg() == NULL)||(setMsg()->AddMessage("list", payload) != B_NO_ERROR)||(subMsg()->AddBool("SUBSCRIBE:/*/*/list", true) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return 10;}
+   if ((SendToSession(owner(), setMsg) != B_NO_ERROR)||(SendToSession(subscriber(), subMsg) != B_NO_ERROR)) return 10;
+
+   Queue<String> model, subscriberModel;
+   uint32 nextID = 0;  // the server names its indexed children "I0", "I1", etc, in order of creation
+   srand(12345);
+   for (uint32 i=0; i<20000; i++)
+   {
+      const uint32 op = rand()%10;
+      const String * randomEntry = model.HasItems() ? &model[rand()%model.GetNumItems()] : NULL;
+      const String * before      = ((randomEntry)&&(rand()%4)) ? &model[rand()%model.GetNumItems()] : NULL;
+      if ((op < 5)||(randomEntry == NULL))
+      {
+         const int32 beforeIdx = before ? model.IndexOf(*before) : -1;
+         if ((InsertEntries(owner(), payload, before, 1) != B_NO_ERROR)||(model.InsertItemAt((beforeIdx >= 0) ? (uint32)beforeIdx : model.GetNumItems(), String("I%1").Arg(nextID++)) != B_NO_ERROR)) return 10;
+      }
+      else if (op < 8)
+      {
+         const String name = *randomEntry;
+         if (MoveEntry(owner(), name, before) != B_NO_ERROR) return 10;
+         if ((before == NULL)||(*before != name))
+         {
+            const String beforeName = before ? *before : String();
+            (void) model.RemoveFirstInstanceOf(name);
+            const int32 beforeIdx = before ? model.IndexOf(beforeName) : -1;
+            if (model.InsertItemAt((beforeIdx >= 0) ? (uint32)beforeIdx : model.GetNumItems(), name) != B_NO_ERROR) return 10;
+         }
+      }
+      else
+      {
+         const String name = *randomEntry;
+         if (RemoveEntry(owner(), name) != B_NO_ERROR) return 10;
+         (void) model.RemoveFirstInstanceOf(name);
+      }
+
+      if (IndexMatchesModel(GetListNode(owner()), model) == false) {printf("ERROR:  Index doesn't match the model after operation #" UINT32_FORMAT_SPEC "!\n", i); return 10;}
+      if ((ApplyIndexUpdates(subscriber(), subscriberModel) != B_NO_ERROR)||(subscriberModel != model)) {printf("ERROR:  Subscriber's index doesn't match the model after operation #" UINT32_FORMAT_SPEC "!\n", i); return 10;}
+   }
+
+   printf("Index checks passed (" UINT32_FORMAT_SPEC " entries at the end).\n", model.GetNumItems());
+   server.Cleanup();
+   return 0;
+}
+
+static int BenchmarkIndex(uint32 indexSize, uint32 numOps)
+{
+   ReflectServer server;
+   AbstractReflectSessionRef owner = AddSession(server);
+   MessageRef payload = GetMessageFromPool(1234);
+   MessageRef setMsg  = GetMessageFromPool(PR_COMMAND_SETDATA);
+   if ((owner() == NULL)||(payload() == NULL)||(setMsg() == NULL)||(setMsg()->AddMessage("list", payload) != B_NO_ERROR)||(SendToSession(owner(), setMsg) != B_NO_ERROR)) {server.Cleanup(); return 10;}
+
+   // Build the index, one batch of appended entries at a time
+   Queue<String> names;  // every entry's name, in no particular order
+   if (names.EnsureSize(indexSize+numOps) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 10;}
+   const uint64 buildStart = GetRunTime64();
+   for (uint32 i=0; i<indexSize; i+=1000) if (InsertEntries(owner(), payload, NULL, muscleMin(indexSize-i, (uint32)1000)) != B_NO_ERROR) {server.Cleanup(); return 10;}
+   const uint64 buildTime = GetRunTime64()-buildStart;
+   for (uint32 i=0; i<indexSize; i++) (void) names.AddTail(String("I%1").Arg(i));
+   uint32 nextID = indexSize;
+
+   // Then time random inserts, moves and removes in the middle of it
+   const uint64 insertStart = GetRunTime64();
+   for (uint32 i=0; i<numOps; i++)
+   {
+      if (InsertEntries(owner(), payload, &names[rand()%names.GetNumItems()], 1) != B_NO_ERROR) {server.Cleanup(); return 10;}
+      (void) names.AddTail(String("I%1").Arg(nextID++));
+   }
+   const uint64 moveStart = GetRunTime64();
+   for (uint32 i=0; i<numOps; i++) if (MoveEntry(owner(), names[rand()%names.GetNumItems()], &names[rand()%names.GetNumItems()]) != B_NO_ERROR) {server.Cleanup(); return 10;}
+   const uint64 removeStart = GetRunTime64();
+   for (uint32 i=0; i<numOps; i++)
+   {
+      const uint32 idx = rand()%names.GetNumItems();
+      if (RemoveEntry(owner(), names[idx]) != B_NO_ERROR) {server.Cleanup(); return 10;}
+      names[idx] = names.Tail();
+      (void) names.RemoveTail();
+   }
+   const uint64 endTime = GetRunTime64();
+
+   const DataNode * list = GetListNode(owner());
+   const uint32 finalSize = ((list)&&(list->GetIndex())) ? list->GetIndex()->GetNumItems() : 0;
+   printf("%10u  %14.2f  %14.2f  %14.2f  %14.2f\n", (unsigned) indexSize, ((double)buildTime)/indexSize, ((double)(moveStart-insertStart))/numOps, ((double)(removeStart-moveStart))/numOps, ((double)(endTime-removeStart))/numOps);
+   server.Cleanup();
+   if (finalSize != indexSize) {printf("ERROR:  index ended up with " UINT32_FORMAT_SPEC " entries, expected " UINT32_FORMAT_SPEC "\n", finalSize, indexSize); return 10;}
+   return 0;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   {
+      ReflectServer server;
+      const int ret = CheckIndex(server);
+      if (ret != 0) {server.Cleanup(); return ret;}
+   }
+
+   uint32 numOps = 2000;
+   const char * s;
+   if (args.FindString("ops", &s) == B_NO_ERROR) numOps = muscleMax((uint32)1, (uint32)atol(s));
+
+   Queue<uint32> sizes;
+   if (args.FindString("size", &s) == B_NO_ERROR) (void) sizes.AddTail((uint32)atol(s));
+   else
+   {
+      const uint32 defaultSizes[] = {10000, 100000, 1000000};
+      for (uint32 i=0; i<ARRAYITEMS(defaultSizes); i++) (void) sizes.AddTail(defaultSizes[i]);
+   }
+
+   printf("\nMeasuring the cost of operations on an index, " UINT32_FORMAT_SPEC " operations each.\n", numOps);
+   printf("%10s  %14s  %14s  %14s  %14s\n", "Entries", "Append (us)", "Insert (us)", "Reorder (us)", "Remove (us)");
+   for (uint32 i=0; i<sizes.GetNumItems(); i++) if (BenchmarkIndex(sizes[i], numOps) != 0) return 10;
+   return 0;
+}
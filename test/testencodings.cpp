@@ -0,0 +1,272 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include <math.h>
+#include "dataio/ByteBufferDataIO.h"
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/StorageReflectConstants.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program compares the speed and compression ratio of each of MessageIOGateway's encodings.  It generates
+// three realistic streams of Messages (subscription updates from a StorageReflectSession, chat text, and binary
+// sensor readings), sends each stream through a gateway using each encoding into a memory buffer, reads it back
+// with a second gateway, checks that every Message came back intact, and prints the results.
+
+enum {
+   CHAT_TEXT_WHAT = 1000,
+   SENSOR_DATA_WHAT
+};
+
+// A simple deterministic pseudo-random number generator, so that every run compresses the same data
+class TestRandom
+{
+public:
+   TestRandom(uint32 seed) : _state(seed) {/* empty */}
+   uint32 Next() {_state = (_state*1103515245)+12345; return (_state>>16);}
+   uint32 Next(uint32 range) {return Next()%range;}
+
+private:
+   uint32 _state;
+};
+
+// Subscription updates, as a StorageReflectSession would send them to a client that is watching a set of devices
+static status_t GenerateSubscriptionUpdates(Queue<MessageRef> & retMsgs)
+{
+   static const char * statuses[] = {"ok", "ok", "ok", "warning", "offline"};
+   TestRandom rand(1);
+   for (uint32 i=0; i<4000; i++)
+   {
+      MessageRef msg = GetMessageFromPool(PR_RESULT_DATAITEMS);
+      if (msg() == NULL) return B_ERROR;
+
+      const uint32 numItems = 1+rand.Next(4);
+      for (uint32 j=0; j<numItems; j++)
+      {
+         const uint32 deviceID = rand.Next(64);
+         MessageRef item = GetMessageFromPool();
+         if ((item() == NULL)
+           ||(item()->AddString("name",         String("device_%1").Arg(deviceID))                  != B_NO_ERROR)
+           ||(item()->AddFloat( "temperature",  20.0f+(rand.Next(1000)/100.0f))                     != B_NO_ERROR)
+           ||(item()->AddFloat( "humidity",     40.0f+(rand.Next(2000)/100.0f))                     != B_NO_ERROR)
+           ||(item()->AddInt64( "timestamp",    ((int64)1400000000000000LL)+(i*250000)+rand.Next(1000)) != B_NO_ERROR)
+           ||(item()->AddInt32( "sequence",     i)                                                  != B_NO_ERROR)
+           ||(item()->AddString("status",       statuses[rand.Next(ARRAYITEMS(statuses))])          != B_NO_ERROR)
+           ||(msg()->AddMessage(String("192.168.1.%1:%2/devices/building_%3/device_%4").Arg(10+(deviceID%8)).Arg(2960+(deviceID%3)).Arg(deviceID/16).Arg(deviceID), item) != B_NO_ERROR)) return B_ERROR;
+      }
+      if (retMsgs.AddTail(msg) != B_NO_ERROR) return B_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
+// Chat text, as the chat clients in this directory send it
+static status_t GenerateChatText(Queue<MessageRef> & retMsgs)
+{
+   static const char * users[] = {"alice", "bob", "carol", "dave", "eve", "mallory", "trent", "peggy"};
+   static const char * words[] = {"the", "a", "server", "is", "was", "down", "up", "again", "why", "I", "you", "we", "think", "restart", "it", "please",
+                                  "check", "logs", "build", "broken", "fixed", "now", "thanks", "lunch", "meeting", "at", "noon", "ok", "sure", "later",
+                                  "latency", "looks", "fine", "to", "me", "packet", "loss", "on", "wifi", "again?", "lol", "deploying", "rollback", "done"};
+   TestRandom rand(2);
+   for (uint32 i=0; i<8000; i++)
+   {
+      String text;
+      const uint32 numWords = 3+rand.Next(15);
+      for (uint32 j=0; j<numWords; j++)
+      {
+         if (j > 0) text += ' ';
+         text += words[rand.Next(ARRAYITEMS(words))];
+      }
+
+      MessageRef msg = GetMessageFromPool(CHAT_TEXT_WHAT);
+      if ((msg() == NULL)
+        ||(msg()->AddString(PR_NAME_KEYS, String("/*/%1/beshare").Arg(rand.Next(200))) != B_NO_ERROR)
+        ||(msg()->AddString("session", String("%1").Arg(1000+rand.Next(50)))         != B_NO_ERROR)
+        ||(msg()->AddString("user",    users[rand.Next(ARRAYITEMS(users))])           != B_NO_ERROR)
+        ||(msg()->AddString("text",    text)                                          != B_NO_ERROR)
+        ||(msg()->AddBool("private",   (rand.Next(10) == 0))                          != B_NO_ERROR)
+        ||(retMsgs.AddTail(msg) != B_NO_ERROR)) return B_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
+// Blocks of 16-bit samples from a noisy multi-channel sensor
+static status_t GenerateSensorData(Queue<MessageRef> & retMsgs)
+{
+   static const uint32 NUM_CHANNELS = 4;
+   static const uint32 SAMPLES_PER_CHANNEL = 256;
+   TestRandom rand(3);
+   uint32 sampleIndex = 0;
+   for (uint32 i=0; i<1000; i++)
+   {
+      int16 samples[NUM_CHANNELS*SAMPLES_PER_CHANNEL];
+      for (uint32 j=0; j<SAMPLES_PER_CHANNEL; j++,sampleIndex++)
+         for (uint32 c=0; c<NUM_CHANNELS; c++)
+            samples[(j*NUM_CHANNELS)+c] = B_HOST_TO_LENDIAN_INT16((int16)((8000.0*sin((sampleIndex*(c+1))/50.0))+((int32)rand.Next(64))-32));
+
+      MessageRef msg = GetMessageFromPool(SENSOR_DATA_WHAT);
+      if ((msg() == NULL)
+        ||(msg()->AddInt32("channels",   NUM_CHANNELS)                         != B_NO_ERROR)
+        ||(msg()->AddInt64("firstSample", sampleIndex-SAMPLES_PER_CHANNEL)     != B_NO_ERROR)
+        ||(msg()->AddData("samples", B_RAW_TYPE, samples, sizeof(samples))     != B_NO_ERROR)
+        ||(retMsgs.AddTail(msg) != B_NO_ERROR)) return B_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
+// Collects the Messages our decoding gateway reads back
+class CollectingReceiver : public AbstractGatewayMessageReceiver
+{
+public:
+   CollectingReceiver() {/* empty */}
+
+   Queue<MessageRef> & GetMessages() {return _msgs;}
+
+protected:
+   virtual void MessageReceivedFromGateway(const MessageRef & msg, void * /*userData*/) {(void) _msgs.AddTail(msg);}
+
+private:
+   Queue<MessageRef> _msgs;
+};
+
+// Sends (msgs) through a gateway using the given encoding (numPasses) times, each time into a new buffer
+static status_t EncodeMessages(int32 encoding, const Queue<MessageRef> & msgs, uint32 numPasses, ByteBufferRef & retBuf)
+{
+   for (uint32 pass=0; pass<numPasses; pass++)
+   {
+      retBuf = GetByteBufferFromPool(0);
+      ByteBufferDataIO * dio = newnothrow ByteBufferDataIO(retBuf);
+      if ((retBuf() == NULL)||(dio == NULL)) {WARN_OUT_OF_MEMORY; delete dio; return B_ERROR;}
+
+      MessageIOGateway encoder(encoding);
+      encoder.SetDataIO(DataIORef(dio));
+      for (uint32 i=0; i<msgs.GetNumItems(); i++) if (encoder.AddOutgoingMessage(msgs[i]) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      while(encoder.HasBytesToOutput()) if (encoder.DoOutput() < 0) {printf("ERROR:  Encoding failed!\n"); return B_ERROR;}
+   }
+   return B_NO_ERROR;
+}
+
+// Reads the Messages in (buf) back with a new gateway, (numPasses) times
+static status_t DecodeMessages(const ByteBufferRef & buf, uint32 numPasses, CollectingReceiver & receiver)
+{
+   for (uint32 pass=0; pass<numPasses; pass++)
+   {
+      ByteBufferDataIO * dio = newnothrow ByteBufferDataIO(buf);
+      if (dio == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+      MessageIOGateway decoder;
+      decoder.SetDataIO(DataIORef(dio));
+      receiver.GetMessages().Clear();
+
+      int32 numRead;
+      while((numRead = decoder.DoInput(receiver)) > 0) {/* empty */}
+      if (numRead < 0) {printf("ERROR:  Decoding failed!\n"); return B_ERROR;}
+   }
+   return B_NO_ERROR;
+}
+
+// GetRunTime64() may only tick every few milliseconds, so each measurement repeats its operation
+// (doubling the number of passes each time) until it has taken at least this long
+static const uint64 MIN_MEASUREMENT_MICROS = 200000;
+
+class EncodingResult
+{
+public:
+   EncodingResult() : _encodedSize(0), _encodeMicros(0), _decodeMicros(0) {/* empty */}
+
+   uint32 _encodedSize;
+   double _encodeMicros;  // average time to encode the whole stream
+   double _decodeMicros;  // average time to decode the whole stream
+};
+
+// Measures how long it takes to encode and decode (msgs) with the given encoding, and checks that every Message comes back intact
+static status_t TestEncoding(int32 encoding, const Queue<MessageRef> & msgs, EncodingResult & result)
+{
+   ByteBufferRef buf;
+   for (uint32 numPasses=1; ; numPasses*=2)
+   {
+      const uint64 startTime = GetRunTime64();
+      if (EncodeMessages(encoding, msgs, numPasses, buf) != B_NO_ERROR) return B_ERROR;
+      const uint64 elapsed = GetRunTime64()-startTime;
+      if (elapsed >= MIN_MEASUREMENT_MICROS) {result._encodeMicros = ((double)elapsed)/numPasses; break;}
+   }
+   result._encodedSize = buf()->GetNumBytes();
+
+   CollectingReceiver receiver;
+   for (uint32 numPasses=1; ; numPasses*=2)
+   {
+      const uint64 startTime = GetRunTime64();
+      if (DecodeMessages(buf, numPasses, receiver) != B_NO_ERROR) return B_ERROR;
+      const uint64 elapsed = GetRunTime64()-startTime;
+      if (elapsed >= MIN_MEASUREMENT_MICROS) {result._decodeMicros = ((double)elapsed)/numPasses; break;}
+   }
+
+   const Queue<MessageRef> & rmsgs = receiver.GetMessages();
+   if (rmsgs.GetNumItems() != msgs.GetNumItems()) {printf("ERROR:  Sent " UINT32_FORMAT_SPEC " Messages but received " UINT32_FORMAT_SPEC "!\n", msgs.GetNumItems(), rmsgs.GetNumItems()); return B_ERROR;}
+   for (uint32 i=0; i<msgs.GetNumItems(); i++) if (*rmsgs[i]() != *msgs[i]()) {printf("ERROR:  Message #" UINT32_FORMAT_SPEC " was corrupted!\n", i); return B_ERROR;}
+   return B_NO_ERROR;
+}
+
+static double GetMegabytesPerSecond(uint32 numBytes, double micros) {return (((double)numBytes)/(1024.0*1024.0))/(muscleMax(micros, 1.0)/1000000.0);}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   struct {
+      const char * _name;
+      status_t (*_generator)(Queue<MessageRef> &);
+   } streams[] = {
+      {"subscription updates", GenerateSubscriptionUpdates},
+      {"chat text",            GenerateChatText},
+      {"sensor data",          GenerateSensorData}
+   };
+
+   struct {
+      const char * _name;
+      int32 _encoding;
+   } encodings[] = {
+      {"DEFAULT",     MUSCLE_MESSAGE_ENCODING_DEFAULT},
+#ifdef MUSCLE_ENABLE_ZLIB_ENCODING
+      {"ZLIB_1",      MUSCLE_MESSAGE_ENCODING_ZLIB_1},
+      {"ZLIB_6",      MUSCLE_MESSAGE_ENCODING_ZLIB_6},
+      {"ZLIB_9",      MUSCLE_MESSAGE_ENCODING_ZLIB_9},
+#endif
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+      {"ZSTD_FAST_9", MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_9},
+      {"ZSTD_FAST_4", MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_4},
+      {"ZSTD_FAST_1", MUSCLE_MESSAGE_ENCODING_ZSTD_FAST_1},
+      {"ZSTD_1",      MUSCLE_MESSAGE_ENCODING_ZSTD_1},
+      {"ZSTD_3",      MUSCLE_MESSAGE_ENCODING_ZSTD_3},
+      {"ZSTD_9",      MUSCLE_MESSAGE_ENCODING_ZSTD_9},
+      {"ZSTD_19",     MUSCLE_MESSAGE_ENCODING_ZSTD_19},
+#endif
+   };
+
+   for (uint32 s=0; s<ARRAYITEMS(streams); s++)
+   {
+      Queue<MessageRef> msgs;
+      if (streams[s]._generator(msgs) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return 10;}
+
+      ByteBufferRef plainBuf;
+      if (EncodeMessages(MUSCLE_MESSAGE_ENCODING_DEFAULT, msgs, 1, plainBuf) != B_NO_ERROR) return 10;
+      const uint32 plainSize = plainBuf()->GetNumBytes();
+
+      printf("\n%s:  " UINT32_FORMAT_SPEC " Messages, " UINT32_FORMAT_SPEC " bytes unencoded\n", streams[s]._name, msgs.GetNumItems(), plainSize);
+      printf("%-12s  %12s  %8s  %14s  %14s\n", "Encoding", "Bytes", "Ratio", "Encode (MB/s)", "Decode (MB/s)");
+      for (uint32 e=0; e<ARRAYITEMS(encodings); e++)
+      {
+         EncodingResult r;
+         if (TestEncoding(encodings[e]._encoding, msgs, r) != B_NO_ERROR) {printf("ERROR:  Encoding %s failed on the %s stream!\n", encodings[e]._name, streams[s]._name); return 10;}
+
+         // Throughput is measured against the unencoded size, so that the encodings can be compared directly
+         printf("%-12s  %12u  %8.2f  %14.1f  %14.1f\n", encodings[e]._name, (unsigned) r._encodedSize, ((double)plainSize)/muscleMax(r._encodedSize, (uint32)1), GetMegabytesPerSecond(plainSize, r._encodeMicros), GetMegabytesPerSecond(plainSize, r._decodeMicros));
+      }
+   }
+   printf("\nAll encodings decoded every Message intact.\n");
+   return 0;
+}
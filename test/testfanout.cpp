@@ -0,0 +1,170 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program benchmarks the cost of sending a subscription update to many subscribers at once.
+// One "publisher" session repeatedly updates a node that (numSubscribers) other sessions are subscribed to,
+// and we measure the CPU time needed per update, for the whole fan-out:  building the PR_RESULT_DATAITEMS
+// Messages, flattening them, and writing them out to each subscriber's (null) DataIO.
+// Before that, it checks that every subscriber is notified even when one of them unsubscribes while being notified.
+
+// A gateway that refuses to share its flattened buffers, so that every subscriber has to flatten its own copy
+class UnsharedMessageIOGateway : public MessageIOGateway
+{
+public:
+   UnsharedMessageIOGateway() {/* empty */}
+
+   virtual bool IsFlattenedFormatCompatibleWith(const MessageIOGateway &) const {return false;}
+};
+
+static status_t Subscribe(AbstractReflectSession * session)
+{
+   MessageRef subMsg = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+   if ((subMsg() == NULL)||(subMsg()->AddBool("SUBSCRIBE:/*/*/hot", true) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   session->CallMessageReceivedFromGateway(subMsg);
+   return B_NO_ERROR;
+}
+
+// A subscriber that counts its notifications, and (optionally) cancels its subscription when it gets one
+class CountingSession : public StorageReflectSession
+{
+public:
+   CountingSession(bool unsubscribeWhenNotified) : _unsubscribeWhenNotified(unsubscribeWhenNotified), _numNotifications(0) {/* empty */}
+
+   uint32 GetNumNotifications() const {return _numNotifications;}
+
+protected:
+   virtual void NodeChanged(DataNode & node, const MessageRef & oldData, bool isBeingRemoved)
+   {
+      _numNotifications++;
+      if (_unsubscribeWhenNotified)
+      {
+         MessageRef unsubMsg = GetMessageFromPool(PR_COMMAND_REMOVEPARAMETERS);
+         if ((unsubMsg())&&(unsubMsg()->AddString(PR_NAME_KEYS, "SUBSCRIBE:*") == B_NO_ERROR)) CallMessageReceivedFromGateway(unsubMsg);
+      }
+      StorageReflectSession::NodeChanged(node, oldData, isBeingRemoved);
+   }
+
+private:
+   const bool _unsubscribeWhenNotified;
+   uint32 _numNotifications;
+};
+
+// Checks that when one subscriber unsubscribes while it is being notified, the other subscribers are still notified
+static int CheckUnsubscribeDuringNotification()
+{
+   static const uint32 NUM_SUBSCRIBERS = 5;
+   for (uint32 quitter=0; quitter<NUM_SUBSCRIBERS; quitter++)
+   {
+      ReflectServer server;
+      AbstractReflectSessionRef publisherRef(newnothrow StorageReflectSession);
+      if (AddOfflineSession(server, publisherRef) != B_NO_ERROR) {server.Cleanup(); return 10;}
+
+      CountingSession * subscribers[NUM_SUBSCRIBERS];
+      for (uint32 i=0; i<NUM_SUBSCRIBERS; i++)
+      {
+         subscribers[i] = newnothrow CountingSession(i == quitter);
+         AbstractReflectSessionRef subRef(subscribers[i]);
+         if ((AddOfflineSession(server, subRef) != B_NO_ERROR)||(Subscribe(subscribers[i]) != B_NO_ERROR)) {server.Cleanup(); return 10;}
+      }
+
+      MessageRef setMsg = GetMessageFromPool(PR_COMMAND_SETDATA);
+      if ((setMsg() == NULL)||(setMsg()->AddMessage("hot", GetMessageFromPool(1234)) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 10;}
+      publisherRef()->CallMessageReceivedFromGateway(setMsg);
+
+      for (uint32 i=0; i<NUM_SUBSCRIBERS; i++)
+      {
+         if (subscribers[i]->GetNumNotifications() != 1)
+         {
+            printf("ERROR:  when subscriber #" UINT32_FORMAT_SPEC " unsubscribed during its notification, subscriber #" UINT32_FORMAT_SPEC " was notified " UINT32_FORMAT_SPEC " times!\n", quitter, i, subscribers[i]->GetNumNotifications());
+            server.Cleanup();
+            return 10;
+         }
+      }
+      server.Cleanup();
+   }
+   printf("Unsubscribing during a notification doesn't cause any other subscriber to be skipped.\n");
+   return 0;
+}
+
+static uint64 RunTrial(uint32 numSubscribers, uint32 numUpdates, bool shareFlattenedBuffers)
+{
+   uint64 ret = 0;
+
+   ReflectServer server;
+   Queue<AbstractReflectSessionRef> sessions;
+   for (uint32 i=0; i<=numSubscribers; i++)  // session #0 is the publisher
+   {
+      AbstractReflectSessionRef sessionRef(newnothrow StorageReflectSession);
+      if ((AddOfflineSession(server, sessionRef, shareFlattenedBuffers ? NULL : newnothrow UnsharedMessageIOGateway) != B_NO_ERROR)||(sessions.AddTail(sessionRef) != B_NO_ERROR))
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't add session #" UINT32_FORMAT_SPEC "!\n", i);
+         server.Cleanup();
+         return 0;
+      }
+      if ((i > 0)&&(Subscribe(sessionRef()) != B_NO_ERROR)) {server.Cleanup(); return 0;}
+   }
+
+   AbstractReflectSession * publisher = sessions.Head()();
+   uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<numUpdates; i++)
+   {
+      MessageRef payload = GetMessageFromPool(1234);
+      MessageRef setMsg  = GetMessageFromPool(PR_COMMAND_SETDATA);
+      if ((payload() == NULL)||(setMsg() == NULL)) {WARN_OUT_OF_MEMORY; break;}
+
+      (void) payload()->AddInt32("count", i);
+      (void) payload()->AddString("text", "This is a typical-sized status string for a hot node");
+      for (uint32 j=0; j<10; j++) (void) payload()->AddFloat("levels", (float) j);
+      (void) setMsg()->AddMessage("hot", payload);
+
+      publisher->CallMessageReceivedFromGateway(setMsg);
+      for (uint32 j=0; j<sessions.GetNumItems(); j++) (void) sessions[j]()->GetGateway()()->DoOutput();
+   }
+   ret = GetRunTime64()-startTime;
+
+   server.Cleanup();
+   return ret;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   if (CheckUnsubscribeDuringNotification() != 0) return 10;
+
+   uint32 numUpdates = 1000;
+   const char * s;
+   if (args.FindString("updates", &s) == B_NO_ERROR) numUpdates = muscleMax((uint32)1, (uint32)atol(s));
+
+   Queue<uint32> subscriberCounts;
+   if (args.FindString("subscribers", &s) == B_NO_ERROR) (void) subscriberCounts.AddTail((uint32)atol(s));
+   else
+   {
+      const uint32 defaultCounts[] = {1, 10, 100, 500, 1000, 2000};
+      for (uint32 i=0; i<ARRAYITEMS(defaultCounts); i++) (void) subscriberCounts.AddTail(defaultCounts[i]);
+   }
+
+   printf("Measuring the cost of (at least " UINT32_FORMAT_SPEC ") node updates, each sent to every subscriber.\n", numUpdates);
+   printf("%12s  %22s  %22s  %22s\n", "Subscribers", "Shared (us/update)", "Unshared (us/update)", "Shared (ns/subscriber)");
+   for (uint32 i=0; i<subscriberCounts.GetNumItems(); i++)
+   {
+      uint32 numSubscribers = subscriberCounts[i];
+      uint32 trialUpdates   = muscleMax(numUpdates, (uint32)(200000/muscleMax(numSubscribers, (uint32)1)));  // so that the run time will be large enough to measure accurately
+      uint64 sharedTime     = RunTrial(numSubscribers, trialUpdates, true);
+      uint64 unsharedTime   = RunTrial(numSubscribers, trialUpdates, false);
+      printf("%12u  %22.2f  %22.2f  %22.2f\n", (unsigned) numSubscribers, ((double)sharedTime)/trialUpdates, ((double)unsharedTime)/trialUpdates, (1000.0*sharedTime)/((double)trialUpdates*muscleMax(numSubscribers, (uint32)1)));
+   }
+   return 0;
+}
@@ -0,0 +1,169 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks StorageReflectSession's latest-value output mode.  A "publisher" session rapidly updates
+// (and occasionally removes) a set of nodes, while two subscribers never get a chance to send anything, as if their
+// clients had stopped reading.  One subscriber uses latest-value output and the other doesn't.  We then replay each
+// subscriber's outgoing queue the way a client would, and check that both end up with the same view of the
+// database, that the latest-value subscriber's queue held no more than one value per node, and that
+// updates were never moved ahead of (or behind) the PR_RESULT_PONG Messages queued in between them.
+
+static const uint32 NUM_NODES  = 200;
+static const uint32 NUM_ROUNDS = 100;
+
+static status_t SetNode(AbstractReflectSession * publisher, uint32 nodeIdx, int32 value)
+{
+   MessageRef payload = GetMessageFromPool(1234);
+   MessageRef setMsg  = GetMessageFromPool(PR_COMMAND_SETDATA);
+   if ((payload() == NULL)||(setMsg() == NULL)||(payload()->AddInt32("value", value) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   char buf[32]; sprintf(buf, "node" UINT32_FORMAT_SPEC, nodeIdx);
+   return (setMsg()->AddMessage(buf, payload) == B_NO_ERROR) ? SendToSession(publisher, setMsg) : B_ERROR;
+}
+
+static status_t RemoveNode(AbstractReflectSession * publisher, uint32 nodeIdx)
+{
+   MessageRef removeMsg = GetMessageFromPool(PR_COMMAND_REMOVEDATA);
+   char buf[32]; sprintf(buf, "node" UINT32_FORMAT_SPEC, nodeIdx);
+   return ((removeMsg())&&(removeMsg()->AddString(PR_NAME_KEYS, buf) == B_NO_ERROR)) ? SendToSession(publisher, removeMsg) : B_ERROR;
+}
+
+// Applies the PR_RESULT_DATAITEMS Messages in (session)'s outgoing queue to (model), the way a client would.
+// Each time a PR_RESULT_PONG is found, (model) is checked against the snapshot that was taken when the ping was sent.
+static int ReplayQueue(const char * desc, AbstractReflectSession * session, Hashtable<String, int32> & model, const Queue<Hashtable<String, int32> > & snapshots, uint32 & retNumValues)
+{
+   retNumValues = 0;
+   uint32 numPongs = 0;
+   const Queue<MessageRef> & oq = session->GetGateway()()->GetOutgoingMessageQueue();
+   for (uint32 i=0; i<oq.GetNumItems(); i++)
+   {
+      const Message & msg = *oq[i]();
+      if (msg.what == PR_RESULT_DATAITEMS)
+      {
+         const String * rname;
+         for (uint32 j=0; msg.FindString(PR_NAME_REMOVED_DATAITEMS, j, &rname) == B_NO_ERROR; j++) (void) model.Remove(*rname);
+         for (MessageFieldNameIterator iter = msg.GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++)
+         {
+            MessageRef nodeData;
+            for (uint32 j=0; msg.FindMessage(iter.GetFieldName(), j, nodeData) == B_NO_ERROR; j++)
+            {
+               int32 value;
+               if ((nodeData()->FindInt32("value", value) != B_NO_ERROR)||(model.Put(iter.GetFieldName(), value) != B_NO_ERROR)) return 10;
+               retNumValues++;
+            }
+         }
+      }
+      else if (msg.what == PR_RESULT_PONG)
+      {
+         if ((numPongs >= snapshots.GetNumItems())||(model.IsEqualTo(snapshots[numPongs]) == false))
+         {
+            printf("ERROR:  %s subscriber's view of the database at PONG #" UINT32_FORMAT_SPEC " doesn't match the database at the time of the PING!\n", desc, numPongs);
+            return 10;
+         }
+         numPongs++;
+      }
+   }
+   if (numPongs != snapshots.GetNumItems())
+   {
+      printf("ERROR:  %s subscriber got " UINT32_FORMAT_SPEC " PONGs, expected " UINT32_FORMAT_SPEC "\n", desc, numPongs, snapshots.GetNumItems());
+      return 10;
+   }
+   return 0;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   ReflectServer server;
+   AbstractReflectSession * sessions[3];  // publisher, regular subscriber, latest-value subscriber
+   for (uint32 i=0; i<ARRAYITEMS(sessions); i++)
+   {
+      AbstractReflectSessionRef sessionRef(newnothrow StorageReflectSession);
+      if (AddOfflineSession(server, sessionRef) != B_NO_ERROR) {printf("Couldn't add session #" UINT32_FORMAT_SPEC "!\n", i); server.Cleanup(); return 10;}
+      sessions[i] = sessionRef();
+
+      if (i > 0)
+      {
+         MessageRef subMsg = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+         if ((subMsg() == NULL)||(subMsg()->AddBool("SUBSCRIBE:/*/*/node*", true) != B_NO_ERROR)||((i == 2)&&(subMsg()->AddBool(PR_NAME_LATEST_VALUES_ONLY, true) != B_NO_ERROR))) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 10;}
+         if (SendToSession(sessions[i], subMsg) != B_NO_ERROR) {server.Cleanup(); return 10;}
+      }
+   }
+   if (static_cast<StorageReflectSession *>(sessions[2])->IsLatestValueOutputEnabled() == false) {printf("ERROR:  PR_NAME_LATEST_VALUES_ONLY parameter wasn't honored!\n"); server.Cleanup(); return 10;}
+
+   // Hammer on the nodes.  Every so often, the subscribers send a PING, and we remember what the database looked like at that moment.
+   Hashtable<String, int32> database;
+   Queue<Hashtable<String, int32> > snapshots;
+   const String prefix = sessions[0]->GetSessionRootPath() + "/";  // i.e. "/hostname/sessionID/"
+   srand(54321);
+   int ret = 0;
+   uint64 startTime = GetRunTime64();
+   for (uint32 r=0; (ret==0)&&(r<NUM_ROUNDS); r++)
+   {
+      for (uint32 n=0; (ret==0)&&(n<NUM_NODES); n++)
+      {
+         const uint32 nodeIdx = rand()%NUM_NODES;
+         const String path    = prefix + String("node%1").Arg(nodeIdx);
+         if ((rand()%10) == 0)
+         {
+            if (RemoveNode(sessions[0], nodeIdx) != B_NO_ERROR) ret = 10;
+            (void) database.Remove(path);
+         }
+         else
+         {
+            const int32 value = (int32) ((r*NUM_NODES)+n);
+            if ((SetNode(sessions[0], nodeIdx, value) != B_NO_ERROR)||(database.Put(path, value) != B_NO_ERROR)) ret = 10;
+         }
+      }
+      if ((r%10) == 9)
+      {
+         if (snapshots.AddTail(database) != B_NO_ERROR) ret = 10;
+         for (uint32 i=1; i<ARRAYITEMS(sessions); i++) if (SendToSession(sessions[i], GetMessageFromPool(PR_COMMAND_PING)) != B_NO_ERROR) ret = 10;
+      }
+   }
+   const uint64 elapsed = GetRunTime64()-startTime;
+
+   const char * descs[] = {"Regular", "Latest-value"};
+   for (uint32 i=1; (ret==0)&&(i<ARRAYITEMS(sessions)); i++)
+   {
+      Hashtable<String, int32> model;
+      uint32 numValues;
+      ret = ReplayQueue(descs[i-1], sessions[i], model, snapshots, numValues);
+      if (ret != 0) break;
+
+      printf("%s subscriber:  " UINT32_FORMAT_SPEC " Messages with " UINT32_FORMAT_SPEC " node values queued for " UINT32_FORMAT_SPEC " updates\n", descs[i-1], sessions[i]->GetGateway()()->GetOutgoingMessageQueue().GetNumItems(), numValues, NUM_ROUNDS*NUM_NODES);
+      if (model.IsEqualTo(database) == false) {printf("ERROR:  %s subscriber's view of the database doesn't match the actual database!\n", descs[i-1]); ret = 10;}
+
+      // Between each pair of PONGs, there should be at most one value per node
+      if ((i == 2)&&(numValues > (snapshots.GetNumItems()+1)*NUM_NODES)) {printf("ERROR:  Latest-value subscriber's queue holds superseded values!\n"); ret = 10;}
+   }
+
+   if (ret == 0)
+   {
+      // Once the latest-value subscriber's client catches up, updates should flow through one at a time again
+      AbstractMessageIOGateway * gw = sessions[2]->GetGateway()();
+      while(gw->HasBytesToOutput()) if (gw->DoOutput() < 0) {printf("ERROR:  DoOutput() failed!\n"); ret = 10; break;}
+      for (uint32 i=0; (ret==0)&&(i<3); i++)
+      {
+         if (SetNode(sessions[0], 0, -1) != B_NO_ERROR) ret = 10;
+         else if (gw->GetOutgoingMessageQueue().GetNumItems() != 1) {printf("ERROR:  Update wasn't queued after the client caught up!\n"); ret = 10;}
+         else (void) gw->DoOutput();
+      }
+   }
+
+   server.Cleanup();
+   if (ret == 0) printf("All latest-value checks passed (" UINT64_FORMAT_SPEC " microseconds of updates).\n", elapsed);
+   return ret;
+}
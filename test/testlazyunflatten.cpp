@@ -0,0 +1,253 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+
+#include "message/Message.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/TimeUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks that Messages unflattened via Message::UnflattenLazily() behave exactly like
+// Messages unflattened via Message::Unflatten(), and then benchmarks the two in a typical relay
+// scenario (unflatten a received Message, look at a field or two, and flatten it again to send it on).
+
+static int _numFailures = 0;
+
+#define CHECK(x) if (!(x)) {printf("Check failed, line %i:  %s\n", __LINE__, #x); _numFailures++;}
+
+static MessageRef CreateTestMessage(uint32 numStrings)
+{
+   MessageRef msg = GetMessageFromPool(1234);
+   Message & m = *msg();
+   for (uint32 i=0; i<numStrings; i++) (void) m.AddString("strings", String("This is string #%1, a typical-sized status string").Arg(i));
+   (void) m.AddString("name", "relayed");
+   (void) m.AddInt8("int8", 8);
+   (void) m.AddInt16("int16", 16);
+   (void) m.AddInt32("int32", 32);
+   (void) m.AddInt32("int32", -32);
+   (void) m.AddInt64("int64", 64);
+   (void) m.AddBool("bool", true);
+   (void) m.AddFloat("float", 3.5f);
+   (void) m.AddDouble("double", 6.25);
+   (void) m.AddPoint("point", Point(1.0f, 2.0f));
+   (void) m.AddRect("rect", Rect(1.0f, 2.0f, 3.0f, 4.0f));
+   (void) m.AddTag("tag", RefCountableRef(GetMessageFromPool()()));  // tags don't get flattened
+
+   const uint8 rawBytes[] = {0, 1, 2, 3, 4, 5, 6, 7};
+   (void) m.AddData("raw", B_RAW_TYPE, rawBytes, sizeof(rawBytes));
+   (void) m.AddData("raw", B_RAW_TYPE, rawBytes, 3);
+   (void) m.AddData("custom", 'cust', rawBytes, sizeof(rawBytes));
+
+   MessageRef subMsg = GetMessageFromPool(5678);
+   (void) subMsg()->AddString("subString", "sub");
+   (void) subMsg()->AddInt32("subInt", 5);
+   MessageRef subSubMsg = GetMessageFromPool(9);
+   (void) subSubMsg()->AddString("deep", "deeper");
+   (void) subMsg()->AddMessage("subSub", subSubMsg);
+   (void) m.AddMessage("sub", subMsg);
+   (void) m.AddMessage("sub", GetMessageFromPool(0));
+   return msg;
+}
+
+static ByteBufferRef FlattenToBuffer(const Message & msg)
+{
+   ByteBufferRef buf = GetByteBufferFromPool(msg.FlattenedSize());
+   if (buf()) msg.Flatten(buf()->GetBuffer());
+   return buf;
+}
+
+static bool BuffersAreEqual(const ByteBufferRef & a, const ByteBufferRef & b)
+{
+   return ((a())&&(b())&&(*a() == *b()));
+}
+
+static void TestCorrectness()
+{
+   MessageRef orig = CreateTestMessage(5);
+   ByteBufferRef origBuf = FlattenToBuffer(*orig());
+   CHECK(origBuf());
+
+   // An untouched lazy Message should re-flatten to exactly the original bytes
+   Message lazy;
+   CHECK(lazy.UnflattenLazily(origBuf) == B_NO_ERROR);
+   CHECK(lazy.FlattenedSize() == origBuf()->GetNumBytes());
+   CHECK(BuffersAreEqual(FlattenToBuffer(lazy), origBuf));
+   CHECK(lazy.GetNumNames() == orig()->GetNumNames()-1);  // the tag field wasn't flattened
+
+   // Copies and lightweight copies of the lazy Message should flatten the same way
+   Message lazyCopy(lazy);
+   CHECK(BuffersAreEqual(FlattenToBuffer(lazyCopy), origBuf));
+   Message lightCopy; lightCopy.BecomeLightweightCopyOf(lazy);
+   CHECK(BuffersAreEqual(FlattenToBuffer(lightCopy), origBuf));
+
+   // And it should be equivalent to an eagerly unflattened Message
+   Message eager;
+   CHECK(eager.Unflatten(origBuf()->GetBuffer(), origBuf()->GetNumBytes()) == B_NO_ERROR);
+   CHECK(lazy.CalculateChecksum() == eager.CalculateChecksum());
+   CHECK(lazy == eager);
+   CHECK(lazy.ToString() == eager.ToString());
+   CHECK(BuffersAreEqual(FlattenToBuffer(lazy), origBuf));  // still the same bytes, now that its fields have all been accessed
+
+   // Field access
+   Message lazy2;
+   CHECK(lazy2.UnflattenLazily(origBuf) == B_NO_ERROR);
+   CHECK(lazy2.GetString("name") == "relayed");
+   CHECK(lazy2.GetString("strings", "", 4) == "This is string #4, a typical-sized status string");
+   CHECK(lazy2.GetNumValuesInName("strings") == 5);
+   CHECK(lazy2.GetInt32("int32", 0, 1) == -32);
+   const void * data; uint32 numBytes;
+   CHECK((lazy2.FindData("raw", B_RAW_TYPE, 1, &data, &numBytes) == B_NO_ERROR)&&(numBytes == 3)&&(((const uint8 *)data)[2] == 2));
+   CHECK((lazy2.FindData("custom", 'cust', &data, &numBytes) == B_NO_ERROR)&&(numBytes == 8));
+   MessageRef sub;
+   CHECK((lazy2.FindMessage("sub", sub) == B_NO_ERROR)&&(sub()->GetString("subString") == "sub"));
+   MessageRef subSub;
+   CHECK((sub()->FindMessage("subSub", subSub) == B_NO_ERROR)&&(subSub()->GetString("deep") == "deeper"));
+   CHECK(lazy2.HasName("strings", B_STRING_TYPE));
+   CHECK(lazy2.HasName("strings", B_RAW_TYPE) == false);
+   CHECK(lazy2.GetNumNames(B_STRING_TYPE) == 2);
+
+   // Modifications to a lazy Message should be reflected when it is flattened again, just as with an eager one
+   Message lazy3, eager3;
+   CHECK(lazy3.UnflattenLazily(origBuf) == B_NO_ERROR);
+   CHECK(eager3.Unflatten(origBuf()->GetBuffer(), origBuf()->GetNumBytes()) == B_NO_ERROR);
+   CHECK(lazy3.ReplaceString(false, "strings", 2, "changed") == B_NO_ERROR);
+   CHECK(eager3.ReplaceString(false, "strings", 2, "changed") == B_NO_ERROR);
+   CHECK(lazy3.AddData("raw", B_RAW_TYPE, "x", 1) == B_NO_ERROR);
+   CHECK(eager3.AddData("raw", B_RAW_TYPE, "x", 1) == B_NO_ERROR);
+   CHECK(lazy3.Rename("custom", "renamed") == B_NO_ERROR);
+   CHECK(eager3.Rename("custom", "renamed") == B_NO_ERROR);
+   CHECK(lazy3.AddString("name", "twice") == B_NO_ERROR);
+   CHECK(eager3.AddString("name", "twice") == B_NO_ERROR);
+   CHECK(lazy3.AddInt32("name", 5) != B_NO_ERROR);  // wrong type for the existing field
+   CHECK(BuffersAreEqual(FlattenToBuffer(lazy3), FlattenToBuffer(eager3)));
+   CHECK(lazy3 == eager3);
+
+   // Sharing and copying lazy fields between Messages
+   Message lazy4, target;
+   CHECK(lazy4.UnflattenLazily(origBuf) == B_NO_ERROR);
+   CHECK(lazy4.ShareName("strings", target) == B_NO_ERROR);
+   CHECK(lazy4.CopyName("raw", target) == B_NO_ERROR);
+   CHECK(target.GetString("strings", "", 3) == eager.GetString("strings", "", 3));
+   CHECK(lazy4.GetString("strings", "", 3) == eager.GetString("strings", "", 3));
+   CHECK(target.GetNumValuesInName("raw") == 2);
+
+   // A lazy Message must not depend on anything but the ByteBuffer it was given
+   {
+      ByteBufferRef bufCopy = GetByteBufferFromPool(origBuf()->GetNumBytes(), origBuf()->GetBuffer());
+      Message lazy5;
+      CHECK(lazy5.UnflattenLazily(bufCopy) == B_NO_ERROR);
+      bufCopy.Reset();  // (lazy5) still holds a reference, so the bytes stay valid
+      CHECK(lazy5 == eager);
+   }
+
+   // Unflattening from an offset within a larger buffer
+   {
+      const uint32 pad = 13;
+      ByteBufferRef padded = GetByteBufferFromPool(origBuf()->GetNumBytes()+pad+pad);
+      memset(padded()->GetBuffer(), 0xFF, padded()->GetNumBytes());
+      memcpy(padded()->GetBuffer()+pad, origBuf()->GetBuffer(), origBuf()->GetNumBytes());
+      Message lazy6;
+      CHECK(lazy6.UnflattenLazily(padded, pad, origBuf()->GetNumBytes()) == B_NO_ERROR);
+      CHECK(BuffersAreEqual(FlattenToBuffer(lazy6), origBuf));
+      CHECK(lazy6 == eager);
+      CHECK(lazy6.UnflattenLazily(padded, padded()->GetNumBytes()+1) != B_NO_ERROR);
+      CHECK(lazy6.IsEmpty());
+   }
+
+   // Truncated or corrupted buffers must be rejected by UnflattenLazily() whenever Unflatten() rejects them,
+   // and whenever they are accepted, the two Messages must be identical.
+   uint32 numRejected = 0;
+   for (uint32 len=0; len<origBuf()->GetNumBytes(); len++)
+   {
+      Message l, e;
+      status_t lRet = l.UnflattenLazily(origBuf, 0, len);
+      status_t eRet = e.Unflatten(origBuf()->GetBuffer(), len);
+      CHECK(lRet == eRet);
+      if (lRet != B_NO_ERROR) numRejected++;
+      else CHECK(l == e);
+   }
+   CHECK(numRejected > 0);
+
+   uint32 seed = 12345;
+   for (uint32 i=0; i<20000; i++)
+   {
+      ByteBufferRef corrupt = GetByteBufferFromPool(origBuf()->GetNumBytes(), origBuf()->GetBuffer());
+      uint32 numChanges = 1+(i%3);
+      for (uint32 j=0; j<numChanges; j++)
+      {
+         seed = (seed*1103515245)+12345;
+         uint32 idx = (seed>>8) % corrupt()->GetNumBytes();
+         corrupt()->GetBuffer()[idx] = (uint8)(((i+j)%2) ? (seed>>24) : (corrupt()->GetBuffer()[idx]+1));
+      }
+
+      Message l, e;
+      status_t lRet = l.UnflattenLazily(corrupt);
+      status_t eRet = e.Unflatten(corrupt()->GetBuffer(), corrupt()->GetNumBytes());
+      if (lRet != eRet) {printf("Corruption trial " UINT32_FORMAT_SPEC ":  lazy result %i, eager result %i\n", i, (int)lRet, (int)eRet); _numFailures++;}
+      else if ((lRet == B_NO_ERROR)&&((l == e) == false)) {printf("Corruption trial " UINT32_FORMAT_SPEC ":  lazy and eager Messages differ\n", i); _numFailures++;}
+   }
+}
+
+static void RunBenchmark(uint32 numStrings, uint64 microsPerTrial)
+{
+   MessageRef orig = CreateTestMessage(numStrings);
+   ByteBufferRef origBuf = FlattenToBuffer(*orig());
+   ByteBufferRef outBuf = GetByteBufferFromPool(origBuf()->GetNumBytes());
+   if ((origBuf() == NULL)||(outBuf() == NULL)) {WARN_OUT_OF_MEMORY; _numFailures++; return;}
+
+   double nanosPerMessage[2];
+   for (uint32 lazy=0; lazy<2; lazy++)
+   {
+      uint64 numIterations = 0;
+      uint64 startTime = GetRunTime64();
+      uint64 elapsed = 0;
+      while(elapsed < microsPerTrial)
+      {
+         for (uint32 i=0; i<100; i++)
+         {
+            // Typical relay work:  unflatten, check the what-code and one field, flatten for sending
+            MessageRef msg = GetMessageFromPool();
+            status_t ret = lazy ? msg()->UnflattenLazily(origBuf) : msg()->Unflatten(origBuf()->GetBuffer(), origBuf()->GetNumBytes());
+            if ((ret != B_NO_ERROR)||(msg()->what != 1234)||(msg()->GetString("name") != "relayed")) {_numFailures++; return;}
+            msg()->Flatten(outBuf()->GetBuffer());
+         }
+         numIterations += 100;
+         elapsed = GetRunTime64()-startTime;
+      }
+      nanosPerMessage[lazy] = (1000.0*elapsed)/numIterations;
+   }
+   printf("%12u  %12u  %14.0f  %18.0f\n", (unsigned) numStrings, (unsigned) origBuf()->GetNumBytes(), nanosPerMessage[0], nanosPerMessage[1]);
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   uint64 microsPerTrial = SecondsToMicros(1);
+   const char * s;
+   if (args.FindString("millis", &s) == B_NO_ERROR) microsPerTrial = MillisToMicros(muscleMax((uint64)1, (uint64)atol(s)));
+
+   TestCorrectness();
+   if (_numFailures > 0)
+   {
+      printf("%i correctness checks failed!\n", _numFailures);
+      return 10;
+   }
+   printf("Correctness checks passed.\n\n");
+
+   printf("Nanoseconds to unflatten, inspect, and re-flatten a Message:\n");
+   printf("%12s  %12s  %14s  %18s\n", "Strings", "Flat bytes", "Unflatten()", "UnflattenLazily()");
+   const uint32 stringCounts[] = {0, 10, 100, 1000};
+   for (uint32 i=0; i<ARRAYITEMS(stringCounts); i++) RunBenchmark(stringCounts[i], microsPerTrial);
+   if (_numFailures > 0)
+   {
+      printf("Benchmark failed!\n");
+      return 10;
+   }
+   return 0;
+}
@@ -0,0 +1,289 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "dataio/ByteBufferDataIO.h"
+#include "dataio/TCPSocketDataIO.h"
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/StorageReflectConstants.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/NetworkUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program tests MessageIOGateway's priority scheduling and interleaving.  First it checks that queued Messages
+// are sent in priority order.  Then it sends a large bulk-data Message over a TCP socket pair, queues a small
+// high-priority control Message once the bulk transfer is under way, and prints how many bytes the receiver had
+// to read before the control Message arrived:  with plain FIFO output, with interleaving negotiated, and with
+// interleaving requested of a peer that doesn't support it (which must fall back to sending whole Messages).
+// It also feeds hand-made chunk streams to a receiving gateway, to check that chunks are refused from a peer that
+// hasn't negotiated interleaving, and that a peer can't start more concurrent chunked Messages than the limits allow.
+
+enum {
+   BULK_WHAT = 1000,
+   CONTROL_WHAT,
+   FILLER_WHAT
+};
+
+static const uint32 BULK_SIZE = 32*1024*1024;
+
+// Records the Messages it receives, and (if we're emulating a MUSCLE server) echoes any pings back as pongs
+class TestReceiver : public AbstractGatewayMessageReceiver
+{
+public:
+   TestReceiver(MessageIOGateway & gw, bool echoPings) : _gateway(gw), _echoPings(echoPings), _numBytesRead(0), _controlArrivedAfterBytes(0), _bulkIntact(false), _numOtherMessages(0) {/* empty */}
+
+   void AddBytesRead(uint32 numBytes) {_numBytesRead += numBytes;}
+
+   const Queue<uint32> & GetReceivedWhatCodes() const {return _whatCodes;}
+   uint64 GetControlArrivedAfterBytes() const {return _controlArrivedAfterBytes;}
+   bool IsBulkIntact() const {return _bulkIntact;}
+   uint32 GetNumOtherMessages() const {return _numOtherMessages;}
+
+protected:
+   virtual void MessageReceivedFromGateway(const MessageRef & msg, void * /*userData*/)
+   {
+      if (msg()->what != PR_COMMAND_PING) (void) _whatCodes.AddTail(msg()->what);
+      switch(msg()->what)
+      {
+         case BULK_WHAT:
+         {
+            const void * data;
+            uint32 numBytes;
+            _bulkIntact = ((msg()->FindData("data", B_RAW_TYPE, &data, &numBytes) == B_NO_ERROR)&&(numBytes == BULK_SIZE));
+            for (uint32 i=0; ((_bulkIntact)&&(i<numBytes)); i+=4099) if (((const uint8 *)data)[i] != (uint8)(i%251)) _bulkIntact = false;
+         }
+         break;
+
+         case CONTROL_WHAT:
+            _controlArrivedAfterBytes = _numBytesRead;
+         break;
+
+         case PR_COMMAND_PING:
+            if (_echoPings)
+            {
+               // This is what StorageReflectSession does with a ping
+               msg()->what = PR_RESULT_PONG;
+               (void) _gateway.AddOutgoingMessage(msg);
+               break;
+            }
+         // fall through!
+         default:
+            _numOtherMessages++;
+         break;
+      }
+   }
+
+private:
+   MessageIOGateway & _gateway;
+   const bool _echoPings;
+   uint64 _numBytesRead;
+   uint64 _controlArrivedAfterBytes;
+   Queue<uint32> _whatCodes;
+   bool _bulkIntact;
+   uint32 _numOtherMessages;
+};
+
+// Lets both gateways do some I/O.  Returns B_ERROR if either of them failed.
+static status_t Exchange(MessageIOGateway & sender, TestReceiver & senderReceiver, MessageIOGateway & receiver, TestReceiver & receiverReceiver, uint32 maxSendBytes)
+{
+   if ((sender.HasBytesToOutput())&&(sender.DoOutput(maxSendBytes) < 0)) return B_ERROR;
+   if ((receiver.HasBytesToOutput())&&(receiver.DoOutput() < 0)) return B_ERROR;
+
+   int32 numRead;
+   while((numRead = receiver.DoInput(receiverReceiver)) > 0) receiverReceiver.AddBytesRead(numRead);
+   if (numRead < 0) return B_ERROR;
+
+   while((numRead = sender.DoInput(senderReceiver)) > 0) senderReceiver.AddBytesRead(numRead);
+   return (numRead < 0) ? B_ERROR : B_NO_ERROR;
+}
+
+static status_t SetupGatewayPair(MessageIOGateway & a, MessageIOGateway & b)
+{
+   ConstSocketRef sa, sb;
+   if (CreateConnectedSocketPair(sa, sb) != B_NO_ERROR) {printf("ERROR:  CreateConnectedSocketPair() failed!\n"); return B_ERROR;}
+
+   TCPSocketDataIO * da = newnothrow TCPSocketDataIO(sa, false);
+   TCPSocketDataIO * db = newnothrow TCPSocketDataIO(sb, false);
+   if ((da == NULL)||(db == NULL)) {WARN_OUT_OF_MEMORY; delete da; delete db; return B_ERROR;}
+
+   a.SetDataIO(DataIORef(da));
+   b.SetDataIO(DataIORef(db));
+   return B_NO_ERROR;
+}
+
+// Queues up some Messages before sending any of them, and checks that they are received in priority order
+static status_t TestPriorityOrder()
+{
+   MessageIOGateway sender, receiver;
+   if (SetupGatewayPair(sender, receiver) != B_NO_ERROR) return B_ERROR;
+   if ((sender.SetPriorityForWhatCode(CONTROL_WHAT, 10) != B_NO_ERROR)||(sender.SetPriorityForWhatCode(BULK_WHAT, -5) != B_NO_ERROR)) return B_ERROR;
+
+   const uint32 sendOrder[]     = {BULK_WHAT, FILLER_WHAT, CONTROL_WHAT, FILLER_WHAT, BULK_WHAT, CONTROL_WHAT};
+   const uint32 expectedOrder[] = {CONTROL_WHAT, CONTROL_WHAT, FILLER_WHAT, FILLER_WHAT, BULK_WHAT, BULK_WHAT};
+   for (uint32 i=0; i<ARRAYITEMS(sendOrder); i++)
+   {
+      MessageRef msg = GetMessageFromPool(sendOrder[i]);
+      if ((msg() == NULL)||(msg()->AddInt32("index", i) != B_NO_ERROR)||(sender.AddOutgoingMessage(msg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   }
+
+   TestReceiver senderReceiver(sender, false), receiverReceiver(receiver, false);
+   for (uint32 i=0; ((i<1000)&&(receiverReceiver.GetReceivedWhatCodes().GetNumItems() < ARRAYITEMS(expectedOrder))); i++) if (Exchange(sender, senderReceiver, receiver, receiverReceiver, MUSCLE_NO_LIMIT) != B_NO_ERROR) return B_ERROR;
+
+   const Queue<uint32> & q = receiverReceiver.GetReceivedWhatCodes();
+   bool ok = (q.GetNumItems() == ARRAYITEMS(expectedOrder));
+   for (uint32 i=0; ((ok)&&(i<ARRAYITEMS(expectedOrder))); i++) if (q[i] != expectedOrder[i]) ok = false;
+   printf("Priority order:  %s\n", ok ? "correct" : "WRONG");
+   return ok ? B_NO_ERROR : B_ERROR;
+}
+
+// Appends (msg) to (stream), with the header that a MessageIOGateway puts in front of it.  (ByteBuffers are little-endian by default)
+static status_t AppendFlattenedMessage(ByteBuffer & stream, const Message & msg)
+{
+   const uint32 oldSize  = stream.GetNumBytes();
+   const uint32 flatSize = msg.FlattenedSize();
+   if ((stream.AppendInt32(flatSize) != B_NO_ERROR)||(stream.AppendInt32(MUSCLE_MESSAGE_ENCODING_DEFAULT) != B_NO_ERROR)||(stream.SetNumBytes(oldSize+(2*sizeof(uint32))+flatSize, true) != B_NO_ERROR)) return B_ERROR;
+   msg.Flatten(stream.GetBuffer()+oldSize+(2*sizeof(uint32)));
+   return B_NO_ERROR;
+}
+
+// Appends to (stream) the first (numBytes) bytes of (flatMsg), as the first chunk of chunked-Message transfer number (transferID)
+static status_t AppendFirstChunk(ByteBuffer & stream, uint32 transferID, const ByteBuffer & flatMsg, uint32 numBytes)
+{
+   return ((stream.AppendInt32((3*sizeof(uint32))+numBytes) == B_NO_ERROR)&&(stream.AppendInt32(MUSCLE_MESSAGE_ENCODING_CHUNK) == B_NO_ERROR)
+         &&(stream.AppendInt32(transferID) == B_NO_ERROR)&&(stream.AppendInt32(0) == B_NO_ERROR)&&(stream.AppendInt32(flatMsg.GetNumBytes()) == B_NO_ERROR)
+         &&(stream.AppendBytes(flatMsg.GetBuffer(), numBytes) == B_NO_ERROR)) ? B_NO_ERROR : B_ERROR;
+}
+
+// Feeds a pong (if (withPong) is true, as if our peer had agreed to interleave), followed by the first chunks of
+// (numTransfers) chunked Messages, to a fresh MessageIOGateway (with interleaving enabled iff (enableInterleaving) is true).
+// Each chunk holds the first (chunkSize) bytes of (flatMsg).  Returns the number of Messages the gateway delivered,
+// -1 if it gave up on the stream (i.e. it was hosed), or -2 if we couldn't set up the trial.
+static int32 FeedChunks(bool enableInterleaving, bool withPong, uint32 numTransfers, const ByteBuffer & flatMsg, uint32 chunkSize, uint32 maxTotalBytes = MUSCLE_MAX_CONCURRENT_CHUNKED_BYTES)
+{
+   MessageRef pongMsg = GetMessageFromPool(PR_RESULT_PONG);
+   ByteBufferRef stream = GetByteBufferFromPool();
+   if ((pongMsg() == NULL)||(pongMsg()->AddInt32("_mioilva", 1) != B_NO_ERROR)||(stream() == NULL)) {WARN_OUT_OF_MEMORY; return -2;}
+   if ((withPong)&&(AppendFlattenedMessage(*stream(), *pongMsg()) != B_NO_ERROR)) return -2;
+   for (uint32 i=0; i<numTransfers; i++) if (AppendFirstChunk(*stream(), i, flatMsg, chunkSize) != B_NO_ERROR) return -2;
+
+   MessageIOGateway gw;
+   if (enableInterleaving) gw.SetInterleavingEnabled(true, false);
+   gw.SetMaxIncomingChunkedMessages(MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES, maxTotalBytes);
+   gw.SetDataIO(DataIORef(newnothrow ByteBufferDataIO(stream)));
+   if (gw.GetDataIO()() == NULL) {WARN_OUT_OF_MEMORY; return -2;}
+
+   QueueGatewayMessageReceiver q;
+   int32 numRead;
+   while((numRead = gw.DoInput(q)) > 0) {/* empty */}
+   return (numRead < 0) ? -1 : (int32) q.GetNumItems();
+}
+
+// Returns true iff FeedChunks() gave the expected result
+static bool CheckChunks(const char * desc, int32 result, int32 expected)
+{
+   if (result < -1) {printf("ERROR:  Couldn't set up trial [%s]!\n", desc); return false;}
+   printf("%s:  %s (expected %s)\n", desc, (result >= 0) ? String("delivered %1 Messages").Arg(result)() : "disconnected", (expected >= 0) ? String("delivered %1 Messages").Arg(expected)() : "disconnected");
+   return (result == expected);
+}
+
+// Checks that chunks are accepted only after interleaving has been negotiated, and only up to the concurrency limits
+static status_t TestChunkLimits()
+{
+   MessageRef smallMsg = GetMessageFromPool(FILLER_WHAT);
+   MessageRef bigMsg   = GetMessageFromPool(BULK_WHAT);
+   ByteBuffer smallFlat, bigFlat;
+   if ((smallMsg() == NULL)||(smallMsg()->AddInt32("index", 0) != B_NO_ERROR)||(AppendFlattenedMessage(smallFlat, *smallMsg()) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   if ((bigMsg() == NULL)||(bigMsg()->AddString("data", String().Pad(4000)) != B_NO_ERROR)||(AppendFlattenedMessage(bigFlat, *bigMsg()) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   const uint32 maxTransfers = MUSCLE_MAX_CONCURRENT_CHUNKED_MESSAGES;
+   bool ok = true;
+   if (CheckChunks("Whole-Message chunk, interleaving negotiated",            FeedChunks(true,  true,  1, smallFlat, smallFlat.GetNumBytes()), 1) == false) ok = false;
+   if (CheckChunks("Whole-Message chunk, interleaving not enabled",           FeedChunks(false, true,  1, smallFlat, smallFlat.GetNumBytes()), -1) == false) ok = false;
+   if (CheckChunks("Whole-Message chunk, interleaving not negotiated",        FeedChunks(true,  false, 1, smallFlat, smallFlat.GetNumBytes()), -1) == false) ok = false;
+   if (CheckChunks("Concurrent chunked Messages, at the limit",               FeedChunks(true,  true,  maxTransfers,   bigFlat, 100), 0) == false) ok = false;
+   if (CheckChunks("Concurrent chunked Messages, one too many",               FeedChunks(true,  true,  maxTransfers+1, bigFlat, 100), -1) == false) ok = false;
+   if (CheckChunks("Concurrent chunked Messages, at the byte limit",          FeedChunks(true,  true,  2, bigFlat, 100, 2*bigFlat.GetNumBytes()), 0) == false) ok = false;
+   if (CheckChunks("Concurrent chunked Messages, one byte over the limit",    FeedChunks(true,  true,  2, bigFlat, 100, (2*bigFlat.GetNumBytes())-1), -1) == false) ok = false;
+   return ok ? B_NO_ERROR : B_ERROR;
+}
+
+// Sends a large bulk Message, and then a small control Message once the bulk transfer is under way.
+// Returns the number of bytes the receiver read before the control Message arrived, or -1 on error.
+static int64 RunTrial(const char * desc, bool senderInterleaves, bool receiverInterleaves, bool expectNegotiated)
+{
+   MessageIOGateway sender, receiver;
+   if (SetupGatewayPair(sender, receiver) != B_NO_ERROR) return -1;
+   if (sender.SetPriorityForWhatCode(CONTROL_WHAT, 10) != B_NO_ERROR) return -1;
+   if (senderInterleaves)   sender.SetInterleavingEnabled(true);
+   if (receiverInterleaves) receiver.SetInterleavingEnabled(true, false);
+
+   TestReceiver senderReceiver(sender, false);
+   TestReceiver receiverReceiver(receiver, !receiverInterleaves);  // emulate an older MUSCLE server, which echoes pings
+
+   // Give the gateways a chance to negotiate before the bulk transfer starts
+   for (uint32 i=0; i<20; i++) if (Exchange(sender, senderReceiver, receiver, receiverReceiver, MUSCLE_NO_LIMIT) != B_NO_ERROR) return -1;
+   if (sender.IsInterleavingNegotiated() != expectNegotiated) {printf("ERROR:  Interleaving negotiated=%i, expected %i!\n", sender.IsInterleavingNegotiated(), expectNegotiated); return -1;}
+
+   ByteBufferRef bulkBuf = GetByteBufferFromPool(BULK_SIZE);
+   MessageRef bulkMsg = GetMessageFromPool(BULK_WHAT);
+   if ((bulkBuf() == NULL)||(bulkMsg() == NULL)) {WARN_OUT_OF_MEMORY; return -1;}
+   uint8 * b = bulkBuf()->GetBuffer();
+   for (uint32 i=0; i<BULK_SIZE; i++) b[i] = (uint8)(i%251);
+   if ((bulkMsg()->AddData("data", B_RAW_TYPE, b, BULK_SIZE) != B_NO_ERROR)||(sender.AddOutgoingMessage(bulkMsg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return -1;}
+   bulkBuf.Reset();
+
+   const uint64 startTime = GetRunTime64();
+   uint64 controlQueuedTime = 0, controlReceivedTime = 0;
+   for (uint32 i=0; ((i<100000)&&(receiverReceiver.GetReceivedWhatCodes().GetNumItems() < 2)); i++)
+   {
+      if (i == 4)
+      {
+         MessageRef controlMsg = GetMessageFromPool(CONTROL_WHAT);
+         if ((controlMsg() == NULL)||(sender.AddOutgoingMessage(controlMsg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return -1;}
+         controlQueuedTime = GetRunTime64();
+      }
+      if (Exchange(sender, senderReceiver, receiver, receiverReceiver, 256*1024) != B_NO_ERROR) {printf("ERROR:  I/O failed during trial [%s]!\n", desc); return -1;}
+      if ((controlReceivedTime == 0)&&(receiverReceiver.GetControlArrivedAfterBytes() > 0)) controlReceivedTime = GetRunTime64();
+   }
+   const uint64 endTime = GetRunTime64();
+
+   if ((receiverReceiver.GetReceivedWhatCodes().GetNumItems() != 2)||(receiverReceiver.IsBulkIntact() == false)||(receiverReceiver.GetNumOtherMessages() > 0)||(senderReceiver.GetNumOtherMessages() > 0))
+   {
+      printf("ERROR:  Trial [%s] didn't deliver exactly the bulk and control Messages intact!\n", desc);
+      return -1;
+   }
+
+   // The control Message should overtake the bulk Message if (and only if) interleaving was negotiated
+   if ((receiverReceiver.GetReceivedWhatCodes().Head() == CONTROL_WHAT) != expectNegotiated)
+   {
+      printf("ERROR:  Trial [%s] delivered the control Message %s the bulk Message!\n", desc, expectNegotiated ? "after" : "before");
+      return -1;
+   }
+
+   printf("%-36s  %12llu  %16llu  %14llu\n", desc, (unsigned long long) receiverReceiver.GetControlArrivedAfterBytes(), (unsigned long long) MicrosToMillis(controlReceivedTime-controlQueuedTime), (unsigned long long) MicrosToMillis(endTime-startTime));
+   return receiverReceiver.GetControlArrivedAfterBytes();
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   if (TestPriorityOrder() != B_NO_ERROR) {printf("ERROR:  Priority-order test failed!\n"); return 10;}
+   if (TestChunkLimits()   != B_NO_ERROR) {printf("ERROR:  Chunk-limit test failed!\n");    return 10;}
+
+   printf("\nControl Message queued behind a " UINT32_FORMAT_SPEC "MB bulk Message:\n", BULK_SIZE/(1024*1024));
+   printf("%-36s  %12s  %16s  %14s\n", "Mode", "Bytes before", "Control latency", "Total time");
+   const int64 fifoBytes        = RunTrial("FIFO",                                 false, false, false);
+   const int64 interleavedBytes = RunTrial("Interleaved",                          true,  true,  true);
+   const int64 fallbackBytes    = RunTrial("Interleaving requested of older peer", true,  false, false);
+   if ((fifoBytes < 0)||(interleavedBytes < 0)||(fallbackBytes < 0)) return 10;
+
+   if (interleavedBytes >= fifoBytes/2) {printf("ERROR:  Interleaving didn't let the control Message preempt the bulk Message soon enough!\n"); return 10;}
+
+   printf("All priority and interleaving checks passed.\n");
+   return 0;
+}
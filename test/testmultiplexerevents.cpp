@@ -0,0 +1,171 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "system/SetupSystem.h"
+#include "util/NetworkUtilityFunctions.h"
+#include "util/SocketMultiplexer.h"
+
+using namespace muscle;
+
+// This program checks that SocketMultiplexer reports exactly the events it should:  read- and
+// write-readiness, transient and persistent registrations (including changes to them), timeouts,
+// and file descriptors that are closed and then reused by new sockets while they are registered.
+// It is built once with the default SocketMultiplexer implementation, and (under Linux) once more
+// as testmultiplexerevents_iouring, with -DMUSCLE_USE_IOURING.
+
+#define CHECK(x) {if ((x) == false) {printf("Check failed at line %i:  %s\n", __LINE__, #x); return 10;}}
+
+static const int NUM_PAIRS = 200;
+
+// Waits (for no longer than a second) and returns true iff (fd) is then flagged as ready for the given event type
+static bool WaitForEvent(SocketMultiplexer & m, int fd, uint32 whichSet)
+{
+   return ((m.WaitForEvents(GetRunTime64()+SecondsToMicros(1)) >= 0)&&(m.IsSocketEventOfTypeFlagged(fd, whichSet)));
+}
+
+// Polls, and returns the number of flagged file descriptors (or -1 on error)
+static int PollEvents(SocketMultiplexer & m)
+{
+   return m.WaitForEvents(0);
+}
+
+static bool SendByte(const ConstSocketRef & sock)
+{
+   const char c = 'x';
+   return (SendData(sock, &c, 1, false) == 1);
+}
+
+static bool ReceiveByte(const ConstSocketRef & sock)
+{
+   char c;
+   return (ReceiveData(sock, &c, 1, false) == 1);
+}
+
+int main(int, char **)
+{
+   CompleteSetupSystem css;
+
+   SocketMultiplexer m;
+   ConstSocketRef a, b;
+   CHECK(CreateConnectedSocketPair(a, b) == B_NO_ERROR);
+   const int fdB = b.GetFileDescriptor();
+
+   // Transient read registrations
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(PollEvents(m) == 0);
+   CHECK(m.IsSocketReadyForRead(fdB) == false);
+   CHECK(SendByte(a));
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_READ));
+   CHECK(ReceiveByte(b));
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(PollEvents(m) == 0);
+
+   // A transient registration applies to one WaitForEvents() call only
+   CHECK(SendByte(a));
+   CHECK(PollEvents(m) == 0);
+   CHECK(m.IsSocketReadyForRead(fdB) == false);
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_READ));
+   CHECK(ReceiveByte(b));
+   printf("Transient read registrations OK.\n");
+
+   // Write registrations, alone and combined with read registrations on the same socket
+   CHECK(m.RegisterSocketForWriteReady(fdB) == B_NO_ERROR);
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_WRITE));
+   CHECK(m.IsSocketReadyForRead(fdB) == false);
+   CHECK(SendByte(a));
+   CHECK(m.RegisterSocketForReadReady(fdB)  == B_NO_ERROR);
+   CHECK(m.RegisterSocketForWriteReady(fdB) == B_NO_ERROR);
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_READ));
+   CHECK(m.IsSocketReadyForWrite(fdB));
+   CHECK(m.GetReadySockets().GetNumItems() == 1);
+   CHECK(ReceiveByte(b));
+   printf("Write registrations OK.\n");
+
+   // Persistent registrations, and changes to them
+   CHECK(m.RegisterPersistentSocketForEventsByTypeIndex(fdB, SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR);
+   CHECK(PollEvents(m) == 0);
+   CHECK(SendByte(a));
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_READ));
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_READ));  // still there, since we haven't read it yet
+   CHECK(ReceiveByte(b));
+   CHECK(PollEvents(m) == 0);
+   CHECK(m.RegisterSocketForWriteReady(fdB) == B_NO_ERROR);  // a transient registration on top of the persistent one
+   CHECK(WaitForEvent(m, fdB, SocketMultiplexer::FDSTATE_SET_WRITE));
+   CHECK(m.IsSocketReadyForRead(fdB) == false);
+   CHECK(PollEvents(m) == 0);  // and the transient one is gone again
+   CHECK(m.UnregisterPersistentSocketForEventsByTypeIndex(fdB, SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR);
+   CHECK(SendByte(a));
+   CHECK(PollEvents(m) == 0);
+   CHECK(m.IsSocketReadyForRead(fdB) == false);
+   CHECK(ReceiveByte(b));
+   printf("Persistent registrations OK.\n");
+
+   // Timeouts.  (Unless MUSCLE_USE_LIBRT is defined, GetRunTime64() counts in clock ticks, which can lag
+   // behind the clock the kernel times our wait with by up to one tick, so we allow 10 milliseconds of slack)
+   const uint64 waitStart = GetRunTime64();
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(m.WaitForEvents(waitStart+MillisToMicros(50)) == 0);
+   CHECK(GetRunTime64()+MillisToMicros(10) >= waitStart+MillisToMicros(50));
+   printf("Timeouts OK.\n");
+
+   // A socket that is closed while its registration is armed, whose file descriptor is then reused
+   CHECK(m.RegisterSocketForReadReady(fdB) == B_NO_ERROR);
+   CHECK(PollEvents(m) == 0);
+   a.Reset();
+   b.Reset();
+   CHECK(CreateConnectedSocketPair(a, b) == B_NO_ERROR);
+   const int newFDB = b.GetFileDescriptor();
+   CHECK(SendByte(a));
+   CHECK(m.RegisterSocketForReadReady(newFDB) == B_NO_ERROR);
+   CHECK(WaitForEvent(m, newFDB, SocketMultiplexer::FDSTATE_SET_READ));
+   CHECK(ReceiveByte(b));
+   CHECK(m.RegisterSocketForReadReady(newFDB) == B_NO_ERROR);
+   CHECK(PollEvents(m) == 0);
+   printf("Closed-and-reused file descriptors OK (" INT32_FORMAT_SPEC " -> " INT32_FORMAT_SPEC ").\n", (int32) fdB, (int32) newFDB);
+
+   // Many sockets at once, only some of which have data
+   Queue<ConstSocketRef> senders, receivers;
+   CHECK((senders.EnsureSize(NUM_PAIRS, true) == B_NO_ERROR)&&(receivers.EnsureSize(NUM_PAIRS, true) == B_NO_ERROR));
+   for (int i=0; i<NUM_PAIRS; i++)
+   {
+      CHECK(CreateConnectedSocketPair(senders[i], receivers[i]) == B_NO_ERROR);
+      if ((i%2) == 0) CHECK(m.RegisterPersistentSocketForEventsByTypeIndex(receivers[i].GetFileDescriptor(), SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR);
+   }
+   for (int round=0; round<3; round++)
+   {
+      int numExpected = 0;
+      for (int i=0; i<NUM_PAIRS; i++)
+      {
+         if ((i%2) != 0) CHECK(m.RegisterSocketForReadReady(receivers[i].GetFileDescriptor()) == B_NO_ERROR);
+         if (((i+round)%7) == 0) {CHECK(SendByte(senders[i])); numExpected++;}
+      }
+
+      // Data written to a local socket-pair may not be visible to the other end immediately, so we wait until it all shows up
+      Hashtable<int, int> fdToIndex;
+      for (int i=0; i<NUM_PAIRS; i++) CHECK(fdToIndex.Put(receivers[i].GetFileDescriptor(), i) == B_NO_ERROR);
+      int numReceived = 0;
+      const uint64 deadline = GetRunTime64()+SecondsToMicros(5);
+      while(numReceived < numExpected)
+      {
+         CHECK(GetRunTime64() < deadline);
+         CHECK(m.WaitForEvents(deadline) >= 0);
+         const Queue<int> & ready = m.GetReadySockets();
+         for (uint32 j=0; j<ready.GetNumItems(); j++)
+         {
+            const int idx = fdToIndex.GetWithDefault(ready[j], -1);
+            CHECK((idx >= 0)&&(((idx+round)%7) == 0)&&(m.IsSocketReadyForRead(ready[j])));
+            CHECK(ReceiveByte(receivers[idx]));
+            numReceived++;
+         }
+         for (int i=1; i<NUM_PAIRS; i+=2) CHECK(m.RegisterSocketForReadReady(receivers[i].GetFileDescriptor()) == B_NO_ERROR);
+      }
+      CHECK(PollEvents(m) == 0);
+   }
+   for (int i=0; i<NUM_PAIRS; i+=2) CHECK(m.UnregisterPersistentSocketForEventsByTypeIndex(receivers[i].GetFileDescriptor(), SocketMultiplexer::FDSTATE_SET_READ) == B_NO_ERROR);
+   printf("%i socket-pairs OK.\n", NUM_PAIRS);
+
+   printf("All SocketMultiplexer checks passed.\n");
+   return 0;
+}
@@ -0,0 +1,342 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "dataio/DataIO.h"
+#include "iogateway/PacketTunnelIOGateway.h"
+#include "util/PulseNode.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program measures how PacketTunnelIOGateway's forward error correction holds up against packet loss.
+// A sending gateway and a receiving gateway are connected by an in-memory packet channel that drops a given
+// percentage of the packets written to it, at random.  We send a few thousand Messages of various sizes (most of
+// which span several packets) through it, and print the percentage of Messages that were delivered intact,
+// for each combination of loss rate and FEC configuration.  Before that, a few specific sequences of lost and
+// reordered packets are checked, to make sure the receiver neither drops packets it could still use, nor holds
+// on to packets forever while waiting for ones that will never arrive.
+
+static const uint32 MTU = 1400;
+
+// A packet-oriented DataIO that passes packets from its Write() side to its Read() side, dropping some of them
+class LossyPacketDataIO : public DataIO
+{
+public:
+   LossyPacketDataIO(uint32 lossPercent) : _lossPercent(lossPercent), _numPacketsWritten(0) {/* empty */}
+
+   virtual int32 Read(void * buffer, uint32 size)
+   {
+      ByteBufferRef buf;
+      if (_packets.RemoveHead(buf) != B_NO_ERROR) return 0;
+
+      const uint32 numBytes = muscleMin(size, buf()->GetNumBytes());
+      memcpy(buffer, buf()->GetBuffer(), numBytes);
+      return numBytes;
+   }
+
+   virtual int32 Write(const void * buffer, uint32 size)
+   {
+      _numPacketsWritten++;
+      if ((uint32)(rand()%100) >= _lossPercent)
+      {
+         ByteBufferRef buf = GetByteBufferFromPool(size, (const uint8 *) buffer);
+         if ((buf() == NULL)||(_packets.AddTail(buf) != B_NO_ERROR)) return -1;
+      }
+      return size;
+   }
+
+   virtual status_t Seek(int64 /*seekOffset*/, int /*whence*/) {return B_ERROR;}
+   virtual int64 GetPosition() const {return -1;}
+   virtual void FlushOutput() {/* empty */}
+   virtual void Shutdown() {_packets.Clear();}
+   virtual const ConstSocketRef & GetReadSelectSocket()  const {return GetNullSocket();}
+   virtual const ConstSocketRef & GetWriteSelectSocket() const {return GetNullSocket();}
+   virtual uint32 GetPacketMaximumSize() const {return MTU;}
+
+   uint32 GetNumPacketsWritten() const {return _numPacketsWritten;}
+
+private:
+   const uint32 _lossPercent;
+   uint32 _numPacketsWritten;
+   Queue<ByteBufferRef> _packets;
+};
+
+// A packet-oriented DataIO that records the packets written to it, and delivers only the ones it is told to, in the order it is told to
+class ScriptedPacketDataIO : public DataIO
+{
+public:
+   ScriptedPacketDataIO() {/* empty */}
+
+   virtual int32 Read(void * buffer, uint32 size)
+   {
+      ByteBufferRef buf;
+      if (_deliverable.RemoveHead(buf) != B_NO_ERROR) return 0;
+
+      const uint32 numBytes = muscleMin(size, buf()->GetNumBytes());
+      memcpy(buffer, buf()->GetBuffer(), numBytes);
+      return numBytes;
+   }
+
+   virtual int32 Write(const void * buffer, uint32 size)
+   {
+      ByteBufferRef buf = GetByteBufferFromPool(size, (const uint8 *) buffer);
+      return ((buf())&&(_written.AddTail(buf) == B_NO_ERROR)) ? (int32)size : -1;
+   }
+
+   virtual status_t Seek(int64 /*seekOffset*/, int /*whence*/) {return B_ERROR;}
+   virtual int64 GetPosition() const {return -1;}
+   virtual void FlushOutput() {/* empty */}
+   virtual void Shutdown() {_written.Clear(); _deliverable.Clear();}
+   virtual const ConstSocketRef & GetReadSelectSocket()  const {return GetNullSocket();}
+   virtual const ConstSocketRef & GetWriteSelectSocket() const {return GetNullSocket();}
+   virtual uint32 GetPacketMaximumSize() const {return MTU;}
+
+   uint32 GetNumPacketsWritten() const {return _written.GetNumItems();}
+   status_t Deliver(uint32 packetIdx) {return (packetIdx < _written.GetNumItems()) ? _deliverable.AddTail(_written[packetIdx]) : B_ERROR;}
+
+private:
+   Queue<ByteBufferRef> _written;
+   Queue<ByteBufferRef> _deliverable;
+};
+
+static void GetExpectedPayload(uint32 msgIdx, String & retPayload)
+{
+   const uint32 len = 10+((msgIdx*7919)%(5*MTU));  // anywhere from one to six packets' worth
+   retPayload.Clear();
+   (void) retPayload.Prealloc(len);
+   for (uint32 i=0; i<len; i++) retPayload += (char)('a'+((i+msgIdx)%26));
+}
+
+// Checks every Message we receive, and counts the ones that arrived intact
+class FECTestReceiver : public AbstractGatewayMessageReceiver
+{
+public:
+   FECTestReceiver() : _numReceived(0), _nextMinIndex(0), _errorCount(0) {/* empty */}
+
+   uint32 GetNumReceived() const {return _numReceived;}
+   uint32 GetErrorCount() const {return _errorCount;}
+
+protected:
+   virtual void MessageReceivedFromGateway(const MessageRef & msg, void * /*userData*/)
+   {
+      String expected;
+      const String * payload;
+      GetExpectedPayload(msg()->what, expected);
+      if ((msg()->what < _nextMinIndex)||(msg()->FindString("payload", &payload) != B_NO_ERROR)||(*payload != expected))
+      {
+         printf("ERROR:  Message #" UINT32_FORMAT_SPEC " was corrupt, duplicated, or out of order!\n", msg()->what);
+         _errorCount++;
+      }
+      else _numReceived++;
+      _nextMinIndex = msg()->what+1;
+   }
+
+private:
+   uint32 _numReceived;
+   uint32 _nextMinIndex;
+   uint32 _errorCount;
+};
+
+// Sends (numMessages) Messages over a channel with the given loss rate.  Returns the number of Messages
+// that arrived intact, or -1 on error.  (retNumPackets) is set to the number of packets the sender sent.
+static int32 RunTrial(uint32 numMessages, uint32 lossPercent, uint32 numData, uint32 numParity, uint32 & retNumPackets)
+{
+   srand(12345+lossPercent);  // so that every FEC configuration sees the same sequence of losses
+
+   LossyPacketDataIO * channel = newnothrow LossyPacketDataIO(lossPercent);
+   if (channel == NULL) {WARN_OUT_OF_MEMORY; return -1;}
+   DataIORef channelRef(channel);
+
+   PacketTunnelIOGateway sender(AbstractMessageIOGatewayRef(), MTU);
+   PacketTunnelIOGateway receiver(AbstractMessageIOGatewayRef(), MTU);
+   sender.SetDataIO(channelRef);
+   receiver.SetDataIO(channelRef);
+   if ((numParity > 0)&&(sender.SetForwardErrorCorrection(numData, numParity) != B_NO_ERROR))
+   {
+      printf("ERROR:  SetForwardErrorCorrection(" UINT32_FORMAT_SPEC ", " UINT32_FORMAT_SPEC ") failed!\n", numData, numParity);
+      return -1;
+   }
+
+   FECTestReceiver messageReceiver;
+   uint32 msgIdx = 0;
+   while(msgIdx < numMessages)
+   {
+      // Send the Messages in bursts of various sizes, so that some FEC groups get ended early
+      const uint32 burstSize = 1+(msgIdx%13);
+      for (uint32 i=0; ((i<burstSize)&&(msgIdx<numMessages)); i++,msgIdx++)
+      {
+         String payload;
+         GetExpectedPayload(msgIdx, payload);
+         MessageRef msg = GetMessageFromPool(msgIdx);
+         if ((msg() == NULL)||(msg()->AddString("payload", payload) != B_NO_ERROR)||(sender.AddOutgoingMessage(msg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return -1;}
+      }
+      while(sender.HasBytesToOutput()) if (sender.DoOutput() < 0) return -1;
+
+      int32 bytesRead;
+      while((bytesRead = receiver.DoInput(messageReceiver)) > 0) {/* empty */}
+      if (bytesRead < 0) return -1;
+   }
+
+   retNumPackets = channel->GetNumPacketsWritten();
+   return (messageReceiver.GetErrorCount() > 0) ? -1 : (int32) messageReceiver.GetNumReceived();
+}
+
+// Lets us drive a gateway's Pulse() callbacks ourself, since there is no ReflectServer to do it
+class GatewayPulser : public PulseNodeManager
+{
+public:
+   uint64 GetPulseTime(PulseNode & gw, uint64 now) const
+   {
+      uint64 ret = MUSCLE_TIME_NEVER;
+      CallGetPulseTimeAux(gw, now, ret);
+      return ret;
+   }
+
+   void Pulse(PulseNode & gw, uint64 now) const {CallPulseAux(gw, now);}
+};
+
+// Sends a Message that spans three data packets, and then a small Message that fits into the end of the third one,
+// as a single FEC group with one parity packet.  Then delivers only the packets at the given indices (the data packets
+// are #0-#2 and the parity packet is #3), in the given order, and returns the what-codes of the Messages that were received
+// (before and after waiting long enough for any held packets to be given up on), or an empty String on error.
+// If (pulseOnly) is true, then after the first pass no more DoInput() calls are made (as if no more traffic arrived),
+// so any held packets have to be passed on by the receiving gateway's Pulse() callback instead.
+static String RunScriptedTrial(const uint32 * deliveryOrder, uint32 numToDeliver, bool pulseOnly)
+{
+   ScriptedPacketDataIO * channel = newnothrow ScriptedPacketDataIO;
+   if (channel == NULL) {WARN_OUT_OF_MEMORY; return String();}
+   DataIORef channelRef(channel);
+
+   PacketTunnelIOGateway sender(AbstractMessageIOGatewayRef(), MTU);
+   PacketTunnelIOGateway receiver(AbstractMessageIOGatewayRef(), MTU);
+   sender.SetDataIO(channelRef);
+   receiver.SetDataIO(channelRef);
+   if (sender.SetForwardErrorCorrection(4, 1) != B_NO_ERROR) return String();
+
+   MessageRef bigMsg   = GetMessageFromPool(1);
+   MessageRef smallMsg = GetMessageFromPool(2);
+   if ((bigMsg() == NULL)||(bigMsg()->AddString("payload", String().Pad((2*MTU)+(MTU/4))) != B_NO_ERROR)||(smallMsg() == NULL)||(smallMsg()->AddString("payload", "small") != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return String();}
+   if ((sender.AddOutgoingMessage(bigMsg) != B_NO_ERROR)||(sender.AddOutgoingMessage(smallMsg) != B_NO_ERROR)) return String();
+   while(sender.HasBytesToOutput()) if (sender.DoOutput() < 0) return String();
+   if (channel->GetNumPacketsWritten() != 4)
+   {
+      printf("ERROR:  Expected 4 packets to be sent, but " UINT32_FORMAT_SPEC " were!\n", channel->GetNumPacketsWritten());
+      return String();
+   }
+
+   for (uint32 i=0; i<numToDeliver; i++) if (channel->Deliver(deliveryOrder[i]) != B_NO_ERROR) return String();
+
+   QueueGatewayMessageReceiver messageReceiver;
+   GatewayPulser pulser;
+   String ret = "[";
+   for (uint32 pass=0; pass<2; pass++)
+   {
+      if ((pass > 0)&&(pulseOnly))
+      {
+         ret += "] [";
+         const uint64 pulseTime = pulser.GetPulseTime(receiver, GetRunTime64());
+         if (pulseTime == MUSCLE_TIME_NEVER) continue;  // nothing was held, so there's nothing to wait for
+         if (pulseTime > GetRunTime64()+SecondsToMicros(1))
+         {
+            printf("ERROR:  Receiving gateway's Pulse() was scheduled too far in the future!\n");
+            return String();
+         }
+         uint64 now;
+         while((now = GetRunTime64()) < pulseTime) (void) Snooze64(pulseTime-now);
+         pulser.Pulse(receiver, now);
+      }
+      else
+      {
+         if (pass > 0) {(void) Snooze64(MillisToMicros(250)); ret += "] [";}  // long enough for held packets to be given up on
+
+         int32 bytesRead;
+         while((bytesRead = receiver.DoInput(messageReceiver)) > 0) {/* empty */}
+         if (bytesRead < 0) return String();
+      }
+
+      MessageRef msg;
+      while(messageReceiver.RemoveHead(msg) == B_NO_ERROR) ret += String("%1").Arg(msg()->what);
+   }
+   return ret + "]";
+}
+
+// Returns true iff the given delivery order results in the given Messages being received
+static bool CheckScriptedTrial(const char * desc, const uint32 * deliveryOrder, uint32 numToDeliver, const char * expected, bool pulseOnly = false)
+{
+   const String result = RunScriptedTrial(deliveryOrder, numToDeliver, pulseOnly);
+   printf("%s:  received %s (expected %s)\n", desc, result(), expected);
+   return (result == expected);
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   uint32 numMessages = 3000;
+   const char * s;
+   if (args.FindString("messages", &s) == B_NO_ERROR) numMessages = muscleMax((uint32)1, (uint32)atol(s));
+
+   {
+      const uint32 inOrder[]         = {0, 1, 2, 3};
+      const uint32 parityFirst[]     = {0, 3, 2, 1};  // the parity packet arrives before two of its data packets
+      const uint32 oneLost[]         = {0, 2, 3};     // #1 is reconstructed from the parity packet
+      const uint32 lastParityLost[]  = {0, 2};        // #1 can't be reconstructed, so #2 is passed on without it, eventually
+      bool ok = true;
+      if (CheckScriptedTrial("In order",                inOrder,        ARRAYITEMS(inOrder),        "[12] []") == false) ok = false;
+      if (CheckScriptedTrial("Parity packet first",     parityFirst,    ARRAYITEMS(parityFirst),    "[12] []") == false) ok = false;
+      if (CheckScriptedTrial("One data packet lost",    oneLost,        ARRAYITEMS(oneLost),        "[12] []") == false) ok = false;
+      if (CheckScriptedTrial("Parity packet lost too",  lastParityLost, ARRAYITEMS(lastParityLost), "[] [2]")  == false) ok = false;
+      if (CheckScriptedTrial("Then traffic stops",      lastParityLost, ARRAYITEMS(lastParityLost), "[] [2]", true) == false) ok = false;  // only Pulse() can pass #2 on
+      if (ok == false) {printf("ERROR:  Scripted FEC checks failed!\n"); return 10;}
+      printf("Scripted FEC checks passed.\n\n");
+   }
+
+   const uint32 lossPercents[] = {0, 1, 2, 5, 10, 20};
+   const uint32 fecConfigs[][2] = {{0, 0}, {8, 1}, {8, 2}, {4, 2}};  // (data packets, parity packets) per group
+   uint32 delivered[ARRAYITEMS(lossPercents)][ARRAYITEMS(fecConfigs)];
+   uint32 numPackets[ARRAYITEMS(fecConfigs)];
+
+   printf("Percentage of " UINT32_FORMAT_SPEC " Messages delivered, by packet loss rate and FEC configuration:\n", numMessages);
+   printf("%10s", "Loss");
+   for (uint32 c=0; c<ARRAYITEMS(fecConfigs); c++)
+   {
+      char buf[32];
+      if (fecConfigs[c][1] > 0) sprintf(buf, "FEC %u+%u", (unsigned) fecConfigs[c][0], (unsigned) fecConfigs[c][1]);
+                           else strcpy(buf, "No FEC");
+      printf("  %10s", buf);
+   }
+   printf("\n");
+
+   for (uint32 l=0; l<ARRAYITEMS(lossPercents); l++)
+   {
+      printf("%9u%%", (unsigned) lossPercents[l]);
+      for (uint32 c=0; c<ARRAYITEMS(fecConfigs); c++)
+      {
+         uint32 packetsSent = 0;
+         const int32 numDelivered = RunTrial(numMessages, lossPercents[l], fecConfigs[c][0], fecConfigs[c][1], packetsSent);
+         if (numDelivered < 0) {printf("\nERROR:  Trial failed!\n"); return 10;}
+
+         delivered[l][c] = numDelivered;
+         if (l == 0) numPackets[c] = packetsSent;
+         printf("  %9.2f%%", (100.0*numDelivered)/numMessages);
+      }
+      printf("\n");
+   }
+
+   printf("%10s", "Packets");
+   for (uint32 c=0; c<ARRAYITEMS(fecConfigs); c++) printf("  %10u", (unsigned) numPackets[c]);
+   printf("\n");
+
+   int ret = 0;
+   for (uint32 c=0; c<ARRAYITEMS(fecConfigs); c++)
+   {
+      if (delivered[0][c] != numMessages) {printf("ERROR:  Not every Message was delivered when there was no packet loss!\n"); ret = 10;}
+      if ((c > 0)&&(delivered[3][c] <= delivered[3][0])) {printf("ERROR:  FEC didn't improve delivery at 5%% packet loss!\n"); ret = 10;}
+   }
+   if (ret == 0) printf("All FEC checks passed.\n");
+   return ret;
+}
@@ -73,9 +73,76 @@ protected:
 };
 
 
+// A UDPSocketDataIO that moves just one packet per system call, as UDPSocketDataIO used to
+class SinglePacketUDPSocketDataIO : public UDPSocketDataIO
+{
+public:
+   SinglePacketUDPSocketDataIO(const ConstSocketRef & sock) : UDPSocketDataIO(sock, false) {/* empty */}
+
+   virtual int32 ReadPackets(PacketIOVec * packets, uint32 numPackets) {return DataIO::ReadPackets(packets, numPackets);}
+   virtual int32 WritePackets(const PacketIOVec * packets, uint32 numPackets) {return DataIO::WritePackets(packets, numPackets);}
+};
+
+// Sends (numPackets) packets (one Message per packet) from one PacketTunnelIOGateway to another over
+// localhost UDP, in bursts of (burstSize) packets, and returns the number of packets per second achieved,
+// or a negative value on error.
+static double RunBenchmark(bool batched, uint32 numPackets, uint32 burstSize, uint32 mtu, uint32 magic)
+{
+   ConstSocketRef sendSock = CreateUDPSocket();
+   ConstSocketRef recvSock = CreateUDPSocket();
+   uint16 recvPort = 0;
+   if ((sendSock() == NULL)||(recvSock() == NULL)||(BindUDPSocket(sendSock, 0) != B_NO_ERROR)||(BindUDPSocket(recvSock, 0, &recvPort) != B_NO_ERROR))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Error setting up localhost UDP sockets!\n");
+      return -1.0;
+   }
+
+   UDPSocketDataIO * sendIO = batched ? new UDPSocketDataIO(sendSock, false) : new SinglePacketUDPSocketDataIO(sendSock);
+   UDPSocketDataIO * recvIO = batched ? new UDPSocketDataIO(recvSock, false) : new SinglePacketUDPSocketDataIO(recvSock);
+   sendIO->SetSendDestination(IPAddressAndPort(localhostIP, recvPort));
+
+   PacketTunnelIOGateway sendGW(AbstractMessageIOGatewayRef(), mtu, magic);
+   PacketTunnelIOGateway recvGW(AbstractMessageIOGatewayRef(), mtu, magic);
+   sendGW.SetDataIO(DataIORef(sendIO));
+   recvGW.SetDataIO(DataIORef(recvIO));
+
+   // Each Message is too big to share a packet with another one, but small enough to fit into a packet by itself
+   const uint32 spamLen = (mtu*2)/3;
+   String spam;
+   for (uint32 i=0; i<spamLen; i++) spam += (char) ('A'+(((char)i)%26));
+
+   TestPacketGatewayMessageReceiver receiver;
+   SocketMultiplexer multiplexer;
+   const int recvFD = recvSock.GetFileDescriptor();
+   _sendWhatCounter = _recvWhatCounter = 0;
+
+   const uint64 startTime = GetRunTime64();
+   while(_recvWhatCounter < numPackets)
+   {
+      for (uint32 i=0; (i<burstSize)&&(_sendWhatCounter < numPackets); i++)
+      {
+         MessageRef m = GetMessageFromPool(_sendWhatCounter++);
+         if ((m() == NULL)||(m()->AddString("spam", spam) != B_NO_ERROR)||(m()->AddInt32("spamlen", spamLen) != B_NO_ERROR)||(sendGW.AddOutgoingMessage(m) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return -1.0;}
+      }
+      while(sendGW.HasBytesToOutput()) if (sendGW.DoOutput() < 0) {LogTime(MUSCLE_LOG_CRITICALERROR, "DoOutput() failed!\n"); return -1.0;}
+
+      // Wait for the whole burst to arrive before sending the next one, so that the receiving socket's buffer can't overflow
+      while(_recvWhatCounter < _sendWhatCounter)
+      {
+         (void) multiplexer.RegisterSocketForReadReady(recvFD);
+         if (multiplexer.WaitForEvents(GetRunTime64()+MICROS_PER_SECOND) < 0) return -1.0;
+         if (multiplexer.IsSocketReadyForRead(recvFD) == false) {LogTime(MUSCLE_LOG_CRITICALERROR, "Timed out waiting for packet #" UINT32_FORMAT_SPEC "!\n", _recvWhatCounter); return -1.0;}
+         if (recvGW.DoInput(receiver) < 0) {LogTime(MUSCLE_LOG_CRITICALERROR, "DoInput() failed!\n"); return -1.0;}
+      }
+   }
+   return (1000000.0*numPackets)/muscleMax(GetRunTime64()-startTime, (uint64)1);
+}
+
 // This is a text based test of the PacketTunnelIOGateway class.  With this test we
 // should be able to broadcast Messages of any size over UDP, and (barring UDP lossage)
 // they should be received and properly re-assembled by the listeners.
+// If the "benchmark" argument is given, it instead measures how many packets per second
+// two PacketTunnelIOGateways can pass to each other over localhost.
 int main(int argc, char ** argv)
 {
    CompleteSetupSystem css;
@@ -98,6 +165,25 @@ int main(int argc, char ** argv)
    if (args.FindString("magic", &temp) == B_NO_ERROR) magic = atol(temp);
    if (magic == 0) magic = 666;
 
+   if (args.HasName("benchmark"))
+   {
+      // Measure packets per second over localhost, with and without batched (recvmmsg()/sendmmsg()) packet I/O
+      uint32 numPackets = 200000;
+      uint32 burstSize  = 32;
+      if (args.FindString("packets", &temp) == B_NO_ERROR) numPackets = muscleMax((uint32)1, (uint32)atol(temp));
+      if (args.FindString("burst",   &temp) == B_NO_ERROR) burstSize  = muscleMax((uint32)1, (uint32)atol(temp));
+
+      printf("Sending " UINT32_FORMAT_SPEC " packets over localhost in bursts of " UINT32_FORMAT_SPEC ", mtu=" UINT32_FORMAT_SPEC "\n", numPackets, burstSize, mtu);
+      printf("%28s  %18s\n", "Packet I/O", "Packets/second");
+      for (uint32 i=0; i<2; i++)
+      {
+         const double rate = RunBenchmark(i==1, numPackets, burstSize, mtu, magic);
+         if (rate < 0.0) return 10;
+         printf("%28s  %18.0f\n", (i==1) ? "Batched (ReadPackets())" : "One packet per system call", rate);
+      }
+      return 0;
+   }
+
    uint64 spamInterval = 0;
    if (args.FindString("spam", &temp) == B_NO_ERROR)
    {
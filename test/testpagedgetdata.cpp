@@ -0,0 +1,283 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/NetworkUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks StorageReflectSession's paged and streamed PR_COMMAND_GETDATA replies.  First it pages
+// through a database while nodes are being added and removed in between pages, and checks that no node is
+// returned twice, that removed nodes aren't returned, and that every node that was present throughout gets
+// returned.  Then it streams a large query to a client over a real socket, and checks that the server's
+// event loop kept running (and the server's outgoing queue stayed short) while the results were generated.
+
+static const uint32 NUM_PAGED_NODES   = 5000;
+static const uint32 PAGE_SIZE         = 700;
+static const uint32 NUM_STREAMED_NODES = 100000;
+
+static status_t AddNodes(AbstractReflectSession * publisher, const char * prefix, uint32 firstIdx, uint32 numNodes)
+{
+   const uint32 batchSize = 1000;
+   for (uint32 i=0; i<numNodes; i+=batchSize)
+   {
+      MessageRef setMsg = GetMessageFromPool(PR_COMMAND_SETDATA);
+      if (setMsg() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      for (uint32 j=i; (j<numNodes)&&(j<i+batchSize); j++)
+      {
+         MessageRef payload = GetMessageFromPool(1234);
+         if ((payload() == NULL)||(payload()->AddInt32("value", firstIdx+j) != B_NO_ERROR)||(setMsg()->AddMessage(String(prefix).Arg(firstIdx+j), payload) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      }
+      if (SendToSession(publisher, setMsg) != B_NO_ERROR) return B_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
+static MessageRef MakeGetDataMessage(int32 maxResults, bool stream, const char * cursor)
+{
+   MessageRef getMsg = GetMessageFromPool(PR_COMMAND_GETDATA);
+   if ((getMsg() == NULL)||(getMsg()->AddString(PR_NAME_KEYS, "/*/*/items/*") != B_NO_ERROR)) return MessageRef();
+   if ((maxResults > 0)&&(getMsg()->AddInt32(PR_NAME_MAX_RESULTS, maxResults) != B_NO_ERROR)) return MessageRef();
+   if ((stream)&&(getMsg()->AddBool(PR_NAME_STREAM_RESULTS, true) != B_NO_ERROR)) return MessageRef();
+   if ((cursor)&&(getMsg()->AddString(PR_NAME_RESULTS_CURSOR, cursor) != B_NO_ERROR)) return MessageRef();
+   return getMsg;
+}
+
+// Moves the Messages in (session)'s outgoing queue into (retMessages), and then empties the queue
+static void DrainQueue(AbstractReflectSession * session, Queue<MessageRef> & retMessages)
+{
+   AbstractMessageIOGateway * gw = session->GetGateway()();
+   const Queue<MessageRef> & oq = gw->GetOutgoingMessageQueue();
+   for (uint32 i=0; i<oq.GetNumItems(); i++) (void) retMessages.AddTail(oq[i]);
+   while(gw->HasBytesToOutput()) if (gw->DoOutput() < 0) break;
+}
+
+static void AddResultNames(const Message & msg, Queue<String> & retNames)
+{
+   for (MessageFieldNameIterator iter = msg.GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++) (void) retNames.AddTail(iter.GetFieldName());
+}
+
+static int TestPagedResults()
+{
+   ReflectServer server;
+   AbstractReflectSession * sessions[2];  // publisher, reader
+   for (uint32 i=0; i<ARRAYITEMS(sessions); i++)
+   {
+      AbstractReflectSessionRef sessionRef(newnothrow StorageReflectSession);
+      if (AddOfflineSession(server, sessionRef) != B_NO_ERROR) {printf("Couldn't add session #" UINT32_FORMAT_SPEC "!\n", i); server.Cleanup(); return 10;}
+      sessions[i] = sessionRef();
+   }
+   AbstractReflectSession * publisher = sessions[0];
+   AbstractReflectSession * reader    = sessions[1];
+   const String prefix = publisher->GetSessionRootPath() + "/";  // i.e. "/hostname/sessionID/"
+
+   int ret = 0;
+   Hashtable<String, bool> expected;  // the nodes a non-paged GETDATA returns
+   if (AddNodes(publisher, "items/%1", 0, NUM_PAGED_NODES) != B_NO_ERROR) ret = 10;
+   else
+   {
+      Queue<MessageRef> msgs;
+      if (SendToSession(reader, MakeGetDataMessage(0, false, NULL)) != B_NO_ERROR) ret = 10;
+      DrainQueue(reader, msgs);
+      for (uint32 i=0; i<msgs.GetNumItems(); i++)
+      {
+         Queue<String> names; AddResultNames(*msgs[i](), names);
+         for (uint32 j=0; j<names.GetNumItems(); j++) (void) expected.Put(names[j], true);
+      }
+      if (expected.GetNumItems() != NUM_PAGED_NODES) {printf("ERROR:  Non-paged GETDATA returned " UINT32_FORMAT_SPEC " nodes, expected " UINT32_FORMAT_SPEC "\n", expected.GetNumItems(), NUM_PAGED_NODES); ret = 10;}
+   }
+
+   // Now page through the same query.  After the first page, we remove some nodes and add some others.
+   Hashtable<String, bool> returned, removedUnreturned;
+   uint32 numPages = 0;
+   String cursor;
+   bool done = false;
+   if ((ret == 0)&&(SendToSession(reader, MakeGetDataMessage(PAGE_SIZE, false, NULL)) != B_NO_ERROR)) ret = 10;
+   while((ret == 0)&&(done == false))
+   {
+      Queue<MessageRef> msgs;
+      DrainQueue(reader, msgs);
+
+      uint32 pageSize = 0;
+      bool gotEnd = false;
+      for (uint32 i=0; (ret==0)&&(i<msgs.GetNumItems()); i++)
+      {
+         const Message & msg = *msgs[i]();
+         if (msg.what == PR_RESULT_DATAITEMS)
+         {
+            if (gotEnd) {printf("ERROR:  Got results after PR_RESULT_ENDOFDATAITEMS!\n"); ret = 10;}
+            Queue<String> names; AddResultNames(msg, names);
+            for (uint32 j=0; j<names.GetNumItems(); j++)
+            {
+               const String & n = names[j];
+               if (returned.ContainsKey(n))          {printf("ERROR:  Node [%s] was returned twice!\n", n()); ret = 10;}
+               if (removedUnreturned.ContainsKey(n)) {printf("ERROR:  Node [%s] was returned after it was removed!\n", n()); ret = 10;}
+               (void) returned.Put(n, true);
+               pageSize++;
+            }
+         }
+         else if (msg.what == PR_RESULT_ENDOFDATAITEMS)
+         {
+            gotEnd = true;
+            done   = (msg.FindString(PR_NAME_RESULTS_CURSOR, cursor) != B_NO_ERROR);
+         }
+      }
+      if (ret != 0) break;
+      if (gotEnd == false) {printf("ERROR:  Page #" UINT32_FORMAT_SPEC " had no PR_RESULT_ENDOFDATAITEMS!\n", numPages); ret = 10; break;}
+      if (pageSize > PAGE_SIZE) {printf("ERROR:  Page #" UINT32_FORMAT_SPEC " held " UINT32_FORMAT_SPEC " results, limit was " UINT32_FORMAT_SPEC "\n", numPages, pageSize, PAGE_SIZE); ret = 10; break;}
+      if ((done == false)&&(pageSize < PAGE_SIZE)) {printf("ERROR:  Page #" UINT32_FORMAT_SPEC " was short (" UINT32_FORMAT_SPEC " results) but wasn't the last page\n", numPages, pageSize); ret = 10; break;}
+
+      if (numPages++ == 0)
+      {
+         // Remove 50 nodes that have already been returned and 50 that haven't, then add 50 new ones
+         uint32 numOld = 0, numNew = 0;
+         for (HashtableIterator<String, bool> iter(expected); iter.HasData(); iter++)
+         {
+            const String & n = iter.GetKey();
+            const bool wasReturned = returned.ContainsKey(n);
+            uint32 & count = wasReturned ? numOld : numNew;
+            if (count >= 50) continue;
+
+            MessageRef removeMsg = GetMessageFromPool(PR_COMMAND_REMOVEDATA);
+            if ((removeMsg() == NULL)||(removeMsg()->AddString(PR_NAME_KEYS, n.Substring(prefix.Length())) != B_NO_ERROR)||(SendToSession(publisher, removeMsg) != B_NO_ERROR)) {ret = 10; break;}
+            if ((wasReturned == false)&&(removedUnreturned.Put(n, true) != B_NO_ERROR)) {ret = 10; break;}
+            count++;
+         }
+         if ((ret == 0)&&(AddNodes(publisher, "items/new%1", 0, 50) != B_NO_ERROR)) ret = 10;
+         if ((ret == 0)&&(removedUnreturned.GetNumItems() != 50)) {printf("ERROR:  First page returned too many nodes to test removal!\n"); ret = 10;}
+      }
+      if ((ret == 0)&&(done == false)&&(SendToSession(reader, MakeGetDataMessage(PAGE_SIZE, false, cursor())) != B_NO_ERROR)) ret = 10;
+   }
+
+   // Every node that was there from start to finish must have been returned, and nothing else but the new nodes
+   for (HashtableIterator<String, bool> iter(expected); (ret==0)&&(iter.HasData()); iter++)
+   {
+      if ((removedUnreturned.ContainsKey(iter.GetKey()) == false)&&(returned.ContainsKey(iter.GetKey()) == false)) {printf("ERROR:  Node [%s] was never returned!\n", iter.GetKey()()); ret = 10;}
+   }
+   for (HashtableIterator<String, bool> iter(returned); (ret==0)&&(iter.HasData()); iter++)
+   {
+      if ((expected.ContainsKey(iter.GetKey()) == false)&&(iter.GetKey().StartsWith(prefix+"items/new") == false)) {printf("ERROR:  Unexpected node [%s] was returned!\n", iter.GetKey()()); ret = 10;}
+   }
+   if (ret == 0) printf("Paged GETDATA returned " UINT32_FORMAT_SPEC " nodes in " UINT32_FORMAT_SPEC " pages of up to " UINT32_FORMAT_SPEC ".\n", returned.GetNumItems(), numPages, PAGE_SIZE);
+
+   // An unknown cursor should be bounced back to us
+   if (ret == 0)
+   {
+      Queue<MessageRef> msgs;
+      if (SendToSession(reader, MakeGetDataMessage(PAGE_SIZE, false, "bogus")) != B_NO_ERROR) ret = 10;
+      DrainQueue(reader, msgs);
+      if ((msgs.GetNumItems() != 1)||(msgs[0]()->what != PR_RESULT_ERRORACCESSDENIED)) {printf("ERROR:  Unknown cursor wasn't bounced with PR_RESULT_ERRORACCESSDENIED!\n"); ret = 10;}
+   }
+
+   server.Cleanup();
+   return ret;
+}
+
+// Client side of the streaming test:  requests the data, and measures how promptly its Pulse() gets called while the data arrives
+class StreamClientSession : public AbstractReflectSession
+{
+public:
+   StreamClientSession(bool stream, const AbstractReflectSession * serverSession) : _stream(stream), _serverSession(serverSession), _numResults(0), _done(false), _nextTickTime(0), _maxLateness(0), _maxServerQueueLength(0), _deadline(0) {/* empty */}
+
+   virtual status_t AttachedToServer()
+   {
+      if (AbstractReflectSession::AttachedToServer() != B_NO_ERROR) return B_ERROR;
+
+      // The legacy reply ends when our PONG arrives; the streamed reply ends with a PR_RESULT_ENDOFDATAITEMS
+      MessageRef getMsg = MakeGetDataMessage(0, _stream, NULL);
+      if ((getMsg() == NULL)||(AddOutgoingMessage(getMsg) != B_NO_ERROR)||(AddOutgoingMessage(GetMessageFromPool(PR_COMMAND_PING)) != B_NO_ERROR)) return B_ERROR;
+      _deadline = GetRunTime64()+(60*MICROS_PER_SECOND);
+      return B_NO_ERROR;
+   }
+
+   virtual void MessageReceivedFromGateway(const MessageRef & msg, void *)
+   {
+      switch(msg()->what)
+      {
+         case PR_RESULT_DATAITEMS:      _numResults += msg()->GetNumNames(B_MESSAGE_TYPE); break;
+         case PR_RESULT_ENDOFDATAITEMS: if (_stream)           Finish(); break;
+         case PR_RESULT_PONG:           if (_stream == false)  Finish(); break;
+      }
+   }
+
+   virtual uint64 GetPulseTime(const PulseArgs &) {return _done ? MUSCLE_TIME_NEVER : _nextTickTime;}
+
+   virtual void Pulse(const PulseArgs & args)
+   {
+      if (_nextTickTime > 0) _maxLateness = muscleMax(_maxLateness, args.GetCallbackTime()-args.GetScheduledTime());
+      _maxServerQueueLength = muscleMax(_maxServerQueueLength, _serverSession->GetGateway()()->GetOutgoingMessageQueue().GetNumItems());
+      _nextTickTime = args.GetCallbackTime()+1000;
+      if (args.GetCallbackTime() >= _deadline) {printf("ERROR:  Timed out waiting for results!\n"); Finish();}
+   }
+
+   virtual const char * GetTypeName() const {return "StreamClient";}
+
+   const bool _stream;
+   const AbstractReflectSession * _serverSession;
+   uint32 _numResults;
+   bool _done;
+   uint64 _nextTickTime;
+   uint64 _maxLateness;
+   uint32 _maxServerQueueLength;
+
+private:
+   void Finish() {_done = true; EndServer();}
+
+   uint64 _deadline;
+};
+
+static int TestStreamedResults(bool stream, uint64 & retMaxLateness)
+{
+   ReflectServer server;
+   ConstSocketRef serverSock, clientSock;
+   if (CreateConnectedSocketPair(serverSock, clientSock) != B_NO_ERROR) {printf("ERROR:  Couldn't create socket pair!\n"); return 10;}
+
+   AbstractReflectSessionRef serverSessionRef(newnothrow StorageReflectSession);
+   if (serverSessionRef() == NULL) {WARN_OUT_OF_MEMORY; return 10;}
+   if (server.AddNewSession(serverSessionRef, serverSock) != B_NO_ERROR) {printf("ERROR:  Couldn't add server session!\n"); server.Cleanup(); return 10;}
+
+   // The server session holds the data itself, so it needs to be allowed to send its own data to its client
+   MessageRef paramsMsg = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+   if ((paramsMsg() == NULL)||(paramsMsg()->AddBool(PR_NAME_REFLECT_TO_SELF, true) != B_NO_ERROR)||(SendToSession(serverSessionRef(), paramsMsg) != B_NO_ERROR)||(AddNodes(serverSessionRef(), "items/%1", 0, NUM_STREAMED_NODES) != B_NO_ERROR)) {server.Cleanup(); return 10;}
+
+   StreamClientSession * client = newnothrow StreamClientSession(stream, serverSessionRef());
+   if (client == NULL) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 10;}
+   if (server.AddNewSession(AbstractReflectSessionRef(client), clientSock) != B_NO_ERROR) {printf("ERROR:  Couldn't add client session!\n"); server.Cleanup(); return 10;}
+
+   const uint64 startTime = GetRunTime64();
+   int ret = (server.ServerProcessLoop() == B_NO_ERROR) ? 0 : 10;
+   const uint64 elapsed = GetRunTime64()-startTime;
+
+   printf("%s GETDATA:  " UINT32_FORMAT_SPEC " results in " UINT64_FORMAT_SPEC " microseconds, event loop stalled for up to " UINT64_FORMAT_SPEC " microseconds, server queued up to " UINT32_FORMAT_SPEC " Messages\n", stream?"Streamed":"Legacy", client->_numResults, elapsed, client->_maxLateness, client->_maxServerQueueLength);
+   if (client->_numResults != NUM_STREAMED_NODES) {printf("ERROR:  Expected " UINT32_FORMAT_SPEC " results!\n", NUM_STREAMED_NODES); ret = 10;}
+   if ((stream)&&(client->_maxServerQueueLength > 32)) {printf("ERROR:  Streamed results weren't flow-controlled!\n"); ret = 10;}
+   retMaxLateness = client->_maxLateness;
+
+   server.Cleanup();
+   return ret;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   int ret = TestPagedResults();
+
+   uint64 legacyLateness = 0, streamedLateness = 0;
+   if (ret == 0) ret = TestStreamedResults(false, legacyLateness);
+   if (ret == 0) ret = TestStreamedResults(true,  streamedLateness);
+
+   // The streamed query gives up the event loop every few milliseconds (allow for a coarse system clock)
+   if ((ret == 0)&&(streamedLateness > 50000)) {printf("ERROR:  Streamed GETDATA stalled the event loop!\n"); ret = 10;}
+
+   if (ret == 0) printf("All paged/streamed GETDATA checks passed.\n");
+   return ret;
+}
@@ -4,10 +4,88 @@
 
 #include "message/Message.h"
 #include "system/SetupSystem.h"
+#include "system/Thread.h"
 #include "util/TimeUtilityFunctions.h"  // for Snooze64()
 
 using namespace muscle;
 
+static const uint32 NUM_THREADS = 8;
+
+// Each PoolStressThread obtains and releases Messages in bursts, and verifies that no Message it holds
+// is ever handed out to another thread at the same time.  If a Queue is supplied, the thread instead
+// leaves its Messages in its own section of that Queue, so that the main thread can release them.
+class PoolStressThread : public Thread
+{
+public:
+   PoolStressThread() : _threadIndex(0), _numObjects(0), _retQ(NULL), _errorCount(0) {/* empty */}
+
+   void SetParameters(uint32 threadIndex, uint32 numObjects, Queue<MessageRef> * optRetQ)
+   {
+      _threadIndex = threadIndex;
+      _numObjects  = numObjects;
+      _retQ        = optRetQ;
+   }
+
+   uint32 GetErrorCount() const {return _errorCount;}
+
+protected:
+   virtual void InternalThreadEntry()
+   {
+      const uint32 BURST_SIZE = 16;
+      MessageRef burst[BURST_SIZE];
+      for (uint32 i=0; i<_numObjects; i+=BURST_SIZE)
+      {
+         const uint32 numInBurst = muscleMin(BURST_SIZE, _numObjects-i);
+         for (uint32 j=0; j<numInBurst; j++)
+         {
+            burst[j] = GetMessageFromPool(GetTag(i+j));
+            if (burst[j]() == NULL) {_errorCount++; return;}
+         }
+         for (uint32 j=0; j<numInBurst; j++)
+         {
+            if (burst[j]()->what != GetTag(i+j)) _errorCount++;
+            if (_retQ) (*_retQ)[(_threadIndex*_numObjects)+i+j].SwapContents(burst[j]);
+                  else burst[j].Reset();
+         }
+      }
+   }
+
+private:
+   uint32 GetTag(uint32 i) const {return (_threadIndex<<24)|(i&0x00FFFFFF);}
+
+   uint32 _threadIndex;
+   uint32 _numObjects;
+   Queue<MessageRef> * _retQ;
+   uint32 _errorCount;
+};
+
+// Runs NUM_THREADS PoolStressThreads at once, and then checks that the Message pool is left
+// with no outstanding Messages once they have all exited.  Returns B_NO_ERROR on success.
+static status_t RunStressThreads(uint32 numObjectsPerThread, Queue<MessageRef> * optRetQ)
+{
+   PoolStressThread threads[NUM_THREADS];
+   for (uint32 i=0; i<NUM_THREADS; i++)
+   {
+      threads[i].SetParameters(i, numObjectsPerThread, optRetQ);
+      if (threads[i].StartInternalThread() != B_NO_ERROR) {printf("Couldn't start thread #" UINT32_FORMAT_SPEC "!\n", i); return B_ERROR;}
+   }
+
+   uint32 numErrors = 0;
+   for (uint32 i=0; i<NUM_THREADS; i++)
+   {
+      (void) threads[i].WaitForInternalThreadToExit();
+      numErrors += threads[i].GetErrorCount();
+   }
+   if (optRetQ) optRetQ->Clear();  // release all of the threads' Messages from the main thread
+
+   if (numErrors > 0) {printf("ERROR, " UINT32_FORMAT_SPEC " Messages were handed out to more than one thread at once!\n", numErrors); return B_ERROR;}
+
+   MessageRef::ItemPool * pool = GetMessagePool();
+   pool->Drain();
+   if (pool->GetNumAllocatedItemSlots() > 0) {printf("ERROR, " UINT32_FORMAT_SPEC " Message slots are still allocated after all threads exited!\n", pool->GetNumAllocatedItemSlots()); return B_ERROR;}
+   return B_NO_ERROR;
+}
+
 // This program tests the relative speeds of various object allocation strategies.
 int main(int argc, char ** argv)
 {
@@ -72,8 +150,22 @@ int main(int argc, char ** argv)
       }
       break;
 
+      case 8:
+      {
+         // Several threads obtaining and releasing Messages from the pool at once
+         if (RunStressThreads(NUM_OBJECTS/NUM_THREADS, NULL) != B_NO_ERROR) return 10;
+      }
+      break;
+
+      case 9:
+      {
+         // As above, but the Messages are all released by the main thread instead of the threads that obtained them
+         if (RunStressThreads(NUM_OBJECTS/NUM_THREADS, &tempQ) != B_NO_ERROR) return 10;
+      }
+      break;
+
       default:
-         printf("Usage:  testpools <testnum>   (where testnum is between 1 and 6)\n");
+         printf("Usage:  testpools <testnum>   (where testnum is between 1 and 9)\n");
       break;
    }
 
@@ -76,6 +76,103 @@ private:
    Queue<TestPulseChild *> _tpcs;
 };
 
+// In benchmark mode, we drive a tree of PulseNodes directly with simulated time values (instead of
+// waiting for real time to pass in a ReflectServer) and measure how long the scheduling itself takes.
+static const uint64 BENCHMARK_SPAN = 60*1000000;  // children are scheduled up to 60 seconds in the future
+
+static uint64 GetRandomDelay() {return ((((uint64)rand())<<16)^((uint64)rand())) % BENCHMARK_SPAN;}
+
+class BenchmarkPulseChild : public PulseNode
+{
+public:
+   BenchmarkPulseChild() : _nextTime(MUSCLE_TIME_NEVER), _numPulses(0) {/* empty */}
+
+   virtual uint64 GetPulseTime(const PulseArgs &) {return _nextTime;}
+
+   virtual void Pulse(const PulseArgs & args)
+   {
+      _numPulses++;
+      _nextTime = args.GetCallbackTime()+GetRandomDelay();
+   }
+
+   void Reschedule(uint64 nextTime) {_nextTime = nextTime; InvalidatePulseTime();}
+
+   uint32 GetNumPulses() const {return _numPulses;}
+
+private:
+   uint64 _nextTime;
+   uint32 _numPulses;
+};
+
+class BenchmarkPulseNodeManager : public PulseNodeManager
+{
+public:
+   uint64 GetPulseTime(PulseNode & root, uint64 now) const {uint64 min = MUSCLE_TIME_NEVER; CallGetPulseTimeAux(root, now, min); return min;}
+   void Pulse(PulseNode & root, uint64 now) const {CallPulseAux(root, now);}
+};
+
+static int RunBenchmark(const Message & args)
+{
+   uint32 numChildren = 100000;
+   const char * s;
+   if (args.FindString("children", &s) == B_NO_ERROR) numChildren = muscleMax((uint32)1, (uint32)atol(s));
+
+   BenchmarkPulseChild * children = newnothrow_array(BenchmarkPulseChild, numChildren);
+   if (children == NULL) {WARN_OUT_OF_MEMORY; return 10;}
+
+   BenchmarkPulseNodeManager manager;
+   PulseNode root;
+   srand(12345);
+
+   // Phase 1:  schedule all the children at random times
+   uint64 now = 0;
+   uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<numChildren; i++)
+   {
+      children[i].Reschedule(now+GetRandomDelay());
+      if (root.PutPulseChild(&children[i]) != B_NO_ERROR) {printf("PutPulseChild() failed!\n"); delete [] children; return 10;}
+   }
+   (void) manager.GetPulseTime(root, now);
+   const uint64 scheduleTime = GetRunTime64()-startTime;
+
+   // Phase 2:  reschedule randomly-chosen children, recalculating after every 100 changes, as an event loop would
+   startTime = GetRunTime64();
+   for (uint32 i=0; i<numChildren; i++)
+   {
+      children[rand()%numChildren].Reschedule(now+GetRandomDelay());
+      if ((i%100) == 99) (void) manager.GetPulseTime(root, now);
+   }
+   (void) manager.GetPulseTime(root, now);
+   const uint64 rescheduleTime = GetRunTime64()-startTime;
+
+   // Phase 3:  advance the clock through the scheduled span, 10 milliseconds at a time, Pulse()-ing the children that are due
+   startTime = GetRunTime64();
+   const uint64 endTime = now+BENCHMARK_SPAN;
+   while(now < endTime)
+   {
+      now += 10*1000;
+      manager.Pulse(root, now);
+      if (manager.GetPulseTime(root, now) <= now)
+      {
+         printf("Error, a child that was due at or before " UINT64_FORMAT_SPEC " wasn't Pulse()'d!\n", now);
+         delete [] children;
+         return 10;
+      }
+   }
+   const uint64 pulseTime = GetRunTime64()-startTime;
+
+   uint32 numPulses = 0;
+   for (uint32 i=0; i<numChildren; i++) numPulses += children[i].GetNumPulses();
+
+   root.ClearPulseChildren();
+   delete [] children;
+
+   printf("Scheduling " UINT32_FORMAT_SPEC " children took " UINT64_FORMAT_SPEC " ms.\n", numChildren, scheduleTime/1000);
+   printf("Rescheduling " UINT32_FORMAT_SPEC " children took " UINT64_FORMAT_SPEC " ms (%.0f ns per reschedule).\n", numChildren, rescheduleTime/1000, (rescheduleTime*1000.0)/numChildren);
+   printf("Pulsing " UINT32_FORMAT_SPEC " children over " UINT64_FORMAT_SPEC " simulated seconds took " UINT64_FORMAT_SPEC " ms (%.0f ns per Pulse()).\n", numPulses, BENCHMARK_SPAN/1000000, pulseTime/1000, (pulseTime*1000.0)/muscleMax(numPulses, (uint32)1));
+   return 0;
+}
+
 int main(int argc, char ** argv) 
 {
    CompleteSetupSystem css;  // set up our environment
@@ -83,6 +180,8 @@ int main(int argc, char ** argv)
    Message args; (void) ParseArgs(argc, argv, args);
    HandleStandardDaemonArgs(args);
 
+   if (args.HasName("benchmark")) return RunBenchmark(args);
+
    ReflectServer server;
    TestSession session;
 
@@ -0,0 +1,163 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "reflector/DumbReflectSession.h"
+#include "reflector/HierarchicalRateLimitSessionIOPolicy.h"
+#include "system/SetupSystem.h"
+
+using namespace muscle;
+
+// This program drives a HierarchicalRateLimitSessionIOPolicy through simulated I/O cycles (without
+// any actual sockets) and checks that the bandwidth it hands out adds up to its aggregate limit, is
+// divided amongst groups and sessions according to their weights, and respects per-session limits.
+
+static const uint64 SIMULATED_MICROS = 10*MICROS_PER_SECOND;
+static const uint64 CYCLE_MICROS     = 100;
+
+// Groups sessions by the names we assign them, rather than by host name (since our sessions have no hosts)
+class TestPolicy : public HierarchicalRateLimitSessionIOPolicy
+{
+public:
+   TestPolicy(uint32 maxRate) : HierarchicalRateLimitSessionIOPolicy(maxRate) {/* empty */}
+
+   Hashtable<const AbstractReflectSession *, String> _groupNames;
+
+protected:
+   virtual String GetGroupName(const PolicyHolder & holder) const {return _groupNames.GetWithDefault(holder.GetSession());}
+};
+
+class TestSession
+{
+public:
+   TestSession() : _bytesSent(0), _wantsToSendSince(0), _maxLatency(0), _bytesPending(MUSCLE_NO_LIMIT) {/* empty */}
+
+   DumbReflectSession _session;
+   uint64 _bytesSent;
+   uint64 _wantsToSendSince;  // if non-zero, when our currently pending data was queued
+   uint64 _maxLatency;        // the longest we've waited to be allowed to send
+   uint32 _bytesPending;      // MUSCLE_NO_LIMIT means we are a bulk sender that always has more data
+};
+
+// Runs the simulation; every (controlPeriod) microseconds, the last session queues up a small control message
+static void Simulate(TestPolicy & policy, TestSession * sessions, uint32 numSessions, uint64 controlPeriod)
+{
+   for (uint32 i=0; i<numSessions; i++) sessions[i]._session.SetOutputPolicy(AbstractSessionIOPolicyRef(&policy, false));
+
+   const uint64 startTime = 1000000;  // arbitrary, but must be non-zero
+   for (uint64 now=startTime; now<startTime+SIMULATED_MICROS; now+=CYCLE_MICROS)
+   {
+      TestSession & control = sessions[numSessions-1];
+      if ((controlPeriod > 0)&&(((now-startTime)%controlPeriod) == 0)&&(control._bytesPending == 0))
+      {
+         control._bytesPending     = 100;
+         control._wantsToSendSince = now;
+      }
+
+      policy.BeginIO(now);
+      bool okay[64];
+      for (uint32 i=0; i<numSessions; i++) okay[i] = (sessions[i]._bytesPending > 0)&&(policy.OkayToTransfer(PolicyHolder(&sessions[i]._session, false)));
+      for (uint32 i=0; i<numSessions; i++)
+      {
+         if (okay[i] == false) continue;
+
+         TestSession & ts = sessions[i];
+         const uint32 numBytes = muscleMin(policy.GetMaxTransferChunkSize(PolicyHolder(&ts._session, false)), ts._bytesPending);
+         policy.BytesTransferred(PolicyHolder(&ts._session, false), numBytes);
+         ts._bytesSent += numBytes;
+         if (ts._bytesPending != MUSCLE_NO_LIMIT)
+         {
+            ts._bytesPending -= numBytes;
+            if (ts._bytesPending == 0)
+            {
+               ts._maxLatency = muscleMax(ts._maxLatency, now-ts._wantsToSendSince);
+               ts._wantsToSendSince = 0;
+            }
+         }
+      }
+      policy.EndIO(now);
+   }
+
+   for (uint32 i=0; i<numSessions; i++) sessions[i]._session.SetOutputPolicy(AbstractSessionIOPolicyRef());
+}
+
+static bool IsClose(double actual, double expected, double tolerance)
+{
+   return ((actual >= expected*(1.0-tolerance))&&(actual <= expected*(1.0+tolerance)));
+}
+
+static int CheckRate(const char * desc, uint64 numBytes, double expectedRate)
+{
+   const double rate = (numBytes*(double)MICROS_PER_SECOND)/SIMULATED_MICROS;
+   printf("%s:  %.0f bytes/second (expected %.0f)\n", desc, rate, expectedRate);
+   if (IsClose(rate, expectedRate, 0.03)) return 0;
+
+   printf("ERROR:  %s's rate is too far from what was expected!\n", desc);
+   return 10;
+}
+
+int main(int, char **)
+{
+   CompleteSetupSystem css;
+
+   const uint32 maxRate = 100000;
+   {
+      printf("\nFour bulk sessions, equal weights:\n");
+      TestPolicy policy(maxRate);
+      TestSession sessions[4];
+      Simulate(policy, sessions, ARRAYITEMS(sessions), 0);
+
+      uint64 total = 0;
+      for (uint32 i=0; i<ARRAYITEMS(sessions); i++)
+      {
+         total += sessions[i]._bytesSent;
+         if (CheckRate("Bulk session", sessions[i]._bytesSent, maxRate/ARRAYITEMS(sessions)) != 0) return 10;
+      }
+      if (CheckRate("Aggregate", total, maxRate) != 0) return 10;
+   }
+
+   {
+      printf("\nThree sessions in a group with weight 1, one session in a group with weight 3:\n");
+      TestPolicy policy(maxRate);
+      (void) policy.PutGroupParameters("heavy", RateLimitParameters(3));
+      TestSession sessions[4];
+      for (uint32 i=0; i<ARRAYITEMS(sessions); i++) (void) policy._groupNames.Put(&sessions[i]._session, (i<3)?"light":"heavy");
+      Simulate(policy, sessions, ARRAYITEMS(sessions), 0);
+
+      for (uint32 i=0; i<3; i++) if (CheckRate("Light group's session", sessions[i]._bytesSent, maxRate/12) != 0) return 10;
+      if (CheckRate("Heavy group's session", sessions[3]._bytesSent, (maxRate*3)/4) != 0) return 10;
+   }
+
+   {
+      printf("\nTwo sessions, one with weight 4, one limited to 10000 bytes/second:\n");
+      TestPolicy policy(maxRate);
+      TestSession sessions[3];
+      (void) policy.SetSessionParameters(&sessions[1]._session, RateLimitParameters(4));
+      (void) policy.SetSessionParameters(&sessions[2]._session, RateLimitParameters(1, 10000));
+      Simulate(policy, sessions, ARRAYITEMS(sessions), 0);
+
+      if (CheckRate("Weight-1 session", sessions[0]._bytesSent, 18000) != 0) return 10;
+      if (CheckRate("Weight-4 session", sessions[1]._bytesSent, 72000) != 0) return 10;
+      if (CheckRate("Limited session",  sessions[2]._bytesSent, 10000) != 0) return 10;
+   }
+
+   {
+      printf("\nEight bulk sessions and a weight-8 control session sending 100 bytes every 10mS:\n");
+      TestPolicy policy(maxRate);
+      TestSession sessions[9];
+      sessions[8]._bytesPending = 0;
+      (void) policy.SetSessionParameters(&sessions[8]._session, RateLimitParameters(8));
+      Simulate(policy, sessions, ARRAYITEMS(sessions), 10000);
+
+      // The control session should never have to wait longer than it takes the policy to refill to its threshold (1024/8 bytes)
+      const uint64 maxExpectedLatency = (((1024/8)*MICROS_PER_SECOND)/maxRate)+CYCLE_MICROS;
+      printf("Control session's worst-case latency was " UINT64_FORMAT_SPEC " microseconds (limit is " UINT64_FORMAT_SPEC ")\n", sessions[8]._maxLatency, maxExpectedLatency);
+      if ((sessions[8]._bytesSent < 100*(SIMULATED_MICROS/10000)-100)||(sessions[8]._maxLatency > maxExpectedLatency))
+      {
+         printf("ERROR:  control session was starved (sent " UINT64_FORMAT_SPEC " bytes)!\n", sessions[8]._bytesSent);
+         return 10;
+      }
+   }
+
+   printf("\nAll rate-limit tests passed.\n");
+   return 0;
+}
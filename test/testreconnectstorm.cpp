@@ -0,0 +1,186 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "dataio/TCPSocketDataIO.h"
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/NetworkUtilityFunctions.h"
+#include "util/SocketMultiplexer.h"
+
+using namespace muscle;
+
+// This program benchmarks how quickly a ReflectServer can take on a storm of new connections, as a function
+// of its number of accept threads.  A server is run in a separate thread, and we open (numConnections) TCP
+// connections to it all at once (as happens when a network glitch causes every client to reconnect), send a
+// PR_COMMAND_PING on each one as soon as it is connected, and measure the time from the start of each connect()
+// until its PR_RESULT_PONG arrives.  Then all the connections are closed, and the storm is repeated (numRounds) times.
+// Note that the client and the server share this process's file descriptors, so storms of more than a few hundred
+// connections require MUSCLE_USE_EPOLL (or MUSCLE_USE_POLL) to be defined, to get around select()'s FD_SETSIZE limit.
+
+// One client connection, from connect() until its PR_RESULT_PONG arrives
+class StormConnection
+{
+public:
+   StormConnection() : _startTime(0), _isConnecting(false) {/* empty */}
+
+   AbstractMessageIOGatewayRef _gateway;
+   ConstSocketRef _socket;
+   uint64 _startTime;
+   bool _isConnecting;
+};
+
+// Runs one connection storm, and adds the connect-to-PONG latency of each connection to (latencies)
+static status_t RunStorm(uint16 port, uint32 numConnections, Queue<uint64> & latencies)
+{
+   MessageRef pingMsg = GetMessageFromPool(PR_COMMAND_PING);
+   if (pingMsg() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   Queue<StormConnection> conns;
+   if (conns.EnsureSize(numConnections, true) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   for (uint32 i=0; i<numConnections; i++)
+   {
+      StormConnection & c = conns[i];
+      c._startTime = GetRunTime64();
+
+      bool isReady;
+      c._socket = ConnectAsync(localhostIP, port, isReady);
+      if (c._socket() == NULL) {LogTime(MUSCLE_LOG_CRITICALERROR, "ConnectAsync() failed on connection #" UINT32_FORMAT_SPEC "!\n", i); return B_ERROR;}
+      c._isConnecting = (isReady == false);
+
+      c._gateway.SetRef(newnothrow MessageIOGateway);
+      if (c._gateway() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      c._gateway()->SetDataIO(DataIORef(newnothrow TCPSocketDataIO(c._socket, false)));
+      if (c._gateway()->GetDataIO()() == NULL) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+      if (isReady) (void) c._gateway()->AddOutgoingMessage(pingMsg);
+   }
+
+   SocketMultiplexer multiplexer;
+   QueueGatewayMessageReceiver q;
+   uint32 numDone = 0;
+   const uint64 deadline = GetRunTime64()+SecondsToMicros(60);
+   while(numDone < numConnections)
+   {
+      for (uint32 i=0; i<conns.GetNumItems(); i++)
+      {
+         const StormConnection & c = conns[i];
+         if (c._gateway() == NULL) continue;  // already got its PONG
+
+         const int fd = c._socket.GetFileDescriptor();
+         if ((c._isConnecting)||(c._gateway()->HasBytesToOutput())) (void) multiplexer.RegisterSocketForWriteReady(fd);
+         if (c._isConnecting == false) (void) multiplexer.RegisterSocketForReadReady(fd);
+      }
+      if (multiplexer.WaitForEvents(deadline) < 0) return B_ERROR;
+
+      const uint64 now = GetRunTime64();
+      if (now >= deadline) {LogTime(MUSCLE_LOG_CRITICALERROR, "Timed out with " UINT32_FORMAT_SPEC " connections still waiting!\n", numConnections-numDone); return B_ERROR;}
+
+      for (uint32 i=0; i<conns.GetNumItems(); i++)
+      {
+         StormConnection & c = conns[i];
+         if (c._gateway() == NULL) continue;
+
+         const int fd = c._socket.GetFileDescriptor();
+         if ((c._isConnecting)&&(multiplexer.IsSocketReadyForWrite(fd)))
+         {
+            if (FinalizeAsyncConnect(c._socket) != B_NO_ERROR) {LogTime(MUSCLE_LOG_CRITICALERROR, "Connection #" UINT32_FORMAT_SPEC " failed!\n", i); return B_ERROR;}
+            c._isConnecting = false;
+            (void) c._gateway()->AddOutgoingMessage(pingMsg);
+         }
+         if (c._isConnecting) continue;
+
+         if ((c._gateway()->HasBytesToOutput())&&(c._gateway()->DoOutput() < 0)) return B_ERROR;
+         if ((multiplexer.IsSocketReadyForRead(fd))&&(c._gateway()->DoInput(q) < 0)) {LogTime(MUSCLE_LOG_CRITICALERROR, "Connection #" UINT32_FORMAT_SPEC " was closed by the server!\n", i); return B_ERROR;}
+         if (q.HasItems())
+         {
+            if (q.Head()()->what != PR_RESULT_PONG) return B_ERROR;
+            q.Clear();
+            if (latencies.AddTail(now-c._startTime) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+            c._gateway.Reset();  // we'll keep the socket open until the whole storm is done, though
+            numDone++;
+         }
+      }
+   }
+   return B_NO_ERROR;
+}
+
+// Runs (numRounds) connection storms against a server with (numAcceptThreads) accept threads.
+// Returns B_NO_ERROR on success, or B_ERROR on failure.
+static status_t RunTrial(uint32 numAcceptThreads, uint32 numConnections, uint32 numRounds, Queue<uint64> & latencies)
+{
+   ServerThread serverThread;
+   ReflectServer & server = serverThread.GetServer();
+   server.SetNumAcceptThreads(numAcceptThreads);
+   server.SetDoLogging(false);
+
+   uint16 port = 0;
+   if (server.PutAcceptFactory(0, ReflectSessionFactoryRef(newnothrow StorageReflectSessionFactory), invalidIP, &port) != B_NO_ERROR)
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't bind an accept port!\n");
+      return B_ERROR;
+   }
+
+   ConstSocketRef stopSocket, serverSideStopSocket;
+   if ((CreateConnectedSocketPair(stopSocket, serverSideStopSocket) != B_NO_ERROR)||(server.AddNewSession(AbstractReflectSessionRef(newnothrow ServerStopperSession), serverSideStopSocket) != B_NO_ERROR))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't set up the server-stopper session!\n");
+      return B_ERROR;
+   }
+   serverSideStopSocket.Reset();
+
+   if (serverThread.StartInternalThread() != B_NO_ERROR)
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't start the server thread!\n");
+      return B_ERROR;
+   }
+
+   status_t ret = B_NO_ERROR;
+   for (uint32 r=0; ((ret == B_NO_ERROR)&&(r<numRounds)); r++) ret = RunStorm(port, numConnections, latencies);
+
+   stopSocket.Reset();  // tells the server thread to exit
+   (void) serverThread.WaitForInternalThreadToExit();
+   return ret;
+}
+
+static uint64 GetPercentile(const Queue<uint64> & sorted, uint32 percent)
+{
+   return sorted.HasItems() ? sorted[muscleMin((sorted.GetNumItems()*percent)/100, sorted.GetNumItems()-1)] : 0;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   uint32 numConnections = 400;
+   uint32 numRounds      = 5;
+   const char * s;
+   if (args.FindString("connections", &s) == B_NO_ERROR) numConnections = muscleMax((uint32)1, (uint32)atol(s));
+   if (args.FindString("rounds",      &s) == B_NO_ERROR) numRounds      = muscleMax((uint32)1, (uint32)atol(s));
+
+   Queue<uint32> acceptCounts;
+   if (args.FindString("threads", &s) == B_NO_ERROR) (void) acceptCounts.AddTail((uint32)atol(s));
+   else
+   {
+      const uint32 defaultCounts[] = {0, 1, 2, 4};
+      for (uint32 i=0; i<ARRAYITEMS(defaultCounts); i++) (void) acceptCounts.AddTail(defaultCounts[i]);
+   }
+
+   printf("Measuring connect-to-PONG latency for storms of " UINT32_FORMAT_SPEC " simultaneous connections, " UINT32_FORMAT_SPEC " rounds each.\n", numConnections, numRounds);
+   printf("%16s  %14s  %14s  %14s  %14s\n", "Accept threads", "Median (us)", "90th pct (us)", "99th pct (us)", "Max (us)");
+   for (uint32 i=0; i<acceptCounts.GetNumItems(); i++)
+   {
+      Queue<uint64> latencies;
+      if (RunTrial(acceptCounts[i], numConnections, numRounds, latencies) != B_NO_ERROR) {printf("Trial with " UINT32_FORMAT_SPEC " accept threads failed!\n", acceptCounts[i]); return 10;}
+
+      latencies.Sort();
+      printf("%16u  %14llu  %14llu  %14llu  %14llu\n", (unsigned) acceptCounts[i], (unsigned long long) GetPercentile(latencies, 50), (unsigned long long) GetPercentile(latencies, 90), (unsigned long long) GetPercentile(latencies, 99), (unsigned long long) latencies.Tail());
+   }
+   return 0;
+}
@@ -0,0 +1,313 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "dataio/UDPSocketDataIO.h"
+#include "iogateway/ReliableUDPIOGateway.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/NetworkUtilityFunctions.h"
+#include "util/SocketMultiplexer.h"
+
+using namespace muscle;
+
+// This program benchmarks ReliableUDPIOGateway over localhost, with simulated packet loss and latency.
+// One gateway sends a bulk transfer (a series of large Messages) to the other, while also sending a small
+// "control" Message every few milliseconds.  Each packet sent in either direction is dropped at random
+// (with the given probability), and the rest are delayed by the given one-way latency before they are
+// handed to the socket.  We check that every Message arrives intact and in order, and print the bulk
+// transfer's throughput and the control Messages' latencies, both with the control Messages on their
+// own stream and with them sharing the bulk transfer's stream (where they have to wait their turn).
+// Then we repeat the separate-streams trials, but Reset() the receiving gateway halfway through the bulk
+// transfer (as if the receiving program had been restarted), to check that the sender notices and that
+// the transfer carries on.  (The Messages that were in flight when the receiver restarted are lost, so
+// for those trials we only check that the Messages that do arrive are intact and in order)
+
+enum {
+   TEST_WHAT_BULK = 1650553963,  // 'bulk'
+   TEST_WHAT_CONTROL             // 'bulm'
+};
+
+static const uint64 CONTROL_INTERVAL_MICROS = 5*1000;
+
+// Wraps a packet DataIO, dropping or delaying the packets that are written to it
+class ImpairedDataIO : public DataIO
+{
+public:
+   ImpairedDataIO(const DataIORef & slaveIO, uint32 lossPercent, uint64 delayMicros) : _slaveIO(slaveIO), _lossPercent(lossPercent), _delayMicros(delayMicros) {/* empty */}
+
+   virtual int32 Read(void * buffer, uint32 size) {return _slaveIO()->Read(buffer, size);}
+   virtual int32 ReadPackets(PacketIOVec * packets, uint32 numPackets) {return _slaveIO()->ReadPackets(packets, numPackets);}
+
+   virtual int32 Write(const void * buffer, uint32 size)
+   {
+      if ((uint32)(rand()%100) < _lossPercent) return size;  // oops, the network ate it
+
+      ByteBufferRef buf = GetByteBufferFromPool(size, (const uint8 *) buffer);
+      if ((buf() == NULL)||(_delayedPackets.AddTail(DelayedPacket(buf, GetRunTime64()+_delayMicros)) != B_NO_ERROR)) return -1;
+      FlushDuePackets(GetRunTime64());
+      return size;
+   }
+
+   // Hands any packets whose delay has expired to the slave DataIO
+   void FlushDuePackets(uint64 now)
+   {
+      while((_delayedPackets.HasItems())&&(_delayedPackets.Head()._releaseTime <= now))
+      {
+         const ByteBuffer & b = *_delayedPackets.Head()._buf();
+         (void) _slaveIO()->Write(b.GetBuffer(), b.GetNumBytes());  // if the socket's buffer is full, the packet is lost, as on a real network
+         (void) _delayedPackets.RemoveHead();
+      }
+   }
+
+   uint64 GetNextReleaseTime() const {return _delayedPackets.HasItems() ? _delayedPackets.Head()._releaseTime : MUSCLE_TIME_NEVER;}
+
+   virtual status_t Seek(int64 /*seekOffset*/, int /*whence*/) {return B_ERROR;}
+   virtual int64 GetPosition() const {return -1;}
+   virtual void FlushOutput() {/* empty */}
+   virtual void Shutdown() {_slaveIO()->Shutdown();}
+   virtual const ConstSocketRef & GetReadSelectSocket()  const {return _slaveIO()->GetReadSelectSocket();}
+   virtual const ConstSocketRef & GetWriteSelectSocket() const {return _slaveIO()->GetWriteSelectSocket();}
+   virtual uint32 GetPacketMaximumSize() const {return _slaveIO()->GetPacketMaximumSize();}
+
+private:
+   class DelayedPacket
+   {
+   public:
+      DelayedPacket() : _releaseTime(0) {/* empty */}
+      DelayedPacket(const ByteBufferRef & buf, uint64 releaseTime) : _buf(buf), _releaseTime(releaseTime) {/* empty */}
+
+      ByteBufferRef _buf;
+      uint64 _releaseTime;
+   };
+
+   DataIORef _slaveIO;
+   const uint32 _lossPercent;
+   const uint64 _delayMicros;
+   Queue<DelayedPacket> _delayedPackets;
+};
+
+// Lets us drive our gateways' Pulse() callbacks ourself, since there is no ReflectServer to do it
+class GatewayPulser : public PulseNodeManager
+{
+public:
+   uint64 GetPulseTime(PulseNode & gw, uint64 now) const
+   {
+      uint64 ret = MUSCLE_TIME_NEVER;
+      CallGetPulseTimeAux(gw, now, ret);
+      return ret;
+   }
+
+   void Pulse(PulseNode & gw, uint64 now) const {CallPulseAux(gw, now);}
+};
+
+class TrialResults
+{
+public:
+   TrialResults() : _elapsed(0), _numPacketsSent(0), _numPacketsRetransmitted(0), _numBulkLost(0), _numControlLost(0) {/* empty */}
+
+   uint64 _elapsed;
+   uint64 _numPacketsSent;
+   uint64 _numPacketsRetransmitted;
+   uint32 _numBulkLost;     // bulk Messages that never arrived (only possible if the receiver was restarted)
+   uint32 _numControlLost;  // control Messages that never arrived (ditto)
+   Queue<uint64> _controlLatencies;
+};
+
+static uint8 GetBulkByte(uint32 msgIdx, uint32 offset) {return (uint8)((msgIdx*31)+(offset*7));}
+
+static status_t RunTrial(uint32 numBulkMessages, uint32 bulkMessageSize, uint32 lossPercent, uint64 delayMicros, bool separateStreams, bool restartReceiver, TrialResults & results)
+{
+   ConstSocketRef sockA = CreateUDPSocket();
+   ConstSocketRef sockB = CreateUDPSocket();
+   uint16 portA = 0, portB = 0;
+   if ((sockA() == NULL)||(sockB() == NULL)||(BindUDPSocket(sockA, 0, &portA) != B_NO_ERROR)||(BindUDPSocket(sockB, 0, &portB) != B_NO_ERROR))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Error setting up localhost UDP sockets!\n");
+      return B_ERROR;
+   }
+
+   UDPSocketDataIO * udpA = newnothrow UDPSocketDataIO(sockA, false);
+   UDPSocketDataIO * udpB = newnothrow UDPSocketDataIO(sockB, false);
+   if ((udpA == NULL)||(udpB == NULL)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   udpA->SetSendDestination(IPAddressAndPort(localhostIP, portB));
+   udpB->SetSendDestination(IPAddressAndPort(localhostIP, portA));
+
+   ImpairedDataIO * ioA = newnothrow ImpairedDataIO(DataIORef(udpA), lossPercent, delayMicros);
+   ImpairedDataIO * ioB = newnothrow ImpairedDataIO(DataIORef(udpB), lossPercent, delayMicros);
+   if ((ioA == NULL)||(ioB == NULL)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+   ReliableUDPIOGateway sender, receiver;
+   sender.SetDataIO(DataIORef(ioA));
+   receiver.SetDataIO(DataIORef(ioB));
+   if ((separateStreams)&&(sender.SetStreamForWhatCode(TEST_WHAT_BULK, 1) != B_NO_ERROR)) return B_ERROR;
+
+   // Queue up the whole bulk transfer at once
+   for (uint32 i=0; i<numBulkMessages; i++)
+   {
+      ByteBufferRef data = GetByteBufferFromPool(bulkMessageSize);
+      MessageRef msg = GetMessageFromPool(TEST_WHAT_BULK);
+      if ((data() == NULL)||(msg() == NULL)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
+      uint8 * b = data()->GetBuffer();
+      for (uint32 j=0; j<bulkMessageSize; j++) b[j] = GetBulkByte(i, j);
+      if ((msg()->AddInt32("index", i) != B_NO_ERROR)||(msg()->AddData("data", B_RAW_TYPE, b, bulkMessageSize) != B_NO_ERROR)||(sender.AddOutgoingMessage(msg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+   }
+
+   GatewayPulser pulser;
+   SocketMultiplexer multiplexer;
+   QueueGatewayMessageReceiver qReceiver, qSender;
+   const int fdA = sockA.GetFileDescriptor();
+   const int fdB = sockB.GetFileDescriptor();
+   uint32 numBulkReceived = 0, numControlSent = 0, numControlReceived = 0;  // (numBulkReceived) and (numControlReceived) are one past the highest index received so far
+   bool restarted = false;
+   const uint64 startTime = GetRunTime64();
+   const uint64 deadline  = startTime+SecondsToMicros(120);
+   uint64 nextControlTime = startTime;
+   while((numBulkReceived < numBulkMessages)||(numControlReceived < numControlSent))
+   {
+      uint64 now = GetRunTime64();
+      if (now >= deadline) {LogTime(MUSCLE_LOG_CRITICALERROR, "Timed out with " UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " bulk Messages received!\n", numBulkReceived, numBulkMessages); return B_ERROR;}
+
+      if ((restartReceiver)&&(restarted == false)&&(numBulkReceived >= numBulkMessages/2))
+      {
+         receiver.Reset();  // the sender isn't told about this; it has to figure it out from the receiver's acks
+         restarted = true;
+      }
+
+      if ((numBulkReceived < numBulkMessages)&&(now >= nextControlTime))
+      {
+         MessageRef msg = GetMessageFromPool(TEST_WHAT_CONTROL);
+         if ((msg() == NULL)||(msg()->AddInt32("index", numControlSent) != B_NO_ERROR)||(msg()->AddInt64("sent", now) != B_NO_ERROR)||(sender.AddOutgoingMessage(msg) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+         numControlSent++;
+         nextControlTime = now+CONTROL_INTERVAL_MICROS;
+      }
+
+      pulser.Pulse(sender, now);
+      pulser.Pulse(receiver, now);
+      ioA->FlushDuePackets(now);
+      ioB->FlushDuePackets(now);
+      while(sender.HasBytesToOutput())   if (sender.DoOutput()   <= 0) break;
+      while(receiver.HasBytesToOutput()) if (receiver.DoOutput() <= 0) break;
+
+      uint64 wakeTime = muscleMin(deadline, pulser.GetPulseTime(sender, now), pulser.GetPulseTime(receiver, now));
+      wakeTime = muscleMin(wakeTime, ioA->GetNextReleaseTime(), ioB->GetNextReleaseTime());
+      if (numBulkReceived < numBulkMessages) wakeTime = muscleMin(wakeTime, nextControlTime);
+      (void) multiplexer.RegisterSocketForReadReady(fdA);
+      (void) multiplexer.RegisterSocketForReadReady(fdB);
+      if (multiplexer.WaitForEvents(wakeTime) < 0) return B_ERROR;
+
+      if ((multiplexer.IsSocketReadyForRead(fdA))&&(sender.DoInput(qSender) < 0)) return B_ERROR;
+      if ((multiplexer.IsSocketReadyForRead(fdB))&&(receiver.DoInput(qReceiver) < 0)) return B_ERROR;
+
+      now = GetRunTime64();
+      MessageRef msg;
+      while(qReceiver.RemoveHead(msg) == B_NO_ERROR)
+      {
+         int32 index;
+         if (msg()->FindInt32("index", index) != B_NO_ERROR) return B_ERROR;
+         if (msg()->what == TEST_WHAT_BULK)
+         {
+            const uint8 * data;
+            uint32 numBytes;
+            const bool inOrder = restarted ? ((uint32)index >= numBulkReceived) : ((uint32)index == numBulkReceived);
+            if ((inOrder == false)||((uint32)index >= numBulkMessages)||(msg()->FindData("data", B_RAW_TYPE, (const void **) &data, &numBytes) != B_NO_ERROR)||(numBytes != bulkMessageSize))
+            {
+               LogTime(MUSCLE_LOG_CRITICALERROR, "Bulk Message #" INT32_FORMAT_SPEC " arrived out of order (expected #" UINT32_FORMAT_SPEC ")!\n", index, numBulkReceived);
+               return B_ERROR;
+            }
+            for (uint32 j=0; j<numBytes; j++) if (data[j] != GetBulkByte(index, j)) {LogTime(MUSCLE_LOG_CRITICALERROR, "Bulk Message #" INT32_FORMAT_SPEC " was corrupted!\n", index); return B_ERROR;}
+            results._numBulkLost += index-numBulkReceived;
+            numBulkReceived = index+1;
+         }
+         else
+         {
+            int64 sentTime;
+            const bool inOrder = restarted ? ((uint32)index >= numControlReceived) : ((uint32)index == numControlReceived);
+            if ((inOrder == false)||((uint32)index >= numControlSent)||(msg()->FindInt64("sent", sentTime) != B_NO_ERROR))
+            {
+               LogTime(MUSCLE_LOG_CRITICALERROR, "Control Message #" INT32_FORMAT_SPEC " arrived out of order (expected #" UINT32_FORMAT_SPEC ")!\n", index, numControlReceived);
+               return B_ERROR;
+            }
+            if (results._controlLatencies.AddTail(now-sentTime) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+            results._numControlLost += index-numControlReceived;
+            numControlReceived = index+1;
+         }
+      }
+   }
+
+   results._elapsed                 = GetRunTime64()-startTime;
+   results._numPacketsSent          = sender.GetNumPacketsSent();
+   results._numPacketsRetransmitted = sender.GetNumPacketsRetransmitted();
+   return B_NO_ERROR;
+}
+
+static uint64 GetPercentile(const Queue<uint64> & sorted, uint32 percent)
+{
+   return sorted.HasItems() ? sorted[muscleMin((sorted.GetNumItems()*percent)/100, sorted.GetNumItems()-1)] : 0;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   uint32 numBulkMessages = 16;
+   uint32 bulkMessageSize = 64*1024;
+   const char * s;
+   if (args.FindString("bulk", &s) == B_NO_ERROR) numBulkMessages = muscleMax((uint32)1, (uint32)atol(s));
+   if (args.FindString("size", &s) == B_NO_ERROR) bulkMessageSize = muscleMax((uint32)1, (uint32)atol(s));
+
+   Queue<uint32> lossPercents;
+   if (args.FindString("loss", &s) == B_NO_ERROR) (void) lossPercents.AddTail((uint32)atol(s));
+   else
+   {
+      const uint32 defaultLosses[] = {0, 1, 5};
+      for (uint32 i=0; i<ARRAYITEMS(defaultLosses); i++) (void) lossPercents.AddTail(defaultLosses[i]);
+   }
+
+   Queue<uint64> delays;
+   if (args.FindString("delay", &s) == B_NO_ERROR) (void) delays.AddTail(MillisToMicros(atol(s)));
+   else
+   {
+      (void) delays.AddTail(0);
+      (void) delays.AddTail(MillisToMicros(10));
+   }
+
+   srand(12345);
+   printf("Sending " UINT32_FORMAT_SPEC " bulk Messages of " UINT32_FORMAT_SPEC " bytes each, plus a control Message every " UINT64_FORMAT_SPEC " ms, over localhost.\n", numBulkMessages, bulkMessageSize, (uint64) MicrosToMillis(CONTROL_INTERVAL_MICROS));
+   printf("%6s  %6s  %8s  %10s  %8s  %8s  %15s  %15s\n", "Loss", "Delay", "Streams", "Bulk KB/s", "Packets", "Resent", "Ctl median (ms)", "Ctl max (ms)");
+   for (uint32 l=0; l<lossPercents.GetNumItems(); l++)
+   {
+      for (uint32 d=0; d<delays.GetNumItems(); d++)
+      {
+         for (uint32 separate=0; separate<2; separate++)
+         {
+            TrialResults results;
+            if (RunTrial(numBulkMessages, bulkMessageSize, lossPercents[l], delays[d], (separate != 0), false, results) != B_NO_ERROR) {printf("Trial failed!\n"); return 10;}
+
+            results._controlLatencies.Sort();
+            const double kbPerSecond = (((double)numBulkMessages)*bulkMessageSize*MICROS_PER_SECOND)/(1024.0*muscleMax(results._elapsed, (uint64)1));
+            printf("%5u%%  %4llums  %8s  %10.0f  %8llu  %8llu  %15.1f  %15.1f\n", (unsigned) lossPercents[l], (unsigned long long) MicrosToMillis(delays[d]), separate ? "separate" : "shared", kbPerSecond,
+                   (unsigned long long) results._numPacketsSent, (unsigned long long) results._numPacketsRetransmitted,
+                   GetPercentile(results._controlLatencies, 50)/1000.0, (results._controlLatencies.HasItems() ? results._controlLatencies.Tail() : 0)/1000.0);
+         }
+      }
+   }
+   printf("All Messages were delivered intact and in order.\n");
+
+   printf("\nRepeating the separate-streams trials, with the receiver restarted halfway through the bulk transfer:\n");
+   printf("%6s  %6s  %10s  %10s  %13s\n", "Loss", "Delay", "Bulk lost", "Ctl lost", "Elapsed (ms)");
+   for (uint32 l=0; l<lossPercents.GetNumItems(); l++)
+   {
+      for (uint32 d=0; d<delays.GetNumItems(); d++)
+      {
+         TrialResults results;
+         if (RunTrial(numBulkMessages, bulkMessageSize, lossPercents[l], delays[d], true, true, results) != B_NO_ERROR) {printf("Restart trial failed!\n"); return 10;}
+         printf("%5u%%  %4llums  %10u  %10u  %13llu\n", (unsigned) lossPercents[l], (unsigned long long) MicrosToMillis(delays[d]), (unsigned) results._numBulkLost, (unsigned) results._numControlLost, (unsigned long long) MicrosToMillis(results._elapsed));
+      }
+   }
+   printf("The transfers all carried on after the receiver restarted, and the Messages that arrived were intact and in order.\n");
+   return 0;
+}
@@ -0,0 +1,239 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "dataio/NullDataIO.h"
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks PR_COMMAND_SETDATATREES, and benchmarks it against uploading the same nodes
+// with one PR_COMMAND_SETDATA Message per node.  One "publisher" session uploads a two-level tree of
+// (numNodes) nodes that (numSubscribers) other sessions are subscribed to, and we measure the CPU time
+// needed for the whole upload, including sending the resulting PR_RESULT_DATAITEMS Messages to every subscriber.
+
+// A session that keeps count of the Messages that it sends to its client
+class CountingStorageReflectSession : public StorageReflectSession
+{
+public:
+   CountingStorageReflectSession() : _numDataItemsMessages(0), _numDataItems(0), _numErrorMessages(0) {/* empty */}
+
+   virtual status_t AddOutgoingMessage(const MessageRef & msgRef)
+   {
+      const Message * msg = msgRef();
+      if (msg)
+      {
+         if (msg->what == PR_RESULT_DATAITEMS)
+         {
+            _numDataItemsMessages++;
+            _numDataItems += msg->GetNumNames(B_MESSAGE_TYPE);
+         }
+         else if (msg->what == PR_RESULT_ERRORACCESSDENIED) _numErrorMessages++;
+      }
+      return StorageReflectSession::AddOutgoingMessage(msgRef);
+   }
+
+   uint32 _numDataItemsMessages;
+   uint32 _numDataItems;
+   uint32 _numErrorMessages;
+};
+
+static const uint32 NUM_ITEMS_PER_GROUP = 100;
+
+static MessageRef CreatePayload(uint32 idx)
+{
+   MessageRef payload = GetMessageFromPool(1234);
+   if ((payload() == NULL)||(payload()->AddInt32("index", idx) != B_NO_ERROR)||(payload()->AddString("text", "This is a typical-sized status string for a node") != B_NO_ERROR)) return MessageRef();
+   return payload;
+}
+
+// Returns a subtree Message (in SaveNodeTreeToMessage() format) holding (numNodes) nodes:  groups of NUM_ITEMS_PER_GROUP items each
+static MessageRef CreateTree(uint32 numNodes)
+{
+   MessageRef root     = GetMessageFromPool();
+   MessageRef groups   = GetMessageFromPool();
+   MessageRef rootData = CreatePayload(0);
+   if ((root() == NULL)||(groups() == NULL)||(rootData() == NULL)||(root()->AddMessage(PR_NAME_NODEDATA, rootData) != B_NO_ERROR)||(root()->AddMessage(PR_NAME_NODECHILDREN, groups) != B_NO_ERROR)) return MessageRef();
+
+   uint32 numAdded = 0;
+   for (uint32 g=0; numAdded<numNodes; g++)
+   {
+      MessageRef group     = GetMessageFromPool();
+      MessageRef items     = GetMessageFromPool();
+      MessageRef groupData = CreatePayload(numAdded++);
+      if ((group() == NULL)||(items() == NULL)||(groupData() == NULL)||(group()->AddMessage(PR_NAME_NODEDATA, groupData) != B_NO_ERROR)||(group()->AddMessage(PR_NAME_NODECHILDREN, items) != B_NO_ERROR)) return MessageRef();
+      for (uint32 i=0; (i<NUM_ITEMS_PER_GROUP)&&(numAdded<numNodes); i++)
+      {
+         MessageRef item     = GetMessageFromPool();
+         MessageRef itemData = CreatePayload(numAdded++);
+         if ((item() == NULL)||(itemData() == NULL)||(item()->AddMessage(PR_NAME_NODEDATA, itemData) != B_NO_ERROR)||(items()->AddMessage(String("i%1").Arg(i), item) != B_NO_ERROR)) return MessageRef();
+      }
+      if (groups()->AddMessage(String("g%1").Arg(g), group) != B_NO_ERROR) return MessageRef();
+   }
+   return root;
+}
+
+// Adds one PR_COMMAND_SETDATA Message per node in (tree) to (retMsgs)
+static status_t CreatePerNodeMessages(const Message & tree, const String & path, Queue<MessageRef> & retMsgs)
+{
+   MessageRef data, setMsg = GetMessageFromPool(PR_COMMAND_SETDATA);
+   if ((setMsg() == NULL)||(tree.FindMessage(PR_NAME_NODEDATA, data) != B_NO_ERROR)||(setMsg()->AddMessage(path, data) != B_NO_ERROR)||(retMsgs.AddTail(setMsg) != B_NO_ERROR)) return B_ERROR;
+
+   MessageRef children;
+   if (tree.FindMessage(PR_NAME_NODECHILDREN, children) == B_NO_ERROR)
+   {
+      for (MessageFieldNameIterator iter = children()->GetFieldNameIterator(B_MESSAGE_TYPE); iter.HasData(); iter++)
+      {
+         MessageRef child;
+         if ((children()->FindMessage(iter.GetFieldName(), child) != B_NO_ERROR)||(CreatePerNodeMessages(*child(), path+"/"+iter.GetFieldName(), retMsgs) != B_NO_ERROR)) return B_ERROR;
+      }
+   }
+   return B_NO_ERROR;
+}
+
+class TrialResult
+{
+public:
+   TrialResult() : _elapsed(0), _numDataItemsMessages(0), _numDataItems(0), _numErrorMessages(0) {/* empty */}
+
+   uint64 _elapsed;
+   uint32 _numDataItemsMessages;  // counted over all subscribers
+   uint32 _numDataItems;          // counted over all subscribers
+   uint32 _numErrorMessages;      // sent back to the publisher
+};
+
+// Uploads (msgs) from a publisher session, with (numSubscribers) sessions subscribed to the uploaded nodes
+static status_t RunTrial(const Queue<MessageRef> & msgs, uint32 numSubscribers, uint32 maxNodesPerSession, TrialResult & result)
+{
+   ReflectServer server;
+   if (maxNodesPerSession != MUSCLE_NO_LIMIT) (void) server.GetCentralState().AddInt32(PR_NAME_MAX_NODES_PER_SESSION, maxNodesPerSession);
+
+   Queue<CountingStorageReflectSession *> sessions;
+   for (uint32 i=0; i<=numSubscribers; i++)  // session #0 is the publisher
+   {
+      CountingStorageReflectSession * session = newnothrow CountingStorageReflectSession;
+      AbstractReflectSessionRef sessionRef(session);
+      AbstractMessageIOGatewayRef gatewayRef(newnothrow MessageIOGateway);
+      if ((session == NULL)||(gatewayRef() == NULL)) {WARN_OUT_OF_MEMORY; server.Cleanup(); return B_ERROR;}
+
+      gatewayRef()->SetDataIO(DataIORef(newnothrow NullDataIO));
+      session->SetGateway(gatewayRef);
+      if ((server.AddNewSession(sessionRef) != B_NO_ERROR)||(sessions.AddTail(session) != B_NO_ERROR))
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't add session #" UINT32_FORMAT_SPEC "!\n", i);
+         server.Cleanup();
+         return B_ERROR;
+      }
+
+      if (i > 0)
+      {
+         MessageRef subMsg = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+         if ((subMsg() == NULL)||(subMsg()->AddBool("SUBSCRIBE:/*/*/tree/*", true) != B_NO_ERROR)||(subMsg()->AddBool("SUBSCRIBE:/*/*/tree/*/*", true) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; server.Cleanup(); return B_ERROR;}
+         session->CallMessageReceivedFromGateway(subMsg);
+      }
+   }
+   for (uint32 i=0; i<sessions.GetNumItems(); i++)
+   {
+      while(sessions[i]->GetGateway()()->HasBytesToOutput()) (void) sessions[i]->GetGateway()()->DoOutput();
+      sessions[i]->_numDataItemsMessages = sessions[i]->_numDataItems = 0;  // ignore any initial subscription results
+   }
+
+   CountingStorageReflectSession * publisher = sessions.Head();
+   uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<msgs.GetNumItems(); i++) publisher->CallMessageReceivedFromGateway(msgs[i]);
+   for (uint32 i=0; i<sessions.GetNumItems(); i++) while(sessions[i]->GetGateway()()->HasBytesToOutput()) (void) sessions[i]->GetGateway()()->DoOutput();
+   result._elapsed = GetRunTime64()-startTime;
+
+   result._numErrorMessages = publisher->_numErrorMessages;
+   for (uint32 i=1; i<sessions.GetNumItems(); i++)
+   {
+      result._numDataItemsMessages += sessions[i]->_numDataItemsMessages;
+      result._numDataItems         += sessions[i]->_numDataItems;
+   }
+
+   server.Cleanup();
+   return B_NO_ERROR;
+}
+
+static int CheckSetDataTrees()
+{
+   const uint32 numNodes = 1000;
+   MessageRef tree = CreateTree(numNodes);
+   MessageRef setMsg = GetMessageFromPool(PR_COMMAND_SETDATATREES);
+   if ((tree() == NULL)||(setMsg() == NULL)||(setMsg()->AddMessage("tree", tree) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return 10;}
+
+   Queue<MessageRef> msgs;
+   if (msgs.AddTail(setMsg) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return 10;}
+
+   // A valid upload should give each subscriber exactly one update Message, containing every node under "tree"
+   TrialResult r;
+   if ((RunTrial(msgs, 3, MUSCLE_NO_LIMIT, r) != B_NO_ERROR)||(r._numErrorMessages != 0)||(r._numDataItemsMessages != 3)||(r._numDataItems != 3*numNodes))
+   {
+      printf("Valid SETDATATREES upload failed!  (errors=" UINT32_FORMAT_SPEC " updates=" UINT32_FORMAT_SPEC " items=" UINT32_FORMAT_SPEC ")\n", r._numErrorMessages, r._numDataItemsMessages, r._numDataItems);
+      return 10;
+   }
+
+   // An upload that would exceed the node limit should be rejected without creating any nodes
+   r = TrialResult();
+   if ((RunTrial(msgs, 3, numNodes, r) != B_NO_ERROR)||(r._numErrorMessages != 1)||(r._numDataItemsMessages != 0))
+   {
+      printf("Over-limit SETDATATREES upload wasn't rejected cleanly!  (errors=" UINT32_FORMAT_SPEC " updates=" UINT32_FORMAT_SPEC ")\n", r._numErrorMessages, r._numDataItemsMessages);
+      return 10;
+   }
+
+   // As should an upload containing a malformed subtree, even though the malformed subtree comes last
+   MessageRef badTree = GetMessageFromPool();
+   if ((badTree() == NULL)||(badTree()->AddString(PR_NAME_NODEDATA, "not a Message") != B_NO_ERROR)||(setMsg()->AddMessage("tree/zzz", badTree) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return 10;}
+   r = TrialResult();
+   if ((RunTrial(msgs, 3, MUSCLE_NO_LIMIT, r) != B_NO_ERROR)||(r._numErrorMessages != 1)||(r._numDataItemsMessages != 0))
+   {
+      printf("Malformed SETDATATREES upload wasn't rejected cleanly!  (errors=" UINT32_FORMAT_SPEC " updates=" UINT32_FORMAT_SPEC ")\n", r._numErrorMessages, r._numDataItemsMessages);
+      return 10;
+   }
+
+   printf("SETDATATREES checks passed.\n");
+   return 0;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   int ret = CheckSetDataTrees();
+   if (ret != 0) return ret;
+
+   uint32 numSubscribers = 10;
+   const char * s;
+   if (args.FindString("subscribers", &s) == B_NO_ERROR) numSubscribers = (uint32)atol(s);
+
+   Queue<uint32> nodeCounts;
+   if (args.FindString("nodes", &s) == B_NO_ERROR) (void) nodeCounts.AddTail(muscleMax((uint32)1, (uint32)atol(s)));
+   else
+   {
+      const uint32 defaultCounts[] = {1000, 10000, 50000};
+      for (uint32 i=0; i<ARRAYITEMS(defaultCounts); i++) (void) nodeCounts.AddTail(defaultCounts[i]);
+   }
+
+   printf("Measuring the cost of uploading a tree of nodes, with " UINT32_FORMAT_SPEC " subscribers.\n", numSubscribers);
+   printf("%10s  %18s  %18s  %20s  %20s\n", "Nodes", "Per-node (ms)", "SETDATATREES (ms)", "Per-node updates", "SETDATATREES updates");
+   for (uint32 i=0; i<nodeCounts.GetNumItems(); i++)
+   {
+      const uint32 numNodes = nodeCounts[i];
+      MessageRef tree = CreateTree(numNodes);
+      MessageRef setMsg = GetMessageFromPool(PR_COMMAND_SETDATATREES);
+      Queue<MessageRef> perNodeMsgs, bulkMsgs;
+      if ((tree() == NULL)||(setMsg() == NULL)||(setMsg()->AddMessage("tree", tree) != B_NO_ERROR)||(bulkMsgs.AddTail(setMsg) != B_NO_ERROR)||(CreatePerNodeMessages(*tree(), "tree", perNodeMsgs) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; return 10;}
+
+      TrialResult perNode, bulk;
+      if ((RunTrial(perNodeMsgs, numSubscribers, MUSCLE_NO_LIMIT, perNode) != B_NO_ERROR)||(RunTrial(bulkMsgs, numSubscribers, MUSCLE_NO_LIMIT, bulk) != B_NO_ERROR)) {printf("Trial with " UINT32_FORMAT_SPEC " nodes failed!\n", numNodes); return 10;}
+      if (perNode._numDataItems != bulk._numDataItems) {printf("Trial with " UINT32_FORMAT_SPEC " nodes:  subscribers saw " UINT32_FORMAT_SPEC " vs " UINT32_FORMAT_SPEC " node updates!\n", numNodes, perNode._numDataItems, bulk._numDataItems); return 10;}
+      printf("%10u  %18.2f  %18.2f  %20u  %20u\n", (unsigned) numNodes, perNode._elapsed/1000.0, bulk._elapsed/1000.0, (unsigned) perNode._numDataItemsMessages, (unsigned) bulk._numDataItemsMessages);
+   }
+   return 0;
+}
@@ -11,7 +11,9 @@
 using namespace muscle;
 
 // This program tests the SocketMultiplexer class by seeing how many chained socket-pairs
-// we can chain a message through sequentially
+// we can chain a message through sequentially.  If "persistent" is specified on the command
+// line, the sockets are registered only once (via RegisterPersistentSocketForEventsByTypeIndex())
+// and only the sockets listed by GetReadySockets() are checked after each WaitForEvents() call.
 int main(int argc, char ** argv)
 {
    CompleteSetupSystem css;
@@ -20,7 +22,12 @@ int main(int argc, char ** argv)
    if (argc > 1) numPairs = atoi(argv[1]);
 
    bool quiet = false;
-   if ((argc > 2)&&(strcmp(argv[2], "quiet") == 0)) quiet = true;
+   bool persistent = false;
+   for (int i=2; i<argc; i++)
+   {
+           if (strcmp(argv[i], "quiet")      == 0) quiet      = true;
+      else if (strcmp(argv[i], "persistent") == 0) persistent = true;
+   }
 
 #ifdef __APPLE__
    // Tell MacOS/X that yes, we really do want to create this many file descriptors
@@ -29,10 +36,11 @@ int main(int argc, char ** argv)
    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) perror("setrlimit");
 #endif
 
-   printf("Testing %i socket-pairs chained together...\n", numPairs);
+   printf("Testing %i socket-pairs chained together, using %s registrations...\n", numPairs, persistent?"persistent":"per-cycle");
 
    Queue<ConstSocketRef> senders;   (void) senders.EnsureSize(numPairs, true);
    Queue<ConstSocketRef> receivers; (void) receivers.EnsureSize(numPairs, true);
+   Hashtable<int, uint32> receiverFDToIndex;
    
    for (uint32 i=0; i<numPairs; i++) 
    {
@@ -41,6 +49,7 @@ int main(int argc, char ** argv)
          printf("Error, failed to create socket pair #" UINT32_FORMAT_SPEC"!\n", i);
          return 10;
       }
+      if (receiverFDToIndex.Put(receivers[i].GetFileDescriptor(), i) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return 10;}
    }
 
    // Start the game off
@@ -58,9 +67,21 @@ int main(int argc, char ** argv)
    SocketMultiplexer multiplexer;
    uint64 endTime = GetRunTime64() + SecondsToMicros(10);
    bool error = false;
-   while(error==false)
+   if (persistent)
    {
       for (uint32 i=0; i<numPairs; i++)
+      {
+         if (multiplexer.RegisterPersistentSocketForEventsByTypeIndex(receivers[i].GetFileDescriptor(), SocketMultiplexer::FDSTATE_SET_READ) != B_NO_ERROR)
+         {
+            printf("Error, RegisterPersistentSocketForEventsByTypeIndex() failed for receiver #" UINT32_FORMAT_SPEC"!\n", i);
+            return 10;
+         }
+      }
+   }
+
+   while(error==false)
+   {
+      for (uint32 i=0; ((persistent == false)&&(i<numPairs)); i++)
       {
          if (multiplexer.RegisterSocketForReadReady(receivers[i].GetFileDescriptor()) != B_NO_ERROR)
          {
@@ -89,8 +110,11 @@ int main(int argc, char ** argv)
       minRunTime = muscleMin(minRunTime, elapsed);
       maxRunTime = muscleMax(maxRunTime, elapsed);
       
-      for (uint32 i=0; i<numPairs; i++)
+      const Queue<int> & readyFDs = multiplexer.GetReadySockets();
+      for (uint32 j=0; j<(persistent?readyFDs.GetNumItems():numPairs); j++)
       {
+         uint32 i = j;
+         if ((persistent)&&(receiverFDToIndex.Get(readyFDs[j], i) != B_NO_ERROR)) continue;  // paranoia
          if (multiplexer.IsSocketReadyForRead(receivers[i].GetFileDescriptor()))
          {
             char buf[64];
@@ -0,0 +1,159 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "regex/StringMatcher.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+#include "util/TimeUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program checks StringMatcher's native glob matching against the regex library, and then
+// benchmarks the two against each other.  The regex-based matchers are built from the same POSIX
+// regex that StringMatcher::SetPattern() generates for simple patterns it can't match natively.
+
+static String GlobToRegex(const char * str)
+{
+   if ((str[0] == '\\')&&(str[1] == '<')) str++;
+
+   String regexPattern = "^(";
+   bool escapeMode = false;
+   for (const char * ptr = str; *ptr != '\0'; ptr++)
+   {
+      char c = *ptr;
+      if (escapeMode) escapeMode = false;
+      else
+      {
+         switch(c)
+         {
+            case ',':  c = '|';              break;
+            case '.':  regexPattern += '\\'; break;
+            case '*':  regexPattern += '.';  break;
+            case '?':  c = '.';              break;
+            case '\\': escapeMode = true;    break;
+         }
+      }
+      regexPattern += c;
+   }
+   if (escapeMode) regexPattern += '\\';
+   regexPattern += ")$";
+   return regexPattern;
+}
+
+static int CheckPattern(const char * pattern, const char ** strings, uint32 numStrings, bool expectNative)
+{
+   StringMatcher native(pattern);
+   StringMatcher regex(GlobToRegex(pattern), false);
+   if (native.IsNativeGlob() != expectNative)
+   {
+      printf("Pattern [%s] %s natively, but it %s have been!\n", pattern, native.IsNativeGlob() ? "was matched" : "wasn't matched", expectNative ? "should" : "shouldn't");
+      return 10;
+   }
+   for (uint32 i=0; i<numStrings; i++)
+   {
+      if (native.Match(strings[i]) != regex.Match(strings[i]))
+      {
+         printf("Pattern [%s] string [%s]:  native match returned %i, regex match returned %i!\n", pattern, strings[i], native.Match(strings[i]), regex.Match(strings[i]));
+         return 10;
+      }
+   }
+   return 0;
+}
+
+static int CheckMatches()
+{
+   static const char * strings[] = {
+      "", "a", "b", "ab", "ba", "abc", "abcabc", "aXc", "a.c", "a*c", "a,c", "a\\", "sensor_", "sensor_1", "sensor_17",
+      "sensor_17_temp", "_temp", "sensortemp", "probe_3", "<1-5>", "3", "x-y", "ssss", "~abc", "sensor_1/foo"
+   };
+   const uint32 numStrings = ARRAYITEMS(strings);
+
+   static const char * nativePatterns[] = {
+      "", "*", "**", "a", "abc", "a*", "*c", "a*c", "*b*", "a?c", "?", "??", "a*b*c", "*abc*abc", "a.c", "a\\*c", "a\\,c",
+      "a\\", "sensor_*", "*_temp", "sensor_*_temp", "sensor_1?", "sensor_*,probe_*", "a,b,,ab", "s*s*s*s", "x-y", "\\<1-5>", "?*?"
+   };
+   for (uint32 i=0; i<ARRAYITEMS(nativePatterns); i++) if (CheckPattern(nativePatterns[i], strings, numStrings, true) != 0) return 10;
+
+   static const char * regexPatterns[] = {"a[bX]c", "(ab)*", "ab+c", "a|b", "^a", "a{2}", "\\w*"};
+   for (uint32 i=0; i<ARRAYITEMS(regexPatterns); i++) if (CheckPattern(regexPatterns[i], strings, numStrings, false) != 0) return 10;
+
+   // Negation and numeric ranges don't go through the regex library at all, but make sure they still work
+   StringMatcher negated("~sensor_*");
+   if ((negated.Match("sensor_1"))||(negated.Match("probe_1") == false)) {printf("Negated pattern failed!\n"); return 10;}
+   StringMatcher range("<1-5,17>");
+   if ((range.Match("3") == false)||(range.Match("17") == false)||(range.Match("6"))||(range.Match("x"))) {printf("Range pattern failed!\n"); return 10;}
+
+   // Re-using a StringMatcher for different kinds of pattern shouldn't leave anything behind
+   StringMatcher reused("a[bX]c");
+   if ((reused.SetPattern("a*") != B_NO_ERROR)||(reused.IsNativeGlob() == false)||(reused.Match("aXc") == false)) {printf("Regex->glob re-use failed!\n"); return 10;}
+   if ((reused.SetPattern("a?c,d") != B_NO_ERROR)||(reused.Match("aXc") == false)||(reused.Match("d") == false)||(reused.Match("ab"))) {printf("Glob->automaton re-use failed!\n"); return 10;}
+   if ((reused.SetPattern("a[bX]c") != B_NO_ERROR)||(reused.IsNativeGlob())||(reused.Match("aXc") == false)||(reused.Match("aYc"))) {printf("Glob->regex re-use failed!\n"); return 10;}
+
+   // Random patterns and strings, to exercise the automaton
+   static const char patternChars[] = "ab*?,.";
+   static const char stringChars[]  = "ab.";
+   srand(12345);
+   for (uint32 i=0; i<20000; i++)
+   {
+      char pattern[10];
+      const uint32 patLen = rand()%(sizeof(pattern)-1);
+      for (uint32 j=0; j<patLen; j++) pattern[j] = patternChars[rand()%(sizeof(patternChars)-1)];
+      pattern[patLen] = '\0';
+
+      char str[8];
+      const uint32 strLen = rand()%(sizeof(str)-1);
+      for (uint32 j=0; j<strLen; j++) str[j] = stringChars[rand()%(sizeof(stringChars)-1)];
+      str[strLen] = '\0';
+
+      const char * s = str;
+      if (CheckPattern(pattern, &s, 1, true) != 0) return 10;
+   }
+
+   printf("StringMatcher checks passed.\n");
+   return 0;
+}
+
+static uint64 TimeMatches(const StringMatcher & sm, const char ** strings, uint32 numStrings, uint32 numIterations, uint32 & retNumMatches)
+{
+   retNumMatches = 0;
+   const uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<numIterations; i++) for (uint32 j=0; j<numStrings; j++) if (sm.Match(strings[j])) retNumMatches++;
+   return GetRunTime64()-startTime;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   int ret = CheckMatches();
+   if (ret != 0) return ret;
+
+   uint32 numIterations = 200000;
+   Message args; (void) ParseArgs(argc, argv, args);
+   const char * s;
+   if (args.FindString("iterations", &s) == B_NO_ERROR) numIterations = muscleMax((uint32)1, (uint32)atol(s));
+
+   static const char * nodeNames[] = {
+      "sensor_1", "sensor_17", "sensor_17_temp", "sensor_200_pressure", "probe_3", "probe_3_temp", "192.168.1.17", "12345",
+      "status", "a_rather_longer_node_name_than_most", "sensor_", "temp"
+   };
+   static const char * patterns[] = {"*", "sensor_17", "sensor_*", "*_temp", "sensor_*_temp", "sensor_1?", "s*_*_t*", "sensor_*,probe_*"};
+
+   printf("Matching " UINT32_FORMAT_SPEC " node names " UINT32_FORMAT_SPEC " times against each pattern.\n", (uint32) ARRAYITEMS(nodeNames), numIterations);
+   printf("%18s  %18s  %18s  %10s\n", "Pattern", "Native (ns/match)", "Regex (ns/match)", "Speedup");
+   const double numMatches = (double) numIterations*ARRAYITEMS(nodeNames);
+   for (uint32 i=0; i<ARRAYITEMS(patterns); i++)
+   {
+      StringMatcher native(patterns[i]);
+      StringMatcher regex(GlobToRegex(patterns[i]), false);
+
+      uint32 nativeCount, regexCount;
+      const uint64 nativeTime = TimeMatches(native, nodeNames, ARRAYITEMS(nodeNames), numIterations, nativeCount);
+      const uint64 regexTime  = TimeMatches(regex,  nodeNames, ARRAYITEMS(nodeNames), numIterations, regexCount);
+      if (nativeCount != regexCount) {printf("Pattern [%s]:  " UINT32_FORMAT_SPEC " native matches vs " UINT32_FORMAT_SPEC " regex matches!\n", patterns[i], nativeCount, regexCount); return 10;}
+
+      printf("%18s  %18.1f  %18.1f  %9.1fx\n", patterns[i], (nativeTime*1000.0)/numMatches, (regexTime*1000.0)/numMatches, (double)regexTime/muscleMax(nativeTime, (uint64)1));
+   }
+   return 0;
+}
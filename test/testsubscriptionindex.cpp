@@ -0,0 +1,100 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#include <stdio.h>
+#include "iogateway/MessageIOGateway.h"
+#include "reflector/ReflectServer.h"
+#include "reflector/StorageReflectSession.h"
+#include "system/SetupSystem.h"
+#include "test/ServerTestSupport.h"
+#include "util/MiscUtilityFunctions.h"
+
+using namespace muscle;
+
+// This program benchmarks the cost of creating a node in the server's database, as a function of the
+// number of sessions connected to the server.  Only a few of the sessions are subscribed to the new
+// nodes; the rest are either idle or subscribed to an unrelated part of the tree.  Since only the
+// sessions whose subscription paths could match the new node need to be visited, the cost per
+// node-creation should stay roughly constant as the number of sessions grows.
+
+static const uint32 NUM_INTERESTED_SUBSCRIBERS = 3;
+static const uint32 NODES_PER_MESSAGE          = 100;
+
+static uint64 RunTrial(uint32 numSessions, uint32 numNodes, bool otherSessionsSubscribe)
+{
+   ReflectServer server;
+   Queue<AbstractReflectSessionRef> sessions;
+   for (uint32 i=0; i<numSessions; i++)  // session #0 is the publisher
+   {
+      AbstractReflectSessionRef sessionRef(newnothrow StorageReflectSession);
+      if ((AddOfflineSession(server, sessionRef) != B_NO_ERROR)||(sessions.AddTail(sessionRef) != B_NO_ERROR))
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't add session #" UINT32_FORMAT_SPEC "!\n", i);
+         server.Cleanup();
+         return 0;
+      }
+
+      const char * subscribePath = NULL;
+           if ((i > 0)&&(i <= NUM_INTERESTED_SUBSCRIBERS)) subscribePath = "SUBSCRIBE:/*/*/topic/*";
+      else if ((i > 0)&&(otherSessionsSubscribe))         subscribePath = "SUBSCRIBE:/*/*/unrelated/*";
+      if (subscribePath)
+      {
+         MessageRef subMsg = GetMessageFromPool(PR_COMMAND_SETPARAMETERS);
+         if ((subMsg() == NULL)||(subMsg()->AddBool(subscribePath, true) != B_NO_ERROR)) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 0;}
+         sessionRef()->CallMessageReceivedFromGateway(subMsg);
+      }
+   }
+
+   AbstractReflectSession * publisher = sessions.Head()();
+   MessageRef payload = GetMessageFromPool(1234);
+   if (payload() == NULL) {WARN_OUT_OF_MEMORY; server.Cleanup(); return 0;}
+
+   uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<numNodes; i+=NODES_PER_MESSAGE)
+   {
+      MessageRef setMsg = GetMessageFromPool(PR_COMMAND_SETDATA);
+      if (setMsg() == NULL) {WARN_OUT_OF_MEMORY; break;}
+
+      for (uint32 j=i; j<i+NODES_PER_MESSAGE; j++)
+      {
+         char buf[64]; sprintf(buf, "topic/node" UINT32_FORMAT_SPEC, j);
+         (void) setMsg()->AddMessage(buf, payload);
+      }
+      publisher->CallMessageReceivedFromGateway(setMsg);
+      for (uint32 j=0; j<=NUM_INTERESTED_SUBSCRIBERS; j++) (void) sessions[j]()->GetGateway()()->DoOutput();
+   }
+   uint64 ret = GetRunTime64()-startTime;
+
+   server.Cleanup();
+   return ret;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   uint32 numNodes = 20000;
+   const char * s;
+   if (args.FindString("nodes", &s) == B_NO_ERROR) numNodes = muscleMax((uint32)NODES_PER_MESSAGE, (uint32)atol(s));
+
+   Queue<uint32> sessionCounts;
+   if (args.FindString("sessions", &s) == B_NO_ERROR) (void) sessionCounts.AddTail(muscleMax((uint32)(NUM_INTERESTED_SUBSCRIBERS+1), (uint32)atol(s)));
+   else
+   {
+      const uint32 defaultCounts[] = {10, 100, 1000, 2000, 5000};
+      for (uint32 i=0; i<ARRAYITEMS(defaultCounts); i++) (void) sessionCounts.AddTail(defaultCounts[i]);
+   }
+
+   printf("Measuring the cost of creating " UINT32_FORMAT_SPEC " nodes, with " UINT32_FORMAT_SPEC " sessions subscribed to them.\n", numNodes, NUM_INTERESTED_SUBSCRIBERS);
+   printf("%10s  %28s  %28s\n", "Sessions", "Others idle (us/node)", "Others subscribed (us/node)");
+   for (uint32 i=0; i<sessionCounts.GetNumItems(); i++)
+   {
+      uint32 numSessions = sessionCounts[i];
+      uint64 idleTime    = RunTrial(numSessions, numNodes, false);
+      uint64 busyTime    = RunTrial(numSessions, numNodes, true);
+      printf("%10u  %28.2f  %28.2f\n", (unsigned) numSessions, ((double)idleTime)/numNodes, ((double)busyTime)/numNodes);
+   }
+   return 0;
+}
@@ -4,6 +4,7 @@
 #include "system/Thread.h"
 #include "system/ThreadLocalStorage.h"
 #include "system/SetupSystem.h"
+#include "util/TimeUtilityFunctions.h"
 
 using namespace muscle;
 
@@ -32,11 +33,80 @@ public:
    }
 };
 
-// This program exercises the Thread class.
-int main(void) 
+// Counts the Messages it receives, and how many times it had to be woken up to receive them
+class BenchmarkConsumerThread : public Thread
+{
+public:
+   BenchmarkConsumerThread() : _numReceived(0), _numSignals(0) {/* empty */}
+
+   virtual void SignalInternalThread() {_numSignals++; Thread::SignalInternalThread();}  // always called with the signalling lock held
+
+   virtual status_t MessageReceivedFromOwner(const MessageRef & msgRef, uint32)
+   {
+      if (msgRef() == NULL) return B_ERROR;
+      _numReceived++;
+      return B_NO_ERROR;
+   }
+
+   uint32 _numReceived;
+   uint32 _numSignals;
+};
+
+// Sends the same Message to the consumer thread over and over again, as fast as it can
+class BenchmarkProducerThread : public Thread
+{
+public:
+   BenchmarkProducerThread() : Thread(false), _consumer(NULL), _numToSend(0) {/* empty */}
+
+   virtual void InternalThreadEntry()
+   {
+      MessageRef msg = GetMessageFromPool(1234);
+      for (uint32 i=0; i<_numToSend; i++) (void) _consumer->SendMessageToInternalThread(msg);
+   }
+
+   BenchmarkConsumerThread * _consumer;
+   uint32 _numToSend;
+};
+
+static int RunBenchmark(uint32 numMessages)
+{
+   printf("Sending " UINT32_FORMAT_SPEC " Messages to a Thread from 1, 2, and 4 producer threads at once...\n", numMessages);
+   printf("%10s  %10s  %16s  %12s\n", "Queue", "Producers", "Messages/second", "Wakeups");
+   for (uint32 lockFree=0; lockFree<2; lockFree++)
+   {
+      for (uint32 numProducers=1; numProducers<=4; numProducers*=2)
+      {
+         BenchmarkConsumerThread consumer;
+         if ((lockFree)&&(consumer.SetLockFreeMessagingEnabled(true) != B_NO_ERROR)) {printf("Lock-free messaging isn't supported on this platform.\n"); return 0;}
+         if (consumer.StartInternalThread() != B_NO_ERROR) {printf("Couldn't start consumer thread!\n"); return 10;}
+
+         BenchmarkProducerThread producers[4];
+         const uint64 startTime = GetRunTime64();
+         for (uint32 i=0; i<numProducers; i++)
+         {
+            producers[i]._consumer  = &consumer;
+            producers[i]._numToSend = numMessages/numProducers;
+            if (producers[i].StartInternalThread() != B_NO_ERROR) {printf("Couldn't start producer thread!\n"); return 10;}
+         }
+         for (uint32 i=0; i<numProducers; i++) (void) producers[i].WaitForInternalThreadToExit();
+         consumer.ShutdownInternalThread();
+         const uint64 elapsed = muscleMax(GetRunTime64()-startTime, (uint64)1);
+
+         const uint32 numSent = (numMessages/numProducers)*numProducers;
+         if (consumer._numReceived != numSent) {printf("ERROR, consumer received " UINT32_FORMAT_SPEC " Messages, expected " UINT32_FORMAT_SPEC "!\n", consumer._numReceived, numSent); return 10;}
+         printf("%10s  %10u  %16.0f  %12u\n", lockFree ? "lock-free" : "mutex", (unsigned) numProducers, ((double)numSent*1000000.0)/elapsed, (unsigned) consumer._numSignals);
+      }
+   }
+   return 0;
+}
+
+// This program exercises the Thread class.  Run it with the argument "benchmark" (and optionally a Message count) to measure messaging throughput instead.
+int main(int argc, char ** argv) 
 {
    CompleteSetupSystem css;
 
+   if ((argc > 1)&&(strcmp(argv[1], "benchmark") == 0)) return RunBenchmark((argc > 2) ? muscleMax((uint32)atol(argv[2]), (uint32)4) : 2000000);
+
    int * tls = _tls.GetOrCreateThreadLocalObject();
    if (tls) *tls = 3;
        else WARN_OUT_OF_MEMORY;
@@ -1,6 +1,7 @@
 /* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */  
 
 #include <stdio.h>
+#include "system/AtomicCounter.h"
 #include "system/ThreadPool.h"
 #include "system/SetupSystem.h"
 
@@ -19,14 +20,152 @@ public:
    }
 };
 
-// This program exercises the Thread class.
-int main(void) 
+// Checks that each client's Messages are handled one at a time, in the order they were sent
+class BenchmarkClient : public IThreadPoolClient
+{
+public:
+   BenchmarkClient() : IThreadPoolClient(NULL), _nextWhat(0), _numErrors(0) {/* empty */}
+
+   virtual void MessageReceivedFromThreadPool(const MessageRef & msgRef, uint32 /*numLeft*/)
+   {
+      if (_inHandler.AtomicIncrement() == false) _numErrors++;  // another thread is handling our Messages too!?
+      if (msgRef()->what != _nextWhat) _numErrors++;
+      _nextWhat = msgRef()->what+1;
+      (void) _inHandler.AtomicDecrement();
+   }
+
+   uint32 _nextWhat;
+   uint32 _numErrors;
+
+private:
+   AtomicCounter _inHandler;
+};
+
+// Returns the number of Messages per second handled, or -1.0 on error
+static double BenchmarkPool(ThreadPool & pool, uint32 numClients, uint32 numMessages)
+{
+   BenchmarkClient * clients = newnothrow_array(BenchmarkClient, numClients);
+   if (clients == NULL) {WARN_OUT_OF_MEMORY; return -1.0;}
+
+   for (uint32 i=0; i<numClients; i++) clients[i].SetThreadPool(&pool);
+
+   const uint32 numPerClient = muscleMax(numMessages/numClients, (uint32)1);
+   const uint64 startTime = GetRunTime64();
+   for (uint32 i=0; i<numPerClient; i++) for (uint32 j=0; j<numClients; j++) (void) clients[j].SendMessageToThreadPool(GetMessageFromPool(i));
+   for (uint32 i=0; i<numClients; i++) clients[i].SetThreadPool(NULL);  // blocks until all of the client's Messages have been handled
+   const uint64 elapsed = muscleMax(GetRunTime64()-startTime, (uint64)1);
+
+   double ret = ((double)numPerClient*numClients*1000000.0)/elapsed;
+   for (uint32 i=0; i<numClients; i++)
+   {
+      if ((clients[i]._numErrors > 0)||(clients[i]._nextWhat != numPerClient))
+      {
+         printf("ERROR:  client #" UINT32_FORMAT_SPEC " saw " UINT32_FORMAT_SPEC " out-of-order or concurrent Messages, and " UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " Messages in total!\n", i, clients[i]._numErrors, clients[i]._nextWhat, numPerClient);
+         ret = -1.0;
+         break;
+      }
+   }
+   delete [] clients;
+   return ret;
+}
+
+// Compares the throughput of ThreadPool and WorkStealingThreadPool for various numbers of threads and clients
+static int RunBenchmark(uint32 numMessages)
+{
+   static const uint32 threadCounts[] = {1, 2, 4, 8};
+   static const uint32 clientCounts[] = {1, 16, 256};
+
+   printf("Sending " UINT32_FORMAT_SPEC " Messages per test.\n", numMessages);
+   printf("%8s  %8s  %20s  %20s\n", "Threads", "Clients", "ThreadPool (msg/s)", "WorkStealing (msg/s)");
+   for (uint32 i=0; i<ARRAYITEMS(threadCounts); i++)
+   {
+      for (uint32 j=0; j<ARRAYITEMS(clientCounts); j++)
+      {
+         double plainRate, stealingRate;
+         {
+            ThreadPool pool(threadCounts[i]);
+            plainRate = BenchmarkPool(pool, clientCounts[j], numMessages);
+         }
+         {
+            WorkStealingThreadPool pool(threadCounts[i]);
+            stealingRate = BenchmarkPool(pool, clientCounts[j], numMessages);
+         }
+         if ((plainRate < 0.0)||(stealingRate < 0.0)) return 10;
+         printf("%8" UINT32_FORMAT_SPEC_NOPERCENT "  %8" UINT32_FORMAT_SPEC_NOPERCENT "  %20.0f  %20.0f\n", threadCounts[i], clientCounts[j], plainRate, stealingRate);
+      }
+   }
+   return 0;
+}
+
+// Handles each Message slowly, so that it still has Messages pending when its pool is shut down
+class SlowClient : public IThreadPoolClient
+{
+public:
+   SlowClient() : IThreadPoolClient(NULL) {/* empty */}
+
+   virtual void MessageReceivedFromThreadPool(const MessageRef & /*msgRef*/, uint32 /*numLeft*/) {Snooze64(MillisToMicros(5));}
+};
+
+// Unregisters a client from inside its own thread, so that the pool can be shut down while the unregistration is in progress
+class UnregisterThread : public Thread
+{
+public:
+   UnregisterThread() : _client(NULL) {/* empty */}
+
+   IThreadPoolClient * _client;
+
+protected:
+   virtual void InternalThreadEntry() {_client->SetThreadPool(NULL);}  // blocks until the client's Messages are handled, or the pool shuts down
+};
+
+// Deletes WorkStealingThreadPools while their clients are being unregistered by other threads
+static int RunShutdownTest()
+{
+   static const uint32 NUM_CLIENTS = 8;
+   for (uint32 round=0; round<20; round++)
+   {
+      WorkStealingThreadPool * pool = newnothrow WorkStealingThreadPool(4);
+      if (pool == NULL) {WARN_OUT_OF_MEMORY; return 10;}
+
+      SlowClient clients[NUM_CLIENTS];
+      UnregisterThread threads[NUM_CLIENTS];
+      for (uint32 i=0; i<NUM_CLIENTS; i++)
+      {
+         clients[i].SetThreadPool(pool);
+         for (uint32 j=0; j<5; j++) (void) clients[i].SendMessageToThreadPool(GetMessageFromPool(j));
+      }
+      for (uint32 i=0; i<NUM_CLIENTS; i++)
+      {
+         threads[i]._client = &clients[i];
+         if (threads[i].StartInternalThread() != B_NO_ERROR) {printf("ERROR:  couldn't start UnregisterThread!\n"); return 10;}
+      }
+
+      Snooze64(MillisToMicros(round));  // so that the unregistrations are at various stages when the pool goes away
+      delete pool;  // must wake up the UnregisterThreads, and wait until they are done with the pool
+      for (uint32 i=0; i<NUM_CLIENTS; i++) (void) threads[i].WaitForInternalThreadToExit();
+      for (uint32 i=0; i<NUM_CLIENTS; i++) if (clients[i].GetThreadPool() != NULL) {printf("ERROR:  client #" UINT32_FORMAT_SPEC " is still registered!\n", i); return 10;}
+   }
+   printf("Shutdown test passed.\n");
+   return 0;
+}
+
+// This program exercises the ThreadPool class.  Run it with the argument "benchmark" (and optionally a Message count) to
+// compare ThreadPool's throughput against WorkStealingThreadPool's, with the argument "shutdown" to check that a
+// WorkStealingThreadPool can be deleted while its clients are unregistering, or with the argument "workstealing" to
+// run the demonstration below against a WorkStealingThreadPool.
+int main(int argc, char ** argv) 
 {
    CompleteSetupSystem css;
 
+   if ((argc > 1)&&(strcmp(argv[1], "benchmark") == 0)) return RunBenchmark((argc > 2) ? muscleMax((uint32)atol(argv[2]), (uint32)1) : 200000);
+   if ((argc > 1)&&(strcmp(argv[1], "shutdown")  == 0)) return RunShutdownTest();
+   const bool workStealing = ((argc > 1)&&(strcmp(argv[1], "workstealing") == 0));
+
    printf("Creating pool...\n"); fflush(stdout);
 
-   ThreadPool pool;
+   ThreadPool plainPool;
+   WorkStealingThreadPool stealingPool;
+   ThreadPool & pool = workStealing ? (ThreadPool &)stealingPool : plainPool;
    {
       printf("Sending TestClient Messages to pool...\n"); fflush(stdout);
       TestClient tcs[10];
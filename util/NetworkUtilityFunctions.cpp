@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 
+#include "dataio/DataIO.h"  // for ConstIOVec
 #include "util/MiscUtilityFunctions.h"  // for GetConnectString() (which is deliberately defined here)
 #include "util/NetworkUtilityFunctions.h"
 #include "util/SocketMultiplexer.h"
@@ -31,6 +32,8 @@ typedef void sockopt_arg;  // Whereas sane operating systems use void pointers
 #  include <net/if.h>
 # endif
 # include <sys/ioctl.h>
+# include <sys/uio.h>  // for struct iovec
+# include <limits.h>   // for IOV_MAX
 # ifdef BEOS_OLD_NETSERVER
 #  include <app/Roster.h>     // for the run-time bone check
 #  include <storage/Entry.h>  // for the backup run-time bone check
@@ -125,6 +128,7 @@ static void InitializeSockAddr6(struct sockaddr_in6 & addr, const ip_address * o
    if (port) SET_SOCKADDR_PORT(addr, port);
 }
 # define DECLARE_SOCKADDR(addr, ip, port) struct sockaddr_in6 addr; InitializeSockAddr6(addr, ip, port);
+typedef struct sockaddr_in6 muscle_sockaddr;
 #else
 # define MUSCLE_SOCKET_FAMILY AF_INET
 static inline void GET_SOCKADDR_IP(const struct sockaddr_in & sockAddr, ip_address & ipAddr) {ipAddr = ntohl(sockAddr.sin_addr.s_addr);}
@@ -141,6 +145,7 @@ static void InitializeSockAddr4(struct sockaddr_in & addr, const ip_address * op
    if (port) SET_SOCKADDR_PORT(addr, port);
 }
 # define DECLARE_SOCKADDR(addr, ip, port) struct sockaddr_in addr; InitializeSockAddr4(addr, ip, port);
+typedef struct sockaddr_in muscle_sockaddr;
 #endif
 
 static GlobalSocketCallback * _globalSocketCallback = NULL;
@@ -239,7 +244,7 @@ status_t SetUDPSocketTarget(const ConstSocketRef & sock, const char * remoteHost
    return (hostIP != invalidIP) ? SetUDPSocketTarget(sock, hostIP, remotePort) : B_ERROR;
 }
 
-ConstSocketRef CreateAcceptingSocket(uint16 port, int maxbacklog, uint16 * optRetPort, const ip_address & optInterfaceIP)
+ConstSocketRef CreateAcceptingSocket(uint16 port, int maxbacklog, uint16 * optRetPort, const ip_address & optInterfaceIP, bool allowShared)
 {
    ConstSocketRef ret = CreateMuscleSocket(SOCK_STREAM, GlobalSocketCallback::SOCKET_CALLBACK_CREATE_ACCEPTING);
    if (ret())
@@ -250,6 +255,9 @@ ConstSocketRef CreateAcceptingSocket(uint16 port, int maxbacklog, uint16 * optRe
       // (Not necessary under windows -- it has the behaviour we want by default)
       const int trueValue = 1;
       (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const sockopt_arg *) &trueValue, sizeof(trueValue));
+# ifdef SO_REUSEPORT
+      if ((allowShared)&&(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const sockopt_arg *) &trueValue, sizeof(trueValue)) != 0)) return ConstSocketRef();
+# endif
 #endif
 
       DECLARE_SOCKADDR(saSocket, &optInterfaceIP, port);
@@ -313,6 +321,49 @@ int32 SendData(const ConstSocketRef & sock, const void * buffer, uint32 size, bo
    return (fd >= 0) ? ConvertReturnValueToMuscleSemantics(send_ignore_eintr(fd, (const char *)buffer, size, 0L), size, bm) : -1;
 }
 
+int32 SendDataGather(const ConstSocketRef & sock, const ConstIOVec * blocks, uint32 numBlocks, bool bm)
+{
+   int fd = sock.GetFileDescriptor();
+   if (fd < 0) return -1;
+
+   // Any blocks beyond the first (MAX_BLOCKS_PER_CALL) will simply go out on a subsequent call
+   uint32 totalSize = 0;
+#ifdef WIN32
+   static const uint32 MAX_BLOCKS_PER_CALL = 64;
+   WSABUF bufs[MAX_BLOCKS_PER_CALL];
+   const uint32 numBufs = muscleMin(numBlocks, MAX_BLOCKS_PER_CALL);
+   for (uint32 i=0; i<numBufs; i++)
+   {
+      bufs[i].buf = (char *) blocks[i].GetBytes();
+      bufs[i].len = blocks[i].GetNumBytes();
+      totalSize  += blocks[i].GetNumBytes();
+   }
+   DWORD numSent = 0;
+   int r = (WSASend(fd, bufs, numBufs, &numSent, 0, NULL, NULL) == 0) ? (int)numSent : -1;
+#else
+# if defined(IOV_MAX) && (IOV_MAX < 64)
+   static const uint32 MAX_BLOCKS_PER_CALL = IOV_MAX;
+# else
+   static const uint32 MAX_BLOCKS_PER_CALL = 64;
+# endif
+   struct iovec iovs[MAX_BLOCKS_PER_CALL];
+   const uint32 numIovs = muscleMin(numBlocks, MAX_BLOCKS_PER_CALL);
+   for (uint32 i=0; i<numIovs; i++)
+   {
+      iovs[i].iov_base = (void *) blocks[i].GetBytes();
+      iovs[i].iov_len  = blocks[i].GetNumBytes();
+      totalSize       += blocks[i].GetNumBytes();
+   }
+
+   struct msghdr mh; memset(&mh, 0, sizeof(mh));
+   mh.msg_iov    = iovs;
+   mh.msg_iovlen = numIovs;
+
+   int r; do {r = sendmsg(fd, &mh, 0);} while((r<0)&&(PreviousOperationWasInterrupted()));
+#endif
+   return ConvertReturnValueToMuscleSemantics(r, totalSize, bm);
+}
+
 int32 WriteData(const ConstSocketRef & sock, const void * buffer, uint32 size, bool bm)
 {
 #ifdef WIN32
@@ -383,6 +434,132 @@ int32 SendDataUDP(const ConstSocketRef & sock, const void * buffer, uint32 size,
    else return -1;
 }
 
+#if defined(__linux__) && !defined(MUSCLE_AVOID_MMSG)
+# define MUSCLE_USE_MMSG 1
+static const uint32 MAX_PACKETS_PER_CALL = 64;  // any packets beyond this many will simply be handled on a subsequent call
+#endif
+
+int32 ReceivePacketsUDP(const ConstSocketRef & sock, PacketIOVec * packets, uint32 numPackets, bool bm)
+{
+   int fd = sock.GetFileDescriptor();
+   if (fd < 0) return -1;
+   if (numPackets == 0) return 0;
+
+#ifdef MUSCLE_USE_MMSG
+   const uint32 numMsgs = muscleMin(numPackets, MAX_PACKETS_PER_CALL);
+   struct mmsghdr msgs[MAX_PACKETS_PER_CALL];
+   struct iovec iovs[MAX_PACKETS_PER_CALL];
+   muscle_sockaddr fromAddrs[MAX_PACKETS_PER_CALL];
+   memset(msgs, 0, numMsgs*sizeof(msgs[0]));
+   for (uint32 i=0; i<numMsgs; i++)
+   {
+      iovs[i].iov_base = packets[i].GetBytes();
+      iovs[i].iov_len  = packets[i].GetNumBytes();
+
+      struct msghdr & mh = msgs[i].msg_hdr;
+      mh.msg_iov    = &iovs[i];
+      mh.msg_iovlen = 1;
+      if (packets[i].GetAddress())
+      {
+         mh.msg_name    = &fromAddrs[i];
+         mh.msg_namelen = sizeof(fromAddrs[i]);
+      }
+   }
+
+   // In blocking mode, MSG_WAITFORONE makes recvmmsg() block only until the first packet arrives
+   int r; do {r = recvmmsg(fd, msgs, numMsgs, bm?MSG_WAITFORONE:0, NULL);} while((r<0)&&(PreviousOperationWasInterrupted()));
+   for (int i=0; i<r; i++)
+   {
+      PacketIOVec & p = packets[i];
+      p.SetNumBytes(msgs[i].msg_len);
+      if (p.GetAddress())
+      {
+         ip_address fromIP;
+         GET_SOCKADDR_IP(fromAddrs[i], fromIP);
+         p.GetAddress()->SetIPAddress(fromIP);
+         p.GetAddress()->SetPort(GET_SOCKADDR_PORT(fromAddrs[i]));
+      }
+   }
+   return ConvertReturnValueToMuscleSemantics(r, numMsgs, bm);
+#else
+   int32 ret = 0;
+   for (uint32 i=0; i<numPackets; i++)
+   {
+      PacketIOVec & p = packets[i];
+      ip_address fromIP = invalidIP;
+      uint16 fromPort = 0;
+      int32 r = ReceiveDataUDP(sock, p.GetBytes(), p.GetNumBytes(), bm, &fromIP, &fromPort);
+      if (r < 0) return (ret > 0) ? ret : -1;  // report the error on the next call, if we already received some packets
+      if (r == 0) break;  // nothing more to receive, for now
+
+      p.SetNumBytes(r);
+      if (p.GetAddress()) *p.GetAddress() = IPAddressAndPort(fromIP, fromPort);
+      ret++;
+      if (bm) break;  // another recv() on a blocking socket might never return
+   }
+   return ret;
+#endif
+}
+
+int32 SendPacketsUDP(const ConstSocketRef & sock, const PacketIOVec * packets, uint32 numPackets, bool bm)
+{
+   int fd = sock.GetFileDescriptor();
+   if (fd < 0) return -1;
+   if (numPackets == 0) return 0;
+
+#ifdef MUSCLE_USE_MMSG
+   const uint32 numMsgs = muscleMin(numPackets, MAX_PACKETS_PER_CALL);
+   struct mmsghdr msgs[MAX_PACKETS_PER_CALL];
+   struct iovec iovs[MAX_PACKETS_PER_CALL];
+   muscle_sockaddr toAddrs[MAX_PACKETS_PER_CALL];
+   memset(msgs, 0, numMsgs*sizeof(msgs[0]));
+   for (uint32 i=0; i<numMsgs; i++)
+   {
+      const PacketIOVec & p = packets[i];
+      iovs[i].iov_base = p.GetBytes();
+      iovs[i].iov_len  = p.GetNumBytes();
+
+      struct msghdr & mh = msgs[i].msg_hdr;
+      mh.msg_iov    = &iovs[i];
+      mh.msg_iovlen = 1;
+
+      const IPAddressAndPort * iap = p.GetAddress();
+      if ((iap)&&((iap->GetPort())||(iap->GetIPAddress() != invalidIP)))
+      {
+         // Same addressing logic as SendDataUDP()
+         DECLARE_SOCKADDR(toAddr, NULL, 0);
+         if ((iap->GetPort() == 0)||(iap->GetIPAddress() == invalidIP))
+         {
+            // Fill in the values with our socket's current target-values, as defaults
+            muscle_socklen_t length = sizeof(sockaddr_in);
+            if ((getpeername(fd, (struct sockaddr *)&toAddr, &length) != 0)||(GET_SOCKADDR_FAMILY(toAddr) != MUSCLE_SOCKET_FAMILY)) return -1;
+         }
+         if (iap->GetIPAddress() != invalidIP) SET_SOCKADDR_IP(toAddr, iap->GetIPAddress());
+         if (iap->GetPort()) SET_SOCKADDR_PORT(toAddr, iap->GetPort());
+
+         toAddrs[i]     = toAddr;
+         mh.msg_name    = &toAddrs[i];
+         mh.msg_namelen = sizeof(toAddrs[i]);
+      }
+   }
+
+   int r; do {r = sendmmsg(fd, msgs, numMsgs, 0);} while((r<0)&&(PreviousOperationWasInterrupted()));
+   return ConvertReturnValueToMuscleSemantics(r, numMsgs, bm);
+#else
+   int32 ret = 0;
+   for (uint32 i=0; i<numPackets; i++)
+   {
+      const PacketIOVec & p = packets[i];
+      const IPAddressAndPort * iap = p.GetAddress();
+      int32 r = SendDataUDP(sock, p.GetBytes(), p.GetNumBytes(), bm, iap ? iap->GetIPAddress() : invalidIP, iap ? iap->GetPort() : 0);
+      if (r < 0) return (ret > 0) ? ret : -1;  // report the error on the next call, if we already sent some packets
+      if (((uint32)r) < p.GetNumBytes()) break;  // no more buffer space, for now
+      ret++;
+   }
+   return ret;
+#endif
+}
+
 status_t ShutdownSocket(const ConstSocketRef & sock, bool dRecv, bool dSend)
 {
    int fd = sock.GetFileDescriptor();
@@ -23,6 +23,9 @@
 
 namespace muscle {
 
+class ConstIOVec;  // defined in dataio/DataIO.h
+class PacketIOVec;  // defined in dataio/DataIO.h
+
 /** @defgroup networkutilityfunctions The NetworkUtilityFunctions function API
  *  These functions are all defined in NetworkUtilityFunctions(.cpp,.h), and are stand-alone
  *  functions that do various network-related tasks
@@ -423,6 +426,20 @@ int32 ReceiveData(const ConstSocketRef & sock, void * buffer, uint32 bufferSizeB
  */
 int32 ReceiveDataUDP(const ConstSocketRef & sock, void * buffer, uint32 bufferSizeBytes, bool socketIsBlockingIO, ip_address * optRetFromIP = NULL, uint16 * optRetFromPort = NULL);
 
+/** Receives as many UDP packets as are available (up to (numPackets)) from the given socket.
+ *  Under Linux this is done with a single recvmmsg() call (unless MUSCLE_AVOID_MMSG is defined);
+ *  elsewhere it is done by calling ReceiveDataUDP() once per packet.
+ *  @param sock The socket to read from.
+ *  @param packets Array of packets to receive into.  On success, the byte-count of each received packet
+ *                 is set to the size of its datagram, and if the packet has an address, the address is
+ *                 set to the IP address and port that the datagram came from.
+ *  @param numPackets Number of items in the (packets) array.  Note that at most 64 packets will be received per call.
+ *  @param socketIsBlockingIO Pass in true if the given socket is set to use blocking I/O, or false otherwise.
+ *                            If true, this function blocks only until the first packet is received.
+ *  @return The number of packets received, or a negative value if there was an error.
+ */
+int32 ReceivePacketsUDP(const ConstSocketRef & sock, PacketIOVec * packets, uint32 numPackets, bool socketIsBlockingIO);
+
 /** Similar to ReceiveData(), except that it will call read() instead of recv().
  *  This is the function to use if (fd) is referencing a file descriptor instead of a socket.
  *  @param fd The file descriptor to read from.
@@ -444,6 +461,17 @@ int32 ReadData(const ConstSocketRef & fd, void * buffer, uint32 bufferSizeBytes,
  */
 int32 SendData(const ConstSocketRef & sock, const void * buffer, uint32 bufferSizeBytes, bool socketIsBlockingIO);
 
+/** Transmits as many bytes as possible from the given blocks over the given socket, in order, using
+ *  a single system call (writev()-style), so that the blocks don't have to be copied into one buffer first.
+ *  @param sock The socket to transmit over.
+ *  @param blocks Array of blocks to read the outgoing bytes from.
+ *  @param numBlocks Number of items in the (blocks) array.  Note that at most 64 blocks will be sent per call.
+ *  @param socketIsBlockingIO Pass in true if the given socket is set to use blocking I/O, or false otherwise.
+ *  @return The number of bytes sent, or a negative value if there was an error.
+ *          Note that this value may be smaller than the total size of the blocks.
+ */
+int32 SendDataGather(const ConstSocketRef & sock, const ConstIOVec * blocks, uint32 numBlocks, bool socketIsBlockingIO);
+
 /** Similar to SendData(), except that this function's logic is adjusted to handle UDP semantics properly.
  *  @param sock The socket to transmit over.
  *  @param buffer Buffer to read the outgoing bytes from.
@@ -458,6 +486,20 @@ int32 SendData(const ConstSocketRef & sock, const void * buffer, uint32 bufferSi
  */
 int32 SendDataUDP(const ConstSocketRef & sock, const void * buffer, uint32 bufferSizeBytes, bool socketIsBlockingIO, const ip_address & optDestIP = invalidIP, uint16 destPort = 0);
 
+/** Sends as many of the given UDP packets as possible over the given socket, in order.
+ *  Under Linux this is done with a single sendmmsg() call (unless MUSCLE_AVOID_MMSG is defined);
+ *  elsewhere it is done by calling SendDataUDP() once per packet.
+ *  @param sock The socket to transmit over.
+ *  @param packets Array of packets to send.  Each packet is sent to its address, as if the address's IP
+ *                 address and port had been passed to SendDataUDP(); packets with no address are sent to
+ *                 the socket's current destination (see SetUDPSocketTarget()).
+ *  @param numPackets Number of items in the (packets) array.  Note that at most 64 packets will be sent per call.
+ *  @param socketIsBlockingIO Pass in true if the given socket is set to use blocking I/O, or false otherwise.
+ *  @return The number of packets sent, or a negative value if there was an error.
+ *          Note that this value may be smaller than (numPackets).
+ */
+int32 SendPacketsUDP(const ConstSocketRef & sock, const PacketIOVec * packets, uint32 numPackets, bool socketIsBlockingIO);
+
 /** Similar to SendData(), except that the implementation calls write() instead of send().  This
  *  is the function to use when (fd) refers to a file descriptor instead of a socket.
  *  @param fd The file descriptor to write the data to.
@@ -524,9 +566,12 @@ status_t ShutdownSocket(const ConstSocketRef & sock, bool disableReception = tru
  *  @param optRetPort If non-NULL, the uint16 this value points to will be set to the actual port bound to (useful when you want the system to choose a port for you)
  *  @param optInterfaceIP Optional IP address of the local network interface to listen on.  If left unspecified, or
  *                        if passed in as (invalidIP), then this socket will listen on all available network interfaces.
+ *  @param allowShared If set to true, the socket will be set up (via SO_REUSEPORT) so that other sockets created with
+ *                     this flag set may listen on the same port at the same time, with the OS dividing incoming connections
+ *                     amongst them.  Defaults to false.  Ignored on systems that don't support SO_REUSEPORT.
  * @return A non-NULL ConstSocketRef if the port was bound successfully, or a NULL ConstSocketRef if the accept failed.
  */
-ConstSocketRef CreateAcceptingSocket(uint16 port, int maxbacklog = 20, uint16 * optRetPort = NULL, const ip_address & optInterfaceIP = invalidIP);
+ConstSocketRef CreateAcceptingSocket(uint16 port, int maxbacklog = 20, uint16 * optRetPort = NULL, const ip_address & optInterfaceIP = invalidIP, bool allowShared = false);
 
 /** Translates the given 4-byte IP address into a string representation.
  *  @param address The 4-byte IP address to translate into text.
@@ -17,6 +17,17 @@ namespace muscle {
 # define DEFAULT_MUSCLE_POOL_SLAB_SIZE (4*1024)  // let's have each slab fit nicely into a 4KB page
 #endif
 
+// Under pthreads, each thread keeps a small per-thread "magazine" of spare objects for each ObjectPool
+// it uses, so that most ObtainObject() and ReleaseObject() calls don't need to lock the pool's Mutex.
+// Define MUSCLE_AVOID_OBJECTPOOL_MAGAZINES to disable this and lock the Mutex on every call instead.
+#if defined(MUSCLE_USE_PTHREADS) && !defined(MUSCLE_SINGLE_THREAD_ONLY) && !defined(DISABLE_OBJECT_POOLING) && !defined(MUSCLE_AVOID_OBJECTPOOL_MAGAZINES)
+# define MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES 1
+#endif
+
+#ifndef MUSCLE_POOL_MAGAZINE_SIZE
+# define MUSCLE_POOL_MAGAZINE_SIZE 32  // maximum number of spare objects a thread may hold in its magazine for any one ObjectPool
+#endif
+
 /** An interface that must be implemented by all ObjectPool classes.
   * Used to support polymorphism in pool management.
   */
@@ -74,12 +85,102 @@ private:
    AbstractObjectRecycler * _next;
 };
 
+class AbstractObjectManager;
+
+/** A small per-thread cache of spare objects belonging to a single ObjectPool.  
+  * This class is used internally by the ObjectPool class; user code shouldn't need to use it.
+  */
+class ObjectPoolMagazine
+{
+public:
+   /** Constructor.  
+     * @param pool the pool that our objects will belong to.
+     */
+   ObjectPoolMagazine(AbstractObjectManager * pool) : _pool(pool), _numObjects(0), _prev(NULL), _next(NULL) {/* empty */}
+
+   AbstractObjectManager * _pool;   // the pool our objects belong to, or NULL if that pool has been destroyed
+   uint32 _numObjects;              // how many objects are currently in (_objects)
+   void * _objects[MUSCLE_POOL_MAGAZINE_SIZE];
+   ObjectPoolMagazine * _prev;      // for our pool's list of magazines (guarded by the global muscle lock)
+   ObjectPoolMagazine * _next;      // for our pool's list of magazines (guarded by the global muscle lock)
+};
+
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+/** Each thread's table of ObjectPoolMagazines, indexed by ObjectPool.  Used internally by AbstractObjectManager. */
+class ObjectPoolMagazineTable
+{
+public:
+   ObjectPoolMagazineTable() : _magazines(NULL), _numSlots(0) {/* empty */}
+
+   ObjectPoolMagazine ** _magazines;
+   uint32 _numSlots;
+};
+
+// These are set up by the ThreadSetupSystem class ONLY!
+extern pthread_key_t _objectPoolMagazinesKey;
+extern bool _objectPoolMagazinesKeyValid;
+#endif
+
 /** This class is just here to usefully tie together the object generating and
   * object recycling capabilities of its two superclasses into a single interface.
+  * It also manages the per-thread ObjectPoolMagazines used by the ObjectPool class.
   */
 class AbstractObjectManager : public AbstractObjectGenerator, public AbstractObjectRecycler
 {
-   // empty
+public:
+   /** Default constructor */
+   AbstractObjectManager() : _magazineSlot(MUSCLE_NO_LIMIT), _firstMagazine(NULL) {/* empty */}
+
+   /** Destructor */
+   virtual ~AbstractObjectManager() {/* empty */}
+
+   /** Returns all of the objects in (mag) to this pool, leaving (mag) empty.
+     * Called when the thread that owns (mag) exits, and when this pool is destroyed.
+     * Default implementation is a no-op.
+     * @param mag the ObjectPoolMagazine to empty out.
+     */
+   virtual void ReclaimMagazineObjects(ObjectPoolMagazine & mag) {(void) mag;}
+
+   /** Called by the ThreadSetupSystem code when the thread that owns (mag) is going away.
+     * Returns all of (mag)'s objects to its pool and removes (mag) from its pool's list of magazines.
+     * The global muscle lock must be locked when this is called.
+     * @param mag The magazine that is about to be deleted.
+     */
+   static void MagazineThreadExiting(ObjectPoolMagazine & mag);
+
+protected:
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+   /** Returns the calling thread's ObjectPoolMagazine for this pool, creating it if necessary.
+     * Returns NULL if per-thread magazines aren't available (e.g. because we are running in single-threaded mode).
+     */
+   inline ObjectPoolMagazine * GetThreadMagazine()
+   {
+      if (_objectPoolMagazinesKeyValid == false) return NULL;
+      ObjectPoolMagazine * mag = PeekThreadMagazine();
+      return mag ? mag : CreateThreadMagazine();
+   }
+
+   /** Returns the calling thread's ObjectPoolMagazine for this pool, or NULL if it doesn't have one. */
+   inline ObjectPoolMagazine * PeekThreadMagazine() const
+   {
+      if (_objectPoolMagazinesKeyValid == false) return NULL;
+      const ObjectPoolMagazineTable * t = (const ObjectPoolMagazineTable *) pthread_getspecific(_objectPoolMagazinesKey);
+      return ((t)&&(_magazineSlot < t->_numSlots)) ? t->_magazines[_magazineSlot] : NULL;
+   }
+#endif
+
+   /** Empties all of the ObjectPoolMagazines that hold our objects (in every thread) and detaches them from us.
+     * Should be called by the subclass's destructor, when no other threads are using this pool any longer.
+     */
+   void DetachAllMagazines();
+
+private:
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+   ObjectPoolMagazine * CreateThreadMagazine();
+#endif
+
+   uint32 _magazineSlot;                 // our index into each thread's ObjectPoolMagazineTable (assigned on first use)
+   ObjectPoolMagazine * _firstMagazine;  // all the magazines holding our objects (guarded by the global muscle lock)
 };
 
 /** A thread-safe templated object pooling class that helps reduce the number of 
@@ -88,6 +189,12 @@ class AbstractObjectManager : public AbstractObjectGenerator, public AbstractObj
  *  myObjectPool.ReleaseObject().  The advantage is that the ObjectPool will
  *  keep (up to a certain number of) "spare" Objects around, and recycle them back
  *  to you as needed. 
+ *
+ *  When per-thread magazines are enabled (see MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES), each thread
+ *  also keeps up to MUSCLE_POOL_MAGAZINE_SIZE spare objects of its own, which it can obtain and
+ *  release without locking.  Objects move between a thread's magazine and the shared pool in
+ *  batches of half a magazine, so objects released by a thread other than the one that obtained
+ *  them simply flow back to the shared pool once the releasing thread's magazine is full.
  */
 template <class Object, int MUSCLE_POOL_SLAB_SIZE=DEFAULT_MUSCLE_POOL_SLAB_SIZE> class ObjectPool : public AbstractObjectManager
 {
@@ -106,6 +213,7 @@ public:
     */
    virtual ~ObjectPool()
    {
+      DetachAllMagazines();  // so that any spare objects in per-thread magazines won't look like they are still in use
       while(_firstSlab)
       {
          if (_firstSlab->IsInUse()) 
@@ -134,12 +242,12 @@ public:
           else WARN_OUT_OF_MEMORY;
       return ret;
 #else
-      Object * ret = NULL;
-      if (_mutex.Lock() == B_NO_ERROR)
-      {
-         ret = ObtainObjectAux();
-         _mutex.Unlock();
-      }
+# ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+      ObjectPoolMagazine * mag = GetThreadMagazine();
+      Object * ret = mag ? ObtainObjectFromMagazine(*mag) : ObtainObjectLocked();
+# else
+      Object * ret = ObtainObjectLocked();
+# endif
       if (ret) ret->SetManager(this);
           else WARN_OUT_OF_MEMORY;
       return ret;
@@ -162,13 +270,13 @@ public:
 #ifdef DISABLE_OBJECT_POOLING
          delete obj;
 #else
-         if (_mutex.Lock() == B_NO_ERROR)
-         {
-            ObjectSlab * slabToDelete = ReleaseObjectAux(obj);
-            _mutex.Unlock();
-            delete slabToDelete;  // do this outside the critical section, for better concurrency
-         }
-         else WARN_OUT_OF_MEMORY;  // critical error -- not really out of memory but still
+# ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+         ObjectPoolMagazine * mag = GetThreadMagazine();
+         if (mag) ReleaseObjectToMagazine(*mag, obj);
+             else ReleaseObjectLocked(obj);
+# else
+         ReleaseObjectLocked(obj);
+# endif
 #endif
       }
    }
@@ -182,13 +290,23 @@ public:
    /** Implemented to call Drain() and return the number of objects drained. */
    virtual uint32 FlushCachedObjects() {uint32 ret = 0; (void) Drain(&ret); return ret;}
 
+   /** Implemented to return all of (mag)'s objects to our shared pool. */
+   virtual void ReclaimMagazineObjects(ObjectPoolMagazine & mag) {ReturnMagazineObjects(mag, mag._numObjects);}
+
    /** Removes all "spare" objects from the pool and deletes them. 
+     * Spare objects in the calling thread's magazine are included, but spare objects in
+     * other threads' magazines are left alone, since those threads may be using them.
      * This method is thread-safe.
      * @param optSetNumDrained If non-NULL, this value will be set to the number of objects destroyed.
      * @returns B_NO_ERROR on success, or B_ERROR if it couldn't lock the lock for some reason.
      */
    status_t Drain(uint32 * optSetNumDrained = NULL)
    {
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+      ObjectPoolMagazine * mag = PeekThreadMagazine();
+      if (mag) ReturnMagazineObjects(*mag, mag->_numObjects);
+#endif
+
       if (_mutex.Lock() == B_NO_ERROR)
       {
          // This will be our linked list of slabs to delete, later
@@ -442,6 +560,84 @@ private:
       // Any other member variables should be added to the ObjectSlabData class rather than here, so that we can calculate NUM_OBJECTS_PER_SLAB correctly
    };
 
+   Object * ObtainObjectLocked()
+   {
+      Object * ret = NULL;
+      if (_mutex.Lock() == B_NO_ERROR)
+      {
+         ret = ObtainObjectAux();
+         _mutex.Unlock();
+      }
+      return ret;
+   }
+
+   void ReleaseObjectLocked(Object * obj)
+   {
+      if (_mutex.Lock() == B_NO_ERROR)
+      {
+         ObjectSlab * slabToDelete = ReleaseObjectAux(obj);
+         _mutex.Unlock();
+         delete slabToDelete;  // do this outside the critical section, for better concurrency
+      }
+      else WARN_OUT_OF_MEMORY;  // critical error -- not really out of memory but still
+   }
+
+#ifdef MUSCLE_ENABLE_OBJECTPOOL_MAGAZINES
+   Object * ObtainObjectFromMagazine(ObjectPoolMagazine & mag)
+   {
+      if ((mag._numObjects == 0)&&(_mutex.Lock() == B_NO_ERROR))
+      {
+         // Refill half of the magazine at once, so that we only need to lock once per several calls.
+         // Note that (mag) is kept consistent at every step, in case a memory-allocation callback drains it.
+         while(mag._numObjects < (MUSCLE_POOL_MAGAZINE_SIZE/2))
+         {
+            Object * obj = ObtainObjectAux();
+            if (obj) mag._objects[mag._numObjects++] = obj;
+                else break;
+         }
+         _mutex.Unlock();
+      }
+      return (mag._numObjects > 0) ? static_cast<Object *>(mag._objects[--mag._numObjects]) : NULL;
+   }
+
+   void ReleaseObjectToMagazine(ObjectPoolMagazine & mag, Object * obj)
+   {
+      if (mag._numObjects == MUSCLE_POOL_MAGAZINE_SIZE) ReturnMagazineObjects(mag, MUSCLE_POOL_MAGAZINE_SIZE/2);
+      if (mag._numObjects < MUSCLE_POOL_MAGAZINE_SIZE) mag._objects[mag._numObjects++] = obj;
+                                                  else ReleaseObjectLocked(obj);  // should never happen, but just in case
+   }
+#endif
+
+   // Returns the (numToReturn) least-recently-released objects in (mag) to our shared pool
+   void ReturnMagazineObjects(ObjectPoolMagazine & mag, uint32 numToReturn)
+   {
+      if ((numToReturn > 0)&&(_mutex.Lock() == B_NO_ERROR))
+      {
+         ObjectSlab * toDelete = NULL;
+         for (uint32 i=0; i<numToReturn; i++)
+         {
+            ObjectSlab * slab = ReleaseObjectAux(static_cast<Object *>(mag._objects[i]));
+            if (slab)
+            {
+               slab->SetNext(toDelete);
+               toDelete = slab;
+            }
+         }
+         _mutex.Unlock();
+
+         mag._numObjects -= numToReturn;
+         if (mag._numObjects > 0) memmove(mag._objects, &mag._objects[numToReturn], mag._numObjects*sizeof(mag._objects[0]));
+
+         // Do the actual slab deletions outside of the critical section, for better concurrency
+         while(toDelete)
+         {
+            ObjectSlab * nextSlab = toDelete->GetNext();
+            delete toDelete;
+            toDelete = nextSlab;
+         }
+      }
+   }
+
    // Must be called with _mutex locked!   Returns either NULL, or a pointer to a
    // newly allocated Object.
    Object * ObtainObjectAux()
@@ -4,7 +4,7 @@
 
 namespace muscle {
 
-PulseNode :: PulseNode() : _parent(NULL), _aggregatePulseTime(MUSCLE_TIME_NEVER), _myScheduledTime(MUSCLE_TIME_NEVER), _cycleStartedAt(0), _myScheduledTimeValid(false), _curList(-1), _prevSibling(NULL), _nextSibling(NULL), _maxTimeSlice(MUSCLE_TIME_NEVER), _timeSlicingSuggested(false)
+PulseNode :: PulseNode() : _parent(NULL), _aggregatePulseTime(MUSCLE_TIME_NEVER), _myScheduledTime(MUSCLE_TIME_NEVER), _cycleStartedAt(0), _myScheduledTimeValid(false), _curList(-1), _prevSibling(NULL), _nextSibling(NULL), _scheduledIndex(0), _numChildren(0), _maxTimeSlice(MUSCLE_TIME_NEVER), _timeSlicingSuggested(false)
 {
    for (uint32 i=0; i<NUM_LINKED_LISTS; i++) _firstChild[i] = _lastChild[i] = NULL;
 }
@@ -26,6 +26,11 @@ void PulseNode :: Pulse(const PulseArgs &)
    // empty
 }
 
+void PulseNode :: AboutToPulseChild(PulseNode &)
+{
+   // empty
+}
+
 void PulseNode :: InvalidatePulseTime(bool clearPrevResult)
 {
    if (_myScheduledTimeValid)
@@ -66,11 +71,11 @@ void PulseNode :: PulseAux(uint64 now)
       _myScheduledTimeValid = false;
    }
 
-   PulseNode * p = _firstChild[LINKED_LIST_SCHEDULED];
-   while((p)&&(now >= p->_aggregatePulseTime))
+   while((_scheduledChildren.HasItems())&&(now >= _scheduledChildren.Head()->_aggregatePulseTime))
    {
-      p->PulseAux(now);  // guaranteed to move (p) to our NEEDSRECALC list
-      p = _firstChild[LINKED_LIST_SCHEDULED];  // and move on to the next scheduled child
+      PulseNode * p = _scheduledChildren.Head();
+      AboutToPulseChild(*p);
+      p->PulseAux(now);  // guaranteed to move (p) to our NEEDSRECALC list, and the next scheduled child to the head of the heap
    }
 
    // Make sure we get recalculated no matter what (because we know something happened)
@@ -79,8 +84,12 @@ void PulseNode :: PulseAux(uint64 now)
 
 status_t PulseNode :: PutPulseChild(PulseNode * child)
 {
+   // Reserve a heap slot for every child up front, so that ReschedulePulseChild() never needs to allocate memory
+   if (_scheduledChildren.EnsureSize(_numChildren+1, false, _numChildren+1) != B_NO_ERROR) {WARN_OUT_OF_MEMORY; return B_ERROR;}
+
    if (child->_parent) child->_parent->RemovePulseChild(child);
    child->_parent = this;
+   _numChildren++;
    ReschedulePulseChild(child, LINKED_LIST_NEEDSRECALC);
    return B_NO_ERROR;
 }
@@ -89,9 +98,10 @@ status_t PulseNode :: RemovePulseChild(PulseNode * child)
 {
    if (child->_parent == this)
    {
-      bool doResched = (child == _firstChild[LINKED_LIST_SCHEDULED]);
+      bool doResched = ((child->_curList == LINKED_LIST_SCHEDULED)&&(child->_scheduledIndex == 0));
       ReschedulePulseChild(child, -1);
       child->_parent = NULL;
+      _numChildren--;
       child->_myScheduledTimeValid = false;
       if ((doResched)&&(_parent)) _parent->ReschedulePulseChild(this, LINKED_LIST_NEEDSRECALC);
       return B_NO_ERROR;
@@ -102,15 +112,76 @@ status_t PulseNode :: RemovePulseChild(PulseNode * child)
 void PulseNode :: ClearPulseChildren()
 {
    for (uint32 i=0; i<NUM_LINKED_LISTS; i++) while(_firstChild[i]) (void) RemovePulseChild(_firstChild[i]);
+   while(_scheduledChildren.HasItems()) (void) RemovePulseChild(_scheduledChildren.Tail());  // removing from the tail is cheapest
+}
+
+void PulseNode :: UpHeapScheduledChild(uint32 idx)
+{
+   PulseNode * child = _scheduledChildren[idx];
+   while(idx > 0)
+   {
+      const uint32 parentIdx = (idx-1)/2;
+      PulseNode * p = _scheduledChildren[parentIdx];
+      if (p->_aggregatePulseTime <= child->_aggregatePulseTime) break;
+      _scheduledChildren[idx] = p;
+      p->_scheduledIndex = idx;
+      idx = parentIdx;
+   }
+   _scheduledChildren[idx] = child;
+   child->_scheduledIndex = idx;
+}
+
+void PulseNode :: DownHeapScheduledChild(uint32 idx)
+{
+   PulseNode * child = _scheduledChildren[idx];
+   const uint32 numItems = _scheduledChildren.GetNumItems();
+   while(true)
+   {
+      uint32 kidIdx = (idx*2)+1;
+      if (kidIdx >= numItems) break;
+      if ((kidIdx+1 < numItems)&&(_scheduledChildren[kidIdx+1]->_aggregatePulseTime < _scheduledChildren[kidIdx]->_aggregatePulseTime)) kidIdx++;
+
+      PulseNode * kid = _scheduledChildren[kidIdx];
+      if (child->_aggregatePulseTime <= kid->_aggregatePulseTime) break;
+      _scheduledChildren[idx] = kid;
+      kid->_scheduledIndex = idx;
+      idx = kidIdx;
+   }
+   _scheduledChildren[idx] = child;
+   child->_scheduledIndex = idx;
+}
+
+void PulseNode :: RemoveScheduledChild(PulseNode * child)
+{
+   const uint32 idx = child->_scheduledIndex;
+   PulseNode * last = _scheduledChildren.Tail();
+   (void) _scheduledChildren.RemoveTail();
+   if (last != child)
+   {
+      // Move the last child into the vacated slot, then let it find its proper place in the heap
+      _scheduledChildren[idx] = last;
+      last->_scheduledIndex = idx;
+      if ((idx > 0)&&(last->_aggregatePulseTime < _scheduledChildren[(idx-1)/2]->_aggregatePulseTime)) UpHeapScheduledChild(idx);
+                                                                                                   else DownHeapScheduledChild(idx);
+   }
+   child->_scheduledIndex = 0;
 }
 
 void PulseNode :: ReschedulePulseChild(PulseNode * child, int whichList)
 {
    int cl = child->_curList;
-   if ((whichList != cl)||(cl == LINKED_LIST_SCHEDULED))  // since we may need to move within the scheduled list
+   if ((whichList == cl)&&(cl == LINKED_LIST_SCHEDULED))
+   {
+      // The child is already in the heap, but its pulse time has changed, so we just need to move it to its new position
+      const uint32 idx = child->_scheduledIndex;
+      if ((idx > 0)&&(child->_aggregatePulseTime < _scheduledChildren[(idx-1)/2]->_aggregatePulseTime)) UpHeapScheduledChild(idx);
+                                                                                                    else DownHeapScheduledChild(idx);
+   }
+   else if (whichList != cl)
    {
       // First, remove the child from any list he may currently be in
-      if (cl >= 0)
+      if (cl == LINKED_LIST_SCHEDULED) RemoveScheduledChild(child);
+      else if (cl >= 0)
       {
          if (child->_prevSibling) child->_prevSibling->_nextSibling = child->_nextSibling;
          if (child->_nextSibling) child->_nextSibling->_prevSibling = child->_prevSibling;
@@ -123,32 +194,8 @@ void PulseNode :: ReschedulePulseChild(PulseNode * child, int whichList)
       switch(whichList)
       {
          case LINKED_LIST_SCHEDULED:
-         {
-            PulseNode * p = _firstChild[whichList];
-            if (p)
-            {
-               if (child->_aggregatePulseTime >= _lastChild[whichList]->_aggregatePulseTime)
-               {
-                  // Shortcut:  append to the tail of the list!
-                  child->_prevSibling = _lastChild[whichList];
-                  _lastChild[whichList]->_nextSibling = child;
-                  _lastChild[whichList] = child;
-               }
-               else
-               {
-                  // Worst case:  O(N) walk through the list to find the place to insert (child)
-                  while(p->_aggregatePulseTime < child->_aggregatePulseTime) p = p->_nextSibling;
-
-                  // insert (child) just before (p)
-                  child->_nextSibling = p;
-                  child->_prevSibling = p->_prevSibling;
-                  if (p->_prevSibling) p->_prevSibling->_nextSibling = child;
-                                  else _firstChild[whichList] = child;  // FogBugz #4092(b)
-                  p->_prevSibling = child;
-               }
-            }
-            else _firstChild[whichList] = _lastChild[whichList] = child;
-         }
+            (void) _scheduledChildren.AddTail(child);  // can't fail, since PutPulseChild() reserved a slot for every child
+            UpHeapScheduledChild(_scheduledChildren.GetNumItems()-1);
          break;
 
          case LINKED_LIST_NEEDSRECALC:
@@ -5,6 +5,7 @@
 
 #include "util/TimeUtilityFunctions.h"
 #include "util/CountedObject.h"
+#include "util/Queue.h"
 
 namespace muscle {
 
@@ -170,9 +171,20 @@ public:
    /** Returns a pointer to this PulseNode's parent PulseNode, if any. */
    PulseNode * GetPulseParent() const {return _parent;}
 
+protected:
+   /** Called just before one of our child PulseNodes (or one of its descendants) is Pulse()'d.
+     * This lets a parent find out which of its children were active during this cycle, without
+     * having to iterate over all of them.  Default implementation is a no-op.
+     * @param child The child PulseNode whose PulseAux() is about to be called.
+     */
+   virtual void AboutToPulseChild(PulseNode & child);
+
 private:
    void ReschedulePulseChild(PulseNode * child, int toList);
-   uint64 GetFirstScheduledChildTime() const {return _firstChild[LINKED_LIST_SCHEDULED] ? _firstChild[LINKED_LIST_SCHEDULED]->_aggregatePulseTime : MUSCLE_TIME_NEVER;}
+   uint64 GetFirstScheduledChildTime() const {return _scheduledChildren.HasItems() ? _scheduledChildren.Head()->_aggregatePulseTime : MUSCLE_TIME_NEVER;}
+   void RemoveScheduledChild(PulseNode * child);
+   void UpHeapScheduledChild(uint32 idx);
+   void DownHeapScheduledChild(uint32 idx);
    void GetPulseTimeAux(uint64 now, uint64 & min);
    void PulseAux(uint64 now);
 
@@ -186,22 +198,28 @@ private:
    uint64 _cycleStartedAt;      // time when the PulseNodeManager started serving us.
    bool _myScheduledTimeValid;  // true iff _myScheduledTime doesn't need to be recalculated
 
-   // Linked list that this node is in (or NULL if we're not in any linked list)
+   // List that this node is in (or -1 if we're not in any list)
    int _curList;                // index of the list we are part of, or -1 if we're not in any list
-   PulseNode * _prevSibling;
-   PulseNode * _nextSibling;
+   PulseNode * _prevSibling;    // used when we're in one of our parent's linked lists
+   PulseNode * _nextSibling;    // used when we're in one of our parent's linked lists
+   uint32 _scheduledIndex;      // our position in our parent's (_scheduledChildren) heap, when we're in LINKED_LIST_SCHEDULED
 
    enum {
-      LINKED_LIST_SCHEDULED = 0,  // list of children with known upcoming pulse-times (sorted)
-      LINKED_LIST_UNSCHEDULED,    // list of children with known MUSCLE_TIME_NEVER pulse-times (unsorted)
-      LINKED_LIST_NEEDSRECALC,    // list of children whose pulse-times need to be recalculated (unsorted)
-      NUM_LINKED_LISTS
+      LINKED_LIST_UNSCHEDULED = 0,  // list of children with known MUSCLE_TIME_NEVER pulse-times (unsorted)
+      LINKED_LIST_NEEDSRECALC,      // list of children whose pulse-times need to be recalculated (unsorted)
+      NUM_LINKED_LISTS,
+      LINKED_LIST_SCHEDULED = NUM_LINKED_LISTS  // children with known upcoming pulse-times; not a linked list, they are kept in (_scheduledChildren)
    };
 
-   // Linked list of child nodes with finite pulse times, sorted by their pulse times
+   // Linked lists of child nodes that aren't scheduled
    PulseNode * _firstChild[NUM_LINKED_LISTS];
    PulseNode * _lastChild[NUM_LINKED_LISTS];
 
+   // Child nodes with finite pulse times, in a binary min-heap ordered by their pulse times, so that
+   // rescheduling a child is O(log N) no matter how many children we have
+   Queue<PulseNode *> _scheduledChildren;
+   uint32 _numChildren;         // so that (_scheduledChildren) can be pre-allocated in PutPulseChild()
+
    uint64 _maxTimeSlice;
    bool _timeSlicingSuggested;
 
@@ -1,13 +1,219 @@
 /* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
 
-#if defined(MUSCLE_USE_POLL) || defined(MUSCLE_USE_EPOLL)
+#if defined(MUSCLE_USE_POLL) || defined(MUSCLE_USE_EPOLL) || defined(MUSCLE_USE_IOURING)
 # include <limits.h>  // for INT_MAX
 #endif
 
 #include "util/SocketMultiplexer.h"
 
+#if defined(MUSCLE_USE_SELECT) && !defined(WIN32)
+# include <errno.h>
+# include <fcntl.h>  // for fcntl(), to see which of our persistently registered sockets are still valid
+#endif
+
+#if defined(MUSCLE_USE_EPOLL) && !defined(MUSCLE_USE_IOURING)
+# include <errno.h>
+# include <poll.h>  // for ppoll()
+#endif
+
+#if defined(MUSCLE_USE_EPOLL) && defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 35)))
+# define MUSCLE_HAVE_EPOLL_PWAIT2 1  // glibc 2.35 added epoll_pwait2(), whose timeout is in nanoseconds (the kernel must be 5.11 or newer, though)
+#endif
+
+#if defined(MUSCLE_USE_IOURING)
+# include <errno.h>
+# include <poll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+
 namespace muscle {
 
+#if defined(MUSCLE_USE_IOURING)
+/** A minimal io_uring wrapper, talking to the kernel via raw system calls so that we don't need liburing.
+  * It is used only to keep a one-shot poll request armed for each registered socket:  a completed poll
+  * request means the socket was ready, and the next WaitForEvents() call re-arms it (if the socket is still
+  * registered), which gives us the same level-triggered semantics as the other implementations.
+  */
+class SocketMultiplexer :: FDState :: IOURing
+{
+public:
+   /** Returns a new IOURing object, or NULL if io_uring (or a feature we depend on) isn't supported by the running kernel. */
+   static IOURing * CreateIOURing()
+   {
+      struct io_uring_params params; memset(&params, 0, sizeof(params));
+      params.flags      = IORING_SETUP_CQSIZE;
+      params.cq_entries = NUM_CQ_ENTRIES;
+      const int ringFD = (int) syscall(__NR_io_uring_setup, NUM_SQ_ENTRIES, &params);
+      if (ringFD < 0) return NULL;
+
+      // EXT_ARG lets us pass our timeout to io_uring_enter(); NODROP means completions can't be lost if the CQ ring fills up
+      const uint32 requiredFeatures = IORING_FEAT_EXT_ARG|IORING_FEAT_NODROP;
+      IOURing * ret = ((params.features & requiredFeatures) == requiredFeatures) ? newnothrow IOURing(ringFD, params) : NULL;
+      if ((ret)&&(ret->IsValid() == false)) {delete ret; ret = NULL;}
+      if (ret == NULL) close(ringFD);
+      return ret;
+   }
+
+   ~IOURing()
+   {
+      if (_sqes   != MAP_FAILED) munmap(_sqes,   _sqesSize);
+      if (_cqRing != MAP_FAILED) munmap(_cqRing, _cqRingSize);
+      if (_sqRing != MAP_FAILED) munmap(_sqRing, _sqRingSize);
+      close(_ringFD);  // also cancels any poll requests that are still pending
+   }
+
+   /** Queues a one-shot poll request for (fd); it will be submitted by the next call to SubmitAndWait(). */
+   status_t AddPollRequest(int fd, uint32 pollMask, uint64 userData)
+   {
+      struct io_uring_sqe * sqe = GetNextSQE();
+      if (sqe == NULL) return B_ERROR;
+#if __BYTE_ORDER == __BIG_ENDIAN
+      pollMask = (pollMask<<16)|(pollMask>>16);  // the kernel expects this field to be word-swapped on big-endian hosts
+#endif
+      sqe->opcode        = IORING_OP_POLL_ADD;
+      sqe->fd            = fd;
+      sqe->poll32_events = pollMask;
+      sqe->user_data     = userData;
+      return B_NO_ERROR;
+   }
+
+   /** Queues a request to cancel the poll request that was previously added with the given (userData). */
+   status_t RemovePollRequest(uint64 userData)
+   {
+      struct io_uring_sqe * sqe = GetNextSQE();
+      if (sqe == NULL) return B_ERROR;
+      sqe->opcode    = IORING_OP_POLL_REMOVE;
+      sqe->fd        = -1;
+      sqe->addr      = userData;
+      sqe->user_data = 0;  // we don't care about the outcome
+      return B_NO_ERROR;
+   }
+
+   /** Submits all queued requests, then waits up to (waitTimeMicros) for at least one completion, all in a single system call.
+     * @returns B_NO_ERROR on success (including timeouts and interruptions), or B_ERROR on failure.
+     */
+   status_t SubmitAndWait(uint64 waitTimeMicros)
+   {
+      struct __kernel_timespec ts;
+      struct io_uring_getevents_arg arg; memset(&arg, 0, sizeof(arg));
+      if (waitTimeMicros != MUSCLE_TIME_NEVER)
+      {
+         ts.tv_sec  = MicrosToSeconds(waitTimeMicros);
+         ts.tv_nsec = MicrosToNanos(waitTimeMicros%MICROS_PER_SECOND);
+         arg.ts     = (uint64) ((uintptr_t) &ts);
+      }
+
+      const uint32 numToSubmit = _numUnsubmitted;
+      const uint32 minComplete = ((waitTimeMicros == 0)||(HasCompletions())) ? 0 : 1;
+      const int ret = Enter(numToSubmit, minComplete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+      return ((ret >= 0)||(errno == ETIME)||(errno == EINTR)||(errno == EBUSY)) ? B_NO_ERROR : B_ERROR;  // EBUSY means the CQ ring was full; we'll drain it and go again
+   }
+
+   /** Pops the next completion, if there is one.  Returns true on success, or false if there are no more completions to read. */
+   bool GetNextCompletion(uint64 & retUserData, int32 & retResult)
+   {
+      const uint32 head = *_cqHead;
+      if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+      {
+         // If the kernel had to hold back some completions because the CQ ring was full, ask it to flush them to us now
+         if ((__atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) == 0) return false;
+         (void) Enter(0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+         if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) return false;
+      }
+
+      const struct io_uring_cqe & cqe = _cqes[head & _cqMask];
+      retUserData = cqe.user_data;
+      retResult   = cqe.res;
+      __atomic_store_n(_cqHead, head+1, __ATOMIC_RELEASE);
+      return true;
+   }
+
+private:
+   enum {
+      NUM_SQ_ENTRIES = 256,  // more than this many requests in a single WaitForEvents() call just means an extra io_uring_enter() call
+      NUM_CQ_ENTRIES = 4096
+   };
+
+   IOURing(int ringFD, const struct io_uring_params & params)
+      : _ringFD(ringFD)
+      , _sqRingSize(params.sq_off.array + (params.sq_entries*sizeof(uint32)))
+      , _cqRingSize(params.cq_off.cqes  + (params.cq_entries*sizeof(struct io_uring_cqe)))
+      , _sqesSize(params.sq_entries*sizeof(struct io_uring_sqe))
+      , _numUnsubmitted(0)
+   {
+      _sqRing = mmap(NULL, _sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+      _cqRing = mmap(NULL, _cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFD, IORING_OFF_CQ_RING);
+      _sqes   = (struct io_uring_sqe *) mmap(NULL, _sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFD, IORING_OFF_SQES);
+      if (IsValid())
+      {
+         uint8 * sq = (uint8 *) _sqRing;
+         _sqHead    = (uint32 *) (sq+params.sq_off.head);
+         _sqTail    = (uint32 *) (sq+params.sq_off.tail);
+         _sqFlags   = (uint32 *) (sq+params.sq_off.flags);
+         _sqMask    = *((uint32 *) (sq+params.sq_off.ring_mask));
+         _sqEntries = params.sq_entries;
+         _sqArray   = (uint32 *) (sq+params.sq_off.array);
+         for (uint32 i=0; i<_sqEntries; i++) _sqArray[i] = i;  // we always use SQE slots in ring order, so this mapping never changes
+
+         uint8 * cq = (uint8 *) _cqRing;
+         _cqHead    = (uint32 *) (cq+params.cq_off.head);
+         _cqTail    = (uint32 *) (cq+params.cq_off.tail);
+         _cqMask    = *((uint32 *) (cq+params.cq_off.ring_mask));
+         _cqes      = (struct io_uring_cqe *) (cq+params.cq_off.cqes);
+      }
+   }
+
+   bool IsValid() const {return ((_sqRing != MAP_FAILED)&&(_cqRing != MAP_FAILED)&&(_sqes != MAP_FAILED));}
+   bool HasCompletions() const {return (*_cqHead != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE));}
+
+   int Enter(uint32 numToSubmit, uint32 minComplete, uint32 flags, const void * arg, size_t argSize)
+   {
+      const int ret = (int) syscall(__NR_io_uring_enter, _ringFD, numToSubmit, minComplete, flags, arg, argSize);
+      if (ret > 0) _numUnsubmitted -= muscleMin((uint32)ret, _numUnsubmitted);
+      return ret;
+   }
+
+   struct io_uring_sqe * GetNextSQE()
+   {
+      const uint32 tail = *_sqTail;
+      if ((tail-__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE)) >= _sqEntries)
+      {
+         // Submission ring is full; hand what we have so far to the kernel to make room
+         if ((Enter(_numUnsubmitted, 0, 0, NULL, 0) < 0)||((tail-__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE)) >= _sqEntries)) return NULL;
+      }
+
+      struct io_uring_sqe * sqe = &_sqes[tail & _sqMask];
+      memset(sqe, 0, sizeof(*sqe));
+      __atomic_store_n(_sqTail, tail+1, __ATOMIC_RELEASE);
+      _numUnsubmitted++;
+      return sqe;
+   }
+
+   int _ringFD;
+   size_t _sqRingSize;
+   size_t _cqRingSize;
+   size_t _sqesSize;
+   void * _sqRing;
+   void * _cqRing;
+   struct io_uring_sqe * _sqes;
+
+   uint32 * _sqHead;
+   uint32 * _sqTail;
+   uint32 * _sqFlags;
+   uint32 * _sqArray;
+   uint32 _sqMask;
+   uint32 _sqEntries;
+   uint32 _numUnsubmitted;
+
+   uint32 * _cqHead;
+   uint32 * _cqTail;
+   uint32 _cqMask;
+   struct io_uring_cqe * _cqes;
+};
+#endif
+
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
 static Mutex _multiplexersListMutex;
 static SocketMultiplexer * _headMultiplexer = NULL;
@@ -52,9 +258,71 @@ SocketMultiplexer :: ~SocketMultiplexer()
 #endif
 }
 
-int SocketMultiplexer :: WaitForEvents(uint64 optTimeoutAtTime)
+status_t SocketMultiplexer :: RegisterPersistentSocketForEventsByTypeIndex(int fd, uint32 whichSet)
+{
+   return ((fd >= 0)&&(whichSet < NUM_FDSTATE_SETS)) ? SetPersistentRegistration(fd, whichSet, true) : B_ERROR;
+}
+
+status_t SocketMultiplexer :: UnregisterPersistentSocketForEventsByTypeIndex(int fd, uint32 whichSet)
+{
+   return ((fd >= 0)&&(whichSet < NUM_FDSTATE_SETS)) ? SetPersistentRegistration(fd, whichSet, false) : B_ERROR;
+}
+
+#if !defined(MUSCLE_USE_KQUEUE) && !defined(MUSCLE_USE_EPOLL)
+status_t SocketMultiplexer :: SetPersistentRegistration(int fd, uint32 whichSet, bool isRegistered)
+{
+   // select() and poll() have no kernel-side state, so we just remember the registrations and re-register them before each wait
+   if (isRegistered)
+   {
+      uint8 * bits = _persistentRegistrations.GetOrPut(fd);
+      if (bits == NULL) return B_ERROR;
+      *bits |= (1<<whichSet);
+   }
+   else
+   {
+      uint8 * bits = _persistentRegistrations.Get(fd);
+      if (bits)
+      {
+         *bits &= ~(1<<whichSet);
+         if (*bits == 0) (void) _persistentRegistrations.Remove(fd);
+      }
+   }
+   return B_NO_ERROR;
+}
+#endif
+
+int SocketMultiplexer :: WaitForEvents(uint64 optTimeoutAtTime, bool preciseTimeout)
 {
-   int ret = GetCurrentFDState().WaitForEvents(optTimeoutAtTime);
+#if !defined(MUSCLE_USE_KQUEUE) && !defined(MUSCLE_USE_EPOLL)
+   for (HashtableIterator<int, uint8> iter(_persistentRegistrations); iter.HasData(); iter++)
+   {
+      const uint8 bits = iter.GetValue();
+      for (uint32 i=0; i<NUM_FDSTATE_SETS; i++) if (bits & (1<<i)) (void) GetCurrentFDState().RegisterSocket(iter.GetKey(), i);
+   }
+#endif
+
+   int ret = GetCurrentFDState().WaitForEvents(optTimeoutAtTime, preciseTimeout);
+#if defined(MUSCLE_USE_SELECT) && !defined(WIN32)
+   if ((ret < 0)&&(errno == EBADF)&&(_persistentRegistrations.HasItems()))
+   {
+      // One of our persistently registered sockets must have been closed without being unregistered.  Rather than
+      // failing every WaitForEvents() call from now on, we'll drop the registrations of any sockets that are no longer valid.
+      uint32 numDropped = 0;
+      for (HashtableIterator<int, uint8> iter(_persistentRegistrations); iter.HasData(); iter++)
+      {
+         if (fcntl(iter.GetKey(), F_GETFD) < 0)
+         {
+            (void) _persistentRegistrations.Remove(iter.GetKey());
+            numDropped++;
+         }
+      }
+      if (numDropped > 0)
+      {
+         GetCurrentFDState().Reset();  // so that no stale results will be reported
+         ret = 0;
+      }
+   }
+#endif
 #if !defined(MUSCLE_USE_KQUEUE) && !defined(MUSCLE_USE_EPOLL)
    _curFDState = _curFDState?0:1;
 #endif
@@ -62,8 +330,16 @@ int SocketMultiplexer :: WaitForEvents(uint64 optTimeoutAtTime)
    return ret;
 }
 
-int SocketMultiplexer :: FDState :: WaitForEvents(uint64 optTimeoutAtTime)
+#if defined(MUSCLE_HAVE_EPOLL_PWAIT2)
+static bool _epollPWait2Available = true;  // set false if the running kernel turns out not to support epoll_pwait2()
+#endif
+
+int SocketMultiplexer :: FDState :: WaitForEvents(uint64 optTimeoutAtTime, bool preciseTimeout)
 {
+#if !defined(MUSCLE_USE_EPOLL)
+   (void) preciseTimeout;  // the other mechanisms' timeouts are all specified in microseconds or nanoseconds anyway
+#endif
+
    // Calculate how long we should wait before timing out
    uint64 waitTimeMicros;
    if (optTimeoutAtTime == MUSCLE_TIME_NEVER) waitTimeMicros = MUSCLE_TIME_NEVER;
@@ -112,55 +388,95 @@ int SocketMultiplexer :: FDState :: WaitForEvents(uint64 optTimeoutAtTime)
       if (ret >= 0)
       {
          // Record that kevent() accepted our _scratchChanges into its kernel-state, so we'll know not to send the changes again next time
-         for (HashtableIterator<int, uint16> iter(_bits); iter.HasData(); iter++)
-         {
-            uint16 & b = iter.GetValue();
-            uint16 userBits = (b&0x0F);
-            if (userBits) b = (userBits<<4);                   // post-kevent() state is:  bits registered in-kernel but not in-userland or in-results
-                     else (void) _bits.Remove(iter.GetKey());  // this FD isn't being monitored anymore, so we can forget about it
-         }
+         ChangeRequestsAccepted();
 
          // Now go through our _scratchEvents list and set bits for any flagged events, for quick lookup by the user
          for (int i=0; i<ret; i++) 
          {
             const struct kevent & event = _scratchEvents[i];
-            uint16 * bits = _bits.Get(event.ident);
-            if (bits)
+            if (event.flags & EV_ERROR) continue;  // a change request that the kernel didn't like; not an actual event
+            switch(event.filter)
             {
-               switch(event.filter)
-               {
-                  case EVFILT_READ:  *bits |= (1<<(FDSTATE_SET_READ +8)); break;  // +8 because this bit goes into the results-nybble
-                  case EVFILT_WRITE: *bits |= (1<<(FDSTATE_SET_WRITE+8)); break;  // ditto
-               }
+               case EVFILT_READ:  SetResultBit(event.ident, FDSTATE_SET_READ);  break;
+               case EVFILT_WRITE: SetResultBit(event.ident, FDSTATE_SET_WRITE); break;
             }
          }
       }
 #elif defined(MUSCLE_USE_EPOLL)
       if (ComputeStateBitsChangeRequests() != B_NO_ERROR) return B_ERROR;
 
-      int ret = epoll_wait(_kernelFD, _scratchEvents.HeadPointer(), _scratchEvents.GetNumItems(), (waitTimeMicros==MUSCLE_TIME_NEVER)?-1:(int)(muscleMin(MicrosToMillis(waitTimeMicros), (int64)INT_MAX)));
+# if defined(MUSCLE_USE_IOURING)
+      if (_ring) return ((_ring->SubmitAndWait(waitTimeMicros) == B_NO_ERROR)&&(ReapIOURingCompletions() == B_NO_ERROR)) ? (int)_readyFDs.GetNumItems() : -1;
+# endif
+
+      int ret = -1;
+      bool waited = false;
+# if defined(MUSCLE_HAVE_EPOLL_PWAIT2)
+      if (_epollPWait2Available)
+      {
+         struct timespec waitTime;
+         if (waitTimeMicros != MUSCLE_TIME_NEVER)
+         {
+            waitTime.tv_sec  = MicrosToSeconds(waitTimeMicros);
+            waitTime.tv_nsec = MicrosToNanos(waitTimeMicros%MICROS_PER_SECOND);
+         }
+         ret = epoll_pwait2(_kernelFD, _scratchEvents.HeadPointer(), _scratchEvents.GetNumItems(), (waitTimeMicros == MUSCLE_TIME_NEVER) ? NULL : &waitTime, NULL);
+         if ((ret < 0)&&(errno == ENOSYS)) _epollPWait2Available = false;  // pre-5.11 kernel, so we'll use epoll_wait() from now on
+         else waited = true;
+      }
+# endif
+
+      if (waited == false)
+      {
+         // epoll_wait()'s timeout is in milliseconds, so we round up to the next millisecond, since waking up a little late is
+         // better than waking up early and spinning until the deadline arrives.  Only when our caller has asked for a precise
+         // timeout (e.g. for a rate-limiting policy's Pulse()) do we spend an extra ppoll() call on the epoll descriptor, since
+         // ppoll()'s timeout is in nanoseconds.
+         if ((preciseTimeout)&&(waitTimeMicros != MUSCLE_TIME_NEVER)&&((waitTimeMicros%1000) != 0))
+         {
+            struct pollfd pfd; pfd.fd = _kernelFD; pfd.events = POLLIN; pfd.revents = 0;
+            struct timespec waitTime;
+            waitTime.tv_sec  = MicrosToSeconds(waitTimeMicros);
+            waitTime.tv_nsec = MicrosToNanos(waitTimeMicros%MICROS_PER_SECOND);
+            (void) ppoll(&pfd, 1, &waitTime, NULL);  // if this fails, the epoll_wait() below will tell us why
+            waitTimeMicros = 0;
+         }
+         ret = epoll_wait(_kernelFD, _scratchEvents.HeadPointer(), _scratchEvents.GetNumItems(), (waitTimeMicros==MUSCLE_TIME_NEVER)?-1:(int)(muscleMin((waitTimeMicros+999)/1000, (uint64)INT_MAX)));
+      }
       if (ret >= 0)
       {
          // Now go through our _scratchEvents list and set bits for any flagged events, for quick lookup by the user
          for (int i=0; i<ret; i++) 
          {
             const struct epoll_event & event = _scratchEvents[i];
-            uint16 * bits = _bits.Get(event.data.fd);
-            if (bits)
-            {
-               if (event.events & (EPOLLIN|EPOLLHUP|EPOLLRDHUP)) *bits |= (1<<(FDSTATE_SET_READ  +8)); // +8 because this bit goes into the results-nybble
-               if (event.events & (EPOLLOUT|EPOLLHUP))           *bits |= (1<<(FDSTATE_SET_WRITE +8)); // ditto
-               if (event.events & (EPOLLERR))                    *bits |= (1<<(FDSTATE_SET_EXCEPT+8)); // ditto
-            }
+            if (event.events & (EPOLLIN|EPOLLHUP|EPOLLRDHUP)) SetResultBit(event.data.fd, FDSTATE_SET_READ);
+            if (event.events & (EPOLLOUT|EPOLLHUP))           SetResultBit(event.data.fd, FDSTATE_SET_WRITE);
+            if (event.events & (EPOLLERR))                    SetResultBit(event.data.fd, FDSTATE_SET_EXCEPT);
          }
       }
 #elif defined(MUSCLE_USE_POLL)
+# if defined(__linux__)
+      // ppoll() lets us wake up partway through a millisecond, when that's what our caller asked for
+      struct timespec waitTime;
+      if (waitTimeMicros != MUSCLE_TIME_NEVER)
+      {
+         waitTime.tv_sec  = MicrosToSeconds(waitTimeMicros);
+         waitTime.tv_nsec = MicrosToNanos(waitTimeMicros%MICROS_PER_SECOND);
+      }
+      int ret = ppoll(_pollFDArray.GetItemAt(0), _pollFDArray.GetNumItems(), (waitTimeMicros == MUSCLE_TIME_NEVER) ? NULL : &waitTime, NULL);
+# else
       int timeoutMillis = (waitTimeMicros == MUSCLE_TIME_NEVER) ? -1 : ((int) muscleMin(MicrosToMillis(waitTimeMicros), (int64)(INT_MAX)));
-# ifdef WIN32
+#  ifdef WIN32
       int ret = WSAPoll(_pollFDArray.GetItemAt(0), _pollFDArray.GetNumItems(), timeoutMillis);
-# else
+#  else
       int ret = poll(   _pollFDArray.GetItemAt(0), _pollFDArray.GetNumItems(), timeoutMillis);
+#  endif
 # endif
+      if (ret > 0)
+      {
+         const short readyBits = GetPollBitsForFDSet(FDSTATE_SET_READ, false)|GetPollBitsForFDSet(FDSTATE_SET_WRITE, false)|GetPollBitsForFDSet(FDSTATE_SET_EXCEPT, false);
+         for (uint32 i=0; i<_pollFDArray.GetNumItems(); i++) if (_pollFDArray[i].revents & readyBits) (void) _readyFDs.AddTail(_pollFDArray[i].fd);
+      }
 #else
       struct timeval waitTime;
       struct timeval * pWaitTime;
@@ -171,6 +487,35 @@ int SocketMultiplexer :: FDState :: WaitForEvents(uint64 optTimeoutAtTime)
          pWaitTime = &waitTime;
       }
       int ret = select(maxFD+1, sets[0], sets[1], sets[2], pWaitTime);
+      if (ret > 0)
+      {
+# ifdef WIN32
+         // Under Windows, select() leaves only the ready sockets in each fd_set, so we can just read them out
+         for (uint32 i=0; i<NUM_FDSTATE_SETS; i++)
+         {
+            if (sets[i])
+            {
+               for (u_int j=0; j<sets[i]->fd_count; j++)
+               {
+                  const int fd = (int) sets[i]->fd_array[j];
+                  if (_readyFDs.IndexOf(fd) < 0) (void) _readyFDs.AddTail(fd);
+               }
+            }
+         }
+# else
+         for (int fd=0; fd<=maxFD; fd++)
+         {
+            for (uint32 i=0; i<NUM_FDSTATE_SETS; i++)
+            {
+               if ((sets[i])&&(FD_ISSET(fd, sets[i])))
+               {
+                  (void) _readyFDs.AddTail(fd);
+                  break;
+               }
+            }
+         }
+# endif
+      }
 #endif
       if ((ret < 0)&&(PreviousOperationWasInterrupted())) ret = 0;  // on interruption we'll just go round gain
       return ret;
@@ -187,6 +532,7 @@ int SocketMultiplexer :: FDState :: WaitForEvents(uint64 optTimeoutAtTime)
 void SocketMultiplexer :: FDState :: Reset()
 {
 #if !defined(MUSCLE_USE_KQUEUE) && !defined(MUSCLE_USE_EPOLL)
+   _readyFDs.FastClear();
 # if defined(MUSCLE_USE_POLL)
    _pollFDArray.FastClear();
    _pollFDToArrayIndex.Clear();
@@ -222,8 +568,15 @@ SocketMultiplexer :: FDState :: FDState()
    _kernelFD = kqueue();
    if (_kernelFD < 0) printf("FDState:  Error, couldn't allocate a kqueue!\n");
 #elif defined(MUSCLE_USE_EPOLL)
+# if defined(MUSCLE_USE_IOURING)
+   _nextPollTag = 1;
+   _ring        = IOURing::CreateIOURing();  // returns NULL if the running kernel can't give us io_uring, in which case we use epoll() instead
+   _kernelFD    = _ring ? -1 : epoll_create(1024);
+   if ((_ring == NULL)&&(_kernelFD < 0)) printf("FDState:  Error, epoll_create() failed!\n");
+# else
    _kernelFD = epoll_create(1024);  // note that this argument is ignored in modern unix, it just has to be greater than zero
    if (_kernelFD < 0) printf("FDState:  Error, epoll_create() failed!\n");
+# endif
 #endif
 
    Reset();
@@ -234,6 +587,9 @@ SocketMultiplexer :: FDState :: ~FDState()
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
    if (_kernelFD >= 0) close(_kernelFD);
 #endif
+#if defined(MUSCLE_USE_IOURING)
+   delete _ring;
+#endif
 }
 
 #ifdef MUSCLE_USE_KQUEUE
@@ -257,13 +613,33 @@ status_t SocketMultiplexer :: FDState :: AddKQueueChangeRequest(int fd, uint32 w
 #endif
 
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
+status_t SocketMultiplexer :: FDState :: SetPersistentRegistration(int fd, uint32 whichSet, bool isRegistered)
+{
+   const uint16 persistentBit = (1<<(whichSet+12));  // +12 because this bit goes into the persistent-registrations nybble
+   uint16 * bits = isRegistered ? _bits.GetOrPut(fd) : _bits.Get(fd);
+   if (bits == NULL) return isRegistered ? B_ERROR : B_NO_ERROR;
+   if (((*bits & persistentBit) != 0) == isRegistered) return B_NO_ERROR;  // nothing to change
+
+   if (_changedFDs.PutWithDefault(fd) != B_NO_ERROR) return B_ERROR;
+   if (isRegistered) *bits |= persistentBit;
+                else *bits &= ~persistentBit;
+   return B_NO_ERROR;
+}
+
 status_t SocketMultiplexer :: FDState :: ComputeStateBitsChangeRequests()
 {
 #if defined(MUSCLE_USE_KQUEUE)
    _scratchChanges.FastClear();
-   (void) _scratchChanges.EnsureSize(GetMaxNumEvents());  // try to avoid multiple reallocs if possible
 #endif
 
+   // Get rid of the results-bits from the previous iteration
+   for (uint32 i=0; i<_readyFDs.GetNumItems(); i++)
+   {
+      uint16 * bits = _bits.Get(_readyFDs[i]);
+      if (bits) *bits &= ~(0xF00);
+   }
+   _readyFDs.FastClear();
+
    // If any of our sockets were closed since the last call, we need to make sure to note that the kernel is no longer
    // tracking them.  Otherwise we can run into this problem:  
    //   http://stackoverflow.com/questions/8608931/is-there-any-way-to-tell-that-a-file-descriptor-value-has-been-reused
@@ -280,50 +656,178 @@ status_t SocketMultiplexer :: FDState :: ComputeStateBitsChangeRequests()
             uint16 * bits = _bits.Get(iter.GetKey());
             if (bits) 
             {
+#if defined(MUSCLE_USE_IOURING)
+               CancelIOURingPoll(iter.GetKey());  // otherwise the ring would keep the old socket open, and report its events under this fd
+#endif
                uint16 & b = *bits;
-               b &= 0x0F;  // Remove all bits except for the userland-registration-bits, to force a kernel re-registration below
-               if (b == 0) _bits.Remove(iter.GetKey());  // No userland-registration-bits either?  Then we can discard the record
+               b &= 0xF00F;  // Remove the kernel-state-bits, to force a kernel re-registration below
+                    if (b == 0) _bits.Remove(iter.GetKey());  // No registration-bits either?  Then we can discard the record
+               else if (_changedFDs.PutWithDefault(iter.GetKey()) != B_NO_ERROR) return B_ERROR;
             }
          }
          _scratchClosedSockets.Clear();
       }
    }
 
-   // Generate change requests to the kernel, based on how the userBits differ from the kernelBits
-   for (HashtableIterator<int, uint16> iter(_bits); iter.HasData(); iter++)
+   // Generate change requests to the kernel, but only for the sockets whose registrations might have changed
+   for (HashtableIterator<int, Void> iter(_changedFDs); iter.HasData(); iter++) if (ComputeStateBitsChangeRequest(iter.GetKey()) != B_NO_ERROR) return B_ERROR;
+   for (uint32 i=0; i<_transientFDs.GetNumItems(); i++)
+   {
+      const int fd = _transientFDs[i];
+      if ((_changedFDs.ContainsKey(fd) == false)&&(ComputeStateBitsChangeRequest(fd) != B_NO_ERROR)) return B_ERROR;
+   }
+
+#if defined(MUSCLE_USE_EPOLL)
+   ChangeRequestsAccepted();  // for epoll() we update the bits now, since epoll_ctl() succeeded already
+# if defined(MUSCLE_USE_IOURING)
+   if (_ring) return B_NO_ERROR;  // our poll requests are already queued up in the ring, to be submitted along with our wait
+# endif
+#endif
+
+   return _scratchEvents.EnsureSize(muscleMax(GetMaxNumEvents(), (uint32)1), true);  // try to ensure we have plenty of room for whatever events epoll_wait() will want to return.  (epoll_wait() won't accept an empty array)
+}
+
+status_t SocketMultiplexer :: FDState :: ComputeStateBitsChangeRequest(int fd)
+{
+   uint16 * bits = _bits.Get(fd);
+   if (bits == NULL) return B_NO_ERROR;
+
+   uint16 & b = *bits;
+   const uint8 userBits = ((b>>0)|(b>>12))&0x0F;  // transient and persistent registrations both count
+   const uint8 kernBits = ((b>>4)&0x0F);
+   if (userBits != kernBits)
    {
-      uint16 & bits  = iter.GetValue();
-      bits &= ~(0xF00);  // get rid of any leftover results-bits from the previous iteration
-      uint8 userBits = ((bits>>0)&0x0F);
-      uint8 kernBits = ((bits>>4)&0x0F);
-      if (userBits != kernBits)
-      {
 #if defined(MUSCLE_USE_KQUEUE)
-         for (uint32 i=0; i<NUM_FDSTATE_SETS; i++)
+      for (uint32 i=0; i<NUM_FDSTATE_SETS; i++)
+      {
+         const bool hasBit = ((userBits&(1<<i)) != 0);
+         const bool hadBit = ((kernBits&(1<<i)) != 0);
+         if ((hasBit != hadBit)&&(AddKQueueChangeRequest(fd, i, hasBit) != B_NO_ERROR)) return B_ERROR;
+      }
+#else
+# if defined(MUSCLE_USE_IOURING)
+      if (_ring)
+      {
+         CancelIOURingPoll(fd);  // any poll request we already have armed for (fd) is watching for the wrong events now
+         if (userBits != 0)
          {
-            const bool hasBit = ((userBits&(1<<i)) != 0);
-            const bool hadBit = ((kernBits&(1<<i)) != 0);
-            if ((hasBit != hadBit)&&(AddKQueueChangeRequest(iter.GetKey(), i, hasBit) != B_NO_ERROR)) return B_ERROR;
+            uint32 pollMask = 0;
+            if (userBits & (1<<FDSTATE_SET_READ))   pollMask |= POLLIN;
+            if (userBits & (1<<FDSTATE_SET_WRITE))  pollMask |= POLLOUT;
+            if (userBits & (1<<FDSTATE_SET_EXCEPT)) pollMask |= POLLERR;
+
+            const uint64 tag = (((uint64)_nextPollTag)<<32)|((uint32)fd);
+            if (++_nextPollTag == 0) _nextPollTag = 1;  // a tag of zero is reserved for our poll-removal requests
+            if (_pollTags.Put(fd, tag) != B_NO_ERROR) return B_ERROR;
+            if (_ring->AddPollRequest(fd, pollMask, tag) != B_NO_ERROR)
+            {
+               (void) _pollTags.Remove(fd);
+               return B_ERROR;
+            }
          }
-#else
-         struct epoll_event evt; memset(&evt, 0, sizeof(evt));  // paranoia
-         evt.data.fd = iter.GetKey();
-         if (userBits & (1<<FDSTATE_SET_READ))   evt.events |= EPOLLIN;
-         if (userBits & (1<<FDSTATE_SET_WRITE))  evt.events |= EPOLLOUT;
-         if (userBits & (1<<FDSTATE_SET_EXCEPT)) evt.events |= EPOLLERR;
-         int op = ((userBits==0)&&(kernBits != 0)) ? EPOLL_CTL_DEL : (((userBits!=0)&&(kernBits==0)) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
-         if ((epoll_ctl(_kernelFD, op, iter.GetKey(), &evt) != 0)&&(op != EPOLL_CTL_DEL)) return B_ERROR;  // DEL may fail if fd was already closed, that's okay
-#endif
+         return B_NO_ERROR;
       }
+# endif
+      struct epoll_event evt; memset(&evt, 0, sizeof(evt));  // paranoia
+      evt.data.fd = fd;
+      if (userBits & (1<<FDSTATE_SET_READ))   evt.events |= EPOLLIN;
+      if (userBits & (1<<FDSTATE_SET_WRITE))  evt.events |= EPOLLOUT;
+      if (userBits & (1<<FDSTATE_SET_EXCEPT)) evt.events |= EPOLLERR;
+      int op = ((userBits==0)&&(kernBits != 0)) ? EPOLL_CTL_DEL : (((userBits!=0)&&(kernBits==0)) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+      if ((epoll_ctl(_kernelFD, op, fd, &evt) != 0)&&(op != EPOLL_CTL_DEL))  // DEL may fail if fd was already closed, that's okay
+      {
+         if ((b & 0xF000) == 0) return B_ERROR;
 
-#if defined(MUSCLE_USE_EPOLL)
-      bits = (((uint16)userBits)<<4);   // for epoll() we update the bits now, since epoll_ctrl() succeeded already
+         // A persistently registered socket that the kernel won't accept must have been closed without being unregistered;
+         // so we'll just drop its registrations, rather than failing every WaitForEvents() call from now on.
+         b &= 0x0F00;
+      }
 #endif
    }
+   return B_NO_ERROR;
+}
+
+void SocketMultiplexer :: FDState :: SetKernelBits(int fd)
+{
+   uint16 * bits = _bits.Get(fd);
+   if (bits)
+   {
+      uint16 & b = *bits;
+      const uint16 userBits = ((b>>0)|(b>>12))&0x0F;
+      b = (b & ~0x00F0)|(userBits<<4);
+      if (b == 0) (void) _bits.Remove(fd);  // this FD isn't being monitored anymore, so we can forget about it
+   }
+}
+
+void SocketMultiplexer :: FDState :: ChangeRequestsAccepted()
+{
+   for (HashtableIterator<int, Void> iter(_changedFDs); iter.HasData(); iter++) SetKernelBits(iter.GetKey());
+   _changedFDs.Clear();
+
+   // Registrations made via RegisterSocket() apply only to the current cycle, so we clear them now, and note that
+   // their kernel-state will need to be re-checked next time, in case they don't get registered again.
+   for (uint32 i=0; i<_transientFDs.GetNumItems(); i++)
+   {
+      const int fd = _transientFDs[i];
+      SetKernelBits(fd);
+
+      uint16 * bits = _bits.Get(fd);
+      if (bits) 
+      {
+         *bits &= ~0x000F;
+         (void) _changedFDs.PutWithDefault(fd);
+      }
+   }
+   _transientFDs.FastClear();
+}
 
-   return _scratchEvents.EnsureSize(GetMaxNumEvents(), true);  // try to ensure we have plenty of room for whatever events epoll_wait() will want to return.
+#endif
+
+#if defined(MUSCLE_USE_IOURING)
+void SocketMultiplexer :: FDState :: CancelIOURingPoll(int fd)
+{
+   uint64 tag;
+   if ((_ring)&&(_pollTags.Remove(fd, tag) == B_NO_ERROR)) (void) _ring->RemovePollRequest(tag);
 }
 
+status_t SocketMultiplexer :: FDState :: ReapIOURingCompletions()
+{
+   uint64 userData;
+   int32 result;
+   while(_ring->GetNextCompletion(userData, result))
+   {
+      const int fd = (int) (userData & 0xFFFFFFFF);
+      const uint64 * tag = (userData != 0) ? _pollTags.Get(fd) : NULL;
+      if ((tag == NULL)||(*tag != userData)) continue;  // a removal request's completion, or a poll request we've already cancelled
+
+      // Each poll request completes only once, so the kernel is no longer watching (fd) now.  Noting that here
+      // means the next WaitForEvents() call will re-arm it, if (fd) is still registered by then.
+      (void) _pollTags.Remove(fd);
+      uint16 * bits = _bits.Get(fd);
+      if (bits == NULL) continue;  // paranoia
+      if (_changedFDs.PutWithDefault(fd) != B_NO_ERROR) return B_ERROR;
+
+      uint16 & b = *bits;
+      uint32 events = (uint32) result;
+      if (result < 0)
+      {
+         // The kernel wouldn't poll (fd), presumably because it was closed without being unregistered.  We'll report
+         // it as ready (so that the caller will find out about the problem when it tries to use it), but we drop its
+         // registrations, rather than having every WaitForEvents() call from now on return immediately because of it.
+         const uint8 kernBits = ((b>>4)&0x0F);
+         events = ((kernBits & (1<<FDSTATE_SET_READ))   ? POLLIN  : 0)
+                | ((kernBits & (1<<FDSTATE_SET_WRITE))  ? POLLOUT : 0)
+                | ((kernBits & (1<<FDSTATE_SET_EXCEPT)) ? POLLERR : 0);
+         b &= 0x0F00;
+      }
+      else b &= ~0x00F0;
+
+      if (events & (POLLIN|POLLHUP|POLLRDHUP)) SetResultBit(fd, FDSTATE_SET_READ);
+      if (events & (POLLOUT|POLLHUP))          SetResultBit(fd, FDSTATE_SET_WRITE);
+      if (events & (POLLERR))                  SetResultBit(fd, FDSTATE_SET_EXCEPT);
+   }
+   return B_NO_ERROR;
+}
 #endif
 
 }; // end namespace muscle
@@ -5,6 +5,10 @@
 
 #include "util/NetworkUtilityFunctions.h"
 
+#if defined(MUSCLE_USE_IOURING) && !defined(MUSCLE_USE_EPOLL)
+# define MUSCLE_USE_EPOLL 1  // the io_uring implementation falls back to epoll() if io_uring isn't available at run time
+#endif
+
 #if defined(MUSCLE_USE_KQUEUE)
 # include <sys/event.h>
 # include "system/Mutex.h"
@@ -25,10 +29,8 @@
 # endif
 #endif
 
-#ifndef MUSCLE_USE_SELECT
-# include "util/Hashtable.h"
-# include "util/Queue.h"
-#endif
+#include "util/Hashtable.h"
+#include "util/Queue.h"
 
 namespace muscle {
 
@@ -41,7 +43,25 @@ namespace muscle {
  *  mechanism is the most widely portable.  However, you can force this class 
  *  to use poll(), epoll(), or kqueue() instead, by specifying the compiler
  *  flag -DMUSCLE_USE_POLL, -DMUSCLE_USE_EPOLL, or -DMUSCLE_USE_KQUEUE
- *  (respectively) on the compile line.
+ *  (respectively) on the compile line.  Under Linux you can also specify
+ *  -DMUSCLE_USE_IOURING, which uses io_uring when the running kernel supports
+ *  it, and epoll() otherwise.  Note that io_uring is used here only to wait for
+ *  readiness (via poll requests):  the reads and writes themselves are still done
+ *  by the caller (e.g. by each session's DataIO) via recv() and send(), since
+ *  DataIO's Read() and Write() calls are synchronous and return the number of
+ *  bytes transferred, whereas a kernel-submitted recv or send completes later,
+ *  and needs its buffer to stay valid until it does.
+ *
+ *  Sockets can be registered either for a single WaitForEvents() call (via
+ *  the RegisterSocketFor*() methods) or persistently (via
+ *  RegisterPersistentSocketForEventsByTypeIndex()).  Under epoll, kqueue and
+ *  io_uring, persistent registrations are only passed to the kernel when they change,
+ *  so a program that watches many mostly-idle sockets this way pays only for
+ *  the sockets whose registrations changed and the sockets that had events.
+ *  Under io_uring, all of those changes are submitted to the kernel by the same
+ *  system call that waits for events.
+ *  (Note that under io_uring, a socket that was closed while registered isn't
+ *  released by the kernel until the next WaitForEvents() call cancels its registration)
  */
 class SocketMultiplexer
 {
@@ -89,6 +109,25 @@ public:
      */
    inline status_t RegisterSocketForEventsByTypeIndex(int fd, uint32 whichSet) {return GetCurrentFDState().RegisterSocket(fd, whichSet);}
 
+   /** Persistently registers (fd) for events of the specified type.  Unlike the RegisterSocketFor*() methods,
+     * a persistent registration is not cleared when WaitForEvents() returns; it stays in effect for all subsequent
+     * WaitForEvents() calls, until it is removed via UnregisterPersistentSocketForEventsByTypeIndex().
+     * @note If (fd) is closed while it is persistently registered, the registration will apply to whatever socket
+     *       is next given that file descriptor value, so be sure to unregister a socket when you are done with it.
+     * @param fd The file descriptor to watch for the event type specified by (whichSet)
+     * @param whichSet A FDSTATE_SET_* value indicating the type of event to watch the socket for.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory or bad fd value?)
+     */
+   status_t RegisterPersistentSocketForEventsByTypeIndex(int fd, uint32 whichSet);
+
+   /** Removes a persistent registration that was previously added by RegisterPersistentSocketForEventsByTypeIndex().
+     * Does nothing if (fd) wasn't persistently registered for the specified event type.
+     * @param fd The file descriptor to stop watching for the event type specified by (whichSet)
+     * @param whichSet A FDSTATE_SET_* value indicating the type of event to stop watching the socket for.
+     * @returns B_NO_ERROR on success, or B_ERROR on failure (out of memory?)
+     */
+   status_t UnregisterPersistentSocketForEventsByTypeIndex(int fd, uint32 whichSet);
+
    /** Blocks until at least one of the events specified in previous RegisterSocketFor*()
      * calls becomes valid, or for (optMaxWaitTimeMicros) microseconds, whichever comes first.
      * @note All socket-registrations will be cleared after this method call returns.  You will typically 
@@ -97,10 +136,14 @@ public:
      *                      if not timeout is desired.  Uses the sameDefaults to MUSCLE_TIME_NEVER.
      *                      Specifying 0 (or any other value not greater than the current value returned
      *                      by GetRunTime64()) will effect a poll, guaranteed to return immediately.
+     * @param preciseTimeout If true, we'll try harder to return at exactly (timeoutAtTime), rather than up to
+     *                       a millisecond later.  This only makes a difference under epoll on kernels older than
+     *                       5.11 (or with glibc older than 2.35), where epoll_wait()'s timeout is in milliseconds,
+     *                       and precise timeouts cost an extra system call.  Defaults to false.
      * @returns The number of socket-registrations that indicated that they are currently ready, 
      *          or 0 if the timeout period elapsed without any events happening, or -1 if an error occurred.
      */
-   int WaitForEvents(uint64 timeoutAtTime = MUSCLE_TIME_NEVER);
+   int WaitForEvents(uint64 timeoutAtTime = MUSCLE_TIME_NEVER, bool preciseTimeout = false);
 
    /** Call this after WaitForEvents() returns, to find out if the specified file descriptor has
      * data ready to read or not.
@@ -136,6 +179,13 @@ public:
      */
    inline bool IsSocketEventOfTypeFlagged(int fd, uint32 whichSet) const {return GetAlternateFDState().IsSocketReady(fd, whichSet);}
 
+   /** Call this after WaitForEvents() returns, to get the list of file descriptors that had at least one
+     * event flagged.  Each flagged file descriptor appears in the list exactly once, in no particular order.
+     * Iterating over this list is cheaper than calling IsSocketReadyForRead() (etc) on every registered socket,
+     * when only a few of the registered sockets are expected to be ready at any given time.
+     */
+   inline const Queue<int> & GetReadySockets() const {return GetAlternateFDState().GetReadySockets();}
+
    enum {
       FDSTATE_SET_READ = 0,
       FDSTATE_SET_WRITE,
@@ -159,6 +209,7 @@ private:
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
          uint16 * b = _bits.GetOrPut(fd);
          if (b == NULL) return B_ERROR;
+         if (((*b & 0x0F) == 0)&&(_transientFDs.AddTail(fd) != B_NO_ERROR)) return B_ERROR;  // first registration of this fd for this cycle?
          *b |= (1<<whichSet);
 #elif defined(MUSCLE_USE_POLL)
          uint32 idx;
@@ -185,9 +236,13 @@ private:
          return (FD_ISSET(fd, const_cast<fd_set *>(&_fdSets[whichSet])) != 0);
 #endif
       }
-      int WaitForEvents(uint64 timeoutAtTime);
+      int WaitForEvents(uint64 timeoutAtTime, bool preciseTimeout);
+
+      const Queue<int> & GetReadySockets() const {return _readyFDs;}
 
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
+      status_t SetPersistentRegistration(int fd, uint32 whichSet, bool isRegistered);
+
       void NotifySocketClosed(int fd)
       {
          MutexGuard mg(_closedSocketsMutex);
@@ -199,21 +254,47 @@ private:
 #if defined(MUSCLE_USE_KQUEUE)
       status_t AddKQueueChangeRequest(int fd, uint32 whichSet, bool add);
 #endif
+#if defined(MUSCLE_USE_IOURING)
+      class IOURing;
+      status_t ReapIOURingCompletions();
+      void CancelIOURingPoll(int fd);
+#endif
+      Queue<int> _readyFDs;  // file descriptors that had events flagged by our most recent WaitForEvents() call
+
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
       status_t ComputeStateBitsChangeRequests();
+      status_t ComputeStateBitsChangeRequest(int fd);
+      void ChangeRequestsAccepted();
+      void SetKernelBits(int fd);
       uint32 GetMaxNumEvents() const {return _bits.GetNumItems()*2;}  // times two since each FD could have both read and write events
+      void SetResultBit(int fd, uint32 whichSet)
+      {
+         uint16 * bits = _bits.Get(fd);
+         if (bits)
+         {
+            if (((*bits & 0xF00) == 0)&&(_readyFDs.AddTail(fd) != B_NO_ERROR)) return;  // out of memory?
+            *bits |= (1<<(whichSet+8));  // +8 because this bit goes into the results-nybble
+         }
+      }
 
       Mutex _closedSocketsMutex;  // necessary since NotifySocketClosed() might get called from any thread
       Hashtable<int, Void> _closedSockets;  // written to by NotifySocketClosed(), read-and-cleared by WaitForEvents(), protected by _closedSocketsMutex
       Hashtable<int, Void> _scratchClosedSockets;  // Used for double-buffering purposes
 
       int _kernelFD;
-      Hashtable<int, uint16> _bits;   // fd -> (nybble #0 for userland registrations, nybble #1 for kernel-state, nybble #2 for results)
+      Hashtable<int, uint16> _bits;   // fd -> (nybble #0 for userland registrations, nybble #1 for kernel-state, nybble #2 for results, nybble #3 for persistent registrations)
+      Queue<int> _transientFDs;       // fds that have userland registrations for the current cycle
+      Hashtable<int, Void> _changedFDs;  // fds whose kernel-state might not match their registrations anymore
 # if defined(MUSCLE_USE_KQUEUE)
       Queue<struct kevent> _scratchChanges; 
       Queue<struct kevent> _scratchEvents; 
 # else
       Queue<struct epoll_event> _scratchEvents; 
+#  if defined(MUSCLE_USE_IOURING)
+      IOURing * _ring;                     // NULL if io_uring wasn't available, in which case we use _kernelFD (an epoll fd) instead
+      uint32 _nextPollTag;                 // used to tell completions of the current poll request for an fd from those of cancelled ones
+      Hashtable<int, uint64> _pollTags;    // fd -> user_data of the poll request currently armed in the ring for that fd
+#  endif
 # endif
 #elif defined(MUSCLE_USE_POLL)
       short GetPollBitsForFDSet(uint32 whichSet, bool isRegister) const
@@ -240,6 +321,8 @@ private:
    };
 
 #if defined(MUSCLE_USE_KQUEUE) || defined(MUSCLE_USE_EPOLL)
+   status_t SetPersistentRegistration(int fd, uint32 whichSet, bool isRegistered) {return _fdState.SetPersistentRegistration(fd, whichSet, isRegistered);}
+
    friend void NotifySocketMultiplexersThatSocketIsClosed(int);
    void NotifySocketClosed(int fd)                    {GetCurrentFDState().NotifySocketClosed(fd);}
    inline FDState & GetCurrentFDState()               {return _fdState;}
@@ -256,8 +339,11 @@ private:
    inline FDState & GetAlternateFDState()             {return _fdStates[_curFDState?0:1];}
    inline const FDState & GetAlternateFDState() const {return _fdStates[_curFDState?0:1];}
 
+   status_t SetPersistentRegistration(int fd, uint32 whichSet, bool isRegistered);
+
    FDState _fdStates[2];
    int _curFDState;
+   Hashtable<int, uint8> _persistentRegistrations;  // fd -> FDSTATE_SET_* bits; re-registered before each WaitForEvents() call
 #endif
 };
 
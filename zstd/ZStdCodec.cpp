@@ -0,0 +1,155 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+
+#define ZSTD_STATIC_LINKING_ONLY  // for ZSTD_getCParams() and the ZSTD_create*_advanced() functions
+#include "zstd/ZStdCodec.h"
+#include "zstd/zstd/zstd.h"
+#include "system/GlobalMemoryAllocator.h"
+
+namespace muscle {
+
+#ifdef MUSCLE_ENABLE_MEMORY_TRACKING
+static void * muscleZStdAlloc(void *, size_t size) {using namespace muscle; return muscleAlloc(size);}
+static void muscleZStdFree(void *, void * address) {using namespace muscle; muscleFree(address);}
+static const ZSTD_customMem _muscleZStdMem = {muscleZStdAlloc, muscleZStdFree, NULL};
+#else
+static const ZSTD_customMem _muscleZStdMem = {NULL, NULL, NULL};
+#endif
+
+static const int ZSTD_CODEC_MIN_LEVEL = -9;
+static const int ZSTD_CODEC_MAX_LEVEL = 19;
+
+ZStdCodec :: ZStdCodec(int compressionLevel) : _compressionLevel(muscleClamp(compressionLevel, ZSTD_CODEC_MIN_LEVEL, ZSTD_CODEC_MAX_LEVEL)), _compressor(NULL), _decompressor(NULL)
+{
+   if (_compressionLevel == 0) _compressionLevel = 1;  // since Zstandard interprets level 0 as "the default level"
+}
+
+ZStdCodec :: ~ZStdCodec()
+{
+   TCHECKPOINT;
+
+   if (_compressor)   (void) ZSTD_freeCCtx(_compressor);
+   if (_decompressor) (void) ZSTD_freeDCtx(_decompressor);
+}
+
+// Sets up our compressor for our compression level, but with its history window limited to
+// MUSCLE_ZSTD_WINDOW_LOG, and its match-finding tables no larger than that window calls for
+status_t ZStdCodec :: SetCompressionParameters()
+{
+   ZSTD_compressionParameters cp = ZSTD_getCParams(_compressionLevel, 0, 0);
+   const unsigned int windowLog = muscleMin((unsigned int) MUSCLE_ZSTD_WINDOW_LOG, cp.windowLog);
+   return ((ZSTD_isError(ZSTD_CCtx_setParameter(_compressor, ZSTD_c_compressionLevel, _compressionLevel)) == 0)&&
+           (ZSTD_isError(ZSTD_CCtx_setParameter(_compressor, ZSTD_c_windowLog, windowLog))                == 0)&&
+           (ZSTD_isError(ZSTD_CCtx_setParameter(_compressor, ZSTD_c_hashLog,   muscleMin(cp.hashLog,  windowLog+1))) == 0)&&
+           (ZSTD_isError(ZSTD_CCtx_setParameter(_compressor, ZSTD_c_chainLog,  muscleMin(cp.chainLog, windowLog+1))) == 0)) ? B_NO_ERROR : B_ERROR;
+}
+
+static const uint32 ZSTD_CODEC_HEADER_DEPENDENT   = 2054386788;               // 'zstd'
+static const uint32 ZSTD_CODEC_HEADER_INDEPENDENT = 2054386787;               // 'zstc'
+static const uint32 ZSTD_CODEC_HEADER_SIZE  = sizeof(uint32)+sizeof(uint32);  // 4 bytes of magic, 4 bytes of raw-size
+
+ByteBufferRef ZStdCodec :: Compress(const uint8 * rawBytes, uint32 numRaw, bool independent, uint32 addHeaderBytes, uint32 addFooterBytes)
+{
+   TCHECKPOINT;
+
+   if (rawBytes == NULL) return ByteBufferRef();
+
+   if (_compressor == NULL)
+   {
+      _compressor = ZSTD_createCCtx_advanced(_muscleZStdMem);
+      if (_compressor == NULL) {WARN_OUT_OF_MEMORY; return ByteBufferRef();}
+      if (SetCompressionParameters() != B_NO_ERROR) {(void) ZSTD_freeCCtx(_compressor); _compressor = NULL; return ByteBufferRef();}
+   }
+   else if ((independent)&&(ZSTD_isError(ZSTD_CCtx_reset(_compressor, ZSTD_reset_session_only)))) return ByteBufferRef();
+
+   const uint32 prefixBytes = addHeaderBytes+ZSTD_CODEC_HEADER_SIZE;
+   uint32 compAvailSize = ZSTD_compressBound(numRaw)+32;  // a little extra, for the frame header that starts each new session
+   ByteBufferRef ret = GetByteBufferFromPool(prefixBytes+compAvailSize+addFooterBytes);
+   if (ret() == NULL) return ByteBufferRef();
+
+   // ZSTD_e_flush makes all of this data decodable right away, while keeping it in the window for subsequent buffers to refer to
+   ZSTD_inBuffer in = {rawBytes, numRaw, 0};
+   ZSTD_outBuffer out = {ret()->GetBuffer()+prefixBytes, compAvailSize, 0};
+   while(true)
+   {
+      const size_t r = ZSTD_compressStream2(_compressor, &out, &in, ZSTD_e_flush);
+      if (ZSTD_isError(r))
+      {
+         (void) ZSTD_CCtx_reset(_compressor, ZSTD_reset_session_only);  // our peer won't be able to follow this stream anymore anyway
+         return ByteBufferRef();
+      }
+      if (r == 0) break;  // all flushed
+
+      // Oops, we need more room (this shouldn't happen, but just in case)
+      compAvailSize *= 2;
+      if (ret()->SetNumBytes(prefixBytes+compAvailSize+addFooterBytes, true) != B_NO_ERROR) return ByteBufferRef();
+      out.dst  = ret()->GetBuffer()+prefixBytes;
+      out.size = compAvailSize;
+   }
+
+   if (ret()->SetNumBytes(prefixBytes+out.pos+addFooterBytes, true) != B_NO_ERROR) return ByteBufferRef();
+   (void) ret()->FreeExtraBytes();  // no sense keeping all that extra space around, is there?
+
+   uint8 * compBytes = ret()->GetBuffer()+addHeaderBytes;  // important -- it might have changed!
+
+   const uint32 magic = B_HOST_TO_LENDIAN_INT32(independent ? ZSTD_CODEC_HEADER_INDEPENDENT : ZSTD_CODEC_HEADER_DEPENDENT);
+   muscleCopyOut(compBytes, magic);
+
+   const uint32 rawLen = B_HOST_TO_LENDIAN_INT32(numRaw);
+   muscleCopyOut(&compBytes[sizeof(magic)], rawLen);
+   return ret;
+}
+
+int32 ZStdCodec :: GetDecompressedSize(const uint8 * compBytes, uint32 numComp, bool * optRetIsIndependent) const
+{
+   TCHECKPOINT;
+
+   if ((compBytes)&&(numComp >= ZSTD_CODEC_HEADER_SIZE))
+   {
+      uint32 magic; muscleCopyIn(magic, compBytes); magic = B_LENDIAN_TO_HOST_INT32(magic);
+      if ((magic == ZSTD_CODEC_HEADER_INDEPENDENT)||(magic == ZSTD_CODEC_HEADER_DEPENDENT))
+      {
+         if (optRetIsIndependent) *optRetIsIndependent = (magic == ZSTD_CODEC_HEADER_INDEPENDENT);
+         uint32 rawLen; muscleCopyIn(rawLen, compBytes+sizeof(magic));
+         return B_LENDIAN_TO_HOST_INT32(rawLen);
+      }
+   }
+   return -1;
+}
+
+ByteBufferRef ZStdCodec :: Decompress(const uint8 * compBytes, uint32 numComp)
+{
+   TCHECKPOINT;
+
+   bool independent;
+   const int32 rawLen = GetDecompressedSize(compBytes, numComp, &independent);
+   if (rawLen < 0) return ByteBufferRef();
+
+   if (_decompressor == NULL)
+   {
+      _decompressor = ZSTD_createDCtx_advanced(_muscleZStdMem);
+      if (_decompressor == NULL) {WARN_OUT_OF_MEMORY; return ByteBufferRef();}
+
+      // Otherwise a peer could make us allocate a window of up to 128MB (Zstandard's default limit) just by asking for it
+      if (ZSTD_isError(ZSTD_DCtx_setParameter(_decompressor, ZSTD_d_windowLogMax, MUSCLE_ZSTD_WINDOW_LOG))) {(void) ZSTD_freeDCtx(_decompressor); _decompressor = NULL; return ByteBufferRef();}
+   }
+   else if ((independent)&&(ZSTD_isError(ZSTD_DCtx_reset(_decompressor, ZSTD_reset_session_only)))) return ByteBufferRef();
+
+   ByteBufferRef ret = GetByteBufferFromPool(rawLen);
+   if (ret() == NULL) return ByteBufferRef();
+
+   ZSTD_inBuffer in = {compBytes+ZSTD_CODEC_HEADER_SIZE, numComp-ZSTD_CODEC_HEADER_SIZE, 0};
+   ZSTD_outBuffer out = {ret()->GetBuffer(), (size_t) rawLen, 0};
+   while(in.pos < in.size)
+   {
+      const size_t oldInPos = in.pos, oldOutPos = out.pos;
+      if (ZSTD_isError(ZSTD_decompressStream(_decompressor, &out, &in))) return ByteBufferRef();
+      if ((in.pos == oldInPos)&&(out.pos == oldOutPos)) break;  // no progress; the data must be bad
+   }
+   return ((in.pos == in.size)&&(out.pos == (size_t) rawLen)) ? ret : ByteBufferRef();
+}
+
+}; // end namespace muscle
+
+#endif
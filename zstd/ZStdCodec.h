@@ -0,0 +1,106 @@
+/* This file is Copyright 2000-2013 Meyer Sound Laboratories Inc.  See the included LICENSE.txt file for details. */
+
+#ifndef ZStdCodec_h
+#define ZStdCodec_h
+
+#ifdef MUSCLE_ENABLE_ZSTD_ENCODING
+
+# include "util/ByteBuffer.h"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace muscle {
+
+/** The base-2 logarithm of the size of the history window that a ZStdCodec's compressor may refer back into.
+  * Larger windows can find more matches (e.g. against Messages sent further back in the stream) but cost more
+  * memory per codec, on both the sending and the receiving side.  Defaults to 20 (i.e. 1 megabyte).
+  * Compressed data that would need a larger window to decompress is rejected, so both peers should use the same value.
+  */
+#ifndef MUSCLE_ZSTD_WINDOW_LOG
+# define MUSCLE_ZSTD_WINDOW_LOG 20
+#endif
+
+/** This class is a handy wrapper around the Zstandard C functions.
+  * It works like ZLibCodec:  each buffer it compresses is decompressible as soon as it is received,
+  * but (unless it was compressed independently) may refer back to the data in any previously compressed
+  * buffers, so that (e.g.) field names that are repeated in consecutive Messages compress to almost nothing.
+  */
+class ZStdCodec
+{
+public:
+   /** Constructor.
+     * @param compressionLevel how much to compress outgoing data.  Positive values from 1 (fastest) to 19 (smallest)
+     *                         select Zstandard's regular compression levels.  Negative values from -1 to -9 select its
+     *                         "fast" levels (as in "zstd --fast=N"), which trade compression ratio for LZ4-like speed;
+     *                         -9 is the fastest.  Out-of-range values will be clamped.  Default is 3.
+     */
+   ZStdCodec(int compressionLevel = 3);
+
+   /** Destructor */
+   ~ZStdCodec();
+
+   /** Given a buffer of raw data, returns a reference to a Buffer containing
+     * the matching compressed data.
+     * @param rawData The raw data to compress
+     * @param numBytes The number of bytes (rawData) points to
+     * @param independent If true, the generated buffer will be decompressible on its
+     *                    own, not depending on any previously decompressed data.
+     *                    If false, the generated buffer will only be decompressible
+     *                    if the previously Compress()'d buffers have been decompressed
+     *                    before it.  Setting this value to true will reduce the
+     *                    compression efficiency, but allows for more flexibility.
+     * @param addHeaderBytes If set to non-zero, the returned ByteBuffer will contain
+     *                    this many additional bytes at the beginning of the byte array,
+     *                    before the first compressed-data byte.  The values in these bytes
+     *                    are undefined; the caller can write header data to them if desired.
+     * @param addFooterBytes If set to non-zero, the returned ByteBuffer will contain
+     *                    this many additional bytes at the end of the byte array,
+     *                    after the last compressed-data byte.  The values in these bytes
+     *                    are undefined; the caller can write footer data to them if desired.
+     * @returns Reference to a buffer of compressed data on success, or a NULL reference on failure.
+     */
+   ByteBufferRef Compress(const uint8 * rawData, uint32 numBytes, bool independent, uint32 addHeaderBytes=0, uint32 addFooterBytes=0);
+
+   /** Given a buffer of compressed data, returns a reference to a Buffer containing
+     * the matching raw data, or NULL on failure.
+     * @param compressedData The compressed data to expand.  This should be data that was previously produced by the Compress() method.
+     * @param numBytes The number of bytes (compressedData) points to
+     * @returns Reference to a buffer of decompressed data on success, or a NULL reference on failure.
+     */
+   ByteBufferRef Decompress(const uint8 * compressedData, uint32 numBytes);
+
+   /** Given a ByteBuffer that was previously produced by Compress(), returns the number of bytes
+     * of raw data that the buffer represents, or -1 if the buffer isn't recognized as valid.
+     * @param compressedData Pointer to data that was previously created by ZStdCodec::Compress().
+     * @param numBytes The number of bytes (compressedData) points to
+     * @param optRetIsIndependent If non-NULL, the bool that this argument points to will have
+     *                            the independent/non-independent state of this buffer written into it.
+     *                            See Compress()'s documentation for details.
+     */
+   int32 GetDecompressedSize(const uint8 * compressedData, uint32 numBytes, bool * optRetIsIndependent = NULL) const;
+
+   /** Returns this codec's compression level, as was specified in the constructor (after clamping).
+     * Note that this value only affects what we compress to -- we can decompress data of any compression level.
+     */
+   int GetCompressionLevel() const {return _compressionLevel;}
+
+   // Convenience methods -- they work the same as their counterparts above, but take a ByteBuffer argument rather than a pointer and byte count.
+   ByteBufferRef Compress(const ByteBuffer & rawData, bool independent, uint32 addHeaderBytes=0, uint32 addFooterBytes=0) {return Compress(rawData.GetBuffer(), rawData.GetNumBytes(), independent, addHeaderBytes, addFooterBytes);}
+   ByteBufferRef Decompress(const ByteBuffer & compressedData) {return Decompress(compressedData.GetBuffer(), compressedData.GetNumBytes());}
+   int32 GetDecompressedSize(const ByteBuffer & compressedData, bool * optRetIsIndependent = NULL) const {return GetDecompressedSize(compressedData.GetBuffer(), compressedData.GetNumBytes(), optRetIsIndependent);}
+
+private:
+   status_t SetCompressionParameters();
+
+   int _compressionLevel;
+
+   ZSTD_CCtx_s * _compressor;
+   ZSTD_DCtx_s * _decompressor;
+};
+
+}; // end namespace muscle
+
+#endif
+
+#endif